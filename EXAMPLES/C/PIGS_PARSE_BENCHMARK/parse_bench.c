@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "command.h"
+
+/*
+
+REQUIRES
+
+Nothing, no Pi or pigpio daemon is needed.
+
+TO BUILD
+
+gcc -O3 -I../../.. -o parse_bench parse_bench.c ../../../command.c
+
+TO RUN
+
+./parse_bench [lines [passes]]
+
+Builds a pigs script of lines lines (default 20000) from a mix of
+typical commands and times cmdParseScript and a cmdParse loop
+over it, reporting commands parsed per second.
+
+*/
+
+static char *lines[]=
+{
+   "w 4 1",
+   "mics 10",
+   "w 4 0",
+   "ld v1 0x20",
+   "add p3",
+   "sta v2",
+   "r 17",
+   "cmp 0",
+   "modes 18 w",
+   "pud 23 u",
+   "pwm 12 128",
+   "servo 13 1500",
+   "trig 5 10 1",
+   "i2cwb 0 0x10 255",
+   "wdog 22 -0",
+   "bs1 0x00FF00FF",
+   "bc1 0x00FF00FF",
+   "mils 0100",
+   "lda v3",
+   "inr v3",
+};
+
+#define NUM_LINES (sizeof(lines)/sizeof(lines[0]))
+
+static double now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec + ((double)ts.tv_nsec / 1E9);
+}
+
+int main(int argc, char *argv[])
+{
+   int numLines, passes, i, len, pos, cmds, idx;
+   char *script;
+   cmdScript_t s;
+   cmdCtlParse_t ctl;
+   uintptr_t p[CMD_P_ARR];
+   static char v[CMD_MAX_EXTENSION];
+   double t0, t1;
+
+   numLines = 20000;
+   passes = 10;
+
+   if (argc > 1) numLines = atoi(argv[1]);
+   if (argc > 2) passes = atoi(argv[2]);
+
+   if ((numLines < 1) || (passes < 1)) return 1;
+
+   len = 0;
+   for (i=0; i<numLines; i++) len += strlen(lines[i % NUM_LINES]) + 1;
+
+   script = malloc(len + 1);
+
+   if (script == NULL) return 1;
+
+   pos = 0;
+   for (i=0; i<numLines; i++)
+      pos += sprintf(script + pos, "%s ", lines[i % NUM_LINES]);
+
+   /* cmdParse over the whole text, as the fifo and pigs do */
+
+   cmds = 0;
+   t0 = now();
+
+   for (i=0; i<passes; i++)
+   {
+      ctl.eaten = 0;
+
+      while (ctl.eaten < len)
+      {
+         idx = cmdParse(script, p, CMD_MAX_EXTENSION, v, &ctl);
+
+         if (idx < 0)
+         {
+            fprintf(stderr, "parse error %d at %d\n", idx, ctl.eaten);
+            return 1;
+         }
+
+         cmds++;
+      }
+   }
+
+   t1 = now();
+
+   printf("cmdParse:       %d commands in %.3f s, %.0f commands/s\n",
+      cmds, t1 - t0, cmds / (t1 - t0));
+
+   /* cmdParseScript, as gpioStoreScript does */
+
+   t0 = now();
+
+   for (i=0; i<passes; i++)
+   {
+      if (cmdParseScript(script, &s, 1))
+      {
+         fprintf(stderr, "script parse failed\n");
+         return 1;
+      }
+
+      free(s.par);
+   }
+
+   t1 = now();
+
+   printf("cmdParseScript: %d commands in %.3f s, %.0f commands/s\n",
+      numLines * passes, t1 - t0, (numLines * passes) / (t1 - t0));
+
+   free(script);
+
+   return 0;
+}
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pigpio.h>
+
+/*
+
+REQUIRES
+
+A Pi.  The chosen gpio (default 4) is driven as an output, so make
+sure nothing is connected to it.
+
+TO BUILD
+
+gcc -Wall -pthread -o script_bench script_bench.c -lpigpio
+
+TO RUN
+
+sudo ./script_bench [gpio [loops]]
+
+Runs each script in the suite for loops iterations (default 200000)
+twice, once as stored with PI_CFG_NOSCRIPTOPT set (no
+superinstructions) and once as normally stored, and reports the
+script instructions executed per second for each.
+
+*/
+
+typedef struct
+{
+   char *name;
+   int   steps; /* instructions per loop */
+   char *text;
+} bench_t;
+
+/*
+   p0 loops, p1 gpio, p9 set to 1 when finished
+*/
+
+static bench_t bench[]=
+{
+   {"pulse", 5,
+      "ld v0 p0 tag 1 w p1 1 mics 0 w p1 0 dcr v0 jnz 1 ld p9 1"},
+
+   {"poll", 4,
+      "ld v0 p0 tag 1 r p1 jz 2 tag 2 dcr v0 jnz 1 ld p9 1"},
+
+   {"arith", 8,
+      "ld v0 p0 tag 1 lda v1 add 1 sta v1 lda v2 xor 5 sta v2 "
+      "dcr v0 jnz 1 ld p9 1"},
+
+   {"compare", 5,
+      "ld v0 p0 tag 1 lda v0 cmp 1000 jm 2 tag 2 dcr v0 jnz 1 ld p9 1"},
+
+   {"mixed", 11,
+      "ld v0 p0 tag 1 w p1 1 mics 0 w p1 0 r p1 jnz 2 tag 2 "
+      "lda v1 add 1 sta v1 lda v1 dcr v0 jnz 1 ld p9 1"},
+};
+
+#define NUM_BENCH (sizeof(bench)/sizeof(bench[0]))
+
+static double now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec + ((double)ts.tv_nsec / 1E9);
+}
+
+static double runBench(bench_t *b, unsigned gpio, unsigned loops, int opt)
+{
+   uint32_t cfg, param[PI_MAX_SCRIPT_PARAMS];
+   int id;
+   double t0, t1;
+
+   cfg = gpioCfgGetInternals();
+
+   if (opt) gpioCfgSetInternals(cfg & ~PI_CFG_NOSCRIPTOPT);
+   else     gpioCfgSetInternals(cfg | PI_CFG_NOSCRIPTOPT);
+
+   id = gpioStoreScript(b->text);
+
+   gpioCfgSetInternals(cfg);
+
+   if (id < 0)
+   {
+      fprintf(stderr, "%s: store failed (%d)\n", b->name, id);
+      return 0.0;
+   }
+
+   while (gpioScriptStatus(id, NULL) == PI_SCRIPT_INITING) gpioDelay(1000);
+
+   memset(param, 0, sizeof(param));
+   param[0] = loops;
+   param[1] = gpio;
+
+   t0 = now();
+
+   gpioRunScript(id, PI_MAX_SCRIPT_PARAMS, param);
+
+   do
+   {
+      gpioDelay(1000);
+      gpioScriptStatus(id, param);
+   }
+   while (param[9] == 0);
+
+   t1 = now();
+
+   gpioDeleteScript(id);
+
+   return ((double)loops * b->steps) / (t1 - t0);
+}
+
+int main(int argc, char *argv[])
+{
+   unsigned gpio, loops, i;
+   double before, after;
+
+   gpio = 4;
+   loops = 200000;
+
+   if (argc > 1) gpio = atoi(argv[1]);
+   if (argc > 2) loops = atoi(argv[2]);
+
+   if (gpioInitialise() < 0) return 1;
+
+   gpioSetMode(gpio, PI_OUTPUT);
+
+   printf("%-8s %14s %14s %8s\n",
+      "script", "before (i/s)", "after (i/s)", "speedup");
+
+   for (i=0; i<NUM_BENCH; i++)
+   {
+      before = runBench(&bench[i], gpio, loops, 0);
+      after  = runBench(&bench[i], gpio, loops, 1);
+
+      printf("%-8s %14.0f %14.0f %7.2fx\n",
+         bench[i].name, before, after, before > 0.0 ? after / before : 0.0);
+   }
+
+   gpioTerminate();
+
+   return 0;
+}
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pigpio.h>
+
+/*
+
+REQUIRES
+
+Nothing.  This runs on any Linux machine pigpio builds on, no Pi or
+root access is needed.
+
+TO BUILD
+
+gcc -Wall -pthread -o spi_sim spi_sim.c -lpigpio
+
+TO RUN
+
+./spi_sim
+
+Sends transfers either side of the DMA threshold, of every length
+modulo 4, and either side of the 65532 byte DMA piece, plus a run of
+12 KB LED matrix frames.  Checks each is looped back intact and
+that the simulated DMA accepted every control block and moved
+exactly the bytes at or above the threshold.  Exits 0 if all the
+checks pass.
+
+*/
+
+#define TX_DMA   5
+#define RX_DMA   4
+#define MIN_DMA  4096
+#define FRAME    12288
+#define FRAMES   60
+
+static char tx[65536], rx[65536];
+
+static int fails = 0;
+
+static void check(char *what, unsigned got, unsigned want)
+{
+   if (got != want)
+   {
+      printf("FAIL %s: %u not %u\n", what, got, want);
+      fails++;
+   }
+   else printf("ok   %s: %u\n", what, got);
+}
+
+int main(int argc, char *argv[])
+{
+   unsigned sizes[] =
+      {1, 10, MIN_DMA-1, MIN_DMA, MIN_DMA+1, MIN_DMA+2, MIN_DMA+3,
+       FRAME, 65531, 65532, 65533, 65536};
+   unsigned i, wantDMA, wantCPU;
+   uint32_t dmaBytes, cpuBytes;
+   int h, n, bad;
+
+   for (i=0; i<sizeof(tx); i++) tx[i] = rand();
+
+   if (gpioCfgSPIDMA(TX_DMA, RX_DMA, MIN_DMA) < 0) return 1;
+
+   if (gpioSPISimOpen() < 0) return 1;
+
+   h = spiOpen(0, 8000000, 0);
+
+   if (h < 0) {printf("open failed (%d)\n", h); return 1;}
+
+   wantDMA = 0;
+   wantCPU = 0;
+
+   for (i=0; i<(sizeof(sizes)/sizeof(sizes[0])); i++)
+   {
+      memset(rx, 0, sizeof(rx));
+
+      n = spiXfer(h, tx, rx, sizes[i]);
+
+      check("bytes", n, sizes[i]);
+      check("looped back", memcmp(tx, rx, sizes[i]) == 0, 1);
+
+      if (sizes[i] >= MIN_DMA) wantDMA += sizes[i];
+      else                     wantCPU += sizes[i];
+   }
+
+   /* one second of frames at 60 Hz */
+
+   bad = 0;
+
+   for (i=0; i<FRAMES; i++)
+   {
+      tx[0] = i;
+      memset(rx, 0, FRAME);
+      spiXfer(h, tx, rx, FRAME);
+      if (memcmp(tx, rx, FRAME)) bad++;
+      wantDMA += FRAME;
+   }
+
+   check("bad frames", bad, 0);
+
+   check("rejected DMA", gpioSPISimStats(&dmaBytes, &cpuBytes), 0);
+   check("DMA bytes", dmaBytes, wantDMA);
+   check("CPU bytes", cpuBytes, wantCPU);
+
+   spiClose(h);
+
+   gpioSPISimClose();
+
+   return fails ? 1 : 0;
+}
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pigpio.h>
+
+/*
+
+REQUIRES
+
+A Pi.  No waves are transmitted so nothing need be connected.
+
+TO BUILD
+
+gcc -Wall -pthread -o wave_merge_bench wave_merge_bench.c -lpigpio
+
+TO RUN
+
+sudo ./wave_merge_bench [lanes [repeats]]
+
+Builds a wave of lanes (default 8) serial channels of random data
+with close to PI_WAVE_MAX_PULSES pulses in all, first by adding each
+channel with gpioWaveAddGeneric and then by adding all the channels
+at once with gpioWaveAddTrains.  Each build is repeated repeats
+(default 20) times and the average build time is reported.
+
+*/
+
+#define MAX_LANES 16
+#define BIT_MICROS 104 /* 9600 baud */
+
+static gpioPulse_t lane[MAX_LANES][PI_WAVE_MAX_PULSES];
+static gpioPulseTrain_t train[MAX_LANES];
+
+static double now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec + ((double)ts.tv_nsec / 1E9);
+}
+
+static void makeLanes(unsigned lanes)
+{
+   /*
+      Each lane is 8N1 serial on GPIO 4+lane, one pulse per bit, the
+      lanes offset a little from each other so few pulses coincide.
+   */
+
+   unsigned l, p, b, bits, per;
+   uint32_t mask;
+   int byte;
+
+   per = (PI_WAVE_MAX_PULSES - 2) / lanes; /* room for a leading delay */
+
+   for (l=0; l<lanes; l++)
+   {
+      mask = 1<<(4+l);
+      bits = 0;
+      byte = 0;
+
+      for (p=0; p<per; p++)
+      {
+         b = bits % 10;
+
+         if (b == 0) byte = rand() & 0xFF;
+
+         if      (b == 0) {lane[l][p].gpioOn = 0; lane[l][p].gpioOff = mask;}
+         else if (b == 9) {lane[l][p].gpioOn = mask; lane[l][p].gpioOff = 0;}
+         else if (byte & (1<<(b-1)))
+                          {lane[l][p].gpioOn = mask; lane[l][p].gpioOff = 0;}
+         else             {lane[l][p].gpioOn = 0; lane[l][p].gpioOff = mask;}
+
+         lane[l][p].usDelay = BIT_MICROS;
+
+         bits++;
+      }
+
+      train[l].offset = 1 + (l * BIT_MICROS) / lanes;
+      train[l].numPulses = per;
+      train[l].pulses = lane[l];
+   }
+}
+
+static int addGeneric(unsigned lanes)
+{
+   static gpioPulse_t buf[PI_WAVE_MAX_PULSES+1];
+   unsigned l;
+   int pulses = 0;
+
+   gpioWaveAddNew();
+
+   for (l=0; l<lanes; l++)
+   {
+      /* the offset becomes a leading delay */
+
+      buf[0].gpioOn = 0;
+      buf[0].gpioOff = 0;
+      buf[0].usDelay = train[l].offset;
+
+      memcpy(buf+1, train[l].pulses, train[l].numPulses*sizeof(gpioPulse_t));
+
+      pulses = gpioWaveAddGeneric(train[l].numPulses+1, buf);
+
+      if (pulses < 0) break;
+   }
+
+   return pulses;
+}
+
+static int addTrains(unsigned lanes)
+{
+   gpioWaveAddNew();
+
+   return gpioWaveAddTrains(lanes, train);
+}
+
+int main(int argc, char *argv[])
+{
+   unsigned lanes, repeats, i;
+   int generic=0, trains=0;
+   double t0, t1, t2;
+
+   lanes = 8;
+   repeats = 20;
+
+   if (argc > 1) lanes = atoi(argv[1]);
+   if (argc > 2) repeats = atoi(argv[2]);
+
+   if ((lanes < 1) || (lanes > MAX_LANES) || (repeats < 1))
+   {
+      fprintf(stderr, "lanes 1-%d, repeats >0\n", MAX_LANES);
+      return 1;
+   }
+
+   if (gpioInitialise() < 0) return 1;
+
+   makeLanes(lanes);
+
+   t0 = now();
+   for (i=0; i<repeats; i++) generic = addGeneric(lanes);
+   t1 = now();
+   for (i=0; i<repeats; i++) trains = addTrains(lanes);
+   t2 = now();
+
+   gpioWaveClear();
+
+   printf("%u lanes, %d and %d pulses\n", lanes, generic, trains);
+
+   printf("gpioWaveAddGeneric x %u: %8.3f ms\n",
+      lanes, 1000.0 * (t1 - t0) / repeats);
+
+   printf("gpioWaveAddTrains:      %8.3f ms\n",
+      1000.0 * (t2 - t1) / repeats);
+
+   gpioTerminate();
+
+   return 0;
+}
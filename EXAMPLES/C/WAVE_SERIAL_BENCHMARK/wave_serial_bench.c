@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <pigpio.h>
+
+/*
+
+REQUIRES
+
+A Pi.  No waves are transmitted so nothing need be connected.
+
+TO BUILD
+
+gcc -Wall -pthread -o wave_serial_bench wave_serial_bench.c -lpigpio
+
+TO RUN
+
+sudo ./wave_serial_bench [lanes [chars [repeats]]]
+
+Builds a wave of lanes (default 8) 19200 baud 8N1 serial channels
+each of chars (default 256) random characters, first by adding each
+channel with gpioWaveAddSerial and then by adding all the channels
+at once with gpioWaveAddSerials.  Each build is repeated repeats
+(default 20) times and the average build time is reported.
+
+*/
+
+#define MAX_LANES 16
+#define MAX_CHARS 1024
+#define BAUD 19200
+
+static char data[MAX_LANES][MAX_CHARS];
+static gpioSerialLane_t lane[MAX_LANES];
+
+static double now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec + ((double)ts.tv_nsec / 1E9);
+}
+
+static void makeLanes(unsigned lanes, unsigned chars)
+{
+   unsigned l, c;
+
+   for (l=0; l<lanes; l++)
+   {
+      for (c=0; c<chars; c++) data[l][c] = rand();
+
+      lane[l].gpio = 4 + l;
+      lane[l].baud = BAUD;
+      lane[l].data_bits = 8;
+      lane[l].stop_bits = 2;
+      lane[l].offset = ((lanes + l) * 1000000 / BAUD) / lanes;
+      lane[l].numBytes = chars;
+      lane[l].str = data[l];
+   }
+}
+
+static int addSerial(unsigned lanes)
+{
+   unsigned l;
+   int pulses = 0;
+
+   gpioWaveAddNew();
+
+   for (l=0; l<lanes; l++)
+   {
+      pulses = gpioWaveAddSerial(lane[l].gpio, lane[l].baud,
+         lane[l].data_bits, lane[l].stop_bits, lane[l].offset,
+         lane[l].numBytes, lane[l].str);
+
+      if (pulses < 0) break;
+   }
+
+   return pulses;
+}
+
+static int addSerials(unsigned lanes)
+{
+   gpioWaveAddNew();
+
+   return gpioWaveAddSerials(lanes, lane);
+}
+
+int main(int argc, char *argv[])
+{
+   unsigned lanes, chars, repeats, i;
+   int serial=0, serials=0;
+   double t0, t1, t2;
+
+   lanes = 8;
+   chars = 256;
+   repeats = 20;
+
+   if (argc > 1) lanes = atoi(argv[1]);
+   if (argc > 2) chars = atoi(argv[2]);
+   if (argc > 3) repeats = atoi(argv[3]);
+
+   if ((lanes < 1) || (lanes > MAX_LANES) ||
+       (chars < 1) || (chars > MAX_CHARS) || (repeats < 1))
+   {
+      fprintf(stderr, "lanes 1-%d, chars 1-%d, repeats >0\n",
+         MAX_LANES, MAX_CHARS);
+      return 1;
+   }
+
+   if (gpioInitialise() < 0) return 1;
+
+   makeLanes(lanes, chars);
+
+   t0 = now();
+   for (i=0; i<repeats; i++) serial = addSerial(lanes);
+   t1 = now();
+   for (i=0; i<repeats; i++) serials = addSerials(lanes);
+   t2 = now();
+
+   gpioWaveClear();
+
+   printf("%u lanes of %u chars, %d and %d pulses\n",
+      lanes, chars, serial, serials);
+
+   printf("gpioWaveAddSerial x %u: %8.3f ms\n",
+      lanes, 1000.0 * (t1 - t0) / repeats);
+
+   printf("gpioWaveAddSerials:     %8.3f ms\n",
+      1000.0 * (t2 - t1) / repeats);
+
+   gpioTerminate();
+
+   return 0;
+}
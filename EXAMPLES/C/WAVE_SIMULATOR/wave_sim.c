@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <pigpio.h>
+
+/*
+
+REQUIRES
+
+Nothing.  This runs on any Linux machine pigpio builds on, no Pi or
+root access is needed.
+
+TO BUILD
+
+gcc -Wall -pthread -o wave_sim wave_sim.c -lpigpio
+
+TO RUN
+
+./wave_sim [vcd-file]
+
+Builds a 9600 baud serial wave on GPIO 4 and a chain which sends it
+three times with 1 ms gaps, simulates the DMA and checks the bit
+timing and the length of the chain.  The chain timeline is written to vcd-file (if given) for
+viewing in GTKWave.  Exits 0 if all the checks pass.
+
+*/
+
+#define GPIO 4
+#define BAUD 9600
+#define MAX_PULSES 1000
+
+static gpioPulse_t pulse[MAX_PULSES];
+
+static int fails = 0;
+
+static void check(char *what, unsigned got, unsigned lo, unsigned hi)
+{
+   if ((got < lo) || (got > hi))
+   {
+      printf("FAIL %s: %u not %u-%u\n", what, got, lo, hi);
+      fails++;
+   }
+   else printf("ok   %s: %u\n", what, got);
+}
+
+int main(int argc, char *argv[])
+{
+   int wid, n, i, fd, edges;
+   unsigned t, micros;
+   char chain[] =
+   {
+      255, 0,          /* loop start */
+         0,            /* the serial wave */
+         255, 2, 0xE8, 0x03, /* 1000 us delay */
+      255, 1, 3, 0     /* loop 3 times */
+   };
+
+   fd = -1;
+
+   if (argc > 1)
+   {
+      fd = open(argv[1], O_WRONLY|O_CREAT|O_TRUNC, 0644);
+      if (fd < 0) {perror(argv[1]); return 1;}
+   }
+
+   if (gpioWaveSimOpen() < 0) return 1;
+
+   gpioWaveAddSerial(GPIO, BAUD, 8, 2, 0, 1, "U"); /* 0x55, every bit flips */
+
+   wid = gpioWaveCreate();
+
+   if (wid < 0) {printf("create failed (%d)\n", wid); return 1;}
+
+   /*
+      One shot.  After the 20 us DMA start delay each of the 11 bit
+      changes (idle, start, 8 data, stop) is one bit time.
+   */
+
+   gpioWaveTxSend(wid, PI_WAVE_MODE_ONE_SHOT);
+
+   n = gpioWaveSimRun(1000000, pulse, MAX_PULSES, -1);
+
+   check("one shot pulses", n, 12, 12);
+   check("start delay", pulse[0].usDelay, 20, 20);
+
+   micros = 0;
+
+   for (i=1; i<n; i++)
+   {
+      check("bit micros", pulse[i].usDelay, 104, 105);
+      micros += pulse[i].usDelay;
+   }
+
+   /* the chain, three frames each followed by the 1000 us gap */
+
+   gpioWaveChain(chain, sizeof(chain));
+
+   n = gpioWaveSimRun(1000000, pulse, MAX_PULSES, fd);
+
+   t = 0;
+   edges = 0;
+
+   for (i=0; i<n; i++)
+   {
+      if (pulse[i].gpioOff & (1<<GPIO)) edges++;
+      t += pulse[i].usDelay;
+   }
+
+   check("falling edges", edges, 15, 15);
+   check("chain micros", t, 20 + 3*(micros+1000), 20 + 3*(micros+1000));
+
+   gpioWaveSimClose();
+
+   if (fd >= 0) close(fd);
+
+   return fails ? 1 : 0;
+}
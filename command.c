@@ -35,6 +35,7 @@ This version is for pigpio version 70+
 #include <stdlib.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "pigpio.h"
 #include "command.h"
@@ -43,6 +44,11 @@ cmdInfo_t cmdInfo[]=
 {
    /* num          str    vfyt retv script*/
 
+   {PI_CMD_ACQM,  "ACQM",  122, 1, 1}, // acqMonitor
+   {PI_CMD_ACQP,  "ACQP",  112, 0, 1}, // acqStop
+   {PI_CMD_ACQR,  "ACQR",  121, 6, 0}, // acqRead
+   {PI_CMD_ACQS,  "ACQS",  135, 2, 0}, // acqStart
+
    {PI_CMD_BC1,   "BC1",   111, 1, 1}, // gpioWrite_Bits_0_31_Clear
    {PI_CMD_BC2,   "BC2",   111, 1, 1}, // gpioWrite_Bits_32_53_Clear
 
@@ -59,6 +65,7 @@ cmdInfo_t cmdInfo[]=
    {PI_CMD_BSCX,  "BSCX",  193, 8, 0}, // bscXfer
 
    {PI_CMD_BSPIC, "BSPIC", 112, 0, 1}, // bbSPIClose
+   {PI_CMD_BSPIL, "BSPIL", 134, 0, 0}, // bbSPIOpenLanes
    {PI_CMD_BSPIO, "BSPIO", 134, 0, 0}, // bbSPIOpen
    {PI_CMD_BSPIX, "BSPIX", 193, 6, 0}, // bbSPIXfer
 
@@ -118,6 +125,9 @@ cmdInfo_t cmdInfo[]=
 
    {PI_CMD_I2CZ,  "I2CZ",  193, 6, 0}, // i2cZip
 
+   {PI_CMD_I2CBQ, "I2CBQ", 195, 2, 0}, // i2cBatchStart
+   {PI_CMD_I2CBR, "I2CBR", 121, 6, 0}, // i2cBatchWait
+
    {PI_CMD_MICS,  "MICS",  112, 0, 1}, // gpioDelay
    {PI_CMD_MILS,  "MILS",  112, 0, 1}, // gpioDelay
 
@@ -151,6 +161,9 @@ cmdInfo_t cmdInfo[]=
    {PI_CMD_PROCS, "PROCS", 112, 0, 0}, // gpioStopScript
    {PI_CMD_PROCU, "PROCU", 191, 0, 0}, // gpioUpdateScript
 
+   {PI_CMD_PROFR, "PROFR", 121, 9, 0}, // gpioScriptProfileRead
+   {PI_CMD_PROFS, "PROFS", 121, 0, 0}, // gpioScriptProfile
+
    {PI_CMD_PRRG,  "PRRG",  112, 2, 1}, // gpioGetPWMrealRange
    {PI_CMD_PRS,   "PRS",   121, 2, 1}, // gpioSetPWMrange
 
@@ -162,6 +175,7 @@ cmdInfo_t cmdInfo[]=
    {PI_CMD_READ,  "R",     112, 2, 1}, // gpioRead
    {PI_CMD_READ,  "READ",  112, 2, 1}, // gpioRead
 
+   {PI_CMD_SERB,  "SERB",  135, 0, 0}, // serReadBuffer
    {PI_CMD_SERC,  "SERC",  112, 0, 1}, // serClose
    {PI_CMD_SERDA, "SERDA", 112, 2, 1}, // serDataAvailable
    {PI_CMD_SERO,  "SERO",  132, 2, 0}, // serOpen
@@ -179,6 +193,7 @@ cmdInfo_t cmdInfo[]=
    {PI_CMD_SLRC,  "SLRC",  112, 0, 1}, // gpioSerialReadClose
    {PI_CMD_SLRO,  "SLRO",  131, 0, 1}, // gpioSerialReadOpen
    {PI_CMD_SLRI,  "SLRI",  121, 0, 1}, // gpioSerialReadInvert
+   {PI_CMD_SLRM,  "SLRM",  122, 1, 1}, // serialMonitor
 
    {PI_CMD_SPIC,  "SPIC",  112, 0, 1}, // spiClose
    {PI_CMD_SPIO,  "SPIO",  131, 2, 1}, // spiOpen
@@ -203,6 +218,7 @@ cmdInfo_t cmdInfo[]=
    {PI_CMD_WVCLR, "WVCLR", 101, 0, 1}, // gpioWaveClear
    {PI_CMD_WVCRE, "WVCRE", 101, 2, 1}, // gpioWaveCreate 
    {PI_CMD_WVCAP, "WVCAP", 112, 2, 1}, // gpioWaveCreatePad
+   {PI_CMD_WVCMP, "WVCMP", 101, 2, 1}, // gpioWaveCompact
    {PI_CMD_WVDEL, "WVDEL", 112, 0, 1}, // gpioWaveDelete
    {PI_CMD_WVGO,  "WVGO" , 101, 2, 0}, // gpioWaveTxStart
    {PI_CMD_WVGOR, "WVGOR", 101, 2, 0}, // gpioWaveTxStart
@@ -264,6 +280,11 @@ cmdInfo_t cmdInfo[]=
 
 
 char * cmdUsage = "\n\
+ACQM h bits      Stream the samples of the selected acquisitions\n\
+ACQP id          Stop periodic sensor reads\n\
+ACQR id num      Read timestamped sensor samples\n\
+ACQS t h r len us | Start periodic sensor reads\n\
+\n\
 BC1 bits         Clear GPIO in bank 1\n\
 BC2 bits         Clear GPIO in bank 2\n\
 BI2CC sda        Close bit bang I2C\n\
@@ -271,6 +292,7 @@ BI2CO sda scl baud | Open bit bang I2C\n\
 BI2CZ sda ...    I2C bit bang multiple transactions\n\
 \n\
 BSPIC cs        Close bit bang SPI\n\
+BSPIL cs misob mosib sclk baud flag | Open parallel bit bang SPI\n\
 BSPIO cs miso mosi sclk baud flag | Open bit bang SPI\n\
 BSPIX cs ...    SPI bit bang transfer\n\
 \n\
@@ -308,6 +330,8 @@ HC g f           Set hardware clock frequency\n\
 HP g f dc        Set hardware PWM frequency and dutycycle\n\
 HWVER            Get hardware version\n\
 \n\
+I2CBQ pri evt ... Queue I2C batch, trigger event evt when done\n\
+I2CBR id ms      Get result of queued I2C batch, waiting up to ms\n\
 I2CC h           Close I2C handle\n\
 I2CO bus device flags | Open I2C bus and device with flags\n\
 I2CPC h r word   SMBus Process Call: exchange register with word\n\
@@ -351,6 +375,8 @@ PROCP sid        Get script status and parameters\n\
 PROCR sid ...    Run script\n\
 PROCS sid        Stop script\n\
 PROCU sid ...    Set script parameters\n\
+PROFR sid start  Get script profile\n\
+PROFS sid on     Turn script profiling on or off\n\
 PRRG g           Get GPIO PWM real range\n\
 PRS g v          Set GPIO PWM range\n\
 PUD g pud        Set GPIO pull up/down\n\
@@ -358,6 +384,7 @@ PUD g pud        Set GPIO pull up/down\n\
 R/READ g         Read GPIO level\n\
 \n\
 S/SERVO g v      Set GPIO servo pulsewidth\n\
+SERB h sz min t e | Buffer serial reads, trigger event e when ready\n\
 SERC h           Close serial handle\n\
 SERDA h          Check for serial data ready to read\n\
 SERO text baud flags | Open serial device at baud with flags\n\
@@ -370,6 +397,7 @@ SLR g v          Read bit bang serial data from GPIO\n\
 SLRC g           Close GPIO for bit bang serial data\n\
 SLRO g baud bitlen | Open GPIO for bit bang serial data\n\
 SLRI g invert    Invert serial logic (1 invert, 0 normal)\n\
+SLRM h bits      Set bit bang serial data to stream\n\
 SPIC h           SPI close handle\n\
 SPIO channel baud flags | SPI open channel at baud with flags\n\
 SPIR h v         SPI read bytes from handle\n\
@@ -386,6 +414,7 @@ WVAS g baud bitlen stopbits offset ... | Wave add serial data\n\
 WVBSY            Check if wave busy\n\
 WVCHA            Transmit a chain of waves\n\
 WVCLR            Wave clear\n\
+WVCMP            Defragment wave memory\n\
 WVCRE            Create wave from added pulses\n\
 WVDEL wid        Delete waves w and higher\n\
 WVGO             Wave transmit (DEPRECATED)\n\
@@ -567,60 +596,166 @@ static errInfo_t errInfo[]=
    {PI_CMD_INTERRUPTED  , "command interrupted, Python"},
    {PI_NOT_ON_BCM2711   , "not available on BCM2711"},
    {PI_ONLY_ON_BCM2711  , "only available on BCM2711"},
+   {PI_NO_SCRIPT_PROF   , "script profiling never turned on"},
+   {PI_CHAIN_IN_USE     , "can't compact while a chain is transmitted"},
+   {PI_WAVE_SIM_FAULT   , "bad address or endless loop in simulated DMA"},
+   {PI_SLOT_BUSY        , "wave slot copy still being transmitted"},
+   {PI_BAD_SLOT_DELAY   , "delay needs more CBs than the slot reserved"},
+   {PI_NO_WAVE_STREAM   , "wave stream not open"},
+   {PI_BAD_WAVE_MEMORY  , "bad wave blocks or number of waves"},
+   {PI_NO_WAVE_MEMORY   , "wave memory not configured or unavailable"},
+   {PI_BAD_SER_PARITY   , "bit bang serial parity not 0, 1, or 2"},
+   {PI_BAD_TIMER_MICROS , "timer delay or period out of range"},
+   {PI_I2C_PENDING      , "queued I2C batch has not completed"},
+   {PI_BAD_SPI_DMA      , "bad SPI DMA channels or threshold"},
+   {PI_SER_BUF_FAILED   , "can't start buffered serial reads"},
 
 };
 
 static char * fmtMdeStr="RW540123";
 static char * fmtPudStr="ODU";
 
-static int cmdMatch(char *str)
+/*
+Command names are looked up through an open addressing hash of
+the (upper cased) name.  The table holds cmdInfo index + 1, 0 is
+an empty slot.  It is built once, on first use, as scripts may be
+parsed by several socket threads at once.
+*/
+
+#define CMD_HASH_SIZE 512 /* power of 2, > 2 * entries in cmdInfo */
+
+static uint16_t cmdHash[CMD_HASH_SIZE];
+static pthread_once_t cmdHashOnce = PTHREAD_ONCE_INIT;
+
+static uint32_t cmdHashStr(const char *str)
 {
-   int i;
+   uint32_t h = 2166136261u; /* FNV-1a */
+
+   while (*str) h = (h ^ (uint8_t)toupper((uint8_t)*str++)) * 16777619u;
+
+   return h;
+}
+
+static void cmdHashInit(void)
+{
+   int i, slot;
 
    for (i=0; i<(sizeof(cmdInfo)/sizeof(cmdInfo_t)); i++)
    {
-      if (strcasecmp(str, cmdInfo[i].name) == 0) return i;
+      slot = cmdHashStr(cmdInfo[i].name) & (CMD_HASH_SIZE-1);
+
+      while (cmdHash[slot])
+      {
+         /* first entry wins, as the linear search did */
+         if (strcasecmp(cmdInfo[cmdHash[slot]-1].name, cmdInfo[i].name) == 0)
+            break;
+
+         slot = (slot + 1) & (CMD_HASH_SIZE-1);
+      }
+
+      if (!cmdHash[slot]) cmdHash[slot] = i + 1;
+   }
+}
+
+static int cmdMatch(char *str)
+{
+   int slot;
+
+   pthread_once(&cmdHashOnce, cmdHashInit);
+
+   slot = cmdHashStr(str) & (CMD_HASH_SIZE-1);
+
+   while (cmdHash[slot])
+   {
+      if (strcasecmp(str, cmdInfo[cmdHash[slot]-1].name) == 0)
+         return cmdHash[slot] - 1;
+
+      slot = (slot + 1) & (CMD_HASH_SIZE-1);
    }
    return CMD_UNKNOWN_CMD;
 }
 
+/*
+Single pass equivalent of sscanf(str, " %ji %n"), optionally
+preceded by a 'v' (variable) or 'p' (parameter) prefix.  Numbers
+may be signed hex (0x), octal (0), or decimal.
+*/
+
 static int getNum(char *str, uintptr_t *val, int8_t *opt)
 {
-   int f, n;
+   char *s, *digits;
+   int kind, neg, base, d;
+   uintmax_t u;
    intmax_t v;
 
    *opt = 0;
 
-   f = sscanf(str, " %ji %n", &v, &n);
+   s = str;
 
-   if (f == 1)
-   {
-      *val = v;
-      *opt = CMD_NUMERIC;
-      return n;
-   }
+   while (isspace((uint8_t)*s)) s++;
 
-   f = sscanf(str, " v%ji %n", &v, &n);
+   if      (*s == 'v') {kind = CMD_VAR; s++;}
+   else if (*s == 'p') {kind = CMD_PAR; s++;}
+   else                 kind = CMD_NUMERIC;
 
-   if (f == 1)
+   while (isspace((uint8_t)*s)) s++;
+
+   neg = 0;
+
+   if      (*s == '-') {neg = 1; s++;}
+   else if (*s == '+') s++;
+
+   digits = s;
+   base = 10;
+   u = 0;
+
+   if (*s == '0')
    {
-      *val = v;
-      if (v < PI_MAX_SCRIPT_VARS) *opt = CMD_VAR;
-      else *opt = -CMD_VAR;
-      return n;
+      /* like %i a bare "0x" is eaten and reads as 0 */
+      if ((s[1] == 'x') || (s[1] == 'X'))
+      {
+         base = 16;
+         s += 2;
+      }
+      else base = 8;
    }
 
-   f = sscanf(str, " p%ji %n", &v, &n);
-
-   if (f == 1)
+   while (1)
    {
-      *val = v;
-      if (v < PI_MAX_SCRIPT_PARAMS) *opt = CMD_PAR;
-      else *opt = -CMD_PAR;
-      return n;
+      if      ((*s >= '0') && (*s <= '9')) d = *s - '0';
+      else if ((*s >= 'a') && (*s <= 'f')) d = *s - 'a' + 10;
+      else if ((*s >= 'A') && (*s <= 'F')) d = *s - 'A' + 10;
+      else break;
+
+      if (d >= base) break;
+
+      if (u > ((UINTMAX_MAX - d) / base)) u = UINTMAX_MAX; /* saturate */
+      else u = (u * base) + d;
+
+      s++;
    }
 
-   return 0;
+   if (s == digits) return 0;
+
+   /* clamp to the intmax_t range as %ji does */
+
+   if (neg)
+      v = (u > (uintmax_t)INTMAX_MAX) ? INTMAX_MIN : -(intmax_t)u;
+   else
+      v = (u > (uintmax_t)INTMAX_MAX) ? INTMAX_MAX : (intmax_t)u;
+
+   while (isspace((uint8_t)*s)) s++;
+
+   *val = v;
+
+   if      (kind == CMD_VAR)
+      *opt = (v < PI_MAX_SCRIPT_VARS)   ? CMD_VAR : -CMD_VAR;
+   else if (kind == CMD_PAR)
+      *opt = (v < PI_MAX_SCRIPT_PARAMS) ? CMD_PAR : -CMD_PAR;
+   else
+      *opt = CMD_NUMERIC;
+
+   return s - str;
 }
 
 static char intCmdStr[32];
@@ -631,6 +766,18 @@ char *cmdStr(void)
    return intCmdStr;
 }
 
+char *cmdName(int cmd)
+{
+   int i;
+
+   for (i=0; i<(sizeof(cmdInfo)/sizeof(cmdInfo_t)); i++)
+   {
+      if (cmdInfo[i].cmd == cmd) return cmdInfo[i].name;
+   }
+
+   return "?";
+}
+
 int cmdParse(
    char *buf, uintptr_t *p, unsigned ext_len, char *ext, cmdCtlParse_t *ctl)
 {
@@ -647,7 +794,20 @@ int cmdParse(
 
    bzero(&ctl->opt, sizeof(ctl->opt));
 
-   sscanf(buf+ctl->eaten, " %31s %n", intCmdStr, &pp);
+   /* equivalent of sscanf(" %31s %n") */
+
+   p8 = buf + ctl->eaten;
+
+   while (isspace((uint8_t)*p8)) p8++;
+
+   for (n=0; (n<(sizeof(intCmdStr)-1)) && *p8 && !isspace((uint8_t)*p8); n++)
+      intCmdStr[n] = *p8++;
+
+   intCmdStr[n] = 0;
+
+   while (isspace((uint8_t)*p8)) p8++;
+
+   pp = p8 - (buf + ctl->eaten);
 
    ctl->eaten += pp;
 
@@ -671,7 +831,7 @@ int cmdParse(
       case 101: /* BR1  BR2  CGI  H  HELP  HWVER
                    DCRA  HALT  INRA  NO
                    PIGPV  POPA  PUSHA  RET  T  TICK  WVBSY  WVCLR
-                   WVCRE  WVGO  WVGOR  WVHLT  WVNEW
+                   WVCMP  WVCRE  WVGO  WVGOR  WVHLT  WVNEW
 
                    No parameters, always valid.
                 */
@@ -691,7 +851,7 @@ int cmdParse(
 
          break;
 
-      case 112: /* BI2CC FC  GDC  GPW  I2CC  I2CRB
+      case 112: /* ACQP  BI2CC FC  GDC  GPW  I2CC  I2CRB
                    MG  MICS  MILS  MODEG  NC  NP  PADG PFG  PRG
                    PROCD  PROCP  PROCS  PRRG  R  READ  SLRC  SPIC
                    WVCAP WVDEL  WVSC  WVSM  WVSP  WVTX  WVTXR  BSPIC
@@ -750,9 +910,9 @@ int cmdParse(
 
          break;
 
-      case 121: /* HC  FR  I2CRD  I2CRR  I2CRW  I2CWB I2CWQ  P
-                   PADS  PFS  PRS  PWM  S  SERVO  SLR  SLRI  W
-                   WDOG  WRITE  WVTXM
+      case 121: /* ACQR  HC  FR  I2CBR  I2CRD  I2CRR  I2CRW  I2CWB I2CWQ  P
+                   PADS  PFS  PROFR  PROFS  PRS  PWM  S  SERVO  SLR
+                   SLRI  W  WDOG  WRITE  WVTXM
 
                    Two positive parameters.
                 */
@@ -764,7 +924,7 @@ int cmdParse(
 
          break;
 
-      case 122: /* NB
+      case 122: /* ACQM  EVM  NB  SLRM
 
                    Two parameters, first positive, second any value.
                 */
@@ -955,7 +1115,7 @@ int cmdParse(
 
          break;
 
-      case 134: /* BSPIO
+      case 134: /* BSPIL  BSPIO
 
                    Six parameters.  First to Fifth positive.
                    Sixth may be negative when interpreted as an int.
@@ -985,6 +1145,31 @@ int cmdParse(
 
          break;
 
+      case 135: /* ACQS  SERB
+
+                   Five parameters, first four positive.
+                */
+         ctl->eaten += getNum(buf+ctl->eaten, &p[1], &ctl->opt[1]);
+         ctl->eaten += getNum(buf+ctl->eaten, &p[2], &ctl->opt[2]);
+         ctl->eaten += getNum(buf+ctl->eaten, &tp1, &to1);
+         ctl->eaten += getNum(buf+ctl->eaten, &tp2, &to2);
+         ctl->eaten += getNum(buf+ctl->eaten, &tp3, &to3);
+
+         if ((ctl->opt[1] > 0) && ((int)p[1] >= 0) &&
+             (ctl->opt[2] > 0) && ((int)p[2] >= 0) &&
+             (to1 == CMD_NUMERIC) && ((int)tp1 >= 0) &&
+             (to2 == CMD_NUMERIC) && ((int)tp2 >= 0) &&
+             (to3 == CMD_NUMERIC))
+         {
+            p[3] = 3 * 4;
+            memcpy(ext+0, &tp1, 4);
+            memcpy(ext+4, &tp2, 4);
+            memcpy(ext+8, &tp3, 4);
+            valid = 1;
+         }
+
+         break;
+
       case 191: /* PROCR PROCU
 
                    One to 11 parameters, first positive,
@@ -1116,7 +1301,7 @@ int cmdParse(
 
          break;
 
-      case 195: /* CF1  CF2
+      case 195: /* CF1  CF2  I2CBQ
 
                    Zero or more parameters, first two >=0, rest 0-255.
                 */
@@ -1263,6 +1448,116 @@ char * cmdErrStr(int error)
    return "unknown error";
 }
 
+static int cmdScriptOp(uintptr_t cmd)
+{
+   switch (cmd)
+   {
+      case PI_CMD_WRITE: return CMD_OP_WRITE;
+      case PI_CMD_READ:  return CMD_OP_READ;
+      case PI_CMD_MICS:  return CMD_OP_MICS;
+      case PI_CMD_MILS:  return CMD_OP_MILS;
+      case PI_CMD_BR1:   return CMD_OP_BR1;
+      case PI_CMD_BS1:   return CMD_OP_BS1;
+      case PI_CMD_BC1:   return CMD_OP_BC1;
+      case PI_CMD_TICK:  return CMD_OP_TICK;
+
+      case PI_CMD_ADD:   return CMD_OP_ADD;
+      case PI_CMD_AND:   return CMD_OP_AND;
+      case PI_CMD_CALL:  return CMD_OP_CALL;
+      case PI_CMD_CMP:   return CMD_OP_CMP;
+      case PI_CMD_DCR:   return CMD_OP_DCR;
+      case PI_CMD_DCRA:  return CMD_OP_DCRA;
+      case PI_CMD_DIV:   return CMD_OP_DIV;
+      case PI_CMD_EVTWT: return CMD_OP_EVTWT;
+      case PI_CMD_HALT:  return CMD_OP_HALT;
+      case PI_CMD_INR:   return CMD_OP_INR;
+      case PI_CMD_INRA:  return CMD_OP_INRA;
+      case PI_CMD_JM:    return CMD_OP_JM;
+      case PI_CMD_JMP:   return CMD_OP_JMP;
+      case PI_CMD_JNZ:   return CMD_OP_JNZ;
+      case PI_CMD_JP:    return CMD_OP_JP;
+      case PI_CMD_JZ:    return CMD_OP_JZ;
+      case PI_CMD_LD:    return CMD_OP_LD;
+      case PI_CMD_LDA:   return CMD_OP_LDA;
+      case PI_CMD_LDAB:  return CMD_OP_LDAB;
+      case PI_CMD_MLT:   return CMD_OP_MLT;
+      case PI_CMD_MOD:   return CMD_OP_MOD;
+      case PI_CMD_OR:    return CMD_OP_OR;
+      case PI_CMD_POP:   return CMD_OP_POP;
+      case PI_CMD_POPA:  return CMD_OP_POPA;
+      case PI_CMD_PUSH:  return CMD_OP_PUSH;
+      case PI_CMD_PUSHA: return CMD_OP_PUSHA;
+      case PI_CMD_RET:   return CMD_OP_RET;
+      case PI_CMD_RL:    return CMD_OP_RL;
+      case PI_CMD_RLA:   return CMD_OP_RLA;
+      case PI_CMD_RR:    return CMD_OP_RR;
+      case PI_CMD_RRA:   return CMD_OP_RRA;
+      case PI_CMD_STA:   return CMD_OP_STA;
+      case PI_CMD_STAB:  return CMD_OP_STAB;
+      case PI_CMD_SUB:   return CMD_OP_SUB;
+      case PI_CMD_SYS:   return CMD_OP_SYS;
+      case PI_CMD_WAIT:  return CMD_OP_WAIT;
+      case PI_CMD_X:     return CMD_OP_X;
+      case PI_CMD_XA:    return CMD_OP_XA;
+      case PI_CMD_XOR:   return CMD_OP_XOR;
+   }
+
+   if (cmd < PI_CMD_SCRIPT) return CMD_OP_CMD;
+
+   return CMD_OP_NOP; /* NOP CMDR CMDW */
+}
+
+static uintptr_t cmdScriptReg(cmdInstr_t *instr, int n)
+{
+   /* register file index of a register operand */
+
+   if (instr->opt[n] == CMD_PAR) return instr->p[n];
+   else                          return PI_MAX_SCRIPT_PARAMS + instr->p[n];
+}
+
+static void cmdScriptDecode(cmdScript_t *s)
+{
+   int i;
+   cmdInstr_t *instr;
+   cmdCode_t *code;
+
+   for (i=0; i<s->instrs; i++)
+   {
+      instr = &s->instr[i];
+      code = &s->code[i];
+
+      code->op = cmdScriptOp(instr->p[0]);
+      code->k1 = (instr->opt[1] == CMD_VAR) || (instr->opt[1] == CMD_PAR);
+      code->k2 = (instr->opt[2] == CMD_VAR) || (instr->opt[2] == CMD_PAR);
+      code->p1 = code->k1 ? cmdScriptReg(instr, 1) : instr->p[1];
+      code->p2 = code->k2 ? cmdScriptReg(instr, 2) : instr->p[2];
+
+      switch (code->op)
+      {
+         case CMD_OP_DCR:
+         case CMD_OP_INR:
+         case CMD_OP_LD:
+         case CMD_OP_POP:
+         case CMD_OP_PUSH:
+         case CMD_OP_RL:
+         case CMD_OP_RR:
+         case CMD_OP_STA:
+         case CMD_OP_X:
+         case CMD_OP_XA:
+            /* a numeric register operand names a variable */
+            code->k1 = 0;
+            code->p1 = cmdScriptReg(instr, 1);
+
+            if (code->op == CMD_OP_X)
+            {
+               code->k2 = 0;
+               code->p2 = cmdScriptReg(instr, 2);
+            }
+            break;
+      }
+   }
+}
+
 int cmdParseScript(char *script, cmdScript_t *s, int diags)
 {
    int idx, len, b, i, j, tags, resolved;
@@ -1280,10 +1575,11 @@ int cmdParseScript(char *script, cmdScript_t *s, int diags)
 
    len = strlen(script);
 
-   /* calloc space for PARAMS, VARS, CMDS, and STRINGS */
+   /* calloc space for PARAMS, VARS, CMDS, CODE, and STRINGS */
 
    b = (sizeof(int) * (PI_MAX_SCRIPT_PARAMS + PI_MAX_SCRIPT_VARS)) +
-       (sizeof(cmdInstr_t) * (len + 2) / 2) + len;
+       (sizeof(cmdInstr_t) * (len + 2) / 2) +
+       (sizeof(cmdCode_t) * (len + 2) / 2) + len;
 
    s->par = calloc(1, b);
 
@@ -1293,7 +1589,9 @@ int cmdParseScript(char *script, cmdScript_t *s, int diags)
 
    s->instr = (cmdInstr_t *)(s->var + PI_MAX_SCRIPT_VARS);
 
-   s->str_area = (char *)(s->instr + ((len + 2) / 2));
+   s->code = (cmdCode_t *)(s->instr + ((len + 2) / 2));
+
+   s->str_area = (char *)(s->code + ((len + 2) / 2));
 
    s->str_area_len = len;
    s->str_area_pos = 0;
@@ -1417,6 +1715,81 @@ int cmdParseScript(char *script, cmdScript_t *s, int diags)
          }
       }
    }
+
+   cmdScriptDecode(s);
+
    return status;
 }
 
+
+static int cmdIsJcc(int op)
+{
+   return ((op == CMD_OP_JZ) || (op == CMD_OP_JNZ) ||
+           (op == CMD_OP_JM) || (op == CMD_OP_JP));
+}
+
+static int cmdIsArith(int op)
+{
+   return ((op == CMD_OP_ADD) || (op == CMD_OP_SUB) ||
+           (op == CMD_OP_AND) || (op == CMD_OP_OR)  ||
+           (op == CMD_OP_XOR) || (op == CMD_OP_MLT));
+}
+
+void cmdOptimiseScript(cmdScript_t *s)
+{
+   /*
+      Peephole pass over the decoded script.  Common sequences are
+      fused into a single superinstruction at the position of their
+      first step.  The fused forms set A and F exactly as the
+      original steps would.
+   */
+
+   int i, n, op0, op1, op2;
+   cmdCode_t *c;
+
+   for (i=0; i<s->instrs; i++)
+   {
+      c = &s->code[i];
+      n = s->instrs - i;
+
+      op0 = c[0].op;
+      op1 = (n > 1) ? c[1].op : -1;
+      op2 = (n > 2) ? c[2].op : -1;
+
+      if ((op0 == CMD_OP_WRITE) && (op1 == CMD_OP_MICS) &&
+          (op2 == CMD_OP_WRITE))
+      {
+         c[0].op = CMD_OP_WMW;
+      }
+      else if ((op0 == CMD_OP_LDA) && cmdIsArith(op1) && (op2 == CMD_OP_STA))
+      {
+         c[0].op = CMD_OP_LAS;
+         c[0].sub = op1;
+      }
+      else if (cmdIsJcc(op1) &&
+         ((op0 == CMD_OP_READ) || (op0 == CMD_OP_CMP) ||
+          (op0 == CMD_OP_DCR)  || (op0 == CMD_OP_INR)))
+      {
+         switch (op0)
+         {
+            case CMD_OP_READ: c[0].op = CMD_OP_RJ;   break;
+            case CMD_OP_CMP:  c[0].op = CMD_OP_CMPJ; break;
+            case CMD_OP_DCR:  c[0].op = CMD_OP_DCRJ; break;
+            case CMD_OP_INR:  c[0].op = CMD_OP_INRJ; break;
+         }
+         c[0].sub = op1;
+      }
+      else if ((op0 == CMD_OP_STA) && (op1 == CMD_OP_LDA) &&
+               c[1].k1 && (c[1].p1 == c[0].p1))
+      {
+         /* A already holds the register */
+         c[0].op = CMD_OP_STAL;
+      }
+      else if ((op0 == CMD_OP_LDA) && (op1 == CMD_OP_LDA))
+      {
+         /* the first load is dead */
+         c[0].op = CMD_OP_LDAL;
+      }
+   }
+}
+
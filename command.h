@@ -92,16 +92,106 @@ typedef struct
    int8_t opt[4];
 } cmdInstr_t;
 
+/* script bytecode operations (dense, for the interpreter dispatch) */
+
+#define CMD_OP_CMD    0 /* any command below PI_CMD_SCRIPT */
+#define CMD_OP_WRITE  1
+#define CMD_OP_READ   2
+#define CMD_OP_MICS   3
+#define CMD_OP_MILS   4
+#define CMD_OP_BR1    5
+#define CMD_OP_BS1    6
+#define CMD_OP_BC1    7
+#define CMD_OP_TICK   8
+#define CMD_OP_ADD    9
+#define CMD_OP_AND   10
+#define CMD_OP_CALL  11
+#define CMD_OP_CMP   12
+#define CMD_OP_DCR   13
+#define CMD_OP_DCRA  14
+#define CMD_OP_DIV   15
+#define CMD_OP_EVTWT 16
+#define CMD_OP_HALT  17
+#define CMD_OP_INR   18
+#define CMD_OP_INRA  19
+#define CMD_OP_JM    20
+#define CMD_OP_JMP   21
+#define CMD_OP_JNZ   22
+#define CMD_OP_JP    23
+#define CMD_OP_JZ    24
+#define CMD_OP_LD    25
+#define CMD_OP_LDA   26
+#define CMD_OP_LDAB  27
+#define CMD_OP_MLT   28
+#define CMD_OP_MOD   29
+#define CMD_OP_NOP   30
+#define CMD_OP_OR    31
+#define CMD_OP_POP   32
+#define CMD_OP_POPA  33
+#define CMD_OP_PUSH  34
+#define CMD_OP_PUSHA 35
+#define CMD_OP_RET   36
+#define CMD_OP_RL    37
+#define CMD_OP_RLA   38
+#define CMD_OP_RR    39
+#define CMD_OP_RRA   40
+#define CMD_OP_STA   41
+#define CMD_OP_STAB  42
+#define CMD_OP_SUB   43
+#define CMD_OP_SYS   44
+#define CMD_OP_WAIT  45
+#define CMD_OP_X     46
+#define CMD_OP_XA    47
+#define CMD_OP_XOR   48
+
+/* superinstructions, see cmdOptimiseScript */
+
+#define CMD_OP_WMW   49 /* W MICS W */
+#define CMD_OP_RJ    50 /* R Jcc */
+#define CMD_OP_CMPJ  51 /* CMP Jcc */
+#define CMD_OP_DCRJ  52 /* DCR Jcc */
+#define CMD_OP_INRJ  53 /* INR Jcc */
+#define CMD_OP_LAS   54 /* LDA arith STA */
+#define CMD_OP_STAL  55 /* STA r LDA r */
+#define CMD_OP_LDAL  56 /* LDA LDA */
+
+#define CMD_OPS      57
+
+/*
+A pre-decoded script instruction.  Operands are either immediate
+values or, if the matching k flag is set, an index into the
+combined par[]/var[] register file (var n is at index
+PI_MAX_SCRIPT_PARAMS + n).  Operands which name a register to be
+updated (DCR, INR, LD, POP, PUSH, RL, RR, STA, X, XA) always hold
+a register file index.
+
+A superinstruction replaces only the op of the first instruction of
+the sequence it stands for.  It takes its remaining operands from the
+following entries, which are left untouched so that a jump into the
+middle of the sequence still behaves as before.
+*/
+
+typedef struct
+{
+   uint8_t   op;  /* CMD_OP_ */
+   uint8_t   k1;  /* p1 is a register file index */
+   uint8_t   k2;  /* p2 is a register file index */
+   uint8_t   sub; /* superinstruction variant, a CMD_OP_ */
+   uintptr_t p1;
+   uintptr_t p2;
+} cmdCode_t;
+
 typedef struct
 {
    /*
-     +-----------+---------+---------+----------------+
-     | PARAMS... | VARS... | CMDS... | STRING AREA... |
-     +-----------+---------+---------+----------------+
+     +-----------+---------+---------+---------+----------------+
+     | PARAMS... | VARS... | CMDS... | CODE... | STRING AREA... |
+     +-----------+---------+---------+---------+----------------+
    */
    int *par;
    int *var;
    cmdInstr_t *instr;
+   cmdCode_t *code;
    int instrs;
    char *str_area;
    int str_area_len;
@@ -116,9 +206,13 @@ int cmdParse(char *buf, uintptr_t *p, unsigned ext_len, char *ext, cmdCtlParse_t
 
 int cmdParseScript(char *script, cmdScript_t *s, int diags);
 
+void cmdOptimiseScript(cmdScript_t *s);
+
 char *cmdErrStr(int error);
 
 char *cmdStr(void);
 
+char *cmdName(int cmd);
+
 #endif
 
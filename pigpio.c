@@ -57,12 +57,16 @@ For more information, please refer to <http://unlicense.org/>
 #include <sys/file.h>
 #include <sys/socket.h>
 #include <sys/sysmacros.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/select.h>
 #include <fnmatch.h>
 #include <glob.h>
 #include <arpa/inet.h>
+#include <linux/gpio.h>
+#include <linux/spi/spidev.h>
 
 #include "pigpio.h"
 
@@ -235,6 +239,36 @@ bit 0 READ_LAST_NOT_SET_ERROR
    }                                                               \
    while (0)
 
+/* the wave functions also work in ordinary memory, see gpioWaveSimOpen */
+
+#define CHECK_WAVE_INITED                                          \
+   do                                                              \
+   {                                                               \
+      if (!libInitialised && !waveSimOpen)                         \
+      {                                                            \
+         DBG(DBG_ALWAYS,                                           \
+           "pigpio uninitialised, call gpioInitialise()");         \
+         return PI_NOT_INITIALISED;                                \
+      }                                                            \
+      if (!waveMemReady && (initWaveMem() < 0))                    \
+         return PI_NO_WAVE_MEMORY;                                 \
+   }                                                               \
+   while (0)
+
+/* the main SPI also works in ordinary memory, see gpioSPISimOpen */
+
+#define CHECK_SPI_INITED                                           \
+   do                                                              \
+   {                                                               \
+      if (!libInitialised && !spiSimOpen)                          \
+      {                                                            \
+         DBG(DBG_ALWAYS,                                           \
+           "pigpio uninitialised, call gpioInitialise()");         \
+         return PI_NOT_INITIALISED;                                \
+      }                                                            \
+   }                                                               \
+   while (0)
+
 #define CHECK_INITED_RET_NULL_PTR                                  \
    do                                                              \
    {                                                               \
@@ -672,6 +706,11 @@ bit 0 READ_LAST_NOT_SET_ERROR
 #define PCM_TIMER (((PCM_BASE + PCM_FIFO*4) & 0x00ffffff) | PI_PERI_BUS)
 #define PWM_TIMER (((PWM_BASE + PWM_FIFO*4) & 0x00ffffff) | PI_PERI_BUS)
 
+#define SPI_BUS_FIFO (((SPI_BASE + SPI_FIFO*4) & 0x00ffffff) | PI_PERI_BUS)
+
+#define SPI_DREQ_TX 6
+#define SPI_DREQ_RX 7
+
 #define DBG_MIN_LEVEL 0
 #define DBG_ALWAYS    0
 #define DBG_STARTUP   1
@@ -746,11 +785,16 @@ Assumes two counters per block.  Each counter 4 * 16 (16^4=65536)
 
 #define DMAI_PAGES (PAGES_PER_BLOCK * bufferBlocks)
 
-#define DMAO_PAGES (PAGES_PER_BLOCK * PI_WAVE_BLOCKS)
+#define DMAO_PAGES (PAGES_PER_BLOCK * gpioCfg.waveBlocks)
 
 #define NUM_WAVE_OOL (DMAO_PAGES * OOL_PER_OPAGE)
 #define NUM_WAVE_CBS (DMAO_PAGES * CBS_PER_OPAGE)
 
+/* the wave CB and OOL arenas start above the chain counter pages */
+
+#define WAVE_BASE_CB  (PI_WAVE_COUNT_PAGES*CBS_PER_OPAGE)
+#define WAVE_BASE_OOL (PI_WAVE_COUNT_PAGES*OOL_PER_OPAGE)
+
 #define TICKSLOTS 50
 
 #define PI_I2C_CLOSED   0
@@ -789,6 +833,23 @@ Assumes two counters per block.  Each counter 4 * 16 (16^4=65536)
 
 #define BPD 4
 
+#define WAVE_SIM_BUS   0xC0000000 /* gpioWaveSimOpen pages */
+#define WAVE_SIM_STEPS 1000000    /* CBs without a delay */
+
+#define SPI_SIM_BUS    0xE0000000 /* gpioSPISimOpen memory */
+
+/* SPI DMA memory, two CBs then the tx and rx buffers */
+
+#define SPI_DMA_CHUNK  DMA_LITE_MAX /* DLEN is 16 bits, lite DMA 0xfffc */
+#define SPI_DMA_TX     PAGE_SIZE
+#define SPI_DMA_RX    (PAGE_SIZE + 65536)
+#define SPI_DMA_MEM   (PAGE_SIZE + 65536 + 65536)
+#define SPI_DMA_SPIN   200 /* micros spun rather than slept */
+
+#define WAVE_STREAM_STALL 10 /* micros between checks of a dry stream */
+
+#define WAVE_SER_STRIDE 10 /* pulses in the longest 8 bit character */
+
 #define MAX_REPORT 250
 #define MAX_SAMPLE 4000
 
@@ -796,7 +857,53 @@ Assumes two counters per block.  Each counter 4 * 16 (16^4=65536)
 
 #define MAX_EMITS (PIPE_BUF / sizeof(gpioReport_t))
 
+#define TIMER_BITS   6
+#define TIMER_SLOTS  (1<<TIMER_BITS) /* slots per wheel level */
+#define TIMER_LEVELS 4               /* 1 us to 16.7 s, then overflow */
+
+#define ISR_SYSFS   1
+#define ISR_CHARDEV 2
+#define ISR_EVENTS  16          /* per epoll_wait and per line read */
+#define ISR_WAKE    (PI_MAX_GPIO+1)
+
+#define SER_WAKE    PI_SER_SLOTS
+#define SER_CHUNK   256         /* bytes per read of a buffered port */
+
+#define I2C_BATCH_SCRATCH 4096    /* register writes per I2C_RDWR */
+
+#define BB_SLACK_NS 100 /* bit bang edge lateness absorbed, nanoseconds */
+
+/* bit bang I2C, SCL is low for 9/16 of the period to meet the fast
+   mode minimum low time (1.3 us) at 400 kbps */
+
+#define I2C_LOW_NS(baud)  ((THOUSAND * MILLION / (baud)) * 9 / 16)
+#define I2C_MAX_STRETCH   (100 * MILLION) /* nanoseconds */
+#define I2C_OP_PENDING    INT_MIN
+
+#define I2C_REQUESTS 64
+#define I2C_WORKERS   8
+
+#define I2C_REQ_FREE    0
+#define I2C_REQ_QUEUED  1
+#define I2C_REQ_RUNNING 2
+#define I2C_REQ_DONE    3
+
+#define I2C_OWNER_LOCAL -1 /* C, pipe, or script request */
+#define I2C_OWNER_GONE  -2 /* its socket closed, freed once done */
+
+#define ACQ_CLOSED  0
+#define ACQ_RUNNING 1
+#define ACQ_FAILED  2 /* its handle was closed */
+
+#define ACQ_NTFY_REPORTS 32 /* per acquisition per alert pass */
+
 #define SRX_BUF_SIZE 8192
+#define SRX_NTFY_REPORTS 8 /* per GPIO per alert pass, 4 bytes each */
+
+#define PI_FIFO_OUT_SIZE      (4*CMD_MAX_EXTENSION)
+#define PI_FIFO_BIN_IN_SIZE   (4*CMD_MAX_EXTENSION)
+#define PI_FIFO_BIN_OUT_SIZE  (4*CMD_MAX_EXTENSION)
+#define PI_FIFO_WRITE_WAIT_MS 100
 
 #define PI_I2C_RETRIES 0x0701
 #define PI_I2C_TIMEOUT 0x0702
@@ -821,6 +928,7 @@ Assumes two counters per block.  Each counter 4 * 16 (16^4=65536)
 #define PI_I2C_SMBUS_BLOCK_MAX     32
 #define PI_I2C_SMBUS_I2C_BLOCK_MAX 32
 
+#define PI_I2C_FUNC_I2C                    0x00000001
 #define PI_I2C_FUNC_SMBUS_QUICK            0x00010000
 #define PI_I2C_FUNC_SMBUS_READ_BYTE        0x00020000
 #define PI_I2C_FUNC_SMBUS_WRITE_BYTE       0x00040000
@@ -869,6 +977,7 @@ Assumes two counters per block.  Each counter 4 * 16 (16^4=65536)
 #define PI_SPI_FLAGS_CHANNEL(x)    ((x&7)<<29)
 
 #define PI_SPI_FLAGS_GET_CHANNEL(x) (((x)>>29)&7)
+#define PI_SPI_FLAGS_GET_SPIDEV(x)  (((x)>>22)&1)
 #define PI_SPI_FLAGS_GET_BITLEN(x)  (((x)>>16)&63)
 #define PI_SPI_FLAGS_GET_RX_LSB(x)  (((x)>>15)&1)
 #define PI_SPI_FLAGS_GET_TX_LSB(x)  (((x)>>14)&1)
@@ -969,14 +1078,14 @@ typedef struct
 typedef struct
 {
    unsigned gpio;
-   pthread_t *pth;
    callbk_t func;
    unsigned edge;
    int timeout;
    unsigned ex;
    void *userdata;
    int fd;
-   int inited;
+   int inited;        /* ISR_SYSFS or ISR_CHARDEV once set up */
+   uint64_t deadline; /* micros, for the interrupt timeout */
 } gpioISR_t;
 
 typedef struct
@@ -994,15 +1103,16 @@ typedef struct
    uint32_t bits;
 } gpioGetSamples_t;
 
-typedef struct
+typedef struct gpioTimer_s
 {
+   struct gpioTimer_s *next;
+   struct gpioTimer_s **pprev; /* NULL when not on a wheel list */
    callbk_t func;
    unsigned ex;
    void *userdata;
-   unsigned id;
-   unsigned running;
-   unsigned millis;
-   pthread_t pthId;
+   uint64_t expiry;            /* absolute monotonic micros */
+   uint32_t period;            /* 0 for a one-shot */
+   int used;
 } gpioTimer_t;
 
 typedef struct
@@ -1018,6 +1128,8 @@ typedef struct
    pthread_mutex_t pthMutex;
    pthread_cond_t pthCond;
    cmdScript_t script;
+   unsigned profile;       /* profile the next run */
+   gpioScriptProf_t *prof; /* one per script step */
 } gpioScript_t;
 
 
@@ -1033,6 +1145,8 @@ typedef struct
    uint16_t state;
    uint32_t bits;
    uint32_t eventBits;
+   uint32_t serialBits;
+   uint32_t acqBits;
    uint32_t lastReportTick;
    int      fd;
    int      pipe;
@@ -1046,25 +1160,84 @@ typedef struct
    uint32_t mode;
 } fileInfo_t;
 
+typedef struct
+{
+   int  fd;
+   int  len;
+   char buf[PI_FIFO_OUT_SIZE];
+} fifoOut_t;
+
 typedef struct
 {
    uint16_t state;
    int16_t  fd;
+   uint32_t bus;
    uint32_t addr;
    uint32_t flags;
    uint32_t funcs;
 } i2cInfo_t;
 
+typedef struct
+{
+   int state;
+   int worker;
+   unsigned priority;
+   uint32_t seq;         /* first come first served within a priority */
+   pi_i2c_op_t *ops;
+   unsigned numOps;
+   i2cBatchFunc_t func;
+   void *userdata;
+   int event;            /* triggered when done, or -1 */
+   char *copy;           /* ops and data of a socket request */
+   int owner;            /* socket of a socket request, or I2C_OWNER_ */
+   int status;
+} i2cRequest_t;
+
+typedef struct
+{
+   int bus;
+   int running;
+   pthread_t pth;
+   pthread_cond_t cond;
+} i2cWorker_t;
+
+typedef struct
+{
+   int state;
+   unsigned type;
+   unsigned handle;
+   unsigned reg;
+   unsigned len;
+   int timer;
+   int pending;          /* I2C read queued on the bus worker */
+   uint32_t tick;        /* when the pending read was requested */
+   pi_i2c_op_t op;
+   char data[PI_MAX_ACQ_LEN+1];
+   char *ring;           /* PI_ACQ_SAMPLES of tick then len bytes */
+   unsigned readPos;
+   unsigned count;
+} acqInfo_t;
+
 typedef struct
 {
    uint16_t state;
    int16_t  fd;
    uint32_t flags;
+   char    *ring;       /* buffered reads, NULL if not buffered */
+   unsigned size;
+   unsigned readPos;
+   unsigned count;
+   unsigned minBytes;
+   int      terminator;
+   int      event;
+   serReadyFunc_t func;
+   void    *userdata;
 } serInfo_t;
 
 typedef struct
 {
    uint16_t state;
+   int16_t  fd;    /* /dev/spidev handles only */
    unsigned speed;
    uint32_t flags;
 } spiInfo_t;
@@ -1098,6 +1271,11 @@ typedef struct
    unsigned socketPort;
    unsigned ifFlags;
    unsigned memAllocMode;
+   unsigned waveBlocks;
+   unsigned maxWaves;
+   unsigned spiDMATx;
+   unsigned spiDMARx;
+   unsigned spiDMABytes;
    unsigned dbgLevel;
    unsigned alertFreq;
    uint32_t internals;
@@ -1120,6 +1298,53 @@ typedef struct
    uint32_t maxCbs;
 } wfStats_t;
 
+typedef struct
+{
+   int start;
+   int len;
+} waveSpan_t;
+
+typedef struct
+{
+   int          used;
+   int          wid[2];  /* the two copies of the wave */
+   int          active;  /* the copy being (or next to be) sent */
+   int          stale;   /* inactive copy lacks the active pulses */
+   unsigned     pulses;
+   uint32_t    *cbOff;   /* per pulse, its first CB less botCB */
+   uint32_t    *delays;  /* per pulse, delay CBs reserved */
+   gpioPulse_t *pulse[2];
+} waveSlot_t;
+
+typedef struct
+{
+   int          open;
+   int          wid;       /* the wave holding the ring */
+   int          started;   /* the DMA has been sent to the ring */
+   unsigned     segments;
+   unsigned     segPulses; /* pulses a segment holds */
+   unsigned     delays;    /* per pulse, delay CBs reserved */
+   uint32_t     maxDelay;  /* longest delay of one pulse */
+   unsigned     segCBs;    /* CBs a segment uses */
+   unsigned     head;      /* oldest segment not yet sent */
+   unsigned     queued;    /* segments committed but not yet sent */
+   unsigned     filled;    /* pulses staged for the next segment */
+   uint32_t     carry;     /* delay still owed by the last pulse */
+   uint32_t     underruns;
+   uint16_t    *count;     /* per segment, pulses committed */
+   gpioPulse_t *stage;
+} waveStream_t;
+
+typedef struct
+{
+   unsigned   baud;      /* the key, 0 if none */
+   unsigned   data_bits;
+   unsigned   stop_bits;
+   unsigned   bitDelay0;
+   uint8_t    count[256];
+   rawWave_t *pulse;     /* 256 characters of WAVE_SER_STRIDE pulses */
+} waveSerTab_t;
+
 typedef struct
 {
    char    *buf;
@@ -1128,7 +1353,6 @@ typedef struct
    int      writePos;
    uint32_t fullBit; /* nanoseconds */
    uint32_t halfBit; /* nanoseconds */
-   int      timeout; /* millisconds */
    uint32_t startBitTick; /* microseconds */
    uint32_t nextBitDiff; /* nanoseconds */
    int      bit;
@@ -1137,16 +1361,30 @@ typedef struct
    int      level;
    int      dataBits; /* 1-32 */
    int      invert; /* 0, 1 */
+   int      parity; /* 0 none, 1 odd, 2 even */
+   int      frameBits; /* data, parity, and stop bits */
+   uint32_t frameTicks; /* start to stop bit middle, microseconds */
+   int      ones;
+   uint32_t framingErrs;
+   uint32_t parityErrs;
+   int      waiters;    /* threads in gpioSerialReadWait */
 } wfRxSerial_t;
 
 typedef struct
 {
    int SDA;
    int SCL;
-   int delay;
    int SDAMode;
    int SCLMode;
    int started;
+   uint32_t SDABit;
+   uint32_t SCLBit;
+   uint32_t lowNs;     /* SCL low time */
+   uint32_t highNs;    /* SCL high time */
+   uint64_t next;      /* earliest time of the next SCL edge */
+   uint32_t clocks;    /* SCL pulses clocking bytes in the last zip */
+   uint64_t clockNs;   /* time taken by those pulses */
+   uint32_t stretches; /* clock stretches in the last zip */
 } wfRxI2C_t;
 
 typedef struct
@@ -1162,6 +1400,11 @@ typedef struct
    int MOSIMode;
    int CSMode;
    int SCLKMode;
+   int lanes;         /* 0 unless opened by bbSPIOpenLanes */
+   int laneMode;      /* mode of a lane bus GPIO before it was opened */
+   uint32_t MISOBits;
+   uint32_t MOSIBits;
+   uint32_t halfNs;
 } wfRxSPI_t;
 
 typedef struct
@@ -1170,6 +1413,7 @@ typedef struct
    int      gpio;
    uint32_t baud;
    pthread_mutex_t mutex;
+   pthread_cond_t  cond; /* serial read waiters */
    union
    {
       wfRxSerial_t s;
@@ -1263,21 +1507,65 @@ static wfStats_t wfStats=
 {
    0, 0, PI_WAVE_MAX_MICROS,
    0, 0, PI_WAVE_MAX_PULSES,
-   0, 0, (DMAO_PAGES * CBS_PER_OPAGE)
+   0, 0, (PI_WAVE_BLOCKS * PAGES_PER_BLOCK * CBS_PER_OPAGE)
 };
 
-static rawWaveInfo_t waveInfo[PI_MAX_WAVES];
+/* the wave table, see gpioCfgWaveMemory, allocated on first use */
+
+static int waveMemReady = 0;
+static int waveMax      = 0;
+
+static rawWaveInfo_t *waveInfo = NULL;
 
 static wfRx_t wfRx[PI_MAX_USER_GPIO+1];
 
-static int waveOutBotCB  = PI_WAVE_COUNT_PAGES*CBS_PER_OPAGE;
-static int waveOutBotOOL = PI_WAVE_COUNT_PAGES*OOL_PER_OPAGE;
-static int waveOutTopOOL = NUM_WAVE_OOL;
+/* free CB and OOL space, in address order, adjacent spans merged */
+
+static waveSpan_t *waveFreeCB  = NULL; /* waveMax+1 spans */
+static waveSpan_t *waveFreeOOL = NULL;
+static int waveFreeCBs  = 0;
+static int waveFreeOOLs = 0;
+
 static int waveOutCount = 0;
 
+/* wave cache, see PI_CFG_WAVE_CACHE */
+
+static uint32_t   *waveRefs    = NULL;
+static uint32_t   *waveHash    = NULL;
+static int        *waveKeptLen = NULL;
+static rawWave_t **waveKept    = NULL;
+
+/* gpioWaveCompact work space, 5 ints and 2 spans a wave */
+
+static int        *waveWork = NULL;
+static waveSpan_t *wavePins = NULL;
+
+static waveSlot_t waveSlot[PI_MAX_WAVE_SLOTS];
+
+static waveStream_t waveStream;
+
+static waveSerTab_t *waveSerTab[PI_MAX_USER_GPIO+1];
+
 static uint32_t *waveEndPtr = NULL;
 
+/* wave simulation, DMA output pages in ordinary memory */
+
+static int         waveSimOpen   = 0;
+static uint32_t    waveSimStart  = 0;
+static uint32_t    waveSimLevels = 0;
+static dmaOPage_t *waveSimPages  = NULL;
+
+/* SPI DMA, see gpioCfgSPIDMA, simulated by gpioSPISimOpen */
+
+static DMAMem_t  spiDMAMem      = {0, 0, NULL, 0};
+static int       spiSimOpen     = 0;
+static uint32_t *spiSimRegs     = NULL;
+static uint32_t  spiSimDMABytes = 0;
+static uint32_t  spiSimCPUBytes = 0;
+static uint32_t  spiSimFaults   = 0;
+
 static volatile uint32_t alertBits   = 0;
+static volatile uint32_t serialRxBits = 0;
 static volatile uint32_t monitorBits = 0;
 static volatile uint32_t notifyBits  = 0;
 static volatile uint32_t scriptBits  = 0;
@@ -1291,7 +1579,10 @@ static volatile int runState = PI_STARTING;
 
 static int pthAlertRunning  = PI_THREAD_NONE;
 static int pthFifoRunning   = PI_THREAD_NONE;
+static int pthFifoBinRunning = PI_THREAD_NONE;
 static int pthSocketRunning = PI_THREAD_NONE;
+static int pthTimerRunning  = PI_THREAD_NONE;
+static int pthISRRunning    = PI_THREAD_NONE;
 
 static gpioAlert_t      gpioAlert  [PI_MAX_USER_GPIO+1];
 
@@ -1299,6 +1590,15 @@ static eventAlert_t     eventAlert [PI_MAX_EVENT+1];
 
 static gpioISR_t        gpioISR    [PI_MAX_GPIO+1];
 
+/* ISR service, all protected by isrMutex */
+
+static pthread_mutex_t isrMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  isrIdle; /* signalled after each callback */
+
+static uint64_t isrBits;
+static int      isrActive;
+static int      isrStop;
+
 static gpioGetSamples_t gpioGetSamples;
 
 static gpioInfo_t       gpioInfo   [PI_MAX_GPIO+1];
@@ -1308,13 +1608,58 @@ static gpioNotify_t     gpioNotify [PI_NOTIFY_SLOTS];
 static fileInfo_t       fileInfo   [PI_FILE_SLOTS];
 static i2cInfo_t        i2cInfo    [PI_I2C_SLOTS];
 static serInfo_t        serInfo    [PI_SER_SLOTS];
+
+/* buffered serial reads, all protected by serMutex */
+
+static pthread_mutex_t serMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int serStop;
+static int fdSer     = -1;
+static int fdSerWake = -1;
+static int pthSerRunning = PI_THREAD_NONE;
+static pthread_t pthSer;
+
+/* asynchronous I2C, all protected by i2cAsyncMutex */
+
+static pthread_mutex_t i2cAsyncMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  i2cAsyncDone;
+
+static i2cRequest_t i2cRequest[I2C_REQUESTS];
+static i2cWorker_t  i2cWorker [I2C_WORKERS];
+static uint32_t     i2cSeq;
+static int          i2cAsyncStop;
+
+/* periodic sensor reads, all protected by acqMutex */
+
+static pthread_mutex_t acqMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  acqDone  = PTHREAD_COND_INITIALIZER;
+
+static acqInfo_t acqInfo[PI_ACQ_SLOTS];
+
 static spiInfo_t        spiInfo    [PI_SPI_SLOTS];
 
 static gpioScript_t     gpioScript [PI_MAX_SCRIPTS];
 
 static gpioSignal_t     gpioSignal [PI_MAX_SIGNUM+1];
 
-static gpioTimer_t      gpioTimer  [PI_MAX_TIMER+1];
+static gpioTimer_t      gpioTimer  [PI_TIMER_SLOTS];
+static int              gpioTimerId[PI_MAX_TIMER+1];
+
+/* timer wheel, all protected by timerMutex */
+
+static pthread_mutex_t timerMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  timerCond; /* wakes the timer thread */
+static pthread_cond_t  timerIdle; /* signalled after each callback */
+
+static gpioTimer_t *timerWheel[TIMER_LEVELS][TIMER_SLOTS];
+static uint64_t     timerOccupied[TIMER_LEVELS]; /* may have stale bits */
+static gpioTimer_t *timerOverflow;
+static gpioTimer_t *timerDue;
+
+static uint64_t timerNow;   /* wheel time, earlier expiries have fired */
+static uint64_t timerSleep; /* deadline the timer thread waits for */
+static int      timerActive;
+static int      timerStop;
 
 static int pwmFreq[PWM_FREQS];
 
@@ -1325,11 +1670,17 @@ static int pwmFreq[PWM_FREQS];
 static FILE * inpFifo = NULL;
 static FILE * outFifo = NULL;
 
+static int fdBinInp     = -1;
+static int fdBinOut     = -1;
+
 static int fdLock       = -1;
 static int fdMem        = -1;
 static int fdSock       = -1;
 static int fdPmap       = -1;
 static int fdMbox       = -1;
+static int fdISR        = -1;
+static int fdISRWake    = -1;
+static int fdGpioChip   = -1;
 
 static DMAMem_t *dmaMboxBlk = MAP_FAILED;
 static uintptr_t * * dmaPMapBlk = MAP_FAILED;
@@ -1356,6 +1707,9 @@ static volatile uint32_t * systReg = MAP_FAILED;
 static volatile uint32_t * dmaIn   = MAP_FAILED;
 static volatile uint32_t * dmaOut  = MAP_FAILED;
 
+static volatile uint32_t * dmaSpiTx = MAP_FAILED;
+static volatile uint32_t * dmaSpiRx = MAP_FAILED;
+
 static uint32_t hw_clk_freq[3];
 static uint32_t hw_pwm_freq[2];
 static uint32_t hw_pwm_duty[2];
@@ -1371,6 +1725,11 @@ static volatile gpioCfg_t gpioCfg =
    PI_DEFAULT_SOCKET_PORT,
    PI_DEFAULT_IF_FLAGS,
    PI_DEFAULT_MEM_ALLOC_MODE,
+   PI_WAVE_BLOCKS,
+   PI_MAX_WAVES,
+   0, /* SPI DMA tx channel */
+   0, /* SPI DMA rx channel */
+   0, /* SPI DMA threshold, 0 is off */
    0, /* dbgLevel */
    0, /* alertFreq */
    0, /* internals */
@@ -1379,11 +1738,18 @@ static volatile gpioCfg_t gpioCfg =
 /* no initialisation required */
 
 static unsigned bufferBlocks; /* number of blocks in buffer */
+static unsigned dmaBlocks;    /* buffer and wave blocks with page pointers */
+static unsigned dmaMapped;    /* blocks allocated, the wave ones lazily */
 static unsigned bufferCycles; /* number of cycles */
 
 static pthread_t pthAlert;
 static pthread_t pthFifo;
+static pthread_t pthFifoBin;
 static pthread_t pthSocket;
+static pthread_t pthTimer;
+static pthread_t pthISR;
+
+static fifoOut_t fifoOut;
 
 static uint32_t spi_dummy;
 
@@ -1509,12 +1875,25 @@ static int  gpioNotifyOpenInBand(int fd);
 static void initHWClk
    (int clkCtl, int clkDiv, int clkSrc, int divI, int divF, int MASH);
 
+static void initKillDMA(volatile uint32_t *dmaAddr);
 static void initDMAgo(volatile uint32_t  *dmaAddr, uint32_t cbAddr);
 
+static int  initWaveMem(void);
+
 int gpioWaveTxStart(unsigned wave_mode); /* deprecated */
 
 static void closeOrphanedNotifications(int slot, int fd);
 
+static int i2cBatchSocket(
+   unsigned priority, unsigned event, char *buf, unsigned len, int owner);
+
+static int intI2CBatchWait(
+   unsigned id, unsigned timeout, char *buf, unsigned bufSize, int owner);
+
+static void closeOrphanedI2CRequests(int fd);
+
+static void acqHandleClosed(unsigned type, unsigned handle);
+
 
 /* ======================================================================= */
 
@@ -1654,6 +2033,16 @@ static void myGpioSetMode(unsigned gpio, unsigned mode)
    gpioReg[reg] = (gpioReg[reg] & ~(7<<shift)) | (mode<<shift);
 }
 
+static unsigned myGpioGetMode(unsigned gpio)
+{
+   int reg, shift;
+
+   reg   =  gpio/10;
+   shift = (gpio%10) * 3;
+
+   return (gpioReg[reg] >> shift) & 7;
+}
+
 
 /* ----------------------------------------------------------------------- */
 
@@ -1710,6 +2099,50 @@ static uint32_t myGpioDelay(uint32_t micros)
 
 /* ----------------------------------------------------------------------- */
 
+/*
+   Bit banged clock edges are given deadlines, the earliest time each
+   may happen, and the code's own overhead is absorbed into the wait.
+   The next deadline is set from the previous one, so small overshoots
+   do not add up, but from the time of the edge if that was late (e.g.
+   after a preemption), so a late edge never shortens the next phase
+   by more than BB_SLACK_NS.
+*/
+
+static uint64_t myNanos(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ((uint64_t)ts.tv_sec * THOUSAND * MILLION) + ts.tv_nsec;
+}
+
+static uint64_t myNanosWait(uint64_t until)
+{
+   /* returns the time the following edge is taken to happen */
+
+   uint64_t now;
+   uint32_t micros;
+
+   now = myNanos();
+
+   /* sleep through most of a long wait, e.g. at low baud rates */
+
+   if (until > (now + (PI_MAX_BUSY_DELAY * THOUSAND)))
+   {
+      micros = (until - now) / THOUSAND - PI_MAX_BUSY_DELAY;
+      myGpioSleep(micros / MILLION, micros % MILLION);
+   }
+
+   while (now < until) now = myNanos();
+
+   if ((now - until) < BB_SLACK_NS) return until;
+
+   return now;
+}
+
+/* ----------------------------------------------------------------------- */
+
 static void myCreatePipe(char * name, int perm)
 {
    unlink(name);
@@ -1873,6 +2306,22 @@ static int myDoCommand(uintptr_t *p, unsigned bufSize, char *buf)
 
    switch (p[0])
    {
+      case PI_CMD_ACQM: res = acqMonitor(p[1], p[2]); break;
+
+      case PI_CMD_ACQP: res = acqStop(p[1]); break;
+
+      case PI_CMD_ACQR:
+         if (p[2] > bufSize) p[2] = bufSize;
+         res = acqRead(p[1], buf, p[2]);
+         break;
+
+      case PI_CMD_ACQS:
+         memcpy(&tmp1, buf+0, 4); // reg
+         memcpy(&tmp2, buf+4, 4); // len
+         memcpy(&tmp3, buf+8, 4); // micros
+         res = acqStart(p[1], p[2], tmp1, tmp2, tmp3);
+         break;
+
       case PI_CMD_BC1:
          mask = gpioMask;
 
@@ -1977,6 +2426,25 @@ static int myDoCommand(uintptr_t *p, unsigned bufSize, char *buf)
          res = bbSPIClose(p[1]);
          break;
 
+      case PI_CMD_BSPIL:
+
+         memcpy(&tmp1, buf+ 0, 4); // MISOBits
+         memcpy(&tmp2, buf+ 4, 4); // MOSIBits
+         memcpy(&tmp3, buf+ 8, 4); // SCLK
+         memcpy(&tmp4, buf+12, 4); // baud
+         memcpy(&tmp5, buf+16, 4); // flags
+
+         if (!myPermit(p[1]) || !myPermit(tmp3) ||
+             ((tmp1 | tmp2) & ~gpioMask))
+         {
+            DBG(DBG_USER,
+               "bbSPIOpenLanes: no permission to update one or more GPIO");
+            res = PI_NOT_PERMITTED;
+         }
+
+         if (!res) res = bbSPIOpenLanes(p[1], tmp1, tmp2, tmp3, tmp4, tmp5);
+         break;
+
       case PI_CMD_BSPIX:
          if (p[3] > bufSize) p[3] = bufSize;
             res = bbSPIXfer(p[1], buf, buf, p[3]);
@@ -2161,6 +2629,17 @@ static int myDoCommand(uintptr_t *p, unsigned bufSize, char *buf)
          res = i2cWriteWordData(p[1], p[2], p[4]);
          break;
 
+      case PI_CMD_I2CBQ:
+         res = i2cBatchSocket(p[1], p[2], buf, p[3], I2C_OWNER_LOCAL);
+         break;
+
+      case PI_CMD_I2CBR:
+         if (p[1] < I2C_REQUESTS)
+            res = intI2CBatchWait(p[1], p[2], buf, bufSize, I2C_OWNER_LOCAL);
+         else
+            res = PI_BAD_HANDLE;
+         break;
+
       case PI_CMD_I2CZ:
          /* use half buffer for write, half buffer for read */
          if (p[3] > (bufSize/2)) p[3] = bufSize/2;
@@ -2241,6 +2720,14 @@ static int myDoCommand(uintptr_t *p, unsigned bufSize, char *buf)
          res = gpioUpdateScript(p[1], p[3]/4, (uint32_t *)buf);
          break;
 
+      case PI_CMD_PROFR:
+         res = gpioScriptProfileRead(p[1], p[2],
+            bufSize / sizeof(gpioScriptProf_t), (gpioScriptProf_t *)buf);
+         if (res > 0) res *= sizeof(gpioScriptProf_t);
+         break;
+
+      case PI_CMD_PROFS: res = gpioScriptProfile(p[1], p[2]); break;
+
       case PI_CMD_PRRG: res = gpioGetPWMrealRange(p[1]); break;
 
       case PI_CMD_PRS:
@@ -2290,6 +2777,13 @@ static int myDoCommand(uintptr_t *p, unsigned bufSize, char *buf)
 
       case PI_CMD_SERWB: res = serWriteByte(p[1], p[2]); break;
 
+      case PI_CMD_SERB:
+         memcpy(&tmp1, buf+0, 4); // minBytes
+         memcpy(&tmp2, buf+4, 4); // terminator
+         memcpy(&tmp3, buf+8, 4); // event
+         res = serReadBuffer(p[1], p[2], tmp1, tmp2, tmp3);
+         break;
+
       case PI_CMD_SERC: res = serClose(p[1]); break;
 
       case PI_CMD_SERDA: res = serDataAvailable(p[1]); break;
@@ -2322,6 +2816,8 @@ static int myDoCommand(uintptr_t *p, unsigned bufSize, char *buf)
 
       case PI_CMD_SLRI: res = gpioSerialReadInvert(p[1], p[2]); break;
 
+      case PI_CMD_SLRM: res = serialMonitor(p[1], p[2]); break;
+
       case PI_CMD_SPIC:
          res = spiClose(p[1]);
          break;
@@ -2463,6 +2959,8 @@ static int myDoCommand(uintptr_t *p, unsigned bufSize, char *buf)
 
       case PI_CMD_WVDEL: res = gpioWaveDelete(p[1]); break;
 
+      case PI_CMD_WVCMP: res = gpioWaveCompact(); break;
+
       case PI_CMD_WVGO:  res = gpioWaveTxStart(PI_WAVE_MODE_ONE_SHOT); break;
 
       case PI_CMD_WVGOR: res = gpioWaveTxStart(PI_WAVE_MODE_REPEAT); break;
@@ -2935,6 +3433,17 @@ static void waveSetOOL(int pos, uint32_t OOL)
 
 /* ----------------------------------------------------------------------- */
 
+static uint32_t waveGetOOL(int pos)
+{
+   int page, slot;
+
+   waveOOLPageSlot(pos, &page, &slot);
+
+   return dmaOVirt[page]->OOL[slot];
+}
+
+/* ----------------------------------------------------------------------- */
+
 static uint32_t waveOOLPOadr(int pos)
 {
    int page, slot;
@@ -2972,81 +3481,314 @@ static void waveBitDelay
    bitDelay[i] = diff;
 }
 
-static int waveDelayCBs(uint32_t delay)
+static int waveSerialChar(
+   rawWave_t *out,
+   uint32_t mask,
+   unsigned data_bits,
+   unsigned *bitDelay,
+   uint32_t c)
 {
-   uint32_t cbs;
+   /* one character, start bit to stop bit, equal adjacent bits merged */
 
-   if (!delay) return 0;
-   if (gpioCfg.DMAsecondaryChannel < DMA_LITE_FIRST) return 1;
-   cbs = BPD * delay / DMA_LITE_MAX;
-   if  ((BPD * delay) % DMA_LITE_MAX) cbs++;
-   return cbs;
-}
+   int p, b, lev, v;
 
-/* ----------------------------------------------------------------------- */
+   p = 0;
 
-static void waveCBsOOLs(int *numCBs, int *numBOOLs, int *numTOOLs)
-{
-   int numCB=0, numBOOL=0, numTOOL=0;
+   /* start bit */
 
-   unsigned i;
+   out[p].gpioOn  = 0;
+   out[p].gpioOff = mask;
+   out[p].usDelay = bitDelay[0];
+   out[p].flags   = 0;
 
-   unsigned numWaves;
+   lev = 0;
 
-   rawWave_t *waves;
+   for (b=0; b<data_bits; b++)
+   {
+      v = (c >> b) & 1;
 
-   numWaves = wfc[wfcur];
-   waves    = wf [wfcur];
+      if (v == lev) out[p].usDelay += bitDelay[b+1];
+      else
+      {
+         p++;
 
-   /* delay cb at start of DMA */
+         lev = v;
 
-   numCB++;
+         if (lev)
+         {
+            out[p].gpioOn  = mask;
+            out[p].gpioOff = 0;
+         }
+         else
+         {
+            out[p].gpioOn  = 0;
+            out[p].gpioOff = mask;
+         }
 
-   for (i=0; i<numWaves; i++)
+         out[p].usDelay = bitDelay[b+1];
+         out[p].flags   = 0;
+      }
+   }
+
+   /* stop bit */
+
+   if (lev) out[p].usDelay += bitDelay[data_bits+1];
+   else
    {
-      if (waves[i].gpioOn)                 {numBOOL++;}
-      if (waves[i].gpioOff)                {numBOOL++;}
-      if (waves[i].gpioOn || waves[i].gpioOff) {numCB++;}
-      if (waves[i].flags & WAVE_FLAG_READ) {numCB++; numTOOL++;}
-      if (waves[i].flags & WAVE_FLAG_TICK) {numCB++; numTOOL++;}
+      p++;
 
-      numCB += waveDelayCBs(waves[i].usDelay);
+      out[p].gpioOn  = mask;
+      out[p].gpioOff = 0;
+      out[p].usDelay = bitDelay[data_bits+1];
+      out[p].flags   = 0;
    }
 
-   *numCBs   = numCB;
-   *numBOOLs = numBOOL;
-   *numTOOLs = numTOOL;
+   return p+1;
 }
 
-/* ----------------------------------------------------------------------- */
-
-static int wave2Cbs(unsigned wave_mode, int *CB, int *BOOL, int *TOOL,
-                    int numCB, int numBOOL, int numTOOL)
+static waveSerTab_t *waveSerialTable(
+   unsigned gpio, unsigned baud, unsigned data_bits, unsigned stop_bits)
 {
-   int botCB=*CB, botOOL=*BOOL, topOOL=*TOOL;
+   /*
+      The pulses of every character for the gpio at this baud rate
+      and format, built once and kept until the format changes.
+   */
 
-   int status, s_stride;
+   waveSerTab_t *tab;
+   unsigned bitDelay[PI_MAX_WAVE_DATABITS+2];
+   unsigned c;
 
-   rawCbs_t *p=NULL;
+   tab = waveSerTab[gpio];
 
-   unsigned i, repeatCB;
+   if (tab == NULL)
+   {
+      tab = malloc(sizeof(waveSerTab_t) +
+         (256 * WAVE_SER_STRIDE * sizeof(rawWave_t)));
 
-   unsigned numWaves;
+      if (tab == NULL) return NULL;
 
-   unsigned delayCBs, dcb;
+      tab->baud  = 0;
+      tab->pulse = (rawWave_t *)(tab + 1);
 
-   uint32_t delayLeft;
+      waveSerTab[gpio] = tab;
+   }
 
-   rawWave_t * waves;
+   if ((tab->baud      == baud)      &&
+       (tab->data_bits == data_bits) &&
+       (tab->stop_bits == stop_bits)) return tab;
 
-   numWaves = wfc[wfcur];
-   waves    = wf [wfcur];
+   waveBitDelay(baud, data_bits, stop_bits, bitDelay);
 
-   /* add delay cb at start of DMA */
+   for (c=0; c<(1<<data_bits); c++)
+   {
+      tab->count[c] = waveSerialChar(
+         tab->pulse + (c * WAVE_SER_STRIDE), (1<<gpio),
+         data_bits, bitDelay, c);
+   }
 
-   p = rawWaveCBAdr(botCB++);
+   tab->baud      = baud;
+   tab->data_bits = data_bits;
+   tab->stop_bits = stop_bits;
+   tab->bitDelay0 = bitDelay[0];
 
-   /* use the secondary clock */
+   return tab;
+}
+
+static void waveSerialFree(void)
+{
+   int i;
+
+   for (i=0; i<=PI_MAX_USER_GPIO; i++)
+   {
+      free(waveSerTab[i]);
+      waveSerTab[i] = NULL;
+   }
+}
+
+static int waveSerialEncode(
+   rawWave_t *out,
+   unsigned maxPulses,
+   unsigned gpio,
+   unsigned baud,
+   unsigned data_bits,
+   unsigned stop_bits,
+   unsigned offset,
+   unsigned numChars,
+   char *bstr)
+{
+   /*
+      Returns the number of pulses in out, else PI_TOO_MANY_PULSES.
+      The characters of up to 8 bits are copied from the gpio's
+      table, wider ones are built a bit at a time.
+   */
+
+   waveSerTab_t *tab = NULL;
+   unsigned bitDelay[PI_MAX_WAVE_DATABITS+2];
+   unsigned i, p, first;
+   uint32_t c, mask;
+
+   uint16_t *wstr = (uint16_t *)bstr;
+   uint32_t *lstr = (uint32_t *)bstr;
+
+   if (data_bits < 9) tab = waveSerialTable(gpio, baud, data_bits, stop_bits);
+
+   if (tab) first = tab->bitDelay0;
+   else
+   {
+      waveBitDelay(baud, data_bits, stop_bits, bitDelay);
+      first = bitDelay[0];
+   }
+
+   mask = 1<<gpio;
+
+   /* idle high until the offset */
+
+   out[0].gpioOn  = mask;
+   out[0].gpioOff = 0;
+   out[0].flags   = 0;
+
+   if (offset > first) out[0].usDelay = offset;
+   else                out[0].usDelay = first;
+
+   p = 1;
+
+   for (i=0; i<numChars; i++)
+   {
+      if ((p + data_bits + 2) > maxPulses) return PI_TOO_MANY_PULSES;
+
+      if (tab)
+      {
+         c = (uint8_t)bstr[i] & ((1<<data_bits) - 1);
+
+         memcpy(out + p, tab->pulse + (c * WAVE_SER_STRIDE),
+            tab->count[c] * sizeof(rawWave_t));
+
+         p += tab->count[c];
+      }
+      else
+      {
+         if      (data_bits <  9) c = (uint8_t)bstr[i];
+         else if (data_bits < 17) c = wstr[i];
+         else                     c = lstr[i];
+
+         p += waveSerialChar(out + p, mask, data_bits, bitDelay, c);
+      }
+   }
+
+   return p;
+}
+
+static int waveSerialCheck(
+   unsigned gpio,
+   unsigned baud,
+   unsigned data_bits,
+   unsigned stop_bits,
+   unsigned offset,
+   unsigned numBytes)
+{
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+
+   if ((baud < PI_WAVE_MIN_BAUD) || (baud > PI_WAVE_MAX_BAUD))
+      SOFT_ERROR(PI_BAD_WAVE_BAUD, "bad baud rate (%d)", baud);
+
+   if ((data_bits < PI_MIN_WAVE_DATABITS) ||
+       (data_bits > PI_MAX_WAVE_DATABITS))
+      SOFT_ERROR(PI_BAD_DATABITS, "bad number of databits (%d)", data_bits);
+
+   if ((stop_bits < PI_MIN_WAVE_HALFSTOPBITS) ||
+       (stop_bits > PI_MAX_WAVE_HALFSTOPBITS))
+      SOFT_ERROR(PI_BAD_STOPBITS,
+         "bad number of (half) stop bits (%d)", stop_bits);
+
+   if (numBytes > PI_WAVE_MAX_CHARS)
+      SOFT_ERROR(PI_TOO_MANY_CHARS, "too many chars (%d)", numBytes);
+
+   if (offset > PI_WAVE_MAX_MICROS)
+      SOFT_ERROR(PI_BAD_SER_OFFSET, "offset too large (%d)", offset);
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int waveDelayCBs(uint32_t delay)
+{
+   uint64_t bytes;
+   uint32_t cbs;
+
+   if (!delay) return 0;
+   if (gpioCfg.DMAsecondaryChannel < DMA_LITE_FIRST) return 1;
+   bytes = (uint64_t)BPD * delay;
+   cbs = bytes / DMA_LITE_MAX;
+   if  (bytes % DMA_LITE_MAX) cbs++;
+   return cbs;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void waveCBsOOLs(int *numCBs, int *numBOOLs, int *numTOOLs)
+{
+   int numCB=0, numBOOL=0, numTOOL=0;
+
+   unsigned i;
+
+   unsigned numWaves;
+
+   rawWave_t *waves;
+
+   numWaves = wfc[wfcur];
+   waves    = wf [wfcur];
+
+   /* delay cb at start of DMA */
+
+   numCB++;
+
+   for (i=0; i<numWaves; i++)
+   {
+      if (waves[i].gpioOn)                 {numBOOL++;}
+      if (waves[i].gpioOff)                {numBOOL++;}
+      if (waves[i].gpioOn || waves[i].gpioOff) {numCB++;}
+      if (waves[i].flags & WAVE_FLAG_READ) {numCB++; numTOOL++;}
+      if (waves[i].flags & WAVE_FLAG_TICK) {numCB++; numTOOL++;}
+
+      numCB += waveDelayCBs(waves[i].usDelay);
+   }
+
+   *numCBs   = numCB;
+   *numBOOLs = numBOOL;
+   *numTOOLs = numTOOL;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int wave2Cbs(unsigned wave_mode, int *CB, int *BOOL, int *TOOL,
+                    int numCB, int numBOOL, int numTOOL)
+{
+   int botCB=*CB, botOOL=*BOOL, topOOL=*TOOL;
+
+   int status, s_stride;
+
+   rawCbs_t *p=NULL;
+
+   unsigned i, repeatCB;
+
+   unsigned numWaves;
+
+   unsigned delayCBs, dcb;
+
+   uint32_t delayLeft;
+
+   rawWave_t * waves;
+
+   numWaves = wfc[wfcur];
+   waves    = wf [wfcur];
+
+   /* add delay cb at start of DMA */
+
+   p = rawWaveCBAdr(botCB++);
+
+   /* use the secondary clock */
 
    if (gpioCfg.clockPeriph != PI_CLOCK_PCM)
    {
@@ -3212,744 +3954,846 @@ static int wave2Cbs(unsigned wave_mode, int *CB, int *BOOL, int *TOOL,
 
 /* ----------------------------------------------------------------------- */
 
-static void waveRxSerial(wfRx_t *w, int level, uint32_t tick)
+static void waveFreeReset(void)
 {
-   int diffTicks, lastLevel;
-   int newWritePos;
+   if (!waveMax) return;
 
-   level = level ^ w->s.invert;
+   waveFreeCB[0].start = WAVE_BASE_CB;
+   waveFreeCB[0].len   = NUM_WAVE_CBS - WAVE_BASE_CB;
+   waveFreeCBs = 1;
 
-   if (w->s.bit >= 0)
-   {
-      diffTicks = tick - w->s.startBitTick;
+   waveFreeOOL[0].start = WAVE_BASE_OOL;
+   waveFreeOOL[0].len   = NUM_WAVE_OOL - WAVE_BASE_OOL;
+   waveFreeOOLs = 1;
+}
 
-      if (level != PI_TIMEOUT)
-      {
-         w->s.level = level;
-         lastLevel = !level;
-      }
-      else lastLevel = w->s.level;
+/* ----------------------------------------------------------------------- */
 
-      while ((w->s.bit <= w->s.dataBits) &&
-             (diffTicks > (w->s.nextBitDiff/1000)))
-      {
-         if (w->s.bit)
-         {
-            if (lastLevel) w->s.data |= (1<<(w->s.bit-1));
-         }
-         else w->s.data = 0;
+static int waveSpanAlloc(waveSpan_t *span, int *spans, int len)
+{
+   /* best fit, lowest address on a tie, -1 if nothing fits */
 
-         ++(w->s.bit);
+   int i, best, start;
 
-         w->s.nextBitDiff += w->s.fullBit;
-      }
+   if (len <= 0) return 0;
 
-      if (w->s.bit > w->s.dataBits)
-      {
-         memcpy(w->s.buf + w->s.writePos, &w->s.data, w->s.bytes);
+   best = -1;
 
-         /* don't let writePos catch readPos */
+   for (i=0; i<*spans; i++)
+   {
+      if ((span[i].len >= len) &&
+          ((best < 0) || (span[i].len < span[best].len))) best = i;
+   }
 
-         newWritePos = (w->s.writePos + w->s.bytes) % (w->s.bufSize);
+   if (best < 0) return -1;
 
-         if (newWritePos != w->s.readPos) w->s.writePos = newWritePos;
+   start = span[best].start;
 
-         if (level == 0)
-         {
-            gpioSetWatchdog(w->gpio, w->s.timeout);
-            w->s.bit          = 0;
-            w->s.startBitTick = tick;
-            w->s.nextBitDiff  = w->s.halfBit;
-         }
-         else
-         {
-            w->s.bit = -1;
-            gpioSetWatchdog(w->gpio, 0);
-         }
-      }
+   span[best].start += len;
+   span[best].len   -= len;
+
+   if (!span[best].len)
+   {
+      (*spans)--;
+      memmove(&span[best], &span[best+1], (*spans-best)*sizeof(waveSpan_t));
    }
-   else
+
+   return start;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void waveSpanFree(waveSpan_t *span, int *spans, int start, int len)
+{
+   /* return a span to the list, merging it with its neighbours */
+
+   int i;
+
+   if (len <= 0) return;
+
+   for (i=0; (i<*spans) && (span[i].start < start); i++) ;
+
+   if ((i > 0) && ((span[i-1].start + span[i-1].len) == start))
    {
-      /* start bit if high->low */
+      span[i-1].len += len;
 
-      if (level == 0)
+      if ((i < *spans) && ((start + len) == span[i].start))
       {
-         gpioSetWatchdog(w->gpio, w->s.timeout);
-         w->s.level        = 0;
-         w->s.bit          = 0;
-         w->s.startBitTick = tick;
-         w->s.nextBitDiff  = w->s.halfBit;
+         span[i-1].len += span[i].len;
+         (*spans)--;
+         memmove(&span[i], &span[i+1], (*spans-i)*sizeof(waveSpan_t));
       }
    }
+   else if ((i < *spans) && ((start + len) == span[i].start))
+   {
+      span[i].start = start;
+      span[i].len  += len;
+   }
+   else
+   {
+      memmove(&span[i+1], &span[i], (*spans-i)*sizeof(waveSpan_t));
+      span[i].start = start;
+      span[i].len   = len;
+      (*spans)++;
+   }
 }
 
-
 /* ----------------------------------------------------------------------- */
 
-static void waveRxBit(int gpio, int level, uint32_t tick)
+static int waveAllocate(int numCB, int numBOOL, int numTOOL)
 {
-   switch (wfRx[gpio].mode)
+   /*
+      Find a wave id and space for the wave's CBs and OOLs.  The OOLs
+      are one span, BOOLs climbing from its bottom and TOOLs descending
+      from its top.
+   */
+
+   int wid, CB, OOL;
+
+   for (wid=0; wid<waveOutCount; wid++)
    {
-      case PI_WFRX_SERIAL:
-         waveRxSerial(&wfRx[gpio], level, tick);
+      if (waveInfo[wid].deleted) break;
    }
-}
 
+   if (wid >= waveMax) return PI_NO_WAVEFORM_ID;
 
-/* ----------------------------------------------------------------------- */
+   CB = waveSpanAlloc(waveFreeCB, &waveFreeCBs, numCB);
 
-int rawWaveAddGeneric(unsigned numIn1, rawWave_t *in1)
-{
-   unsigned inPos1=0, inPos2=0, outPos=0, level = NUM_WAVE_OOL;
+   if (CB < 0) return PI_TOO_MANY_CBS;
 
-   unsigned cbs=0;
+   OOL = waveSpanAlloc(waveFreeOOL, &waveFreeOOLs, numBOOL + numTOOL);
 
-   unsigned numIn2, numOut;
+   if (OOL < 0)
+   {
+      waveSpanFree(waveFreeCB, &waveFreeCBs, CB, numCB);
+      return PI_TOO_MANY_OOL;
+   }
 
-   uint32_t tNow, tNext1, tNext2, tDelay, tMax;
+   if (wid == waveOutCount) waveOutCount++;
 
-   rawWave_t *in2, *out;
+   waveRefs[wid] = 1;
 
-   numIn2 = wfc[wfcur];
-   in2    = wf[wfcur];
+   waveInfo[wid].botCB   = CB;
+   waveInfo[wid].topCB   = CB + numCB - 1;
+   waveInfo[wid].botOOL  = OOL;
+   waveInfo[wid].topOOL  = OOL + numBOOL + numTOOL;
+   waveInfo[wid].numCB   = numCB;
+   waveInfo[wid].numBOOL = numBOOL;
+   waveInfo[wid].numTOOL = numTOOL;
 
-   numOut = PI_WAVE_MAX_PULSES;
-   out   = wf[1-wfcur];
+   return wid;
+}
 
-   tNow = 0;
-   tMax = 0;
+/* ----------------------------------------------------------------------- */
 
-   if (!numIn1) tNext1 = -1; else tNext1 = 0;
-   if (!numIn2) tNext2 = -1; else tNext2 = 0;
+static void waveRelease(int wid)
+{
+   free(waveKept[wid]);
+   waveKept[wid] = NULL;
 
-   while (((inPos1<numIn1) || (inPos2<numIn2)) && (outPos<numOut))
-   {
-      if (tNext1 < tNext2)
-      {
-         /* pulse 1 due */
+   waveSpanFree(waveFreeCB, &waveFreeCBs,
+      waveInfo[wid].botCB, waveInfo[wid].numCB);
 
-         if (tNow < tNext1)
-         {
-            /* extend previous delay */
-            out[outPos-1].usDelay += (tNext1 - tNow);
-            tNow = tNext1;
-         }
+   waveSpanFree(waveFreeOOL, &waveFreeOOLs,
+      waveInfo[wid].botOOL, waveInfo[wid].numBOOL + waveInfo[wid].numTOOL);
+}
 
-         out[outPos].gpioOn  = in1[inPos1].gpioOn;
-         out[outPos].gpioOff = in1[inPos1].gpioOff;
-         out[outPos].flags   = in1[inPos1].flags;
+/* ----------------------------------------------------------------------- */
 
-         tNext1 = tNow + in1[inPos1].usDelay; ++inPos1;
-         if (tMax < tNext1) tMax = tNext1;
-      }
-      else if (tNext2 < tNext1)
-      {
-         /* pulse 2 due */
-
-         if (tNow < tNext2)
-         {
-            /* extend previous delay */
-            out[outPos-1].usDelay += (tNext2 - tNow);
-            tNow = tNext2;
-         }
-
-         out[outPos].gpioOn  = in2[inPos2].gpioOn;
-         out[outPos].gpioOff = in2[inPos2].gpioOff;
-         out[outPos].flags   = in2[inPos2].flags;
-
-         tNext2 = tNow + in2[inPos2].usDelay; ++inPos2;
-         if (tMax < tNext2) tMax = tNext2;
-      }
-      else
-      {
-         /* pulse 1 and 2 both due */
-
-         if (tNow < tNext1)
-         {
-            /* extend previous delay */
-            out[outPos-1].usDelay += (tNext1 - tNow);
-            tNow = tNext1;
-         }
-
-         out[outPos].gpioOn  = in1[inPos1].gpioOn  | in2[inPos2].gpioOn;
-         out[outPos].gpioOff = in1[inPos1].gpioOff | in2[inPos2].gpioOff;
-         out[outPos].flags   = in1[inPos1].flags   | in2[inPos2].flags;
+static int waveSlotOf(int wid)
+{
+   int s;
 
-         tNext1 = tNow + in1[inPos1].usDelay; ++inPos1;
-         tNext2 = tNow + in2[inPos2].usDelay; ++inPos2;
-         if (tMax < tNext1) tMax = tNext1;
-         if (tMax < tNext2) tMax = tNext2;
-      }
+   for (s=0; s<PI_MAX_WAVE_SLOTS; s++)
+   {
+      if (waveSlot[s].used &&
+         ((waveSlot[s].wid[0] == wid) || (waveSlot[s].wid[1] == wid)))
+         return s;
+   }
 
-      if (tNext1 <= tNext2) { tDelay = tNext1 - tNow; tNow = tNext1; }
-      else                  { tDelay = tNext2 - tNow; tNow = tNext2; }
+   return -1;
+}
 
-      out[outPos].usDelay = tDelay;
+/* ----------------------------------------------------------------------- */
 
-      cbs += waveDelayCBs(tDelay);
+static void waveSlotFree(int s)
+{
+   free(waveSlot[s].cbOff);
+   free(waveSlot[s].delays);
+   free(waveSlot[s].pulse[0]);
+   free(waveSlot[s].pulse[1]);
 
-      if (out[outPos].gpioOn || out[outPos].gpioOff) cbs++;
+   memset(&waveSlot[s], 0, sizeof(waveSlot_t));
+}
 
-      if (out[outPos].flags & WAVE_FLAG_READ)
-      {
-         cbs++; /* one cb if read */
-         --level;
-      }
+/* ----------------------------------------------------------------------- */
 
-      if (out[outPos].flags & WAVE_FLAG_TICK)
-      {
-         cbs++; /* one cb if tick */
-         --level;
-      }
+static void waveStreamFree(void)
+{
+   free(waveStream.count);
+   free(waveStream.stage);
 
-      outPos++;
+   memset(&waveStream, 0, sizeof(waveStream_t));
+}
 
-      if (inPos1 >= numIn1) tNext1 = -1;
-      if (inPos2 >= numIn2) tNext2 = -1;
+/* ----------------------------------------------------------------------- */
 
-   }
+static void waveCacheReset(void)
+{
+   int i;
 
-   if (tNow < tMax)
+   for (i=0; i<waveMax; i++)
    {
-      /* extend previous delay */
-      out[outPos-1].usDelay += (tMax - tNow);
-      tNow = tMax;
+      free(waveKept[i]);
+      waveKept[i] = NULL;
    }
+}
 
-   if ((outPos < numOut) && (outPos < level))
-   {
-      wfStats.micros = tNow;
+/* ----------------------------------------------------------------------- */
 
-      if (tNow > wfStats.highMicros) wfStats.highMicros = tNow;
+static uint32_t waveCacheHash(rawWave_t *waves, int numWaves)
+{
+   /* FNV-1a over the merged pulse list */
 
-      wfStats.pulses = outPos;
+   uint32_t h = 2166136261U;
+   uint8_t *p = (uint8_t *)waves;
+   size_t i, len = numWaves * sizeof(rawWave_t);
 
-      if (outPos > wfStats.highPulses) wfStats.highPulses = outPos;
+   for (i=0; i<len; i++) h = (h ^ p[i]) * 16777619U;
 
-      wfStats.cbs    = cbs;
+   return h;
+}
 
-      if (cbs > wfStats.highCbs) wfStats.highCbs = cbs;
+/* ----------------------------------------------------------------------- */
 
-      wfc[1-wfcur] = outPos;
-      wfcur = 1 - wfcur;
+static int waveCacheFind(uint32_t hash, rawWave_t *waves, int numWaves)
+{
+   int i;
 
-      return outPos;
+   for (i=0; i<waveOutCount; i++)
+   {
+      if (waveKept[i] && !waveInfo[i].deleted &&
+          (waveHash[i] == hash) && (waveKeptLen[i] == numWaves) &&
+          !memcmp(waveKept[i], waves, numWaves * sizeof(rawWave_t)))
+         return i;
    }
-   else return PI_TOO_MANY_PULSES;
+
+   return -1;
 }
 
-/* ======================================================================= */
+/* ----------------------------------------------------------------------- */
 
-int i2cWriteQuick(unsigned handle, unsigned bit)
+static void waveCacheKeep(int wid, uint32_t hash, rawWave_t *waves, int numWaves)
 {
-   int status;
+   int i;
 
-   DBG(DBG_USER, "handle=%d bit=%d", handle, bit);
+   /* waves which read into their OOLs are not shared */
 
-   CHECK_INITED;
+   for (i=0; i<numWaves; i++)
+   {
+      if (waves[i].flags & (WAVE_FLAG_READ | WAVE_FLAG_TICK)) return;
+   }
 
-   if (handle >= PI_I2C_SLOTS)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+   waveKept[wid] = malloc(numWaves * sizeof(rawWave_t));
 
-   if (i2cInfo[handle].state != PI_I2C_OPENED)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+   if (waveKept[wid] == NULL) return; /* just not cached */
 
-   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_QUICK) == 0)
-      SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+   memcpy(waveKept[wid], waves, numWaves * sizeof(rawWave_t));
 
-   if (bit > 1)
-      SOFT_ERROR(PI_BAD_PARAM, "bad bit (%d)", bit);
+   waveHash[wid]    = hash;
+   waveKeptLen[wid] = numWaves;
+}
 
-   status = my_smbus_access(
-      i2cInfo[handle].fd, bit, 0, PI_I2C_SMBUS_QUICK, NULL);
+/* ----------------------------------------------------------------------- */
 
-   if (status < 0)
-   {
-      DBG(DBG_USER, "error=%d (%m)", status);
-      return PI_I2C_WRITE_FAILED;
-   }
+static void waveRxSerialFrame(wfRx_t *w)
+{
+   w->s.frameBits = w->s.dataBits + 1;
 
-   return status;
+   if (w->s.parity != PI_BB_SER_PARITY_NONE) w->s.frameBits++;
+
+   w->s.frameTicks = (w->s.halfBit + (w->s.frameBits * w->s.fullBit))/1000;
 }
 
-int i2cReadByte(unsigned handle)
+static int waveRxSerial(wfRx_t *w, int level, uint32_t tick)
 {
-   union my_smbus_data data;
-   int status;
-
-   DBG(DBG_USER, "handle=%d", handle);
-
-   CHECK_INITED;
+   /*
+      level is PI_TIMEOUT once the frame should have ended.  Returns
+      1 if a character was stored while a thread waits.  Call with
+      the GPIO's mutex held.
+   */
 
-   if (handle >= PI_I2C_SLOTS)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+   int diffTicks, lastLevel;
+   int newWritePos;
+   int wake = 0;
 
-   if (i2cInfo[handle].state != PI_I2C_OPENED)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+   if (level != PI_TIMEOUT) level = level ^ w->s.invert;
 
-   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_READ_BYTE) == 0)
-      SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+   if (w->s.bit >= 0)
+   {
+      diffTicks = tick - w->s.startBitTick;
 
-   status = my_smbus_access(
-      i2cInfo[handle].fd, PI_I2C_SMBUS_READ, 0, PI_I2C_SMBUS_BYTE, &data);
+      if (level != PI_TIMEOUT)
+      {
+         w->s.level = level;
+         lastLevel = !level;
+      }
+      else lastLevel = w->s.level;
 
-   if (status < 0)
-   {
-      DBG(DBG_USER, "error=%d (%m)", status);
-      return PI_I2C_READ_FAILED;
-   }
+      while ((w->s.bit <= w->s.frameBits) &&
+             (diffTicks > (w->s.nextBitDiff/1000)))
+      {
+         if (w->s.bit == 0)
+         {
+            w->s.data = 0;
+            w->s.ones = 0;
+         }
+         else if (w->s.bit <= w->s.dataBits)
+         {
+            if (lastLevel)
+            {
+               w->s.data |= (1U<<(w->s.bit-1));
+               w->s.ones++;
+            }
+         }
+         else if (w->s.bit < w->s.frameBits)
+         {
+            /* parity bit */
 
-   return 0xFF & data.byte;
-}
+            if (lastLevel) w->s.ones++;
+         }
+         else if (!lastLevel) w->s.framingErrs++; /* stop bit */
 
+         ++(w->s.bit);
 
-int i2cWriteByte(unsigned handle, unsigned bVal)
-{
-   int status;
+         w->s.nextBitDiff += w->s.fullBit;
+      }
 
-   DBG(DBG_USER, "handle=%d bVal=%d", handle, bVal);
+      if (w->s.bit > w->s.frameBits)
+      {
+         if (w->s.parity &&
+            ((w->s.ones & 1) != (w->s.parity == PI_BB_SER_PARITY_ODD)))
+               w->s.parityErrs++;
 
-   CHECK_INITED;
+         memcpy(w->s.buf + w->s.writePos, &w->s.data, w->s.bytes);
 
-   if (handle >= PI_I2C_SLOTS)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+         /* don't let writePos catch readPos */
 
-   if (i2cInfo[handle].state != PI_I2C_OPENED)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+         newWritePos = (w->s.writePos + w->s.bytes) % (w->s.bufSize);
 
-   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_WRITE_BYTE) == 0)
-      SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+         if (newWritePos != w->s.readPos) w->s.writePos = newWritePos;
 
-   if (bVal > 0xFF)
-      SOFT_ERROR(PI_BAD_PARAM, "bad bVal (%d)", bVal);
+         /* each waiter checks its own terminator */
 
-   status = my_smbus_access(
-            i2cInfo[handle].fd,
-            PI_I2C_SMBUS_WRITE,
-            bVal,
-            PI_I2C_SMBUS_BYTE,
-            NULL);
+         if (w->s.waiters) wake = 1;
 
-   if (status < 0)
+         if (level == 0)
+         {
+            w->s.bit          = 0;
+            w->s.startBitTick = tick;
+            w->s.nextBitDiff  = w->s.halfBit;
+         }
+         else w->s.bit = -1;
+      }
+   }
+   else
    {
-      DBG(DBG_USER, "error=%d (%m)", status);
-      return PI_I2C_WRITE_FAILED;
+      /* start bit if high->low */
+
+      if (level == 0)
+      {
+         w->s.level        = 0;
+         w->s.bit          = 0;
+         w->s.startBitTick = tick;
+         w->s.nextBitDiff  = w->s.halfBit;
+      }
    }
 
-   return status;
+   return wake;
 }
 
+/* ----------------------------------------------------------------------- */
 
-int i2cReadByteData(unsigned handle, unsigned reg)
+static int waveRxSerialReady(wfRx_t *w, unsigned terminator)
 {
-   union my_smbus_data data;
-   int status;
+   /*
+      Returns the unread bytes if they hold terminator (or any
+      byte for PI_BB_SER_ANY), otherwise 0.  Call with the GPIO's
+      mutex held.
+   */
 
-   DBG(DBG_USER, "handle=%d reg=%d", handle, reg);
+   int pos, wpos, bytes;
+   uint32_t c;
 
-   CHECK_INITED;
+   pos  = w->s.readPos;
+   wpos = w->s.writePos;
 
-   if (handle >= PI_I2C_SLOTS)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+   bytes = wpos - pos;
 
-   if (i2cInfo[handle].state != PI_I2C_OPENED)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+   if (bytes < 0) bytes += w->s.bufSize;
 
-   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_READ_BYTE_DATA) == 0)
-      SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+   if (!bytes || (terminator == PI_BB_SER_ANY)) return bytes;
 
-   if (reg > 0xFF)
-      SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
+   while (pos != wpos)
+   {
+      c = 0;
 
-   status = my_smbus_access(i2cInfo[handle].fd,
-            PI_I2C_SMBUS_READ, reg, PI_I2C_SMBUS_BYTE_DATA, &data);
+      memcpy(&c, w->s.buf + pos, w->s.bytes);
 
-   if (status < 0)
-   {
-      DBG(DBG_USER, "error=%d (%m)", status);
-      return PI_I2C_READ_FAILED;
+      if (c == terminator) return bytes;
+
+      pos = (pos + w->s.bytes) % w->s.bufSize;
    }
 
-   return 0xFF & data.byte;
+   return 0;
 }
 
+/* ----------------------------------------------------------------------- */
 
-int i2cWriteByteData(unsigned handle, unsigned reg, unsigned bVal)
+static void waveRxSerialSamples(
+   gpioSample_t *sample, int numSamples, uint32_t eTick)
 {
-   union my_smbus_data data;
+   /*
+      Decodes every serial read GPIO in one pass over the samples.
+      A frame still open at eTick past its last bit is ended there,
+      which replaces a watchdog per GPIO.
+   */
 
-   int status;
+   static uint32_t lastLevel = 0, lastBits = 0;
 
-   DBG(DBG_USER, "handle=%d reg=%d bVal=%d", handle, reg, bVal);
+   uint32_t bits, oldLevel, newLevel, changes, wakeBits;
+   wfRx_t *w;
+   int d, b;
 
-   CHECK_INITED;
+   bits = serialRxBits;
 
-   if (handle >= PI_I2C_SLOTS)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
-
-   if (i2cInfo[handle].state != PI_I2C_OPENED)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+   if (!bits)
+   {
+      lastBits = 0;
+      return;
+   }
 
-   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_WRITE_BYTE_DATA) == 0)
-      SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+   /*
+      Hold each GPIO's mutex for the pass so a reader or
+      gpioSerialReadClose can't change the buffer under the decoder.
+      Always locked in ascending order.
+   */
 
-   if (reg > 0xFF)
-      SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
+   changes = bits;
 
-   if (bVal > 0xFF)
-      SOFT_ERROR(PI_BAD_PARAM, "bad bVal (%d)", bVal);
+   while (changes)
+   {
+      b = __builtin_ctz(changes);
 
-   data.byte = bVal;
+      changes &= (changes - 1);
 
-   status = my_smbus_access(
-            i2cInfo[handle].fd,
-            PI_I2C_SMBUS_WRITE,
-            reg,
-            PI_I2C_SMBUS_BYTE_DATA,
-            &data);
+      wfRx_lock(b);
 
-   if (status < 0)
-   {
-      DBG(DBG_USER, "error=%d (%m)", status);
-      return PI_I2C_WRITE_FAILED;
+      if (wfRx[b].mode != PI_WFRX_SERIAL)
+      {
+         wfRx_unlock(b);
+         bits &= ~(1<<b);
+      }
    }
 
-   return status;
-}
-
+   /* GPIO opened since the last pass start from the reported level */
 
-int i2cReadWordData(unsigned handle, unsigned reg)
-{
-   union my_smbus_data data;
-   int status;
+   oldLevel = (lastLevel & lastBits & bits) |
+              (reportedLevel & bits & ~lastBits);
 
-   DBG(DBG_USER, "handle=%d reg=%d", handle, reg);
+   lastBits = bits;
 
-   CHECK_INITED;
+   wakeBits = 0;
 
-   if (handle >= PI_I2C_SLOTS)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+   for (d=0; d<numSamples; d++)
+   {
+      newLevel = sample[d].level & bits;
 
-   if (i2cInfo[handle].state != PI_I2C_OPENED)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+      changes = newLevel ^ oldLevel;
 
-   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_READ_WORD_DATA) == 0)
-      SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+      while (changes)
+      {
+         b = __builtin_ctz(changes);
 
-   if (reg > 0xFF)
-      SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
+         changes &= (changes - 1);
 
-   status = (my_smbus_access(
-      i2cInfo[handle].fd,
-      PI_I2C_SMBUS_READ,
-      reg,
-      PI_I2C_SMBUS_WORD_DATA,
-      &data));
+         if (waveRxSerial(&wfRx[b], (newLevel >> b) & 1, sample[d].tick))
+            wakeBits |= (1<<b);
+      }
 
-   if (status < 0)
-   {
-      DBG(DBG_USER, "error=%d (%m)", status);
-      return PI_I2C_READ_FAILED;
+      oldLevel = newLevel;
    }
 
-   return 0xFFFF & data.word;
-}
+   lastLevel = oldLevel;
 
+   while (bits)
+   {
+      b = __builtin_ctz(bits);
 
-int i2cWriteWordData(unsigned handle, unsigned reg, unsigned wVal)
-{
-   union my_smbus_data data;
+      bits &= (bits - 1);
 
-   int status;
+      w = &wfRx[b];
 
-   DBG(DBG_USER, "handle=%d reg=%d wVal=%d", handle, reg, wVal);
+      if ((w->s.bit >= 0) &&
+          ((uint32_t)(eTick - w->s.startBitTick) > w->s.frameTicks))
+      {
+         if (waveRxSerial(w, PI_TIMEOUT, eTick)) wakeBits |= (1<<b);
+      }
 
-   CHECK_INITED;
+      /* at most one wakeup per GPIO per pass */
 
-   if (handle >= PI_I2C_SLOTS)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+      if (wakeBits & (1<<b)) pthread_cond_broadcast(&w->cond);
 
-   if (i2cInfo[handle].state != PI_I2C_OPENED)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+      wfRx_unlock(b);
+   }
+}
 
-   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_WRITE_WORD_DATA) == 0)
-      SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+/* ----------------------------------------------------------------------- */
 
-   if (reg > 0xFF)
-      SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
+static int waveAddDone(unsigned outPos, unsigned numOut, unsigned level,
+                       uint32_t tNow, unsigned cbs);
 
-   if (wVal > 0xFFFF)
-      SOFT_ERROR(PI_BAD_PARAM, "bad wVal (%d)", wVal);
+/* ----------------------------------------------------------------------- */
 
-   data.word = wVal;
+int rawWaveAddGeneric(unsigned numIn1, rawWave_t *in1)
+{
+   unsigned inPos1=0, inPos2=0, outPos=0, level = NUM_WAVE_OOL;
 
-   status = my_smbus_access(
-            i2cInfo[handle].fd,
-            PI_I2C_SMBUS_WRITE,
-            reg,
-            PI_I2C_SMBUS_WORD_DATA,
-            &data);
+   unsigned cbs=0;
 
-   if (status < 0)
-   {
-      DBG(DBG_USER, "error=%d (%m)", status);
-      return PI_I2C_WRITE_FAILED;
-   }
+   unsigned numIn2, numOut;
 
-   return status;
-}
+   uint32_t tNow, tNext1, tNext2, tDelay, tMax;
 
+   rawWave_t *in2, *out;
 
-int i2cProcessCall(unsigned handle, unsigned reg, unsigned wVal)
-{
-   union my_smbus_data data;
-   int status;
+   numIn2 = wfc[wfcur];
+   in2    = wf[wfcur];
 
-   DBG(DBG_USER, "handle=%d reg=%d wVal=%d", handle, reg, wVal);
+   numOut = PI_WAVE_MAX_PULSES;
+   out   = wf[1-wfcur];
 
-   CHECK_INITED;
+   tNow = 0;
+   tMax = 0;
 
-   if (handle >= PI_I2C_SLOTS)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+   if (!numIn1) tNext1 = -1; else tNext1 = 0;
+   if (!numIn2) tNext2 = -1; else tNext2 = 0;
 
-   if (i2cInfo[handle].state != PI_I2C_OPENED)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+   while (((inPos1<numIn1) || (inPos2<numIn2)) && (outPos<numOut))
+   {
+      if (tNext1 < tNext2)
+      {
+         /* pulse 1 due */
 
-   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_PROC_CALL) == 0)
-      SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+         if (tNow < tNext1)
+         {
+            /* extend previous delay */
+            out[outPos-1].usDelay += (tNext1 - tNow);
+            tNow = tNext1;
+         }
 
-   if (reg > 0xFF)
-      SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
+         out[outPos].gpioOn  = in1[inPos1].gpioOn;
+         out[outPos].gpioOff = in1[inPos1].gpioOff;
+         out[outPos].flags   = in1[inPos1].flags;
 
-   if (wVal > 0xFFFF)
-      SOFT_ERROR(PI_BAD_PARAM, "bad wVal (%d)", wVal);
+         tNext1 = tNow + in1[inPos1].usDelay; ++inPos1;
+         if (tMax < tNext1) tMax = tNext1;
+      }
+      else if (tNext2 < tNext1)
+      {
+         /* pulse 2 due */
 
-   data.word = wVal;
+         if (tNow < tNext2)
+         {
+            /* extend previous delay */
+            out[outPos-1].usDelay += (tNext2 - tNow);
+            tNow = tNext2;
+         }
 
-   status = (my_smbus_access(
-      i2cInfo[handle].fd,
-      PI_I2C_SMBUS_WRITE,
-      reg, PI_I2C_SMBUS_PROC_CALL,
-      &data));
+         out[outPos].gpioOn  = in2[inPos2].gpioOn;
+         out[outPos].gpioOff = in2[inPos2].gpioOff;
+         out[outPos].flags   = in2[inPos2].flags;
 
-   if (status < 0)
-   {
-      DBG(DBG_USER, "error=%d (%m)", status);
-      return PI_I2C_READ_FAILED;
-   }
+         tNext2 = tNow + in2[inPos2].usDelay; ++inPos2;
+         if (tMax < tNext2) tMax = tNext2;
+      }
+      else
+      {
+         /* pulse 1 and 2 both due */
 
-   return 0xFFFF & data.word;
-}
+         if (tNow < tNext1)
+         {
+            /* extend previous delay */
+            out[outPos-1].usDelay += (tNext1 - tNow);
+            tNow = tNext1;
+         }
 
+         out[outPos].gpioOn  = in1[inPos1].gpioOn  | in2[inPos2].gpioOn;
+         out[outPos].gpioOff = in1[inPos1].gpioOff | in2[inPos2].gpioOff;
+         out[outPos].flags   = in1[inPos1].flags   | in2[inPos2].flags;
 
-int i2cReadBlockData(unsigned handle, unsigned reg, char *buf)
-{
-   union my_smbus_data data;
+         tNext1 = tNow + in1[inPos1].usDelay; ++inPos1;
+         tNext2 = tNow + in2[inPos2].usDelay; ++inPos2;
+         if (tMax < tNext1) tMax = tNext1;
+         if (tMax < tNext2) tMax = tNext2;
+      }
 
-   int i, status;
+      if (tNext1 <= tNext2) { tDelay = tNext1 - tNow; tNow = tNext1; }
+      else                  { tDelay = tNext2 - tNow; tNow = tNext2; }
 
-   DBG(DBG_USER, "handle=%d reg=%d buf=%08"PRIXPTR, handle, reg, (uintptr_t)buf);
+      out[outPos].usDelay = tDelay;
 
-   CHECK_INITED;
+      cbs += waveDelayCBs(tDelay);
 
-   if (handle >= PI_I2C_SLOTS)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+      if (out[outPos].gpioOn || out[outPos].gpioOff) cbs++;
 
-   if (i2cInfo[handle].state != PI_I2C_OPENED)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+      if (out[outPos].flags & WAVE_FLAG_READ)
+      {
+         cbs++; /* one cb if read */
+         --level;
+      }
 
-   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_READ_BLOCK_DATA) == 0)
-      SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+      if (out[outPos].flags & WAVE_FLAG_TICK)
+      {
+         cbs++; /* one cb if tick */
+         --level;
+      }
 
-   if (reg > 0xFF)
-      SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
+      outPos++;
 
-   status = (my_smbus_access(
-      i2cInfo[handle].fd,
-      PI_I2C_SMBUS_READ,
-      reg,
-      PI_I2C_SMBUS_BLOCK_DATA,
-      &data));
+      if (inPos1 >= numIn1) tNext1 = -1;
+      if (inPos2 >= numIn2) tNext2 = -1;
 
-   if (status < 0)
-   {
-      DBG(DBG_USER, "error=%d (%m)", status);
-      return PI_I2C_READ_FAILED;
    }
-   else
+
+   if (tNow < tMax)
    {
-      if (data.block[0] <= PI_I2C_SMBUS_BLOCK_MAX)
-      {
-         for (i=0; i<data.block[0]; i++) buf[i] = data.block[i+1];
-         return data.block[0];
-      }
-      else return PI_I2C_READ_FAILED;
+      /* extend previous delay */
+      out[outPos-1].usDelay += (tMax - tNow);
+      tNow = tMax;
    }
+
+   return waveAddDone(outPos, numOut, level, tNow, cbs);
 }
 
+/* ----------------------------------------------------------------------- */
 
-int i2cWriteBlockData(
-   unsigned handle, unsigned reg, char *buf, unsigned count)
+static int waveAddDone(unsigned outPos, unsigned numOut, unsigned level,
+                       uint32_t tNow, unsigned cbs)
 {
-   union my_smbus_data data;
+   /* the merged wave in wf[1-wfcur] becomes the current wave */
 
-   int i, status;
+   if ((outPos < numOut) && (outPos < level))
+   {
+      wfStats.micros = tNow;
 
-   DBG(DBG_USER, "handle=%d reg=%d count=%d [%s]",
-      handle, reg, count, myBuf2Str(count, buf));
+      if (tNow > wfStats.highMicros) wfStats.highMicros = tNow;
 
-   CHECK_INITED;
+      wfStats.pulses = outPos;
 
-   if (handle >= PI_I2C_SLOTS)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+      if (outPos > wfStats.highPulses) wfStats.highPulses = outPos;
 
-   if (i2cInfo[handle].state != PI_I2C_OPENED)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+      wfStats.cbs    = cbs;
 
-   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_WRITE_BLOCK_DATA) == 0)
-      SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+      if (cbs > wfStats.highCbs) wfStats.highCbs = cbs;
 
-   if (reg > 0xFF)
-      SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
+      wfc[1-wfcur] = outPos;
+      wfcur = 1 - wfcur;
 
-   if ((count < 1) || (count > 32))
-      SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
+      return outPos;
+   }
+   else return PI_TOO_MANY_PULSES;
+}
 
-   for (i=1; i<=count; i++) data.block[i] = buf[i-1];
-   data.block[0] = count;
+/* ----------------------------------------------------------------------- */
 
-   status = my_smbus_access(
-            i2cInfo[handle].fd,
-            PI_I2C_SMBUS_WRITE,
-            reg,
-            PI_I2C_SMBUS_BLOCK_DATA,
-            &data);
+typedef struct
+{
+   uint32_t     tNext; /* time the next pulse is due */
+   unsigned     pos;
+   unsigned     num;
+   rawWave_t   *raw;   /* the current wave, else */
+   gpioPulse_t *pulse; /* an added train */
+} waveSrc_t;
 
-   if (status < 0)
-   {
-      DBG(DBG_USER, "error=%d (%m)", status);
-      return PI_I2C_WRITE_FAILED;
-   }
+static int waveSrcBefore(waveSrc_t *src, int a, int b)
+{
+   /* earliest first, ties in source order so merges are repeatable */
 
-   return status;
-}
+   if (src[a].tNext != src[b].tNext) return src[a].tNext < src[b].tNext;
 
+   return a < b;
+}
 
-int i2cBlockProcessCall(
-   unsigned handle, unsigned reg, char *buf, unsigned count)
+static void waveHeapDown(waveSrc_t *src, int *heap, int n, int i)
 {
-   union my_smbus_data data;
+   int c, t;
 
-   int i, status;
+   while ((c = (2*i) + 1) < n)
+   {
+      if (((c+1) < n) && waveSrcBefore(src, heap[c+1], heap[c])) c++;
 
-   DBG(DBG_USER, "handle=%d reg=%d count=%d [%s]",
-      handle, reg, count, myBuf2Str(count, buf));
+      if (!waveSrcBefore(src, heap[c], heap[i])) break;
 
-   CHECK_INITED;
+      t = heap[i]; heap[i] = heap[c]; heap[c] = t;
 
-   if (handle >= PI_I2C_SLOTS)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+      i = c;
+   }
+}
 
-   if (i2cInfo[handle].state != PI_I2C_OPENED)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+static int rawWaveMerge(unsigned numSrcs, waveSrc_t *src, int *heap)
+{
+   /*
+      Merge the current wave and all the sources in one pass.  A binary
+      heap holds each source by the time its next pulse is due, so the
+      cost is (total pulses) x log(sources).
 
-   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_PROC_CALL) == 0)
-      SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+      src and heap have room for numSrcs+1 entries, the last being
+      filled in here with the current wave.
+   */
 
-   if (reg > 0xFF)
-      SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
+   unsigned outPos=0, level=NUM_WAVE_OOL, cbs=0, numOut=PI_WAVE_MAX_PULSES;
+   unsigned i;
+   int n, s;
+   uint32_t tNow, tMax, d;
+   rawWave_t *out;
 
-   if ((count < 1) || (count > 32))
-      SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
+   out = wf[1-wfcur];
 
-   for (i=1; i<=count; i++) data.block[i] = buf[i-1];
-   data.block[0] = count;
+   n = 0;
+   tMax = 0;
 
-   status = (my_smbus_access(
-      i2cInfo[handle].fd, PI_I2C_SMBUS_WRITE, reg,
-      PI_I2C_SMBUS_BLOCK_PROC_CALL, &data));
+   src[numSrcs].tNext = 0;
+   src[numSrcs].pos   = 0;
+   src[numSrcs].num   = wfc[wfcur];
+   src[numSrcs].raw   = wf[wfcur];
+   src[numSrcs].pulse = NULL;
 
-   if (status < 0)
+   if (wfc[wfcur]) heap[n++] = numSrcs;
+
+   for (i=0; i<numSrcs; i++)
    {
-      DBG(DBG_USER, "error=%d (%m)", status);
-      return PI_I2C_READ_FAILED;
+      if (src[i].num) heap[n++] = i;
+      else if (tMax < src[i].tNext) tMax = src[i].tNext;
    }
-   else
+
+   for (s=(n/2)-1; s>=0; s--) waveHeapDown(src, heap, n, s);
+
+   tNow = 0;
+
+   /* a wave always starts with a pulse at time 0 */
+
+   if (n && src[heap[0]].tNext)
    {
-      if (data.block[0] <= PI_I2C_SMBUS_BLOCK_MAX)
-      {
-         for (i=0; i<data.block[0]; i++) buf[i] = data.block[i+1];
-         return data.block[0];
-      }
-      else return PI_I2C_READ_FAILED;
+      out[0].gpioOn  = 0;
+      out[0].gpioOff = 0;
+      out[0].usDelay = 0;
+      out[0].flags   = 0;
+      outPos = 1;
    }
-}
 
+   while (n && (outPos < numOut))
+   {
+      /* tNow is when the pulses at the top of the heap are due */
 
-int i2cReadI2CBlockData(
-   unsigned handle, unsigned reg, char *buf, unsigned count)
-{
-   union my_smbus_data data;
+      tNow = src[heap[0]].tNext;
 
-   int i, status;
-   uint32_t size;
+      if (outPos) out[outPos-1].usDelay = tNow - out[outPos-1].usDelay;
 
-   DBG(DBG_USER, "handle=%d reg=%d count=%d buf=%08"PRIXPTR,
-      handle, reg, count, (uintptr_t)buf);
+      out[outPos].gpioOn  = 0;
+      out[outPos].gpioOff = 0;
+      out[outPos].flags   = 0;
 
-   CHECK_INITED;
+      while (n && (src[heap[0]].tNext == tNow))
+      {
+         s = heap[0];
 
-   if (handle >= PI_I2C_SLOTS)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+         if (src[s].raw)
+         {
+            out[outPos].gpioOn  |= src[s].raw[src[s].pos].gpioOn;
+            out[outPos].gpioOff |= src[s].raw[src[s].pos].gpioOff;
+            out[outPos].flags   |= src[s].raw[src[s].pos].flags;
+            d = src[s].raw[src[s].pos].usDelay;
+         }
+         else
+         {
+            out[outPos].gpioOn  |= src[s].pulse[src[s].pos].gpioOn;
+            out[outPos].gpioOff |= src[s].pulse[src[s].pos].gpioOff;
+            d = src[s].pulse[src[s].pos].usDelay;
+         }
 
-   if (i2cInfo[handle].state != PI_I2C_OPENED)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+         src[s].tNext = tNow + d;
 
-   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_READ_I2C_BLOCK) == 0)
-      SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+         if (tMax < src[s].tNext) tMax = src[s].tNext;
 
-   if (reg > 0xFF)
-      SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
+         if (++src[s].pos >= src[s].num) heap[0] = heap[--n];
 
-   if ((count < 1) || (count > 32))
-      SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
+         waveHeapDown(src, heap, n, 0);
+      }
 
-   if (count == 32)
-      size = PI_I2C_SMBUS_I2C_BLOCK_BROKEN;
-   else
-      size = PI_I2C_SMBUS_I2C_BLOCK_DATA;
+      /* usDelay holds the start time until the next pulse is known */
 
-   data.block[0] = count;
+      out[outPos].usDelay = tNow;
 
-   status = (my_smbus_access(
-      i2cInfo[handle].fd, PI_I2C_SMBUS_READ, reg, size, &data));
+      if (out[outPos].flags & WAVE_FLAG_READ) {cbs++; --level;}
+      if (out[outPos].flags & WAVE_FLAG_TICK) {cbs++; --level;}
+      if (out[outPos].gpioOn || out[outPos].gpioOff) cbs++;
 
-   if (status < 0)
+      outPos++;
+   }
+
+   if (n) return PI_TOO_MANY_PULSES;
+
+   if (outPos)
    {
-      DBG(DBG_USER, "error=%d (%m)", status);
-      return PI_I2C_READ_FAILED;
+      if (tMax < tNow) tMax = tNow;
+
+      out[outPos-1].usDelay = tMax - out[outPos-1].usDelay;
+
+      tNow = tMax;
+
+      for (i=0; i<outPos; i++) cbs += waveDelayCBs(out[i].usDelay);
    }
-   else
+
+   return waveAddDone(outPos, numOut, level, tNow, cbs);
+}
+
+static int rawWaveAddTrains(unsigned numTrains, gpioPulseTrain_t *trains)
+{
+   unsigned i;
+   int status;
+   waveSrc_t *src;
+   int *heap;
+
+   src = malloc((numTrains+1) * (sizeof(waveSrc_t) + sizeof(int)));
+
+   if (src == NULL) return PI_NO_MEMORY;
+
+   heap = (int *)(src + numTrains + 1);
+
+   for (i=0; i<numTrains; i++)
    {
-      if (data.block[0] <= PI_I2C_SMBUS_I2C_BLOCK_MAX)
-      {
-         for (i=0; i<data.block[0]; i++) buf[i] = data.block[i+1];
-         return data.block[0];
-      }
-      else return PI_I2C_READ_FAILED;
+      src[i].tNext = trains[i].offset;
+      src[i].pos   = 0;
+      src[i].num   = trains[i].numPulses;
+      src[i].raw   = NULL;
+      src[i].pulse = trains[i].pulses;
    }
+
+   status = rawWaveMerge(numTrains, src, heap);
+
+   free(src);
+
+   return status;
 }
 
+/* ======================================================================= */
 
-int i2cWriteI2CBlockData(
-   unsigned handle, unsigned reg, char *buf, unsigned count)
+int i2cWriteQuick(unsigned handle, unsigned bit)
 {
-   union my_smbus_data data;
-
-   int i, status;
+   int status;
 
-   DBG(DBG_USER, "handle=%d reg=%d count=%d [%s]",
-      handle, reg, count, myBuf2Str(count, buf));
+   DBG(DBG_USER, "handle=%d bit=%d", handle, bit);
 
    CHECK_INITED;
 
@@ -3959,25 +4803,14 @@ int i2cWriteI2CBlockData(
    if (i2cInfo[handle].state != PI_I2C_OPENED)
       SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_WRITE_I2C_BLOCK) == 0)
+   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_QUICK) == 0)
       SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
 
-   if (reg > 0xFF)
-      SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
-
-   if ((count < 1) || (count > 32))
-      SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
-
-   for (i=1; i<=count; i++) data.block[i] = buf[i-1];
-
-   data.block[0] = count;
+   if (bit > 1)
+      SOFT_ERROR(PI_BAD_PARAM, "bad bit (%d)", bit);
 
    status = my_smbus_access(
-            i2cInfo[handle].fd,
-            PI_I2C_SMBUS_WRITE,
-            reg,
-            PI_I2C_SMBUS_I2C_BLOCK_BROKEN,
-            &data);
+      i2cInfo[handle].fd, bit, 0, PI_I2C_SMBUS_QUICK, NULL);
 
    if (status < 0)
    {
@@ -3988,12 +4821,12 @@ int i2cWriteI2CBlockData(
    return status;
 }
 
-int i2cWriteDevice(unsigned handle, char *buf, unsigned count)
+int i2cReadByte(unsigned handle)
 {
-   int bytes;
+   union my_smbus_data data;
+   int status;
 
-   DBG(DBG_USER, "handle=%d count=%d [%s]",
-      handle, count, myBuf2Str(count, buf));
+   DBG(DBG_USER, "handle=%d", handle);
 
    CHECK_INITED;
 
@@ -4003,26 +4836,27 @@ int i2cWriteDevice(unsigned handle, char *buf, unsigned count)
    if (i2cInfo[handle].state != PI_I2C_OPENED)
       SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   if ((count < 1) || (count > PI_MAX_I2C_DEVICE_COUNT))
-      SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
+   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_READ_BYTE) == 0)
+      SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
 
-   bytes = write(i2cInfo[handle].fd, buf, count);
+   status = my_smbus_access(
+      i2cInfo[handle].fd, PI_I2C_SMBUS_READ, 0, PI_I2C_SMBUS_BYTE, &data);
 
-   if (bytes != count)
+   if (status < 0)
    {
-      DBG(DBG_USER, "error=%d (%m)", bytes);
-      return PI_I2C_WRITE_FAILED;
+      DBG(DBG_USER, "error=%d (%m)", status);
+      return PI_I2C_READ_FAILED;
    }
 
-   return 0;
+   return 0xFF & data.byte;
 }
 
-int i2cReadDevice(unsigned handle, char *buf, unsigned count)
+
+int i2cWriteByte(unsigned handle, unsigned bVal)
 {
-   int bytes;
+   int status;
 
-   DBG(DBG_USER, "handle=%d count=%d buf=%08"PRIXPTR,
-      handle, count, (uintptr_t)buf);
+   DBG(DBG_USER, "handle=%d bVal=%d", handle, bVal);
 
    CHECK_INITED;
 
@@ -4032,98 +4866,113 @@ int i2cReadDevice(unsigned handle, char *buf, unsigned count)
    if (i2cInfo[handle].state != PI_I2C_OPENED)
       SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   if ((count < 1) || (count > PI_MAX_I2C_DEVICE_COUNT))
-      SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
+   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_WRITE_BYTE) == 0)
+      SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
 
-   bytes = read(i2cInfo[handle].fd, buf, count);
+   if (bVal > 0xFF)
+      SOFT_ERROR(PI_BAD_PARAM, "bad bVal (%d)", bVal);
 
-   if (bytes != count)
+   status = my_smbus_access(
+            i2cInfo[handle].fd,
+            PI_I2C_SMBUS_WRITE,
+            bVal,
+            PI_I2C_SMBUS_BYTE,
+            NULL);
+
+   if (status < 0)
    {
-      DBG(DBG_USER, "error=%d (%m)", bytes);
-      return PI_I2C_READ_FAILED;
+      DBG(DBG_USER, "error=%d (%m)", status);
+      return PI_I2C_WRITE_FAILED;
    }
 
-   return bytes;
+   return status;
 }
 
-int i2cOpen(unsigned i2cBus, unsigned i2cAddr, unsigned i2cFlags)
+
+int i2cReadByteData(unsigned handle, unsigned reg)
 {
-   static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-   char dev[32];
-   int i, slot, fd;
-   uint32_t funcs;
+   union my_smbus_data data;
+   int status;
 
-   DBG(DBG_USER, "i2cBus=%d i2cAddr=%d flags=0x%X",
-      i2cBus, i2cAddr, i2cFlags);
+   DBG(DBG_USER, "handle=%d reg=%d", handle, reg);
 
    CHECK_INITED;
 
-   if (i2cAddr > PI_MAX_I2C_ADDR)
-      SOFT_ERROR(PI_BAD_I2C_ADDR, "bad I2C address (%d)", i2cAddr);
+   if (handle >= PI_I2C_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   if (i2cFlags)
-      SOFT_ERROR(PI_BAD_FLAGS, "bad flags (0x%X)", i2cFlags);
+   if (i2cInfo[handle].state != PI_I2C_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   slot = -1;
+   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_READ_BYTE_DATA) == 0)
+      SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
 
-   pthread_mutex_lock(&mutex);
+   if (reg > 0xFF)
+      SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
 
-   for (i=0; i<PI_I2C_SLOTS; i++)
+   status = my_smbus_access(i2cInfo[handle].fd,
+            PI_I2C_SMBUS_READ, reg, PI_I2C_SMBUS_BYTE_DATA, &data);
+
+   if (status < 0)
    {
-      if (i2cInfo[i].state == PI_I2C_CLOSED)
-      {
-         slot = i;
-         i2cInfo[slot].state = PI_I2C_RESERVED;
-         break;
-      }
+      DBG(DBG_USER, "error=%d (%m)", status);
+      return PI_I2C_READ_FAILED;
    }
 
-   pthread_mutex_unlock(&mutex);
+   return 0xFF & data.byte;
+}
 
-   if (slot < 0) SOFT_ERROR(PI_NO_HANDLE, "no I2C handles");
 
-   sprintf(dev, "/dev/i2c-%d", i2cBus);
+int i2cWriteByteData(unsigned handle, unsigned reg, unsigned bVal)
+{
+   union my_smbus_data data;
 
-   if ((fd = open(dev, O_RDWR)) < 0)
-   {
-      /* try a modprobe */
+   int status;
 
-      if (system("/sbin/modprobe i2c_dev") == -1) { /* ignore errors */}
-      if (system("/sbin/modprobe i2c_bcm2835") == -1) { /* ignore errors */}
+   DBG(DBG_USER, "handle=%d reg=%d bVal=%d", handle, reg, bVal);
 
-      myGpioDelay(100000);
+   CHECK_INITED;
 
-      if ((fd = open(dev, O_RDWR)) < 0)
-      {
-         i2cInfo[slot].state = PI_I2C_CLOSED;
-         return PI_BAD_I2C_BUS;
-      }
-   }
+   if (handle >= PI_I2C_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   if (ioctl(fd, PI_I2C_SLAVE, i2cAddr) < 0)
-   {
-      close(fd);
-      i2cInfo[slot].state = PI_I2C_CLOSED;
-      return PI_I2C_OPEN_FAILED;
-   }
+   if (i2cInfo[handle].state != PI_I2C_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   if (ioctl(fd, PI_I2C_FUNCS, &funcs) < 0)
+   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_WRITE_BYTE_DATA) == 0)
+      SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+
+   if (reg > 0xFF)
+      SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
+
+   if (bVal > 0xFF)
+      SOFT_ERROR(PI_BAD_PARAM, "bad bVal (%d)", bVal);
+
+   data.byte = bVal;
+
+   status = my_smbus_access(
+            i2cInfo[handle].fd,
+            PI_I2C_SMBUS_WRITE,
+            reg,
+            PI_I2C_SMBUS_BYTE_DATA,
+            &data);
+
+   if (status < 0)
    {
-      funcs = -1; /* assume all smbus commands allowed */
+      DBG(DBG_USER, "error=%d (%m)", status);
+      return PI_I2C_WRITE_FAILED;
    }
 
-   i2cInfo[slot].fd = fd;
-   i2cInfo[slot].addr = i2cAddr;
-   i2cInfo[slot].flags = i2cFlags;
-   i2cInfo[slot].funcs = funcs;
-   i2cInfo[slot].state = PI_I2C_OPENED;
-
-   return slot;
+   return status;
 }
 
-int i2cClose(unsigned handle)
+
+int i2cReadWordData(unsigned handle, unsigned reg)
 {
-   DBG(DBG_USER, "handle=%d", handle);
+   union my_smbus_data data;
+   int status;
+
+   DBG(DBG_USER, "handle=%d reg=%d", handle, reg);
 
    CHECK_INITED;
 
@@ -4133,43 +4982,36 @@ int i2cClose(unsigned handle)
    if (i2cInfo[handle].state != PI_I2C_OPENED)
       SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   if (i2cInfo[handle].fd >= 0) close(i2cInfo[handle].fd);
-
-   i2cInfo[handle].fd = -1;
-   i2cInfo[handle].state = PI_I2C_CLOSED;
-
-   return 0;
-}
-
-void i2cSwitchCombined(int setting)
-{
-   int fd;
+   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_READ_WORD_DATA) == 0)
+      SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
 
-   DBG(DBG_USER, "setting=%d", setting);
+   if (reg > 0xFF)
+      SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
 
-   fd = open(PI_I2C_COMBINED, O_WRONLY);
+   status = (my_smbus_access(
+      i2cInfo[handle].fd,
+      PI_I2C_SMBUS_READ,
+      reg,
+      PI_I2C_SMBUS_WORD_DATA,
+      &data));
 
-   if (fd >= 0)
+   if (status < 0)
    {
-      if (setting)
-      {
-         if (write(fd, "1\n", 2) == -1) { /* ignore errors */ }
-      }
-      else
-      {
-         if (write(fd, "0\n", 2) == -1) { /* ignore errors */ }
-      }
-
-      close(fd);
+      DBG(DBG_USER, "error=%d (%m)", status);
+      return PI_I2C_READ_FAILED;
    }
+
+   return 0xFFFF & data.word;
 }
 
-int i2cSegments(unsigned handle, pi_i2c_msg_t *segs, unsigned numSegs)
+
+int i2cWriteWordData(unsigned handle, unsigned reg, unsigned wVal)
 {
-   int retval;
-   my_i2c_rdwr_ioctl_data_t rdwr;
+   union my_smbus_data data;
 
-   DBG(DBG_USER, "handle=%d", handle);
+   int status;
+
+   DBG(DBG_USER, "handle=%d reg=%d wVal=%d", handle, reg, wVal);
 
    CHECK_INITED;
 
@@ -4179,31 +5021,40 @@ int i2cSegments(unsigned handle, pi_i2c_msg_t *segs, unsigned numSegs)
    if (i2cInfo[handle].state != PI_I2C_OPENED)
       SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   if (segs == NULL)
-      SOFT_ERROR(PI_BAD_POINTER, "null segments");
+   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_WRITE_WORD_DATA) == 0)
+      SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
 
-   if (numSegs > PI_I2C_RDRW_IOCTL_MAX_MSGS)
-      SOFT_ERROR(PI_TOO_MANY_SEGS, "too many segments (%d)", numSegs);
+   if (reg > 0xFF)
+      SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
 
-   rdwr.msgs = segs;
-   rdwr.nmsgs = numSegs;
+   if (wVal > 0xFFFF)
+      SOFT_ERROR(PI_BAD_PARAM, "bad wVal (%d)", wVal);
 
-   retval = ioctl(i2cInfo[handle].fd, PI_I2C_RDWR, &rdwr);
+   data.word = wVal;
 
-   if (retval >= 0) return retval;
-   else             return PI_BAD_I2C_SEG;
+   status = my_smbus_access(
+            i2cInfo[handle].fd,
+            PI_I2C_SMBUS_WRITE,
+            reg,
+            PI_I2C_SMBUS_WORD_DATA,
+            &data);
+
+   if (status < 0)
+   {
+      DBG(DBG_USER, "error=%d (%m)", status);
+      return PI_I2C_WRITE_FAILED;
+   }
+
+   return status;
 }
 
-int i2cZip(
-   unsigned handle,
-   char *inBuf, unsigned inLen, char *outBuf, unsigned outLen)
+
+int i2cProcessCall(unsigned handle, unsigned reg, unsigned wVal)
 {
-   int numSegs, inPos, outPos, status, bytes, flags, addr;
-   int esc, setesc;
-   pi_i2c_msg_t segs[PI_I2C_RDRW_IOCTL_MAX_MSGS];
+   union my_smbus_data data;
+   int status;
 
-   DBG(DBG_USER, "handle=%d inBuf=%s outBuf=%08"PRIXPTR" len=%d",
-      handle, myBuf2Str(inLen, (char *)inBuf), (uintptr_t)outBuf, outLen);
+   DBG(DBG_USER, "handle=%d reg=%d wVal=%d", handle, reg, wVal);
 
    CHECK_INITED;
 
@@ -4213,5098 +5064,10247 @@ int i2cZip(
    if (i2cInfo[handle].state != PI_I2C_OPENED)
       SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   if (!inBuf || !inLen)
-      SOFT_ERROR(PI_BAD_POINTER, "input buffer can't be NULL");
+   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_PROC_CALL) == 0)
+      SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
 
-   if (!outBuf && outLen)
-      SOFT_ERROR(PI_BAD_POINTER, "output buffer can't be NULL");
+   if (reg > 0xFF)
+      SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
 
-   numSegs = 0;
+   if (wVal > 0xFFFF)
+      SOFT_ERROR(PI_BAD_PARAM, "bad wVal (%d)", wVal);
 
-   inPos = 0;
-   outPos = 0;
-   status = 0;
+   data.word = wVal;
 
-   addr = i2cInfo[handle].addr;
-   flags = 0;
-   esc = 0;
-   setesc = 0;
+   status = (my_smbus_access(
+      i2cInfo[handle].fd,
+      PI_I2C_SMBUS_WRITE,
+      reg, PI_I2C_SMBUS_PROC_CALL,
+      &data));
 
-   while (!status && (inPos < inLen))
+   if (status < 0)
    {
-      DBG(DBG_INTERNAL, "status=%d inpos=%d inlen=%d cmd=%d addr=%d flags=%x",
-         status, inPos, inLen, inBuf[inPos], addr, flags);
+      DBG(DBG_USER, "error=%d (%m)", status);
+      return PI_I2C_READ_FAILED;
+   }
 
-      switch (inBuf[inPos++])
-      {
-         case PI_I2C_END:
-            status = 1;
-            break;
+   return 0xFFFF & data.word;
+}
 
-         case PI_I2C_COMBINED_ON:
-            /* Run prior transactions before setting combined flag */
-            if (numSegs)
-            {
-               status = i2cSegments(handle, segs, numSegs);
-               if (status >= 0) status = 0; /* continue */
-               numSegs = 0;
-            }
-            i2cSwitchCombined(1);
-            break;
 
-         case PI_I2C_COMBINED_OFF:
-            /* Run prior transactions before clearing combined flag */
-            if (numSegs)
-            {
-               status = i2cSegments(handle, segs, numSegs);
-               if (status >= 0) status = 0; /* continue */
-               numSegs = 0;
-            }
-            i2cSwitchCombined(0);
-            break;
+int i2cReadBlockData(unsigned handle, unsigned reg, char *buf)
+{
+   union my_smbus_data data;
 
-         case PI_I2C_ADDR:
-            addr = myI2CGetPar(inBuf, &inPos, inLen, &esc);
-            if (addr < 0) status = PI_BAD_I2C_CMD;
-            break;
+   int i, status;
 
-         case PI_I2C_FLAGS:
-            /* cheat to force two byte flags */
-            esc = 1;
-            flags = myI2CGetPar(inBuf, &inPos, inLen, &esc);
-            if (flags < 0) status = PI_BAD_I2C_CMD;
-            break;
-
-         case PI_I2C_ESC:
-            setesc = 1;
-            break;
-
-         case PI_I2C_READ:
-
-            bytes = myI2CGetPar(inBuf, &inPos, inLen, &esc);
+   DBG(DBG_USER, "handle=%d reg=%d buf=%08"PRIXPTR, handle, reg, (uintptr_t)buf);
 
-            if (bytes >= 0)
-            {
-               if ((bytes + outPos) < outLen)
-               {
-                  segs[numSegs].addr = addr;
-                  segs[numSegs].flags = (flags|1);
-                  segs[numSegs].len = bytes;
-                  segs[numSegs].buf = (uint8_t *)(outBuf + outPos);
-                  outPos += bytes;
-                  numSegs++;
-                  if (numSegs >= PI_I2C_RDRW_IOCTL_MAX_MSGS)
-                  {
-                     status = i2cSegments(handle, segs, numSegs);
-                     if (status >= 0) status = 0; /* continue */
-                     numSegs = 0;
-                  }
-               }
-               else status = PI_BAD_I2C_RLEN;
-            }
-            else status = PI_BAD_I2C_RLEN;
-            break;
+   CHECK_INITED;
 
-         case PI_I2C_WRITE:
+   if (handle >= PI_I2C_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-            bytes = myI2CGetPar(inBuf, &inPos, inLen, &esc);
+   if (i2cInfo[handle].state != PI_I2C_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-            if (bytes >= 0)
-            {
-               if ((bytes + inPos) < inLen)
-               {
-                  segs[numSegs].addr = addr;
-                  segs[numSegs].flags = (flags&0xfffe);
-                  segs[numSegs].len = bytes;
-                  segs[numSegs].buf = (uint8_t *)(inBuf + inPos);
-                  inPos += bytes;
-                  numSegs++;
-                  if (numSegs >= PI_I2C_RDRW_IOCTL_MAX_MSGS)
-                  {
-                     status = i2cSegments(handle, segs, numSegs);
-                     if (status >= 0) status = 0; /* continue */
-                     numSegs = 0;
-                  }
-               }
-               else status = PI_BAD_I2C_WLEN;
-            }
-            else status = PI_BAD_I2C_WLEN;
-            break;
+   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_READ_BLOCK_DATA) == 0)
+      SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
 
-         default:
-            status = PI_BAD_I2C_CMD;
-      }
+   if (reg > 0xFF)
+      SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
 
-      if (setesc) esc = 1; else esc = 0;
+   status = (my_smbus_access(
+      i2cInfo[handle].fd,
+      PI_I2C_SMBUS_READ,
+      reg,
+      PI_I2C_SMBUS_BLOCK_DATA,
+      &data));
 
-      setesc = 0;
+   if (status < 0)
+   {
+      DBG(DBG_USER, "error=%d (%m)", status);
+      return PI_I2C_READ_FAILED;
    }
-
-   if (status >= 0)
+   else
    {
-      if (numSegs) status = i2cSegments(handle, segs, numSegs);
+      if (data.block[0] <= PI_I2C_SMBUS_BLOCK_MAX)
+      {
+         for (i=0; i<data.block[0]; i++) buf[i] = data.block[i+1];
+         return data.block[0];
+      }
+      else return PI_I2C_READ_FAILED;
    }
+}
 
-   if (status >= 0) status = outPos;
 
-   return status;
-}
+int i2cWriteBlockData(
+   unsigned handle, unsigned reg, char *buf, unsigned count)
+{
+   union my_smbus_data data;
 
-/* ======================================================================= */
+   int i, status;
 
-/*SPI */
+   DBG(DBG_USER, "handle=%d reg=%d count=%d [%s]",
+      handle, reg, count, myBuf2Str(count, buf));
 
-static uint32_t _spiTXBits(char *buf, int pos, int bitlen, int msbf)
-{
-   uint32_t bits=0;
+   CHECK_INITED;
 
-   if (buf)
-   {
-      if      (bitlen <=  8) bits = *((( uint8_t*)buf)+pos);
-      else if (bitlen <= 16) bits = *(((uint16_t*)buf)+pos);
-      else                   bits = *(((uint32_t*)buf)+pos);
+   if (handle >= PI_I2C_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-      if (msbf) bits <<= (32-bitlen);
-   }
+   if (i2cInfo[handle].state != PI_I2C_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   return bits;
-}
+   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_WRITE_BLOCK_DATA) == 0)
+      SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
 
-static void _spiRXBits(
-   char *buf, int pos, int bitlen, int msbf, uint32_t bits)
-{
-   if (buf)
-   {
-      if (!msbf) bits >>= (32-bitlen);
+   if (reg > 0xFF)
+      SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
 
-      if      (bitlen <=  8) *((( uint8_t*)buf)+pos) = bits;
-      else if (bitlen <= 16) *(((uint16_t*)buf)+pos) = bits;
-      else                   *(((uint32_t*)buf)+pos) = bits;
-   }
-}
+   if ((count < 1) || (count > 32))
+      SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
 
-static void spiACS(int channel, int on)
-{
-   int gpio;
+   for (i=1; i<=count; i++) data.block[i] = buf[i-1];
+   data.block[0] = count;
 
-   switch (channel)
+   status = my_smbus_access(
+            i2cInfo[handle].fd,
+            PI_I2C_SMBUS_WRITE,
+            reg,
+            PI_I2C_SMBUS_BLOCK_DATA,
+            &data);
+
+   if (status < 0)
    {
-       case  0: gpio = PI_ASPI_CE0; break;
-       case  1: gpio = PI_ASPI_CE1; break;
-       default: gpio = PI_ASPI_CE2; break;
+      DBG(DBG_USER, "error=%d (%m)", status);
+      return PI_I2C_WRITE_FAILED;
    }
-   myGpioWrite(gpio, on);
+
+   return status;
 }
 
-static void spiGoA(
-   unsigned speed,    /* bits per second */
-   uint32_t flags,    /* flags           */
-   char     *txBuf,   /* tx buffer       */
-   char     *rxBuf,   /* rx buffer       */
-   unsigned count)    /* number of bytes */
+
+int i2cBlockProcessCall(
+   unsigned handle, unsigned reg, char *buf, unsigned count)
 {
-   int cs;
-   char bit_ir[4] = {1, 0, 0, 1}; /* read on rising edge */
-   char bit_or[4] = {0, 1, 1, 0}; /* write on rising edge */
-   char bit_ic[4] = {0, 0, 1, 1}; /* invert clock */
+   union my_smbus_data data;
 
-   int mode, bitlen, txmsbf, rxmsbf, channel;
-   unsigned txCnt=0;
-   unsigned rxCnt=0;
-   uint32_t spiDefaults;
-   uint32_t statusReg;
-   int txFull, rxEmpty;
+   int i, status;
 
-   channel = PI_SPI_FLAGS_GET_CHANNEL(flags);
-   mode   =  PI_SPI_FLAGS_GET_MODE   (flags);
+   DBG(DBG_USER, "handle=%d reg=%d count=%d [%s]",
+      handle, reg, count, myBuf2Str(count, buf));
 
-   bitlen =  PI_SPI_FLAGS_GET_BITLEN (flags);
+   CHECK_INITED;
 
-   if (!bitlen) bitlen = 8;
+   if (handle >= PI_I2C_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   /* correct count for word size */
+   if (i2cInfo[handle].state != PI_I2C_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   if (bitlen >  8) count /= 2;
-   if (bitlen > 16) count /= 2;
+   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_PROC_CALL) == 0)
+      SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
 
-   txmsbf = !PI_SPI_FLAGS_GET_TX_LSB (flags);
-   rxmsbf = !PI_SPI_FLAGS_GET_RX_LSB (flags);
+   if (reg > 0xFF)
+      SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
 
-   cs = PI_SPI_FLAGS_GET_CSPOLS(flags) & (1<<channel);
+   if ((count < 1) || (count > 32))
+      SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
 
-   spiDefaults = AUXSPI_CNTL0_SPEED((125000000/speed)-1)|
-                 AUXSPI_CNTL0_IN_RISING(bit_ir[mode])  |
-                 AUXSPI_CNTL0_OUT_RISING(bit_or[mode]) |
-                 AUXSPI_CNTL0_INVERT_CLK(bit_ic[mode]) |
-                 AUXSPI_CNTL0_MSB_FIRST(txmsbf)        |
-                 AUXSPI_CNTL0_SHIFT_LEN(bitlen);
+   for (i=1; i<=count; i++) data.block[i] = buf[i-1];
+   data.block[0] = count;
 
-   if (!count)
+   status = (my_smbus_access(
+      i2cInfo[handle].fd, PI_I2C_SMBUS_WRITE, reg,
+      PI_I2C_SMBUS_BLOCK_PROC_CALL, &data));
+
+   if (status < 0)
    {
-      auxReg[AUX_SPI0_CNTL0_REG] =
-         AUXSPI_CNTL0_ENABLE | AUXSPI_CNTL0_CLR_FIFOS;
+      DBG(DBG_USER, "error=%d (%m)", status);
+      return PI_I2C_READ_FAILED;
+   }
+   else
+   {
+      if (data.block[0] <= PI_I2C_SMBUS_BLOCK_MAX)
+      {
+         for (i=0; i<data.block[0]; i++) buf[i] = data.block[i+1];
+         return data.block[0];
+      }
+      else return PI_I2C_READ_FAILED;
+   }
+}
 
-      myGpioDelay(10);
 
-      auxReg[AUX_SPI0_CNTL0_REG] = AUXSPI_CNTL0_ENABLE  | spiDefaults;
+int i2cReadI2CBlockData(
+   unsigned handle, unsigned reg, char *buf, unsigned count)
+{
+   union my_smbus_data data;
 
-      auxReg[AUX_SPI0_CNTL1_REG] = AUXSPI_CNTL1_MSB_FIRST(rxmsbf);
+   int i, status;
+   uint32_t size;
 
-      return;
-   }
+   DBG(DBG_USER, "handle=%d reg=%d count=%d buf=%08"PRIXPTR,
+      handle, reg, count, (uintptr_t)buf);
 
-   auxReg[AUX_SPI0_CNTL0_REG] = AUXSPI_CNTL0_ENABLE  | spiDefaults;
+   CHECK_INITED;
 
-   auxReg[AUX_SPI0_CNTL1_REG] = AUXSPI_CNTL1_MSB_FIRST(rxmsbf);
+   if (handle >= PI_I2C_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   spiACS(channel, cs);
+   if (i2cInfo[handle].state != PI_I2C_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   while ((txCnt < count) || (rxCnt < count))
-   {
-      statusReg = auxReg[AUX_SPI0_STAT_REG];
+   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_READ_I2C_BLOCK) == 0)
+      SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
 
-      rxEmpty = statusReg & AUXSPI_STAT_RX_EMPTY;
+   if (reg > 0xFF)
+      SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
 
-      txFull = (((statusReg>>28)&15) > 2);
+   if ((count < 1) || (count > 32))
+      SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
 
-      if (rxCnt < count)
-      {
-         if (!rxEmpty)
-         {
-            _spiRXBits(
-               rxBuf, rxCnt++, bitlen, rxmsbf, auxReg[AUX_SPI0_IO_REG]);
-         }
-      }
+   if (count == 32)
+      size = PI_I2C_SMBUS_I2C_BLOCK_BROKEN;
+   else
+      size = PI_I2C_SMBUS_I2C_BLOCK_DATA;
 
-      if (txCnt < count)
+   data.block[0] = count;
+
+   status = (my_smbus_access(
+      i2cInfo[handle].fd, PI_I2C_SMBUS_READ, reg, size, &data));
+
+   if (status < 0)
+   {
+      DBG(DBG_USER, "error=%d (%m)", status);
+      return PI_I2C_READ_FAILED;
+   }
+   else
+   {
+      if (data.block[0] <= PI_I2C_SMBUS_I2C_BLOCK_MAX)
       {
-         if (!txFull)
-         {
-            if (txCnt != (count-1))
-            {
-               auxReg[AUX_SPI0_TX_HOLD] =
-                  _spiTXBits(txBuf, txCnt++, bitlen, txmsbf);
-            }
-            else
-            {
-               auxReg[AUX_SPI0_IO_REG] =
-                  _spiTXBits(txBuf, txCnt++, bitlen, txmsbf);
-            }
-         }
+         for (i=0; i<data.block[0]; i++) buf[i] = data.block[i+1];
+         return data.block[0];
       }
+      else return PI_I2C_READ_FAILED;
    }
-
-   while ((auxReg[AUX_SPI0_STAT_REG] & AUXSPI_STAT_BUSY)) ;
-
-   spiACS(channel, !cs);
 }
 
-static void spiGoS(
-   unsigned speed,
-   uint32_t flags,
-   char     *txBuf,
-   char     *rxBuf,
-   unsigned count)
+
+int i2cWriteI2CBlockData(
+   unsigned handle, unsigned reg, char *buf, unsigned count)
 {
-   unsigned txCnt=0;
-   unsigned rxCnt=0;
-   unsigned cnt, cnt4w, cnt3w;
-   uint32_t spiDefaults;
-   unsigned mode, channel, cspol, cspols, flag3w, ren3w;
+   union my_smbus_data data;
 
-   channel = PI_SPI_FLAGS_GET_CHANNEL(flags);
-   mode   =  PI_SPI_FLAGS_GET_MODE   (flags);
-   cspols =  PI_SPI_FLAGS_GET_CSPOLS(flags);
-   cspol  =  (cspols>>channel) & 1;
-   flag3w =  PI_SPI_FLAGS_GET_3WIRE(flags);
-   ren3w =   PI_SPI_FLAGS_GET_3WREN(flags);
+   int i, status;
 
-   spiDefaults = SPI_CS_MODE(mode)     |
-                 SPI_CS_CSPOLS(cspols) |
-                 SPI_CS_CS(channel)    |
-                 SPI_CS_CSPOL(cspol)   |
-                 SPI_CS_CLEAR(3);
+   DBG(DBG_USER, "handle=%d reg=%d count=%d [%s]",
+      handle, reg, count, myBuf2Str(count, buf));
 
-   spiReg[SPI_DLEN] = 2; /* undocumented, stops inter-byte gap */
+   CHECK_INITED;
 
-   spiReg[SPI_CS] = spiDefaults; /* stop */
+   if (handle >= PI_I2C_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   if (!count) return;
+   if (i2cInfo[handle].state != PI_I2C_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   if (flag3w)
-   {
-      if (ren3w < count)
-      {
-         cnt4w = ren3w;
-         cnt3w = count - ren3w;
-      }
-      else
-      {
-         cnt4w = count;
-         cnt3w = 0;
-      }
-   }
-   else
-   {
-      cnt4w = count;
-      cnt3w = 0;
-   }
+   if ((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_WRITE_I2C_BLOCK) == 0)
+      SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
 
-   spiReg[SPI_CLK] = 250000000/speed;
+   if (reg > 0xFF)
+      SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
 
-   spiReg[SPI_CS] = spiDefaults | SPI_CS_TA; /* start */
+   if ((count < 1) || (count > 32))
+      SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
 
-   cnt = cnt4w;
+   for (i=1; i<=count; i++) data.block[i] = buf[i-1];
 
-   while((txCnt < cnt) || (rxCnt < cnt))
-   {
-      while((rxCnt < cnt) && ((spiReg[SPI_CS] & SPI_CS_RXD)))
-      {
-         if (rxBuf) rxBuf[rxCnt] = spiReg[SPI_FIFO];
-         else       spi_dummy    = spiReg[SPI_FIFO];
-         rxCnt++;
-      }
+   data.block[0] = count;
 
-      while((txCnt < cnt) && ((spiReg[SPI_CS] & SPI_CS_TXD)))
-      {
-         if (txBuf) spiReg[SPI_FIFO] = txBuf[txCnt];
-         else       spiReg[SPI_FIFO] = 0;
-         txCnt++;
-      }
-   }
+   status = my_smbus_access(
+            i2cInfo[handle].fd,
+            PI_I2C_SMBUS_WRITE,
+            reg,
+            PI_I2C_SMBUS_I2C_BLOCK_BROKEN,
+            &data);
 
-   while (!(spiReg[SPI_CS] & SPI_CS_DONE)) ;
+   if (status < 0)
+   {
+      DBG(DBG_USER, "error=%d (%m)", status);
+      return PI_I2C_WRITE_FAILED;
+   }
 
-   /* now switch to 3-wire bus */
+   return status;
+}
 
-   cnt += cnt3w;
+int i2cWriteDevice(unsigned handle, char *buf, unsigned count)
+{
+   int bytes;
 
-   spiReg[SPI_CS] |= SPI_CS_REN;
+   DBG(DBG_USER, "handle=%d count=%d [%s]",
+      handle, count, myBuf2Str(count, buf));
 
-   while((txCnt < cnt) || (rxCnt < cnt))
-   {
-      while((rxCnt < cnt) && ((spiReg[SPI_CS] & SPI_CS_RXD)))
-      {
-         if (rxBuf) rxBuf[rxCnt] = spiReg[SPI_FIFO];
-         else       spi_dummy    = spiReg[SPI_FIFO];
-         rxCnt++;
-      }
+   CHECK_INITED;
 
-      while((txCnt < cnt) && ((spiReg[SPI_CS] & SPI_CS_TXD)))
-      {
-         if (txBuf) spiReg[SPI_FIFO] = txBuf[txCnt];
-         else       spiReg[SPI_FIFO] = 0;
-         txCnt++;
-      }
-   }
+   if (handle >= PI_I2C_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   while (!(spiReg[SPI_CS] & SPI_CS_DONE)) ;
+   if (i2cInfo[handle].state != PI_I2C_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   spiReg[SPI_CS] = spiDefaults; /* stop */
-}
+   if ((count < 1) || (count > PI_MAX_I2C_DEVICE_COUNT))
+      SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
 
-static void spiGo(
-   unsigned speed,
-   uint32_t flags,
-   char     *txBuf,
-   char     *rxBuf,
-   unsigned count)
-{
-   static pthread_mutex_t main_mutex = PTHREAD_MUTEX_INITIALIZER;
-   static pthread_mutex_t aux_mutex = PTHREAD_MUTEX_INITIALIZER;
+   bytes = write(i2cInfo[handle].fd, buf, count);
 
-   if (PI_SPI_FLAGS_GET_AUX_SPI(flags))
-   {
-      pthread_mutex_lock(&aux_mutex);
-      spiGoA(speed, flags, txBuf, rxBuf, count);
-      pthread_mutex_unlock(&aux_mutex);
-   }
-   else
+   if (bytes != count)
    {
-      pthread_mutex_lock(&main_mutex);
-      spiGoS(speed, flags, txBuf, rxBuf, count);
-      pthread_mutex_unlock(&main_mutex);
+      DBG(DBG_USER, "error=%d (%m)", bytes);
+      return PI_I2C_WRITE_FAILED;
    }
+
+   return 0;
 }
 
-static int spiAnyOpen(uint32_t flags)
+int i2cReadDevice(unsigned handle, char *buf, unsigned count)
 {
-   int i, aux;
+   int bytes;
 
-   aux = PI_SPI_FLAGS_GET_AUX_SPI(flags);
+   DBG(DBG_USER, "handle=%d count=%d buf=%08"PRIXPTR,
+      handle, count, (uintptr_t)buf);
 
-   for (i=0; i<PI_SPI_SLOTS; i++)
+   CHECK_INITED;
+
+   if (handle >= PI_I2C_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (i2cInfo[handle].state != PI_I2C_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if ((count < 1) || (count > PI_MAX_I2C_DEVICE_COUNT))
+      SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
+
+   bytes = read(i2cInfo[handle].fd, buf, count);
+
+   if (bytes != count)
    {
-      if ((spiInfo[i].state == PI_SPI_OPENED) &&
-         (PI_SPI_FLAGS_GET_AUX_SPI(spiInfo[i].flags) == aux))
-            return 1;
+      DBG(DBG_USER, "error=%d (%m)", bytes);
+      return PI_I2C_READ_FAILED;
    }
-   return 0;
+
+   return bytes;
 }
 
-static void spiInit(uint32_t flags)
+int i2cOpen(unsigned i2cBus, unsigned i2cAddr, unsigned i2cFlags)
 {
-   uint32_t resvd, cspols;
+   static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+   char dev[32];
+   int i, slot, fd;
+   uint32_t funcs;
 
-   resvd  = PI_SPI_FLAGS_GET_RESVD(flags);
-   cspols = PI_SPI_FLAGS_GET_CSPOLS(flags);
+   DBG(DBG_USER, "i2cBus=%d i2cAddr=%d flags=0x%X",
+      i2cBus, i2cAddr, i2cFlags);
 
-   if (PI_SPI_FLAGS_GET_AUX_SPI(flags))
-   {
-      /* enable module and access to registers */
+   CHECK_INITED;
 
-      auxReg[AUX_ENABLES] |= AUXENB_SPI1;
+   if (i2cAddr > PI_MAX_I2C_ADDR)
+      SOFT_ERROR(PI_BAD_I2C_ADDR, "bad I2C address (%d)", i2cAddr);
 
-      /* save original state */
-
-      old_mode_ace0  = gpioGetMode(PI_ASPI_CE0);
-      old_mode_ace1  = gpioGetMode(PI_ASPI_CE1);
-      old_mode_ace2  = gpioGetMode(PI_ASPI_CE2);
-      old_mode_asclk = gpioGetMode(PI_ASPI_SCLK);
-      old_mode_amiso = gpioGetMode(PI_ASPI_MISO);
-      old_mode_amosi = gpioGetMode(PI_ASPI_MOSI);
-
-      old_spi_cntl0 = auxReg[AUX_SPI0_CNTL0_REG];
-      old_spi_cntl1 = auxReg[AUX_SPI0_CNTL1_REG];
-
-      /* manually control auxiliary SPI chip selects */
+   if (i2cFlags)
+      SOFT_ERROR(PI_BAD_FLAGS, "bad flags (0x%X)", i2cFlags);
 
-      if (!(resvd&1))
-      {
-         myGpioSetMode(PI_ASPI_CE0,  PI_OUTPUT);
-         myGpioWrite(PI_ASPI_CE0, !(cspols&1));
-      }
+   slot = -1;
 
-      if (!(resvd&2))
-      {
-         myGpioSetMode(PI_ASPI_CE1,  PI_OUTPUT);
-         myGpioWrite(PI_ASPI_CE1, !(cspols&2));
-      }
+   pthread_mutex_lock(&mutex);
 
-      if (!(resvd&4))
+   for (i=0; i<PI_I2C_SLOTS; i++)
+   {
+      if (i2cInfo[i].state == PI_I2C_CLOSED)
       {
-         myGpioSetMode(PI_ASPI_CE2,  PI_OUTPUT);
-         myGpioWrite(PI_ASPI_CE2, !(cspols&4));
+         slot = i;
+         i2cInfo[slot].state = PI_I2C_RESERVED;
+         break;
       }
-
-      /* set gpios to SPI mode */
-
-      myGpioSetMode(PI_ASPI_SCLK, PI_ALT4);
-      myGpioSetMode(PI_ASPI_MISO, PI_ALT4);
-      myGpioSetMode(PI_ASPI_MOSI, PI_ALT4);
-   }
-   else
-   {
-      /* save original state */
-
-      old_mode_ce0  = gpioGetMode(PI_SPI_CE0);
-      old_mode_ce1  = gpioGetMode(PI_SPI_CE1);
-      old_mode_sclk = gpioGetMode(PI_SPI_SCLK);
-      old_mode_miso = gpioGetMode(PI_SPI_MISO);
-      old_mode_mosi = gpioGetMode(PI_SPI_MOSI);
-
-      old_spi_cs  = spiReg[SPI_CS];
-      old_spi_clk = spiReg[SPI_CLK];
-
-      /* set gpios to SPI mode */
-
-      if (!(resvd&1)) myGpioSetMode(PI_SPI_CE0,  PI_ALT0);
-      if (!(resvd&2)) myGpioSetMode(PI_SPI_CE1,  PI_ALT0);
-
-      myGpioSetMode(PI_SPI_SCLK, PI_ALT0);
-      myGpioSetMode(PI_SPI_MISO, PI_ALT0);
-      myGpioSetMode(PI_SPI_MOSI, PI_ALT0);
    }
-}
-
-static void spiTerm(uint32_t flags)
-{
-   int resvd;
-
-   resvd = PI_SPI_FLAGS_GET_RESVD(flags);
-
-   if (PI_SPI_FLAGS_GET_AUX_SPI(flags))
-   {
-      /* disable module and access to registers */
-
-      auxReg[AUX_ENABLES] &= (~AUXENB_SPI1);
 
-      /* restore original state */
+   pthread_mutex_unlock(&mutex);
 
-      if (!(resvd&1)) myGpioSetMode(PI_ASPI_CE0,  old_mode_ace0);
-      if (!(resvd&2)) myGpioSetMode(PI_ASPI_CE1,  old_mode_ace1);
-      if (!(resvd&4)) myGpioSetMode(PI_ASPI_CE2,  old_mode_ace2);
+   if (slot < 0) SOFT_ERROR(PI_NO_HANDLE, "no I2C handles");
 
-      myGpioSetMode(PI_ASPI_SCLK, old_mode_asclk);
-      myGpioSetMode(PI_ASPI_MISO, old_mode_amiso);
-      myGpioSetMode(PI_ASPI_MOSI, old_mode_amosi);
+   sprintf(dev, "/dev/i2c-%d", i2cBus);
 
-      auxReg[AUX_SPI0_CNTL0_REG] = old_spi_cntl0;
-      auxReg[AUX_SPI0_CNTL1_REG] = old_spi_cntl1;
-   }
-   else
+   if ((fd = open(dev, O_RDWR)) < 0)
    {
-      /* restore original state */
-
-      if (!(resvd&1)) myGpioSetMode(PI_SPI_CE0,  old_mode_ce0);
-      if (!(resvd&2)) myGpioSetMode(PI_SPI_CE1,  old_mode_ce1);
-
-      myGpioSetMode(PI_SPI_SCLK, old_mode_sclk);
-      myGpioSetMode(PI_SPI_MISO, old_mode_miso);
-      myGpioSetMode(PI_SPI_MOSI, old_mode_mosi);
-
-      spiReg[SPI_CS]  = old_spi_cs;
-      spiReg[SPI_CLK] = old_spi_clk;
-   }
-}
-
-int spiOpen(unsigned spiChan, unsigned baud, unsigned spiFlags)
-{
-   static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-   int i, slot;
-
-   DBG(DBG_USER, "spiChan=%d baud=%d spiFlags=0x%X",
-      spiChan, baud, spiFlags);
+      /* try a modprobe */
 
-   CHECK_INITED;
+      if (system("/sbin/modprobe i2c_dev") == -1) { /* ignore errors */}
+      if (system("/sbin/modprobe i2c_bcm2835") == -1) { /* ignore errors */}
 
-   if (PI_SPI_FLAGS_GET_AUX_SPI(spiFlags))
-   {
-      if (gpioHardwareRevision() < 16)
-         SOFT_ERROR(PI_NO_AUX_SPI, "no auxiliary SPI on Pi A or B");
+      myGpioDelay(100000);
 
-      i = PI_NUM_AUX_SPI_CHANNEL;
+      if ((fd = open(dev, O_RDWR)) < 0)
+      {
+         i2cInfo[slot].state = PI_I2C_CLOSED;
+         return PI_BAD_I2C_BUS;
+      }
    }
-   else
-      i = PI_NUM_STD_SPI_CHANNEL;
-
-   if (spiChan >= i)
-      SOFT_ERROR(PI_BAD_SPI_CHANNEL, "bad spiChan (%d)", spiChan);
-
-   if ((baud < PI_SPI_MIN_BAUD) || (baud > PI_SPI_MAX_BAUD))
-      SOFT_ERROR(PI_BAD_SPI_SPEED, "bad baud (%d)", baud);
-
-   if (spiFlags > (1<<22))
-      SOFT_ERROR(PI_BAD_FLAGS, "bad spiFlags (0x%X)", spiFlags);
 
-   if (!spiAnyOpen(spiFlags)) /* initialise on first open */
+   if (ioctl(fd, PI_I2C_SLAVE, i2cAddr) < 0)
    {
-      spiInit(spiFlags);
-      spiGo(baud, spiFlags, NULL, NULL, 0);
+      close(fd);
+      i2cInfo[slot].state = PI_I2C_CLOSED;
+      return PI_I2C_OPEN_FAILED;
    }
 
-   slot = -1;
-
-   pthread_mutex_lock(&mutex);
-
-   for (i=0; i<PI_SPI_SLOTS; i++)
+   if (ioctl(fd, PI_I2C_FUNCS, &funcs) < 0)
    {
-      if (spiInfo[i].state == PI_SPI_CLOSED)
-      {
-         slot = i;
-         spiInfo[slot].state = PI_SPI_RESERVED;
-         break;
-      }
+      funcs = -1; /* assume all smbus commands allowed */
    }
 
-   pthread_mutex_unlock(&mutex);
-
-   if (slot < 0) SOFT_ERROR(PI_NO_HANDLE, "no SPI handles");
-
-   spiInfo[slot].speed = baud;
-   spiInfo[slot].flags = spiFlags | PI_SPI_FLAGS_CHANNEL(spiChan);
-   spiInfo[slot].state = PI_SPI_OPENED;
+   i2cInfo[slot].fd = fd;
+   i2cInfo[slot].bus = i2cBus;
+   i2cInfo[slot].addr = i2cAddr;
+   i2cInfo[slot].flags = i2cFlags;
+   i2cInfo[slot].funcs = funcs;
+   i2cInfo[slot].state = PI_I2C_OPENED;
 
    return slot;
 }
 
-int spiClose(unsigned handle)
+int i2cClose(unsigned handle)
 {
    DBG(DBG_USER, "handle=%d", handle);
 
    CHECK_INITED;
 
-   if (handle >= PI_SPI_SLOTS)
+   if (handle >= PI_I2C_SLOTS)
       SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   if (spiInfo[handle].state != PI_SPI_OPENED)
+   if (i2cInfo[handle].state != PI_I2C_OPENED)
       SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   spiInfo[handle].state = PI_SPI_CLOSED;
+   acqHandleClosed(PI_ACQ_I2C, handle);
 
-   if (!spiAnyOpen(spiInfo[handle].flags))
-      spiTerm(spiInfo[handle].flags); /* terminate on last close */
+   if (i2cInfo[handle].fd >= 0) close(i2cInfo[handle].fd);
+
+   i2cInfo[handle].fd = -1;
+   i2cInfo[handle].state = PI_I2C_CLOSED;
 
    return 0;
 }
 
-int spiRead(unsigned handle, char *buf, unsigned count)
+void i2cSwitchCombined(int setting)
 {
-   DBG(DBG_USER, "handle=%d count=%d [%s]",
-      handle, count, myBuf2Str(count, buf));
-
-   CHECK_INITED;
-
-   if (handle >= PI_SPI_SLOTS)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+   int fd;
 
-   if (spiInfo[handle].state != PI_SPI_OPENED)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+   DBG(DBG_USER, "setting=%d", setting);
 
-   if (count > PI_MAX_SPI_DEVICE_COUNT)
-      SOFT_ERROR(PI_BAD_SPI_COUNT, "bad count (%d)", count);
+   fd = open(PI_I2C_COMBINED, O_WRONLY);
 
-   spiGo(spiInfo[handle].speed, spiInfo[handle].flags, NULL, buf, count);
+   if (fd >= 0)
+   {
+      if (setting)
+      {
+         if (write(fd, "1\n", 2) == -1) { /* ignore errors */ }
+      }
+      else
+      {
+         if (write(fd, "0\n", 2) == -1) { /* ignore errors */ }
+      }
 
-   return count;
+      close(fd);
+   }
 }
 
-int spiWrite(unsigned handle, char *buf, unsigned count)
+int i2cSegments(unsigned handle, pi_i2c_msg_t *segs, unsigned numSegs)
 {
-   DBG(DBG_USER, "handle=%d count=%d [%s]",
-      handle, count, myBuf2Str(count, buf));
+   int retval;
+   my_i2c_rdwr_ioctl_data_t rdwr;
+
+   DBG(DBG_USER, "handle=%d", handle);
 
    CHECK_INITED;
 
-   if (handle >= PI_SPI_SLOTS)
+   if (handle >= PI_I2C_SLOTS)
       SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   if (spiInfo[handle].state != PI_SPI_OPENED)
+   if (i2cInfo[handle].state != PI_I2C_OPENED)
       SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   if (count > PI_MAX_SPI_DEVICE_COUNT)
-      SOFT_ERROR(PI_BAD_SPI_COUNT, "bad count (%d)", count);
+   if (segs == NULL)
+      SOFT_ERROR(PI_BAD_POINTER, "null segments");
 
-   spiGo(spiInfo[handle].speed, spiInfo[handle].flags, buf, NULL, count);
+   if (numSegs > PI_I2C_RDRW_IOCTL_MAX_MSGS)
+      SOFT_ERROR(PI_TOO_MANY_SEGS, "too many segments (%d)", numSegs);
 
-   return count;
+   rdwr.msgs = segs;
+   rdwr.nmsgs = numSegs;
+
+   retval = ioctl(i2cInfo[handle].fd, PI_I2C_RDWR, &rdwr);
+
+   if (retval >= 0) return retval;
+   else             return PI_BAD_I2C_SEG;
 }
 
-int spiXfer(unsigned handle, char *txBuf, char *rxBuf, unsigned count)
+int i2cZip(
+   unsigned handle,
+   char *inBuf, unsigned inLen, char *outBuf, unsigned outLen)
 {
-   DBG(DBG_USER, "handle=%d count=%d [%s]",
-      handle, count, myBuf2Str(count, txBuf));
+   int numSegs, inPos, outPos, status, bytes, flags, addr;
+   int esc, setesc;
+   pi_i2c_msg_t segs[PI_I2C_RDRW_IOCTL_MAX_MSGS];
+
+   DBG(DBG_USER, "handle=%d inBuf=%s outBuf=%08"PRIXPTR" len=%d",
+      handle, myBuf2Str(inLen, (char *)inBuf), (uintptr_t)outBuf, outLen);
 
    CHECK_INITED;
 
-   if (handle >= PI_SPI_SLOTS)
+   if (handle >= PI_I2C_SLOTS)
       SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   if (spiInfo[handle].state != PI_SPI_OPENED)
+   if (i2cInfo[handle].state != PI_I2C_OPENED)
       SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-   if (count > PI_MAX_SPI_DEVICE_COUNT)
-      SOFT_ERROR(PI_BAD_SPI_COUNT, "bad count (%d)", count);
+   if (!inBuf || !inLen)
+      SOFT_ERROR(PI_BAD_POINTER, "input buffer can't be NULL");
 
-   spiGo(spiInfo[handle].speed, spiInfo[handle].flags, txBuf, rxBuf, count);
+   if (!outBuf && outLen)
+      SOFT_ERROR(PI_BAD_POINTER, "output buffer can't be NULL");
 
-   return count;
-}
+   numSegs = 0;
 
-/* ======================================================================= */
+   inPos = 0;
+   outPos = 0;
+   status = 0;
 
+   addr = i2cInfo[handle].addr;
+   flags = 0;
+   esc = 0;
+   setesc = 0;
 
-int serOpen(char *tty, unsigned serBaud, unsigned serFlags)
-{
-   static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-   struct termios new;
-   int speed;
-   int fd;
-   int i, slot;
+   while (!status && (inPos < inLen))
+   {
+      DBG(DBG_INTERNAL, "status=%d inpos=%d inlen=%d cmd=%d addr=%d flags=%x",
+         status, inPos, inLen, inBuf[inPos], addr, flags);
 
-   DBG(DBG_USER, "tty=%s serBaud=%d serFlags=0x%X", tty, serBaud, serFlags);
+      switch (inBuf[inPos++])
+      {
+         case PI_I2C_END:
+            status = 1;
+            break;
 
-   SER_CHECK_INITED;
+         case PI_I2C_COMBINED_ON:
+            /* Run prior transactions before setting combined flag */
+            if (numSegs)
+            {
+               status = i2cSegments(handle, segs, numSegs);
+               if (status >= 0) status = 0; /* continue */
+               numSegs = 0;
+            }
+            i2cSwitchCombined(1);
+            break;
 
-   if (strncmp("/dev/tty", tty, 8) && strncmp("/dev/serial", tty, 11))
-      SOFT_ERROR(PI_BAD_SER_DEVICE, "bad device (%s)", tty);
+         case PI_I2C_COMBINED_OFF:
+            /* Run prior transactions before clearing combined flag */
+            if (numSegs)
+            {
+               status = i2cSegments(handle, segs, numSegs);
+               if (status >= 0) status = 0; /* continue */
+               numSegs = 0;
+            }
+            i2cSwitchCombined(0);
+            break;
 
-   switch (serBaud)
-   {
-      case     50: speed =     B50; break;
-      case     75: speed =     B75; break;
-      case    110: speed =    B110; break;
-      case    134: speed =    B134; break;
-      case    150: speed =    B150; break;
-      case    200: speed =    B200; break;
-      case    300: speed =    B300; break;
-      case    600: speed =    B600; break;
-      case   1200: speed =   B1200; break;
-      case   1800: speed =   B1800; break;
-      case   2400: speed =   B2400; break;
-      case   4800: speed =   B4800; break;
-      case   9600: speed =   B9600; break;
-      case  19200: speed =  B19200; break;
-      case  38400: speed =  B38400; break;
-      case  57600: speed =  B57600; break;
-      case 115200: speed = B115200; break;
-      case 230400: speed = B230400; break;
+         case PI_I2C_ADDR:
+            addr = myI2CGetPar(inBuf, &inPos, inLen, &esc);
+            if (addr < 0) status = PI_BAD_I2C_CMD;
+            break;
 
-      default:
-         SOFT_ERROR(PI_BAD_SER_SPEED, "bad speed (%d)", serBaud);
-   }
+         case PI_I2C_FLAGS:
+            /* cheat to force two byte flags */
+            esc = 1;
+            flags = myI2CGetPar(inBuf, &inPos, inLen, &esc);
+            if (flags < 0) status = PI_BAD_I2C_CMD;
+            break;
 
-   if (serFlags)
-      SOFT_ERROR(PI_BAD_FLAGS, "bad flags (0x%X)", serFlags);
+         case PI_I2C_ESC:
+            setesc = 1;
+            break;
 
-   slot = -1;
+         case PI_I2C_READ:
 
-   pthread_mutex_lock(&mutex);
+            bytes = myI2CGetPar(inBuf, &inPos, inLen, &esc);
 
-   for (i=0; i<PI_SER_SLOTS; i++)
-   {
-      if (serInfo[i].state == PI_SER_CLOSED)
-      {
-         slot = i;
-         serInfo[slot].state = PI_SER_RESERVED;
-         break;
+            if (bytes >= 0)
+            {
+               if ((bytes + outPos) < outLen)
+               {
+                  segs[numSegs].addr = addr;
+                  segs[numSegs].flags = (flags|1);
+                  segs[numSegs].len = bytes;
+                  segs[numSegs].buf = (uint8_t *)(outBuf + outPos);
+                  outPos += bytes;
+                  numSegs++;
+                  if (numSegs >= PI_I2C_RDRW_IOCTL_MAX_MSGS)
+                  {
+                     status = i2cSegments(handle, segs, numSegs);
+                     if (status >= 0) status = 0; /* continue */
+                     numSegs = 0;
+                  }
+               }
+               else status = PI_BAD_I2C_RLEN;
+            }
+            else status = PI_BAD_I2C_RLEN;
+            break;
+
+         case PI_I2C_WRITE:
+
+            bytes = myI2CGetPar(inBuf, &inPos, inLen, &esc);
+
+            if (bytes >= 0)
+            {
+               if ((bytes + inPos) < inLen)
+               {
+                  segs[numSegs].addr = addr;
+                  segs[numSegs].flags = (flags&0xfffe);
+                  segs[numSegs].len = bytes;
+                  segs[numSegs].buf = (uint8_t *)(inBuf + inPos);
+                  inPos += bytes;
+                  numSegs++;
+                  if (numSegs >= PI_I2C_RDRW_IOCTL_MAX_MSGS)
+                  {
+                     status = i2cSegments(handle, segs, numSegs);
+                     if (status >= 0) status = 0; /* continue */
+                     numSegs = 0;
+                  }
+               }
+               else status = PI_BAD_I2C_WLEN;
+            }
+            else status = PI_BAD_I2C_WLEN;
+            break;
+
+         default:
+            status = PI_BAD_I2C_CMD;
       }
-   }
 
-   pthread_mutex_unlock(&mutex);
+      if (setesc) esc = 1; else esc = 0;
 
-   if (slot < 0) SOFT_ERROR(PI_NO_HANDLE, "no serial handles");
+      setesc = 0;
+   }
 
-   if ((fd = open(tty, O_RDWR | O_NOCTTY | O_NDELAY | O_NONBLOCK)) == -1)
+   if (status >= 0)
    {
-      serInfo[slot].state = PI_SER_CLOSED;
-      return PI_SER_OPEN_FAILED;
+      if (numSegs) status = i2cSegments(handle, segs, numSegs);
    }
 
-   tcgetattr(fd, &new);
+   if (status >= 0) status = outPos;
 
-   cfmakeraw(&new);
+   return status;
+}
 
-   cfsetispeed(&new, speed);
-   cfsetospeed(&new, speed);
+static int i2cOpSMBus(pi_i2c_op_t *op)
+{
+   /* one operation by SMBus, for adapters without I2C_RDWR */
 
-   new.c_cc [VMIN]  = 0;
-   new.c_cc [VTIME] = 0;
+   int status;
 
-   tcflush(fd, TCIFLUSH);
-   tcsetattr(fd, TCSANOW, &new);
+   if (op->flags & PI_I2C_OP_READ)
+   {
+      if (!(op->flags & PI_I2C_OP_REG))
+         return i2cReadDevice(op->handle, op->buf, op->len);
 
-   //fcntl(fd, F_SETFL, O_RDWR);
+      if (op->len > 1)
+         return i2cReadI2CBlockData(op->handle, op->reg, op->buf, op->len);
 
-   serInfo[slot].fd = fd;
-   serInfo[slot].flags = serFlags;
-   serInfo[slot].state = PI_SER_OPENED;
+      status = i2cReadByteData(op->handle, op->reg);
 
-   return slot;
+      if (status >= 0)
+      {
+         op->buf[0] = status;
+         status = 1;
+      }
+   }
+   else
+   {
+      if (!(op->flags & PI_I2C_OP_REG))
+         status = i2cWriteDevice(op->handle, op->buf, op->len);
+      else if (op->len == 0)
+         status = i2cWriteByte(op->handle, op->reg);
+      else if (op->len == 1)
+         status = i2cWriteByteData(op->handle, op->reg, op->buf[0]);
+      else
+         status = i2cWriteI2CBlockData(op->handle, op->reg, op->buf, op->len);
+
+      if (status >= 0) status = op->len;
+   }
+
+   return status;
 }
 
-int serClose(unsigned handle)
+static int i2cOpMsgs(pi_i2c_op_t *op, pi_i2c_msg_t *msg, char *scratch)
 {
-   DBG(DBG_USER, "handle=%d", handle);
-
-   SER_CHECK_INITED;
+   /*
+   Adds the segments of an operation, a register read is a
+   register write and a read joined by a repeated start, a
+   register write is the register followed by the data.
+   */
 
-   if (handle >= PI_SER_SLOTS)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+   int n = 0;
 
-   if (serInfo[handle].state != PI_SER_OPENED)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+   if (op->flags & PI_I2C_OP_REG)
+   {
+      msg[n].addr = i2cInfo[op->handle].addr;
+      msg[n].flags = PI_I2C_M_WR;
 
-   if (serInfo[handle].fd >= 0) close(serInfo[handle].fd);
+      if (op->flags & PI_I2C_OP_READ)
+      {
+         msg[n].len = 1;
+         msg[n].buf = &op->reg;
+         n++;
+      }
+      else
+      {
+         scratch[0] = op->reg;
+         memcpy(scratch+1, op->buf, op->len);
+         msg[n].len = op->len + 1;
+         msg[n].buf = (uint8_t *)scratch;
+         return 1;
+      }
+   }
 
-   serInfo[handle].fd = -1;
-   serInfo[handle].state = PI_SER_CLOSED;
+   msg[n].addr = i2cInfo[op->handle].addr;
+   msg[n].flags = (op->flags & PI_I2C_OP_READ) ? PI_I2C_M_RD : PI_I2C_M_WR;
+   msg[n].len = op->len;
+   msg[n].buf = (uint8_t *)op->buf;
 
-   return 0;
+   return n + 1;
 }
 
-int serWriteByte(unsigned handle, unsigned bVal)
+static void i2cBatchRun(pi_i2c_op_t **op, int numOps)
 {
-   char c;
+   pi_i2c_msg_t msgs[PI_I2C_RDRW_IOCTL_MAX_MSGS];
+   char scratch[I2C_BATCH_SCRATCH];
+   my_i2c_rdwr_ioctl_data_t rdwr;
+   int i, m, used;
 
-   DBG(DBG_USER, "handle=%d bVal=%d", handle, bVal);
+   m = 0;
+   used = 0;
 
-   SER_CHECK_INITED;
+   for (i=0; i<numOps; i++)
+   {
+      m += i2cOpMsgs(op[i], msgs+m, scratch+used);
 
-   if (handle >= PI_SER_SLOTS)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+      if ((op[i]->flags & PI_I2C_OP_REG) && !(op[i]->flags & PI_I2C_OP_READ))
+         used += op[i]->len + 1;
+   }
 
-   if (serInfo[handle].state != PI_SER_OPENED)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+   rdwr.msgs = msgs;
+   rdwr.nmsgs = m;
 
-   if (bVal > 0xFF)
-      SOFT_ERROR(PI_BAD_PARAM, "bad parameter (%d)", bVal);
+   if (ioctl(i2cInfo[op[0]->handle].fd, PI_I2C_RDWR, &rdwr) >= 0)
+   {
+      for (i=0; i<numOps; i++) op[i]->status = op[i]->len;
+   }
+   else
+   {
+      /*
+      The ioctl stops at the first failure without saying which
+      message it was.  Those before it have been performed so
+      replaying them would repeat writes and clear-on-read reads,
+      the whole chunk is marked as failed instead.
+      */
 
-   c = bVal;
+      DBG(DBG_USER, "error (%m), %d operations failed", numOps);
 
-   if (write(serInfo[handle].fd, &c, 1) != 1)
-      return PI_SER_WRITE_FAILED;
-   else
-      return 0;
+      for (i=0; i<numOps; i++)
+      {
+         if (op[i]->flags & PI_I2C_OP_READ)
+            op[i]->status = PI_I2C_READ_FAILED;
+         else
+            op[i]->status = PI_I2C_WRITE_FAILED;
+      }
+   }
 }
 
-int serReadByte(unsigned handle)
+int i2cBatch(unsigned numOps, pi_i2c_op_t *ops)
 {
-   int r;
-   char x;
+   pi_i2c_op_t *chunk[PI_I2C_RDRW_IOCTL_MAX_MSGS];
+   pi_i2c_op_t *op;
+   unsigned i, j, bus;
+   int n, m, need, size, used, ok;
 
-   DBG(DBG_USER, "handle=%d", handle);
+   DBG(DBG_USER, "numOps=%d ops=%08"PRIXPTR, numOps, (uintptr_t)ops);
 
-   SER_CHECK_INITED;
+   CHECK_INITED;
 
-   if (handle >= PI_SER_SLOTS)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+   if (!ops && numOps)
+      SOFT_ERROR(PI_BAD_POINTER, "null operations");
 
-   if (serInfo[handle].state != PI_SER_OPENED)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+   for (i=0; i<numOps; i++)
+   {
+      op = &ops[i];
 
-   r = read(serInfo[handle].fd, &x, 1);
+      op->status = I2C_OP_PENDING;
 
-   if (r == 1)
-      return ((int)x) & 0xFF;
+      if ((op->handle >= PI_I2C_SLOTS) ||
+          (i2cInfo[op->handle].state != PI_I2C_OPENED))
+         op->status = PI_BAD_HANDLE;
+      else if (op->len && !op->buf)
+         op->status = PI_BAD_POINTER;
+      else if (op->flags & PI_I2C_OP_READ)
+      {
+         if (!op->len) op->status = PI_BAD_I2C_RLEN;
+      }
+      else if (op->flags & PI_I2C_OP_REG)
+      {
+         if (op->len >= I2C_BATCH_SCRATCH) op->status = PI_BAD_I2C_WLEN;
+      }
+      else if (!op->len) op->status = PI_BAD_I2C_WLEN;
+   }
 
-   else if (r == 0)
-      return PI_SER_READ_NO_DATA;
+   /*
+   Operations on one bus are joined, in order, into as few
+   I2C_RDWR ioctls as will hold them.  Each ioctl is made
+   through the first handle in it as the segments carry the
+   device addresses.
+   */
 
-   else if ((r == -1) && (errno == EAGAIN))
-      return PI_SER_READ_NO_DATA;
+   for (i=0; i<numOps; i++)
+   {
+      if (ops[i].status != I2C_OP_PENDING) continue;
 
-   else
-      return PI_SER_READ_FAILED;
-}
+      if (!(i2cInfo[ops[i].handle].funcs & PI_I2C_FUNC_I2C))
+      {
+         ops[i].status = i2cOpSMBus(&ops[i]);
+         continue;
+      }
 
-int serWrite(unsigned handle, char *buf, unsigned count)
-{
-   int written=0, wrote=0;
+      bus = i2cInfo[ops[i].handle].bus;
 
-   DBG(DBG_USER, "handle=%d count=%d [%s]",
-      handle, count, myBuf2Str(count, buf));
+      n = 0;
+      m = 0;
+      used = 0;
 
-   SER_CHECK_INITED;
+      for (j=i; j<numOps; j++)
+      {
+         op = &ops[j];
 
-   if (handle >= PI_SER_SLOTS)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+         if ((op->status != I2C_OP_PENDING) ||
+             (i2cInfo[op->handle].bus != bus) ||
+             !(i2cInfo[op->handle].funcs & PI_I2C_FUNC_I2C)) continue;
 
-   if (serInfo[handle].state != PI_SER_OPENED)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+         need = 1;
+         size = 0;
 
-   if (!count)
-      SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
+         if (op->flags & PI_I2C_OP_REG)
+         {
+            if (op->flags & PI_I2C_OP_READ) need = 2;
+            else                            size = op->len + 1;
+         }
 
-   while ((written != count) && (wrote >= 0))
-   {
-      wrote = write(serInfo[handle].fd, buf+written, count-written);
+         if (((m + need) > PI_I2C_RDRW_IOCTL_MAX_MSGS) ||
+             ((used + size) > I2C_BATCH_SCRATCH)) break;
 
-      if (wrote >= 0)
-      {
-         written += wrote;
+         m += need;
+         used += size;
 
-         if (written != count) time_sleep(0.05);
+         chunk[n++] = op;
+
+         op->status = 0;
       }
+
+      i2cBatchRun(chunk, n);
    }
 
-   if (written != count)
-      return PI_SER_WRITE_FAILED;
-   else
-      return 0;
+   ok = 0;
+
+   for (i=0; i<numOps; i++) if (ops[i].status >= 0) ok++;
+
+   return ok;
 }
 
-int serRead(unsigned handle, char *buf, unsigned count)
+static void *pthI2CWorker(void *x)
 {
-   int r;
+   i2cWorker_t *w = x;
+   i2cRequest_t *r;
+   i2cBatchFunc_t func;
+   void *userdata;
+   int i, best, worker;
 
-   DBG(DBG_USER, "handle=%d count=%d buf=0x%"PRIXPTR, handle, count, (uintptr_t)buf);
+   worker = w - i2cWorker;
 
-   SER_CHECK_INITED;
+   pthread_mutex_lock(&i2cAsyncMutex);
 
-   if (handle >= PI_SER_SLOTS)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+   while (!i2cAsyncStop)
+   {
+      /* highest priority first, then oldest first */
 
-   if (serInfo[handle].state != PI_SER_OPENED)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+      best = -1;
 
-   if (!count)
-      SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
+      for (i=0; i<I2C_REQUESTS; i++)
+      {
+         r = &i2cRequest[i];
 
-   r = read(serInfo[handle].fd, buf, count);
+         if ((r->state != I2C_REQ_QUEUED) || (r->worker != worker)) continue;
 
-   if (r == -1)
-   {
-      if (errno == EAGAIN)
-         return PI_SER_READ_NO_DATA;
-      else
-         return PI_SER_READ_FAILED;
-   }
-   else
-   {
-      if (r < count) buf[r] = 0;
-      return r;
-   }
-}
+         if ((best < 0) ||
+             (r->priority > i2cRequest[best].priority) ||
+             ((r->priority == i2cRequest[best].priority) &&
+              ((int32_t)(r->seq - i2cRequest[best].seq) < 0))) best = i;
+      }
 
-int serDataAvailable(unsigned handle)
-{
-   int result;
+      if (best < 0)
+      {
+         pthread_cond_wait(&w->cond, &i2cAsyncMutex);
+         continue;
+      }
 
-   DBG(DBG_USER, "handle=%d", handle);
+      r = &i2cRequest[best];
 
-   SER_CHECK_INITED;
+      r->state = I2C_REQ_RUNNING;
 
-   if (handle >= PI_SER_SLOTS)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+      pthread_mutex_unlock(&i2cAsyncMutex);
 
-   if (serInfo[handle].state != PI_SER_OPENED)
-      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+      r->status = i2cBatch(r->numOps, r->ops);
 
-   if (ioctl(serInfo[handle].fd, FIONREAD, &result) == -1) return 0;
+      pthread_mutex_lock(&i2cAsyncMutex);
 
-   return result;
-}
+      if (r->owner == I2C_OWNER_GONE)
+      {
+         /* nobody is left to collect the result */
 
-/* ======================================================================= */
+         free(r->copy);
 
-static int chooseBestClock
-   (clkInf_t *clkInf, unsigned f, unsigned numc, unsigned *cf)
-{
-   int c, valid;
-   double fdiv, offby, best_offby;
-   unsigned div, frac;
+         r->copy = NULL;
+         r->state = I2C_REQ_FREE;
+      }
+      else if (r->func)
+      {
+         func = r->func;
+         userdata = r->userdata;
 
-   valid = 0;
-   best_offby = 0;
+         pthread_mutex_unlock(&i2cAsyncMutex);
 
-   for (c=0; c<numc; c++)
-   {
-      fdiv = (double)cf[c] / (double)f;
-      if (f < PI_MASH_MAX_FREQ)
-      {
-         fdiv += (0.5 / 4096.0);
-         div = fdiv;
-         frac = (fdiv - div) * 4096.0;
+         (func)(best, r->status, userdata);
+
+         pthread_mutex_lock(&i2cAsyncMutex);
+
+         r->state = I2C_REQ_FREE;
       }
       else
       {
-         fdiv += 0.5;
-         div = fdiv;
-         frac = 0;
-      }
+         r->state = I2C_REQ_DONE;
 
-      if ((div > 1) && (div < 4096))
-      {
-         offby = f - (cf[c] / (div + (frac / 4096.0)));
-         if (offby < 0) offby = - offby;
-         if ((!valid) || (offby <= best_offby))
-         {
-            valid = 1;
-            clkInf->div = div;
-            clkInf->frac = frac;
-            clkInf->clock = c;
-            best_offby = offby;
-         }
+         pthread_cond_broadcast(&i2cAsyncDone);
+
+         if (r->event >= 0) eventTrigger(r->event);
       }
    }
-   return valid;
-}
-
-/* ======================================================================= */
-
-static rawCbs_t * dmaCB2adr(int pos)
-{
-   int page, slot;
 
-   page = pos/CBS_PER_IPAGE;
-   slot = pos%CBS_PER_IPAGE;
+   pthread_mutex_unlock(&i2cAsyncMutex);
 
-   return &dmaIVirt[page]->cb[slot];
+   return NULL;
 }
 
-/* ----------------------------------------------------------------------- */
-
-static void dmaCbPrint(int pos)
+static int intI2CBatchStart(
+   unsigned numOps, pi_i2c_op_t *ops, unsigned priority,
+   i2cBatchFunc_t f, void *userdata, int event, char *copy, int owner)
 {
-   rawCbs_t * p;
+   pthread_attr_t pthAttr;
+   i2cRequest_t *r;
+   int i, id, worker, bus;
 
-   p = dmaCB2adr(pos);
+   bus = -1;
 
-   fprintf(stderr, "i=%x s=%x d=%x len=%x s=%x nxt=%x\n",
-      p->info, p->src, p->dst, p->length, p->stride, p->next);
-}
+   for (i=0; i<numOps; i++)
+   {
+      /* bad handles are left for i2cBatch to report */
 
-/* ----------------------------------------------------------------------- */
+      if ((ops[i].handle >= PI_I2C_SLOTS) ||
+          (i2cInfo[ops[i].handle].state != PI_I2C_OPENED)) continue;
 
-static unsigned dmaNowAtICB(void)
-{
-   unsigned cb;
-   static unsigned lastPage=0;
-   unsigned page;
-   uint32_t cbAddr;
-   uint32_t startTick, endTick;
+      if (bus < 0) bus = i2cInfo[ops[i].handle].bus;
+      else if (i2cInfo[ops[i].handle].bus != bus)
+         SOFT_ERROR(PI_BAD_PARAM, "operations on more than one bus");
+   }
 
-   startTick = systReg[SYST_CLO];
+   if (bus < 0) SOFT_ERROR(PI_BAD_HANDLE, "no valid handle");
 
-   cbAddr = dmaIn[DMA_CONBLK_AD];
+   pthread_mutex_lock(&i2cAsyncMutex);
 
-   page = lastPage;
+   worker = -1;
 
-   /* which page are we dma'ing? */
+   for (i=0; i<I2C_WORKERS; i++)
+   {
+      if (i2cWorker[i].bus == bus) {worker = i; break;}
+      if ((worker < 0) && (i2cWorker[i].bus < 0)) worker = i;
+   }
 
-   while (1)
+   for (id=0; id<I2C_REQUESTS; id++)
    {
-      //cast twice to suppress compiler warning, I belive this cast is ok
-      //because dmaIbus contains bus addresses, not user addresses. --plugwash
-      cb = (cbAddr - ((int)(uintptr_t)dmaIBus[page])) / 32;
+      if (i2cRequest[id].state == I2C_REQ_FREE) break;
+   }
 
-      if (cb < CBS_PER_IPAGE)
-      {
-         endTick = systReg[SYST_CLO];
+   if ((worker < 0) || (id >= I2C_REQUESTS))
+   {
+      pthread_mutex_unlock(&i2cAsyncMutex);
+      SOFT_ERROR(PI_NO_HANDLE, "no I2C worker or request slots");
+   }
 
-         if (endTick != startTick)
-            gpioStats.cbTicks += (endTick - startTick);
+   if (!i2cWorker[worker].running)
+   {
+      /* one worker thread per bus, started by its first request */
 
-         gpioStats.cbCalls++;
+      if (pthread_attr_init(&pthAttr) ||
+          pthread_attr_setstacksize(&pthAttr, STACK_SIZE) ||
+          pthread_create(&i2cWorker[worker].pth, &pthAttr, pthI2CWorker,
+             &i2cWorker[worker]))
+      {
+         pthread_mutex_unlock(&i2cAsyncMutex);
+         SOFT_ERROR(PI_NO_HANDLE, "I2C worker create failed (%m)");
+      }
 
-         lastPage = page;
+      i2cWorker[worker].bus = bus;
+      i2cWorker[worker].running = 1;
+   }
 
-         return (page*CBS_PER_IPAGE) + cb;
-      }
+   r = &i2cRequest[id];
 
-      if (page++ >= DMAI_PAGES) page=0;
+   r->worker   = worker;
+   r->priority = priority;
+   r->seq      = i2cSeq++;
+   r->ops      = ops;
+   r->numOps   = numOps;
+   r->func     = f;
+   r->userdata = userdata;
+   r->event    = event;
+   r->copy     = copy;
+   r->owner    = owner;
+   r->state    = I2C_REQ_QUEUED;
 
-      if (page == lastPage) break;
-   }
+   pthread_cond_signal(&i2cWorker[worker].cond);
 
-   return 0;
-}
+   pthread_mutex_unlock(&i2cAsyncMutex);
 
-/* ----------------------------------------------------------------------- */
+   return id;
+}
 
-static int dmaNowAtOCB(void)
+static int intI2CBatchWait(
+   unsigned id, unsigned timeout, char *buf, unsigned bufSize, int owner)
 {
-   unsigned cb;
-   unsigned page;
-   uint32_t cbAddr;
+   /*
+   If buf is given the results are packed for the socket.  Only
+   the request's owner may collect it.
+   */
 
-   cbAddr = dmaOut[DMA_CONBLK_AD];
+   struct timespec deadline;
+   i2cRequest_t *r;
+   pi_i2c_op_t *op;
+   int i, status, pos;
 
-   if (!cbAddr) return -PI_NO_TX_WAVE;
+   pthread_mutex_lock(&i2cAsyncMutex);
 
-   page = 0;
+   r = &i2cRequest[id];
 
-   /* which page are we dma'ing? */
+   if ((r->state == I2C_REQ_FREE) || r->func || (r->owner != owner))
+   {
+      pthread_mutex_unlock(&i2cAsyncMutex);
+      SOFT_ERROR(PI_BAD_HANDLE, "bad I2C request (%d)", id);
+   }
 
-   while (1)
+   clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+   deadline.tv_sec  += timeout / THOUSAND;
+   deadline.tv_nsec += (timeout % THOUSAND) * THOUSAND * THOUSAND;
+
+   if (deadline.tv_nsec >= (THOUSAND * MILLION))
    {
-      //cast twice to suppress compiler warning, I belive this cast is ok
-      //because dmaIbus contains bus addresses, not user addresses. --plugwash
-      cb = (cbAddr - ((int)(uintptr_t)dmaOBus[page])) / 32;
+      deadline.tv_sec++;
+      deadline.tv_nsec -= (THOUSAND * MILLION);
+   }
 
-      if (cb < CBS_PER_OPAGE) return (page*CBS_PER_OPAGE) + cb;
+   while (timeout && (r->state != I2C_REQ_DONE))
+   {
+      if (pthread_cond_timedwait(&i2cAsyncDone, &i2cAsyncMutex, &deadline)
+         == ETIMEDOUT) break;
+   }
 
-      if (page++ >= DMAO_PAGES) break;
+   if (r->state != I2C_REQ_DONE)
+   {
+      pthread_mutex_unlock(&i2cAsyncMutex);
+      return PI_I2C_PENDING;
    }
 
-   /* Try twice */
+   status = r->status;
 
-   cbAddr = dmaOut[DMA_CONBLK_AD];
+   if (buf)
+   {
+      /* per operation, status then any data read */
 
-   if (!cbAddr) return -PI_NO_TX_WAVE;
+      pos = 0;
 
-   page = 0;
+      for (i=0; i<r->numOps; i++)
+      {
+         op = &r->ops[i];
 
-   /* which page are we dma'ing? */
+         if ((pos + 4) > bufSize) break;
 
-   while (1)
-   {
-      //cast twice to suppress compiler warning, I belive this cast is ok
-      //because dmaIbus contains bus addresses, not user addresses. --plugwash
-      cb = (cbAddr - ((int)(uintptr_t)dmaOBus[page])) / 32;
+         memcpy(buf+pos, &op->status, 4);
+         pos += 4;
 
-      if (cb < CBS_PER_OPAGE) return (page*CBS_PER_OPAGE) + cb;
+         if ((op->flags & PI_I2C_OP_READ) && (op->status > 0))
+         {
+            if ((pos + op->status) > bufSize) break;
 
-      if (page++ >= DMAO_PAGES) break;
+            memcpy(buf+pos, op->buf, op->status);
+            pos += op->status;
+         }
+      }
+
+      if (i < r->numOps) status = PI_BAD_I2C_RLEN;
+      else               status = pos;
    }
 
-   return -PI_WAVE_NOT_FOUND;
-}
+   if (r->copy) free(r->copy);
 
-/* ----------------------------------------------------------------------- */
+   r->copy = NULL;
+   r->state = I2C_REQ_FREE;
 
-unsigned rawWaveCB(void)
-{
-   unsigned cb;
-   static unsigned lastPage=0;
-   unsigned page;
-   uint32_t cbAddr;
+   pthread_mutex_unlock(&i2cAsyncMutex);
 
-   cbAddr = dmaOut[DMA_CONBLK_AD];
+   return status;
+}
 
-   if (!cbAddr) return -1;
+static void closeOrphanedI2CRequests(int fd)
+{
+   /* frees the requests of a closed socket, or has them freed when done */
 
-   page = lastPage;
+   i2cRequest_t *r;
+   int i;
 
-   /* which page are we dma'ing? */
+   pthread_mutex_lock(&i2cAsyncMutex);
 
-   while (1)
+   for (i=0; i<I2C_REQUESTS; i++)
    {
-      //cast twice to suppress compiler warning, I belive this cast is ok
-      //because dmaIbus contains bus addresses, not user addresses. --plugwash
-      cb = (cbAddr - ((int)(uintptr_t)dmaOBus[page])) / 32;
+      r = &i2cRequest[i];
 
-      if (cb < CBS_PER_OPAGE)
+      if ((r->state == I2C_REQ_FREE) || (r->owner != fd)) continue;
+
+      if (r->state == I2C_REQ_RUNNING) r->owner = I2C_OWNER_GONE;
+      else
       {
-         lastPage = page;
+         free(r->copy);
 
-         return (page*CBS_PER_OPAGE) + cb;
+         r->copy = NULL;
+         r->state = I2C_REQ_FREE;
       }
+   }
 
-      if (page++ >= DMAO_PAGES) page=0;
+   pthread_mutex_unlock(&i2cAsyncMutex);
+}
 
-      if (page == lastPage) break;
-   }
+static int i2cBatchSocket(
+   unsigned priority, unsigned event, char *buf, unsigned len, int owner)
+{
+   /*
+   Each operation is handle (2 bytes), flags, reg, len (2 bytes),
+   all little endian, then the data of a write.
+   */
 
-   return 0;
-}
+   pi_i2c_op_t *ops;
+   char *copy, *data;
+   unsigned pos, numOps, bytes, reply, opLen, i;
+   int id;
 
-/* ----------------------------------------------------------------------- */
+   if (priority > PI_MAX_I2C_PRIORITY)
+      SOFT_ERROR(PI_BAD_PARAM, "bad priority (%d)", priority);
 
-static unsigned dmaCurrentSlot(unsigned pos)
-{
-   unsigned cycle=0, slot=0, tmp;
+   numOps = 0;
+   bytes = 0;
+   reply = 0;
 
-   cycle = (pos/CBS_PER_CYCLE);
-   tmp   = (pos%CBS_PER_CYCLE);
+   for (pos=0; (pos+6)<=len; numOps++)
+   {
+      opLen = (uint8_t)buf[pos+4] | ((uint8_t)buf[pos+5] << 8);
 
-   if (tmp > 2) slot = ((tmp-2)/3);
+      bytes += opLen;
+      reply += 4;
 
-   return (cycle*PULSE_PER_CYCLE)+slot;
-}
+      if (buf[pos+2] & PI_I2C_OP_READ) reply += opLen;
+      else pos += opLen;
 
-/* ----------------------------------------------------------------------- */
+      pos += 6;
+   }
 
-static uint32_t dmaPwmDataAdr(int pos)
-{
-   //cast twice to suppress compiler warning, I belive this cast is ok
-   //because dmaIbus contains bus addresses, not user addresses. --plugwash
-   return (uint32_t)(uintptr_t) &dmaIBus[pos]->periphData;
-}
+   if (!numOps || (pos != len))
+      SOFT_ERROR(PI_BAD_PARAM, "bad I2C batch (%d bytes)", len);
 
-/* ----------------------------------------------------------------------- */
+   if (reply > (CMD_MAX_EXTENSION-1))
+      SOFT_ERROR(PI_BAD_I2C_RLEN, "I2C batch reply too long (%d)", reply);
 
-static uint32_t dmaGpioOnAdr(int pos)
-{
-   int page, slot;
+   copy = malloc((numOps * sizeof(pi_i2c_op_t)) + bytes);
 
-   page = pos/ON_PER_IPAGE;
-   slot = pos%ON_PER_IPAGE;
+   if (!copy) SOFT_ERROR(PI_NO_MEMORY, "no memory for I2C batch");
 
-   //cast twice to suppress compiler warning, I belive this cast is ok
-   //because dmaIbus contains bus addresses, not user addresses. --plugwash
-   return (uint32_t)(uintptr_t) &dmaIBus[page]->gpioOn[slot];
-}
+   ops = (pi_i2c_op_t *)copy;
+   data = copy + (numOps * sizeof(pi_i2c_op_t));
 
-/* ----------------------------------------------------------------------- */
+   for (i=0, pos=0; i<numOps; i++)
+   {
+      ops[i].handle = (uint8_t)buf[pos] | ((uint8_t)buf[pos+1] << 8);
+      ops[i].flags  = buf[pos+2];
+      ops[i].reg    = buf[pos+3];
+      ops[i].len    = (uint8_t)buf[pos+4] | ((uint8_t)buf[pos+5] << 8);
+      ops[i].buf    = data;
 
-static uint32_t dmaGpioOffAdr(int pos)
-{
-   int page, slot;
+      pos += 6;
 
-   myOffPageSlot(pos, &page, &slot);
+      if (!(ops[i].flags & PI_I2C_OP_READ))
+      {
+         memcpy(data, buf+pos, ops[i].len);
+         pos += ops[i].len;
+      }
 
-   //cast twice to suppress compiler warning, I belive this cast is ok
-   //because dmaIbus contains bus addresses, not user addresses. --plugwash
-   return (uint32_t)(uintptr_t) &dmaIBus[page]->gpioOff[slot];
-}
+      data += ops[i].len;
+   }
 
-/* ----------------------------------------------------------------------- */
+   if (event > PI_MAX_EVENT) id = -1; else id = event;
 
-static uint32_t dmaTickAdr(int pos)
-{
-   int page, slot;
+   id = intI2CBatchStart(numOps, ops, priority, NULL, NULL, id, copy, owner);
 
-   myTckPageSlot(pos, &page, &slot);
+   if (id < 0) free(copy);
 
-   //cast twice to suppress compiler warning, I belive this cast is ok
-   //because dmaIbus contains bus addresses, not user addresses. --plugwash
-   return (uint32_t)(uintptr_t) &dmaIBus[page]->tick[slot];
+   return id;
 }
 
-/* ----------------------------------------------------------------------- */
-
-static uint32_t dmaReadLevelsAdr(int pos)
+int i2cBatchStart(
+   unsigned numOps, pi_i2c_op_t *ops, unsigned priority,
+   i2cBatchFunc_t f, void *userdata)
 {
-   int page, slot;
-
-   myLvsPageSlot(pos, &page, &slot);
-
-   //cast twice to suppress compiler warning, I belive this cast is ok
-   //because dmaIbus contains bus addresses, not user addresses. --plugwash
-   return (uint32_t)(uintptr_t) &dmaIBus[page]->level[slot];
-}
+   DBG(DBG_USER, "numOps=%d ops=%08"PRIXPTR" priority=%d f=%08"PRIXPTR,
+      numOps, (uintptr_t)ops, priority, (uintptr_t)f);
 
-/* ----------------------------------------------------------------------- */
+   CHECK_INITED;
 
-static uint32_t dmaCbAdr(int pos)
-{
-   int page, slot;
+   if (!ops || !numOps)
+      SOFT_ERROR(PI_BAD_POINTER, "no operations");
 
-   page = (pos/CBS_PER_IPAGE);
-   slot = (pos%CBS_PER_IPAGE);
+   if (priority > PI_MAX_I2C_PRIORITY)
+      SOFT_ERROR(PI_BAD_PARAM, "bad priority (%d)", priority);
 
-   //cast twice to suppress compiler warning, I belive this cast is ok
-   //because dmaIbus contains bus addresses, not user addresses. --plugwash
-   return (uint32_t)(uintptr_t) &dmaIBus[page]->cb[slot];
+   return intI2CBatchStart(
+      numOps, ops, priority, f, userdata, -1, NULL, I2C_OWNER_LOCAL);
 }
 
-/* ----------------------------------------------------------------------- */
-
-static void dmaGpioOnCb(int b, int pos)
+int i2cBatchWait(unsigned id, unsigned timeout)
 {
-   rawCbs_t * p;
+   DBG(DBG_USER, "id=%d timeout=%d", id, timeout);
 
-   p = dmaCB2adr(b);
+   CHECK_INITED;
 
-   p->info   = NORMAL_DMA;
-   p->src    = dmaGpioOnAdr(pos);
-   p->dst    = ((GPIO_BASE + (GPSET0*4)) & 0x00ffffff) | PI_PERI_BUS;
-   p->length = 4;
-   p->next   = dmaCbAdr(b+1);
+   if (id >= I2C_REQUESTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad I2C request (%d)", id);
+
+   return intI2CBatchWait(id, timeout, NULL, 0, I2C_OWNER_LOCAL);
 }
 
-/* ----------------------------------------------------------------------- */
+/* ======================================================================= */
 
-static void dmaTickCb(int b, int pos)
+/*SPI */
+
+static uint32_t _spiTXBits(char *buf, int pos, int bitlen, int msbf)
 {
-   rawCbs_t * p;
+   uint32_t bits=0;
 
-   p = dmaCB2adr(b);
+   if (buf)
+   {
+      if      (bitlen <=  8) bits = *((( uint8_t*)buf)+pos);
+      else if (bitlen <= 16) bits = *(((uint16_t*)buf)+pos);
+      else                   bits = *(((uint32_t*)buf)+pos);
 
-   p->info   = NORMAL_DMA;
-   p->src    = ((SYST_BASE + (SYST_CLO*4)) & 0x00ffffff) | PI_PERI_BUS;
-   p->dst    = dmaTickAdr(pos);
-   p->length = 4;
-   p->next   = dmaCbAdr(b+1);
-}
+      if (msbf) bits <<= (32-bitlen);
+   }
 
-/* ----------------------------------------------------------------------- */
+   return bits;
+}
 
-static void dmaGpioOffCb(int b, int pos)
+static void _spiRXBits(
+   char *buf, int pos, int bitlen, int msbf, uint32_t bits)
 {
-   rawCbs_t * p;
-
-   p = dmaCB2adr(b);
+   if (buf)
+   {
+      if (!msbf) bits >>= (32-bitlen);
 
-   p->info   = NORMAL_DMA;
-   p->src    = dmaGpioOffAdr(pos);
-   p->dst    = ((GPIO_BASE + (GPCLR0*4)) & 0x00ffffff) | PI_PERI_BUS;
-   p->length = 4;
-   p->next   = dmaCbAdr(b+1);
+      if      (bitlen <=  8) *((( uint8_t*)buf)+pos) = bits;
+      else if (bitlen <= 16) *(((uint16_t*)buf)+pos) = bits;
+      else                   *(((uint32_t*)buf)+pos) = bits;
+   }
 }
 
-/* ----------------------------------------------------------------------- */
-
-static void dmaReadLevelsCb(int b, int pos)
+static void spiACS(int channel, int on)
 {
-   rawCbs_t * p;
-
-   p = dmaCB2adr(b);
+   int gpio;
 
-   p->info   = NORMAL_DMA;
-   p->src    = ((GPIO_BASE + (GPLEV0*4)) & 0x00ffffff) | PI_PERI_BUS;
-   p->dst    = dmaReadLevelsAdr(pos);
-   p->length = 4;
-   p->next   = dmaCbAdr(b+1);
+   switch (channel)
+   {
+       case  0: gpio = PI_ASPI_CE0; break;
+       case  1: gpio = PI_ASPI_CE1; break;
+       default: gpio = PI_ASPI_CE2; break;
+   }
+   myGpioWrite(gpio, on);
 }
 
-/* ----------------------------------------------------------------------- */
-
-static void dmaDelayCb(int b)
+static void spiGoA(
+   unsigned speed,    /* bits per second */
+   uint32_t flags,    /* flags           */
+   char     *txBuf,   /* tx buffer       */
+   char     *rxBuf,   /* rx buffer       */
+   unsigned count)    /* number of bytes */
 {
-   rawCbs_t * p;
-
-   p = dmaCB2adr(b);
+   int cs;
+   char bit_ir[4] = {1, 0, 0, 1}; /* read on rising edge */
+   char bit_or[4] = {0, 1, 1, 0}; /* write on rising edge */
+   char bit_ic[4] = {0, 0, 1, 1}; /* invert clock */
 
-   if (gpioCfg.clockPeriph == PI_CLOCK_PCM)
-   {
-      p->info = NORMAL_DMA | TIMED_DMA(2);
-      p->dst  = PCM_TIMER;
-   }
-   else
-   {
-      p->info = NORMAL_DMA | TIMED_DMA(5);
-      p->dst  = PWM_TIMER;
-   }
+   int mode, bitlen, txmsbf, rxmsbf, channel;
+   unsigned txCnt=0;
+   unsigned rxCnt=0;
+   uint32_t spiDefaults;
+   uint32_t statusReg;
+   int txFull, rxEmpty;
 
-   p->src    = dmaPwmDataAdr(b%DMAI_PAGES);
-   p->length = 4;
-   p->next   = dmaCbAdr(b+1);
-}
+   channel = PI_SPI_FLAGS_GET_CHANNEL(flags);
+   mode   =  PI_SPI_FLAGS_GET_MODE   (flags);
 
-/* ----------------------------------------------------------------------- */
+   bitlen =  PI_SPI_FLAGS_GET_BITLEN (flags);
 
-static void dmaInitCbs(void)
-{
-   int b, pulse, level, cycle;
+   if (!bitlen) bitlen = 8;
 
-   rawCbs_t * p;
+   /* correct count for word size */
 
-   /* set up the DMA control blocks */
+   if (bitlen >  8) count /= 2;
+   if (bitlen > 16) count /= 2;
 
-   DBG(DBG_STARTUP, "");
+   txmsbf = !PI_SPI_FLAGS_GET_TX_LSB (flags);
+   rxmsbf = !PI_SPI_FLAGS_GET_RX_LSB (flags);
 
-   gpioStats.dmaInitCbsCount++;
+   cs = PI_SPI_FLAGS_GET_CSPOLS(flags) & (1<<channel);
 
-   b = -1;
-   level = 0;
+   spiDefaults = AUXSPI_CNTL0_SPEED((125000000/speed)-1)|
+                 AUXSPI_CNTL0_IN_RISING(bit_ir[mode])  |
+                 AUXSPI_CNTL0_OUT_RISING(bit_or[mode]) |
+                 AUXSPI_CNTL0_INVERT_CLK(bit_ic[mode]) |
+                 AUXSPI_CNTL0_MSB_FIRST(txmsbf)        |
+                 AUXSPI_CNTL0_SHIFT_LEN(bitlen);
 
-   for (cycle=0; cycle<bufferCycles; cycle++)
+   if (!count)
    {
-      b++; dmaGpioOnCb(b, cycle%SUPERCYCLE); /* gpio on slot */
-
-      b++; dmaTickCb(b, cycle);              /* tick slot */
+      auxReg[AUX_SPI0_CNTL0_REG] =
+         AUXSPI_CNTL0_ENABLE | AUXSPI_CNTL0_CLR_FIFOS;
 
-      for (pulse=0; pulse<PULSE_PER_CYCLE; pulse++)
-      {
-         b++; dmaReadLevelsCb(b, level);               /* read levels slot */
+      myGpioDelay(10);
 
-         b++; dmaDelayCb(b);                           /* delay slot */
+      auxReg[AUX_SPI0_CNTL0_REG] = AUXSPI_CNTL0_ENABLE  | spiDefaults;
 
-         b++; dmaGpioOffCb(b, (level%SUPERLEVEL)+1);   /* gpio off slot */
+      auxReg[AUX_SPI0_CNTL1_REG] = AUXSPI_CNTL1_MSB_FIRST(rxmsbf);
 
-         ++level;
-      }
+      return;
    }
 
-   /* point last cb back to first for continuous loop */
-
-   p = dmaCB2adr(b);
+   auxReg[AUX_SPI0_CNTL0_REG] = AUXSPI_CNTL0_ENABLE  | spiDefaults;
 
-   p->next = dmaCbAdr(0);
+   auxReg[AUX_SPI0_CNTL1_REG] = AUXSPI_CNTL1_MSB_FIRST(rxmsbf);
 
-   DBG(DBG_STARTUP, "DMA page type count = %zd", sizeof(dmaIPage_t));
+   spiACS(channel, cs);
 
-   DBG(DBG_STARTUP, "%d control blocks (exp=%d)", b+1, NUM_CBS);
-}
+   while ((txCnt < count) || (rxCnt < count))
+   {
+      statusReg = auxReg[AUX_SPI0_STAT_REG];
 
-/* ======================================================================= */
+      rxEmpty = statusReg & AUXSPI_STAT_RX_EMPTY;
 
+      txFull = (((statusReg>>28)&15) > 2);
 
-static void sigHandler(int signum)
-{
-   if ((signum >= PI_MIN_SIGNUM) && (signum <= PI_MAX_SIGNUM))
-   {
-      if (gpioSignal[signum].func)
+      if (rxCnt < count)
       {
-         if (gpioSignal[signum].ex)
+         if (!rxEmpty)
          {
-            (gpioSignal[signum].func)(signum, gpioSignal[signum].userdata);
-         }
-         else
-         {
-            (gpioSignal[signum].func)(signum);
+            _spiRXBits(
+               rxBuf, rxCnt++, bitlen, rxmsbf, auxReg[AUX_SPI0_IO_REG]);
          }
       }
-      else
+
+      if (txCnt < count)
       {
-         switch(signum)
+         if (!txFull)
          {
-            case SIGUSR1:
+            if (txCnt != (count-1))
+            {
+               auxReg[AUX_SPI0_TX_HOLD] =
+                  _spiTXBits(txBuf, txCnt++, bitlen, txmsbf);
+            }
+            else
+            {
+               auxReg[AUX_SPI0_IO_REG] =
+                  _spiTXBits(txBuf, txCnt++, bitlen, txmsbf);
+            }
+         }
+      }
+   }
 
-               if (gpioCfg.dbgLevel > DBG_MIN_LEVEL) --gpioCfg.dbgLevel;
-               else gpioCfg.dbgLevel = DBG_MIN_LEVEL;
-               DBG(DBG_USER, "Debug level %d\n", gpioCfg.dbgLevel);
-               break;
+   while ((auxReg[AUX_SPI0_STAT_REG] & AUXSPI_STAT_BUSY)) ;
 
-            case SIGUSR2:
-               if (gpioCfg.dbgLevel < DBG_MAX_LEVEL) ++gpioCfg.dbgLevel;
-               else gpioCfg.dbgLevel = DBG_MAX_LEVEL;
-               DBG(DBG_USER, "Debug level %d\n", gpioCfg.dbgLevel);
-               break;
+   spiACS(channel, !cs);
+}
 
-            case SIGPIPE:
-            case SIGWINCH:
-               DBG(DBG_USER, "signal %d ignored", signum);
-               break;
+static uint8_t *spiSimMem(uint32_t bus, uint32_t len)
+{
+   uint32_t offset;
 
-            case SIGCHLD:
-               /* Used to notify threads of events */
-               break;
+   offset = bus - SPI_SIM_BUS;
 
-            default:
-               DBG(DBG_ALWAYS, "Unhandled signal %d, terminating\n", signum);
-               gpioTerminate();
-               exit(-1);
-         }
-      }
-   }
-   else
-   {
-      /* exit */
+   if ((bus < SPI_SIM_BUS) || (offset > SPI_DMA_MEM) ||
+       (len > (SPI_DMA_MEM - offset))) return NULL;
 
-      DBG(DBG_ALWAYS, "Unhandled signal %d, terminating\n", signum);
-      gpioTerminate();
-      exit(-1);
-   }
+   return (uint8_t *)spiDMAMem.virtual_addr + offset;
 }
 
-/* ----------------------------------------------------------------------- */
-
-static void sigSetHandler(void)
+static int spiSimDMA(uint32_t txCb, uint32_t rxCb)
 {
-   int i;
-   struct sigaction new;
+   /* a looped back SPI device fed by the DMA engine, everything the
+      real hardware relies on is checked before any data moves
+   */
 
-   for (i=PI_MIN_SIGNUM; i<=PI_MAX_SIGNUM; i++)
-   {
+   rawCbs_t *tx, *rx;
+   uint8_t *src, *dst;
+   uint32_t len, cs, last, i;
 
-      memset(&new, 0, sizeof(new));
-      new.sa_handler = sigHandler;
+   len = spiReg[SPI_DLEN];
+   cs  = spiReg[SPI_CS];
 
-      sigaction(i, &new, NULL);
-   }
-}
+   if (!(cs & SPI_CS_TA) || !(cs & SPI_CS_DMAEN) || !len) return -1;
 
-/*
-   freq mics  net
- 0 1000 1000  900
- 1 4000  250  225
- 2 3750  266  240
- 3 3500  285  257
- 4 3250  307  276
- 5 3000  333  300
- 6 2750  363  327
- 7 2500  400  360
- 8 2250  444  400
- 9 2000  500  450
-10 1750  571  514
-11 1500  666  600
-12 1250  800  720
-13 1000 1000  900
-14 750  1333 1200
-15 500  2000 1800
-*/
+   tx = (rawCbs_t *)spiSimMem(txCb, sizeof(rawCbs_t));
 
-unsigned alert_delays[]=
-{
-   900000, 225000, 240000, 257142, 276923, 300000,  327272,  360000,
-   400000, 450000, 514285, 600000, 720000, 900000, 1200000, 1800000
-};
+   if ((tx == NULL) || (txCb & 31) || tx->next) return -1;
 
-/* ======================================================================= */
+   if ((tx->info & (DMA_DEST_DREQ | DMA_SRC_INC | DMA_DEST_INC)) !=
+          (DMA_DEST_DREQ | DMA_SRC_INC)) return -1;
 
-static void alertGlitchFilter(gpioSample_t *sample, int numSamples)
-{
-   int i, j, diff;
-   uint32_t steadyUs, changedTick, RBitV, LBitV, initialised;
-   uint32_t bit, bitV;
+   if ((tx->info & DMA_PERIPHERAL_MAPPING(31)) !=
+          DMA_PERIPHERAL_MAPPING(SPI_DREQ_TX)) return -1;
 
-   for (i=0; i<=PI_MAX_USER_GPIO; i++)
+   if ((tx->dst != SPI_BUS_FIFO) || (tx->length != ((len + 3) & ~3)))
+      return -1;
+
+   if ((src = spiSimMem(tx->src, tx->length)) == NULL) return -1;
+
+   if (rxCb)
    {
-      bit = (1<<i);
+      rx = (rawCbs_t *)spiSimMem(rxCb, sizeof(rawCbs_t));
 
-      if (monitorBits & bit & gFilterBits)
-      {
-         initialised = gpioAlert[i].gfInitialised;
-         if (!initialised && numSamples > 0)
-         {
-           /* Initialise filter with first sample */
-           bitV = sample[0].level & bit;
-           gpioAlert[i].gfRBitV = bitV;
-           gpioAlert[i].gfLBitV = bitV;
-           gpioAlert[i].gfTick = sample[0].tick;
-           gpioAlert[i].gfInitialised = 1;
-         }
+      if ((rx == NULL) || (rxCb & 31) || rx->next) return -1;
 
-         steadyUs    = gpioAlert[i].gfSteadyUs;
-         RBitV       = gpioAlert[i].gfRBitV;
-         LBitV       = gpioAlert[i].gfLBitV;
-         changedTick = gpioAlert[i].gfTick;
+      if ((rx->info & (DMA_SRC_DREQ | DMA_SRC_INC | DMA_DEST_INC)) !=
+             (DMA_SRC_DREQ | DMA_DEST_INC)) return -1;
 
-         for (j=0; j<numSamples; j++)
-         {
-            bitV = sample[j].level & bit;
+      if ((rx->info & DMA_PERIPHERAL_MAPPING(31)) !=
+             DMA_PERIPHERAL_MAPPING(SPI_DREQ_RX)) return -1;
 
-            if (bitV != LBitV)
-            {
-               /* Difference between level and last level.
-                  Restart steady timer. */
+      /* the rx FIFO only ever holds the bytes clocked in */
 
-               changedTick = sample[j].tick;
-               LBitV = bitV;
-            }
+      if ((rx->src != SPI_BUS_FIFO) || (rx->length & 3) ||
+          (rx->length > len)) return -1;
 
-            if (bitV != RBitV)
-            {
-               /* Difference between level and reported level. */
+      if ((dst = spiSimMem(rx->dst, rx->length)) == NULL) return -1;
 
-               diff = sample[j].tick - changedTick;
+      memmove(dst, src, rx->length);
 
-               if (diff >= steadyUs)
-               {
-                  /* Level stable for steady period. */
-                  RBitV = bitV;
-               }
-               else
-               {
-                  /* Keep reporting old level. */
+      src += rx->length;
+      len -= rx->length;
+   }
 
-                  sample[j].level ^= bit;
-               }
-            }
+   /* the CPU reads what the rx DMA left in the FIFO */
 
-         }
+   if (len > 3) return -1;
 
-         gpioAlert[i].gfRBitV = RBitV;
-         gpioAlert[i].gfLBitV = LBitV;
-         gpioAlert[i].gfTick  = changedTick;
+   last = 0;
+
+   for (i=0; i<len; i++) last |= (src[i] << (8*i));
+
+   spiReg[SPI_FIFO] = last;
+   spiReg[SPI_CS]   = cs | SPI_CS_DONE;
+
+   spiSimDMABytes += spiReg[SPI_DLEN];
+
+   return 0;
+}
+
+static void spiDMAgo(uint32_t txCb, uint32_t rxCb)
+{
+   if (spiSimOpen)
+   {
+      if (spiSimDMA(txCb, rxCb) < 0)
+      {
+         spiSimFaults++;
+
+         DBG(DBG_ALWAYS, "bad SPI DMA (%08X %08X)", txCb, rxCb);
+
+         spiReg[SPI_CS] |= SPI_CS_DONE;
       }
    }
+   else
+   {
+      /* rx first so that no received word is missed */
+
+      if (rxCb) initDMAgo(dmaSpiRx, rxCb);
+
+      initDMAgo(dmaSpiTx, txCb);
+   }
 }
 
-static void alertNoiseFilter(gpioSample_t *sample, int numSamples)
+static void spiDMAwait(unsigned micros)
 {
-   int i, j, diff;
-   uint32_t LBitV;
-   uint32_t bit, bitV;
-   uint32_t nowTick;
+   if (spiSimOpen) return;
 
-   for (i=0; i<=PI_MAX_USER_GPIO; i++)
+   /* sleep through most of the transfer, spin for the rest */
+
+   if (micros > SPI_DMA_SPIN)
    {
-      bit = (1<<i);
+      micros -= SPI_DMA_SPIN;
+      myGpioSleep(micros / 1000000, micros % 1000000);
+   }
 
-      if (monitorBits & bit & nFilterBits)
-      {
-         LBitV = gpioAlert[i].nfLBitV;
+   while ((dmaSpiTx[DMA_CS] | dmaSpiRx[DMA_CS]) & DMA_ACTIVE) ;
+}
 
-         for (j=0; j<numSamples; j++)
-         {
-            bitV = sample[j].level & bit;
-            nowTick = sample[j].tick;
+static void spiGoDMA(
+   unsigned speed,
+   uint32_t spiDefaults,
+   char     *txBuf,
+   char     *rxBuf,
+   unsigned count)
+{
+   rawCbs_t *cb;
+   uint8_t *tx, *rx;
+   uint32_t bus, last;
+   unsigned done, len, words, i;
 
-            if (gpioAlert[i].nfActive) /* reporting events */
-            {
-               diff = nowTick - gpioAlert[i].nfTick2;
+   cb  = (rawCbs_t *)spiDMAMem.virtual_addr;
+   tx  = (uint8_t *)cb + SPI_DMA_TX;
+   rx  = (uint8_t *)cb + SPI_DMA_RX;
+   bus = spiDMAMem.bus_addr;
 
-               if (diff >= 0)
-               {
-                  /* Stop reporting gpio changes */
+   spiReg[SPI_CLK] = 250000000/speed;
 
-                  gpioAlert[i].nfActive = 0;
-                  gpioAlert[i].nfTick1 = nowTick;
-               }
-            }
-            else /* waiting for steady us */
-            {
-               if (bitV != LBitV)
-               {
-                  diff = nowTick - gpioAlert[i].nfTick1;
-                  gpioAlert[i].nfTick1 = nowTick;
+   spiReg[SPI_DC] = SPI_DC_RPANIC(48) | SPI_DC_RDREQ(32) |
+                    SPI_DC_TPANIC(16) | SPI_DC_TDREQ(32);
 
-                  if (diff >= gpioAlert[i].nfSteadyUs)
-                  {
-                     /* Start reporting gpio changes */
+   for (done=0; done<count; done+=len)
+   {
+      len = count - done;
 
-                     gpioAlert[i].nfRBitV = LBitV;
-                     gpioAlert[i].nfActive = 1;
-                     gpioAlert[i].nfTick2 =
-                        nowTick + gpioAlert[i].nfActiveUs;
-                  }
-               }
-            }
+      if (len > SPI_DMA_CHUNK) len = SPI_DMA_CHUNK;
 
-            if (!gpioAlert[i].nfActive)
-            {
-               if (bitV != gpioAlert[i].nfRBitV)
-                  sample[j].level ^= bit;
-            }
+      words = len / 4;
 
-            LBitV = bitV;
-         }
+      if (txBuf) memcpy(tx, txBuf+done, len);
+      else       memset(tx, 0, len);
 
-         gpioAlert[i].nfLBitV = LBitV;
+      memset(tx+len, 0, 3); /* the tx DMA sends whole words */
+
+      cb[0].info   = NORMAL_DMA | DMA_SRC_INC | DMA_DEST_DREQ |
+                     DMA_PERIPHERAL_MAPPING(SPI_DREQ_TX);
+      cb[0].src    = bus + SPI_DMA_TX;
+      cb[0].dst    = SPI_BUS_FIFO;
+      cb[0].length = (len + 3) & ~3;
+      cb[0].stride = 0;
+      cb[0].next   = 0;
+
+      cb[1].info   = NORMAL_DMA | DMA_DEST_INC | DMA_SRC_DREQ |
+                     DMA_PERIPHERAL_MAPPING(SPI_DREQ_RX);
+      cb[1].src    = SPI_BUS_FIFO;
+      cb[1].dst    = bus + SPI_DMA_RX;
+      cb[1].length = words * 4;
+      cb[1].stride = 0;
+      cb[1].next   = 0;
+
+      spiReg[SPI_DLEN] = len;
+
+      spiReg[SPI_CS] = spiDefaults | SPI_CS_DMAEN | SPI_CS_ADCS | SPI_CS_TA;
+
+      spiDMAgo(bus, words ? bus + sizeof(rawCbs_t) : 0);
+
+      spiDMAwait(((uint64_t)len * 8000000) / speed);
+
+      while (!(spiReg[SPI_CS] & SPI_CS_DONE)) ;
+
+      /* up to 3 bytes are left for the CPU */
+
+      if (len & 3)
+      {
+         last = spiReg[SPI_FIFO];
 
+         for (i=words*4; i<len; i++)
+         {
+            rx[i] = last;
+            last >>= 8;
+         }
       }
+
+      spiReg[SPI_CS] = spiDefaults; /* stop */
+
+      if (rxBuf) memcpy(rxBuf+done, rx, len);
    }
+
+   spiReg[SPI_DLEN] = 2;
 }
 
-static void alertEmit(
-   gpioSample_t *sample, int numSamples, uint32_t changedBits, uint32_t eTick)
+static void spiSimXfer(char *txBuf, char *rxBuf, unsigned count)
 {
-   uint32_t oldLevel, newLevel;
-   int32_t diff;
-   int emit, seqno, emitted;
-   uint32_t changes, bits, timeoutBits, eventBits;
-   int d;
-   int b, n, v;
-   int err;
-   int max_emits;
-   char fifo[32];
-   /* ensure space for maximum number of watchdog and event notifications */
-   gpioReport_t report[MAX_REPORT+PI_MAX_USER_GPIO+1+PI_MAX_EVENT+1];
+   /* the simulator has no FIFO model, the polled bytes loop back */
 
-   if (changedBits)
+   if (rxBuf)
    {
-      if (gpioGetSamples.func)
-      {
-         if (gpioGetSamples.ex)
-         {
-            (gpioGetSamples.func)
-               (sample, numSamples, gpioGetSamples.userdata);
-         }
-         else
-         {
-            (gpioGetSamples.func)(sample, numSamples);
-         }
-      }
+      if (txBuf) memmove(rxBuf, txBuf, count);
+      else       memset(rxBuf, 0, count);
    }
 
-   eventBits = 0;
+   spiSimCPUBytes += count;
+}
 
-   if (bscFR != (bscsReg[BSC_FR]&0xffff))
-   {
-      bscFR = bscsReg[BSC_FR]&0xffff;
-      eventAlert[PI_EVENT_BSC].fired = 1;
-   }
+static void spiGoS(
+   unsigned speed,
+   uint32_t flags,
+   char     *txBuf,
+   char     *rxBuf,
+   unsigned count)
+{
+   unsigned txCnt=0;
+   unsigned rxCnt=0;
+   unsigned cnt, cnt4w, cnt3w;
+   uint32_t spiDefaults;
+   unsigned mode, channel, cspol, cspols, flag3w, ren3w;
 
-   for (b=0; b<=PI_MAX_EVENT; b++)
-   {
-      if (eventAlert[b].fired && (!eventAlert[b].ignore))
-      {
-         eventBits |= (1<<b);
+   channel = PI_SPI_FLAGS_GET_CHANNEL(flags);
+   mode   =  PI_SPI_FLAGS_GET_MODE   (flags);
+   cspols =  PI_SPI_FLAGS_GET_CSPOLS(flags);
+   cspol  =  (cspols>>channel) & 1;
+   flag3w =  PI_SPI_FLAGS_GET_3WIRE(flags);
+   ren3w =   PI_SPI_FLAGS_GET_3WREN(flags);
 
-         if (eventAlert[b].func)
-         {
-            if (eventAlert[b].ex)
-            {
-               (eventAlert[b].func)(b, eTick, eventAlert[b].userdata);
-            }
-            else
-            {
-               (eventAlert[b].func)(b, eTick);
-            }
-         }
-      }
+   spiDefaults = SPI_CS_MODE(mode)     |
+                 SPI_CS_CSPOLS(cspols) |
+                 SPI_CS_CS(channel)    |
+                 SPI_CS_CSPOL(cspol)   |
+                 SPI_CS_CLEAR(3);
 
-      eventAlert[b].fired = 0;
-   }
+   spiReg[SPI_DLEN] = 2; /* undocumented, stops inter-byte gap */
 
-   /* call alert callbacks for each bit transition */
+   spiReg[SPI_CS] = spiDefaults; /* stop */
 
-   if (changedBits & alertBits)
-   {
-      oldLevel = (reportedLevel & alertBits);
+   if (!count) return;
 
-      for (d=0; d<numSamples; d++)
-      {
-         newLevel = (sample[d].level & alertBits);
+   /* large 4-wire transfers use DMA if configured */
 
-         if (newLevel != oldLevel)
-         {
-            changes = (newLevel ^ oldLevel);
+   if (gpioCfg.spiDMABytes && (count >= gpioCfg.spiDMABytes) &&
+       !flag3w && (spiDMAMem.virtual_addr != NULL))
+   {
+      spiGoDMA(speed, spiDefaults, txBuf, rxBuf, count);
+      return;
+   }
 
-            for (b=0; b<=PI_MAX_USER_GPIO; b++)
-            {
-               if (changes & (1<<b))
-               {
-                  if (newLevel & (1<<b)) v = 1; else v = 0;
+   if (spiSimOpen)
+   {
+      spiSimXfer(txBuf, rxBuf, count);
+      return;
+   }
 
-                  if (gpioAlert[b].func)
-                  {
-                     if (gpioAlert[b].ex)
-                     {
-                        (gpioAlert[b].func)
-                           (b, v, sample[d].tick,
-                            gpioAlert[b].userdata);
-                     }
-                     else
-                     {
-                        (gpioAlert[b].func)(b, v, sample[d].tick);
-                     }
-                  }
-               }
-            }
-            oldLevel = newLevel;
-         }
+   if (flag3w)
+   {
+      if (ren3w < count)
+      {
+         cnt4w = ren3w;
+         cnt3w = count - ren3w;
+      }
+      else
+      {
+         cnt4w = count;
+         cnt3w = 0;
       }
    }
+   else
+   {
+      cnt4w = count;
+      cnt3w = 0;
+   }
 
-   /* check for watchdog timeouts */
+   spiReg[SPI_CLK] = 250000000/speed;
 
-   timeoutBits = 0;
+   spiReg[SPI_CS] = spiDefaults | SPI_CS_TA; /* start */
 
-   if (wdogBits)
+   cnt = cnt4w;
+
+   while((txCnt < cnt) || (rxCnt < cnt))
    {
-      for (b=0; b<=PI_MAX_USER_GPIO; b++)
+      while((rxCnt < cnt) && ((spiReg[SPI_CS] & SPI_CS_RXD)))
       {
-         if (gpioAlert[b].wdSteadyUs)
-         {
-            diff = eTick - gpioAlert[b].wdTick;
-
-            if (diff >= gpioAlert[b].wdSteadyUs)
-            {
-               timeoutBits |= (1<<b);
-
-               gpioAlert[b].wdTick = eTick;
+         if (rxBuf) rxBuf[rxCnt] = spiReg[SPI_FIFO];
+         else       spi_dummy    = spiReg[SPI_FIFO];
+         rxCnt++;
+      }
 
-               if (gpioAlert[b].func)
-               {
-                  if (gpioAlert[b].ex)
-                  {
-                     (gpioAlert[b].func)(b, PI_TIMEOUT, eTick,
-                                            gpioAlert[b].userdata);
-                  }
-                  else
-                  {
-                     (gpioAlert[b].func)(b, PI_TIMEOUT, eTick);
-                  }
-               }
-            }
-         }
+      while((txCnt < cnt) && ((spiReg[SPI_CS] & SPI_CS_TXD)))
+      {
+         if (txBuf) spiReg[SPI_FIFO] = txBuf[txCnt];
+         else       spiReg[SPI_FIFO] = 0;
+         txCnt++;
       }
    }
 
-   for (n=0; n<PI_NOTIFY_SLOTS; n++)
-   {
-      if (gpioNotify[n].state == PI_NOTIFY_CLOSING)
-      {
-         if (gpioNotify[n].pipe)
-         {
-            DBG(DBG_INTERNAL, "close notify pipe %d", gpioNotify[n].fd);
-            close(gpioNotify[n].fd);
+   while (!(spiReg[SPI_CS] & SPI_CS_DONE)) ;
 
-            sprintf(fifo, "/dev/pigpio%d", n);
+   /* now switch to 3-wire bus */
 
-            unlink(fifo);
-         }
+   cnt += cnt3w;
 
-         gpioNotify[n].state = PI_NOTIFY_CLOSED;
+   spiReg[SPI_CS] |= SPI_CS_REN;
+
+   while((txCnt < cnt) || (rxCnt < cnt))
+   {
+      while((rxCnt < cnt) && ((spiReg[SPI_CS] & SPI_CS_RXD)))
+      {
+         if (rxBuf) rxBuf[rxCnt] = spiReg[SPI_FIFO];
+         else       spi_dummy    = spiReg[SPI_FIFO];
+         rxCnt++;
       }
-      else if (gpioNotify[n].state >= PI_NOTIFY_OPENED)
+
+      while((txCnt < cnt) && ((spiReg[SPI_CS] & SPI_CS_TXD)))
       {
-         bits = gpioNotify[n].bits;
+         if (txBuf) spiReg[SPI_FIFO] = txBuf[txCnt];
+         else       spiReg[SPI_FIFO] = 0;
+         txCnt++;
+      }
+   }
 
-         emit = 0;
+   while (!(spiReg[SPI_CS] & SPI_CS_DONE)) ;
 
-         seqno = gpioNotify[n].seqno;
+   spiReg[SPI_CS] = spiDefaults; /* stop */
+}
 
-         if (gpioNotify[n].state == PI_NOTIFY_RUNNING)
-         {
-            /* check to see if any bits have changed for this
-               notification.
+static void spiGo(
+   unsigned speed,
+   uint32_t flags,
+   char     *txBuf,
+   char     *rxBuf,
+   unsigned count)
+{
+   static pthread_mutex_t main_mutex = PTHREAD_MUTEX_INITIALIZER;
+   static pthread_mutex_t aux_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-               bits         is the set of notification bits
-               changedBits is the set of changed bits
-            */
+   if (PI_SPI_FLAGS_GET_AUX_SPI(flags))
+   {
+      pthread_mutex_lock(&aux_mutex);
+      spiGoA(speed, flags, txBuf, rxBuf, count);
+      pthread_mutex_unlock(&aux_mutex);
+   }
+   else
+   {
+      pthread_mutex_lock(&main_mutex);
+      spiGoS(speed, flags, txBuf, rxBuf, count);
+      pthread_mutex_unlock(&main_mutex);
+   }
+}
 
-            if (changedBits & bits)
-            {
-               oldLevel = reportedLevel & bits;
+static int spiAnyOpen(uint32_t flags)
+{
+   int i, aux;
 
-               for (d=0; d<numSamples; d++)
-               {
-                  newLevel = sample[d].level & bits;
+   aux = PI_SPI_FLAGS_GET_AUX_SPI(flags);
 
-                  if (newLevel != oldLevel)
-                  {
-                     report[emit].seqno = seqno;
-                     report[emit].flags = 0;
-                     report[emit].tick  = sample[d].tick;
-                     report[emit].level = sample[d].level;
+   for (i=0; i<PI_SPI_SLOTS; i++)
+   {
+      if ((spiInfo[i].state == PI_SPI_OPENED) &&
+         !PI_SPI_FLAGS_GET_SPIDEV(spiInfo[i].flags) &&
+         (PI_SPI_FLAGS_GET_AUX_SPI(spiInfo[i].flags) == aux))
+            return 1;
+   }
+   return 0;
+}
 
-                     oldLevel = newLevel;
+static void spiInit(uint32_t flags)
+{
+   uint32_t resvd, cspols;
 
-                     emit++;
+   resvd  = PI_SPI_FLAGS_GET_RESVD(flags);
+   cspols = PI_SPI_FLAGS_GET_CSPOLS(flags);
+
+   if (PI_SPI_FLAGS_GET_AUX_SPI(flags))
+   {
+      /* enable module and access to registers */
+
+      auxReg[AUX_ENABLES] |= AUXENB_SPI1;
+
+      /* save original state */
+
+      old_mode_ace0  = gpioGetMode(PI_ASPI_CE0);
+      old_mode_ace1  = gpioGetMode(PI_ASPI_CE1);
+      old_mode_ace2  = gpioGetMode(PI_ASPI_CE2);
+      old_mode_asclk = gpioGetMode(PI_ASPI_SCLK);
+      old_mode_amiso = gpioGetMode(PI_ASPI_MISO);
+      old_mode_amosi = gpioGetMode(PI_ASPI_MOSI);
+
+      old_spi_cntl0 = auxReg[AUX_SPI0_CNTL0_REG];
+      old_spi_cntl1 = auxReg[AUX_SPI0_CNTL1_REG];
+
+      /* manually control auxiliary SPI chip selects */
+
+      if (!(resvd&1))
+      {
+         myGpioSetMode(PI_ASPI_CE0,  PI_OUTPUT);
+         myGpioWrite(PI_ASPI_CE0, !(cspols&1));
+      }
+
+      if (!(resvd&2))
+      {
+         myGpioSetMode(PI_ASPI_CE1,  PI_OUTPUT);
+         myGpioWrite(PI_ASPI_CE1, !(cspols&2));
+      }
+
+      if (!(resvd&4))
+      {
+         myGpioSetMode(PI_ASPI_CE2,  PI_OUTPUT);
+         myGpioWrite(PI_ASPI_CE2, !(cspols&4));
+      }
+
+      /* set gpios to SPI mode */
+
+      myGpioSetMode(PI_ASPI_SCLK, PI_ALT4);
+      myGpioSetMode(PI_ASPI_MISO, PI_ALT4);
+      myGpioSetMode(PI_ASPI_MOSI, PI_ALT4);
+   }
+   else
+   {
+      /* save original state */
+
+      old_mode_ce0  = myGpioGetMode(PI_SPI_CE0);
+      old_mode_ce1  = myGpioGetMode(PI_SPI_CE1);
+      old_mode_sclk = myGpioGetMode(PI_SPI_SCLK);
+      old_mode_miso = myGpioGetMode(PI_SPI_MISO);
+      old_mode_mosi = myGpioGetMode(PI_SPI_MOSI);
+
+      old_spi_cs  = spiReg[SPI_CS];
+      old_spi_clk = spiReg[SPI_CLK];
+
+      /* set gpios to SPI mode */
+
+      if (!(resvd&1)) myGpioSetMode(PI_SPI_CE0,  PI_ALT0);
+      if (!(resvd&2)) myGpioSetMode(PI_SPI_CE1,  PI_ALT0);
+
+      myGpioSetMode(PI_SPI_SCLK, PI_ALT0);
+      myGpioSetMode(PI_SPI_MISO, PI_ALT0);
+      myGpioSetMode(PI_SPI_MOSI, PI_ALT0);
+   }
+}
+
+static void spiTerm(uint32_t flags)
+{
+   int resvd;
+
+   resvd = PI_SPI_FLAGS_GET_RESVD(flags);
+
+   if (PI_SPI_FLAGS_GET_AUX_SPI(flags))
+   {
+      /* disable module and access to registers */
+
+      auxReg[AUX_ENABLES] &= (~AUXENB_SPI1);
+
+      /* restore original state */
+
+      if (!(resvd&1)) myGpioSetMode(PI_ASPI_CE0,  old_mode_ace0);
+      if (!(resvd&2)) myGpioSetMode(PI_ASPI_CE1,  old_mode_ace1);
+      if (!(resvd&4)) myGpioSetMode(PI_ASPI_CE2,  old_mode_ace2);
+
+      myGpioSetMode(PI_ASPI_SCLK, old_mode_asclk);
+      myGpioSetMode(PI_ASPI_MISO, old_mode_amiso);
+      myGpioSetMode(PI_ASPI_MOSI, old_mode_amosi);
+
+      auxReg[AUX_SPI0_CNTL0_REG] = old_spi_cntl0;
+      auxReg[AUX_SPI0_CNTL1_REG] = old_spi_cntl1;
+   }
+   else
+   {
+      /* restore original state */
+
+      if (!(resvd&1)) myGpioSetMode(PI_SPI_CE0,  old_mode_ce0);
+      if (!(resvd&2)) myGpioSetMode(PI_SPI_CE1,  old_mode_ce1);
+
+      myGpioSetMode(PI_SPI_SCLK, old_mode_sclk);
+      myGpioSetMode(PI_SPI_MISO, old_mode_miso);
+      myGpioSetMode(PI_SPI_MOSI, old_mode_mosi);
+
+      spiReg[SPI_CS]  = old_spi_cs;
+      spiReg[SPI_CLK] = old_spi_clk;
+   }
+}
+
+static int spiDevOpen(unsigned spiChan, unsigned baud, uint32_t flags)
+{
+   char dev[32];
+   int fd;
+   uint8_t mode, bits;
+   uint32_t speed;
+
+   snprintf(dev, sizeof(dev), "/dev/spidev%d.%d",
+      PI_SPI_FLAGS_GET_AUX_SPI(flags), spiChan);
+
+   if ((fd = open(dev, O_RDWR)) < 0)
+      SOFT_ERROR(PI_SPI_OPEN_FAILED, "can't open %s (%m)", dev);
+
+   /* the mode bits are the same as the kernel's SPI_CPHA/SPI_CPOL */
+
+   mode = PI_SPI_FLAGS_GET_MODE(flags);
+
+   if (PI_SPI_FLAGS_GET_CSPOLS(flags) & (1<<spiChan)) mode |= SPI_CS_HIGH;
+   if (PI_SPI_FLAGS_GET_3WIRE(flags))                 mode |= SPI_3WIRE;
+   if (PI_SPI_FLAGS_GET_TX_LSB(flags))                mode |= SPI_LSB_FIRST;
+
+   bits = PI_SPI_FLAGS_GET_BITLEN(flags);
+
+   if (!bits) bits = 8;
+
+   speed = baud;
+
+   if ((ioctl(fd, SPI_IOC_WR_MODE, &mode) < 0) ||
+       (ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0) ||
+       (ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0))
+   {
+      close(fd);
+      SOFT_ERROR(PI_SPI_OPEN_FAILED, "can't configure %s (%m)", dev);
+   }
+
+   return fd;
+}
+
+static int spiDevMessage(unsigned handle, pi_spi_seg_t *segs, unsigned numSegs)
+{
+   struct spi_ioc_transfer tr[PI_SPI_MAX_SEGS];
+   unsigned i;
+   int status;
+
+   memset(tr, 0, numSegs * sizeof(tr[0]));
+
+   for (i=0; i<numSegs; i++)
+   {
+      tr[i].tx_buf      = (uintptr_t)segs[i].txBuf;
+      tr[i].rx_buf      = (uintptr_t)segs[i].rxBuf;
+      tr[i].len         = segs[i].len;
+      tr[i].speed_hz    = spiInfo[handle].speed;
+      tr[i].delay_usecs = segs[i].usDelay;
+
+      /* on the last transfer cs_change would keep the device selected */
+
+      if (i < (numSegs-1)) tr[i].cs_change = segs[i].csChange;
+   }
+
+   status = ioctl(spiInfo[handle].fd, SPI_IOC_MESSAGE(numSegs), tr);
+
+   if (status < 0)
+      SOFT_ERROR(PI_SPI_XFER_FAILED, "SPI_IOC_MESSAGE failed (%m)");
+
+   return status;
+}
+
+static int spiDevXfer(
+   unsigned handle, char *txBuf, char *rxBuf, unsigned count)
+{
+   pi_spi_seg_t seg[2];
+   unsigned ren3w;
+
+   memset(seg, 0, sizeof(seg));
+
+   seg[0].txBuf = txBuf;
+   seg[0].rxBuf = rxBuf;
+   seg[0].len   = count;
+
+   if (!PI_SPI_FLAGS_GET_3WIRE(spiInfo[handle].flags) || !count)
+      return spiDevMessage(handle, seg, 1);
+
+   /* 3-wire is half duplex, write the first nnnn bytes then read */
+
+   ren3w = PI_SPI_FLAGS_GET_3WREN(spiInfo[handle].flags);
+
+   if (ren3w > count) ren3w = count;
+
+   if (rxBuf) memset(rxBuf, 0, ren3w);
+
+   seg[0].rxBuf = NULL;
+   seg[0].len   = ren3w;
+
+   seg[1].rxBuf = rxBuf ? (rxBuf + ren3w) : NULL;
+   seg[1].len   = count - ren3w;
+
+   if (!ren3w)          return spiDevMessage(handle, seg+1, 1);
+   if (ren3w == count)  return spiDevMessage(handle, seg, 1);
+
+   return spiDevMessage(handle, seg, 2);
+}
+
+int spiOpen(unsigned spiChan, unsigned baud, unsigned spiFlags)
+{
+   static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+   int i, slot, fd, spidev;
+
+   DBG(DBG_USER, "spiChan=%d baud=%d spiFlags=0x%X",
+      spiChan, baud, spiFlags);
+
+   spidev = PI_SPI_FLAGS_GET_SPIDEV(spiFlags);
+
+   if (!spidev) CHECK_SPI_INITED;
+
+   if (PI_SPI_FLAGS_GET_AUX_SPI(spiFlags))
+   {
+      /* the kernel knows whether /dev/spidev1.x exists */
+
+      if (spiSimOpen && !spidev)
+         SOFT_ERROR(PI_NO_AUX_SPI, "no auxiliary SPI in the simulator");
+
+      if (!spidev && (gpioHardwareRevision() < 16))
+         SOFT_ERROR(PI_NO_AUX_SPI, "no auxiliary SPI on Pi A or B");
+
+      i = PI_NUM_AUX_SPI_CHANNEL;
+   }
+   else
+      i = PI_NUM_STD_SPI_CHANNEL;
+
+   if (spiChan >= i)
+      SOFT_ERROR(PI_BAD_SPI_CHANNEL, "bad spiChan (%d)", spiChan);
+
+   if ((baud < PI_SPI_MIN_BAUD) || (baud > PI_SPI_MAX_BAUD))
+      SOFT_ERROR(PI_BAD_SPI_SPEED, "bad baud (%d)", baud);
+
+   if (spiFlags >= (1<<23))
+      SOFT_ERROR(PI_BAD_FLAGS, "bad spiFlags (0x%X)", spiFlags);
+
+   if (!spidev && !spiAnyOpen(spiFlags)) /* initialise on first open */
+   {
+      spiInit(spiFlags);
+      spiGo(baud, spiFlags, NULL, NULL, 0);
+   }
+
+   slot = -1;
+
+   pthread_mutex_lock(&mutex);
+
+   for (i=0; i<PI_SPI_SLOTS; i++)
+   {
+      if (spiInfo[i].state == PI_SPI_CLOSED)
+      {
+         slot = i;
+         spiInfo[slot].state = PI_SPI_RESERVED;
+         break;
+      }
+   }
+
+   pthread_mutex_unlock(&mutex);
+
+   if (slot < 0) SOFT_ERROR(PI_NO_HANDLE, "no SPI handles");
+
+   fd = -1;
+
+   if (spidev)
+   {
+      fd = spiDevOpen(spiChan, baud, spiFlags);
+
+      if (fd < 0)
+      {
+         spiInfo[slot].state = PI_SPI_CLOSED;
+         return fd;
+      }
+   }
+
+   spiInfo[slot].fd    = fd;
+   spiInfo[slot].speed = baud;
+   spiInfo[slot].flags = spiFlags | PI_SPI_FLAGS_CHANNEL(spiChan);
+   spiInfo[slot].state = PI_SPI_OPENED;
+
+   return slot;
+}
+
+int spiClose(unsigned handle)
+{
+   DBG(DBG_USER, "handle=%d", handle);
+
+   if (handle >= PI_SPI_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (spiInfo[handle].state != PI_SPI_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (!PI_SPI_FLAGS_GET_SPIDEV(spiInfo[handle].flags)) CHECK_SPI_INITED;
+
+   acqHandleClosed(PI_ACQ_SPI, handle);
+
+   spiInfo[handle].state = PI_SPI_CLOSED;
+
+   if (PI_SPI_FLAGS_GET_SPIDEV(spiInfo[handle].flags))
+   {
+      close(spiInfo[handle].fd);
+      spiInfo[handle].fd = -1;
+   }
+   else if (!spiAnyOpen(spiInfo[handle].flags))
+      spiTerm(spiInfo[handle].flags); /* terminate on last close */
+
+   return 0;
+}
+
+int spiRead(unsigned handle, char *buf, unsigned count)
+{
+   DBG(DBG_USER, "handle=%d count=%d [%s]",
+      handle, count, myBuf2Str(count, buf));
+
+   if (handle >= PI_SPI_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (spiInfo[handle].state != PI_SPI_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (!PI_SPI_FLAGS_GET_SPIDEV(spiInfo[handle].flags)) CHECK_SPI_INITED;
+
+   if (count > PI_MAX_SPI_DEVICE_COUNT)
+      SOFT_ERROR(PI_BAD_SPI_COUNT, "bad count (%d)", count);
+
+   if (PI_SPI_FLAGS_GET_SPIDEV(spiInfo[handle].flags))
+      return spiDevXfer(handle, NULL, buf, count);
+
+   spiGo(spiInfo[handle].speed, spiInfo[handle].flags, NULL, buf, count);
+
+   return count;
+}
+
+int spiWrite(unsigned handle, char *buf, unsigned count)
+{
+   DBG(DBG_USER, "handle=%d count=%d [%s]",
+      handle, count, myBuf2Str(count, buf));
+
+   if (handle >= PI_SPI_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (spiInfo[handle].state != PI_SPI_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (!PI_SPI_FLAGS_GET_SPIDEV(spiInfo[handle].flags)) CHECK_SPI_INITED;
+
+   if (count > PI_MAX_SPI_DEVICE_COUNT)
+      SOFT_ERROR(PI_BAD_SPI_COUNT, "bad count (%d)", count);
+
+   if (PI_SPI_FLAGS_GET_SPIDEV(spiInfo[handle].flags))
+      return spiDevXfer(handle, buf, NULL, count);
+
+   spiGo(spiInfo[handle].speed, spiInfo[handle].flags, buf, NULL, count);
+
+   return count;
+}
+
+int spiXfer(unsigned handle, char *txBuf, char *rxBuf, unsigned count)
+{
+   DBG(DBG_USER, "handle=%d count=%d [%s]",
+      handle, count, myBuf2Str(count, txBuf));
+
+   if (handle >= PI_SPI_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (spiInfo[handle].state != PI_SPI_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (!PI_SPI_FLAGS_GET_SPIDEV(spiInfo[handle].flags)) CHECK_SPI_INITED;
+
+   if (count > PI_MAX_SPI_DEVICE_COUNT)
+      SOFT_ERROR(PI_BAD_SPI_COUNT, "bad count (%d)", count);
+
+   if (PI_SPI_FLAGS_GET_SPIDEV(spiInfo[handle].flags))
+      return spiDevXfer(handle, txBuf, rxBuf, count);
+
+   spiGo(spiInfo[handle].speed, spiInfo[handle].flags, txBuf, rxBuf, count);
+
+   return count;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int spiSegments(unsigned handle, pi_spi_seg_t *segs, unsigned numSegs)
+{
+   unsigned i, total;
+
+   DBG(DBG_USER, "handle=%d segs=%08"PRIXPTR" numSegs=%d",
+      handle, (uintptr_t)segs, numSegs);
+
+   if (handle >= PI_SPI_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (spiInfo[handle].state != PI_SPI_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (!PI_SPI_FLAGS_GET_SPIDEV(spiInfo[handle].flags)) CHECK_SPI_INITED;
+
+   if (segs == NULL)
+      SOFT_ERROR(PI_BAD_POINTER, "null segments");
+
+   if ((numSegs < 1) || (numSegs > PI_SPI_MAX_SEGS))
+      SOFT_ERROR(PI_TOO_MANY_SEGS, "bad numSegs (%d)", numSegs);
+
+   total = 0;
+
+   for (i=0; i<numSegs; i++)
+   {
+      if (segs[i].len > PI_MAX_SPI_DEVICE_COUNT)
+         SOFT_ERROR(PI_BAD_SPI_COUNT, "bad len (%d) in segment %d",
+            segs[i].len, i);
+
+      total += segs[i].len;
+   }
+
+   if (PI_SPI_FLAGS_GET_SPIDEV(spiInfo[handle].flags))
+      return spiDevMessage(handle, segs, numSegs);
+
+   /* the registers deselect the device after every transfer */
+
+   for (i=0; i<numSegs; i++)
+   {
+      spiGo(spiInfo[handle].speed, spiInfo[handle].flags,
+         segs[i].txBuf, segs[i].rxBuf, segs[i].len);
+
+      if (segs[i].usDelay) myGpioDelay(segs[i].usDelay);
+   }
+
+   return total;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioSPISimOpen(void)
+{
+   DBG(DBG_USER, "");
+
+   CHECK_NOT_INITED;
+
+   if (spiSimOpen) return 0;
+
+   /* GPIO then SPI registers */
+
+   spiSimRegs = calloc(128, sizeof(uint32_t));
+
+   spiDMAMem.virtual_addr = calloc(1, SPI_DMA_MEM);
+
+   if ((spiSimRegs == NULL) || (spiDMAMem.virtual_addr == NULL))
+   {
+      free(spiSimRegs);
+      free(spiDMAMem.virtual_addr);
+
+      spiSimRegs             = NULL;
+      spiDMAMem.virtual_addr = NULL;
+
+      SOFT_ERROR(PI_NO_MEMORY, "can't allocate simulated SPI");
+   }
+
+   /* a made up bus address, only the simulator follows it */
+
+   spiDMAMem.handle   = 0;
+   spiDMAMem.bus_addr = SPI_SIM_BUS;
+   spiDMAMem.size     = SPI_DMA_MEM;
+
+   gpioReg = spiSimRegs;
+   spiReg  = spiSimRegs + 64;
+
+   spiSimDMABytes = 0;
+   spiSimCPUBytes = 0;
+   spiSimFaults   = 0;
+
+   spiSimOpen = 1;
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioSPISimClose(void)
+{
+   int i;
+
+   DBG(DBG_USER, "");
+
+   if (!spiSimOpen) return 0;
+
+   for (i=0; i<PI_SPI_SLOTS; i++)
+   {
+      if (!PI_SPI_FLAGS_GET_SPIDEV(spiInfo[i].flags) &&
+          (spiInfo[i].state == PI_SPI_OPENED))
+      {
+         acqHandleClosed(PI_ACQ_SPI, i);
+         spiInfo[i].state = PI_SPI_CLOSED;
+      }
+   }
+
+   free(spiSimRegs);
+   free(spiDMAMem.virtual_addr);
+
+   spiSimRegs             = NULL;
+   spiDMAMem.virtual_addr = NULL;
+   spiDMAMem.bus_addr     = 0;
+
+   gpioReg = MAP_FAILED;
+   spiReg  = MAP_FAILED;
+
+   spiSimOpen = 0;
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioSPISimStats(uint32_t *dmaBytes, uint32_t *cpuBytes)
+{
+   DBG(DBG_USER, "dmaBytes=%08"PRIXPTR" cpuBytes=%08"PRIXPTR,
+      (uintptr_t)dmaBytes, (uintptr_t)cpuBytes);
+
+   if (!spiSimOpen)
+      SOFT_ERROR(PI_NOT_INITIALISED, "call gpioSPISimOpen() first");
+
+   if (dmaBytes) *dmaBytes = spiSimDMABytes;
+   if (cpuBytes) *cpuBytes = spiSimCPUBytes;
+
+   return spiSimFaults;
+}
+
+/* ======================================================================= */
+
+/*SENSOR ACQUISITION */
+
+static void acqStore(acqInfo_t *a, uint32_t tick, char *data)
+{
+   /* called with acqMutex held, the oldest sample is lost if full */
+
+   char *rec;
+
+   if (a->count == PI_ACQ_SAMPLES)
+   {
+      a->readPos = (a->readPos + 1) % PI_ACQ_SAMPLES;
+      a->count--;
+   }
+
+   rec = a->ring +
+      (((a->readPos + a->count) % PI_ACQ_SAMPLES) * (4 + a->len));
+
+   memcpy(rec, &tick, 4);
+   memcpy(rec + 4, data, a->len);
+
+   a->count++;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void acqI2CDone(int id, int status, void *userdata)
+{
+   acqInfo_t *a = userdata;
+
+   pthread_mutex_lock(&acqMutex);
+
+   if ((a->state == ACQ_RUNNING) && (a->op.status == a->len))
+      acqStore(a, a->tick, a->data);
+
+   a->pending = 0;
+
+   pthread_cond_broadcast(&acqDone);
+
+   pthread_mutex_unlock(&acqMutex);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void acqSample(void *userdata)
+{
+   /* called from the timer thread each period */
+
+   acqInfo_t *a = userdata;
+   char tx[PI_MAX_ACQ_LEN+1];
+   uint32_t tick;
+
+   tick = systReg[SYST_CLO];
+
+   pthread_mutex_lock(&acqMutex);
+
+   /* the handle may be closing, see acqHandleClosed */
+
+   if (a->state != ACQ_RUNNING)
+   {
+      pthread_mutex_unlock(&acqMutex);
+      return;
+   }
+
+   if (a->type == PI_ACQ_I2C)
+   {
+      if (a->pending)
+      {
+         /* the last read is still queued, skip this one */
+
+         pthread_mutex_unlock(&acqMutex);
+         return;
+      }
+
+      a->pending = 1;
+      a->tick = tick;
+
+      pthread_mutex_unlock(&acqMutex);
+
+      if (intI2CBatchStart(1, &a->op, PI_MAX_I2C_PRIORITY,
+             acqI2CDone, a, -1, NULL, I2C_OWNER_LOCAL) < 0)
+      {
+         pthread_mutex_lock(&acqMutex);
+         a->pending = 0;
+         pthread_cond_broadcast(&acqDone);
+         pthread_mutex_unlock(&acqMutex);
+      }
+   }
+   else
+   {
+      pthread_mutex_unlock(&acqMutex);
+
+      memset(tx, 0, a->len + 1);
+      tx[0] = a->reg;
+
+      if (spiXfer(a->handle, tx, a->data, a->len + 1) == (a->len + 1))
+      {
+         pthread_mutex_lock(&acqMutex);
+         acqStore(a, tick, a->data + 1);
+         pthread_mutex_unlock(&acqMutex);
+      }
+   }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void acqHandleClosed(unsigned type, unsigned handle)
+{
+   /*
+   Called before an I2C or SPI handle is closed.  Its acquisitions
+   stop sampling and are marked as failed, their unread samples are
+   kept until acqStop.
+   */
+
+   int timers[PI_ACQ_SLOTS];
+   int i, n;
+
+   n = 0;
+
+   pthread_mutex_lock(&acqMutex);
+
+   for (i=0; i<PI_ACQ_SLOTS; i++)
+   {
+      if ((acqInfo[i].state == ACQ_RUNNING) &&
+          (acqInfo[i].type == type) && (acqInfo[i].handle == handle))
+      {
+         DBG(DBG_USER, "acquisition %d failed, handle %d closed", i, handle);
+
+         acqInfo[i].state = ACQ_FAILED;
+         timers[n++] = acqInfo[i].timer;
+      }
+   }
+
+   pthread_mutex_unlock(&acqMutex);
+
+   /* waits for a sample already being taken */
+
+   for (i=0; i<n; i++) gpioTimerCancel(timers[i]);
+}
+
+/* ----------------------------------------------------------------------- */
+
+int acqStart(
+   unsigned type, unsigned handle, unsigned reg, unsigned len,
+   unsigned micros)
+{
+   acqInfo_t *a;
+   int id;
+
+   DBG(DBG_USER, "type=%d handle=%d reg=%d len=%d micros=%d",
+      type, handle, reg, len, micros);
+
+   CHECK_INITED;
+
+   if (type == PI_ACQ_I2C)
+   {
+      if ((handle >= PI_I2C_SLOTS) ||
+          (i2cInfo[handle].state != PI_I2C_OPENED))
+         SOFT_ERROR(PI_BAD_HANDLE, "bad I2C handle (%d)", handle);
+   }
+   else if (type == PI_ACQ_SPI)
+   {
+      if ((handle >= PI_SPI_SLOTS) ||
+          (spiInfo[handle].state != PI_SPI_OPENED))
+         SOFT_ERROR(PI_BAD_HANDLE, "bad SPI handle (%d)", handle);
+   }
+   else SOFT_ERROR(PI_BAD_PARAM, "bad type (%d)", type);
+
+   if (reg > 255)
+      SOFT_ERROR(PI_BAD_PARAM, "bad register (%d)", reg);
+
+   if ((len < 1) || (len > PI_MAX_ACQ_LEN))
+      SOFT_ERROR(PI_BAD_PARAM, "bad length (%d)", len);
+
+   if ((micros < PI_MIN_TIMER_PERIOD) || (micros > PI_MAX_TIMER_MICROS))
+      SOFT_ERROR(PI_BAD_TIMER_MICROS, "bad micros (%d)", micros);
+
+   pthread_mutex_lock(&acqMutex);
+
+   for (id=0; id<PI_ACQ_SLOTS; id++)
+   {
+      if (acqInfo[id].state == ACQ_CLOSED) break;
+   }
+
+   if (id >= PI_ACQ_SLOTS)
+   {
+      pthread_mutex_unlock(&acqMutex);
+      SOFT_ERROR(PI_NO_HANDLE, "no acquisition slots");
+   }
+
+   a = &acqInfo[id];
+
+   a->ring = malloc(PI_ACQ_SAMPLES * (4 + len));
+
+   if (!a->ring)
+   {
+      pthread_mutex_unlock(&acqMutex);
+      SOFT_ERROR(PI_NO_MEMORY, "no memory for acquisition ring");
+   }
+
+   a->type      = type;
+   a->handle    = handle;
+   a->reg       = reg;
+   a->len       = len;
+   a->pending   = 0;
+   a->readPos   = 0;
+   a->count     = 0;
+
+   a->op.handle = handle;
+   a->op.flags  = PI_I2C_OP_READ | PI_I2C_OP_REG;
+   a->op.reg    = reg;
+   a->op.len    = len;
+   a->op.buf    = a->data;
+
+   a->timer = gpioTimerStart(micros, micros, acqSample, a);
+
+   if (a->timer < 0)
+   {
+      free(a->ring);
+      a->ring = NULL;
+
+      pthread_mutex_unlock(&acqMutex);
+
+      return a->timer;
+   }
+
+   a->state = ACQ_RUNNING;
+
+   pthread_mutex_unlock(&acqMutex);
+
+   return id;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int acqStop(unsigned acq_id)
+{
+   acqInfo_t *a;
+
+   DBG(DBG_USER, "acq_id=%d", acq_id);
+
+   CHECK_INITED;
+
+   if ((acq_id >= PI_ACQ_SLOTS) || (acqInfo[acq_id].state == ACQ_CLOSED))
+      SOFT_ERROR(PI_BAD_HANDLE, "bad acquisition id (%d)", acq_id);
+
+   a = &acqInfo[acq_id];
+
+   /* once cancelled no new read will be started */
+
+   if (a->state == ACQ_RUNNING) gpioTimerCancel(a->timer);
+
+   pthread_mutex_lock(&acqMutex);
+
+   while (a->pending) pthread_cond_wait(&acqDone, &acqMutex);
+
+   free(a->ring);
+   a->ring = NULL;
+   a->state = ACQ_CLOSED;
+
+   pthread_mutex_unlock(&acqMutex);
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int acqRead(unsigned acq_id, char *buf, unsigned bufSize)
+{
+   acqInfo_t *a;
+   unsigned recSize, pos;
+
+   DBG(DBG_USER, "acq_id=%d buf=%08"PRIXPTR" bufSize=%d",
+      acq_id, (uintptr_t)buf, bufSize);
+
+   CHECK_INITED;
+
+   if (acq_id >= PI_ACQ_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad acquisition id (%d)", acq_id);
+
+   a = &acqInfo[acq_id];
+
+   pthread_mutex_lock(&acqMutex);
+
+   if (a->state == ACQ_CLOSED)
+   {
+      pthread_mutex_unlock(&acqMutex);
+      SOFT_ERROR(PI_BAD_HANDLE, "bad acquisition id (%d)", acq_id);
+   }
+
+   /* a failed acquisition is drained, then reports its closed handle */
+
+   if ((a->state == ACQ_FAILED) && !a->count)
+   {
+      pthread_mutex_unlock(&acqMutex);
+      return PI_BAD_HANDLE;
+   }
+
+   recSize = 4 + a->len;
+
+   for (pos=0; a->count && ((pos + recSize) <= bufSize); pos+=recSize)
+   {
+      memcpy(buf+pos, a->ring + (a->readPos * recSize), recSize);
+
+      a->readPos = (a->readPos + 1) % PI_ACQ_SAMPLES;
+      a->count--;
+   }
+
+   pthread_mutex_unlock(&acqMutex);
+
+   return pos;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int acqMonitor(unsigned handle, uint32_t bits)
+{
+   DBG(DBG_USER, "handle=%d bits=%08X", handle, bits);
+
+   CHECK_INITED;
+
+   if (handle >= PI_NOTIFY_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (gpioNotify[handle].state <= PI_NOTIFY_CLOSING)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   gpioNotify[handle].acqBits = bits;
+
+   return 0;
+}
+
+/* ======================================================================= */
+
+static int serFill(unsigned handle, uint32_t events)
+{
+   /* move what the port has received into its buffer, return the
+      buffered count if the data is ready, otherwise 0 */
+
+   serInfo_t *ser = &serInfo[handle];
+   char chunk[SER_CHUNK];
+   int i, r, got = 0, ready = 0;
+
+   if ((ser->state != PI_SER_OPENED) || (ser->ring == NULL)) return 0;
+
+   while ((r = read(ser->fd, chunk, sizeof(chunk))) > 0)
+   {
+      got += r;
+
+      for (i=0; i<r; i++)
+      {
+         if (ser->count == ser->size) /* full, discard the oldest */
+         {
+            ser->readPos = (ser->readPos + 1) % ser->size;
+            ser->count--;
+         }
+
+         ser->ring[(ser->readPos + ser->count) % ser->size] = chunk[i];
+         ser->count++;
+
+         if ((chunk[i] & 0xFF) == ser->terminator) ready = 1;
+      }
+   }
+
+   /* stop waiting on a port which has hung up or failed */
+
+   if ((events & (EPOLLHUP | EPOLLERR)) ||
+       ((r < 0) && (errno != EAGAIN) && (errno != EINTR)))
+   {
+      DBG(DBG_USER, "serial handle %d no longer readable", handle);
+      epoll_ctl(fdSer, EPOLL_CTL_DEL, ser->fd, NULL);
+   }
+
+   if (got && (ser->count >= ser->minBytes)) ready = 1;
+
+   if (ready) return ser->count; else return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int serTake(unsigned handle, char *buf, unsigned count)
+{
+   /* copy up to count bytes out of the buffer, serMutex held */
+
+   serInfo_t *ser = &serInfo[handle];
+   unsigned part;
+
+   if (count > ser->count) count = ser->count;
+
+   part = ser->size - ser->readPos;
+
+   if (part > count) part = count;
+
+   memcpy(buf, ser->ring + ser->readPos, part);
+   memcpy(buf + part, ser->ring, count - part);
+
+   ser->readPos = (ser->readPos + count) % ser->size;
+   ser->count -= count;
+
+   return count;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void *pthSerThread(void *x)
+{
+   struct epoll_event ev[PI_SER_SLOTS];
+   eventfd_t wakes;
+   serReadyFunc_t func;
+   void *userdata;
+   int i, n, handle, count;
+
+   pthread_mutex_lock(&serMutex);
+
+   while (!serStop)
+   {
+      pthread_mutex_unlock(&serMutex);
+
+      n = epoll_wait(fdSer, ev, PI_SER_SLOTS, -1);
+
+      pthread_mutex_lock(&serMutex);
+
+      for (i=0; i<n; i++)
+      {
+         handle = ev[i].data.u32;
+
+         if (handle == SER_WAKE)
+         {
+            eventfd_read(fdSerWake, &wakes);
+            continue;
+         }
+
+         count = serFill(handle, ev[i].events);
+
+         if (!count) continue;
+
+         if (serInfo[handle].event >= 0)
+            eventAlert[serInfo[handle].event].fired = 1;
+
+         func     = serInfo[handle].func;
+         userdata = serInfo[handle].userdata;
+
+         if (func)
+         {
+            pthread_mutex_unlock(&serMutex);
+
+            (func)(handle, count, userdata);
+
+            pthread_mutex_lock(&serMutex);
+         }
+      }
+   }
+
+   pthread_mutex_unlock(&serMutex);
+
+   return NULL;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int serReaderStart(void)
+{
+   /* one thread reads every buffered port, serMutex held */
+
+   pthread_attr_t pthAttr;
+   struct epoll_event ev;
+
+   if (pthSerRunning != PI_THREAD_NONE) return 0;
+
+   if (fdSer < 0) fdSer = epoll_create1(EPOLL_CLOEXEC);
+
+   if (fdSer < 0) return -1;
+
+   if (fdSerWake < 0)
+   {
+      fdSerWake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+      if (fdSerWake < 0) return -1;
+
+      ev.events = EPOLLIN;
+      ev.data.u64 = 0;
+      ev.data.u32 = SER_WAKE;
+
+      if (epoll_ctl(fdSer, EPOLL_CTL_ADD, fdSerWake, &ev)) return -1;
+   }
+
+   if (pthread_attr_init(&pthAttr)) return -1;
+
+   if (pthread_attr_setstacksize(&pthAttr, STACK_SIZE)) return -1;
+
+   serStop = 0;
+
+   if (pthread_create(&pthSer, &pthAttr, pthSerThread, NULL)) return -1;
+
+   pthSerRunning = PI_THREAD_RUNNING;
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void serReaderStop(void)
+{
+   int i;
+
+   if (pthSerRunning != PI_THREAD_NONE)
+   {
+      pthread_mutex_lock(&serMutex);
+      serStop = 1;
+      pthread_mutex_unlock(&serMutex);
+
+      eventfd_write(fdSerWake, 1);
+
+      /* may be called from a ready callback */
+
+      if (pthread_equal(pthread_self(), pthSer)) pthread_detach(pthSer);
+      else                                       pthread_join(pthSer, NULL);
+
+      pthSerRunning = PI_THREAD_NONE;
+   }
+
+   pthread_mutex_lock(&serMutex);
+
+   for (i=0; i<PI_SER_SLOTS; i++)
+   {
+      if (serInfo[i].ring) free(serInfo[i].ring);
+      serInfo[i].ring = NULL;
+      serInfo[i].func = NULL;
+   }
+
+   if (fdSer != -1)
+   {
+      close(fdSer);
+      fdSer = -1;
+   }
+
+   if (fdSerWake != -1)
+   {
+      close(fdSerWake);
+      fdSerWake = -1;
+   }
+
+   pthread_mutex_unlock(&serMutex);
+}
+
+/* ----------------------------------------------------------------------- */
+
+
+int serOpen(char *tty, unsigned serBaud, unsigned serFlags)
+{
+   static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+   struct termios new;
+   int speed;
+   int fd;
+   int i, slot;
+
+   DBG(DBG_USER, "tty=%s serBaud=%d serFlags=0x%X", tty, serBaud, serFlags);
+
+   SER_CHECK_INITED;
+
+   if (strncmp("/dev/tty", tty, 8) && strncmp("/dev/serial", tty, 11) &&
+       strncmp("/dev/pts/", tty, 9))
+      SOFT_ERROR(PI_BAD_SER_DEVICE, "bad device (%s)", tty);
+
+   switch (serBaud)
+   {
+      case     50: speed =     B50; break;
+      case     75: speed =     B75; break;
+      case    110: speed =    B110; break;
+      case    134: speed =    B134; break;
+      case    150: speed =    B150; break;
+      case    200: speed =    B200; break;
+      case    300: speed =    B300; break;
+      case    600: speed =    B600; break;
+      case   1200: speed =   B1200; break;
+      case   1800: speed =   B1800; break;
+      case   2400: speed =   B2400; break;
+      case   4800: speed =   B4800; break;
+      case   9600: speed =   B9600; break;
+      case  19200: speed =  B19200; break;
+      case  38400: speed =  B38400; break;
+      case  57600: speed =  B57600; break;
+      case 115200: speed = B115200; break;
+      case 230400: speed = B230400; break;
+
+      default:
+         SOFT_ERROR(PI_BAD_SER_SPEED, "bad speed (%d)", serBaud);
+   }
+
+   if (serFlags)
+      SOFT_ERROR(PI_BAD_FLAGS, "bad flags (0x%X)", serFlags);
+
+   slot = -1;
+
+   pthread_mutex_lock(&mutex);
+
+   for (i=0; i<PI_SER_SLOTS; i++)
+   {
+      if (serInfo[i].state == PI_SER_CLOSED)
+      {
+         slot = i;
+         serInfo[slot].state = PI_SER_RESERVED;
+         break;
+      }
+   }
+
+   pthread_mutex_unlock(&mutex);
+
+   if (slot < 0) SOFT_ERROR(PI_NO_HANDLE, "no serial handles");
+
+   if ((fd = open(tty, O_RDWR | O_NOCTTY | O_NDELAY | O_NONBLOCK)) == -1)
+   {
+      serInfo[slot].state = PI_SER_CLOSED;
+      return PI_SER_OPEN_FAILED;
+   }
+
+   tcgetattr(fd, &new);
+
+   cfmakeraw(&new);
+
+   cfsetispeed(&new, speed);
+   cfsetospeed(&new, speed);
+
+   new.c_cc [VMIN]  = 0;
+   new.c_cc [VTIME] = 0;
+
+   tcflush(fd, TCIFLUSH);
+   tcsetattr(fd, TCSANOW, &new);
+
+   //fcntl(fd, F_SETFL, O_RDWR);
+
+   serInfo[slot].fd = fd;
+   serInfo[slot].flags = serFlags;
+   serInfo[slot].ring = NULL;
+   serInfo[slot].func = NULL;
+   serInfo[slot].state = PI_SER_OPENED;
+
+   return slot;
+}
+
+int serClose(unsigned handle)
+{
+   DBG(DBG_USER, "handle=%d", handle);
+
+   SER_CHECK_INITED;
+
+   if (handle >= PI_SER_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (serInfo[handle].state != PI_SER_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   pthread_mutex_lock(&serMutex);
+
+   if (serInfo[handle].ring)
+   {
+      epoll_ctl(fdSer, EPOLL_CTL_DEL, serInfo[handle].fd, NULL);
+      free(serInfo[handle].ring);
+      serInfo[handle].ring = NULL;
+   }
+
+   serInfo[handle].func = NULL;
+
+   pthread_mutex_unlock(&serMutex);
+
+   if (serInfo[handle].fd >= 0) close(serInfo[handle].fd);
+
+   serInfo[handle].fd = -1;
+   serInfo[handle].state = PI_SER_CLOSED;
+
+   return 0;
+}
+
+int serWriteByte(unsigned handle, unsigned bVal)
+{
+   char c;
+
+   DBG(DBG_USER, "handle=%d bVal=%d", handle, bVal);
+
+   SER_CHECK_INITED;
+
+   if (handle >= PI_SER_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (serInfo[handle].state != PI_SER_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (bVal > 0xFF)
+      SOFT_ERROR(PI_BAD_PARAM, "bad parameter (%d)", bVal);
+
+   c = bVal;
+
+   if (write(serInfo[handle].fd, &c, 1) != 1)
+      return PI_SER_WRITE_FAILED;
+   else
+      return 0;
+}
+
+int serReadByte(unsigned handle)
+{
+   int r;
+   char x;
+
+   DBG(DBG_USER, "handle=%d", handle);
+
+   SER_CHECK_INITED;
+
+   if (handle >= PI_SER_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (serInfo[handle].state != PI_SER_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   pthread_mutex_lock(&serMutex);
+
+   if (serInfo[handle].ring) r = serTake(handle, &x, 1);
+   else                      r = read(serInfo[handle].fd, &x, 1);
+
+   pthread_mutex_unlock(&serMutex);
+
+   if (r == 1)
+      return ((int)x) & 0xFF;
+
+   else if (r == 0)
+      return PI_SER_READ_NO_DATA;
+
+   else if ((r == -1) && (errno == EAGAIN))
+      return PI_SER_READ_NO_DATA;
+
+   else
+      return PI_SER_READ_FAILED;
+}
+
+int serWrite(unsigned handle, char *buf, unsigned count)
+{
+   int written=0, wrote=0;
+
+   DBG(DBG_USER, "handle=%d count=%d [%s]",
+      handle, count, myBuf2Str(count, buf));
+
+   SER_CHECK_INITED;
+
+   if (handle >= PI_SER_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (serInfo[handle].state != PI_SER_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (!count)
+      SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
+
+   while ((written != count) && (wrote >= 0))
+   {
+      wrote = write(serInfo[handle].fd, buf+written, count-written);
+
+      if (wrote >= 0)
+      {
+         written += wrote;
+
+         if (written != count) time_sleep(0.05);
+      }
+   }
+
+   if (written != count)
+      return PI_SER_WRITE_FAILED;
+   else
+      return 0;
+}
+
+int serRead(unsigned handle, char *buf, unsigned count)
+{
+   int r;
+
+   DBG(DBG_USER, "handle=%d count=%d buf=0x%"PRIXPTR, handle, count, (uintptr_t)buf);
+
+   SER_CHECK_INITED;
+
+   if (handle >= PI_SER_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (serInfo[handle].state != PI_SER_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (!count)
+      SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
+
+   pthread_mutex_lock(&serMutex);
+
+   if (serInfo[handle].ring)
+   {
+      r = serTake(handle, buf, count);
+
+      if (!r)
+      {
+         r = -1;
+         errno = EAGAIN;
+      }
+   }
+   else r = read(serInfo[handle].fd, buf, count);
+
+   pthread_mutex_unlock(&serMutex);
+
+   if (r == -1)
+   {
+      if (errno == EAGAIN)
+         return PI_SER_READ_NO_DATA;
+      else
+         return PI_SER_READ_FAILED;
+   }
+   else
+   {
+      if (r < count) buf[r] = 0;
+      return r;
+   }
+}
+
+int serDataAvailable(unsigned handle)
+{
+   int result;
+
+   DBG(DBG_USER, "handle=%d", handle);
+
+   SER_CHECK_INITED;
+
+   if (handle >= PI_SER_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (serInfo[handle].state != PI_SER_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   pthread_mutex_lock(&serMutex);
+
+   if (serInfo[handle].ring) result = serInfo[handle].count;
+   else if (ioctl(serInfo[handle].fd, FIONREAD, &result) == -1) result = 0;
+
+   pthread_mutex_unlock(&serMutex);
+
+   return result;
+}
+
+int serReadBuffer(
+   unsigned handle, unsigned bufSize, unsigned minBytes,
+   unsigned terminator, unsigned event)
+{
+   serInfo_t *ser;
+   struct epoll_event ev;
+   char *ring;
+   unsigned i, keep;
+
+   DBG(DBG_USER, "handle=%d bufSize=%d minBytes=%d terminator=%d event=%d",
+      handle, bufSize, minBytes, terminator, event);
+
+   SER_CHECK_INITED;
+
+   if (handle >= PI_SER_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (serInfo[handle].state != PI_SER_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (bufSize > PI_SER_MAX_BUFFER)
+      SOFT_ERROR(PI_BAD_PARAM, "bad bufSize (%d)", bufSize);
+
+   if (bufSize && ((minBytes < 1) || (minBytes > bufSize)))
+      SOFT_ERROR(PI_BAD_PARAM, "bad minBytes (%d)", minBytes);
+
+   if (terminator > PI_SER_NO_TERMINATOR)
+      SOFT_ERROR(PI_BAD_PARAM, "bad terminator (%d)", terminator);
+
+   if (event > PI_SER_NO_EVENT)
+      SOFT_ERROR(PI_BAD_PARAM, "bad event (%d)", event);
+
+   ser = &serInfo[handle];
+
+   pthread_mutex_lock(&serMutex);
+
+   if (!bufSize)
+   {
+      if (ser->ring)
+      {
+         epoll_ctl(fdSer, EPOLL_CTL_DEL, ser->fd, NULL);
+         free(ser->ring);
+         ser->ring = NULL;
+      }
+
+      pthread_mutex_unlock(&serMutex);
+
+      return 0;
+   }
+
+   ser->minBytes = minBytes;
+
+   if (terminator < PI_SER_NO_TERMINATOR) ser->terminator = terminator;
+   else                                   ser->terminator = -1;
+
+   if (event < PI_SER_NO_EVENT) ser->event = event;
+   else                         ser->event = -1;
+
+   if (ser->ring && (ser->size == bufSize))
+   {
+      pthread_mutex_unlock(&serMutex);
+
+      return 0;
+   }
+
+   if ((ring = malloc(bufSize)) == NULL)
+   {
+      pthread_mutex_unlock(&serMutex);
+
+      SOFT_ERROR(PI_SER_BUF_FAILED, "can't allocate %d bytes", bufSize);
+   }
+
+   if (ser->ring)
+   {
+      /* resized, keep the newest data which fits */
+
+      keep = ser->count;
+
+      if (keep > bufSize) keep = bufSize;
+
+      for (i=0; i<keep; i++)
+         ring[i] = ser->ring[
+            (ser->readPos + ser->count - keep + i) % ser->size];
+
+      free(ser->ring);
+
+      ser->ring    = ring;
+      ser->size    = bufSize;
+      ser->readPos = 0;
+      ser->count   = keep;
+
+      pthread_mutex_unlock(&serMutex);
+
+      return 0;
+   }
+
+   ser->ring    = ring;
+   ser->size    = bufSize;
+   ser->readPos = 0;
+   ser->count   = 0;
+
+   ev.events = EPOLLIN;
+   ev.data.u64 = 0;
+   ev.data.u32 = handle;
+
+   if (serReaderStart() || epoll_ctl(fdSer, EPOLL_CTL_ADD, ser->fd, &ev))
+   {
+      free(ser->ring);
+      ser->ring = NULL;
+
+      pthread_mutex_unlock(&serMutex);
+
+      SOFT_ERROR(PI_SER_BUF_FAILED, "can't wait on handle %d", handle);
+   }
+
+   pthread_mutex_unlock(&serMutex);
+
+   return 0;
+}
+
+int serSetReadyFunc(unsigned handle, serReadyFunc_t f, void *userdata)
+{
+   DBG(DBG_USER, "handle=%d function=%08"PRIXPTR" userdata=%08"PRIXPTR,
+      handle, (uintptr_t)f, (uintptr_t)userdata);
+
+   SER_CHECK_INITED;
+
+   if (handle >= PI_SER_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (serInfo[handle].state != PI_SER_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   pthread_mutex_lock(&serMutex);
+
+   serInfo[handle].func     = f;
+   serInfo[handle].userdata = userdata;
+
+   pthread_mutex_unlock(&serMutex);
+
+   return 0;
+}
+
+/* ======================================================================= */
+
+static int chooseBestClock
+   (clkInf_t *clkInf, unsigned f, unsigned numc, unsigned *cf)
+{
+   int c, valid;
+   double fdiv, offby, best_offby;
+   unsigned div, frac;
+
+   valid = 0;
+   best_offby = 0;
+
+   for (c=0; c<numc; c++)
+   {
+      fdiv = (double)cf[c] / (double)f;
+      if (f < PI_MASH_MAX_FREQ)
+      {
+         fdiv += (0.5 / 4096.0);
+         div = fdiv;
+         frac = (fdiv - div) * 4096.0;
+      }
+      else
+      {
+         fdiv += 0.5;
+         div = fdiv;
+         frac = 0;
+      }
+
+      if ((div > 1) && (div < 4096))
+      {
+         offby = f - (cf[c] / (div + (frac / 4096.0)));
+         if (offby < 0) offby = - offby;
+         if ((!valid) || (offby <= best_offby))
+         {
+            valid = 1;
+            clkInf->div = div;
+            clkInf->frac = frac;
+            clkInf->clock = c;
+            best_offby = offby;
+         }
+      }
+   }
+   return valid;
+}
+
+/* ======================================================================= */
+
+static rawCbs_t * dmaCB2adr(int pos)
+{
+   int page, slot;
+
+   page = pos/CBS_PER_IPAGE;
+   slot = pos%CBS_PER_IPAGE;
+
+   return &dmaIVirt[page]->cb[slot];
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void dmaCbPrint(int pos)
+{
+   rawCbs_t * p;
+
+   p = dmaCB2adr(pos);
+
+   fprintf(stderr, "i=%x s=%x d=%x len=%x s=%x nxt=%x\n",
+      p->info, p->src, p->dst, p->length, p->stride, p->next);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned dmaNowAtICB(void)
+{
+   unsigned cb;
+   static unsigned lastPage=0;
+   unsigned page;
+   uint32_t cbAddr;
+   uint32_t startTick, endTick;
+
+   startTick = systReg[SYST_CLO];
+
+   cbAddr = dmaIn[DMA_CONBLK_AD];
+
+   page = lastPage;
+
+   /* which page are we dma'ing? */
+
+   while (1)
+   {
+      //cast twice to suppress compiler warning, I belive this cast is ok
+      //because dmaIbus contains bus addresses, not user addresses. --plugwash
+      cb = (cbAddr - ((int)(uintptr_t)dmaIBus[page])) / 32;
+
+      if (cb < CBS_PER_IPAGE)
+      {
+         endTick = systReg[SYST_CLO];
+
+         if (endTick != startTick)
+            gpioStats.cbTicks += (endTick - startTick);
+
+         gpioStats.cbCalls++;
+
+         lastPage = page;
+
+         return (page*CBS_PER_IPAGE) + cb;
+      }
+
+      if (page++ >= DMAI_PAGES) page=0;
+
+      if (page == lastPage) break;
+   }
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int dmaNowAtOCB(void)
+{
+   unsigned cb;
+   unsigned page;
+   uint32_t cbAddr;
+
+   cbAddr = dmaOut[DMA_CONBLK_AD];
+
+   if (!cbAddr) return -PI_NO_TX_WAVE;
+
+   page = 0;
+
+   /* which page are we dma'ing? */
+
+   while (1)
+   {
+      //cast twice to suppress compiler warning, I belive this cast is ok
+      //because dmaIbus contains bus addresses, not user addresses. --plugwash
+      cb = (cbAddr - ((int)(uintptr_t)dmaOBus[page])) / 32;
+
+      if (cb < CBS_PER_OPAGE) return (page*CBS_PER_OPAGE) + cb;
+
+      if (page++ >= DMAO_PAGES) break;
+   }
+
+   /* Try twice */
+
+   cbAddr = dmaOut[DMA_CONBLK_AD];
+
+   if (!cbAddr) return -PI_NO_TX_WAVE;
+
+   page = 0;
+
+   /* which page are we dma'ing? */
+
+   while (1)
+   {
+      //cast twice to suppress compiler warning, I belive this cast is ok
+      //because dmaIbus contains bus addresses, not user addresses. --plugwash
+      cb = (cbAddr - ((int)(uintptr_t)dmaOBus[page])) / 32;
+
+      if (cb < CBS_PER_OPAGE) return (page*CBS_PER_OPAGE) + cb;
+
+      if (page++ >= DMAO_PAGES) break;
+   }
+
+   return -PI_WAVE_NOT_FOUND;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int waveDMAnow(void)
+{
+   uint32_t offset;
+
+   if (!waveSimOpen) return dmaNowAtOCB();
+
+   /* the CB the simulated DMA will run next */
+
+   if (!waveSimStart) return -PI_NO_TX_WAVE;
+
+   offset = waveSimStart - WAVE_SIM_BUS;
+
+   if ((waveSimStart < WAVE_SIM_BUS) ||
+       (offset >= (DMAO_PAGES * sizeof(dmaOPage_t))) ||
+       ((offset % sizeof(dmaOPage_t)) >= (CBS_PER_OPAGE * 32)))
+      return -PI_WAVE_NOT_FOUND;
+
+   return ((offset / sizeof(dmaOPage_t)) * CBS_PER_OPAGE) +
+          ((offset % sizeof(dmaOPage_t)) / 32);
+}
+
+/* ----------------------------------------------------------------------- */
+
+unsigned rawWaveCB(void)
+{
+   unsigned cb;
+   static unsigned lastPage=0;
+   unsigned page;
+   uint32_t cbAddr;
+
+   cbAddr = dmaOut[DMA_CONBLK_AD];
+
+   if (!cbAddr) return -1;
+
+   page = lastPage;
+
+   /* which page are we dma'ing? */
+
+   while (1)
+   {
+      //cast twice to suppress compiler warning, I belive this cast is ok
+      //because dmaIbus contains bus addresses, not user addresses. --plugwash
+      cb = (cbAddr - ((int)(uintptr_t)dmaOBus[page])) / 32;
+
+      if (cb < CBS_PER_OPAGE)
+      {
+         lastPage = page;
+
+         return (page*CBS_PER_OPAGE) + cb;
+      }
+
+      if (page++ >= DMAO_PAGES) page=0;
+
+      if (page == lastPage) break;
+   }
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned dmaCurrentSlot(unsigned pos)
+{
+   unsigned cycle=0, slot=0, tmp;
+
+   cycle = (pos/CBS_PER_CYCLE);
+   tmp   = (pos%CBS_PER_CYCLE);
+
+   if (tmp > 2) slot = ((tmp-2)/3);
+
+   return (cycle*PULSE_PER_CYCLE)+slot;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint32_t dmaPwmDataAdr(int pos)
+{
+   //cast twice to suppress compiler warning, I belive this cast is ok
+   //because dmaIbus contains bus addresses, not user addresses. --plugwash
+   return (uint32_t)(uintptr_t) &dmaIBus[pos]->periphData;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint32_t dmaGpioOnAdr(int pos)
+{
+   int page, slot;
+
+   page = pos/ON_PER_IPAGE;
+   slot = pos%ON_PER_IPAGE;
+
+   //cast twice to suppress compiler warning, I belive this cast is ok
+   //because dmaIbus contains bus addresses, not user addresses. --plugwash
+   return (uint32_t)(uintptr_t) &dmaIBus[page]->gpioOn[slot];
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint32_t dmaGpioOffAdr(int pos)
+{
+   int page, slot;
+
+   myOffPageSlot(pos, &page, &slot);
+
+   //cast twice to suppress compiler warning, I belive this cast is ok
+   //because dmaIbus contains bus addresses, not user addresses. --plugwash
+   return (uint32_t)(uintptr_t) &dmaIBus[page]->gpioOff[slot];
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint32_t dmaTickAdr(int pos)
+{
+   int page, slot;
+
+   myTckPageSlot(pos, &page, &slot);
+
+   //cast twice to suppress compiler warning, I belive this cast is ok
+   //because dmaIbus contains bus addresses, not user addresses. --plugwash
+   return (uint32_t)(uintptr_t) &dmaIBus[page]->tick[slot];
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint32_t dmaReadLevelsAdr(int pos)
+{
+   int page, slot;
+
+   myLvsPageSlot(pos, &page, &slot);
+
+   //cast twice to suppress compiler warning, I belive this cast is ok
+   //because dmaIbus contains bus addresses, not user addresses. --plugwash
+   return (uint32_t)(uintptr_t) &dmaIBus[page]->level[slot];
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint32_t dmaCbAdr(int pos)
+{
+   int page, slot;
+
+   page = (pos/CBS_PER_IPAGE);
+   slot = (pos%CBS_PER_IPAGE);
+
+   //cast twice to suppress compiler warning, I belive this cast is ok
+   //because dmaIbus contains bus addresses, not user addresses. --plugwash
+   return (uint32_t)(uintptr_t) &dmaIBus[page]->cb[slot];
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void dmaGpioOnCb(int b, int pos)
+{
+   rawCbs_t * p;
+
+   p = dmaCB2adr(b);
+
+   p->info   = NORMAL_DMA;
+   p->src    = dmaGpioOnAdr(pos);
+   p->dst    = ((GPIO_BASE + (GPSET0*4)) & 0x00ffffff) | PI_PERI_BUS;
+   p->length = 4;
+   p->next   = dmaCbAdr(b+1);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void dmaTickCb(int b, int pos)
+{
+   rawCbs_t * p;
+
+   p = dmaCB2adr(b);
+
+   p->info   = NORMAL_DMA;
+   p->src    = ((SYST_BASE + (SYST_CLO*4)) & 0x00ffffff) | PI_PERI_BUS;
+   p->dst    = dmaTickAdr(pos);
+   p->length = 4;
+   p->next   = dmaCbAdr(b+1);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void dmaGpioOffCb(int b, int pos)
+{
+   rawCbs_t * p;
+
+   p = dmaCB2adr(b);
+
+   p->info   = NORMAL_DMA;
+   p->src    = dmaGpioOffAdr(pos);
+   p->dst    = ((GPIO_BASE + (GPCLR0*4)) & 0x00ffffff) | PI_PERI_BUS;
+   p->length = 4;
+   p->next   = dmaCbAdr(b+1);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void dmaReadLevelsCb(int b, int pos)
+{
+   rawCbs_t * p;
+
+   p = dmaCB2adr(b);
+
+   p->info   = NORMAL_DMA;
+   p->src    = ((GPIO_BASE + (GPLEV0*4)) & 0x00ffffff) | PI_PERI_BUS;
+   p->dst    = dmaReadLevelsAdr(pos);
+   p->length = 4;
+   p->next   = dmaCbAdr(b+1);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void dmaDelayCb(int b)
+{
+   rawCbs_t * p;
+
+   p = dmaCB2adr(b);
+
+   if (gpioCfg.clockPeriph == PI_CLOCK_PCM)
+   {
+      p->info = NORMAL_DMA | TIMED_DMA(2);
+      p->dst  = PCM_TIMER;
+   }
+   else
+   {
+      p->info = NORMAL_DMA | TIMED_DMA(5);
+      p->dst  = PWM_TIMER;
+   }
+
+   p->src    = dmaPwmDataAdr(b%DMAI_PAGES);
+   p->length = 4;
+   p->next   = dmaCbAdr(b+1);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void dmaInitCbs(void)
+{
+   int b, pulse, level, cycle;
+
+   rawCbs_t * p;
+
+   /* set up the DMA control blocks */
+
+   DBG(DBG_STARTUP, "");
+
+   gpioStats.dmaInitCbsCount++;
+
+   b = -1;
+   level = 0;
+
+   for (cycle=0; cycle<bufferCycles; cycle++)
+   {
+      b++; dmaGpioOnCb(b, cycle%SUPERCYCLE); /* gpio on slot */
+
+      b++; dmaTickCb(b, cycle);              /* tick slot */
+
+      for (pulse=0; pulse<PULSE_PER_CYCLE; pulse++)
+      {
+         b++; dmaReadLevelsCb(b, level);               /* read levels slot */
+
+         b++; dmaDelayCb(b);                           /* delay slot */
+
+         b++; dmaGpioOffCb(b, (level%SUPERLEVEL)+1);   /* gpio off slot */
+
+         ++level;
+      }
+   }
+
+   /* point last cb back to first for continuous loop */
+
+   p = dmaCB2adr(b);
+
+   p->next = dmaCbAdr(0);
+
+   DBG(DBG_STARTUP, "DMA page type count = %zd", sizeof(dmaIPage_t));
+
+   DBG(DBG_STARTUP, "%d control blocks (exp=%d)", b+1, NUM_CBS);
+}
+
+/* ======================================================================= */
+
+
+static void sigHandler(int signum)
+{
+   if ((signum >= PI_MIN_SIGNUM) && (signum <= PI_MAX_SIGNUM))
+   {
+      if (gpioSignal[signum].func)
+      {
+         if (gpioSignal[signum].ex)
+         {
+            (gpioSignal[signum].func)(signum, gpioSignal[signum].userdata);
+         }
+         else
+         {
+            (gpioSignal[signum].func)(signum);
+         }
+      }
+      else
+      {
+         switch(signum)
+         {
+            case SIGUSR1:
+
+               if (gpioCfg.dbgLevel > DBG_MIN_LEVEL) --gpioCfg.dbgLevel;
+               else gpioCfg.dbgLevel = DBG_MIN_LEVEL;
+               DBG(DBG_USER, "Debug level %d\n", gpioCfg.dbgLevel);
+               break;
+
+            case SIGUSR2:
+               if (gpioCfg.dbgLevel < DBG_MAX_LEVEL) ++gpioCfg.dbgLevel;
+               else gpioCfg.dbgLevel = DBG_MAX_LEVEL;
+               DBG(DBG_USER, "Debug level %d\n", gpioCfg.dbgLevel);
+               break;
+
+            case SIGPIPE:
+            case SIGWINCH:
+               DBG(DBG_USER, "signal %d ignored", signum);
+               break;
+
+            case SIGCHLD:
+               /* Used to notify threads of events */
+               break;
+
+            default:
+               DBG(DBG_ALWAYS, "Unhandled signal %d, terminating\n", signum);
+               gpioTerminate();
+               exit(-1);
+         }
+      }
+   }
+   else
+   {
+      /* exit */
+
+      DBG(DBG_ALWAYS, "Unhandled signal %d, terminating\n", signum);
+      gpioTerminate();
+      exit(-1);
+   }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void sigSetHandler(void)
+{
+   int i;
+   struct sigaction new;
+
+   for (i=PI_MIN_SIGNUM; i<=PI_MAX_SIGNUM; i++)
+   {
+
+      memset(&new, 0, sizeof(new));
+      new.sa_handler = sigHandler;
+
+      sigaction(i, &new, NULL);
+   }
+}
+
+/*
+   freq mics  net
+ 0 1000 1000  900
+ 1 4000  250  225
+ 2 3750  266  240
+ 3 3500  285  257
+ 4 3250  307  276
+ 5 3000  333  300
+ 6 2750  363  327
+ 7 2500  400  360
+ 8 2250  444  400
+ 9 2000  500  450
+10 1750  571  514
+11 1500  666  600
+12 1250  800  720
+13 1000 1000  900
+14 750  1333 1200
+15 500  2000 1800
+*/
+
+unsigned alert_delays[]=
+{
+   900000, 225000, 240000, 257142, 276923, 300000,  327272,  360000,
+   400000, 450000, 514285, 600000, 720000, 900000, 1200000, 1800000
+};
+
+/* ======================================================================= */
+
+static void alertGlitchFilter(gpioSample_t *sample, int numSamples)
+{
+   int i, j, diff;
+   uint32_t steadyUs, changedTick, RBitV, LBitV, initialised;
+   uint32_t bit, bitV;
+
+   for (i=0; i<=PI_MAX_USER_GPIO; i++)
+   {
+      bit = (1<<i);
+
+      if (monitorBits & bit & gFilterBits)
+      {
+         initialised = gpioAlert[i].gfInitialised;
+         if (!initialised && numSamples > 0)
+         {
+           /* Initialise filter with first sample */
+           bitV = sample[0].level & bit;
+           gpioAlert[i].gfRBitV = bitV;
+           gpioAlert[i].gfLBitV = bitV;
+           gpioAlert[i].gfTick = sample[0].tick;
+           gpioAlert[i].gfInitialised = 1;
+         }
+
+         steadyUs    = gpioAlert[i].gfSteadyUs;
+         RBitV       = gpioAlert[i].gfRBitV;
+         LBitV       = gpioAlert[i].gfLBitV;
+         changedTick = gpioAlert[i].gfTick;
+
+         for (j=0; j<numSamples; j++)
+         {
+            bitV = sample[j].level & bit;
+
+            if (bitV != LBitV)
+            {
+               /* Difference between level and last level.
+                  Restart steady timer. */
+
+               changedTick = sample[j].tick;
+               LBitV = bitV;
+            }
+
+            if (bitV != RBitV)
+            {
+               /* Difference between level and reported level. */
+
+               diff = sample[j].tick - changedTick;
+
+               if (diff >= steadyUs)
+               {
+                  /* Level stable for steady period. */
+                  RBitV = bitV;
+               }
+               else
+               {
+                  /* Keep reporting old level. */
+
+                  sample[j].level ^= bit;
+               }
+            }
+
+         }
+
+         gpioAlert[i].gfRBitV = RBitV;
+         gpioAlert[i].gfLBitV = LBitV;
+         gpioAlert[i].gfTick  = changedTick;
+      }
+   }
+}
+
+static void alertNoiseFilter(gpioSample_t *sample, int numSamples)
+{
+   int i, j, diff;
+   uint32_t LBitV;
+   uint32_t bit, bitV;
+   uint32_t nowTick;
+
+   for (i=0; i<=PI_MAX_USER_GPIO; i++)
+   {
+      bit = (1<<i);
+
+      if (monitorBits & bit & nFilterBits)
+      {
+         LBitV = gpioAlert[i].nfLBitV;
+
+         for (j=0; j<numSamples; j++)
+         {
+            bitV = sample[j].level & bit;
+            nowTick = sample[j].tick;
+
+            if (gpioAlert[i].nfActive) /* reporting events */
+            {
+               diff = nowTick - gpioAlert[i].nfTick2;
+
+               if (diff >= 0)
+               {
+                  /* Stop reporting gpio changes */
+
+                  gpioAlert[i].nfActive = 0;
+                  gpioAlert[i].nfTick1 = nowTick;
+               }
+            }
+            else /* waiting for steady us */
+            {
+               if (bitV != LBitV)
+               {
+                  diff = nowTick - gpioAlert[i].nfTick1;
+                  gpioAlert[i].nfTick1 = nowTick;
+
+                  if (diff >= gpioAlert[i].nfSteadyUs)
+                  {
+                     /* Start reporting gpio changes */
+
+                     gpioAlert[i].nfRBitV = LBitV;
+                     gpioAlert[i].nfActive = 1;
+                     gpioAlert[i].nfTick2 =
+                        nowTick + gpioAlert[i].nfActiveUs;
+                  }
+               }
+            }
+
+            if (!gpioAlert[i].nfActive)
+            {
+               if (bitV != gpioAlert[i].nfRBitV)
+                  sample[j].level ^= bit;
+            }
+
+            LBitV = bitV;
+         }
+
+         gpioAlert[i].nfLBitV = LBitV;
+
+      }
+   }
+}
+
+static int alertSerialReports(
+   wfRx_t *w, int gpio, gpioReport_t *report, int seqno, uint32_t eTick)
+{
+   /* moves serial data from the GPIO's buffer into reports */
+
+   int r, rpos, wpos, bytes;
+
+   r = 0;
+
+   wfRx_lock(gpio);
+
+   /* the GPIO may have been closed since serialRxBits was read */
+
+   if (w->mode == PI_WFRX_SERIAL) for (r=0; r<SRX_NTFY_REPORTS; r++)
+   {
+      rpos = w->s.readPos;
+      wpos = w->s.writePos;
+
+      if (rpos == wpos) break;
+
+      if (wpos > rpos) bytes = wpos - rpos;
+      else             bytes = w->s.bufSize - rpos;
+
+      if (bytes > 4) bytes = 4;
+
+      report[r].seqno = seqno + r;
+      report[r].flags =
+         PI_NTFY_FLAGS_SER | PI_NTFY_FLAGS_LEN(bytes) | PI_NTFY_FLAGS_BIT(gpio);
+      report[r].tick  = eTick;
+      report[r].level = 0;
+
+      memcpy(&report[r].level, w->s.buf + rpos, bytes);
+
+      w->s.readPos = (rpos + bytes) % w->s.bufSize;
+   }
+
+   wfRx_unlock(gpio);
+
+   return r;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int alertAcqReports(
+   acqInfo_t *a, int id, gpioReport_t *report, int seqno)
+{
+   /* moves whole samples from the acquisition's ring into reports */
+
+   char *rec;
+   int r, i, per, bytes;
+   uint32_t tick;
+
+   r = 0;
+
+   pthread_mutex_lock(&acqMutex);
+
+   if (a->state == ACQ_RUNNING)
+   {
+      per = (a->len + 3) / 4;
+
+      while (a->count && ((r + per) <= ACQ_NTFY_REPORTS))
+      {
+         rec = a->ring + (a->readPos * (4 + a->len));
+
+         memcpy(&tick, rec, 4);
+
+         for (i=0; i<a->len; i+=4)
+         {
+            bytes = a->len - i;
+            if (bytes > 4) bytes = 4;
+
+            report[r].seqno = seqno + r;
+            report[r].flags =
+               PI_NTFY_FLAGS_ACQ | PI_NTFY_FLAGS_LEN(bytes) |
+               PI_NTFY_FLAGS_BIT(id);
+            report[r].tick  = tick;
+            report[r].level = 0;
+
+            memcpy(&report[r].level, rec + 4 + i, bytes);
+
+            if ((i + 4) >= a->len) report[r].flags |= PI_NTFY_FLAGS_END;
+
+            r++;
+         }
+
+         a->readPos = (a->readPos + 1) % PI_ACQ_SAMPLES;
+         a->count--;
+      }
+   }
+
+   pthread_mutex_unlock(&acqMutex);
+
+   return r;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void alertEmit(
+   gpioSample_t *sample, int numSamples, uint32_t changedBits, uint32_t eTick)
+{
+   uint32_t oldLevel, newLevel;
+   int32_t diff;
+   int emit, seqno, emitted;
+   uint32_t changes, bits, timeoutBits, eventBits;
+   int d;
+   int b, n, v;
+   int err;
+   int max_emits, reps;
+   char fifo[32];
+   /* ensure space for maximum number of watchdog, event, serial, and
+      acquisition notifications */
+   gpioReport_t report[MAX_REPORT+PI_MAX_USER_GPIO+1+PI_MAX_EVENT+1+
+                       ((PI_MAX_USER_GPIO+1)*SRX_NTFY_REPORTS)+
+                       (PI_ACQ_SLOTS*ACQ_NTFY_REPORTS)];
+
+   if (changedBits)
+   {
+      if (gpioGetSamples.func)
+      {
+         if (gpioGetSamples.ex)
+         {
+            (gpioGetSamples.func)
+               (sample, numSamples, gpioGetSamples.userdata);
+         }
+         else
+         {
+            (gpioGetSamples.func)(sample, numSamples);
+         }
+      }
+   }
+
+   eventBits = 0;
+
+   if (bscFR != (bscsReg[BSC_FR]&0xffff))
+   {
+      bscFR = bscsReg[BSC_FR]&0xffff;
+      eventAlert[PI_EVENT_BSC].fired = 1;
+   }
+
+   for (b=0; b<=PI_MAX_EVENT; b++)
+   {
+      if (eventAlert[b].fired && (!eventAlert[b].ignore))
+      {
+         eventBits |= (1<<b);
+
+         if (eventAlert[b].func)
+         {
+            if (eventAlert[b].ex)
+            {
+               (eventAlert[b].func)(b, eTick, eventAlert[b].userdata);
+            }
+            else
+            {
+               (eventAlert[b].func)(b, eTick);
+            }
+         }
+      }
+
+      eventAlert[b].fired = 0;
+   }
+
+   waveRxSerialSamples(sample, numSamples, eTick);
+
+   /* call alert callbacks for each bit transition */
+
+   if (changedBits & alertBits)
+   {
+      oldLevel = (reportedLevel & alertBits);
+
+      for (d=0; d<numSamples; d++)
+      {
+         newLevel = (sample[d].level & alertBits);
+
+         if (newLevel != oldLevel)
+         {
+            changes = (newLevel ^ oldLevel);
+
+            for (b=0; b<=PI_MAX_USER_GPIO; b++)
+            {
+               if (changes & (1<<b))
+               {
+                  if (newLevel & (1<<b)) v = 1; else v = 0;
+
+                  if (gpioAlert[b].func)
+                  {
+                     if (gpioAlert[b].ex)
+                     {
+                        (gpioAlert[b].func)
+                           (b, v, sample[d].tick,
+                            gpioAlert[b].userdata);
+                     }
+                     else
+                     {
+                        (gpioAlert[b].func)(b, v, sample[d].tick);
+                     }
+                  }
+               }
+            }
+            oldLevel = newLevel;
+         }
+      }
+   }
+
+   /* check for watchdog timeouts */
+
+   timeoutBits = 0;
+
+   if (wdogBits)
+   {
+      for (b=0; b<=PI_MAX_USER_GPIO; b++)
+      {
+         if (gpioAlert[b].wdSteadyUs)
+         {
+            diff = eTick - gpioAlert[b].wdTick;
+
+            if (diff >= gpioAlert[b].wdSteadyUs)
+            {
+               timeoutBits |= (1<<b);
+
+               gpioAlert[b].wdTick = eTick;
+
+               if (gpioAlert[b].func)
+               {
+                  if (gpioAlert[b].ex)
+                  {
+                     (gpioAlert[b].func)(b, PI_TIMEOUT, eTick,
+                                            gpioAlert[b].userdata);
+                  }
+                  else
+                  {
+                     (gpioAlert[b].func)(b, PI_TIMEOUT, eTick);
+                  }
+               }
+            }
+         }
+      }
+   }
+
+   for (n=0; n<PI_NOTIFY_SLOTS; n++)
+   {
+      if (gpioNotify[n].state == PI_NOTIFY_CLOSING)
+      {
+         if (gpioNotify[n].pipe)
+         {
+            DBG(DBG_INTERNAL, "close notify pipe %d", gpioNotify[n].fd);
+            close(gpioNotify[n].fd);
+
+            sprintf(fifo, "/dev/pigpio%d", n);
+
+            unlink(fifo);
+         }
+
+         gpioNotify[n].state = PI_NOTIFY_CLOSED;
+      }
+      else if (gpioNotify[n].state >= PI_NOTIFY_OPENED)
+      {
+         bits = gpioNotify[n].bits;
+
+         emit = 0;
+
+         seqno = gpioNotify[n].seqno;
+
+         if (gpioNotify[n].state == PI_NOTIFY_RUNNING)
+         {
+            /* check to see if any bits have changed for this
+               notification.
+
+               bits         is the set of notification bits
+               changedBits is the set of changed bits
+            */
+
+            if (changedBits & bits)
+            {
+               oldLevel = reportedLevel & bits;
+
+               for (d=0; d<numSamples; d++)
+               {
+                  newLevel = sample[d].level & bits;
+
+                  if (newLevel != oldLevel)
+                  {
+                     report[emit].seqno = seqno;
+                     report[emit].flags = 0;
+                     report[emit].tick  = sample[d].tick;
+                     report[emit].level = sample[d].level;
+
+                     oldLevel = newLevel;
+
+                     emit++;
+                     seqno++;
+                  }
+               }
+            }
+
+            /* check to see if any watchdogs are due for this
+               notification.
+
+               bits        is the set of notification bits
+               timeoutBits is the set of timed out bits
+            */
+
+            bits = gpioNotify[n].bits;
+
+            if (timeoutBits & bits)
+            {
+               /* at least one watchdog has fired for this
+                  notification.
+               */
+
+               for (b=0; b<=PI_MAX_USER_GPIO; b++)
+               {
+                  if (timeoutBits & bits & (1<<b))
+                  {
+                     if (numSamples)
+                        newLevel = sample[numSamples-1].level;
+                     else
+                        newLevel = reportedLevel;
+
+                     report[emit].seqno = seqno;
+                     report[emit].flags =
+                        PI_NTFY_FLAGS_WDOG | PI_NTFY_FLAGS_BIT(b);
+                     report[emit].tick  = eTick;
+                     report[emit].level = newLevel;
+
+                     emit++;
                      seqno++;
                   }
                }
             }
+         }
+
+         /* check to see if any events are due
+
+            eventBits is the set of events
+         */
+
+         if (eventBits & gpioNotify[n].eventBits)
+         {
+            for (b=0; b<=PI_MAX_EVENT; b++)
+            {
+               if (eventBits & gpioNotify[n].eventBits & (1<<b))
+               {
+                  if (numSamples)
+                     newLevel = sample[numSamples-1].level;
+                  else
+                     newLevel = reportedLevel;
+
+                  report[emit].seqno = seqno;
+                  report[emit].flags = 
+                     PI_NTFY_FLAGS_EVENT | PI_NTFY_FLAGS_BIT(b);
+                  report[emit].tick  = eTick;
+                  report[emit].level = newLevel;
+
+                  emit++;
+                  seqno++;
+               }
+            }
+         }
+
+         /* stream bit bang serial data, up to 4 bytes a report */
+
+         if (serialRxBits & gpioNotify[n].serialBits)
+         {
+            for (b=0; b<=PI_MAX_USER_GPIO; b++)
+            {
+               if (serialRxBits & gpioNotify[n].serialBits & (1<<b))
+               {
+                  reps = alertSerialReports(
+                     &wfRx[b], b, report+emit, seqno, eTick);
+
+                  emit  += reps;
+                  seqno += reps;
+               }
+            }
+         }
+
+         /* stream sensor samples, whole samples only */
+
+         if (gpioNotify[n].acqBits)
+         {
+            for (b=0; b<PI_ACQ_SLOTS; b++)
+            {
+               if (gpioNotify[n].acqBits & (1<<b))
+               {
+                  reps = alertAcqReports(&acqInfo[b], b, report+emit, seqno);
+
+                  emit  += reps;
+                  seqno += reps;
+               }
+            }
+         }
+
+         if (!emit)
+         {
+            if ((int)(eTick - gpioNotify[n].lastReportTick) > 60000000)
+            {
+               if (numSamples)
+                  newLevel = sample[numSamples-1].level;
+               else
+                  newLevel = reportedLevel;
+
+               report[emit].seqno = seqno;
+               report[emit].flags = PI_NTFY_FLAGS_ALIVE;
+               report[emit].tick  = eTick;
+               report[emit].level = newLevel;
+
+               emit++;
+               seqno++;
+            }
+         }
+
+         if (emit)
+         {
+            DBG(DBG_FAST_TICK, "notification %d (%d reports, %x-%x)",
+               n, emit, report[0].seqno,  report[emit-1].seqno);
+            gpioNotify[n].lastReportTick = eTick;
+            max_emits = gpioNotify[n].max_emits;
+
+            if (emit > gpioStats.maxEmit) gpioStats.maxEmit = emit;
+
+            emitted = 0;
+
+            while (emit > 0)
+            {
+               if (emit > max_emits)
+               {
+                  gpioStats.emitFrags++;
+
+                  err = write(gpioNotify[n].fd,
+                           report+emitted,
+                           max_emits*sizeof(gpioReport_t));
+
+                  if (err != (max_emits*sizeof(gpioReport_t)))
+                  {
+                     if (err < 0)
+                     {
+                        if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+                        {
+                           /* serious error, no point continuing */
+
+                           DBG(DBG_ALWAYS, "fd=%d err=%d errno=%d",
+                              gpioNotify[n].fd, err, errno);
+
+                           DBG(DBG_ALWAYS, "%s", strerror(errno));
+
+                           gpioNotify[n].bits  = 0;
+                           gpioNotify[n].state = PI_NOTIFY_CLOSING;
+                           intNotifyBits();
+                           break;
+                        }
+                        else gpioStats.wouldBlockPipeWrite++;
+                     }
+                     else
+                     {
+                        gpioStats.shortPipeWrite++;
+                        DBG(DBG_ALWAYS, "emitted %zd, asked for %d",
+                           err/sizeof(gpioReport_t), max_emits);
+                     }
+                  }
+                  else
+                  {
+                     gpioStats.goodPipeWrite++;
+                  }
+
+                  emitted += max_emits;
+                  emit    -= max_emits;
+               }
+               else
+               {
+                  err = write(gpioNotify[n].fd,
+                           report+emitted,
+                           emit*sizeof(gpioReport_t));
+
+                  if (err != (emit*sizeof(gpioReport_t)))
+                  {
+                     if (err < 0)
+                     {
+                        if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+                        {
+                           DBG(DBG_ALWAYS, "fd=%d err=%d errno=%d",
+                              gpioNotify[n].fd, err, errno);
+
+                           DBG(DBG_ALWAYS, "%s", strerror(errno));
+
+                           /* serious error, no point continuing */
+                           gpioNotify[n].bits  = 0;
+                           gpioNotify[n].state = PI_NOTIFY_CLOSING;
+                           intNotifyBits();
+                           break;
+                        }
+                        else gpioStats.wouldBlockPipeWrite++;
+                     }
+                     else
+                     {
+                        gpioStats.shortPipeWrite++;
+                        DBG(DBG_ALWAYS, "emitted %zd, asked for %d",
+                           err/sizeof(gpioReport_t), emit);
+                     }
+                  }
+                  else
+                  {
+                     gpioStats.goodPipeWrite++;
+                  }
+
+                  emitted += emit;
+                  emit = 0;
+               }
+            }
+
+            gpioNotify[n].seqno = seqno;
+         }
+      }
+   }
+
+   if (changedBits & scriptBits)
+   {
+      for (n=0; n<PI_MAX_SCRIPTS; n++)
+      {
+         if ((gpioScript[n].state     == PI_SCRIPT_IN_USE)  &&
+             (gpioScript[n].run_state == PI_SCRIPT_WAITING) &&
+             (gpioScript[n].waitBits & changedBits))
+         {
+            pthread_mutex_lock(&gpioScript[n].pthMutex);
+
+            if (gpioScript[n].run_state == PI_SCRIPT_WAITING)
+            {
+               gpioScript[n].changedBits =
+                  gpioScript[n].waitBits & changedBits;
+               pthread_cond_signal(&gpioScript[n].pthCond);
+            }
+
+            pthread_mutex_unlock(&gpioScript[n].pthMutex);
+         }
+      }
+   }
+
+   if (eventBits & scriptEventBits)
+   {
+      for (n=0; n<PI_MAX_SCRIPTS; n++)
+      {
+         if ((gpioScript[n].state     == PI_SCRIPT_IN_USE)  &&
+             (gpioScript[n].run_state == PI_SCRIPT_WAITING) &&
+             (gpioScript[n].eventBits & eventBits))
+         {
+            pthread_mutex_lock(&gpioScript[n].pthMutex);
+
+            if (gpioScript[n].run_state == PI_SCRIPT_WAITING)
+            {
+               gpioScript[n].changedBits =
+                  gpioScript[n].eventBits & eventBits;
+               pthread_cond_signal(&gpioScript[n].pthCond);
+            }
+
+            pthread_mutex_unlock(&gpioScript[n].pthMutex);
+         }
+      }
+   }
+
+   if (numSamples) reportedLevel = sample[numSamples-1].level;
+}
+
+static void alertWdogCheck(gpioSample_t *sample, int numSamples)
+{
+   /*
+   Go through and set the last time each GPIO with a watchdog changed state.
+   */
+
+   int i, j;
+   uint32_t LBitV;
+   uint32_t bit;
+
+   for (i=0; i<=PI_MAX_USER_GPIO; i++)
+   {
+      bit = (1<<i);
+
+      if (monitorBits & bit & wdogBits)
+      {
+         LBitV = gpioAlert[i].wdLBitV;
+
+         for (j=0; j<numSamples; j++)
+         {
+            if ((sample[j].level & bit) != LBitV)
+            {
+               LBitV = sample[j].level & bit;
+               gpioAlert[i].wdTick = sample[j].tick;
+            }
+         }
+
+         gpioAlert[i].wdLBitV = LBitV;
+      }
+   }
+}
+
+static void * pthAlertThread(void *x)
+{
+   struct timespec req, rem;
+   uint32_t oldLevel, newLevel, level;
+   uint32_t oldSlot,  newSlot;
+   uint32_t expected, ft, sTick;
+   uint32_t changedBits;
+   int32_t diff, minDiff, stickInited;
+   int cycle, pulse;
+   int numSamples, ticks, i;
+   int rp, reports, totalSamples;
+   int stopped;
+   int moreToDo;
+   gpioSample_t sample[MAX_SAMPLE];
+
+   req.tv_sec = 0;
+
+   /* don't start until DMA started */
+
+   spinWhileStarting();
+
+   reportedLevel = gpioReg[GPLEV0];
+
+   oldLevel = reportedLevel;
+
+   oldSlot = dmaCurrentSlot(dmaNowAtICB());
+
+   oldSlot = (oldSlot / PULSE_PER_CYCLE) * PULSE_PER_CYCLE;
+
+   cycle = (oldSlot/PULSE_PER_CYCLE);
+
+   pulse = 0;
+
+   stopped = 0;
+
+   moreToDo = 0;
+
+   stickInited = 0;
+
+   sTick = 0;
+
+   minDiff = gpioCfg.clockMicros / 2;
+
+   while (1)
+   {
+      /* Check that DMA is running okay */
+
+      if (dmaIn[DMA_CONBLK_AD])
+      {
+         if (stopped)
+         {
+            DBG(DBG_STARTUP, "****** GOING ******");
+            stopped = 0;
+         }
+      }
+      else
+      {
+         stopped = 1;
+
+         myGpioDelay(5000);
+
+         if (runState == PI_RUNNING)
+         {
+            /* should never be executed, leave code just in case */
+
+            gpioCfg.internals |= PI_CFG_STATS;
+
+            dmaInitCbs();
+            flushMemory();
+            //cast twice to suppress compiler warning, I belive this cast is ok
+            //because dmaIbus contains bus addresses, not user addresses. --plugwash
+            initDMAgo((uint32_t *)dmaIn, (uint32_t)(uintptr_t)dmaIBus[0]);
+            myGpioDelay(5000); /* let DMA run for a while */
+            oldSlot = dmaCurrentSlot(dmaNowAtICB());
+            gpioStats.DMARestarts++;
+         }
+      }
+
+      newSlot = dmaCurrentSlot(dmaNowAtICB());
+
+      newSlot = (newSlot / PULSE_PER_CYCLE) * PULSE_PER_CYCLE;
+
+      numSamples = 0;
+
+      /*
+      Extract samples from DMA ring buffer.
+      */
+
+      while ((oldSlot != newSlot) && (numSamples < MAX_SAMPLE))
+      {
+         level = myGetLevel(oldSlot++);
+
+         sample[numSamples].tick  = sTick;
+         sample[numSamples].level = level;
+
+         numSamples++;
+
+         sTick += gpioCfg.clockMicros;
+
+         if (++pulse >= PULSE_PER_CYCLE)
+         {
+            pulse = 0;
+
+            if (++cycle >= bufferCycles)
+            {
+               cycle = 0;
+               oldSlot = 0;
+            }
+
+            expected = sTick;
+
+            sTick = myGetTick(cycle);
+
+            if (stickInited)
+            {
+               diff = sTick - expected;
+
+               if (abs(diff) > minDiff)
+               {
+                  ft = sample[numSamples-PULSE_PER_CYCLE].tick;
+
+                  ticks = sTick - ft;
+
+                  for (i=1; i<PULSE_PER_CYCLE; i++)
+                  {
+                     sample[numSamples-PULSE_PER_CYCLE+i].tick =
+                        ((i*ticks)/PULSE_PER_CYCLE) + ft;
+                  }
+               }
+
+               diff += (TICKSLOTS/2);
+
+               if (diff < 0)
+               {
+                  gpioStats.diffTick[0]++;
+               }
+
+               else if (diff >= TICKSLOTS)
+               {
+                  gpioStats.diffTick[TICKSLOTS-1]++;
+               }
+
+               else gpioStats.diffTick[diff]++;
+            }
+            else
+            {
+               stickInited = 1;
+               numSamples = 0;
+               if (!(gpioCfg.ifFlags & PI_DISABLE_ALERT))
+               {
+                  pthAlertRunning = PI_THREAD_RUNNING;
+               }
+            }
+         }
+      }
+
+      if (oldSlot == newSlot) moreToDo = 0; else moreToDo = 1;
+
+      /* Apply glitch filter */
+
+      if (numSamples && gFilterBits) alertGlitchFilter(sample, numSamples);
+
+      /* Apply noise filter */
+
+      if (numSamples && nFilterBits) alertNoiseFilter(sample, numSamples);
+
+      /* Compact samples */
+
+      changedBits = 0;
+      oldLevel &= monitorBits;
+      reports = 0;
+      totalSamples = 0;
+
+      for (rp=0; rp<numSamples; rp++)
+      {
+         newLevel = (sample[rp].level & monitorBits);
+
+         if (newLevel != oldLevel)
+         {
+            sample[reports].tick  = sample[rp].tick;
+            sample[reports].level = sample[rp].level;
+            changedBits |= (newLevel ^ oldLevel);
+            oldLevel = newLevel;
+
+            reports++;
+
+            if (reports >= MAX_REPORT)
+            {
+               totalSamples += reports;
+
+               /* Rebase watchdog timeouts */
+               if (wdogBits) alertWdogCheck(sample, reports);
+
+               gpioStats.numSamples += reports;
+
+               alertEmit(sample, reports, changedBits, sample[rp].tick);
+
+               changedBits = 0;
+               reports = 0;
+            }
+         }
+      }
+
+      if (reports)
+      {
+         totalSamples += reports;
+
+         /* Rebase watchdog timeouts */
+         if (wdogBits) alertWdogCheck(sample, reports);
+
+         gpioStats.numSamples += reports;
+      }
+
+      alertEmit(sample, reports, changedBits, sTick);
+      reportedLevel = sample[numSamples -1].level;
+
+      if (totalSamples > gpioStats.maxSamples)
+         gpioStats.maxSamples = numSamples;
+
+      req.tv_sec = 0;
+      req.tv_nsec = alert_delays[(gpioCfg.internals>>PI_CFG_ALERT_FREQ)&15];
+
+      if (moreToDo)
+      {
+         gpioStats.moreToDo++;
+      }
+      else
+      {
+         gpioStats.alertTicks++;
+
+         while (nanosleep(&req, &rem))
+         {
+            req.tv_sec  = rem.tv_sec;
+            req.tv_nsec = rem.tv_nsec;
+         }
+      }
+   }
+
+   return 0;
+}
+
+/* ======================================================================= */
+
+static int scrPop(gpioScript_t *s, int *SP, int *S)
+{
+   if ((*SP) > 0)
+   {
+      return S[--(*SP)];
+   }
+   else
+   {
+      s->run_state = PI_SCRIPT_FAILED;
+      DBG(DBG_ALWAYS, "script %d too many pops", s->id);
+      return 0;
+   }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void scrPush(gpioScript_t *s, int *SP, int *S, int val)
+{
+   if ((*SP) < PI_SCRIPT_STACK_SIZE)
+   {
+      S[(*SP)++] = val;
+   }
+   else
+   {
+      s->run_state = PI_SCRIPT_FAILED;
+      DBG(DBG_ALWAYS, "script %d too many pushes", s->id);
+   }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void scrSwap(int *v1, int *v2)
+{
+   int t;
+
+   t=*v1; *v1=*v2; *v2= t;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int scrEvtWait(gpioScript_t *s, uint32_t bits)
+{
+   pthread_mutex_lock(&s->pthMutex);
+
+   if (s->request == PI_SCRIPT_RUN)
+   {
+      s->run_state = PI_SCRIPT_WAITING;
+      s->eventBits = bits;
+      intScriptEventBits();
+
+      pthread_cond_wait(&s->pthCond, &s->pthMutex);
+
+      s->waitBits = 0;
+      intScriptEventBits();
+      s->run_state = PI_SCRIPT_RUNNING;
+   }
+
+   pthread_mutex_unlock(&s->pthMutex);
+
+   return s->changedBits;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int scrWait(gpioScript_t *s, uint32_t bits)
+{
+   pthread_mutex_lock(&s->pthMutex);
+
+   if (s->request == PI_SCRIPT_RUN)
+   {
+      s->run_state = PI_SCRIPT_WAITING;
+      s->waitBits = bits;
+      intScriptBits();
+
+      pthread_cond_wait(&s->pthCond, &s->pthMutex);
+
+      s->waitBits = 0;
+      intScriptBits();
+      s->run_state = PI_SCRIPT_RUNNING;
+   }
+
+   pthread_mutex_unlock(&s->pthMutex);
+
+   return s->changedBits;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int scrSys(char *cmd, uint32_t p1, uint32_t p2)
+{
+   char buf[1024];
+   int status;
+
+   if (!myScriptNameValid(cmd))
+      SOFT_ERROR(PI_BAD_SCRIPT_NAME, "bad script name (%s)", cmd);
+
+   snprintf(buf, sizeof(buf), "/opt/pigpio/cgi/%s %u %u", cmd, p1, p2);
+
+   DBG(DBG_USER, "%s", buf);
+
+   status = system(buf);
+
+   if (status < 0) status = PI_BAD_SHELL_STATUS;
+
+   return status;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int scrJcc(int cond, int F)
+{
+   switch (cond)
+   {
+      case CMD_OP_JZ:  return (!F);
+      case CMD_OP_JNZ: return (F != 0);
+      case CMD_OP_JM:  return (F < 0);
+      default:         return (F >= 0);
+   }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void *pthScript(void *x)
+{
+   /*
+      Threaded-code interpreter.  Each instruction was decoded by
+      cmdParseScript into a cmdCode_t and is dispatched through a
+      table of label addresses, so the hot path has no switch, no
+      per-instruction copy of the command, and no operand type tests.
+   */
+
+   static void *dispatch[CMD_OPS] =
+   {
+      [CMD_OP_CMD]   = &&op_cmd,
+      [CMD_OP_WRITE] = &&op_write,
+      [CMD_OP_READ]  = &&op_read,
+      [CMD_OP_MICS]  = &&op_mics,
+      [CMD_OP_MILS]  = &&op_mils,
+      [CMD_OP_BR1]   = &&op_br1,
+      [CMD_OP_BS1]   = &&op_bs1,
+      [CMD_OP_BC1]   = &&op_bc1,
+      [CMD_OP_TICK]  = &&op_tick,
+      [CMD_OP_ADD]   = &&op_add,
+      [CMD_OP_AND]   = &&op_and,
+      [CMD_OP_CALL]  = &&op_call,
+      [CMD_OP_CMP]   = &&op_cmp,
+      [CMD_OP_DCR]   = &&op_dcr,
+      [CMD_OP_DCRA]  = &&op_dcra,
+      [CMD_OP_DIV]   = &&op_div,
+      [CMD_OP_EVTWT] = &&op_evtwt,
+      [CMD_OP_HALT]  = &&op_halt,
+      [CMD_OP_INR]   = &&op_inr,
+      [CMD_OP_INRA]  = &&op_inra,
+      [CMD_OP_JM]    = &&op_jm,
+      [CMD_OP_JMP]   = &&op_jmp,
+      [CMD_OP_JNZ]   = &&op_jnz,
+      [CMD_OP_JP]    = &&op_jp,
+      [CMD_OP_JZ]    = &&op_jz,
+      [CMD_OP_LD]    = &&op_ld,
+      [CMD_OP_LDA]   = &&op_lda,
+      [CMD_OP_LDAB]  = &&op_ldab,
+      [CMD_OP_MLT]   = &&op_mlt,
+      [CMD_OP_MOD]   = &&op_mod,
+      [CMD_OP_NOP]   = &&op_nop,
+      [CMD_OP_OR]    = &&op_or,
+      [CMD_OP_POP]   = &&op_pop,
+      [CMD_OP_POPA]  = &&op_popa,
+      [CMD_OP_PUSH]  = &&op_push,
+      [CMD_OP_PUSHA] = &&op_pusha,
+      [CMD_OP_RET]   = &&op_ret,
+      [CMD_OP_RL]    = &&op_rl,
+      [CMD_OP_RLA]   = &&op_rla,
+      [CMD_OP_RR]    = &&op_rr,
+      [CMD_OP_RRA]   = &&op_rra,
+      [CMD_OP_STA]   = &&op_sta,
+      [CMD_OP_STAB]  = &&op_stab,
+      [CMD_OP_SUB]   = &&op_sub,
+      [CMD_OP_SYS]   = &&op_sys,
+      [CMD_OP_WAIT]  = &&op_wait,
+      [CMD_OP_X]     = &&op_x,
+      [CMD_OP_XA]    = &&op_xa,
+      [CMD_OP_XOR]   = &&op_xor,
+      [CMD_OP_WMW]   = &&op_wmw,
+      [CMD_OP_RJ]    = &&op_rj,
+      [CMD_OP_CMPJ]  = &&op_cmpj,
+      [CMD_OP_DCRJ]  = &&op_dcrj,
+      [CMD_OP_INRJ]  = &&op_inrj,
+      [CMD_OP_LAS]   = &&op_las,
+      [CMD_OP_STAL]  = &&op_stal,
+      [CMD_OP_LDAL]  = &&op_ldal,
+   };
+
+   /* used instead of dispatch when profiling */
+
+   static void *profiling[CMD_OPS] = {[0 ... CMD_OPS-1] = &&op_prof};
+
+   void **table;
+   gpioScriptProf_t *P;
+   int op, blockPC;
+   uint32_t blockTick;
+   gpioScript_t *s;
+   cmdInstr_t *instr;
+   cmdCode_t *c;
+   uintptr_t v1, v2, v3, v4, v5, p[5];
+   int p1, p3o, *R;
+   int PC, A, F, SP;
+   int S[PI_SCRIPT_STACK_SIZE];
+   char buf[CMD_MAX_EXTENSION];
+
+/* the value of operand n of instruction c */
+
+#define SCR_VAL(c, n) ((c)->k##n ? (uintptr_t)R[(c)->p##n] : (c)->p##n)
+
+/* fetch the next instruction, resolve its operands, and jump to it */
+
+#define SCR_NEXT                                                  \
+   if (((unsigned)PC >= (unsigned)s->script.instrs)            || \
+       ((volatile int)s->request != PI_SCRIPT_RUN)             || \
+       (s->run_state != PI_SCRIPT_RUNNING)) goto halt;            \
+   c  = &s->script.code[PC];                                      \
+   v1 = SCR_VAL(c, 1);                                            \
+   v2 = SCR_VAL(c, 2);                                            \
+   p1 = v1;                                                       \
+   goto *table[c->op]
+
+   S[0] = 0; /* to prevent compiler warning */
+
+   s = x;
+
+   while ((volatile int)s->request != PI_SCRIPT_DELETE)
+   {
+      pthread_mutex_lock(&s->pthMutex);
+      s->run_state = PI_SCRIPT_HALTED;
+      pthread_cond_wait(&s->pthCond, &s->pthMutex);
+      pthread_mutex_unlock(&s->pthMutex);
+
+      s->run_state = PI_SCRIPT_RUNNING;
+
+      /* par[] and var[] are contiguous */
+
+      R = s->script.par;
+
+      P = s->profile ? s->prof : NULL;
+      table = P ? profiling : dispatch;
+      blockPC = -1;
+      blockTick = 0;
+
+      A  = 0;
+      F  = 0;
+      PC = 0;
+      SP = 0;
+
+      SCR_NEXT;
+
+      /* commands, the common ones called directly */
+
+      op_write:
+         if (!myPermit(v1)) goto op_cmd;
+         A = gpioWrite(v1, v2); F = A; PC++; SCR_NEXT;
+
+      op_read:
+         A = gpioRead(v1); F = A; PC++; SCR_NEXT;
+
+      op_mics:
+         if (v1 > PI_MAX_MICS_DELAY) goto op_cmd;
+         myGpioDelay(v1); A = 0; F = A; PC++; SCR_NEXT;
+
+      op_mils:
+         if (v1 > PI_MAX_MILS_DELAY) goto op_cmd;
+         myGpioDelay(v1 * 1000); A = 0; F = A; PC++; SCR_NEXT;
+
+      op_br1:
+         A = gpioRead_Bits_0_31(); F = A; PC++; SCR_NEXT;
+
+      op_bs1:
+         if ((gpioMask | v1) != gpioMask) goto op_cmd;
+         A = gpioWrite_Bits_0_31_Set(v1); F = A; PC++; SCR_NEXT;
+
+      op_bc1:
+         if ((gpioMask | v1) != gpioMask) goto op_cmd;
+         A = gpioWrite_Bits_0_31_Clear(v1); F = A; PC++; SCR_NEXT;
+
+      op_tick:
+         A = gpioTick(); F = A; PC++; SCR_NEXT;
+
+      op_cmd:
+         instr = &s->script.instr[PC];
+
+         p[0] = instr->p[0];
+         p[1] = v1;
+         p[2] = v2;
+         p[3] = instr->p[3];
+         p[4] = instr->p[4];
+
+         if (p[3])
+         {
+            if ((p[3] == sizeof(int)) &&
+                ((instr->opt[3] == CMD_VAR) || (instr->opt[3] == CMD_PAR)))
+            {
+               /* Hack to allow register use in 3rd parameter */
+               memcpy((char*)&p3o, (char *)p[4], sizeof(int));
+               if (instr->opt[3] == CMD_VAR)
+                  memcpy(buf, (char *)&(s->script.var[p3o]), sizeof(int));
+               else
+                  memcpy(buf, (char *)&(s->script.par[p3o]), sizeof(int));
+            }
+            else
+            {
+               memcpy(buf, (char *)p[4], p[3]);
+            }
+         }
+
+         A = myDoCommand(p, sizeof(buf)-1, buf); F = A; PC++; SCR_NEXT;
+
+      /* script instructions */
+
+      op_add:   A+=p1; F=A;                     PC++; SCR_NEXT;
+
+      op_and:   A&=p1; F=A;                     PC++; SCR_NEXT;
+
+      op_call:  scrPush(s, &SP, S, PC+1);    PC = p1; SCR_NEXT;
+
+      op_cmp:   F=A-p1;                         PC++; SCR_NEXT;
+
+      op_dcr:   F=--R[c->p1];                   PC++; SCR_NEXT;
+
+      op_dcra:  --A; F=A;                       PC++; SCR_NEXT;
+
+      op_div:   A/=p1; F=A;                     PC++; SCR_NEXT;
+
+      op_evtwt: A=scrEvtWait(s, p1); F=A;       PC++; SCR_NEXT;
+
+      op_halt:  s->run_state = PI_SCRIPT_HALTED;      SCR_NEXT;
+
+      op_inr:   F=++R[c->p1];                   PC++; SCR_NEXT;
+
+      op_inra:  ++A; F=A;                       PC++; SCR_NEXT;
+
+      op_jm:    if (F<0)  PC=p1; else PC++;           SCR_NEXT;
+
+      op_jmp:   PC=p1;                                SCR_NEXT;
+
+      op_jnz:   if (F)    PC=p1; else PC++;           SCR_NEXT;
+
+      op_jp:    if (F>=0) PC=p1; else PC++;           SCR_NEXT;
+
+      op_jz:    if (!F)   PC=p1; else PC++;           SCR_NEXT;
+
+      op_ld:    R[c->p1]=v2;                    PC++; SCR_NEXT;
+
+      op_lda:   A=p1;                           PC++; SCR_NEXT;
+
+      op_ldab:
+         if ((p1 >= 0) && (p1 < sizeof(buf))) A = buf[p1];
+         PC++;
+         SCR_NEXT;
+
+      op_mlt:   A*=p1; F=A;                     PC++; SCR_NEXT;
+
+      op_mod:   A%=p1; F=A;                     PC++; SCR_NEXT;
+
+      op_nop:                                   PC++; SCR_NEXT;
+
+      op_or:    A|=p1; F=A;                     PC++; SCR_NEXT;
+
+      op_pop:   R[c->p1]=scrPop(s, &SP, S);     PC++; SCR_NEXT;
+
+      op_popa:  A=scrPop(s, &SP, S);            PC++; SCR_NEXT;
+
+      op_push:  scrPush(s, &SP, S, R[c->p1]);   PC++; SCR_NEXT;
+
+      op_pusha: scrPush(s, &SP, S, A);          PC++; SCR_NEXT;
+
+      op_ret:   PC=scrPop(s, &SP, S);                 SCR_NEXT;
+
+      op_rl:    R[c->p1]<<=(int)v2; F=R[c->p1]; PC++; SCR_NEXT;
+
+      op_rla:   A<<=p1; F=A;                    PC++; SCR_NEXT;
+
+      op_rr:    R[c->p1]>>=(int)v2; F=R[c->p1]; PC++; SCR_NEXT;
+
+      op_rra:   A>>=p1; F=A;                    PC++; SCR_NEXT;
+
+      op_sta:   R[c->p1]=A;                     PC++; SCR_NEXT;
+
+      op_stab:
+         if ((p1 >= 0) && (p1 < sizeof(buf))) buf[p1] = A;
+         PC++;
+         SCR_NEXT;
+
+      op_sub:   A-=p1; F=A;                     PC++; SCR_NEXT;
+
+      op_sys:
+         A=scrSys((char*)s->script.instr[PC].p[4], A, *(gpioReg + GPLEV0));
+         F=A;
+         PC++;
+         SCR_NEXT;
+
+      op_wait:  A=scrWait(s, p1); F=A;          PC++; SCR_NEXT;
+
+      op_x:     scrSwap(&R[c->p1], &R[c->p2]);  PC++; SCR_NEXT;
+
+      op_xa:    scrSwap(&R[c->p1], &A);         PC++; SCR_NEXT;
+
+      op_xor:   A^=p1; F=A;                     PC++; SCR_NEXT;
+
+      /* superinstructions, fall back to the first step if unusual */
+
+      op_wmw:
+         v3 = SCR_VAL(&c[1], 1);
+         v4 = SCR_VAL(&c[2], 1);
+         v5 = SCR_VAL(&c[2], 2);
+         if (!myPermit(v1) || !myPermit(v4) || (v3 > PI_MAX_MICS_DELAY))
+            goto op_write;
+         gpioWrite(v1, v2);
+         myGpioDelay(v3);
+         A = gpioWrite(v4, v5); F = A; PC+=3; SCR_NEXT;
+
+      op_rj:
+         A = gpioRead(v1); F = A;
+         if (scrJcc(c->sub, F)) PC = c[1].p1; else PC+=2;
+         SCR_NEXT;
+
+      op_cmpj:
+         F=A-p1;
+         if (scrJcc(c->sub, F)) PC = c[1].p1; else PC+=2;
+         SCR_NEXT;
+
+      op_dcrj:
+         F=--R[c->p1];
+         if (scrJcc(c->sub, F)) PC = c[1].p1; else PC+=2;
+         SCR_NEXT;
+
+      op_inrj:
+         F=++R[c->p1];
+         if (scrJcc(c->sub, F)) PC = c[1].p1; else PC+=2;
+         SCR_NEXT;
+
+      op_las:
+         A = p1;
+         p1 = SCR_VAL(&c[1], 1);
+         switch (c->sub)
+         {
+            case CMD_OP_ADD: A+=p1; break;
+            case CMD_OP_SUB: A-=p1; break;
+            case CMD_OP_AND: A&=p1; break;
+            case CMD_OP_OR:  A|=p1; break;
+            case CMD_OP_XOR: A^=p1; break;
+            case CMD_OP_MLT: A*=p1; break;
+         }
+         F=A; R[c[2].p1]=A; PC+=3; SCR_NEXT;
+
+      op_stal:  R[c->p1]=A;                     PC+=2; SCR_NEXT;
+
+      op_ldal:  A=SCR_VAL(&c[1], 1);            PC+=2; SCR_NEXT;
+
+      /* count the step, time it if it blocks, and run it unfused */
+
+      op_prof:
+         if (blockPC >= 0)
+         {
+            P[blockPC].micros += gpioTick() - blockTick;
+            blockPC = -1;
+         }
+
+         P[PC].count++;
+
+         switch (c->op)
+         {
+            case CMD_OP_WMW:  op = CMD_OP_WRITE; break;
+            case CMD_OP_RJ:   op = CMD_OP_READ;  break;
+            case CMD_OP_CMPJ: op = CMD_OP_CMP;   break;
+            case CMD_OP_DCRJ: op = CMD_OP_DCR;   break;
+            case CMD_OP_INRJ: op = CMD_OP_INR;   break;
+            case CMD_OP_LAS:
+            case CMD_OP_LDAL: op = CMD_OP_LDA;   break;
+            case CMD_OP_STAL: op = CMD_OP_STA;   break;
+            default:          op = c->op;
+         }
+
+         if ((op == CMD_OP_MICS) || (op == CMD_OP_MILS) ||
+             (op == CMD_OP_WAIT) || (op == CMD_OP_EVTWT))
+         {
+            blockPC = PC;
+            blockTick = gpioTick();
+         }
+
+         goto *dispatch[op];
+
+      halt:
+
+      if (P && (blockPC >= 0)) P[blockPC].micros += gpioTick() - blockTick;
+
+      if ((unsigned)PC >= (unsigned)s->script.instrs)
+         s->run_state = PI_SCRIPT_HALTED;
+
+      if ((volatile int)s->request == PI_SCRIPT_HALT)
+         s->run_state = PI_SCRIPT_HALTED;
+
+   }
+
+#undef SCR_NEXT
+#undef SCR_VAL
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint64_t timerMicros(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ((uint64_t)ts.tv_sec * MILLION) + (ts.tv_nsec / THOUSAND);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void timerLink(gpioTimer_t **head, gpioTimer_t *t)
+{
+   t->next = *head;
+   if (t->next) t->next->pprev = &t->next;
+   *head = t;
+   t->pprev = head;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void timerUnlink(gpioTimer_t *t)
+{
+   if (t->pprev)
+   {
+      *t->pprev = t->next;
+      if (t->next) t->next->pprev = t->pprev;
+      t->next = NULL;
+      t->pprev = NULL;
+   }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void timerInsert(gpioTimer_t *t)
+{
+   /*
+   A timer goes on the level of the highest base 64 digit in
+   which its expiry differs from the wheel time, in the slot
+   given by that digit.  It is moved down a level each time
+   the wheel reaches its slot until it reaches level 0, where
+   the slot is reached at the exact expiry.
+   */
+
+   int level, slot;
+
+   if (t->expiry <= timerNow)
+   {
+      timerLink(&timerDue, t);
+      return;
+   }
+
+   level = (63 - __builtin_clzll(t->expiry ^ timerNow)) / TIMER_BITS;
+
+   if (level >= TIMER_LEVELS)
+   {
+      timerLink(&timerOverflow, t);
+      return;
+   }
+
+   slot = (t->expiry >> (level * TIMER_BITS)) & (TIMER_SLOTS-1);
+
+   timerLink(&timerWheel[level][slot], t);
+
+   timerOccupied[level] |= (1ULL << slot);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int timerNext(uint64_t *next)
+{
+   /*
+   Finds the time at which the wheel next reaches an occupied
+   slot.  Occupied slots always lie ahead of the wheel time on
+   their level, and any slot on a lower level is reached before
+   any slot on a higher level.
+   */
+
+   uint64_t ahead;
+   int level, shift, slot;
+
+   for (level=0; level<TIMER_LEVELS; level++)
+   {
+      shift = level * TIMER_BITS;
+
+      slot = (timerNow >> shift) & (TIMER_SLOTS-1);
+
+      ahead = timerOccupied[level] & ~((2ULL << slot) - 1);
+
+      while (ahead)
+      {
+         slot = __builtin_ctzll(ahead);
+
+         if (timerWheel[level][slot])
+         {
+            *next = ((timerNow >> (shift + TIMER_BITS)) <<
+               (shift + TIMER_BITS)) | ((uint64_t)slot << shift);
+
+            return 1;
+         }
+
+         /* emptied by a cancel */
+
+         timerOccupied[level] &= ~(1ULL << slot);
+         ahead &= ~(1ULL << slot);
+      }
+   }
+
+   if (timerOverflow)
+   {
+      shift = TIMER_LEVELS * TIMER_BITS;
+
+      *next = ((timerNow >> shift) + 1) << shift;
+
+      return 1;
+   }
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void timerAdvance(uint64_t when)
+{
+   /* moves the wheel to when, the next time found by timerNext */
+
+   gpioTimer_t *list, *t;
+   int level, shift, slot;
+
+   timerNow = when;
+
+   shift = TIMER_LEVELS * TIMER_BITS;
+
+   if (!(when & ((1ULL << shift) - 1)))
+   {
+      list = timerOverflow;
+      timerOverflow = NULL;
+
+      while ((t = list))
+      {
+         list = t->next;
+         timerInsert(t);
+      }
+   }
+
+   for (level=TIMER_LEVELS-1; level>=0; level--)
+   {
+      shift = level * TIMER_BITS;
+
+      if (when & ((1ULL << shift) - 1)) continue;
+
+      slot = (when >> shift) & (TIMER_SLOTS-1);
+
+      list = timerWheel[level][slot];
+      timerWheel[level][slot] = NULL;
+      timerOccupied[level] &= ~(1ULL << slot);
+
+      while ((t = list))
+      {
+         list = t->next;
+         timerInsert(t);
+      }
+   }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void * pthTimerTick(void *x)
+{
+   gpioTimer_t *t;
+   callbk_t func;
+   unsigned ex;
+   void *userdata;
+   uint64_t now, next;
+   struct timespec deadline;
+
+   pthread_mutex_lock(&timerMutex);
+
+   while (!timerStop)
+   {
+      now = timerMicros();
+
+      while (timerNext(&next) && (next <= now)) timerAdvance(next);
+
+      /* no occupied slot lies before now */
+
+      if (timerNow < now) timerNow = now;
+
+      if ((t = timerDue))
+      {
+         timerUnlink(t);
+
+         func     = t->func;
+         ex       = t->ex;
+         userdata = t->userdata;
+
+         if (t->period)
+         {
+            /* deadlines stay on the original grid, overruns skip */
+
+            t->expiry += t->period;
+
+            if (t->expiry <= now)
+               t->expiry += ((now - t->expiry) / t->period + 1) * t->period;
+
+            timerInsert(t);
+         }
+
+         /* the slot stays used until the callback returns */
+
+         timerActive = t - gpioTimer;
+
+         pthread_mutex_unlock(&timerMutex);
+
+         if (ex) (func)(userdata);
+         else    (func)();
+
+         pthread_mutex_lock(&timerMutex);
+
+         timerActive = -1;
+
+         /* a one-shot, or a timer cancelled by its callback */
+
+         if (!t->pprev) t->used = 0;
+
+         pthread_cond_broadcast(&timerIdle);
+
+         continue;
+      }
+
+      if (timerNext(&next))
+      {
+         timerSleep = next;
+
+         deadline.tv_sec  = next / MILLION;
+         deadline.tv_nsec = (next % MILLION) * THOUSAND;
+
+         pthread_cond_timedwait(&timerCond, &timerMutex, &deadline);
+      }
+      else
+      {
+         timerSleep = ~0ULL;
+
+         pthread_cond_wait(&timerCond, &timerMutex);
+      }
+   }
+
+   pthread_mutex_unlock(&timerMutex);
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+
+static int myCmdHasExtResponse(unsigned cmd)
+{
+   /* commands whose results are followed by an extension */
+
+   switch (cmd)
+   {
+      case PI_CMD_ACQR:
+      case PI_CMD_BI2CZ:
+      case PI_CMD_BSCX:
+      case PI_CMD_CF2:
+      case PI_CMD_I2CBR:
+      case PI_CMD_FL:
+      case PI_CMD_FR:
+      case PI_CMD_I2CPK:
+      case PI_CMD_I2CRD:
+      case PI_CMD_I2CRI:
+      case PI_CMD_I2CRK:
+      case PI_CMD_I2CZ:
+      case PI_CMD_PROCP:
+      case PI_CMD_PROFR:
+      case PI_CMD_SERR:
+      case PI_CMD_SLR:
+      case PI_CMD_SPIX:
+      case PI_CMD_SPIR:
+      case PI_CMD_BSPIX:
+         return 1;
+
+      default:
+         return 0;
+   }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void myFifoWrite(int fd, char *buf, int len, int nonBlocking)
+{
+   int n, written;
+   struct pollfd pfd;
+
+   written = 0;
+
+   while (len > 0)
+   {
+      n = write(fd, buf, len);
+
+      if (n > 0)
+      {
+         buf += n;
+         len -= n;
+         written += n;
+      }
+      else if ((n < 0) && (errno == EINTR)) continue;
+      else if ((n < 0) && (errno == EAGAIN) && nonBlocking)
+      {
+         /*
+            Nobody reading, drop the results as fprintf used to.
+            Otherwise give the reader a chance to make room.
+         */
+
+         if (!written) return;
+
+         pfd.fd = fd;
+         pfd.events = POLLOUT;
+
+         if (poll(&pfd, 1, PI_FIFO_WRITE_WAIT_MS) <= 0)
+         {
+            DBG(DBG_USER, "fifo reader not keeping up, %d bytes dropped", len);
+            return;
+         }
+      }
+      else
+      {
+         DBG(DBG_ALWAYS, "fifo write failed (%m)");
+         return;
+      }
+   }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void fifoFlush(fifoOut_t *o)
+{
+   if (o->len) myFifoWrite(o->fd, o->buf, o->len, 1);
+   o->len = 0;
+}
+
+static void fifoPrintf(fifoOut_t *o, const char *fmt, ...)
+{
+   va_list ap;
+   int n;
+
+   va_start(ap, fmt);
+   n = vsnprintf(o->buf + o->len, sizeof(o->buf) - o->len, fmt, ap);
+   va_end(ap);
+
+   if ((o->len + n) >= sizeof(o->buf))
+   {
+      /* didn't fit, send what we have and format again */
+
+      fifoFlush(o);
+
+      va_start(ap, fmt);
+      n = vsnprintf(o->buf, sizeof(o->buf), fmt, ap);
+      va_end(ap);
+
+      if (n >= sizeof(o->buf)) n = sizeof(o->buf) - 1;
+   }
+
+   o->len += n;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void fifoDoLine(fifoOut_t *o, char *buf, int len, char *v)
+{
+   int idx, res, i;
+   uintptr_t p[CMD_P_ARR];
+   cmdCtlParse_t ctl;
+   uint32_t *param;
+   gpioScriptProf_t *prof;
+
+   ctl.eaten = 0;
+   idx = 0;
+
+   while (((ctl.eaten)<len) && (idx >= 0))
+   {
+      if ((idx=cmdParse(buf, p, CMD_MAX_EXTENSION, v, &ctl)) >= 0)
+      {
+         /* make sure extensions are null terminated */
+
+         v[p[3]] = 0;
+
+         res = myDoCommand(p, CMD_MAX_EXTENSION-1, v);
+
+         switch (cmdInfo[idx].rv)
+         {
+            case 0:
+            case 1:
+            case 2:
+               fifoPrintf(o, "%d\n", res);
+               break;
+
+            case 3:
+               fifoPrintf(o, "%08X\n", res);
+               break;
+
+            case 4:
+               fifoPrintf(o, "%u\n", res);
+               break;
+
+            case 5:
+               fifoPrintf(o, "%s", cmdUsage);
+               break;
+
+            case 6:
+               fifoPrintf(o, "%d", res);
+               if (res > 0)
+               {
+                  for (i=0; i<res; i++)
+                  {
+                     fifoPrintf(o, " %d", v[i]);
+                  }
+               }
+               fifoPrintf(o, "\n");
+               break;
+
+            case 7:
+               if (res < 0) fifoPrintf(o, "%d\n", res);
+               else
+               {
+                  fifoPrintf(o, "%d", res);
+                  param = (uint32_t *)v;
+                  for (i=0; i<PI_MAX_SCRIPT_PARAMS; i++)
+                  {
+                     fifoPrintf(o, " %d", param[i]);
+                  }
+                  fifoPrintf(o, "\n");
+               }
+               break;
+
+            case 9:
+               if (res < 0) fifoPrintf(o, "%d\n", res);
+               else
+               {
+                  res /= sizeof(gpioScriptProf_t);
+                  fifoPrintf(o, "%d", res);
+                  prof = (gpioScriptProf_t *)v;
+                  for (i=0; i<res; i++)
+                  {
+                     fifoPrintf(o, " %u %u", prof[i].count, prof[i].micros);
+                  }
+                  fifoPrintf(o, "\n");
+               }
+               break;
+         }
+      }
+      else fifoPrintf(o, "%d\n", PI_BAD_FIFO_COMMAND);
+   }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void * pthFifoThread(void *x)
+{
+   char buf[CMD_MAX_EXTENSION];
+   int flags, got, len, start, end;
+   char *nl;
+   char v[CMD_MAX_EXTENSION];
+
+   myCreatePipe(PI_INPFIFO, 0662);
+
+   if ((inpFifo = fopen(PI_INPFIFO, "r+")) == NULL)
+      SOFT_ERROR((void*)PI_INIT_FAILED, "fopen %s failed(%m)", PI_INPFIFO);
+
+   myCreatePipe(PI_OUTFIFO, 0664);
+
+   if ((outFifo = fopen(PI_OUTFIFO, "w+")) == NULL)
+      SOFT_ERROR((void*)PI_INIT_FAILED, "fopen %s failed (%m)", PI_OUTFIFO);
+
+   /* set outFifo non-blocking */
+
+   flags = fcntl(fileno(outFifo), F_GETFL, 0);
+   fcntl(fileno(outFifo), F_SETFL, flags | O_NONBLOCK);
+
+   fifoOut.fd = fileno(outFifo);
+   fifoOut.len = 0;
+
+   /* don't start until DMA started */
+
+   spinWhileStarting();
+
+   len = 0;
+
+   while (1)
+   {
+      /*
+         Read whatever is available, execute every complete line,
+         and send all the results with as few writes as possible.
+      */
+
+      got = read(fileno(inpFifo), buf+len, sizeof(buf)-1-len);
+
+      if (got <= 0)
+      {
+         if ((got < 0) && (errno == EINTR)) continue;
+         SOFT_ERROR((void*)PI_INIT_FAILED, "fifo read failed (%m)");
+      }
+
+      len += got;
+      start = 0;
+
+      while (start < len)
+      {
+         nl = memchr(buf+start, '\n', len-start);
+
+         if (nl != NULL) end = nl - buf;
+         else if ((start == 0) && (len == (sizeof(buf)-1)))
+            end = len; /* overlong line, treat as complete like fgets */
+         else break;
+
+         buf[end] = 0;
+
+         fifoDoLine(&fifoOut, buf+start, end-start, v);
+
+         start = end + 1;
+      }
+
+      if (start > len) start = len;
+
+      /* keep any partial line for the next read */
+
+      if (start)
+      {
+         len -= start;
+         memmove(buf, buf+start, len);
+      }
+
+      fifoFlush(&fifoOut);
+   }
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void * pthFifoBinThread(void *x)
+{
+   static char inBuf[PI_FIFO_BIN_IN_SIZE];
+   static char outBuf[PI_FIFO_BIN_OUT_SIZE];
+   static char v[CMD_MAX_EXTENSION];
+   int got, inLen, outLen, pos, ext;
+   uint32_t hdr[4];
+   uintptr_t p[CMD_P_ARR];
+
+   myCreatePipe(PI_INPFIFO_BIN, 0662);
+
+   if ((fdBinInp = open(PI_INPFIFO_BIN, O_RDWR)) < 0)
+      SOFT_ERROR((void*)PI_INIT_FAILED, "open %s failed(%m)", PI_INPFIFO_BIN);
+
+   myCreatePipe(PI_OUTFIFO_BIN, 0664);
+
+   /* blocking, a bulk reader must consume the responses */
+
+   if ((fdBinOut = open(PI_OUTFIFO_BIN, O_RDWR)) < 0)
+      SOFT_ERROR((void*)PI_INIT_FAILED, "open %s failed(%m)", PI_OUTFIFO_BIN);
+
+   spinWhileStarting();
+
+   inLen = 0;
+
+   while (1)
+   {
+      got = read(fdBinInp, inBuf+inLen, sizeof(inBuf)-inLen);
+
+      if (got <= 0)
+      {
+         if ((got < 0) && (errno == EINTR)) continue;
+         SOFT_ERROR((void*)PI_INIT_FAILED, "bin fifo read failed (%m)");
+      }
+
+      inLen += got;
+      pos = 0;
+      outLen = 0;
+
+      /*
+         Each request is the socket command format, cmd p1 p2 p3
+         followed by p3 bytes of extension.  Each response is
+         cmd p1 p2 res followed by any extension result.
+      */
+
+      while ((inLen - pos) >= sizeof(hdr))
+      {
+         memcpy(hdr, inBuf+pos, sizeof(hdr));
+
+         if (hdr[3] >= CMD_MAX_EXTENSION)
+         {
+            /* can't resync a corrupt stream, discard it */
+
+            DBG(DBG_ALWAYS, "bin fifo ext too large %u, input flushed", hdr[3]);
+            pos = inLen;
+            break;
+         }
+
+         if ((inLen - pos) < (sizeof(hdr) + hdr[3])) break;
+
+         p[0] = hdr[0];
+         p[1] = hdr[1];
+         p[2] = hdr[2];
+         p[3] = hdr[3];
+
+         memcpy(v, inBuf+pos+sizeof(hdr), hdr[3]);
+         v[hdr[3]] = 0;
+
+         pos += sizeof(hdr) + hdr[3];
+
+         if ((outLen + sizeof(hdr) + CMD_MAX_EXTENSION) > sizeof(outBuf))
+         {
+            myFifoWrite(fdBinOut, outBuf, outLen, 0);
+            outLen = 0;
+         }
+
+         switch (p[0])
+         {
+            case PI_CMD_NOIB:
+               p[3] = PI_BAD_FIFO_COMMAND; /* needs a socket */
+               break;
+
+            case PI_CMD_PROCP:
+               p[3] = myDoCommand(p, sizeof(v)-1-sizeof(int), v+sizeof(int));
+               if (((int)p[3]) >= 0)
+               {
+                  memcpy(v, &p[3], 4);
+                  p[3] = 4 + (4*PI_MAX_SCRIPT_PARAMS);
+               }
+               break;
+
+            default:
+               p[3] = myDoCommand(p, sizeof(v)-1, v);
+         }
+
+         if (myCmdHasExtResponse(p[0]) && (((int)p[3]) > 0)) ext = p[3];
+         else ext = 0;
+
+         hdr[3] = p[3];
+
+         memcpy(outBuf+outLen, hdr, sizeof(hdr));
+         outLen += sizeof(hdr);
+
+         if (ext)
+         {
+            memcpy(outBuf+outLen, v, ext);
+            outLen += ext;
+         }
+      }
+
+      if (pos)
+      {
+         inLen -= pos;
+         memmove(inBuf, inBuf+pos, inLen);
+      }
+
+      if (outLen) myFifoWrite(fdBinOut, outBuf, outLen, 0);
+   }
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void *pthSocketThreadHandler(void *fdC)
+{
+   int sock = *(int*)fdC;
+   uintptr_t p[10];
+   uint32_t tmp, response[4];
+   int i;
+   int opt;
+   char buf[CMD_MAX_EXTENSION];
+
+   free(fdC);
+
+   /* Disable the Nagle algorithm. */
+   opt = 1;
+   setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*)&opt, sizeof(int));
+
+   while (1)
+   {
+      if (sizeof(uintptr_t) == 8)
+      {
+         if (recv(sock, &tmp, 4, MSG_WAITALL) != 4) break;
+         p[0] = (uintptr_t)tmp;
+         if (recv(sock, &tmp, 4, MSG_WAITALL) != 4) break;
+         p[1] = (uintptr_t)tmp;
+         if (recv(sock, &tmp, 4, MSG_WAITALL) != 4) break;
+         p[2] = (uintptr_t)tmp;
+         if (recv(sock, &tmp, 4, MSG_WAITALL) != 4) break;
+         p[3] = (uintptr_t)tmp;
+      }
+      else
+      {
+         if (recv(sock, p, 16, MSG_WAITALL) != 16) break;
+      }
+
+      if (p[3])
+      {
+         if (p[3] < sizeof(buf))
+         {
+            /* read extension into buf */
+            if (recv(sock, buf, p[3], MSG_WAITALL) != p[3])
+            {
+               /* Serious error.  No point continuing. */
+               DBG(DBG_ALWAYS,
+                  "recv failed for %"PRIdPTR" bytes, sock=%d", p[3], sock);
+
+               closeOrphanedNotifications(-1, sock);
+
+               closeOrphanedI2CRequests(sock);
+
+               close(sock);
+
+               return 0;
+            }
+         }
+         else
+         {
+            /* Serious error.  No point continuing. */
+            DBG(DBG_ALWAYS, "ext too large %"PRIdPTR"(%zd), sock=%d",
+               p[3], sizeof(buf), sock);
+
+            closeOrphanedNotifications(-1, sock);
+
+            closeOrphanedI2CRequests(sock);
+
+            close(sock);
+
+            return 0;
+         }
+      }
+
+      /* add null terminator in case it's a string */
+
+      buf[p[3]] = 0;
+
+      switch (p[0])
+      {
+         case PI_CMD_NOIB:
+
+            p[3] = gpioNotifyOpenInBand(sock);
+
+           /* Enable the Nagle algorithm. */
+            opt = 0;
+            setsockopt(
+               sock, IPPROTO_TCP, TCP_NODELAY, (char*)&opt, sizeof(int));
+
+            break;
+
+         case PI_CMD_I2CBQ:
+
+            /* the request belongs to this socket */
+
+            p[3] = i2cBatchSocket(p[1], p[2], buf, p[3], sock);
+
+            break;
+
+         case PI_CMD_I2CBR:
+
+            if (p[1] < I2C_REQUESTS)
+               p[3] = intI2CBatchWait(p[1], p[2], buf, sizeof(buf)-1, sock);
+            else
+               p[3] = PI_BAD_HANDLE;
+
+            break;
+
+         case PI_CMD_PROCP:
+            p[3] = myDoCommand(p, sizeof(buf)-1, buf+sizeof(int));
+            if (((int)p[3]) >= 0)
+            {
+               memcpy(buf, &p[3], 4);
+               p[3] = 4 + (4*PI_MAX_SCRIPT_PARAMS);
+            }
+            break;
+
+         default:
+            p[3] = myDoCommand(p, sizeof(buf)-1, buf);
+      }
+
+      if (sizeof(uintptr_t) == 8) // 64-bit system
+      {
+         for (i = 0; i < 4; i++)
+            response[i] = (uint32_t)p[i];
+         if (write(sock, response, 16) == -1) { /* ignore errors */ }
+      }
+      else // 32-bit system
+      {
+         if (write(sock, p, 16) == -1) { /* ignore errors */ }
+      }
+
+      /* extensions */
+
+      if (myCmdHasExtResponse(p[0]) && (((int)p[3]) > 0))
+      {
+         if (write(sock, buf, p[3]) == 1) { /* ignore errors */ }
+      }
+   }
+
+   closeOrphanedNotifications(-1, sock);
+
+   closeOrphanedI2CRequests(sock);
+
+   close(sock);
+
+   DBG(DBG_USER, "Socket %d closed", sock);
+
+   return 0;
+}
+
+static int addrAllowed(struct sockaddr *saddr)
+{
+   int i;
+   uint32_t addr;
+
+   if (!numSockNetAddr) return 1;
+
+   // FIXME: add IPv6 whitelisting support
+   if (saddr->sa_family != AF_INET) return 0;
+
+   addr = ((struct sockaddr_in *) saddr)->sin_addr.s_addr;
+
+   for (i=0; i<numSockNetAddr; i++)
+   {
+      if (addr == sockNetAddr[i]) return 1;
+   }
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void * pthSocketThread(void *x)
+{
+   int fdC=0, c, *sock;
+   struct sockaddr_storage client;
+   pthread_attr_t attr;
+
+   if (pthread_attr_init(&attr))
+      SOFT_ERROR((void*)PI_INIT_FAILED,
+         "pthread_attr_init failed (%m)");
+
+   if (pthread_attr_setstacksize(&attr, STACK_SIZE))
+      SOFT_ERROR((void*)PI_INIT_FAILED,
+         "pthread_attr_setstacksize failed (%m)");
+
+   if (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED))
+      SOFT_ERROR((void*)PI_INIT_FAILED,
+         "pthread_attr_setdetachstate failed (%m)");
+
+   /* fdSock opened in gpioInitialise so that we can treat
+      failure to bind as fatal. */
+
+   listen(fdSock, 100);
+
+   c = sizeof(client);
+
+   /* don't start until DMA started */
+
+   spinWhileStarting();
+
+   while (fdC >= 0)
+   {
+      pthread_t thr;
+
+      fdC = accept(fdSock, (struct sockaddr *)&client, (socklen_t*)&c);
+
+      closeOrphanedNotifications(-1, fdC);
+
+      if (addrAllowed((struct sockaddr *)&client))
+      {
+         DBG(DBG_USER, "Connection accepted on socket %d", fdC);
+
+         sock = malloc(sizeof(int));
+
+         *sock = fdC;
+
+         /* Enable tcp_keepalive */
+         int optval = 1;
+         socklen_t optlen = sizeof(optval);
+
+         if (setsockopt(fdC, SOL_SOCKET, SO_KEEPALIVE, &optval, optlen) < 0)
+         {
+           DBG(DBG_ALWAYS, "setsockopt() fail, closing socket %d", fdC);
+           close(fdC);
+         }
+
+         DBG(DBG_USER, "SO_KEEPALIVE enabled on socket %d\n", fdC);
+
+         if (pthread_create
+            (&thr, &attr, pthSocketThreadHandler, (void*) sock) < 0)
+            SOFT_ERROR((void*)PI_INIT_FAILED,
+               "socket pthread_create failed (%m)");
+      }
+      else
+      {
+         DBG(DBG_ALWAYS, "Connection rejected, closing");
+         close(fdC);
+      }
+   }
+
+   if (fdC < 0)
+      SOFT_ERROR((void*)PI_INIT_FAILED, "accept failed (%m)");
+
+   return 0;
+}
+
+/* ======================================================================= */
+
+static void initCheckLockFile(void)
+{
+   int fd;
+   int count;
+   int pid;
+   int err;
+   int delete;
+   char str[20];
+
+   fd = open(PI_LOCKFILE, O_RDONLY);
+
+   if (fd != -1)
+   {
+      DBG(DBG_STARTUP, "lock file exists");
+      delete = 1;
+
+      count = read(fd, str, sizeof(str)-1);
+
+      if (count)
+      {
+         pid = atoi(str);
+         err = kill(pid, 0);
+         if (!err) delete = 0; /* process still exists */
+         DBG(DBG_STARTUP, "lock file pid=%d err=%d", pid, err);
+      }
+
+      close(fd);
+      DBG(DBG_STARTUP, "lock file delete=%d", delete);
+
+      if (delete) unlink(PI_LOCKFILE);
+   }
+}
+
+static int initGrabLockFile(void)
+{
+   int fd;
+   int lockResult;
+   char pidStr[20];
+
+   initCheckLockFile();
+
+   /* try to grab the lock file */
+
+   fd = open(PI_LOCKFILE, O_WRONLY|O_CREAT|O_EXCL|O_TRUNC, 0644);
+
+   if (fd != -1)
+   {
+      lockResult = flock(fd, LOCK_EX|LOCK_NB);
+
+      if(lockResult == 0)
+      {
+         sprintf(pidStr, "%d\n", (int)getpid());
+
+         if (write(fd, pidStr, strlen(pidStr)) == -1)
+         {
+            /* ignore errors */
+         }
+      }
+      else
+      {
+         close(fd);
+         return -1;
+      }
+   }
+
+   return fd;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint32_t * initMapMem(int fd, uint32_t addr, uint32_t len)
+{
+    return (uint32_t *) mmap(0, len,
+       PROT_READ|PROT_WRITE,
+       MAP_SHARED|MAP_LOCKED,
+       fd, addr);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int initCheckPermitted(void)
+{
+   DBG(DBG_STARTUP, "");
+
+   if (!pi_ispi)
+   {
+      DBG(DBG_ALWAYS,
+         "\n" \
+         "+---------------------------------------------------------+\n" \
+         "|Sorry, this system does not appear to be a raspberry pi. |\n" \
+         "|aborting.                                                |\n" \
+         "+---------------------------------------------------------+\n\n");
+      return -1;
+   }
+
+   if ((fdMem = open("/dev/mem", O_RDWR | O_SYNC) ) < 0)
+   {
+      DBG(DBG_ALWAYS,
+         "\n" \
+         "+---------------------------------------------------------+\n" \
+         "|Sorry, you don't have permission to run this program.    |\n" \
+         "|Try running as root, e.g. precede the command with sudo. |\n" \
+         "+---------------------------------------------------------+\n\n");
+      return -1;
+   }
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int initPeripherals(void)
+{
+   DBG(DBG_STARTUP, "");
+
+   gpioReg = initMapMem(fdMem, GPIO_BASE, GPIO_LEN);
+
+   if (gpioReg == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap gpio failed (%m)");
+
+   dmaReg = initMapMem(fdMem, DMA_BASE, DMA_LEN);
+
+   if (dmaReg == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap dma failed (%m)");
+
+   /* we should know if we are running on a BCM2711 by now */
+
+   if (gpioCfg.DMAprimaryChannel == PI_DEFAULT_DMA_NOT_SET)
+   {
+      if (pi_is_2711)
+         gpioCfg.DMAprimaryChannel = PI_DEFAULT_DMA_PRIMARY_CH_2711;
+      else
+         gpioCfg.DMAprimaryChannel = PI_DEFAULT_DMA_PRIMARY_CHANNEL;
+   }
+      
+   if (gpioCfg.DMAsecondaryChannel == PI_DEFAULT_DMA_NOT_SET)
+   {
+      if (pi_is_2711)
+         gpioCfg.DMAsecondaryChannel = PI_DEFAULT_DMA_SECONDARY_CH_2711;
+      else
+         gpioCfg.DMAsecondaryChannel = PI_DEFAULT_DMA_SECONDARY_CHANNEL;
+   }
+      
+   dmaIn =  dmaReg + (gpioCfg.DMAprimaryChannel   * 0x40);
+   dmaOut = dmaReg + (gpioCfg.DMAsecondaryChannel * 0x40);
+
+   if (gpioCfg.spiDMABytes)
+   {
+      if ((gpioCfg.spiDMATx == gpioCfg.DMAprimaryChannel)   ||
+          (gpioCfg.spiDMATx == gpioCfg.DMAsecondaryChannel) ||
+          (gpioCfg.spiDMARx == gpioCfg.DMAprimaryChannel)   ||
+          (gpioCfg.spiDMARx == gpioCfg.DMAsecondaryChannel))
+         SOFT_ERROR(PI_INIT_FAILED, "SPI DMA channels %d/%d in use",
+            gpioCfg.spiDMATx, gpioCfg.spiDMARx);
+
+      dmaSpiTx = dmaReg + (gpioCfg.spiDMATx * 0x40);
+      dmaSpiRx = dmaReg + (gpioCfg.spiDMARx * 0x40);
+   }
+
+   DBG(DBG_STARTUP, "DMA #%d @ %08"PRIXPTR,
+      gpioCfg.DMAprimaryChannel, (uintptr_t)dmaIn);
+
+   DBG(DBG_STARTUP, "debug reg is %08X", dmaIn[DMA_DEBUG]);
+
+   clkReg  = initMapMem(fdMem, CLK_BASE,  CLK_LEN);
+
+   if (clkReg == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap clk failed (%m)");
+
+   systReg  = initMapMem(fdMem, SYST_BASE,  SYST_LEN);
+
+   if (systReg == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap syst failed (%m)");
+
+   spiReg  = initMapMem(fdMem, SPI_BASE,  SPI_LEN);
+
+   if (spiReg == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap spi failed (%m)");
+
+   pwmReg  = initMapMem(fdMem, PWM_BASE,  PWM_LEN);
+
+   if (pwmReg == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap pwm failed (%m)");
+
+   pcmReg  = initMapMem(fdMem, PCM_BASE,  PCM_LEN);
+
+   if (pcmReg == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap pcm failed (%m)");
+
+   auxReg  = initMapMem(fdMem, AUX_BASE,  AUX_LEN);
+
+   if (auxReg == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap aux failed (%m)");
+
+   padsReg  = initMapMem(fdMem, PADS_BASE,  PADS_LEN);
+
+   if (padsReg == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap pads failed (%m)");
+
+   bscsReg  = initMapMem(fdMem, BSCS_BASE,  BSCS_LEN);
+
+   if (bscsReg == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap bscs failed (%m)");
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int initZaps
+   (int  pmapFd, void *virtualBase, int  basePage, int  pages)
+{
+   int n;
+   uintptr_t index;
+   off_t offset;
+   ssize_t t;
+   uint32_t physical;
+   int status;
+   uintptr_t pageAdr;
+   unsigned long long pa;
+
+   DBG(DBG_STARTUP, "");
+
+   status = 0;
+
+   pageAdr = (uintptr_t) dmaVirt[basePage];
+
+   index  = ((uintptr_t)virtualBase / PAGE_SIZE) * 8;
+
+   offset = lseek(pmapFd, index, SEEK_SET);
+
+   if (offset != index)
+      SOFT_ERROR(PI_INIT_FAILED, "lseek pagemap failed (%m)");
+
+   for (n=0; n<pages; n++)
+   {
+      t = read(pmapFd, &pa, sizeof(pa));
+
+      if (t != sizeof(pa))
+         SOFT_ERROR(PI_INIT_FAILED, "read pagemap failed (%m)");
+
+      DBG(DBG_STARTUP, "pf%d=%016llX", n, pa);
+
+      physical = 0x3FFFFFFF & (PAGE_SIZE * (pa & 0xFFFFFFFF));
+
+      if (physical)
+      {
+         //cast twice to suppress warning, I belive this is ok as these
+         //are bus addresses, not virtual addresses. --plugwash
+         dmaBus[basePage+n] = (dmaPage_t *)(uintptr_t) (physical | pi_dram_bus);
+
+         dmaVirt[basePage+n] = mmap
+         (
+            (void *)pageAdr,
+            PAGE_SIZE,
+            PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_FIXED|MAP_LOCKED|MAP_NORESERVE,
+            fdMem,
+            physical
+         );
+      }
+      else status = 1;
+
+      pageAdr += PAGE_SIZE;
+   }
+
+   return status;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int initPagemapBlock(int block)
+{
+   int trys, ok;
+   unsigned pageNum;
+
+   DBG(DBG_STARTUP, "block=%d", block);
+
+   dmaPMapBlk[block] = mmap(
+       0, (PAGES_PER_BLOCK*PAGE_SIZE),
+       PROT_READ|PROT_WRITE,
+       MAP_SHARED|MAP_ANONYMOUS|MAP_NORESERVE|MAP_LOCKED,
+       -1, 0);
+
+   if (dmaPMapBlk[block] == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap dma block %d failed (%m)", block);
+
+   /* force allocation of physical memory */
+
+   memset((void *)dmaPMapBlk[block], 0xAA, (PAGES_PER_BLOCK*PAGE_SIZE));
+
+   memset((void *)dmaPMapBlk[block], 0xFF, (PAGES_PER_BLOCK*PAGE_SIZE));
+
+   memset((void *)dmaPMapBlk[block], 0, (PAGES_PER_BLOCK*PAGE_SIZE));
+
+   pageNum = block * PAGES_PER_BLOCK;
+
+   dmaVirt[pageNum] = mmap(
+       0, (PAGES_PER_BLOCK*PAGE_SIZE),
+       PROT_READ|PROT_WRITE,
+       MAP_SHARED|MAP_ANONYMOUS|MAP_NORESERVE|MAP_LOCKED,
+       -1, 0);
+
+   if (dmaVirt[pageNum] == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap dma block %d failed (%m)", block);
+
+   munmap(dmaVirt[pageNum], PAGES_PER_BLOCK*PAGE_SIZE);
+
+   trys = 0;
+   ok = 0;
+
+   while ((trys < 10) && !ok)
+   {
+      if (initZaps(fdPmap,
+                    dmaPMapBlk[block],
+                    pageNum,
+                    PAGES_PER_BLOCK) == 0) ok = 1;
+      else myGpioDelay(50000);
+
+      ++trys;
+   }
 
-            /* check to see if any watchdogs are due for this
-               notification.
+   if (!ok) SOFT_ERROR(PI_INIT_FAILED, "initZaps failed");
 
-               bits        is the set of notification bits
-               timeoutBits is the set of timed out bits
-            */
+   return 0;
+}
 
-            bits = gpioNotify[n].bits;
+static int initMboxBlock(int block)
+{
+   int n, ok;
+   unsigned page;
+   uintptr_t virtualAdr;
+   uintptr_t busAdr;
 
-            if (timeoutBits & bits)
-            {
-               /* at least one watchdog has fired for this
-                  notification.
-               */
+   DBG(DBG_STARTUP, "block=%d", block);
 
-               for (b=0; b<=PI_MAX_USER_GPIO; b++)
-               {
-                  if (timeoutBits & bits & (1<<b))
-                  {
-                     if (numSamples)
-                        newLevel = sample[numSamples-1].level;
-                     else
-                        newLevel = reportedLevel;
+   ok = mbDMAAlloc
+      (&dmaMboxBlk[block], PAGES_PER_BLOCK * PAGE_SIZE, pi_mem_flag);
 
-                     report[emit].seqno = seqno;
-                     report[emit].flags =
-                        PI_NTFY_FLAGS_WDOG | PI_NTFY_FLAGS_BIT(b);
-                     report[emit].tick  = eTick;
-                     report[emit].level = newLevel;
+   if (!ok) SOFT_ERROR(PI_INIT_FAILED, "init mbox zaps failed");
 
-                     emit++;
-                     seqno++;
-                  }
-               }
-            }
-         }
+   page = block * PAGES_PER_BLOCK;
 
-         /* check to see if any events are due
+   virtualAdr = (uintptr_t) dmaMboxBlk[block].virtual_addr;
+   busAdr = dmaMboxBlk[block].bus_addr;
 
-            eventBits is the set of events
-         */
+   for (n=0; n<PAGES_PER_BLOCK; n++)
+   {
+      dmaVirt[page+n] = (dmaPage_t *) virtualAdr;
+      dmaBus[page+n] = (dmaPage_t *) busAdr;
+      virtualAdr += PAGE_SIZE;
+      busAdr += PAGE_SIZE;
+   }
 
-         if (eventBits & gpioNotify[n].eventBits)
-         {
-            for (b=0; b<=PI_MAX_EVENT; b++)
-            {
-               if (eventBits & gpioNotify[n].eventBits & (1<<b))
-               {
-                  if (numSamples)
-                     newLevel = sample[numSamples-1].level;
-                  else
-                     newLevel = reportedLevel;
+   return 0;
+}
 
-                  report[emit].seqno = seqno;
-                  report[emit].flags = 
-                     PI_NTFY_FLAGS_EVENT | PI_NTFY_FLAGS_BIT(b);
-                  report[emit].tick  = eTick;
-                  report[emit].level = newLevel;
+/* ----------------------------------------------------------------------- */
 
-                  emit++;
-                  seqno++;
-               }
-            }
-         }
+static int initAllocDMAMem(void)
+{
+   int i, servoCycles, superCycles;
+   int status;
 
-         if (!emit)
-         {
-            if ((int)(eTick - gpioNotify[n].lastReportTick) > 60000000)
-            {
-               if (numSamples)
-                  newLevel = sample[numSamples-1].level;
-               else
-                  newLevel = reportedLevel;
+   DBG(DBG_STARTUP, "");
 
-               report[emit].seqno = seqno;
-               report[emit].flags = PI_NTFY_FLAGS_ALIVE;
-               report[emit].tick  = eTick;
-               report[emit].level = newLevel;
+   /* Calculate the number of blocks needed for buffers.  The number
+      of blocks must be a multiple of the 20ms servo cycle.
+   */
 
-               emit++;
-               seqno++;
-            }
-         }
+   servoCycles = gpioCfg.bufferMilliseconds / 20;
+   if           (gpioCfg.bufferMilliseconds % 20) servoCycles++;
 
-         if (emit)
-         {
-            DBG(DBG_FAST_TICK, "notification %d (%d reports, %x-%x)",
-               n, emit, report[0].seqno,  report[emit-1].seqno);
-            gpioNotify[n].lastReportTick = eTick;
-            max_emits = gpioNotify[n].max_emits;
+   bufferCycles = (SUPERCYCLE * servoCycles) / gpioCfg.clockMicros;
 
-            if (emit > gpioStats.maxEmit) gpioStats.maxEmit = emit;
+   superCycles = bufferCycles / SUPERCYCLE;
+   if           (bufferCycles % SUPERCYCLE) superCycles++;
 
-            emitted = 0;
+   bufferCycles = SUPERCYCLE * superCycles;
 
-            while (emit > 0)
-            {
-               if (emit > max_emits)
-               {
-                  gpioStats.emitFrags++;
+   bufferBlocks = bufferCycles / CYCLES_PER_BLOCK;
 
-                  err = write(gpioNotify[n].fd,
-                           report+emitted,
-                           max_emits*sizeof(gpioReport_t));
+   DBG(DBG_STARTUP, "bmillis=%d mics=%d bblk=%d bcyc=%d wblk=%d",
+      gpioCfg.bufferMilliseconds, gpioCfg.clockMicros,
+      bufferBlocks, bufferCycles, gpioCfg.waveBlocks);
 
-                  if (err != (max_emits*sizeof(gpioReport_t)))
-                  {
-                     if (err < 0)
-                     {
-                        if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
-                        {
-                           /* serious error, no point continuing */
+   /* the wave blocks get page pointers now, memory on first use */
 
-                           DBG(DBG_ALWAYS, "fd=%d err=%d errno=%d",
-                              gpioNotify[n].fd, err, errno);
+   dmaBlocks = bufferBlocks + gpioCfg.waveBlocks;
+   dmaMapped = 0;
 
-                           DBG(DBG_ALWAYS, "%s", strerror(errno));
+   /* allocate memory for pointers to virtual and bus memory pages */
 
-                           gpioNotify[n].bits  = 0;
-                           gpioNotify[n].state = PI_NOTIFY_CLOSING;
-                           intNotifyBits();
-                           break;
-                        }
-                        else gpioStats.wouldBlockPipeWrite++;
-                     }
-                     else
-                     {
-                        gpioStats.shortPipeWrite++;
-                        DBG(DBG_ALWAYS, "emitted %zd, asked for %d",
-                           err/sizeof(gpioReport_t), max_emits);
-                     }
-                  }
-                  else
-                  {
-                     gpioStats.goodPipeWrite++;
-                  }
+   dmaVirt = mmap(
+       0, PAGES_PER_BLOCK*dmaBlocks*sizeof(dmaPage_t *),
+       PROT_READ|PROT_WRITE,
+       MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED,
+       -1, 0);
 
-                  emitted += max_emits;
-                  emit    -= max_emits;
-               }
-               else
-               {
-                  err = write(gpioNotify[n].fd,
-                           report+emitted,
-                           emit*sizeof(gpioReport_t));
+   if (dmaVirt == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap dma virtual failed (%m)");
 
-                  if (err != (emit*sizeof(gpioReport_t)))
-                  {
-                     if (err < 0)
-                     {
-                        if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
-                        {
-                           DBG(DBG_ALWAYS, "fd=%d err=%d errno=%d",
-                              gpioNotify[n].fd, err, errno);
+   dmaBus = mmap(
+       0, PAGES_PER_BLOCK*dmaBlocks*sizeof(dmaPage_t *),
+       PROT_READ|PROT_WRITE,
+       MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED,
+       -1, 0);
 
-                           DBG(DBG_ALWAYS, "%s", strerror(errno));
+   if (dmaBus == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap dma bus failed (%m)");
 
-                           /* serious error, no point continuing */
-                           gpioNotify[n].bits  = 0;
-                           gpioNotify[n].state = PI_NOTIFY_CLOSING;
-                           intNotifyBits();
-                           break;
-                        }
-                        else gpioStats.wouldBlockPipeWrite++;
-                     }
-                     else
-                     {
-                        gpioStats.shortPipeWrite++;
-                        DBG(DBG_ALWAYS, "emitted %zd, asked for %d",
-                           err/sizeof(gpioReport_t), emit);
-                     }
-                  }
-                  else
-                  {
-                     gpioStats.goodPipeWrite++;
-                  }
+   dmaIVirt = (dmaIPage_t **) dmaVirt;
+   dmaIBus  = (dmaIPage_t **) dmaBus;
 
-                  emitted += emit;
-                  emit = 0;
-               }
-            }
+   dmaOVirt = (dmaOPage_t **)(dmaVirt + (PAGES_PER_BLOCK*bufferBlocks));
+   dmaOBus  = (dmaOPage_t **)(dmaBus  + (PAGES_PER_BLOCK*bufferBlocks));
+
+   if ((gpioCfg.memAllocMode == PI_MEM_ALLOC_PAGEMAP) ||
+       ((gpioCfg.memAllocMode == PI_MEM_ALLOC_AUTO) &&
+        (gpioCfg.bufferMilliseconds > PI_DEFAULT_BUFFER_MILLIS)))
+   {
+      /* pagemap allocation of DMA memory */
+
+      dmaPMapBlk = mmap(
+          0, dmaBlocks*sizeof(dmaPage_t *),
+          PROT_READ|PROT_WRITE,
+          MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED,
+          -1, 0);
+
+      if (dmaPMapBlk == MAP_FAILED)
+         SOFT_ERROR(PI_INIT_FAILED, "pagemap mmap block failed (%m)");
+
+      fdPmap = open("/proc/self/pagemap", O_RDONLY);
+
+      if (fdPmap < 0)
+         SOFT_ERROR(PI_INIT_FAILED, "pagemap open failed(%m)");
+
+      for (i=0; i<bufferBlocks; i++)
+      {
+         status = initPagemapBlock(i);
+         if (status < 0)
+         {
+            close(fdPmap);
+            return status;
+         }
+         dmaMapped++;
+      }
+
+      close(fdPmap);
+
+      DBG(DBG_STARTUP, "dmaPMapBlk=%08"PRIXPTR" dmaIn=%08"PRIXPTR,
+         (uintptr_t)dmaPMapBlk, (uintptr_t)dmaIn);
+   }
+   else
+   {
+      /* mailbox allocation of DMA memory */
+
+      dmaMboxBlk = mmap(
+          0, dmaBlocks*sizeof(DMAMem_t),
+          PROT_READ|PROT_WRITE,
+          MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED,
+          -1, 0);
+
+      if (dmaMboxBlk == MAP_FAILED)
+         SOFT_ERROR(PI_INIT_FAILED, "mmap mbox block failed (%m)");
 
-            gpioNotify[n].seqno = seqno;
-         }
-      }
-   }
+      fdMbox = mbOpen();
 
-   if (changedBits & scriptBits)
-   {
-      for (n=0; n<PI_MAX_SCRIPTS; n++)
+      if (fdMbox < 0)
+         SOFT_ERROR(PI_INIT_FAILED, "mbox open failed(%m)");
+
+      for (i=0; i<bufferBlocks; i++)
       {
-         if ((gpioScript[n].state     == PI_SCRIPT_IN_USE)  &&
-             (gpioScript[n].run_state == PI_SCRIPT_WAITING) &&
-             (gpioScript[n].waitBits & changedBits))
+         status = initMboxBlock(i);
+         if (status < 0)
          {
-            pthread_mutex_lock(&gpioScript[n].pthMutex);
-
-            if (gpioScript[n].run_state == PI_SCRIPT_WAITING)
-            {
-               gpioScript[n].changedBits =
-                  gpioScript[n].waitBits & changedBits;
-               pthread_cond_signal(&gpioScript[n].pthCond);
-            }
-
-            pthread_mutex_unlock(&gpioScript[n].pthMutex);
+            mbClose(fdMbox);
+            return status;
          }
+         dmaMapped++;
       }
+
+      mbClose(fdMbox);
+
+      DBG(DBG_STARTUP, "dmaMboxBlk=%08"PRIXPTR" dmaIn=%08"PRIXPTR,
+         (uintptr_t)dmaMboxBlk, (uintptr_t)dmaIn);
    }
 
-   if (eventBits & scriptEventBits)
+   if (gpioCfg.spiDMABytes)
    {
-      for (n=0; n<PI_MAX_SCRIPTS; n++)
-      {
-         if ((gpioScript[n].state     == PI_SCRIPT_IN_USE)  &&
-             (gpioScript[n].run_state == PI_SCRIPT_WAITING) &&
-             (gpioScript[n].eventBits & eventBits))
-         {
-            pthread_mutex_lock(&gpioScript[n].pthMutex);
+      /* SPI DMA always uses the mailbox, the buffers must be contiguous */
 
-            if (gpioScript[n].run_state == PI_SCRIPT_WAITING)
-            {
-               gpioScript[n].changedBits =
-                  gpioScript[n].eventBits & eventBits;
-               pthread_cond_signal(&gpioScript[n].pthCond);
-            }
+      fdMbox = mbOpen();
 
-            pthread_mutex_unlock(&gpioScript[n].pthMutex);
-         }
-      }
-   }
+      if (fdMbox < 0)
+         SOFT_ERROR(PI_INIT_FAILED, "mbox open failed(%m)");
 
-   if (numSamples) reportedLevel = sample[numSamples-1].level;
-}
+      status = mbDMAAlloc(&spiDMAMem, SPI_DMA_MEM, pi_mem_flag);
 
-static void alertWdogCheck(gpioSample_t *sample, int numSamples)
-{
-   /*
-   Go through and set the last time each GPIO with a watchdog changed state.
-   */
+      mbClose(fdMbox);
 
-   int i, j;
-   uint32_t LBitV;
-   uint32_t bit;
+      if (!status) SOFT_ERROR(PI_INIT_FAILED, "SPI DMA memory failed");
 
-   for (i=0; i<=PI_MAX_USER_GPIO; i++)
-   {
-      bit = (1<<i);
+      initKillDMA(dmaSpiTx);
+      initKillDMA(dmaSpiRx);
 
-      if (monitorBits & bit & wdogBits)
-      {
-         LBitV = gpioAlert[i].wdLBitV;
+      DBG(DBG_STARTUP, "SPI DMA tx=%d rx=%d bus=%08"PRIXPTR,
+         gpioCfg.spiDMATx, gpioCfg.spiDMARx, spiDMAMem.bus_addr);
+   }
 
-         for (j=0; j<numSamples; j++)
-         {
-            if ((sample[j].level & bit) != LBitV)
-            {
-               LBitV = sample[j].level & bit;
-               gpioAlert[i].wdTick = sample[j].tick;
-            }
-         }
+   DBG(DBG_STARTUP,
+      "gpioReg=%08"PRIXPTR" pwmReg=%08"PRIXPTR" pcmReg=%08"PRIXPTR" clkReg=%08"PRIXPTR" auxReg=%08"PRIXPTR,
+      (uintptr_t)gpioReg, (uintptr_t)pwmReg,
+      (uintptr_t)pcmReg,  (uintptr_t)clkReg, (uintptr_t)auxReg);
 
-         gpioAlert[i].wdLBitV = LBitV;
-      }
+   for (i=0; i<DMAI_PAGES; i++)
+      DBG(DBG_STARTUP, "dmaIBus[%d]=%08"PRIXPTR, i, (uintptr_t)dmaIBus[i]);
+
+   if (gpioCfg.dbgLevel >= DBG_DMACBS)
+   {
+      fprintf(stderr, "*** INPUT DMA CONTROL BLOCKS ***\n");
+      for (i=0; i<NUM_CBS; i++) dmaCbPrint(i);
    }
+
+   return 0;
 }
 
-static void * pthAlertThread(void *x)
+/* ----------------------------------------------------------------------- */
+
+/* ----------------------------------------------------------------------- */
+
+static void waveTableFree(void)
 {
-   struct timespec req, rem;
-   uint32_t oldLevel, newLevel, level;
-   uint32_t oldSlot,  newSlot;
-   uint32_t expected, ft, sTick;
-   uint32_t changedBits;
-   int32_t diff, minDiff, stickInited;
-   int cycle, pulse;
-   int numSamples, ticks, i;
-   int rp, reports, totalSamples;
-   int stopped;
-   int moreToDo;
-   gpioSample_t sample[MAX_SAMPLE];
+   int i;
 
-   req.tv_sec = 0;
+   if (waveKept)
+   {
+      for (i=0; i<waveMax; i++) free(waveKept[i]);
+   }
 
-   /* don't start until DMA started */
+   waveSerialFree();
 
-   spinWhileStarting();
+   free(waveInfo);
+   free(waveFreeCB);
+   free(waveFreeOOL);
+   free(waveRefs);
+   free(waveHash);
+   free(waveKeptLen);
+   free(waveKept);
+   free(waveWork);
+   free(wavePins);
 
-   reportedLevel = gpioReg[GPLEV0];
+   waveInfo    = NULL;
+   waveFreeCB  = NULL;
+   waveFreeOOL = NULL;
+   waveRefs    = NULL;
+   waveHash    = NULL;
+   waveKeptLen = NULL;
+   waveKept    = NULL;
+   waveWork    = NULL;
+   wavePins    = NULL;
 
-   oldLevel = reportedLevel;
+   waveMax = 0;
 
-   oldSlot = dmaCurrentSlot(dmaNowAtICB());
+   waveMemReady = 0;
+}
 
-   oldSlot = (oldSlot / PULSE_PER_CYCLE) * PULSE_PER_CYCLE;
+/* ----------------------------------------------------------------------- */
 
-   cycle = (oldSlot/PULSE_PER_CYCLE);
+static int initWaveMem(void)
+{
+   /*
+      The wave table and the wave DMA pages, allocated by the first
+      wave function called so programs which never use waves don't
+      pay for them.  The simulator provides its own pages.
+   */
 
-   pulse = 0;
+   int i, n, status;
 
-   stopped = 0;
+   if (waveMemReady) return 0;
 
-   moreToDo = 0;
+   DBG(DBG_STARTUP, "wave blocks=%d waves=%d",
+      gpioCfg.waveBlocks, gpioCfg.maxWaves);
 
-   stickInited = 0;
+   if (!gpioCfg.waveBlocks)
+      SOFT_ERROR(PI_NO_WAVE_MEMORY, "no wave memory configured");
 
-   sTick = 0;
+   if (!waveInfo)
+   {
+      n = gpioCfg.maxWaves;
 
-   minDiff = gpioCfg.clockMicros / 2;
+      waveInfo    = calloc(n,     sizeof(rawWaveInfo_t));
+      waveFreeCB  = calloc(n + 1, sizeof(waveSpan_t));
+      waveFreeOOL = calloc(n + 1, sizeof(waveSpan_t));
+      waveRefs    = calloc(n,     sizeof(uint32_t));
+      waveHash    = calloc(n,     sizeof(uint32_t));
+      waveKeptLen = calloc(n,     sizeof(int));
+      waveKept    = calloc(n,     sizeof(rawWave_t *));
+      waveWork    = calloc(5 * n, sizeof(int));
+      wavePins    = calloc(2 * n, sizeof(waveSpan_t));
 
-   while (1)
+      if (!waveInfo || !waveFreeCB || !waveFreeOOL || !waveRefs ||
+          !waveHash || !waveKeptLen || !waveKept || !waveWork || !wavePins)
+      {
+         waveTableFree();
+         SOFT_ERROR(PI_NO_WAVE_MEMORY, "can't allocate wave table");
+      }
+
+      waveMax = n;
+   }
+
+   if (!waveSimOpen)
    {
-      /* Check that DMA is running okay */
+      /* a failed attempt is carried on by the next */
 
-      if (dmaIn[DMA_CONBLK_AD])
+      if (dmaPMapBlk != MAP_FAILED)
       {
-         if (stopped)
+         fdPmap = open("/proc/self/pagemap", O_RDONLY);
+
+         if (fdPmap < 0)
+            SOFT_ERROR(PI_NO_WAVE_MEMORY, "pagemap open failed(%m)");
+
+         for (i=dmaMapped; i<dmaBlocks; i++)
          {
-            DBG(DBG_STARTUP, "****** GOING ******");
-            stopped = 0;
+            status = initPagemapBlock(i);
+            if (status < 0) break;
+            dmaMapped++;
          }
+
+         close(fdPmap);
       }
       else
       {
-         stopped = 1;
+         fdMbox = mbOpen();
 
-         myGpioDelay(5000);
+         if (fdMbox < 0)
+            SOFT_ERROR(PI_NO_WAVE_MEMORY, "mbox open failed(%m)");
 
-         if (runState == PI_RUNNING)
+         for (i=dmaMapped; i<dmaBlocks; i++)
          {
-            /* should never be executed, leave code just in case */
-
-            gpioCfg.internals |= PI_CFG_STATS;
-
-            dmaInitCbs();
-            flushMemory();
-            //cast twice to suppress compiler warning, I belive this cast is ok
-            //because dmaIbus contains bus addresses, not user addresses. --plugwash
-            initDMAgo((uint32_t *)dmaIn, (uint32_t)(uintptr_t)dmaIBus[0]);
-            myGpioDelay(5000); /* let DMA run for a while */
-            oldSlot = dmaCurrentSlot(dmaNowAtICB());
-            gpioStats.DMARestarts++;
+            status = initMboxBlock(i);
+            if (status < 0) break;
+            dmaMapped++;
          }
+
+         mbClose(fdMbox);
       }
 
-      newSlot = dmaCurrentSlot(dmaNowAtICB());
+      if (dmaMapped < dmaBlocks)
+         SOFT_ERROR(PI_NO_WAVE_MEMORY, "can't allocate wave DMA memory");
+   }
 
-      newSlot = (newSlot / PULSE_PER_CYCLE) * PULSE_PER_CYCLE;
+   waveMemReady = 1;
 
-      numSamples = 0;
+   waveFreeReset();
 
-      /*
-      Extract samples from DMA ring buffer.
-      */
+   wfStats.maxCbs = DMAO_PAGES * CBS_PER_OPAGE;
 
-      while ((oldSlot != newSlot) && (numSamples < MAX_SAMPLE))
-      {
-         level = myGetLevel(oldSlot++);
+   return 0;
+}
 
-         sample[numSamples].tick  = sTick;
-         sample[numSamples].level = level;
+static void initPWM(unsigned bits)
+{
+   DBG(DBG_STARTUP, "bits=%d", bits);
 
-         numSamples++;
+   /* reset PWM */
 
-         sTick += gpioCfg.clockMicros;
+   pwmReg[PWM_CTL] = 0;
 
-         if (++pulse >= PULSE_PER_CYCLE)
-         {
-            pulse = 0;
+   myGpioDelay(10);
 
-            if (++cycle >= bufferCycles)
-            {
-               cycle = 0;
-               oldSlot = 0;
-            }
+   pwmReg[PWM_STA] = -1;
 
-            expected = sTick;
+   myGpioDelay(10);
 
-            sTick = myGetTick(cycle);
+   /* set number of bits to transmit */
 
-            if (stickInited)
-            {
-               diff = sTick - expected;
+   pwmReg[PWM_RNG1] = bits;
 
-               if (abs(diff) > minDiff)
-               {
-                  ft = sample[numSamples-PULSE_PER_CYCLE].tick;
+   myGpioDelay(10);
 
-                  ticks = sTick - ft;
+   dmaIVirt[0]->periphData = 1;
 
-                  for (i=1; i<PULSE_PER_CYCLE; i++)
-                  {
-                     sample[numSamples-PULSE_PER_CYCLE+i].tick =
-                        ((i*ticks)/PULSE_PER_CYCLE) + ft;
-                  }
-               }
+   /* enable PWM DMA, raise panic and dreq thresholds to 15 */
 
-               diff += (TICKSLOTS/2);
+   pwmReg[PWM_DMAC] = PWM_DMAC_ENAB      |
+                      PWM_DMAC_PANIC(15) |
+                      PWM_DMAC_DREQ(15);
+
+   myGpioDelay(10);
+
+   /* clear PWM fifo */
+
+   pwmReg[PWM_CTL] = PWM_CTL_CLRF1;
+
+   myGpioDelay(10);
+
+   /* enable PWM channel 1 and use fifo */
+
+   pwmReg[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_MODE1 | PWM_CTL_PWEN1;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void initPCM(unsigned bits)
+{
+   DBG(DBG_STARTUP, "bits=%d", bits);
+
+   /* disable PCM so we can modify the regs */
+
+   pcmReg[PCM_CS] = 0;
+
+   myGpioDelay(1000);
+
+   pcmReg[PCM_FIFO]   = 0;
+   pcmReg[PCM_MODE]   = 0;
+   pcmReg[PCM_RXC]    = 0;
+   pcmReg[PCM_TXC]    = 0;
+   pcmReg[PCM_DREQ]   = 0;
+   pcmReg[PCM_INTEN]  = 0;
+   pcmReg[PCM_INTSTC] = 0;
+   pcmReg[PCM_GRAY]   = 0;
 
-               if (diff < 0)
-               {
-                  gpioStats.diffTick[0]++;
-               }
+   myGpioDelay(1000);
 
-               else if (diff >= TICKSLOTS)
-               {
-                  gpioStats.diffTick[TICKSLOTS-1]++;
-               }
+   pcmReg[PCM_MODE] = PCM_MODE_FLEN(bits-1); /* # bits in frame */
 
-               else gpioStats.diffTick[diff]++;
-            }
-            else
-            {
-               stickInited = 1;
-               numSamples = 0;
-               if (!(gpioCfg.ifFlags & PI_DISABLE_ALERT))
-               {
-                  pthAlertRunning = PI_THREAD_RUNNING;
-               }
-            }
-         }
-      }
+   /* enable channel 1 with # bits width */
 
-      if (oldSlot == newSlot) moreToDo = 0; else moreToDo = 1;
+   pcmReg[PCM_TXC] = PCM_TXC_CH1EN | PCM_TXC_CH1WID(bits-8);
 
-      /* Apply glitch filter */
+   pcmReg[PCM_CS] |= PCM_CS_STBY; /* clear standby */
 
-      if (numSamples && gFilterBits) alertGlitchFilter(sample, numSamples);
+   myGpioDelay(1000);
 
-      /* Apply noise filter */
+   pcmReg[PCM_CS] |= PCM_CS_TXCLR; /* clear TX FIFO */
 
-      if (numSamples && nFilterBits) alertNoiseFilter(sample, numSamples);
+   pcmReg[PCM_CS] |= PCM_CS_DMAEN; /* enable DREQ */
 
-      /* Compact samples */
+   pcmReg[PCM_DREQ] = PCM_DREQ_TX_PANIC(16) | PCM_DREQ_TX_REQ_L(30);
 
-      changedBits = 0;
-      oldLevel &= monitorBits;
-      reports = 0;
-      totalSamples = 0;
+   pcmReg[PCM_INTSTC] = 0b1111; /* clear status bits */
 
-      for (rp=0; rp<numSamples; rp++)
-      {
-         newLevel = (sample[rp].level & monitorBits);
+   /* enable PCM */
 
-         if (newLevel != oldLevel)
-         {
-            sample[reports].tick  = sample[rp].tick;
-            sample[reports].level = sample[rp].level;
-            changedBits |= (newLevel ^ oldLevel);
-            oldLevel = newLevel;
+   pcmReg[PCM_CS] |= PCM_CS_EN;
 
-            reports++;
+   /* enable tx */
 
-            if (reports >= MAX_REPORT)
-            {
-               totalSamples += reports;
+   pcmReg[PCM_CS] |= PCM_CS_TXON;
 
-               /* Rebase watchdog timeouts */
-               if (wdogBits) alertWdogCheck(sample, reports);
+   dmaIVirt[0]->periphData = 0x0F;
+}
 
-               gpioStats.numSamples += reports;
+/* ----------------------------------------------------------------------- */
 
-               alertEmit(sample, reports, changedBits, sample[rp].tick);
+static void initHWClk
+   (int clkCtl, int clkDiv, int clkSrc, int divI, int divF, int MASH)
+{
+   DBG(DBG_INTERNAL, "ctl=%d div=%d src=%d /I=%d /f=%d M=%d",
+      clkCtl, clkDiv, clkSrc, divI, divF, MASH);
 
-               changedBits = 0;
-               reports = 0;
-            }
-         }
-      }
+   /* kill the clock if busy, anything else isn't reliable */
 
-      if (reports)
+   if (clkReg[clkCtl] & CLK_CTL_BUSY)
+   {
+      do
       {
-         totalSamples += reports;
+         clkReg[clkCtl] = BCM_PASSWD | CLK_CTL_KILL;
+      }
+      while (clkReg[clkCtl] & CLK_CTL_BUSY);
+   }
 
-         /* Rebase watchdog timeouts */
-         if (wdogBits) alertWdogCheck(sample, reports);
+   clkReg[clkDiv] = (BCM_PASSWD | CLK_DIV_DIVI(divI) | CLK_DIV_DIVF(divF));
 
-         gpioStats.numSamples += reports;
-      }
+   usleep(10);
 
-      alertEmit(sample, reports, changedBits, sTick);
-      reportedLevel = sample[numSamples -1].level;
+   clkReg[clkCtl] = (BCM_PASSWD | CLK_CTL_MASH(MASH) | CLK_CTL_SRC(clkSrc));
 
-      if (totalSamples > gpioStats.maxSamples)
-         gpioStats.maxSamples = numSamples;
+   usleep(10);
 
-      req.tv_sec = 0;
-      req.tv_nsec = alert_delays[(gpioCfg.internals>>PI_CFG_ALERT_FREQ)&15];
+   clkReg[clkCtl] |= (BCM_PASSWD | CLK_CTL_ENAB);
+}
 
-      if (moreToDo)
-      {
-         gpioStats.moreToDo++;
-      }
-      else
-      {
-         gpioStats.alertTicks++;
+static void initClock(int mainClock)
+{
+   const unsigned BITS=10;
+   int clockPWM;
+   unsigned clkCtl, clkDiv, clkSrc, clkDivI, clkDivF, clkMash, clkBits;
+   char *per;
+   unsigned micros;
 
-         while (nanosleep(&req, &rem))
-         {
-            req.tv_sec  = rem.tv_sec;
-            req.tv_nsec = rem.tv_nsec;
-         }
-      }
-   }
+   DBG(DBG_STARTUP, "mainClock=%d", mainClock);
 
-   return 0;
-}
+   if (mainClock) micros = gpioCfg.clockMicros;
+   else           micros = PI_WF_MICROS;
 
-/* ======================================================================= */
+   clockPWM = mainClock ^ (gpioCfg.clockPeriph == PI_CLOCK_PCM);
 
-static int scrPop(gpioScript_t *s, int *SP, int *S)
-{
-   if ((*SP) > 0)
+   if (clockPWM)
    {
-      return S[--(*SP)];
+      clkCtl = CLK_PWMCTL;
+      clkDiv = CLK_PWMDIV;
+      per = "PWM";
    }
    else
    {
-      s->run_state = PI_SCRIPT_FAILED;
-      DBG(DBG_ALWAYS, "script %d too many pops", s->id);
-      return 0;
+      clkCtl = CLK_PCMCTL;
+      clkDiv = CLK_PCMDIV;
+      per = "PCM";
    }
-}
 
-/* ----------------------------------------------------------------------- */
+   clkSrc  = CLK_CTL_SRC_PLLD;
+   clkDivI = clk_plld_freq / (10000000 / micros); /* 10 MHz - 1 MHz */ 
+   clkBits = BITS;        /* 10/BITS MHz - 1/BITS MHz */
+   clkDivF = 0;
+   clkMash = 0;
 
-static void scrPush(gpioScript_t *s, int *SP, int *S, int val)
+   DBG(DBG_STARTUP, "%s PLLD divi=%d divf=%d mash=%d bits=%d",
+      per, clkDivI, clkDivF, clkMash, clkBits);
+
+   initHWClk(clkCtl, clkDiv, clkSrc, clkDivI, clkDivF, clkMash);
+
+   if (clockPWM) initPWM(BITS);
+   else          initPCM(BITS);
+
+   myGpioDelay(2000);
+}
+
+static void initKillDMA(volatile uint32_t *dmaAddr)
 {
-   if ((*SP) < PI_SCRIPT_STACK_SIZE)
-   {
-      S[(*SP)++] = val;
-   }
-   else
-   {
-      s->run_state = PI_SCRIPT_FAILED;
-      DBG(DBG_ALWAYS, "script %d too many pushes", s->id);
-   }
+   dmaAddr[DMA_CS] = DMA_CHANNEL_ABORT;
+   dmaAddr[DMA_CS] = 0;
+   dmaAddr[DMA_CS] = DMA_CHANNEL_RESET;
+
+   dmaAddr[DMA_CONBLK_AD] = 0;
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void scrSwap(int *v1, int *v2)
+static void initDMAgo(volatile uint32_t  *dmaAddr, uint32_t cbAddr)
 {
-   int t;
+   DBG(DBG_STARTUP, "");
 
-   t=*v1; *v1=*v2; *v2= t;
+   initKillDMA(dmaAddr);
+
+   dmaAddr[DMA_CS] = DMA_INTERRUPT_STATUS | DMA_END_FLAG;
+
+   dmaAddr[DMA_CONBLK_AD] = cbAddr;
+
+   /* clear READ/FIFO/READ_LAST_NOT_SET error bits */
+
+   dmaAddr[DMA_DEBUG] = DMA_DEBUG_READ_ERR            |
+                        DMA_DEBUG_FIFO_ERR            |
+                        DMA_DEBUG_RD_LST_NOT_SET_ERR;
+
+
+   dmaAddr[DMA_CS] = DMA_WAIT_ON_WRITES    |
+                     DMA_PANIC_PRIORITY(8) |
+                     DMA_PRIORITY(8)       |
+                     DMA_ACTIVE;
 }
 
 /* ----------------------------------------------------------------------- */
 
-static int scrEvtWait(gpioScript_t *s, uint32_t bits)
+static void initClearGlobals(void)
 {
-   pthread_mutex_lock(&s->pthMutex);
+   pthread_condattr_t condAttr;
+   int i;
 
-   if (s->request == PI_SCRIPT_RUN)
+   DBG(DBG_STARTUP, "");
+
+   alertBits   = 0;
+   serialRxBits = 0;
+   monitorBits = 0;
+   notifyBits  = 0;
+   scriptBits  = 0;
+   gFilterBits = 0;
+   nFilterBits = 0;
+   wdogBits    = 0;
+
+   pthAlertRunning  = PI_THREAD_NONE;
+   pthFifoRunning   = PI_THREAD_NONE;
+   pthFifoBinRunning = PI_THREAD_NONE;
+   pthSocketRunning = PI_THREAD_NONE;
+   pthTimerRunning  = PI_THREAD_NONE;
+   pthISRRunning    = PI_THREAD_NONE;
+
+   wfc[0] = 0;
+   wfc[1] = 0;
+   wfc[2] = 0;
+
+   wfcur=0;
+
+   waveFreeReset();
+   waveCacheReset();
+   for (i=0; i<PI_MAX_WAVE_SLOTS; i++) waveSlotFree(i);
+   waveStreamFree();
+   waveOutCount = 0;
+
+   wfStats.micros     = 0;
+   wfStats.highMicros = 0;
+   wfStats.maxMicros  = PI_WAVE_MAX_MICROS;
+
+   wfStats.pulses     = 0;
+   wfStats.highPulses = 0;
+   wfStats.maxPulses  = PI_WAVE_MAX_PULSES;
+
+   wfStats.cbs        = 0;
+   wfStats.highCbs    = 0;
+   wfStats.maxCbs     = DMAO_PAGES * CBS_PER_OPAGE;
+
+   gpioGetSamples.func     = NULL;
+   gpioGetSamples.ex       = 0;
+   gpioGetSamples.userdata = NULL;
+   gpioGetSamples.bits     = 0;
+
+   /* serial read waits, timers and I2C waits use the monotonic clock */
+
+   pthread_condattr_init(&condAttr);
+   pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+
+   for (i=0; i<=PI_MAX_USER_GPIO; i++)
    {
-      s->run_state = PI_SCRIPT_WAITING;
-      s->eventBits = bits;
-      intScriptEventBits();
+      wfRx[i].mode      = PI_WFRX_NONE;
+      pthread_mutex_init(&wfRx[i].mutex, NULL);
+      pthread_cond_init(&wfRx[i].cond, &condAttr);
+      gpioAlert[i].func = NULL;
+   }
 
-      pthread_cond_wait(&s->pthCond, &s->pthMutex);
+   pthread_cond_init(&timerCond, &condAttr);
+   pthread_cond_init(&timerIdle, NULL);
+   pthread_cond_init(&isrIdle, NULL);
+   pthread_cond_init(&i2cAsyncDone, &condAttr);
+
+   for (i=0; i<I2C_WORKERS; i++)
+   {
+      i2cWorker[i].bus = -1;
+      i2cWorker[i].running = 0;
+      pthread_cond_init(&i2cWorker[i].cond, NULL);
+   }
 
-      s->waitBits = 0;
-      intScriptEventBits();
-      s->run_state = PI_SCRIPT_RUNNING;
+   for (i=0; i<I2C_REQUESTS; i++)
+   {
+      i2cRequest[i].state = I2C_REQ_FREE;
+      i2cRequest[i].copy = NULL;
    }
 
-   pthread_mutex_unlock(&s->pthMutex);
+   i2cAsyncStop = 0;
 
-   return s->changedBits;
-}
+   pthread_condattr_destroy(&condAttr);
 
-/* ----------------------------------------------------------------------- */
+   for (i=0; i<PI_ACQ_SLOTS; i++)
+   {
+      acqInfo[i].state = ACQ_CLOSED;
+      acqInfo[i].ring = NULL;
+   }
 
-static int scrWait(gpioScript_t *s, uint32_t bits)
-{
-   pthread_mutex_lock(&s->pthMutex);
+   for (i=0; i<=PI_MAX_GPIO; i++)
+   {
+      gpioInfo [i].is      = GPIO_UNDEFINED;
+      gpioInfo [i].width   = 0;
+      gpioInfo [i].range   = PI_DEFAULT_DUTYCYCLE_RANGE;
+      gpioInfo [i].freqIdx = DEFAULT_PWM_IDX;
+   }
 
-   if (s->request == PI_SCRIPT_RUN)
+   for (i=0; i<PI_NOTIFY_SLOTS; i++)
    {
-      s->run_state = PI_SCRIPT_WAITING;
-      s->waitBits = bits;
-      intScriptBits();
+      gpioNotify[i].seqno = 0;
+      gpioNotify[i].state = PI_NOTIFY_CLOSED;
+   }
 
-      pthread_cond_wait(&s->pthCond, &s->pthMutex);
+   for (i=0; i<=PI_MAX_SIGNUM; i++)
+   {
+      gpioSignal[i].func     = NULL;
+      gpioSignal[i].ex       = 0;
+      gpioSignal[i].userdata = NULL;
+   }
 
-      s->waitBits = 0;
-      intScriptBits();
-      s->run_state = PI_SCRIPT_RUNNING;
+   for (i=0; i<=PI_MAX_TIMER; i++) gpioTimerId[i] = -1;
+
+   for (i=0; i<PI_TIMER_SLOTS; i++)
+   {
+      gpioTimer[i].next  = NULL;
+      gpioTimer[i].pprev = NULL;
+      gpioTimer[i].used  = 0;
    }
 
-   pthread_mutex_unlock(&s->pthMutex);
+   memset(timerWheel, 0, sizeof(timerWheel));
+   memset(timerOccupied, 0, sizeof(timerOccupied));
 
-   return s->changedBits;
-}
+   timerOverflow = NULL;
+   timerDue      = NULL;
+   timerNow      = 0;
+   timerSleep    = ~0ULL;
+   timerActive   = -1;
+   timerStop     = 0;
 
-/* ----------------------------------------------------------------------- */
+   isrBits       = 0;
+   isrActive     = -1;
+   isrStop       = 0;
 
-static int scrSys(char *cmd, uint32_t p1, uint32_t p2)
-{
-   char buf[1024];
-   int status;
+   for (i=0; i<=PI_MAX_EVENT; i++)
+   {
+      eventAlert[i].func      = NULL;
+      eventAlert[i].ignore    = 0;
+      eventAlert[i].fired     = 0;
+   }
 
-   if (!myScriptNameValid(cmd))
-      SOFT_ERROR(PI_BAD_SCRIPT_NAME, "bad script name (%s)", cmd);
+   /* calculate the usable PWM frequencies */
 
-   snprintf(buf, sizeof(buf), "/opt/pigpio/cgi/%s %u %u", cmd, p1, p2);
+   for (i=0; i<PWM_FREQS; i++)
+   {
+      pwmFreq[i]=
+         (1000000.0/
+            ((float)PULSE_PER_CYCLE*gpioCfg.clockMicros*pwmCycles[i]))+0.5;
 
-   DBG(DBG_USER, "%s", buf);
+      DBG(DBG_STARTUP, "f%d is %d", i, pwmFreq[i]);
+   }
 
-   status = system(buf);
+   inpFifo = NULL;
+   outFifo = NULL;
 
-   if (status < 0) status = PI_BAD_SHELL_STATUS;
+   fdBinInp     = -1;
+   fdBinOut     = -1;
 
-   return status;
+   fdLock       = -1;
+   fdMem        = -1;
+   fdSock       = -1;
+   fdISR        = -1;
+   fdISRWake    = -1;
+   fdGpioChip   = -1;
+
+   dmaMboxBlk = MAP_FAILED;
+   dmaPMapBlk = MAP_FAILED;
+   dmaVirt = MAP_FAILED;
+   dmaBus  = MAP_FAILED;
+
+   auxReg  = MAP_FAILED;
+   clkReg  = MAP_FAILED;
+   dmaReg  = MAP_FAILED;
+   gpioReg = MAP_FAILED;
+   pcmReg  = MAP_FAILED;
+   pwmReg  = MAP_FAILED;
+   systReg = MAP_FAILED;
+   spiReg  = MAP_FAILED;
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void *pthScript(void *x)
+static void initReleaseResources(void)
 {
-   gpioScript_t *s;
-   cmdInstr_t instr;
-   int p1, p2, p1o, p2o, p3o, *t1, *t2;
-   int PC, A, F, SP;
-   int S[PI_SCRIPT_STACK_SIZE];
-   char buf[CMD_MAX_EXTENSION];
-
+   int i;
 
-   S[0] = 0; /* to prevent compiler warning */
+   DBG(DBG_STARTUP, "");
 
-   s = x;
+   /* shut down running threads */
 
-   while ((volatile int)s->request != PI_SCRIPT_DELETE)
+   for (i=0; i<=PI_MAX_GPIO; i++)
    {
-      pthread_mutex_lock(&s->pthMutex);
-      s->run_state = PI_SCRIPT_HALTED;
-      pthread_cond_wait(&s->pthCond, &s->pthMutex);
-      pthread_mutex_unlock(&s->pthMutex);
+      if (gpioISR[i].inited)
+      {
+         /* release line or unexport GPIO */
 
-      s->run_state = PI_SCRIPT_RUNNING;
+         gpioSetISRFunc(i, 0, 0, NULL);
+      }
+   }
 
-      A  = 0;
-      F  = 0;
-      PC = 0;
-      SP = 0;
+   /* no more acquisition reads, the rings are freed below */
 
-      while (((volatile int)s->request   == PI_SCRIPT_RUN    ) &&
-                           (s->run_state == PI_SCRIPT_RUNNING))
-      {
-         instr = s->script.instr[PC];
+   for (i=0; i<PI_ACQ_SLOTS; i++)
+   {
+      if (acqInfo[i].state == ACQ_RUNNING) gpioTimerCancel(acqInfo[i].timer);
+   }
 
-         p1o = instr.p[1];
-         p2o = instr.p[2];
+   pthread_mutex_lock(&i2cAsyncMutex);
 
-         if      (instr.opt[1] == CMD_VAR) instr.p[1] = s->script.var[p1o];
-         else if (instr.opt[1] == CMD_PAR) instr.p[1] = s->script.par[p1o];
+   i2cAsyncStop = 1;
 
-         if      (instr.opt[2] == CMD_VAR) instr.p[2] = s->script.var[p2o];
-         else if (instr.opt[2] == CMD_PAR) instr.p[2] = s->script.par[p2o];
-/*
-         fprintf(stderr, "PC=%d cmd=%d p1o=%d p1=%d p2o=%d p2=%d\n",
-            PC, instr.p[0], p1o, instr.p[1], p2o, instr.p[2]);
-         fflush(stderr);
-*/
-         if (instr.p[0] < PI_CMD_SCRIPT)
-         {
-            if (instr.p[3])
-            {
-               if ((instr.p[3] == sizeof(int)) && ((instr.opt[3] == CMD_VAR) || (instr.opt[3] == CMD_PAR)))
-               {
-                  /* Hack to allow register use in 3rd parameter */
-                  memcpy((char*)&p3o, (char *)instr.p[4], sizeof(int));
-                  if (instr.opt[3] == CMD_VAR) memcpy(buf, (char *)&(s->script.var[p3o]), sizeof(int));
-                  else                         memcpy(buf, (char *)&(s->script.par[p3o]), sizeof(int));
-               }
-               else
-               {
-                  memcpy(buf, (char *)instr.p[4], instr.p[3]);
-               }
-            }
+   for (i=0; i<I2C_WORKERS; i++) pthread_cond_signal(&i2cWorker[i].cond);
 
-            A = myDoCommand(instr.p, sizeof(buf)-1, buf);
+   pthread_mutex_unlock(&i2cAsyncMutex);
 
-            F = A;
+   for (i=0; i<I2C_WORKERS; i++)
+   {
+      if (i2cWorker[i].running)
+      {
+         /* may be called from a completion callback */
 
-            PC++;
-         }
+         if (pthread_equal(pthread_self(), i2cWorker[i].pth))
+            pthread_detach(i2cWorker[i].pth);
          else
-         {
-            p1 = instr.p[1];
-            p2 = instr.p[2];
-
-            switch (instr.p[0])
-            {
-               case PI_CMD_ADD:   A+=p1; F=A;                     PC++; break;
-
-               case PI_CMD_AND:   A&=p1; F=A;                     PC++; break;
+            pthread_join(i2cWorker[i].pth, NULL);
 
-               case PI_CMD_CALL:  scrPush(s, &SP, S, PC+1);    PC = p1; break;
+         i2cWorker[i].running = 0;
+      }
+   }
 
-               case PI_CMD_CMP:   F=A-p1;                         PC++; break;
+   for (i=0; i<I2C_REQUESTS; i++)
+   {
+      if (i2cRequest[i].copy) free(i2cRequest[i].copy);
+      i2cRequest[i].copy = NULL;
+      i2cRequest[i].state = I2C_REQ_FREE;
+   }
 
-               case PI_CMD_DCR:
-                  if (instr.opt[1] == CMD_PAR)
-                     {--s->script.par[p1o]; F=s->script.par[p1o];}
-                  else
-                     {--s->script.var[p1o]; F=s->script.var[p1o];}
-                  PC++;
-                  break;
+   for (i=0; i<PI_ACQ_SLOTS; i++)
+   {
+      if (acqInfo[i].ring) free(acqInfo[i].ring);
+      acqInfo[i].ring = NULL;
+      acqInfo[i].state = ACQ_CLOSED;
+   }
 
-               case PI_CMD_DCRA:  --A; F=A;                       PC++; break;
+   if (pthISRRunning != PI_THREAD_NONE)
+   {
+      pthread_mutex_lock(&isrMutex);
+      isrStop = 1;
+      pthread_mutex_unlock(&isrMutex);
 
-               case PI_CMD_DIV:   A/=p1; F=A;                     PC++; break;
+      eventfd_write(fdISRWake, 1);
 
-               case PI_CMD_HALT:  s->run_state = PI_SCRIPT_HALTED;      break;
+      /* may be called from an ISR callback */
 
-               case PI_CMD_EVTWT: A=scrEvtWait(s, p1); F=A;       PC++; break;
+      if (pthread_equal(pthread_self(), pthISR)) pthread_detach(pthISR);
+      else                                       pthread_join(pthISR, NULL);
 
-               case PI_CMD_INR:
-                  if (instr.opt[1] == CMD_PAR)
-                     {++s->script.par[p1o]; F=s->script.par[p1o];}
-                  else
-                     {++s->script.var[p1o]; F=s->script.var[p1o];}
-                  PC++;
-                  break;
+      pthISRRunning = PI_THREAD_NONE;
+   }
 
-               case PI_CMD_INRA:  ++A; F=A;                       PC++; break;
+   serReaderStop();
 
-               case PI_CMD_JM:    if (F<0)  PC=p1; else PC++;           break;
+   if (pthTimerRunning != PI_THREAD_NONE)
+   {
+      pthread_mutex_lock(&timerMutex);
+      timerStop = 1;
+      pthread_cond_signal(&timerCond);
+      pthread_mutex_unlock(&timerMutex);
 
-               case PI_CMD_JMP:   PC=p1;                                break;
+      /* may be called from a timer callback */
 
-               case PI_CMD_JNZ:   if (F)    PC=p1; else PC++;           break;
+      if (pthread_equal(pthread_self(), pthTimer)) pthread_detach(pthTimer);
+      else                                         pthread_join(pthTimer, NULL);
 
-               case PI_CMD_JP:    if (F>=0) PC=p1; else PC++;           break;
+      pthTimerRunning = PI_THREAD_NONE;
+   }
 
-               case PI_CMD_JZ:    if (!F)   PC=p1; else PC++;           break;
+   if (pthAlertRunning != PI_THREAD_NONE)
+   {
+      pthread_cancel(pthAlert);
+      pthread_join(pthAlert, NULL);
+      pthAlertRunning = PI_THREAD_NONE;
+   }
 
-               case PI_CMD_LD:
-                  if (instr.opt[1] == CMD_PAR) s->script.par[p1o]=p2;
-                  else                         s->script.var[p1o]=p2;
-                  PC++;
-                  break;
+   if (pthFifoRunning != PI_THREAD_NONE)
+   {
+      pthread_cancel(pthFifo);
+      pthread_join(pthFifo, NULL);
+      pthFifoRunning = PI_THREAD_NONE;
+   }
 
-               case PI_CMD_LDA:   A=p1;                           PC++; break;
+   if (pthFifoBinRunning != PI_THREAD_NONE)
+   {
+      pthread_cancel(pthFifoBin);
+      pthread_join(pthFifoBin, NULL);
+      pthFifoBinRunning = PI_THREAD_NONE;
+   }
 
-               case PI_CMD_LDAB:
-                  if ((p1 >= 0) && (p1 < sizeof(buf))) A = buf[p1];
-                  PC++;
-                  break;
+   if (pthSocketRunning != PI_THREAD_NONE)
+   {
+      pthread_cancel(pthSocket);
+      pthread_join(pthSocket, NULL);
+      pthSocketRunning = PI_THREAD_NONE;
+   }
 
-               case PI_CMD_MLT:   A*=p1; F=A;                     PC++; break;
+   /* release mmap'd memory */
 
-               case PI_CMD_MOD:   A%=p1; F=A;                     PC++; break;
+   if (auxReg  != MAP_FAILED) munmap((void *)auxReg,  AUX_LEN);
+   if (bscsReg != MAP_FAILED) munmap((void *)bscsReg, BSCS_LEN);
+   if (clkReg  != MAP_FAILED) munmap((void *)clkReg,  CLK_LEN);
+   if (dmaReg  != MAP_FAILED) munmap((void *)dmaReg,  DMA_LEN);
+   if (gpioReg != MAP_FAILED) munmap((void *)gpioReg, GPIO_LEN);
+   if (pcmReg  != MAP_FAILED) munmap((void *)pcmReg,  PCM_LEN);
+   if (pwmReg  != MAP_FAILED) munmap((void *)pwmReg,  PWM_LEN);
+   if (systReg != MAP_FAILED) munmap((void *)systReg, SYST_LEN);
+   if (spiReg  != MAP_FAILED) munmap((void *)spiReg,  SPI_LEN);
 
-               case PI_CMD_OR:    A|=p1; F=A;                     PC++; break;
+   auxReg  = MAP_FAILED;
+   bscsReg = MAP_FAILED;
+   clkReg  = MAP_FAILED;
+   dmaReg  = MAP_FAILED;
+   gpioReg = MAP_FAILED;
+   pcmReg  = MAP_FAILED;
+   pwmReg  = MAP_FAILED;
+   systReg = MAP_FAILED;
+   spiReg  = MAP_FAILED;
 
-               case PI_CMD_POP:
-                  if (instr.opt[1] == CMD_PAR)
-                     s->script.par[p1o]=scrPop(s, &SP, S);
-                  else
-                     s->script.var[p1o]=scrPop(s, &SP, S);
-                  PC++;
-                  break;
+   if (dmaBus != MAP_FAILED)
+   {
+      munmap(dmaBus, PAGES_PER_BLOCK*dmaBlocks*sizeof(dmaPage_t *));
+   }
 
-               case PI_CMD_POPA:  A=scrPop(s, &SP, S);            PC++; break;
+   dmaBus = MAP_FAILED;
 
-               case PI_CMD_PUSH:
-                  if (instr.opt[1] == CMD_PAR)
-                     scrPush(s, &SP, S, s->script.par[p1o]);
-                  else
-                     scrPush(s, &SP, S, s->script.var[p1o]);
-                  PC++;
-                  break;
+   if (dmaVirt != MAP_FAILED)
+   {
+      for (i=0; i<PAGES_PER_BLOCK*dmaMapped; i++)
+      {
+         munmap(dmaVirt[i], PAGE_SIZE);
+      }
 
-               case PI_CMD_PUSHA: scrPush(s, &SP, S, A);          PC++; break;
+      munmap(dmaVirt, PAGES_PER_BLOCK*dmaBlocks*sizeof(dmaPage_t *));
+   }
 
-               case PI_CMD_RET:   PC=scrPop(s, &SP, S);                 break;
+   dmaVirt = MAP_FAILED;
 
-               case PI_CMD_RL:
-                  if (instr.opt[1] == CMD_PAR)
-                     {s->script.par[p1o]<<=p2; F=s->script.par[p1o];}
-                  else
-                     {s->script.var[p1o]<<=p2; F=s->script.var[p1o];}
-                  PC++;
-                  break;
+   if (dmaPMapBlk != MAP_FAILED)
+   {
+      for (i=0; i<dmaMapped; i++)
+      {
+         munmap(dmaPMapBlk[i], PAGES_PER_BLOCK*PAGE_SIZE);
+      }
 
-               case PI_CMD_RLA:   A<<=p1; F=A;                    PC++; break;
+      munmap(dmaPMapBlk, dmaBlocks*sizeof(dmaPage_t *));
+   }
 
-               case PI_CMD_RR:
-                  if (instr.opt[1] == CMD_PAR)
-                     {s->script.par[p1o]>>=p2; F=s->script.par[p1o];}
-                  else
-                     {s->script.var[p1o]>>=p2; F=s->script.var[p1o];}
-                  PC++;
-                  break;
+   dmaPMapBlk = MAP_FAILED;
 
-               case PI_CMD_RRA:   A>>=p1; F=A;                    PC++; break;
+   if (dmaMboxBlk != MAP_FAILED)
+   {
+      fdMbox = mbOpen();
 
-               case PI_CMD_STA:
-                  if (instr.opt[1] == CMD_PAR) s->script.par[p1o]=A;
-                  else                         s->script.var[p1o]=A;
-                  PC++;
-                  break;
+      for (i=0; i<dmaMapped; i++)
+      {
+         mbDMAFree(&dmaMboxBlk[dmaMapped-i-1]);
+      }
 
-               case PI_CMD_STAB:
-                  if ((p1 >= 0) && (p1 < sizeof(buf))) buf[p1] = A;
-                  PC++;
-                  break;
+      mbClose(fdMbox);
 
-               case PI_CMD_SUB:   A-=p1; F=A;                     PC++; break;
+      munmap(dmaMboxBlk, dmaBlocks*sizeof(DMAMem_t));
+   }
 
-               case PI_CMD_SYS:
-                  A=scrSys((char*)instr.p[4], A, *(gpioReg + GPLEV0));
-                  F=A;
-                  PC++;
-                  break;
+   dmaMboxBlk = MAP_FAILED;
 
-               case PI_CMD_WAIT:  A=scrWait(s, p1); F=A;          PC++; break;
+   if (spiDMAMem.handle)
+   {
+      fdMbox = mbOpen();
 
-               case PI_CMD_X:
-                  if (instr.opt[1] == CMD_PAR) t1 = &s->script.par[p1o];
-                  else                         t1 = &s->script.var[p1o];
+      mbDMAFree(&spiDMAMem);
 
-                  if (instr.opt[2] == CMD_PAR) t2 = &s->script.par[p2o];
-                  else                         t2 = &s->script.var[p2o];
+      mbClose(fdMbox);
 
-                  scrSwap(t1, t2);
-                  PC++;
-                  break;
+      spiDMAMem.virtual_addr = NULL;
+   }
 
-               case PI_CMD_XA:
-                  if (instr.opt[1] == CMD_PAR)
-                     scrSwap(&s->script.par[p1o], &A);
-                  else
-                     scrSwap(&s->script.var[p1o], &A);
-                  PC++;
-                  break;
+   dmaSpiTx = MAP_FAILED;
+   dmaSpiRx = MAP_FAILED;
 
-               case PI_CMD_XOR:   A^=p1; F=A;                     PC++; break;
+   dmaBlocks = 0;
+   dmaMapped = 0;
 
-            }
-         }
+   waveTableFree();
 
-         if (PC >= s->script.instrs) s->run_state = PI_SCRIPT_HALTED;
+   if (inpFifo != NULL)
+   {
+      fclose(inpFifo);
+      unlink(PI_INPFIFO);
+      inpFifo = NULL;
+   }
 
-      }
+   if (outFifo != NULL)
+   {
+      fclose(outFifo);
+      unlink(PI_OUTFIFO);
+      outFifo = NULL;
+   }
 
-      if ((volatile int)s->request == PI_SCRIPT_HALT)
-         s->run_state = PI_SCRIPT_HALTED;
+   if (fdBinInp != -1)
+   {
+      close(fdBinInp);
+      unlink(PI_INPFIFO_BIN);
+      fdBinInp = -1;
+   }
 
+   if (fdBinOut != -1)
+   {
+      close(fdBinOut);
+      unlink(PI_OUTFIFO_BIN);
+      fdBinOut = -1;
    }
 
-   return 0;
-}
+   if (fdMem != -1)
+   {
+      close(fdMem);
+      fdMem = -1;
+   }
 
-/* ----------------------------------------------------------------------- */
+   if (fdISR != -1)
+   {
+      close(fdISR);
+      fdISR = -1;
+   }
 
-static void * pthTimerTick(void *x)
-{
-   gpioTimer_t *tp;
-   struct timespec req, rem;
+   if (fdISRWake != -1)
+   {
+      close(fdISRWake);
+      fdISRWake = -1;
+   }
 
-   tp = x;
+   if (fdGpioChip != -1)
+   {
+      close(fdGpioChip);
+      fdGpioChip = -1;
+   }
 
-   while (1)
+   if (fdLock != -1)
    {
-      req.tv_sec  = tp->millis / THOUSAND;
-      req.tv_nsec = (tp->millis % THOUSAND) * THOUSAND * THOUSAND;
+      close(fdLock);
+      unlink(PI_LOCKFILE);
+      fdLock = -1;
+   }
 
-      while (nanosleep(&req, &rem))
-      {
-         req.tv_sec  = rem.tv_sec;
-         req.tv_nsec = rem.tv_nsec;
-      }
+   if (fdSock != -1)
+   {
+      close(fdSock);
+      fdSock = -1;
+   }
 
-      if (tp->ex) (tp->func)(tp->userdata);
-      else        (tp->func)();
+   if (fdPmap != -1)
+   {
+      close(fdPmap);
+      fdPmap = -1;
    }
 
-   return 0;
-}
+   if (fdMbox != -1)
+   {
+      close(fdMbox);
+      fdMbox = -1;
+   }
 
-/* ----------------------------------------------------------------------- */
+   gpioStats.DMARestarts = 0;
+   gpioStats.dmaInitCbsCount = 0;
 
+   numSockNetAddr = 0;
+}
 
-static void * pthFifoThread(void *x)
+int initInitialise(void)
 {
-   char buf[CMD_MAX_EXTENSION];
-   int idx, flags, len, res, i;
-   uintptr_t p[CMD_P_ARR];
-   cmdCtlParse_t ctl;
-   uint32_t *param;
-   char v[CMD_MAX_EXTENSION];
+   int i;
+   unsigned rev, model;
+   struct sockaddr_in server;
+   struct sockaddr_in6 server6;
+   char * portStr;
+   unsigned port;
+   struct sched_param param;
+   pthread_attr_t pthAttr;
 
-   myCreatePipe(PI_INPFIFO, 0662);
+   DBG(DBG_STARTUP, "");
 
-   if ((inpFifo = fopen(PI_INPFIFO, "r+")) == NULL)
-      SOFT_ERROR((void*)PI_INIT_FAILED, "fopen %s failed(%m)", PI_INPFIFO);
+   waveClockInited = 0;
+   PWMClockInited = 0;
 
-   myCreatePipe(PI_OUTFIFO, 0664);
+   clock_gettime(CLOCK_REALTIME, &libStarted);
 
-   if ((outFifo = fopen(PI_OUTFIFO, "w+")) == NULL)
-      SOFT_ERROR((void*)PI_INIT_FAILED, "fopen %s failed (%m)", PI_OUTFIFO);
+   rev = gpioHardwareRevision();
 
-   /* set outFifo non-blocking */
+   initClearGlobals();
 
-   flags = fcntl(fileno(outFifo), F_GETFL, 0);
-   fcntl(fileno(outFifo), F_SETFL, flags | O_NONBLOCK);
+   if (initCheckPermitted() < 0) return PI_INIT_FAILED;
 
-   /* don't start until DMA started */
+   fdLock = initGrabLockFile();
 
-   spinWhileStarting();
+   if (fdLock < 0)
+      SOFT_ERROR(PI_INIT_FAILED, "Can't lock %s", PI_LOCKFILE);
 
-   while (1)
+   if (!gpioMaskSet)
    {
-      if (fgets(buf, sizeof(buf), inpFifo) == NULL)
-         SOFT_ERROR((void*)PI_INIT_FAILED, "fifo fgets failed (%m)");
+      if      (rev ==  0) gpioMask = PI_DEFAULT_UPDATE_MASK_UNKNOWN;
+      else if (rev <   4) gpioMask = PI_DEFAULT_UPDATE_MASK_B1;
+      else if (rev <  16) gpioMask = PI_DEFAULT_UPDATE_MASK_A_B2;
+      else if (rev == 17) gpioMask = PI_DEFAULT_UPDATE_MASK_COMPUTE;
+      else if (rev  < 20) gpioMask = PI_DEFAULT_UPDATE_MASK_APLUS_BPLUS;
+      else if (rev == 20) gpioMask = PI_DEFAULT_UPDATE_MASK_COMPUTE;
+      else if (rev == 21) gpioMask = PI_DEFAULT_UPDATE_MASK_APLUS_BPLUS;
+      else
+      {
+         model = (rev >> 4) & 0xFF;
+
+         /* model
+         0=A 1=B
+         2=A+ 3=B+
+         4=Pi2B
+         5=Alpha
+         6=Compute Module
+         7=Unknown
+         8=Pi3B
+         9=Zero
+         12=Zero W
+         13=Pi3B+
+         14=Pi3A+
+         17=Pi4B
+         */
+         if      (model <  2) gpioMask = PI_DEFAULT_UPDATE_MASK_A_B2;
+         else if (model <  4) gpioMask = PI_DEFAULT_UPDATE_MASK_APLUS_BPLUS;
+         else if (model == 4) gpioMask = PI_DEFAULT_UPDATE_MASK_PI2B;
 
-      len = strlen(buf);
+         else if (model == 6
+               || model ==10
+               || model ==16) gpioMask = PI_DEFAULT_UPDATE_MASK_COMPUTE;
 
-      if (len)
-      {
-        --len;
-        buf[len] = 0; /* replace terminating */
+         else if (model == 8
+               || model ==13
+               || model ==14) gpioMask = PI_DEFAULT_UPDATE_MASK_PI3B;
+
+         else if (model == 9
+               || model ==12) gpioMask = PI_DEFAULT_UPDATE_MASK_ZERO;
+
+         else if (model ==17) gpioMask = PI_DEFAULT_UPDATE_MASK_PI4B;
+         else                 gpioMask = PI_DEFAULT_UPDATE_MASK_UNKNOWN;
       }
 
-      ctl.eaten = 0;
-      idx = 0;
+      gpioMaskSet = 1;
+   }
 
-      while (((ctl.eaten)<len) && (idx >= 0))
-      {
-         if ((idx=cmdParse(buf, p, CMD_MAX_EXTENSION, v, &ctl)) >= 0)
-         {
-            /* make sure extensions are null terminated */
+#ifndef EMBEDDED_IN_VM
+   if (!(gpioCfg.internals & PI_CFG_NOSIGHANDLER))
+      sigSetHandler();
+#endif
 
-            v[p[3]] = 0;
+   if (initPeripherals() < 0) return PI_INIT_FAILED;
 
-            res = myDoCommand(p, sizeof(v)-1, v);
+   if (initAllocDMAMem() < 0) return PI_INIT_FAILED;
 
-            switch (cmdInfo[idx].rv)
-            {
-               case 0:
-                  fprintf(outFifo, "%d\n", res);
-                  break;
+   /* done with /dev/mem */
+
+   if (fdMem != -1)
+   {
+      close(fdMem);
+      fdMem = -1;
+   }
 
-               case 1:
-                  fprintf(outFifo, "%d\n", res);
-                  break;
+   param.sched_priority = sched_get_priority_max(SCHED_FIFO);
 
-               case 2:
-                  fprintf(outFifo, "%d\n", res);
-                  break;
+   if (gpioCfg.internals & PI_CFG_RT_PRIORITY)
+      sched_setscheduler(0, SCHED_FIFO, &param);
 
-               case 3:
-                  fprintf(outFifo, "%08X\n", res);
-                  break;
+   initClock(1); /* initialise main clock */
 
-               case 4:
-                  fprintf(outFifo, "%u\n", res);
-                  break;
+   atexit(gpioTerminate);
 
-               case 5:
-                  fprintf(outFifo, "%s", cmdUsage);
-                  break;
+   if (pthread_attr_init(&pthAttr))
+      SOFT_ERROR(PI_INIT_FAILED, "pthread_attr_init failed (%m)");
 
-               case 6:
-                  fprintf(outFifo, "%d", res);
-                  if (res > 0)
-                  {
-                     for (i=0; i<res; i++)
-                     {
-                        fprintf(outFifo, " %d", v[i]);
-                     }
-                  }
-                  fprintf(outFifo, "\n");
-                  break;
+   if (pthread_attr_setstacksize(&pthAttr, STACK_SIZE))
+      SOFT_ERROR(PI_INIT_FAILED, "pthread_attr_setstacksize failed (%m)");
 
-               case 7:
-                  if (res < 0) fprintf(outFifo, "%d\n", res);
-                  else
-                  {
-                     fprintf(outFifo, "%d", res);
-                     param = (uint32_t *)v;
-                     for (i=0; i<PI_MAX_SCRIPT_PARAMS; i++)
-                     {
-                        fprintf(outFifo, " %d", param[i]);
-                     }
-                     fprintf(outFifo, "\n");
-                  }
-                  break;
-            }
-         }
-         else fprintf(outFifo, "%d\n", PI_BAD_FIFO_COMMAND);
-      }
+   if (!(gpioCfg.ifFlags & PI_DISABLE_ALERT))
+   {
+      if (pthread_create(&pthAlert, &pthAttr, pthAlertThread, &i))
+         SOFT_ERROR(PI_INIT_FAILED, "pthread_create alert failed (%m)");
 
-      fflush(outFifo);
+      pthAlertRunning = PI_THREAD_STARTED;
    }
 
-   return 0;
-}
-
-/* ----------------------------------------------------------------------- */
+   if (!(gpioCfg.ifFlags & PI_DISABLE_FIFO_IF))
+   {
+      if (pthread_create(&pthFifo, &pthAttr, pthFifoThread, &i))
+         SOFT_ERROR(PI_INIT_FAILED, "pthread_create fifo failed (%m)");
 
-static void *pthSocketThreadHandler(void *fdC)
-{
-   int sock = *(int*)fdC;
-   uintptr_t p[10];
-   uint32_t tmp, response[4];
-   int i;
-   int opt;
-   char buf[CMD_MAX_EXTENSION];
+      pthFifoRunning = PI_THREAD_STARTED;
+   }
 
-   free(fdC);
+   if (gpioCfg.ifFlags & PI_ENABLE_BIN_FIFO_IF)
+   {
+      if (pthread_create(&pthFifoBin, &pthAttr, pthFifoBinThread, &i))
+         SOFT_ERROR(PI_INIT_FAILED, "pthread_create bin fifo failed (%m)");
 
-   /* Disable the Nagle algorithm. */
-   opt = 1;
-   setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*)&opt, sizeof(int));
+      pthFifoBinRunning = PI_THREAD_STARTED;
+   }
 
-   while (1)
+   if (!(gpioCfg.ifFlags & PI_DISABLE_SOCK_IF))
    {
-      if (sizeof(uintptr_t) == 8)
-      {
-         if (recv(sock, &tmp, 4, MSG_WAITALL) != 4) break;
-         p[0] = (uintptr_t)tmp;
-         if (recv(sock, &tmp, 4, MSG_WAITALL) != 4) break;
-         p[1] = (uintptr_t)tmp;
-         if (recv(sock, &tmp, 4, MSG_WAITALL) != 4) break;
-         p[2] = (uintptr_t)tmp;
-         if (recv(sock, &tmp, 4, MSG_WAITALL) != 4) break;
-         p[3] = (uintptr_t)tmp;
-      }
-      else
-      {
-         if (recv(sock, p, 16, MSG_WAITALL) != 16) break;
-      }
+      portStr = getenv(PI_ENVPORT);
+      if (portStr) port = atoi(portStr); else port = gpioCfg.socketPort;
 
-      if (p[3])
+      // Accept connections on IPv6, unless we have an IPv4-only whitelist
+      if (!numSockNetAddr)
       {
-         if (p[3] < sizeof(buf))
+         fdSock = socket(AF_INET6, SOCK_STREAM , 0);
+
+         if (fdSock != -1)
          {
-            /* read extension into buf */
-            if (recv(sock, buf, p[3], MSG_WAITALL) != p[3])
+            bzero((char *)&server6, sizeof(server6));
+            server6.sin6_family = AF_INET6;
+            if (gpioCfg.ifFlags & PI_LOCALHOST_SOCK_IF)
             {
-               /* Serious error.  No point continuing. */
-               DBG(DBG_ALWAYS,
-                  "recv failed for %"PRIdPTR" bytes, sock=%d", p[3], sock);
+               server6.sin6_addr = in6addr_loopback;
+            }
+            else
+            {
+               server6.sin6_addr = in6addr_any;
+            }
+            server6.sin6_port = htons(port);
 
-               closeOrphanedNotifications(-1, sock);
+            int opt = 1;
+            setsockopt(fdSock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+            if (bind(fdSock,(struct sockaddr *)&server6, sizeof(server6)) < 0)
+               SOFT_ERROR(PI_INIT_FAILED, "bind to port %d failed (%m)", port);
+         }
+      }
 
-               close(sock);
+      if (numSockNetAddr || fdSock == -1)
+      {
+         fdSock = socket(AF_INET , SOCK_STREAM , 0);
 
-               return 0;
-            }
+         if (fdSock == -1)
+            SOFT_ERROR(PI_INIT_FAILED, "socket failed (%m)");
+         else
+         {
+           int opt = 1;
+           setsockopt(fdSock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+         }
+         server.sin_family = AF_INET;
+         if (gpioCfg.ifFlags & PI_LOCALHOST_SOCK_IF)
+         {
+            server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
          }
          else
          {
-            /* Serious error.  No point continuing. */
-            DBG(DBG_ALWAYS, "ext too large %"PRIdPTR"(%zd), sock=%d",
-               p[3], sizeof(buf), sock);
+            server.sin_addr.s_addr = htonl(INADDR_ANY);
+         }
+         server.sin_port = htons(port);
+
+         if (bind(fdSock,(struct sockaddr *)&server , sizeof(server)) < 0)
+            SOFT_ERROR(PI_INIT_FAILED, "bind to port %d failed (%m)", port);
+      }
 
-            closeOrphanedNotifications(-1, sock);
+      if (pthread_create(&pthSocket, &pthAttr, pthSocketThread, &i))
+         SOFT_ERROR(PI_INIT_FAILED, "pthread_create socket failed (%m)");
 
-            close(sock);
+      pthSocketRunning = PI_THREAD_STARTED;
+   }
 
-            return 0;
-         }
-      }
+   myGpioDelay(1000);
 
-      /* add null terminator in case it's a string */
+   dmaInitCbs();
 
-      buf[p[3]] = 0;
+   flushMemory();
 
-      switch (p[0])
-      {
-         case PI_CMD_NOIB:
+   //cast twice to suppress compiler warning, I belive this cast
+   //is ok because dmaIBus contains bus addresses, not virtual
+   //addresses.
+   initDMAgo((uint32_t *)dmaIn, (uint32_t)(uintptr_t)dmaIBus[0]);
 
-            p[3] = gpioNotifyOpenInBand(sock);
+   return PIGPIO_VERSION;
+}
 
-           /* Enable the Nagle algorithm. */
-            opt = 0;
-            setsockopt(
-               sock, IPPROTO_TCP, TCP_NODELAY, (char*)&opt, sizeof(int));
 
-            break;
+/* ======================================================================= */
 
-         case PI_CMD_PROCP:
-            p[3] = myDoCommand(p, sizeof(buf)-1, buf+sizeof(int));
-            if (((int)p[3]) >= 0)
-            {
-               memcpy(buf, &p[3], 4);
-               p[3] = 4 + (4*PI_MAX_SCRIPT_PARAMS);
-            }
-            break;
+int getBitInBytes(int bitPos, char *buf, int numBits)
+{
+   int bitp, bufp;
 
-         default:
-            p[3] = myDoCommand(p, sizeof(buf)-1, buf);
-      }
+   if (bitPos < numBits)
+   {
+      bufp =      bitPos / 8;
+      bitp = 7 - (bitPos % 8);
+      if (buf[bufp] & (1<<bitp)) return 1;
+   }
 
-      if (sizeof(uintptr_t) == 8) // 64-bit system
-      {
-         for (i = 0; i < 4; i++)
-            response[i] = (uint32_t)p[i];
-         if (write(sock, response, 16) == -1) { /* ignore errors */ }
-      }
-      else // 32-bit system
-      {
-         if (write(sock, p, 16) == -1) { /* ignore errors */ }
-      }
+   return 0;
+}
 
-      switch (p[0])
-      {
-         /* extensions */
-
-         case PI_CMD_BI2CZ:
-         case PI_CMD_BSCX:
-         case PI_CMD_CF2:
-         case PI_CMD_FL:
-         case PI_CMD_FR:
-         case PI_CMD_I2CPK:
-         case PI_CMD_I2CRD:
-         case PI_CMD_I2CRI:
-         case PI_CMD_I2CRK:
-         case PI_CMD_I2CZ:
-         case PI_CMD_PROCP:
-         case PI_CMD_SERR:
-         case PI_CMD_SLR:
-         case PI_CMD_SPIX:
-         case PI_CMD_SPIR:
-         case PI_CMD_BSPIX:
+/* ----------------------------------------------------------------------- */
 
-            if (((int)p[3]) > 0)
-            {
-               if (write(sock, buf, p[3]) == 1) { /* ignore errors */ }
-            }
-            break;
+void putBitInBytes(int bitPos, char *buf, int bit)
+{
+   int bitp, bufp;
 
-         default:
-           break;
-      }
-   }
+   bufp =      bitPos / 8;
+   bitp = 7 - (bitPos % 8);
 
-   closeOrphanedNotifications(-1, sock);
+   if (bit) buf[bufp] |=   (1<<bitp);
+   else     buf[bufp] &= (~(1<<bitp));
+}
 
-   close(sock);
+/* ----------------------------------------------------------------------- */
 
-   DBG(DBG_USER, "Socket %d closed", sock);
+uint32_t rawWaveGetOOL(int pos)
+{
+   int page, slot;
 
-   return 0;
+   if (waveMemReady && (pos >= 0) && (pos < NUM_WAVE_OOL))
+   {
+      waveOOLPageSlot(pos, &page, &slot);
+      return (dmaOVirt[page]->OOL[slot]);
+   }
+
+   return -1;
 }
 
-static int addrAllowed(struct sockaddr *saddr)
+/* ----------------------------------------------------------------------- */
+
+void rawWaveSetOOL(int pos, uint32_t value)
 {
-   int i;
-   uint32_t addr;
+   int page, slot;
 
-   if (!numSockNetAddr) return 1;
+   if (waveMemReady && (pos >= 0) && (pos < NUM_WAVE_OOL))
+   {
+      waveOOLPageSlot(pos, &page, &slot);
+      dmaOVirt[page]->OOL[slot] = value;
+   }
+}
 
-   // FIXME: add IPv6 whitelisting support
-   if (saddr->sa_family != AF_INET) return 0;
 
-   addr = ((struct sockaddr_in *) saddr)->sin_addr.s_addr;
+/* ----------------------------------------------------------------------- */
 
-   for (i=0; i<numSockNetAddr; i++)
+uint32_t rawWaveGetOut(int pos)
+{
+   int page, slot;
+
+   if (waveMemReady && (pos >= 0) && (pos < NUM_WAVE_OOL))
    {
-      if (addr == sockNetAddr[i]) return 1;
+      waveOOLPageSlot(pos, &page, &slot);
+      return (dmaOVirt[page]->OOL[slot]);
    }
-   return 0;
+
+   return -1;
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void * pthSocketThread(void *x)
+void rawWaveSetOut(int pos, uint32_t value)
 {
-   int fdC=0, c, *sock;
-   struct sockaddr_storage client;
-   pthread_attr_t attr;
+   int page, slot;
 
-   if (pthread_attr_init(&attr))
-      SOFT_ERROR((void*)PI_INIT_FAILED,
-         "pthread_attr_init failed (%m)");
+   if (waveMemReady && (pos >= 0) && (pos < NUM_WAVE_OOL))
+   {
+      waveOOLPageSlot(pos, &page, &slot);
+      dmaOVirt[page]->OOL[slot] = value;
+   }
+}
 
-   if (pthread_attr_setstacksize(&attr, STACK_SIZE))
-      SOFT_ERROR((void*)PI_INIT_FAILED,
-         "pthread_attr_setstacksize failed (%m)");
 
-   if (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED))
-      SOFT_ERROR((void*)PI_INIT_FAILED,
-         "pthread_attr_setdetachstate failed (%m)");
+/* ----------------------------------------------------------------------- */
 
-   /* fdSock opened in gpioInitialise so that we can treat
-      failure to bind as fatal. */
+uint32_t rawWaveGetIn(int pos)
+{
+   int page, slot;
 
-   listen(fdSock, 100);
+   if (waveMemReady && (pos >= 0) && (pos < NUM_WAVE_OOL))
+   {
+      waveOOLPageSlot((NUM_WAVE_OOL-1)-pos, &page, &slot);
+      return (dmaOVirt[page]->OOL[slot]);
+   }
 
-   c = sizeof(client);
+   return -1;
+}
 
-   /* don't start until DMA started */
+/* ----------------------------------------------------------------------- */
 
-   spinWhileStarting();
+void rawWaveSetIn(int pos, uint32_t value)
+{
+   int page, slot;
 
-   while (fdC >= 0)
+   if (waveMemReady && (pos >= 0) && (pos < NUM_WAVE_OOL))
    {
-      pthread_t thr;
+      waveOOLPageSlot((NUM_WAVE_OOL-1)-pos, &page, &slot);
+      dmaOVirt[page]->OOL[slot] = value;
+   }
+}
 
-      fdC = accept(fdSock, (struct sockaddr *)&client, (socklen_t*)&c);
+/* ----------------------------------------------------------------------- */
 
-      closeOrphanedNotifications(-1, fdC);
+rawWaveInfo_t rawWaveInfo(int wave_id)
+{
+   rawWaveInfo_t dummy = {0, 0, 0, 0, 0, 0, 0, 0};
 
-      if (addrAllowed((struct sockaddr *)&client))
-      {
-         DBG(DBG_USER, "Connection accepted on socket %d", fdC);
+   if ((wave_id >=0) && (wave_id < waveMax)) return waveInfo[wave_id];
+   else                                      return dummy;
+}
 
-         sock = malloc(sizeof(int));
+/* ----------------------------------------------------------------------- */
 
-         *sock = fdC;
+double time_time(void)
+{
+   struct timeval tv;
+   double t;
 
-         /* Enable tcp_keepalive */
-         int optval = 1;
-         socklen_t optlen = sizeof(optval);
+   gettimeofday(&tv, 0);
 
-         if (setsockopt(fdC, SOL_SOCKET, SO_KEEPALIVE, &optval, optlen) < 0)
-         {
-           DBG(DBG_ALWAYS, "setsockopt() fail, closing socket %d", fdC);
-           close(fdC);
-         }
+   t = (double)tv.tv_sec + ((double)tv.tv_usec / 1E6);
 
-         DBG(DBG_USER, "SO_KEEPALIVE enabled on socket %d\n", fdC);
+   return t;
+}
 
-         if (pthread_create
-            (&thr, &attr, pthSocketThreadHandler, (void*) sock) < 0)
-            SOFT_ERROR((void*)PI_INIT_FAILED,
-               "socket pthread_create failed (%m)");
-      }
-      else
+/* ----------------------------------------------------------------------- */
+
+void time_sleep(double seconds)
+{
+   struct timespec ts, rem;
+
+   if (seconds > 0.0)
+   {
+      ts.tv_sec = seconds;
+      ts.tv_nsec = (seconds-(double)ts.tv_sec) * 1E9;
+
+      while (clock_nanosleep(CLOCK_REALTIME, 0, &ts, &rem))
       {
-         DBG(DBG_ALWAYS, "Connection rejected, closing");
-         close(fdC);
+         /* copy remaining time to ts */
+         ts.tv_sec  = rem.tv_sec;
+         ts.tv_nsec = rem.tv_nsec;
       }
    }
-
-   if (fdC < 0)
-      SOFT_ERROR((void*)PI_INIT_FAILED, "accept failed (%m)");
-
-   return 0;
 }
 
-/* ======================================================================= */
+/* ----------------------------------------------------------------------- */
 
-static void initCheckLockFile(void)
+void rawDumpWave(void)
 {
-   int fd;
-   int count;
-   int pid;
-   int err;
-   int delete;
-   char str[20];
+   int i;
+
+   unsigned numWaves, t;
+
+   rawWave_t *waves;
+
+   numWaves = wfc[wfcur];
+   waves    = wf [wfcur];
+
+   t = 0;
+
+   for (i=0; i<numWaves; i++)
+   {
+      fprintf(stderr, "%10u %08X %08X %08X %10u\n",
+         t, waves[i].gpioOn, waves[i].gpioOff,
+         waves[i].flags, waves[i].usDelay);
+      t += waves[i].usDelay;
+   }
+}
+
+/* ----------------------------------------------------------------------- */
 
-   fd = open(PI_LOCKFILE, O_RDONLY);
+void rawDumpScript(unsigned script_id)
+{
+   int i;
 
-   if (fd != -1)
+   if (script_id >= PI_MAX_SCRIPTS) return;
+
+   if (gpioScript[script_id].state == PI_SCRIPT_IN_USE)
    {
-      DBG(DBG_STARTUP, "lock file exists");
-      delete = 1;
 
-      count = read(fd, str, sizeof(str)-1);
+      for (i=0; i<PI_MAX_SCRIPT_PARAMS; i++)
+      {
+         fprintf(stderr, "p%d=%d ", i, gpioScript[script_id].script.par[i]);
+      }
 
-      if (count)
+      fprintf(stderr, "\n");
+
+      for (i=0; i<PI_MAX_SCRIPT_VARS; i++)
       {
-         pid = atoi(str);
-         err = kill(pid, 0);
-         if (!err) delete = 0; /* process still exists */
-         DBG(DBG_STARTUP, "lock file pid=%d err=%d", pid, err);
+         fprintf(stderr, "v%d=%d ", i, gpioScript[script_id].script.var[i]);
       }
 
-      close(fd);
-      DBG(DBG_STARTUP, "lock file delete=%d", delete);
+      fprintf(stderr, "\n");
 
-      if (delete) unlink(PI_LOCKFILE);
+      for (i=0; i<gpioScript[script_id].script.instrs; i++)
+      {
+         fprintf(stderr,
+            "c%d=[%"PRIdPTR", %"PRIdPTR"(%d), %"PRIdPTR"(%d), %"PRIdPTR", %"PRIdPTR"]\n",
+            i,
+            gpioScript[script_id].script.instr[i].p[0],
+            gpioScript[script_id].script.instr[i].p[1],
+            gpioScript[script_id].script.instr[i].opt[1],
+            gpioScript[script_id].script.instr[i].p[2],
+            gpioScript[script_id].script.instr[i].opt[2],
+            gpioScript[script_id].script.instr[i].p[3],
+            gpioScript[script_id].script.instr[i].p[4]);
+      }
    }
 }
 
-static int initGrabLockFile(void)
+/* ======================================================================= */
+
+int gpioInitialise(void)
 {
-   int fd;
-   int lockResult;
-   char pidStr[20];
+   int status;
 
-   initCheckLockFile();
+   if (libInitialised) return PIGPIO_VERSION;
 
-   /* try to grab the lock file */
+   DBG(DBG_STARTUP, "not initialised, initialising");
 
-   fd = open(PI_LOCKFILE, O_WRONLY|O_CREAT|O_EXCL|O_TRUNC, 0644);
+   gpioWaveSimClose(); /* the real DMA pages replace any simulated ones */
 
-   if (fd != -1)
+   runState = PI_STARTING;
+
+   status = initInitialise();
+
+   if (status < 0)
    {
-      lockResult = flock(fd, LOCK_EX|LOCK_NB);
+      runState = PI_ENDING;
+      initReleaseResources();
+   }
+   else
+   {
+      libInitialised = 1;
 
-      if(lockResult == 0)
-      {
-         sprintf(pidStr, "%d\n", (int)getpid());
+      runState = PI_RUNNING;
 
-         if (write(fd, pidStr, strlen(pidStr)) == -1)
-         {
-            /* ignore errors */
-         }
-      }
-      else
+      if (!(gpioCfg.ifFlags & PI_DISABLE_ALERT))
       {
-         close(fd);
-         return -1;
+         while (pthAlertRunning != PI_THREAD_RUNNING) myGpioDelay(1000);
       }
+
    }
 
-   return fd;
+   return status;
 }
 
+
 /* ----------------------------------------------------------------------- */
 
-static uint32_t * initMapMem(int fd, uint32_t addr, uint32_t len)
+void gpioTerminate(void)
 {
-    return (uint32_t *) mmap(0, len,
-       PROT_READ|PROT_WRITE,
-       MAP_SHARED|MAP_LOCKED,
-       fd, addr);
-}
+   int i;
 
-/* ----------------------------------------------------------------------- */
+   DBG(DBG_USER, "");
 
-static int initCheckPermitted(void)
-{
-   DBG(DBG_STARTUP, "");
+   if (!libInitialised) return;
 
-   if (!pi_ispi)
+   DBG(DBG_STARTUP, "initialised, terminating");
+
+   runState = PI_ENDING;
+
+   gpioMaskSet = 0;
+
+   /* reset DMA */
+
+   if (dmaReg != MAP_FAILED)
    {
-      DBG(DBG_ALWAYS,
-         "\n" \
-         "+---------------------------------------------------------+\n" \
-         "|Sorry, this system does not appear to be a raspberry pi. |\n" \
-         "|aborting.                                                |\n" \
-         "+---------------------------------------------------------+\n\n");
-      return -1;
+      initKillDMA(dmaIn);
+      initKillDMA(dmaOut);
+
+      if (dmaSpiTx != MAP_FAILED)
+      {
+         initKillDMA(dmaSpiTx);
+         initKillDMA(dmaSpiRx);
+      }
    }
 
-   if ((fdMem = open("/dev/mem", O_RDWR | O_SYNC) ) < 0)
+#ifndef EMBEDDED_IN_VM
+   if ((gpioCfg.internals & PI_CFG_STATS) &&
+       (!(gpioCfg.internals & PI_CFG_NOSIGHANDLER)))
    {
-      DBG(DBG_ALWAYS,
-         "\n" \
-         "+---------------------------------------------------------+\n" \
-         "|Sorry, you don't have permission to run this program.    |\n" \
-         "|Try running as root, e.g. precede the command with sudo. |\n" \
-         "+---------------------------------------------------------+\n\n");
-      return -1;
-   }
-   return 0;
-}
+      fprintf(stderr,
+         "\n#####################################################\n");
+      fprintf(stderr, "pigpio version=%d internals=%X\n",
+         PIGPIO_VERSION, gpioCfg.internals);
 
-/* ----------------------------------------------------------------------- */
+      fprintf(stderr,
+         "micros=%d allocMode=%d dmaInitCbs=%d DMARestarts=%d\n",
+         gpioCfg.clockMicros, gpioCfg.memAllocMode,
+         gpioStats.dmaInitCbsCount, gpioStats.DMARestarts);
 
-static int initPeripherals(void)
-{
-   DBG(DBG_STARTUP, "");
+      fprintf(stderr,
+         "samples %u maxSamples %u maxEmit %u emitFrags %u\n",
+         gpioStats.numSamples, gpioStats.maxSamples,
+         gpioStats.maxEmit, gpioStats.emitFrags);
 
-   gpioReg = initMapMem(fdMem, GPIO_BASE, GPIO_LEN);
+      fprintf(stderr, "cbTicks %d, cbCalls %u\n",
+         gpioStats.cbTicks, gpioStats.cbCalls);
 
-   if (gpioReg == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap gpio failed (%m)");
+      fprintf(stderr, "pipe: good %u, short %u, would block %u\n",
+         gpioStats.goodPipeWrite, gpioStats.shortPipeWrite,
+         gpioStats.wouldBlockPipeWrite);
 
-   dmaReg = initMapMem(fdMem, DMA_BASE, DMA_LEN);
+      fprintf(stderr, "alertTicks %u, lateTicks %u, moreToDo %u\n",
+         gpioStats.alertTicks, gpioStats.lateTicks, gpioStats.moreToDo);
 
-   if (dmaReg == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap dma failed (%m)");
+      for (i=0; i< TICKSLOTS; i++)
+         fprintf(stderr, "%9u ", gpioStats.diffTick[i]);
 
-   /* we should know if we are running on a BCM2711 by now */
+      fprintf(stderr,
+         "\n#####################################################\n\n\n");
+   }
 
-   if (gpioCfg.DMAprimaryChannel == PI_DEFAULT_DMA_NOT_SET)
+#endif
+   initReleaseResources();
+
+   fflush(NULL);
+
+   libInitialised = 0;
+}
+
+static void switchFunctionOff(unsigned gpio)
+{
+   switch (gpioInfo[gpio].is)
    {
-      if (pi_is_2711)
-         gpioCfg.DMAprimaryChannel = PI_DEFAULT_DMA_PRIMARY_CH_2711;
-      else
-         gpioCfg.DMAprimaryChannel = PI_DEFAULT_DMA_PRIMARY_CHANNEL;
+      case GPIO_SERVO:
+         /* switch servo off */
+         myGpioSetServo(gpio, gpioInfo[gpio].width, 0);
+         gpioInfo[gpio].width = 0;
+         break;
+
+      case GPIO_PWM:
+         /* switch pwm off */
+         myGpioSetPwm(gpio, gpioInfo[gpio].width, 0);
+         gpioInfo[gpio].width = 0;
+         break;
+
+      case GPIO_HW_CLK:
+         /* No longer disable clock hardware, doing that was a bug. */
+         gpioInfo[gpio].width = 0;
+         break;
+
+      case GPIO_HW_PWM:
+         /* No longer disable PWM hardware, doing that was a bug. */
+         gpioInfo[gpio].width = 0;
+         break;
    }
-      
-   if (gpioCfg.DMAsecondaryChannel == PI_DEFAULT_DMA_NOT_SET)
+}
+
+static void stopHardwarePWM(void)
+{
+   unsigned i, pwm;
+
+   for (i=0; i<= PI_MAX_GPIO; i++)
    {
-      if (pi_is_2711)
-         gpioCfg.DMAsecondaryChannel = PI_DEFAULT_DMA_SECONDARY_CH_2711;
-      else
-         gpioCfg.DMAsecondaryChannel = PI_DEFAULT_DMA_SECONDARY_CHANNEL;
+      if (gpioInfo[i].is == GPIO_HW_PWM)
+      {
+         pwm = (PWMDef[i] >> 4) & 3;
+
+         if (pwm == 0) pwmReg[PWM_CTL] &= (~PWM_CTL_PWEN1);
+         else          pwmReg[PWM_CTL] &= (~PWM_CTL_PWEN2);
+
+         gpioInfo[i].width = 0;
+         gpioInfo[i].is = GPIO_UNDEFINED;
+      }
    }
-      
-   dmaIn =  dmaReg + (gpioCfg.DMAprimaryChannel   * 0x40);
-   dmaOut = dmaReg + (gpioCfg.DMAsecondaryChannel * 0x40);
+}
 
-   DBG(DBG_STARTUP, "DMA #%d @ %08"PRIXPTR,
-      gpioCfg.DMAprimaryChannel, (uintptr_t)dmaIn);
+/* ----------------------------------------------------------------------- */
 
-   DBG(DBG_STARTUP, "debug reg is %08X", dmaIn[DMA_DEBUG]);
+int gpioSetMode(unsigned gpio, unsigned mode)
+{
+   int reg, shift, old_mode;
 
-   clkReg  = initMapMem(fdMem, CLK_BASE,  CLK_LEN);
+   DBG(DBG_USER, "gpio=%d mode=%d", gpio, mode);
 
-   if (clkReg == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap clk failed (%m)");
+   CHECK_INITED;
 
-   systReg  = initMapMem(fdMem, SYST_BASE,  SYST_LEN);
+   if (gpio > PI_MAX_GPIO)
+      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
 
-   if (systReg == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap syst failed (%m)");
+   if (mode > PI_ALT3)
+      SOFT_ERROR(PI_BAD_MODE, "gpio %d, bad mode (%d)", gpio, mode);
+
+   reg   =  gpio/10;
+   shift = (gpio%10) * 3;
 
-   spiReg  = initMapMem(fdMem, SPI_BASE,  SPI_LEN);
+   old_mode = (gpioReg[reg] >> shift) & 7;
 
-   if (spiReg == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap spi failed (%m)");
+   if (mode != old_mode)
+   {
+      switchFunctionOff(gpio);
 
-   pwmReg  = initMapMem(fdMem, PWM_BASE,  PWM_LEN);
+      gpioInfo[gpio].is = GPIO_UNDEFINED;
+   }
 
-   if (pwmReg == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap pwm failed (%m)");
+   gpioReg[reg] = (gpioReg[reg] & ~(7<<shift)) | (mode<<shift);
 
-   pcmReg  = initMapMem(fdMem, PCM_BASE,  PCM_LEN);
+   return 0;
+}
 
-   if (pcmReg == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap pcm failed (%m)");
 
-   auxReg  = initMapMem(fdMem, AUX_BASE,  AUX_LEN);
+/* ----------------------------------------------------------------------- */
 
-   if (auxReg == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap aux failed (%m)");
+int gpioGetMode(unsigned gpio)
+{
+   int reg, shift;
 
-   padsReg  = initMapMem(fdMem, PADS_BASE,  PADS_LEN);
+   DBG(DBG_USER, "gpio=%d", gpio);
 
-   if (padsReg == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap pads failed (%m)");
+   CHECK_INITED;
 
-   bscsReg  = initMapMem(fdMem, BSCS_BASE,  BSCS_LEN);
+   if (gpio > PI_MAX_GPIO)
+      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
 
-   if (bscsReg == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap bscs failed (%m)");
+   reg   =  gpio/10;
+   shift = (gpio%10) * 3;
 
-   return 0;
+   return (gpioReg[reg] >> shift) & 7;
 }
 
+
 /* ----------------------------------------------------------------------- */
 
-static int initZaps
-   (int  pmapFd, void *virtualBase, int  basePage, int  pages)
+int gpioSetPullUpDown(unsigned gpio, unsigned pud)
 {
-   int n;
-   uintptr_t index;
-   off_t offset;
-   ssize_t t;
-   uint32_t physical;
-   int status;
-   uintptr_t pageAdr;
-   unsigned long long pa;
-
-   DBG(DBG_STARTUP, "");
-
-   status = 0;
+   int shift = (gpio & 0xf) << 1;
+   uint32_t bits;
+   uint32_t pull;
 
-   pageAdr = (uintptr_t) dmaVirt[basePage];
+   DBG(DBG_USER, "gpio=%d pud=%d", gpio, pud);
 
-   index  = ((uintptr_t)virtualBase / PAGE_SIZE) * 8;
+   CHECK_INITED;
 
-   offset = lseek(pmapFd, index, SEEK_SET);
+   if (gpio > PI_MAX_GPIO)
+      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
 
-   if (offset != index)
-      SOFT_ERROR(PI_INIT_FAILED, "lseek pagemap failed (%m)");
+   if (pud > PI_PUD_UP)
+      SOFT_ERROR(PI_BAD_PUD, "gpio %d, bad pud (%d)", gpio, pud);
 
-   for (n=0; n<pages; n++)
+   if (pi_is_2711)
    {
-      t = read(pmapFd, &pa, sizeof(pa));
+      switch (pud)
+      {
+         case PI_PUD_OFF:  pull = 0; break;
+         case PI_PUD_UP:   pull = 1; break;
+         case PI_PUD_DOWN: pull = 2; break;
+      }
 
-      if (t != sizeof(pa))
-         SOFT_ERROR(PI_INIT_FAILED, "read pagemap failed (%m)");
+      bits = *(gpioReg + GPPUPPDN0 + (gpio>>4));
+      bits &= ~(3 << shift);
+      bits |= (pull << shift);
+      *(gpioReg + GPPUPPDN0 + (gpio>>4)) = bits;
+   }
+   else
+   {
+      *(gpioReg + GPPUD) = pud;
 
-      DBG(DBG_STARTUP, "pf%d=%016llX", n, pa);
+      myGpioDelay(1);
 
-      physical = 0x3FFFFFFF & (PAGE_SIZE * (pa & 0xFFFFFFFF));
+      *(gpioReg + GPPUDCLK0 + BANK) = BIT;
 
-      if (physical)
-      {
-         //cast twice to suppress warning, I belive this is ok as these
-         //are bus addresses, not virtual addresses. --plugwash
-         dmaBus[basePage+n] = (dmaPage_t *)(uintptr_t) (physical | pi_dram_bus);
+      myGpioDelay(1);
 
-         dmaVirt[basePage+n] = mmap
-         (
-            (void *)pageAdr,
-            PAGE_SIZE,
-            PROT_READ|PROT_WRITE,
-            MAP_SHARED|MAP_FIXED|MAP_LOCKED|MAP_NORESERVE,
-            fdMem,
-            physical
-         );
-      }
-      else status = 1;
+      *(gpioReg + GPPUD) = 0;
 
-      pageAdr += PAGE_SIZE;
+      *(gpioReg + GPPUDCLK0 + BANK) = 0;
    }
 
-   return status;
+   return 0;
 }
 
+
 /* ----------------------------------------------------------------------- */
 
-static int initPagemapBlock(int block)
+int gpioRead(unsigned gpio)
 {
-   int trys, ok;
-   unsigned pageNum;
-
-   DBG(DBG_STARTUP, "block=%d", block);
-
-   dmaPMapBlk[block] = mmap(
-       0, (PAGES_PER_BLOCK*PAGE_SIZE),
-       PROT_READ|PROT_WRITE,
-       MAP_SHARED|MAP_ANONYMOUS|MAP_NORESERVE|MAP_LOCKED,
-       -1, 0);
-
-   if (dmaPMapBlk[block] == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap dma block %d failed (%m)", block);
+   DBG(DBG_USER, "gpio=%d", gpio);
 
-   /* force allocation of physical memory */
+   CHECK_INITED;
 
-   memset((void *)dmaPMapBlk[block], 0xAA, (PAGES_PER_BLOCK*PAGE_SIZE));
+   if (gpio > PI_MAX_GPIO)
+      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
 
-   memset((void *)dmaPMapBlk[block], 0xFF, (PAGES_PER_BLOCK*PAGE_SIZE));
+   if ((*(gpioReg + GPLEV0 + BANK) & BIT) != 0) return PI_ON;
+   else                                         return PI_OFF;
+}
 
-   memset((void *)dmaPMapBlk[block], 0, (PAGES_PER_BLOCK*PAGE_SIZE));
 
-   pageNum = block * PAGES_PER_BLOCK;
+/* ----------------------------------------------------------------------- */
 
-   dmaVirt[pageNum] = mmap(
-       0, (PAGES_PER_BLOCK*PAGE_SIZE),
-       PROT_READ|PROT_WRITE,
-       MAP_SHARED|MAP_ANONYMOUS|MAP_NORESERVE|MAP_LOCKED,
-       -1, 0);
+int gpioWrite(unsigned gpio, unsigned level)
+{
+   DBG(DBG_USER, "gpio=%d level=%d", gpio, level);
 
-   if (dmaVirt[pageNum] == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap dma block %d failed (%m)", block);
+   CHECK_INITED;
 
-   munmap(dmaVirt[pageNum], PAGES_PER_BLOCK*PAGE_SIZE);
+   if (gpio > PI_MAX_GPIO)
+      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
 
-   trys = 0;
-   ok = 0;
+   if (level > PI_ON)
+      SOFT_ERROR(PI_BAD_LEVEL, "gpio %d, bad level (%d)", gpio, level);
 
-   while ((trys < 10) && !ok)
+   if (gpio <= PI_MAX_GPIO)
    {
-      if (initZaps(fdPmap,
-                    dmaPMapBlk[block],
-                    pageNum,
-                    PAGES_PER_BLOCK) == 0) ok = 1;
-      else myGpioDelay(50000);
+      if (gpioInfo[gpio].is != GPIO_WRITE)
+      {
+         /* stop a glitch between setting mode then level */
+         if (level == PI_OFF) *(gpioReg + GPCLR0 + BANK) = BIT;
+         else                 *(gpioReg + GPSET0 + BANK) = BIT;
 
-      ++trys;
+         switchFunctionOff(gpio);
+
+         gpioInfo[gpio].is = GPIO_WRITE;
+      }
    }
 
-   if (!ok) SOFT_ERROR(PI_INIT_FAILED, "initZaps failed");
+   myGpioSetMode(gpio, PI_OUTPUT);
+
+   if (level == PI_OFF) *(gpioReg + GPCLR0 + BANK) = BIT;
+   else                 *(gpioReg + GPSET0 + BANK) = BIT;
 
    return 0;
 }
 
-static int initMboxBlock(int block)
-{
-   int n, ok;
-   unsigned page;
-   uintptr_t virtualAdr;
-   uintptr_t busAdr;
 
-   DBG(DBG_STARTUP, "block=%d", block);
+/* ----------------------------------------------------------------------- */
 
-   ok = mbDMAAlloc
-      (&dmaMboxBlk[block], PAGES_PER_BLOCK * PAGE_SIZE, pi_mem_flag);
+int gpioPWM(unsigned gpio, unsigned val)
+{
+   DBG(DBG_USER, "gpio=%d dutycycle=%d", gpio, val);
 
-   if (!ok) SOFT_ERROR(PI_INIT_FAILED, "init mbox zaps failed");
+   CHECK_INITED;
 
-   page = block * PAGES_PER_BLOCK;
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-   virtualAdr = (uintptr_t) dmaMboxBlk[block].virtual_addr;
-   busAdr = dmaMboxBlk[block].bus_addr;
+   if (val > gpioInfo[gpio].range)
+      SOFT_ERROR(PI_BAD_DUTYCYCLE, "gpio %d, bad dutycycle (%d)", gpio, val);
 
-   for (n=0; n<PAGES_PER_BLOCK; n++)
+   if (gpioInfo[gpio].is != GPIO_PWM)
    {
-      dmaVirt[page+n] = (dmaPage_t *) virtualAdr;
-      dmaBus[page+n] = (dmaPage_t *) busAdr;
-      virtualAdr += PAGE_SIZE;
-      busAdr += PAGE_SIZE;
+      switchFunctionOff(gpio);
+
+      gpioInfo[gpio].is = GPIO_PWM;
+
+      if (!val) myGpioWrite(gpio, 0);
    }
 
+   myGpioSetMode(gpio, PI_OUTPUT);
+
+   myGpioSetPwm(gpio, gpioInfo[gpio].width, val);
+
+   gpioInfo[gpio].width=val;
+
    return 0;
 }
 
 /* ----------------------------------------------------------------------- */
 
-static int initAllocDMAMem(void)
+int gpioGetPWMdutycycle(unsigned gpio)
 {
-   int i, servoCycles, superCycles;
-   int status;
+   unsigned pwm;
 
-   DBG(DBG_STARTUP, "");
+   DBG(DBG_USER, "gpio=%d", gpio);
 
-   /* Calculate the number of blocks needed for buffers.  The number
-      of blocks must be a multiple of the 20ms servo cycle.
-   */
+   CHECK_INITED;
 
-   servoCycles = gpioCfg.bufferMilliseconds / 20;
-   if           (gpioCfg.bufferMilliseconds % 20) servoCycles++;
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-   bufferCycles = (SUPERCYCLE * servoCycles) / gpioCfg.clockMicros;
+   switch (gpioInfo[gpio].is)
+   {
+      case GPIO_PWM:
+         return gpioInfo[gpio].width;
 
-   superCycles = bufferCycles / SUPERCYCLE;
-   if           (bufferCycles % SUPERCYCLE) superCycles++;
+      case GPIO_HW_PWM:
+         pwm = (PWMDef[gpio] >> 4) & 3;
+         return hw_pwm_duty[pwm];
+
+      case GPIO_HW_CLK:
+         return PI_HW_PWM_RANGE/2;
+
+      default:
+         SOFT_ERROR(PI_NOT_PWM_GPIO, "not a PWM gpio (%d)", gpio);
+   }
+}
 
-   bufferCycles = SUPERCYCLE * superCycles;
 
-   bufferBlocks = bufferCycles / CYCLES_PER_BLOCK;
+/* ----------------------------------------------------------------------- */
 
-   DBG(DBG_STARTUP, "bmillis=%d mics=%d bblk=%d bcyc=%d",
-      gpioCfg.bufferMilliseconds, gpioCfg.clockMicros,
-      bufferBlocks, bufferCycles);
+int gpioSetPWMrange(unsigned gpio, unsigned range)
+{
+   int oldWidth, newWidth;
 
-   /* allocate memory for pointers to virtual and bus memory pages */
+   DBG(DBG_USER, "gpio=%d range=%d", gpio, range);
 
-   dmaVirt = mmap(
-       0, PAGES_PER_BLOCK*(bufferBlocks+PI_WAVE_BLOCKS)*sizeof(dmaPage_t *),
-       PROT_READ|PROT_WRITE,
-       MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED,
-       -1, 0);
+   CHECK_INITED;
 
-   if (dmaVirt == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap dma virtual failed (%m)");
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-   dmaBus = mmap(
-       0, PAGES_PER_BLOCK*(bufferBlocks+PI_WAVE_BLOCKS)*sizeof(dmaPage_t *),
-       PROT_READ|PROT_WRITE,
-       MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED,
-       -1, 0);
+   if ((range < PI_MIN_DUTYCYCLE_RANGE)  || (range > PI_MAX_DUTYCYCLE_RANGE))
+      SOFT_ERROR(PI_BAD_DUTYRANGE, "gpio %d, bad range (%d)", gpio, range);
 
-   if (dmaBus == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap dma bus failed (%m)");
+   oldWidth = gpioInfo[gpio].width;
 
-   dmaIVirt = (dmaIPage_t **) dmaVirt;
-   dmaIBus  = (dmaIPage_t **) dmaBus;
+   if (oldWidth)
+   {
+      if (gpioInfo[gpio].is == GPIO_PWM)
+      {
+         newWidth = (range * oldWidth) / gpioInfo[gpio].range;
 
-   dmaOVirt = (dmaOPage_t **)(dmaVirt + (PAGES_PER_BLOCK*bufferBlocks));
-   dmaOBus  = (dmaOPage_t **)(dmaBus  + (PAGES_PER_BLOCK*bufferBlocks));
+         myGpioSetPwm(gpio, oldWidth, 0);
+         gpioInfo[gpio].range = range;
+         gpioInfo[gpio].width = newWidth;
+         myGpioSetPwm(gpio, 0, newWidth);
+      }
+   }
 
-   if ((gpioCfg.memAllocMode == PI_MEM_ALLOC_PAGEMAP) ||
-       ((gpioCfg.memAllocMode == PI_MEM_ALLOC_AUTO) &&
-        (gpioCfg.bufferMilliseconds > PI_DEFAULT_BUFFER_MILLIS)))
-   {
-      /* pagemap allocation of DMA memory */
+   gpioInfo[gpio].range = range;
 
-      dmaPMapBlk = mmap(
-          0, (bufferBlocks+PI_WAVE_BLOCKS)*sizeof(dmaPage_t *),
-          PROT_READ|PROT_WRITE,
-          MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED,
-          -1, 0);
+   /* return the actual range for the current gpio frequency */
 
-      if (dmaPMapBlk == MAP_FAILED)
-         SOFT_ERROR(PI_INIT_FAILED, "pagemap mmap block failed (%m)");
+   return pwmRealRange[gpioInfo[gpio].freqIdx];
+}
 
-      fdPmap = open("/proc/self/pagemap", O_RDONLY);
 
-      if (fdPmap < 0)
-         SOFT_ERROR(PI_INIT_FAILED, "pagemap open failed(%m)");
+/* ----------------------------------------------------------------------- */
 
-      for (i=0; i<(bufferBlocks+PI_WAVE_BLOCKS); i++)
-      {
-         status = initPagemapBlock(i);
-         if (status < 0)
-         {
-            close(fdPmap);
-            return status;
-         }
-      }
+int gpioGetPWMrange(unsigned gpio)
+{
+   DBG(DBG_USER, "gpio=%d", gpio);
 
-      close(fdPmap);
+   CHECK_INITED;
 
-      DBG(DBG_STARTUP, "dmaPMapBlk=%08"PRIXPTR" dmaIn=%08"PRIXPTR,
-         (uintptr_t)dmaPMapBlk, (uintptr_t)dmaIn);
-   }
-   else
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+
+   switch (gpioInfo[gpio].is)
    {
-      /* mailbox allocation of DMA memory */
+      case GPIO_HW_PWM:
+      case GPIO_HW_CLK:
+         return PI_HW_PWM_RANGE;
 
-      dmaMboxBlk = mmap(
-          0, (bufferBlocks+PI_WAVE_BLOCKS)*sizeof(DMAMem_t),
-          PROT_READ|PROT_WRITE,
-          MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED,
-          -1, 0);
+      default:
+         return gpioInfo[gpio].range;
+   }
+}
 
-      if (dmaMboxBlk == MAP_FAILED)
-         SOFT_ERROR(PI_INIT_FAILED, "mmap mbox block failed (%m)");
 
-      fdMbox = mbOpen();
+/* ----------------------------------------------------------------------- */
 
-      if (fdMbox < 0)
-         SOFT_ERROR(PI_INIT_FAILED, "mbox open failed(%m)");
+int gpioGetPWMrealRange(unsigned gpio)
+{
+   unsigned pwm;
 
-      for (i=0; i<(bufferBlocks+PI_WAVE_BLOCKS); i++)
-      {
-         status = initMboxBlock(i);
-         if (status < 0)
-         {
-            mbClose(fdMbox);
-            return status;
-         }
-      }
+   DBG(DBG_USER, "gpio=%d", gpio);
 
-      mbClose(fdMbox);
+   CHECK_INITED;
 
-      DBG(DBG_STARTUP, "dmaMboxBlk=%08"PRIXPTR" dmaIn=%08"PRIXPTR,
-         (uintptr_t)dmaMboxBlk, (uintptr_t)dmaIn);
-   }
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-   DBG(DBG_STARTUP,
-      "gpioReg=%08"PRIXPTR" pwmReg=%08"PRIXPTR" pcmReg=%08"PRIXPTR" clkReg=%08"PRIXPTR" auxReg=%08"PRIXPTR,
-      (uintptr_t)gpioReg, (uintptr_t)pwmReg,
-      (uintptr_t)pcmReg,  (uintptr_t)clkReg, (uintptr_t)auxReg);
+   switch (gpioInfo[gpio].is)
+   {
+      case GPIO_HW_PWM:
+         pwm = (PWMDef[gpio] >> 4) & 3;
+         return hw_pwm_real_range[pwm];
 
-   for (i=0; i<DMAI_PAGES; i++)
-      DBG(DBG_STARTUP, "dmaIBus[%d]=%08"PRIXPTR, i, (uintptr_t)dmaIBus[i]);
+      case GPIO_HW_CLK:
+         return PI_HW_PWM_RANGE;
 
-   if (gpioCfg.dbgLevel >= DBG_DMACBS)
-   {
-      fprintf(stderr, "*** INPUT DMA CONTROL BLOCKS ***\n");
-      for (i=0; i<NUM_CBS; i++) dmaCbPrint(i);
+      default:
+         return pwmRealRange[gpioInfo[gpio].freqIdx];
    }
-
-   return 0;
 }
 
+
 /* ----------------------------------------------------------------------- */
 
-static void initPWM(unsigned bits)
+int gpioSetPWMfrequency(unsigned gpio, unsigned frequency)
 {
-   DBG(DBG_STARTUP, "bits=%d", bits);
+   int i, width;
+   unsigned diff, best, idx;
 
-   /* reset PWM */
+   DBG(DBG_USER, "gpio=%d frequency=%d", gpio, frequency);
 
-   pwmReg[PWM_CTL] = 0;
+   CHECK_INITED;
 
-   myGpioDelay(10);
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-   pwmReg[PWM_STA] = -1;
+   if      (frequency > pwmFreq[0])           idx = 0;
+   else if (frequency < pwmFreq[PWM_FREQS-1]) idx = PWM_FREQS-1;
+   else
+   {
+      best = 100000; /* impossibly high frequency difference */
+      idx = 0;
 
-   myGpioDelay(10);
+      for (i=0; i<PWM_FREQS; i++)
+      {
+         if (frequency > pwmFreq[i]) diff = frequency - pwmFreq[i];
+         else                        diff = pwmFreq[i] - frequency;
 
-   /* set number of bits to transmit */
+         if (diff < best)
+         {
+            best = diff;
+            idx = i;
+         }
+      }
+   }
 
-   pwmReg[PWM_RNG1] = bits;
+   width = gpioInfo[gpio].width;
 
-   myGpioDelay(10);
+   if (width)
+   {
+      if (gpioInfo[gpio].is == GPIO_PWM)
+      {
+         myGpioSetPwm(gpio, width, 0);
+         gpioInfo[gpio].freqIdx = idx;
+         myGpioSetPwm(gpio, 0, width);
+      }
+   }
 
-   dmaIVirt[0]->periphData = 1;
+   gpioInfo[gpio].freqIdx = idx;
 
-   /* enable PWM DMA, raise panic and dreq thresholds to 15 */
+   return pwmFreq[idx];
+}
 
-   pwmReg[PWM_DMAC] = PWM_DMAC_ENAB      |
-                      PWM_DMAC_PANIC(15) |
-                      PWM_DMAC_DREQ(15);
 
-   myGpioDelay(10);
+/* ----------------------------------------------------------------------- */
 
-   /* clear PWM fifo */
+int gpioGetPWMfrequency(unsigned gpio)
+{
+   unsigned pwm, clock;
 
-   pwmReg[PWM_CTL] = PWM_CTL_CLRF1;
+   DBG(DBG_USER, "gpio=%d", gpio);
 
-   myGpioDelay(10);
+   CHECK_INITED;
 
-   /* enable PWM channel 1 and use fifo */
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-   pwmReg[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_MODE1 | PWM_CTL_PWEN1;
+   switch (gpioInfo[gpio].is)
+   {
+      case GPIO_HW_PWM:
+         pwm = (PWMDef[gpio] >> 4) & 3;
+         return hw_pwm_freq[pwm];
+
+      case GPIO_HW_CLK:
+         clock = (clkDef[gpio] >> 4) & 3;
+         return hw_clk_freq[clock];
+
+      default:
+         return pwmFreq[gpioInfo[gpio].freqIdx];
+   }
 }
 
+
 /* ----------------------------------------------------------------------- */
 
-static void initPCM(unsigned bits)
+int gpioServo(unsigned gpio, unsigned val)
 {
-   DBG(DBG_STARTUP, "bits=%d", bits);
-
-   /* disable PCM so we can modify the regs */
+   DBG(DBG_USER, "gpio=%d pulsewidth=%d", gpio, val);
 
-   pcmReg[PCM_CS] = 0;
+   CHECK_INITED;
 
-   myGpioDelay(1000);
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-   pcmReg[PCM_FIFO]   = 0;
-   pcmReg[PCM_MODE]   = 0;
-   pcmReg[PCM_RXC]    = 0;
-   pcmReg[PCM_TXC]    = 0;
-   pcmReg[PCM_DREQ]   = 0;
-   pcmReg[PCM_INTEN]  = 0;
-   pcmReg[PCM_INTSTC] = 0;
-   pcmReg[PCM_GRAY]   = 0;
+   if ((val!=PI_SERVO_OFF) && (val<PI_MIN_SERVO_PULSEWIDTH))
+      SOFT_ERROR(PI_BAD_PULSEWIDTH,
+         "gpio %d, bad pulsewidth (%d)", gpio, val);
 
-   myGpioDelay(1000);
+   if (val>PI_MAX_SERVO_PULSEWIDTH)
+      SOFT_ERROR(PI_BAD_PULSEWIDTH,
+         "gpio %d, bad pulsewidth (%d)", gpio, val);
 
-   pcmReg[PCM_MODE] = PCM_MODE_FLEN(bits-1); /* # bits in frame */
+   if (gpioInfo[gpio].is != GPIO_SERVO)
+   {
+      switchFunctionOff(gpio);
 
-   /* enable channel 1 with # bits width */
+      gpioInfo[gpio].is = GPIO_SERVO;
 
-   pcmReg[PCM_TXC] = PCM_TXC_CH1EN | PCM_TXC_CH1WID(bits-8);
+      if (!val) myGpioWrite(gpio, 0);
+   }
 
-   pcmReg[PCM_CS] |= PCM_CS_STBY; /* clear standby */
+   myGpioSetMode(gpio, PI_OUTPUT);
 
-   myGpioDelay(1000);
+   myGpioSetServo(gpio, gpioInfo[gpio].width, val);
 
-   pcmReg[PCM_CS] |= PCM_CS_TXCLR; /* clear TX FIFO */
+   gpioInfo[gpio].width=val;
 
-   pcmReg[PCM_CS] |= PCM_CS_DMAEN; /* enable DREQ */
+   return 0;
+}
 
-   pcmReg[PCM_DREQ] = PCM_DREQ_TX_PANIC(16) | PCM_DREQ_TX_REQ_L(30);
 
-   pcmReg[PCM_INTSTC] = 0b1111; /* clear status bits */
+/* ----------------------------------------------------------------------- */
 
-   /* enable PCM */
+int gpioGetServoPulsewidth(unsigned gpio)
+{
+   DBG(DBG_USER, "gpio=%d", gpio);
 
-   pcmReg[PCM_CS] |= PCM_CS_EN;
+   CHECK_INITED;
 
-   /* enable tx */
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-   pcmReg[PCM_CS] |= PCM_CS_TXON;
+   if (gpioInfo[gpio].is != GPIO_SERVO)
+      SOFT_ERROR(PI_NOT_SERVO_GPIO, "not a servo gpio (%d)", gpio);
 
-   dmaIVirt[0]->periphData = 0x0F;
+   return gpioInfo[gpio].width;
 }
 
+
 /* ----------------------------------------------------------------------- */
 
-static void initHWClk
-   (int clkCtl, int clkDiv, int clkSrc, int divI, int divF, int MASH)
+int gpioWaveClear(void)
 {
-   DBG(DBG_INTERNAL, "ctl=%d div=%d src=%d /I=%d /f=%d M=%d",
-      clkCtl, clkDiv, clkSrc, divI, divF, MASH);
+   int i;
 
-   /* kill the clock if busy, anything else isn't reliable */
+   DBG(DBG_USER, "");
 
-   if (clkReg[clkCtl] & CLK_CTL_BUSY)
-   {
-      do
-      {
-         clkReg[clkCtl] = BCM_PASSWD | CLK_CTL_KILL;
-      }
-      while (clkReg[clkCtl] & CLK_CTL_BUSY);
-   }
+   CHECK_WAVE_INITED;
 
-   clkReg[clkDiv] = (BCM_PASSWD | CLK_DIV_DIVI(divI) | CLK_DIV_DIVF(divF));
+   wfc[0] = 0;
+   wfc[1] = 0;
+   wfc[2] = 0;
 
-   usleep(10);
+   wfcur = 0;
 
-   clkReg[clkCtl] = (BCM_PASSWD | CLK_CTL_MASH(MASH) | CLK_CTL_SRC(clkSrc));
+   wfStats.micros = 0;
+   wfStats.pulses = 0;
+   wfStats.cbs    = 0;
 
-   usleep(10);
+   waveFreeReset();
 
-   clkReg[clkCtl] |= (BCM_PASSWD | CLK_CTL_ENAB);
-}
+   waveCacheReset();
 
-static void initClock(int mainClock)
-{
-   const unsigned BITS=10;
-   int clockPWM;
-   unsigned clkCtl, clkDiv, clkSrc, clkDivI, clkDivF, clkMash, clkBits;
-   char *per;
-   unsigned micros;
+   for (i=0; i<PI_MAX_WAVE_SLOTS; i++) waveSlotFree(i);
 
-   DBG(DBG_STARTUP, "mainClock=%d", mainClock);
+   waveStreamFree();
 
-   if (mainClock) micros = gpioCfg.clockMicros;
-   else           micros = PI_WF_MICROS;
+   waveOutCount = 0;
 
-   clockPWM = mainClock ^ (gpioCfg.clockPeriph == PI_CLOCK_PCM);
+   waveEndPtr = NULL;
 
-   if (clockPWM)
-   {
-      clkCtl = CLK_PWMCTL;
-      clkDiv = CLK_PWMDIV;
-      per = "PWM";
-   }
-   else
-   {
-      clkCtl = CLK_PCMCTL;
-      clkDiv = CLK_PCMDIV;
-      per = "PCM";
-   }
+   return 0;
+}
 
-   clkSrc  = CLK_CTL_SRC_PLLD;
-   clkDivI = clk_plld_freq / (10000000 / micros); /* 10 MHz - 1 MHz */ 
-   clkBits = BITS;        /* 10/BITS MHz - 1/BITS MHz */
-   clkDivF = 0;
-   clkMash = 0;
+/* ----------------------------------------------------------------------- */
 
-   DBG(DBG_STARTUP, "%s PLLD divi=%d divf=%d mash=%d bits=%d",
-      per, clkDivI, clkDivF, clkMash, clkBits);
+int gpioWaveAddNew(void)
+{
+   DBG(DBG_USER, "");
 
-   initHWClk(clkCtl, clkDiv, clkSrc, clkDivI, clkDivF, clkMash);
+   CHECK_WAVE_INITED;
 
-   if (clockPWM) initPWM(BITS);
-   else          initPCM(BITS);
+   wfc[0] = 0;
+   wfc[1] = 0;
+   wfc[2] = 0;
 
-   myGpioDelay(2000);
-}
+   wfcur = 0;
 
-static void initKillDMA(volatile uint32_t *dmaAddr)
-{
-   dmaAddr[DMA_CS] = DMA_CHANNEL_ABORT;
-   dmaAddr[DMA_CS] = 0;
-   dmaAddr[DMA_CS] = DMA_CHANNEL_RESET;
+   wfStats.micros = 0;
+   wfStats.pulses = 0;
+   wfStats.cbs    = 0;
 
-   dmaAddr[DMA_CONBLK_AD] = 0;
+   return 0;
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void initDMAgo(volatile uint32_t  *dmaAddr, uint32_t cbAddr)
+int gpioWaveAddGeneric(unsigned numPulses, gpioPulse_t *pulses)
 {
-   DBG(DBG_STARTUP, "");
-
-   initKillDMA(dmaAddr);
+   int p;
 
-   dmaAddr[DMA_CS] = DMA_INTERRUPT_STATUS | DMA_END_FLAG;
+   DBG(DBG_USER, "numPulses=%u pulses=%08"PRIXPTR, numPulses, (uintptr_t)pulses);
 
-   dmaAddr[DMA_CONBLK_AD] = cbAddr;
+   CHECK_WAVE_INITED;
 
-   /* clear READ/FIFO/READ_LAST_NOT_SET error bits */
+   if (numPulses > PI_WAVE_MAX_PULSES)
+      SOFT_ERROR(PI_TOO_MANY_PULSES, "bad number of pulses (%d)", numPulses);
 
-   dmaAddr[DMA_DEBUG] = DMA_DEBUG_READ_ERR            |
-                        DMA_DEBUG_FIFO_ERR            |
-                        DMA_DEBUG_RD_LST_NOT_SET_ERR;
+   if (!pulses) SOFT_ERROR(PI_BAD_POINTER, "bad (NULL) pulses pointer");
 
+   for (p=0; p<numPulses; p++)
+   {
+      wf[2][p].gpioOff = pulses[p].gpioOff;
+      wf[2][p].gpioOn  = pulses[p].gpioOn;
+      wf[2][p].usDelay = pulses[p].usDelay;
+      wf[2][p].flags   = 0;
+   }
 
-   dmaAddr[DMA_CS] = DMA_WAIT_ON_WRITES    |
-                     DMA_PANIC_PRIORITY(8) |
-                     DMA_PRIORITY(8)       |
-                     DMA_ACTIVE;
+   return rawWaveAddGeneric(numPulses, wf[2]);
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void initClearGlobals(void)
+int gpioWaveAddTrains(unsigned numTrains, gpioPulseTrain_t *trains)
 {
-   int i;
+   int t;
 
-   DBG(DBG_STARTUP, "");
+   DBG(DBG_USER, "numTrains=%u trains=%08"PRIXPTR,
+      numTrains, (uintptr_t)trains);
 
-   alertBits   = 0;
-   monitorBits = 0;
-   notifyBits  = 0;
-   scriptBits  = 0;
-   gFilterBits = 0;
-   nFilterBits = 0;
-   wdogBits    = 0;
+   CHECK_WAVE_INITED;
 
-   pthAlertRunning  = PI_THREAD_NONE;
-   pthFifoRunning   = PI_THREAD_NONE;
-   pthSocketRunning = PI_THREAD_NONE;
+   if (!trains) SOFT_ERROR(PI_BAD_POINTER, "bad (NULL) trains pointer");
 
-   wfc[0] = 0;
-   wfc[1] = 0;
-   wfc[2] = 0;
+   for (t=0; t<numTrains; t++)
+   {
+      if (trains[t].numPulses > PI_WAVE_MAX_PULSES)
+         SOFT_ERROR(PI_TOO_MANY_PULSES, "bad number of pulses (%d) train %d",
+            trains[t].numPulses, t);
 
-   wfcur=0;
+      if (trains[t].numPulses && !trains[t].pulses)
+         SOFT_ERROR(PI_BAD_POINTER, "bad (NULL) pulses pointer train %d", t);
+   }
 
-   wfStats.micros     = 0;
-   wfStats.highMicros = 0;
-   wfStats.maxMicros  = PI_WAVE_MAX_MICROS;
+   return rawWaveAddTrains(numTrains, trains);
+}
 
-   wfStats.pulses     = 0;
-   wfStats.highPulses = 0;
-   wfStats.maxPulses  = PI_WAVE_MAX_PULSES;
+/* ----------------------------------------------------------------------- */
 
-   wfStats.cbs        = 0;
-   wfStats.highCbs    = 0;
-   wfStats.maxCbs     = (PI_WAVE_BLOCKS * PAGES_PER_BLOCK * CBS_PER_OPAGE);
+int gpioWaveAddSerial
+   (unsigned gpio,
+    unsigned baud,
+    unsigned data_bits,
+    unsigned stop_bits,
+    unsigned offset,
+    unsigned numBytes,
+    char     *bstr)
+{
+   int p, status;
 
-   gpioGetSamples.func     = NULL;
-   gpioGetSamples.ex       = 0;
-   gpioGetSamples.userdata = NULL;
-   gpioGetSamples.bits     = 0;
+   DBG(DBG_USER,
+      "gpio=%d baud=%d bits=%d stops=%d offset=%d numBytes=%d str=[%s]",
+      gpio, baud, data_bits, stop_bits, offset,
+      numBytes, myBuf2Str(numBytes, (char *)bstr));
 
-   for (i=0; i<=PI_MAX_USER_GPIO; i++)
-   {
-      wfRx[i].mode      = PI_WFRX_NONE;
-      pthread_mutex_init(&wfRx[i].mutex, NULL);
-      gpioAlert[i].func = NULL;
-   }
+   CHECK_WAVE_INITED;
 
-   for (i=0; i<=PI_MAX_GPIO; i++)
-   {
-      gpioInfo [i].is      = GPIO_UNDEFINED;
-      gpioInfo [i].width   = 0;
-      gpioInfo [i].range   = PI_DEFAULT_DUTYCYCLE_RANGE;
-      gpioInfo [i].freqIdx = DEFAULT_PWM_IDX;
-   }
+   status = waveSerialCheck(
+      gpio, baud, data_bits, stop_bits, offset, numBytes);
 
-   for (i=0; i<PI_NOTIFY_SLOTS; i++)
-   {
-      gpioNotify[i].seqno = 0;
-      gpioNotify[i].state = PI_NOTIFY_CLOSED;
-   }
+   if (status) return status;
 
-   for (i=0; i<=PI_MAX_SIGNUM; i++)
-   {
-      gpioSignal[i].func     = NULL;
-      gpioSignal[i].ex       = 0;
-      gpioSignal[i].userdata = NULL;
-   }
+   if (data_bits > 8) numBytes /= 2;
+   if (data_bits > 16) numBytes /= 2;
 
-   for (i=0; i<=PI_MAX_TIMER; i++)
-   {
-      gpioTimer[i].running = 0;
-      gpioTimer[i].func    = NULL;
-   }
+   if (!numBytes) return 0;
 
-   for (i=0; i<=PI_MAX_EVENT; i++)
-   {
-      eventAlert[i].func      = NULL;
-      eventAlert[i].ignore    = 0;
-      eventAlert[i].fired     = 0;
-   }
+   p = waveSerialEncode(wf[2], PI_WAVE_MAX_PULSES,
+      gpio, baud, data_bits, stop_bits, offset, numBytes, bstr);
 
-   /* calculate the usable PWM frequencies */
+   if (p < 0) SOFT_ERROR(p, "too many pulses");
 
-   for (i=0; i<PWM_FREQS; i++)
-   {
-      pwmFreq[i]=
-         (1000000.0/
-            ((float)PULSE_PER_CYCLE*gpioCfg.clockMicros*pwmCycles[i]))+0.5;
+   return rawWaveAddGeneric(p, wf[2]);
+}
 
-      DBG(DBG_STARTUP, "f%d is %d", i, pwmFreq[i]);
-   }
+/* ----------------------------------------------------------------------- */
 
-   inpFifo = NULL;
-   outFifo = NULL;
+int gpioWaveAddSerials(unsigned numLanes, gpioSerialLane_t *lanes)
+{
+   unsigned i, chars, room, total;
+   int p, status;
+   rawWave_t *buf, *out;
+   waveSrc_t *src;
+   int *heap;
 
-   fdLock       = -1;
-   fdMem        = -1;
-   fdSock       = -1;
+   DBG(DBG_USER, "numLanes=%u lanes=%08"PRIXPTR,
+      numLanes, (uintptr_t)lanes);
 
-   dmaMboxBlk = MAP_FAILED;
-   dmaPMapBlk = MAP_FAILED;
-   dmaVirt = MAP_FAILED;
-   dmaBus  = MAP_FAILED;
+   CHECK_WAVE_INITED;
 
-   auxReg  = MAP_FAILED;
-   clkReg  = MAP_FAILED;
-   dmaReg  = MAP_FAILED;
-   gpioReg = MAP_FAILED;
-   pcmReg  = MAP_FAILED;
-   pwmReg  = MAP_FAILED;
-   systReg = MAP_FAILED;
-   spiReg  = MAP_FAILED;
-}
+   if (!lanes) SOFT_ERROR(PI_BAD_POINTER, "bad (NULL) lanes pointer");
+
+   total = 0;
+
+   for (i=0; i<numLanes; i++)
+   {
+      status = waveSerialCheck(lanes[i].gpio, lanes[i].baud,
+         lanes[i].data_bits, lanes[i].stop_bits,
+         lanes[i].offset, lanes[i].numBytes);
 
-/* ----------------------------------------------------------------------- */
+      if (status) return status;
 
-static void initReleaseResources(void)
-{
-   int i;
+      if (lanes[i].numBytes && !lanes[i].str)
+         SOFT_ERROR(PI_BAD_POINTER, "bad (NULL) str pointer lane %d", i);
 
-   DBG(DBG_STARTUP, "");
+      chars = lanes[i].numBytes;
 
-   /* shut down running threads */
+      if (lanes[i].data_bits > 8) chars /= 2;
+      if (lanes[i].data_bits > 16) chars /= 2;
 
-   for (i=0; i<=PI_MAX_GPIO; i++)
-   {
-      if (gpioISR[i].pth)
+      if (chars)
       {
-         /* destroy thread, unexport GPIO */
+         room = (chars * (lanes[i].data_bits + 2)) + 1;
 
-         gpioSetISRFunc(i, 0, 0, NULL);
+         if (room > PI_WAVE_MAX_PULSES) room = PI_WAVE_MAX_PULSES;
+
+         total += room;
       }
    }
 
-   for (i=0; i<=PI_MAX_TIMER; i++)
-   {
-      if (gpioTimer[i].running)
-      {
-         /* destroy thread */
+   buf = malloc((total * sizeof(rawWave_t)) +
+      ((numLanes+1) * (sizeof(waveSrc_t) + sizeof(int))));
 
-         pthread_cancel(gpioTimer[i].pthId);
-         pthread_join(gpioTimer[i].pthId, NULL);
-         gpioTimer[i].running = 0;
-      }
-   }
+   if (buf == NULL) return PI_NO_MEMORY;
 
-   if (pthAlertRunning != PI_THREAD_NONE)
-   {
-      pthread_cancel(pthAlert);
-      pthread_join(pthAlert, NULL);
-      pthAlertRunning = PI_THREAD_NONE;
-   }
+   src  = (waveSrc_t *)(buf + total);
+   heap = (int *)(src + numLanes + 1);
 
-   if (pthFifoRunning != PI_THREAD_NONE)
-   {
-      pthread_cancel(pthFifo);
-      pthread_join(pthFifo, NULL);
-      pthFifoRunning = PI_THREAD_NONE;
-   }
+   out = buf;
 
-   if (pthSocketRunning != PI_THREAD_NONE)
+   for (i=0; i<numLanes; i++)
    {
-      pthread_cancel(pthSocket);
-      pthread_join(pthSocket, NULL);
-      pthSocketRunning = PI_THREAD_NONE;
-   }
+      src[i].tNext = 0;
+      src[i].pos   = 0;
+      src[i].num   = 0;
+      src[i].raw   = out;
+      src[i].pulse = NULL;
 
-   /* release mmap'd memory */
+      chars = lanes[i].numBytes;
 
-   if (auxReg  != MAP_FAILED) munmap((void *)auxReg,  AUX_LEN);
-   if (bscsReg != MAP_FAILED) munmap((void *)bscsReg, BSCS_LEN);
-   if (clkReg  != MAP_FAILED) munmap((void *)clkReg,  CLK_LEN);
-   if (dmaReg  != MAP_FAILED) munmap((void *)dmaReg,  DMA_LEN);
-   if (gpioReg != MAP_FAILED) munmap((void *)gpioReg, GPIO_LEN);
-   if (pcmReg  != MAP_FAILED) munmap((void *)pcmReg,  PCM_LEN);
-   if (pwmReg  != MAP_FAILED) munmap((void *)pwmReg,  PWM_LEN);
-   if (systReg != MAP_FAILED) munmap((void *)systReg, SYST_LEN);
-   if (spiReg  != MAP_FAILED) munmap((void *)spiReg,  SPI_LEN);
+      if (lanes[i].data_bits > 8) chars /= 2;
+      if (lanes[i].data_bits > 16) chars /= 2;
 
-   auxReg  = MAP_FAILED;
-   bscsReg = MAP_FAILED;
-   clkReg  = MAP_FAILED;
-   dmaReg  = MAP_FAILED;
-   gpioReg = MAP_FAILED;
-   pcmReg  = MAP_FAILED;
-   pwmReg  = MAP_FAILED;
-   systReg = MAP_FAILED;
-   spiReg  = MAP_FAILED;
+      if (!chars) continue;
 
-   if (dmaBus != MAP_FAILED)
-   {
-      munmap(dmaBus,
-         PAGES_PER_BLOCK*(bufferBlocks+PI_WAVE_BLOCKS)*sizeof(dmaPage_t *));
-   }
+      room = (chars * (lanes[i].data_bits + 2)) + 1;
 
-   dmaBus = MAP_FAILED;
+      if (room > PI_WAVE_MAX_PULSES) room = PI_WAVE_MAX_PULSES;
 
-   if (dmaVirt != MAP_FAILED)
-   {
-      for (i=0; i<PAGES_PER_BLOCK*(bufferBlocks+PI_WAVE_BLOCKS); i++)
+      p = waveSerialEncode(out, room, lanes[i].gpio, lanes[i].baud,
+         lanes[i].data_bits, lanes[i].stop_bits, lanes[i].offset,
+         chars, lanes[i].str);
+
+      if (p < 0)
       {
-         munmap(dmaVirt[i], PAGE_SIZE);
+         free(buf);
+         SOFT_ERROR(p, "too many pulses lane %d", i);
       }
 
-      munmap(dmaVirt,
-         PAGES_PER_BLOCK*(bufferBlocks+PI_WAVE_BLOCKS)*sizeof(dmaPage_t *));
+      src[i].num = p;
+
+      out += room;
    }
 
-   dmaVirt = MAP_FAILED;
+   status = rawWaveMerge(numLanes, src, heap);
 
-   if (dmaPMapBlk != MAP_FAILED)
-   {
-      for (i=0; i<(bufferBlocks+PI_WAVE_BLOCKS); i++)
-      {
-         munmap(dmaPMapBlk[i], PAGES_PER_BLOCK*PAGE_SIZE);
-      }
+   free(buf);
 
-      munmap(dmaPMapBlk, (bufferBlocks+PI_WAVE_BLOCKS)*sizeof(dmaPage_t *));
-   }
+   return status;
+}
 
-   dmaPMapBlk = MAP_FAILED;
+/* ----------------------------------------------------------------------- */
 
-   if (dmaMboxBlk != MAP_FAILED)
-   {
-      fdMbox = mbOpen();
+int rawWaveAddSPI(
+   rawSPI_t *spi,
+   unsigned offset,
+   unsigned spiSS,
+   char *buf,
+   unsigned spiTxBits,
+   unsigned spiBitFirst,
+   unsigned spiBitLast,
+   unsigned spiBits)
+{
+   int p, bit, dbv, halfbit;
+   int rising_edge[2], read_cycle[2];
+   uint32_t on_bits, off_bits;
+   int tx_bit_pos;
 
-      for (i=0; i<(bufferBlocks+PI_WAVE_BLOCKS); i++)
-      {
-         mbDMAFree(&dmaMboxBlk[bufferBlocks+PI_WAVE_BLOCKS-i-1]);
-      }
+   DBG(DBG_USER,
+      "spi=%08"PRIXPTR" off=%d spiSS=%d tx=%08"PRIXPTR", num=%d fb=%d lb=%d spiBits=%d",
+      (uintptr_t)spi, offset, spiSS, (uintptr_t)buf, spiTxBits,
+      spiBitFirst, spiBitLast, spiBits);
 
-      mbClose(fdMbox);
+   CHECK_WAVE_INITED;
 
-      munmap(dmaMboxBlk, (bufferBlocks+PI_WAVE_BLOCKS)*sizeof(DMAMem_t));
-   }
+   if (spiSS > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", spiSS);
 
-   dmaMboxBlk = MAP_FAILED;
+   /*
+   CPOL CPHA
+    0    0   read rising/write falling
+    0    1   read falling/write rising
+    1    0   read falling/write rising
+    1    1   read rising/write falling
+   */
 
-   if (inpFifo != NULL)
-   {
-      fclose(inpFifo);
-      unlink(PI_INPFIFO);
-      inpFifo = NULL;
-   }
+   if (spi->clk_pol) {rising_edge[0] = 0; rising_edge[1] = 1;}
+   else              {rising_edge[0] = 1; rising_edge[1] = 0;}
 
-   if (outFifo != NULL)
-   {
-      fclose(outFifo);
-      unlink(PI_OUTFIFO);
-      outFifo = NULL;
-   }
+   if (spi->clk_pha) {read_cycle[0] = 0; read_cycle[1] = 1;}
+   else              {read_cycle[0] = 1; read_cycle[1] = 0;}
 
-   if (fdMem != -1)
-   {
-      close(fdMem);
-      fdMem = -1;
-   }
+   p = 0;
 
-   if (fdLock != -1)
+   if (offset)
    {
-      close(fdLock);
-      unlink(PI_LOCKFILE);
-      fdLock = -1;
+      wf[2][p].gpioOn  = 0;
+      wf[2][p].gpioOff = 0;
+      wf[2][p].flags   = 0;
+      wf[2][p].usDelay = offset;
+      p++;
    }
 
-   if (fdSock != -1)
-   {
-      close(fdSock);
-      fdSock = -1;
-   }
+   on_bits = 0;
+   off_bits = 0;
 
-   if (fdPmap != -1)
+   tx_bit_pos = 0;
+
+   /* preset initial mosi bit */
+
+   if (getBitInBytes(tx_bit_pos, buf, spiTxBits))
    {
-      close(fdPmap);
-      fdPmap = -1;
+      on_bits  |= (1<<(spi->mosi));
+      dbv = 1;
    }
-
-   if (fdMbox != -1)
+   else
    {
-      close(fdMbox);
-      fdMbox = -1;
+      off_bits |= (1<<(spi->mosi));
+      dbv = 0;
    }
 
-   gpioStats.DMARestarts = 0;
-   gpioStats.dmaInitCbsCount = 0;
-
-   numSockNetAddr = 0;
-}
-
-int initInitialise(void)
-{
-   int i;
-   unsigned rev, model;
-   struct sockaddr_in server;
-   struct sockaddr_in6 server6;
-   char * portStr;
-   unsigned port;
-   struct sched_param param;
-   pthread_attr_t pthAttr;
-
-   DBG(DBG_STARTUP, "");
-
-   waveClockInited = 0;
-   PWMClockInited = 0;
-
-   clock_gettime(CLOCK_REALTIME, &libStarted);
+   if (!spi->clk_pha) tx_bit_pos ++;
 
-   rev = gpioHardwareRevision();
+   if (spi->ss_pol) off_bits |= (1<<spiSS);
+   else             on_bits  |= (1<<spiSS);
 
-   initClearGlobals();
+   if (spi->clk_pol) on_bits  |= (1<<(spi->clk));
+   else              off_bits |= (1<<(spi->clk));
 
-   if (initCheckPermitted() < 0) return PI_INIT_FAILED;
+   wf[2][p].gpioOn  = on_bits;
+   wf[2][p].gpioOff = off_bits;
+   wf[2][p].flags   = 0;
 
-   fdLock = initGrabLockFile();
+   if (spi->clk_us > spi->ss_us) wf[2][p].usDelay = spi->clk_us;
+   else                          wf[2][p].usDelay = spi->ss_us;
 
-   if (fdLock < 0)
-      SOFT_ERROR(PI_INIT_FAILED, "Can't lock %s", PI_LOCKFILE);
+   p++;
 
-   if (!gpioMaskSet)
+   for (bit=1; bit<=spiBits; bit++)
    {
-      if      (rev ==  0) gpioMask = PI_DEFAULT_UPDATE_MASK_UNKNOWN;
-      else if (rev <   4) gpioMask = PI_DEFAULT_UPDATE_MASK_B1;
-      else if (rev <  16) gpioMask = PI_DEFAULT_UPDATE_MASK_A_B2;
-      else if (rev == 17) gpioMask = PI_DEFAULT_UPDATE_MASK_COMPUTE;
-      else if (rev  < 20) gpioMask = PI_DEFAULT_UPDATE_MASK_APLUS_BPLUS;
-      else if (rev == 20) gpioMask = PI_DEFAULT_UPDATE_MASK_COMPUTE;
-      else if (rev == 21) gpioMask = PI_DEFAULT_UPDATE_MASK_APLUS_BPLUS;
-      else
+      for (halfbit=0; halfbit<2; halfbit++)
       {
-         model = (rev >> 4) & 0xFF;
+         wf[2][p].usDelay = spi->clk_us;
+         wf[2][p].flags = 0;
 
-         /* model
-         0=A 1=B
-         2=A+ 3=B+
-         4=Pi2B
-         5=Alpha
-         6=Compute Module
-         7=Unknown
-         8=Pi3B
-         9=Zero
-         12=Zero W
-         13=Pi3B+
-         14=Pi3A+
-         17=Pi4B
-         */
-         if      (model <  2) gpioMask = PI_DEFAULT_UPDATE_MASK_A_B2;
-         else if (model <  4) gpioMask = PI_DEFAULT_UPDATE_MASK_APLUS_BPLUS;
-         else if (model == 4) gpioMask = PI_DEFAULT_UPDATE_MASK_PI2B;
+         on_bits = 0;
+         off_bits = 0;
 
-         else if (model == 6
-               || model ==10
-               || model ==16) gpioMask = PI_DEFAULT_UPDATE_MASK_COMPUTE;
+         if (read_cycle[halfbit])
+         {
+            if ((bit>=spiBitFirst) && (bit<=spiBitLast))
+               wf[2][p].flags = WAVE_FLAG_READ;
+         }
+         else
+         {
+            if (getBitInBytes(tx_bit_pos, buf, spiTxBits))
+            {
+               if (!dbv) on_bits  |= (1<<(spi->mosi));
+               dbv = 1;
+            }
+            else
+            {
+               if (dbv) off_bits |= (1<<(spi->mosi));
+               dbv = 0;
+            }
+
+            ++tx_bit_pos;
+         }
 
-         else if (model == 8
-               || model ==13
-               || model ==14) gpioMask = PI_DEFAULT_UPDATE_MASK_PI3B;
+         if (rising_edge[halfbit]) on_bits  |= (1<<(spi->clk));
+         else                      off_bits |= (1<<(spi->clk));
 
-         else if (model == 9
-               || model ==12) gpioMask = PI_DEFAULT_UPDATE_MASK_ZERO;
+         wf[2][p].gpioOn = on_bits;
+         wf[2][p].gpioOff = off_bits;
 
-         else if (model ==17) gpioMask = PI_DEFAULT_UPDATE_MASK_PI4B;
-         else                 gpioMask = PI_DEFAULT_UPDATE_MASK_UNKNOWN;
+         p++;
       }
-
-      gpioMaskSet = 1;
    }
 
-#ifndef EMBEDDED_IN_VM
-   if (!(gpioCfg.internals & PI_CFG_NOSIGHANDLER))
-      sigSetHandler();
-#endif
+   on_bits = 0;
+   off_bits = 0;
 
-   if (initPeripherals() < 0) return PI_INIT_FAILED;
+   if (spi->ss_pol) on_bits  |= (1<<spiSS);
+   else             off_bits |= (1<<spiSS);
 
-   if (initAllocDMAMem() < 0) return PI_INIT_FAILED;
+   wf[2][p].gpioOn  = on_bits;
+   wf[2][p].gpioOff = off_bits;
+   wf[2][p].flags   = 0;
+   wf[2][p].usDelay = 0;
 
-   /* done with /dev/mem */
+   p++;
 
-   if (fdMem != -1)
-   {
-      close(fdMem);
-      fdMem = -1;
-   }
+   return rawWaveAddGeneric(p, wf[2]);
+}
 
-   param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+/* ----------------------------------------------------------------------- */
 
-   if (gpioCfg.internals & PI_CFG_RT_PRIORITY)
-      sched_setscheduler(0, SCHED_FIFO, &param);
+int gpioWaveCreate(void)
+{
+   int wid;
+   int numCB, numBOOL, numTOOL;
+   int CB, BOOL, TOOL;
+   uint32_t hash = 0;
 
-   initClock(1); /* initialise main clock */
+   DBG(DBG_USER, "");
 
-   atexit(gpioTerminate);
+   CHECK_WAVE_INITED;
 
-   if (pthread_attr_init(&pthAttr))
-      SOFT_ERROR(PI_INIT_FAILED, "pthread_attr_init failed (%m)");
+   if (wfc[wfcur] == 0) return PI_EMPTY_WAVEFORM;
 
-   if (pthread_attr_setstacksize(&pthAttr, STACK_SIZE))
-      SOFT_ERROR(PI_INIT_FAILED, "pthread_attr_setstacksize failed (%m)");
+   /* An identical cached wave is shared rather than rebuilt. */
 
-   if (!(gpioCfg.ifFlags & PI_DISABLE_ALERT))
+   if (gpioCfg.internals & PI_CFG_WAVE_CACHE)
    {
-      if (pthread_create(&pthAlert, &pthAttr, pthAlertThread, &i))
-         SOFT_ERROR(PI_INIT_FAILED, "pthread_create alert failed (%m)");
+      hash = waveCacheHash(wf[wfcur], wfc[wfcur]);
 
-      pthAlertRunning = PI_THREAD_STARTED;
-   }
+      wid = waveCacheFind(hash, wf[wfcur], wfc[wfcur]);
 
-   if (!(gpioCfg.ifFlags & PI_DISABLE_FIFO_IF))
-   {
-      if (pthread_create(&pthFifo, &pthAttr, pthFifoThread, &i))
-         SOFT_ERROR(PI_INIT_FAILED, "pthread_create fifo failed (%m)");
+      /* a saturated count gets a fresh wave */
 
-      pthFifoRunning = PI_THREAD_STARTED;
-   }
+      if ((wid >= 0) && (waveRefs[wid] < UINT32_MAX))
+      {
+         waveRefs[wid]++;
 
-   if (!(gpioCfg.ifFlags & PI_DISABLE_SOCK_IF))
-   {
-      portStr = getenv(PI_ENVPORT);
-      if (portStr) port = atoi(portStr); else port = gpioCfg.socketPort;
+         DBG(DBG_USER, "Wave cache: wid=%d refs %u", wid, waveRefs[wid]);
 
-      // Accept connections on IPv6, unless we have an IPv4-only whitelist
-      if (!numSockNetAddr)
-      {
-         fdSock = socket(AF_INET6, SOCK_STREAM , 0);
+         wfc[0] = 0;
+         wfc[1] = 0;
+         wfc[2] = 0;
 
-         if (fdSock != -1)
-         {
-            bzero((char *)&server6, sizeof(server6));
-            server6.sin6_family = AF_INET6;
-            if (gpioCfg.ifFlags & PI_LOCALHOST_SOCK_IF)
-            {
-               server6.sin6_addr = in6addr_loopback;
-            }
-            else
-            {
-               server6.sin6_addr = in6addr_any;
-            }
-            server6.sin6_port = htons(port);
+         wfcur = 0;
 
-            int opt = 1;
-            setsockopt(fdSock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-            if (bind(fdSock,(struct sockaddr *)&server6, sizeof(server6)) < 0)
-               SOFT_ERROR(PI_INIT_FAILED, "bind to port %d failed (%m)", port);
-         }
+         return wid;
       }
+   }
 
-      if (numSockNetAddr || fdSock == -1)
-      {
-         fdSock = socket(AF_INET , SOCK_STREAM , 0);
+   /* What resources are needed? */
 
-         if (fdSock == -1)
-            SOFT_ERROR(PI_INIT_FAILED, "socket failed (%m)");
-         else
-         {
-           int opt = 1;
-           setsockopt(fdSock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-         }
-         server.sin_family = AF_INET;
-         if (gpioCfg.ifFlags & PI_LOCALHOST_SOCK_IF)
-         {
-            server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-         }
-         else
-         {
-            server.sin_addr.s_addr = htonl(INADDR_ANY);
-         }
-         server.sin_port = htons(port);
+      waveCBsOOLs(&numCB, &numBOOL, &numTOOL);
 
-         if (bind(fdSock,(struct sockaddr *)&server , sizeof(server)) < 0)
-            SOFT_ERROR(PI_INIT_FAILED, "bind to port %d failed (%m)", port);
-      }
+   /* Best fit from the free space. */
 
-      if (pthread_create(&pthSocket, &pthAttr, pthSocketThread, &i))
-         SOFT_ERROR(PI_INIT_FAILED, "pthread_create socket failed (%m)");
+   wid = waveAllocate(numCB, numBOOL, numTOOL);
 
-      pthSocketRunning = PI_THREAD_STARTED;
-   }
+   if (wid < 0) return wid;
 
-   myGpioDelay(1000);
+   CB   = waveInfo[wid].botCB;
+   BOOL = waveInfo[wid].botOOL;
+   TOOL = waveInfo[wid].topOOL;
 
-   dmaInitCbs();
+   wave2Cbs(PI_WAVE_MODE_ONE_SHOT, &CB, &BOOL, &TOOL, 0, 0, 0);
 
-   flushMemory();
+   /* Sanity check. */
 
-   //cast twice to suppress compiler warning, I belive this cast
-   //is ok because dmaIBus contains bus addresses, not virtual
-   //addresses.
-   initDMAgo((uint32_t *)dmaIn, (uint32_t)(uintptr_t)dmaIBus[0]);
+   if ( (numCB   != (CB-waveInfo[wid].botCB))    ||
+        (numBOOL != (BOOL-waveInfo[wid].botOOL)) ||
+        (numTOOL != (waveInfo[wid].topOOL-TOOL)) )
+   {
+      DBG(DBG_ALWAYS, "ERROR wid=%d CBs %d=%d BOOL %d=%d TOOL %d=%d", wid,
+         numCB,   CB-waveInfo[wid].botCB,
+         numBOOL, BOOL-waveInfo[wid].botOOL,
+         numTOOL, waveInfo[wid].topOOL-TOOL);
+   }
 
-   return PIGPIO_VERSION;
-}
+   DBG(DBG_USER, "Wave Stats: wid=%d CBs %d BOOL %d TOOL %d", wid,
+      numCB, numBOOL, numTOOL);
 
+   waveInfo[wid].deleted = 0;
 
-/* ======================================================================= */
+   if (gpioCfg.internals & PI_CFG_WAVE_CACHE)
+      waveCacheKeep(wid, hash, wf[wfcur], wfc[wfcur]);
 
-int getBitInBytes(int bitPos, char *buf, int numBits)
-{
-   int bitp, bufp;
+   /* Consume waves. */
 
-   if (bitPos < numBits)
-   {
-      bufp =      bitPos / 8;
-      bitp = 7 - (bitPos % 8);
-      if (buf[bufp] & (1<<bitp)) return 1;
-   }
+   wfc[0] = 0;
+   wfc[1] = 0;
+   wfc[2] = 0;
 
-   return 0;
-}
+   wfcur = 0;
 
-/* ----------------------------------------------------------------------- */
+   return wid;
+}
 
-void putBitInBytes(int bitPos, char *buf, int bit)
+int gpioWaveCreatePad(int pctCB, int pctBOOL, int pctTOOL)
 {
-   int bitp, bufp;
+   int wid;
+   int numCB, numBOOL, numTOOL;
+   int CB, BOOL, TOOL;
 
-   bufp =      bitPos / 8;
-   bitp = 7 - (bitPos % 8);
+   DBG(DBG_USER, "%d, %d, %d", pctCB, pctBOOL, pctTOOL);
 
-   if (bit) buf[bufp] |=   (1<<bitp);
-   else     buf[bufp] &= (~(1<<bitp));
-}
+   CHECK_WAVE_INITED;
 
-/* ----------------------------------------------------------------------- */
+   if (pctCB < 0 || pctCB > 100)
+      SOFT_ERROR(PI_BAD_PARAM, "bad wave param, pctCB=(%d)", pctCB);
+   if (pctBOOL < 0 || pctBOOL > 100)
+      SOFT_ERROR(PI_BAD_PARAM, "bad wave param, pctBOOL=(%d)", pctBOOL);
+   if (pctTOOL < 0 || pctTOOL > 100)
+      SOFT_ERROR(PI_BAD_PARAM, "bad wave param, pctTOOL=(%d)", pctTOOL);
 
-uint32_t rawWaveGetOOL(int pos)
-{
-   int page, slot;
+   if (wfc[wfcur] == 0) return PI_EMPTY_WAVEFORM;
 
-   if ((pos >= 0) && (pos < NUM_WAVE_OOL))
-   {
-      waveOOLPageSlot(pos, &page, &slot);
-      return (dmaOVirt[page]->OOL[slot]);
-   }
+   /* What resources are needed? */
+   waveCBsOOLs(&numCB, &numBOOL, &numTOOL);
 
-   return -1;
-}
+   /* Amount of pad required */
+   CB = (NUM_WAVE_CBS - PI_WAVE_COUNT_PAGES*CBS_PER_OPAGE) * pctCB / 100;
+   BOOL = (NUM_WAVE_OOL - PI_WAVE_COUNT_PAGES*OOL_PER_OPAGE) * pctBOOL /100;
+   TOOL = (NUM_WAVE_OOL - PI_WAVE_COUNT_PAGES*OOL_PER_OPAGE) * pctTOOL /100;
 
-/* ----------------------------------------------------------------------- */
+   /* Reject if wave is too big */
+   if (numCB > CB) return PI_TOO_MANY_CBS;
+   if (numBOOL > BOOL) return PI_TOO_MANY_OOL;
+   if (numTOOL > TOOL) return PI_TOO_MANY_OOL;
 
-void rawWaveSetOOL(int pos, uint32_t value)
-{
-   int page, slot;
+   /* Set the padding */
+   numCB = CB;
+   numBOOL = BOOL;
+   numTOOL = TOOL;
 
-   if ((pos >= 0) && (pos < NUM_WAVE_OOL))
-   {
-      waveOOLPageSlot(pos, &page, &slot);
-      dmaOVirt[page]->OOL[slot] = value;
-   }
-}
+   /* Best fit from the free space. */
 
+   wid = waveAllocate(numCB, numBOOL, numTOOL);
 
-/* ----------------------------------------------------------------------- */
+   if (wid < 0) return wid;
 
-uint32_t rawWaveGetOut(int pos)
-{
-   int page, slot;
+   CB   = waveInfo[wid].botCB;
+   BOOL = waveInfo[wid].botOOL;
+   TOOL = waveInfo[wid].topOOL;
+
+   wave2Cbs(PI_WAVE_MODE_ONE_SHOT, &CB, &BOOL, &TOOL, numCB, numBOOL, numTOOL);
 
-   if ((pos >= 0) && (pos < NUM_WAVE_OOL))
+   /* Sanity check. */
+
+   if ( (numCB   != (CB-waveInfo[wid].botCB))    ||
+        (numBOOL != (BOOL-waveInfo[wid].botOOL)) ||
+        (numTOOL != (waveInfo[wid].topOOL-TOOL)) )
    {
-      waveOOLPageSlot(pos, &page, &slot);
-      return (dmaOVirt[page]->OOL[slot]);
+      DBG(DBG_ALWAYS, "ERROR wid=%d CBs %d=%d BOOL %d=%d TOOL %d=%d", wid,
+         numCB,   CB-waveInfo[wid].botCB,
+         numBOOL, BOOL-waveInfo[wid].botOOL,
+         numTOOL, waveInfo[wid].topOOL-TOOL);
    }
 
-   return -1;
-}
+   DBG(DBG_USER, "Wave padding: wid=%d CBs %d BOOL %d TOOL %d", wid,
+      numCB, numBOOL, numTOOL);
 
-/* ----------------------------------------------------------------------- */
+   waveInfo[wid].deleted = 0;
 
-void rawWaveSetOut(int pos, uint32_t value)
-{
-   int page, slot;
+   /* Consume waves. */
 
-   if ((pos >= 0) && (pos < NUM_WAVE_OOL))
-   {
-      waveOOLPageSlot(pos, &page, &slot);
-      dmaOVirt[page]->OOL[slot] = value;
-   }
-}
+   wfc[0] = 0;
+   wfc[1] = 0;
+   wfc[2] = 0;
 
+   wfcur = 0;
 
+   return wid;
+}
 /* ----------------------------------------------------------------------- */
 
-uint32_t rawWaveGetIn(int pos)
+int gpioWaveDelete(unsigned wave_id)
 {
-   int page, slot;
+   DBG(DBG_USER, "wave id=%d", wave_id);
 
-   if ((pos >= 0) && (pos < NUM_WAVE_OOL))
-   {
-      waveOOLPageSlot((NUM_WAVE_OOL-1)-pos, &page, &slot);
-      return (dmaOVirt[page]->OOL[slot]);
-   }
+   CHECK_WAVE_INITED;
 
-   return -1;
-}
+   if ((wave_id >= waveOutCount) || waveInfo[wave_id].deleted)
+      SOFT_ERROR(PI_BAD_WAVE_ID, "bad wave id (%d)", wave_id);
 
-/* ----------------------------------------------------------------------- */
+   if (waveSlotOf(wave_id) >= 0)
+      SOFT_ERROR(PI_BAD_WAVE_ID, "wave %d belongs to a slot", wave_id);
 
-void rawWaveSetIn(int pos, uint32_t value)
-{
-   int page, slot;
+   if (waveStream.open && (waveStream.wid == wave_id))
+      SOFT_ERROR(PI_BAD_WAVE_ID, "wave %d belongs to the stream", wave_id);
 
-   if ((pos >= 0) && (pos < NUM_WAVE_OOL))
+   /* a shared cached wave goes when its last user deletes it */
+
+   if (waveRefs[wave_id] > 1)
    {
-      waveOOLPageSlot((NUM_WAVE_OOL-1)-pos, &page, &slot);
-      dmaOVirt[page]->OOL[slot] = value;
+      waveRefs[wave_id]--;
+      return 0;
    }
-}
-
-/* ----------------------------------------------------------------------- */
 
-rawWaveInfo_t rawWaveInfo(int wave_id)
-{
-   rawWaveInfo_t dummy = {0, 0, 0, 0, 0, 0, 0, 0};
+   waveInfo[wave_id].deleted = 1;
 
-   if ((wave_id >=0) && (wave_id < PI_MAX_WAVES)) return waveInfo[wave_id];
-   else                                           return dummy;
-}
+   /* the space is free at once, merged with any free neighbours */
 
-/* ----------------------------------------------------------------------- */
+   waveRelease(wave_id);
 
-double time_time(void)
-{
-   struct timeval tv;
-   double t;
+   if (wave_id == (waveOutCount-1))
+   {
+      /* top wave deleted, release any other deleted top ids */
 
-   gettimeofday(&tv, 0);
+      while ((wave_id > 0) && (waveInfo[wave_id-1].deleted)) --wave_id;
 
-   t = (double)tv.tv_sec + ((double)tv.tv_usec / 1E6);
+      waveOutCount = wave_id;
+   }
 
-   return t;
+   return 0;
 }
 
 /* ----------------------------------------------------------------------- */
 
-void time_sleep(double seconds)
+static int waveCbIndex(uint32_t addr, int bot, int top)
 {
-   struct timespec ts, rem;
+   /* reverse of waveCbPOadr for CBs bot..top, -1 if not one of them */
 
-   if (seconds > 0.0)
+   int page;
+   uint32_t base;
+
+   for (page=bot/CBS_PER_OPAGE; page<=top/CBS_PER_OPAGE; page++)
    {
-      ts.tv_sec = seconds;
-      ts.tv_nsec = (seconds-(double)ts.tv_sec) * 1E9;
+      base = waveCbPOadr(page*CBS_PER_OPAGE);
 
-      while (clock_nanosleep(CLOCK_REALTIME, 0, &ts, &rem))
+      if ((addr >= base) && (addr < (base + CBS_PER_OPAGE*sizeof(rawCbs_t))) &&
+          (((addr - base) % sizeof(rawCbs_t)) == 0))
       {
-         /* copy remaining time to ts */
-         ts.tv_sec  = rem.tv_sec;
-         ts.tv_nsec = rem.tv_nsec;
+         page = page*CBS_PER_OPAGE + (addr - base) / sizeof(rawCbs_t);
+
+         if ((page >= bot) && (page <= top)) return page;
+
+         return -1;
       }
    }
+
+   return -1;
 }
 
 /* ----------------------------------------------------------------------- */
 
-void rawDumpWave(void)
+static int waveOOLIndex(uint32_t addr, int bot, int top)
 {
-   int i;
+   /* reverse of waveOOLPOadr for OOLs bot..top, -1 if not one of them */
 
-   unsigned numWaves, t;
+   int page;
+   uint32_t base;
 
-   rawWave_t *waves;
+   if (top < bot) return -1;
 
-   numWaves = wfc[wfcur];
-   waves    = wf [wfcur];
+   for (page=bot/OOL_PER_OPAGE; page<=top/OOL_PER_OPAGE; page++)
+   {
+      base = waveOOLPOadr(page*OOL_PER_OPAGE);
 
-   t = 0;
+      if ((addr >= base) && (addr < (base + OOL_PER_OPAGE*4)) &&
+          (((addr - base) % 4) == 0))
+      {
+         page = page*OOL_PER_OPAGE + (addr - base) / 4;
 
-   for (i=0; i<numWaves; i++)
-   {
-      fprintf(stderr, "%10u %08X %08X %08X %10u\n",
-         t, waves[i].gpioOn, waves[i].gpioOff,
-         waves[i].flags, waves[i].usDelay);
-      t += waves[i].usDelay;
+         if ((page >= bot) && (page <= top)) return page;
+
+         return -1;
+      }
    }
+
+   return -1;
 }
 
 /* ----------------------------------------------------------------------- */
 
-void rawDumpScript(unsigned script_id)
+static int wavePlace(int pos, int len, waveSpan_t *pin, int pins)
 {
-   int i;
+   /* lowest position at or above pos which misses the pinned spans */
 
-   if (script_id >= PI_MAX_SCRIPTS) return;
+   int i, clash;
 
-   if (gpioScript[script_id].state == PI_SCRIPT_IN_USE)
+   do
    {
+      clash = 0;
 
-      for (i=0; i<PI_MAX_SCRIPT_PARAMS; i++)
-      {
-         fprintf(stderr, "p%d=%d ", i, gpioScript[script_id].script.par[i]);
-      }
-
-      fprintf(stderr, "\n");
-
-      for (i=0; i<PI_MAX_SCRIPT_VARS; i++)
-      {
-         fprintf(stderr, "v%d=%d ", i, gpioScript[script_id].script.var[i]);
-      }
-
-      fprintf(stderr, "\n");
-
-      for (i=0; i<gpioScript[script_id].script.instrs; i++)
+      for (i=0; i<pins; i++)
       {
-         fprintf(stderr,
-            "c%d=[%"PRIdPTR", %"PRIdPTR"(%d), %"PRIdPTR"(%d), %"PRIdPTR", %"PRIdPTR"]\n",
-            i,
-            gpioScript[script_id].script.instr[i].p[0],
-            gpioScript[script_id].script.instr[i].p[1],
-            gpioScript[script_id].script.instr[i].opt[1],
-            gpioScript[script_id].script.instr[i].p[2],
-            gpioScript[script_id].script.instr[i].opt[2],
-            gpioScript[script_id].script.instr[i].p[3],
-            gpioScript[script_id].script.instr[i].p[4]);
+         if ((pos < (pin[i].start + pin[i].len)) && (pin[i].start < (pos + len)))
+         {
+            pos = pin[i].start + pin[i].len;
+            clash = 1;
+         }
       }
    }
+   while (clash);
+
+   return pos;
 }
 
-/* ======================================================================= */
+/* ----------------------------------------------------------------------- */
 
-int gpioInitialise(void)
+static int wavePack(int base, int *wid, int count, int isOOL,
+                    waveSpan_t *pin, int pins, int *newPos)
 {
-   int status;
-
-   if (libInitialised) return PIGPIO_VERSION;
-
-   DBG(DBG_STARTUP, "not initialised, initialising");
+   /*
+      Pack the waves in wid[] (sorted by current position) towards base.
+      No wave moves up so the moves may be made in the same order.
+      Returns the end of the packed space.
+   */
 
-   runState = PI_STARTING;
+   int i, w, pos, len;
 
-   status = initInitialise();
+   pos = base;
 
-   if (status < 0)
-   {
-      runState = PI_ENDING;
-      initReleaseResources();
-   }
-   else
+   for (i=0; i<count; i++)
    {
-      libInitialised = 1;
+      w = wid[i];
 
-      runState = PI_RUNNING;
+      if (isOOL) len = waveInfo[w].numBOOL + waveInfo[w].numTOOL;
+      else       len = waveInfo[w].numCB;
 
-      if (!(gpioCfg.ifFlags & PI_DISABLE_ALERT))
+      if (len)
       {
-         while (pthAlertRunning != PI_THREAD_RUNNING) myGpioDelay(1000);
+         pos = wavePlace(pos, len, pin, pins);
+         newPos[w] = pos;
+         pos += len;
       }
-
+      else newPos[w] = waveInfo[w].botOOL;
    }
 
-   return status;
+   return pos;
 }
 
-
 /* ----------------------------------------------------------------------- */
 
-void gpioTerminate(void)
+static void waveSortBy(int *wid, int count, int isOOL)
 {
-   int i;
+   int i, j, w, key;
 
-   DBG(DBG_USER, "");
+   for (i=1; i<count; i++)
+   {
+      w = wid[i];
+      key = isOOL ? waveInfo[w].botOOL : waveInfo[w].botCB;
 
-   if (!libInitialised) return;
+      for (j=i; j>0; j--)
+      {
+         if ((isOOL ? waveInfo[wid[j-1]].botOOL : waveInfo[wid[j-1]].botCB)
+            <= key) break;
+         wid[j] = wid[j-1];
+      }
 
-   DBG(DBG_STARTUP, "initialised, terminating");
+      wid[j] = w;
+   }
+}
 
-   runState = PI_ENDING;
+/* ----------------------------------------------------------------------- */
 
-   gpioMaskSet = 0;
+static void waveFreeRebuild(waveSpan_t *span, int *spans,
+                            int base, int top, int *wid, int count, int isOOL)
+{
+   /* the free space is whatever lies between the (sorted) waves */
 
-   /* reset DMA */
+   int i, w, bot, len;
 
-   if (dmaReg != MAP_FAILED)
-   {
-      initKillDMA(dmaIn);
-      initKillDMA(dmaOut);
-   }
+   *spans = 0;
 
-#ifndef EMBEDDED_IN_VM
-   if ((gpioCfg.internals & PI_CFG_STATS) &&
-       (!(gpioCfg.internals & PI_CFG_NOSIGHANDLER)))
+   for (i=0; i<=count; i++)
    {
-      fprintf(stderr,
-         "\n#####################################################\n");
-      fprintf(stderr, "pigpio version=%d internals=%X\n",
-         PIGPIO_VERSION, gpioCfg.internals);
-
-      fprintf(stderr,
-         "micros=%d allocMode=%d dmaInitCbs=%d DMARestarts=%d\n",
-         gpioCfg.clockMicros, gpioCfg.memAllocMode,
-         gpioStats.dmaInitCbsCount, gpioStats.DMARestarts);
+      if (i < count)
+      {
+         w = wid[i];
 
-      fprintf(stderr,
-         "samples %u maxSamples %u maxEmit %u emitFrags %u\n",
-         gpioStats.numSamples, gpioStats.maxSamples,
-         gpioStats.maxEmit, gpioStats.emitFrags);
+         if (isOOL)
+         {
+            bot = waveInfo[w].botOOL;
+            len = waveInfo[w].numBOOL + waveInfo[w].numTOOL;
+         }
+         else
+         {
+            bot = waveInfo[w].botCB;
+            len = waveInfo[w].numCB;
+         }
 
-      fprintf(stderr, "cbTicks %d, cbCalls %u\n",
-         gpioStats.cbTicks, gpioStats.cbCalls);
+         if (!len) continue;
+      }
+      else
+      {
+         bot = top;
+         len = 0;
+      }
 
-      fprintf(stderr, "pipe: good %u, short %u, would block %u\n",
-         gpioStats.goodPipeWrite, gpioStats.shortPipeWrite,
-         gpioStats.wouldBlockPipeWrite);
+      if (bot > base)
+      {
+         span[*spans].start = base;
+         span[*spans].len   = bot - base;
+         (*spans)++;
+      }
 
-      fprintf(stderr, "alertTicks %u, lateTicks %u, moreToDo %u\n",
-         gpioStats.alertTicks, gpioStats.lateTicks, gpioStats.moreToDo);
+      base = bot + len;
+   }
+}
 
-      for (i=0; i< TICKSLOTS; i++)
-         fprintf(stderr, "%9u ", gpioStats.diffTick[i]);
+/* ----------------------------------------------------------------------- */
 
-      fprintf(stderr,
-         "\n#####################################################\n\n\n");
-   }
+int gpioWaveCompact(void)
+{
+   int i, j, k, w, count, moved, pins, now;
+   int *byCB, *byOOL, *newCB, *newOOL, *pinned;
+   waveSpan_t *pinCB, *pinOOL;
+   int oldCB, oldOOL, numOOL;
+   rawCbs_t cb, *p;
 
-#endif
-   initReleaseResources();
+   DBG(DBG_USER, "");
 
-   fflush(NULL);
+   CHECK_WAVE_INITED;
 
-   libInitialised = 0;
-}
+   byCB   = waveWork;
+   byOOL  = waveWork + waveMax;
+   newCB  = waveWork + (2 * waveMax);
+   newOOL = waveWork + (3 * waveMax);
+   pinned = waveWork + (4 * waveMax);
 
-static void switchFunctionOff(unsigned gpio)
-{
-   switch (gpioInfo[gpio].is)
-   {
-      case GPIO_SERVO:
-         /* switch servo off */
-         myGpioSetServo(gpio, gpioInfo[gpio].width, 0);
-         gpioInfo[gpio].width = 0;
-         break;
+   pinCB  = wavePins;
+   pinOOL = wavePins + waveMax;
 
-      case GPIO_PWM:
-         /* switch pwm off */
-         myGpioSetPwm(gpio, gpioInfo[gpio].width, 0);
-         gpioInfo[gpio].width = 0;
-         break;
+   /* Waves the DMA is sending or may be about to send stay put. */
 
-      case GPIO_HW_CLK:
-         /* No longer disable clock hardware, doing that was a bug. */
-         gpioInfo[gpio].width = 0;
-         break;
+   memset(pinned, 0, waveMax * sizeof(int));
 
-      case GPIO_HW_PWM:
-         /* No longer disable PWM hardware, doing that was a bug. */
-         gpioInfo[gpio].width = 0;
-         break;
-   }
-}
+   now = waveDMAnow();
 
-static void stopHardwarePWM(void)
-{
-   unsigned i, pwm;
+   if (now == -PI_WAVE_NOT_FOUND)
+      SOFT_ERROR(PI_CHAIN_IN_USE, "unknown DMA being transmitted");
 
-   for (i=0; i<= PI_MAX_GPIO; i++)
+   if (now >= 0)
    {
-      if (gpioInfo[i].is == GPIO_HW_PWM)
+      for (w=0; w<waveOutCount; w++)
       {
-         pwm = (PWMDef[i] >> 4) & 3;
-
-         if (pwm == 0) pwmReg[PWM_CTL] &= (~PWM_CTL_PWEN1);
-         else          pwmReg[PWM_CTL] &= (~PWM_CTL_PWEN2);
-
-         gpioInfo[i].width = 0;
-         gpioInfo[i].is = GPIO_UNDEFINED;
+         if (!waveInfo[w].deleted &&
+             (now >= waveInfo[w].botCB) && (now <= waveInfo[w].topCB)) break;
       }
-   }
-}
 
-/* ----------------------------------------------------------------------- */
+      if (w >= waveOutCount)
+         SOFT_ERROR(PI_CHAIN_IN_USE, "wave chain being transmitted");
 
-int gpioSetMode(unsigned gpio, unsigned mode)
-{
-   int reg, shift, old_mode;
+      pinned[w] = 1;
 
-   DBG(DBG_USER, "gpio=%d mode=%d", gpio, mode);
+      if (waveEndPtr)
+      {
+         for (w=0; w<waveOutCount; w++)
+         {
+            if (!waveInfo[w].deleted &&
+                (&rawWaveCBAdr(waveInfo[w].topCB)->next == waveEndPtr)) break;
+         }
+
+         if (w >= waveOutCount)
+            SOFT_ERROR(PI_CHAIN_IN_USE, "wave chain being transmitted");
 
-   CHECK_INITED;
+         pinned[w] = 1;
+      }
+   }
+   else waveEndPtr = NULL; /* nothing to sync with */
 
-   if (gpio > PI_MAX_GPIO)
-      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+   /* Slot copies link to each other so neither moves, nor the stream. */
 
-   if (mode > PI_ALT3)
-      SOFT_ERROR(PI_BAD_MODE, "gpio %d, bad mode (%d)", gpio, mode);
+   for (w=0; w<waveOutCount; w++)
+   {
+      if (waveSlotOf(w) >= 0) pinned[w] = 1;
+   }
 
-   reg   =  gpio/10;
-   shift = (gpio%10) * 3;
+   if (waveStream.open) pinned[waveStream.wid] = 1;
 
-   old_mode = (gpioReg[reg] >> shift) & 7;
+   count = 0;
+   pins = 0;
 
-   if (mode != old_mode)
+   for (w=0; w<waveOutCount; w++)
    {
-      switchFunctionOff(gpio);
+      if (waveInfo[w].deleted) continue;
 
-      gpioInfo[gpio].is = GPIO_UNDEFINED;
+      if (pinned[w])
+      {
+         pinCB[pins].start  = waveInfo[w].botCB;
+         pinCB[pins].len    = waveInfo[w].numCB;
+         pinOOL[pins].start = waveInfo[w].botOOL;
+         pinOOL[pins].len   = waveInfo[w].numBOOL + waveInfo[w].numTOOL;
+         pins++;
+      }
+      else byCB[count++] = w;
    }
 
-   gpioReg[reg] = (gpioReg[reg] & ~(7<<shift)) | (mode<<shift);
+   memcpy(byOOL, byCB, count * sizeof(int));
 
-   return 0;
-}
+   waveSortBy(byCB, count, 0);
+   waveSortBy(byOOL, count, 1);
 
+   wavePack(WAVE_BASE_CB, byCB, count, 0, pinCB, pins, newCB);
+   wavePack(WAVE_BASE_OOL, byOOL, count, 1, pinOOL, pins, newOOL);
 
-/* ----------------------------------------------------------------------- */
+   /* Rewrite the CBs, relocating any address inside the wave. */
 
-int gpioGetMode(unsigned gpio)
-{
-   int reg, shift;
+   moved = 0;
 
-   DBG(DBG_USER, "gpio=%d", gpio);
+   for (i=0; i<count; i++)
+   {
+      w = byCB[i];
 
-   CHECK_INITED;
+      oldCB  = waveInfo[w].botCB;
+      oldOOL = waveInfo[w].botOOL;
+      numOOL = waveInfo[w].numBOOL + waveInfo[w].numTOOL;
 
-   if (gpio > PI_MAX_GPIO)
-      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+      if ((newCB[w] == oldCB) && (newOOL[w] == oldOOL)) continue;
 
-   reg   =  gpio/10;
-   shift = (gpio%10) * 3;
+      for (j=0; j<waveInfo[w].numCB; j++)
+      {
+         cb = *rawWaveCBAdr(oldCB + j);
 
-   return (gpioReg[reg] >> shift) & 7;
-}
+         k = waveCbIndex(cb.next, oldCB, waveInfo[w].topCB);
+         if (k >= 0) cb.next = waveCbPOadr(k - oldCB + newCB[w]);
 
+         k = waveOOLIndex(cb.dst, oldOOL, oldOOL + numOOL - 1);
+         if (k >= 0) cb.dst = waveOOLPOadr(k - oldOOL + newOOL[w]);
 
-/* ----------------------------------------------------------------------- */
+         k = waveOOLIndex(cb.src, oldOOL, oldOOL + numOOL - 1);
 
-int gpioSetPullUpDown(unsigned gpio, unsigned pud)
-{
-   int shift = (gpio & 0xf) << 1;
-   uint32_t bits;
-   uint32_t pull;
+         if (k >= 0)
+         {
+            k = k - oldOOL + newOOL[w];
 
-   DBG(DBG_USER, "gpio=%d pud=%d", gpio, pud);
+            cb.src = waveOOLPOadr(k);
 
-   CHECK_INITED;
+            if (cb.info == TWO_BEAT_DMA)
+               cb.stride = (12<<16) + (waveOOLPOadr(k+1) - cb.src);
+         }
 
-   if (gpio > PI_MAX_GPIO)
-      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+         p = rawWaveCBAdr(newCB[w] + j);
 
-   if (pud > PI_PUD_UP)
-      SOFT_ERROR(PI_BAD_PUD, "gpio %d, bad pud (%d)", gpio, pud);
+         *p = cb;
+      }
 
-   if (pi_is_2711)
+      moved++;
+   }
+
+   /* Move the OOL values. */
+
+   for (i=0; i<count; i++)
    {
-      switch (pud)
+      w = byOOL[i];
+
+      oldOOL = waveInfo[w].botOOL;
+      numOOL = waveInfo[w].numBOOL + waveInfo[w].numTOOL;
+
+      if (newOOL[w] == oldOOL) continue;
+
+      for (j=0; j<numOOL; j++)
       {
-         case PI_PUD_OFF:  pull = 0; break;
-         case PI_PUD_UP:   pull = 1; break;
-         case PI_PUD_DOWN: pull = 2; break;
+         int op, os, np, ns;
+
+         waveOOLPageSlot(oldOOL + j, &op, &os);
+         waveOOLPageSlot(newOOL[w] + j, &np, &ns);
+
+         dmaOVirt[np]->OOL[ns] = dmaOVirt[op]->OOL[os];
       }
+   }
 
-      bits = *(gpioReg + GPPUPPDN0 + (gpio>>4));
-      bits &= ~(3 << shift);
-      bits |= (pull << shift);
-      *(gpioReg + GPPUPPDN0 + (gpio>>4)) = bits;
+   for (i=0; i<count; i++)
+   {
+      w = byCB[i];
+
+      waveInfo[w].botCB  = newCB[w];
+      waveInfo[w].topCB  = newCB[w] + waveInfo[w].numCB - 1;
+      waveInfo[w].botOOL = newOOL[w];
+      waveInfo[w].topOOL = newOOL[w] +
+         waveInfo[w].numBOOL + waveInfo[w].numTOOL;
    }
-   else
+
+   /* Rebuild the free lists from what is left. */
+
+   for (w=0; w<waveOutCount; w++)
    {
-      *(gpioReg + GPPUD) = pud;
+      if (pinned[w]) byCB[count++] = w;
+   }
 
-      myGpioDelay(1);
+   memcpy(byOOL, byCB, count * sizeof(int));
 
-      *(gpioReg + GPPUDCLK0 + BANK) = BIT;
+   waveSortBy(byCB, count, 0);
+   waveSortBy(byOOL, count, 1);
 
-      myGpioDelay(1);
+   waveFreeRebuild(waveFreeCB, &waveFreeCBs,
+      WAVE_BASE_CB, NUM_WAVE_CBS, byCB, count, 0);
 
-      *(gpioReg + GPPUD) = 0;
+   waveFreeRebuild(waveFreeOOL, &waveFreeOOLs,
+      WAVE_BASE_OOL, NUM_WAVE_OOL, byOOL, count, 1);
 
-      *(gpioReg + GPPUDCLK0 + BANK) = 0;
-   }
+   DBG(DBG_USER, "moved %d waves", moved);
 
-   return 0;
+   return moved;
 }
 
-
 /* ----------------------------------------------------------------------- */
 
-int gpioRead(unsigned gpio)
+static void waveClockStart(void)
 {
-   DBG(DBG_USER, "gpio=%d", gpio);
-
-   CHECK_INITED;
+   if (!waveClockInited && !waveSimOpen)
+   {
+      stopHardwarePWM();
+      initClock(0); /* initialise secondary clock */
+      waveClockInited = 1;
+      PWMClockInited = 0;
+   }
+}
 
-   if (gpio > PI_MAX_GPIO)
-      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+static void waveDMAkill(void)
+{
+   if (waveSimOpen) waveSimStart = 0;
+   else             initKillDMA(dmaOut);
+}
 
-   if ((*(gpioReg + GPLEV0 + BANK) & BIT) != 0) return PI_ON;
-   else                                         return PI_OFF;
+static int waveDMAbusy(void)
+{
+   if (waveSimOpen) return (waveSimStart != 0);
+   else             return (dmaOut[DMA_CONBLK_AD] != 0);
 }
 
+static void waveDMAgo(uint32_t cbAddr)
+{
+   if (waveSimOpen) waveSimStart = cbAddr;
+   else             initDMAgo((uint32_t *)dmaOut, cbAddr);
+}
 
 /* ----------------------------------------------------------------------- */
 
-int gpioWrite(unsigned gpio, unsigned level)
+int gpioWaveSimOpen(void)
 {
-   DBG(DBG_USER, "gpio=%d level=%d", gpio, level);
+   int i;
 
-   CHECK_INITED;
+   DBG(DBG_USER, "");
 
-   if (gpio > PI_MAX_GPIO)
-      SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+   CHECK_NOT_INITED;
 
-   if (level > PI_ON)
-      SOFT_ERROR(PI_BAD_LEVEL, "gpio %d, bad level (%d)", gpio, level);
+   if (waveSimOpen) return 0;
 
-   if (gpio <= PI_MAX_GPIO)
+   if (!gpioCfg.waveBlocks)
+      SOFT_ERROR(PI_NO_WAVE_MEMORY, "no wave memory configured");
+
+   waveSimPages = calloc(DMAO_PAGES, sizeof(dmaOPage_t));
+   dmaOVirt     = malloc(DMAO_PAGES * sizeof(dmaOPage_t *));
+   dmaOBus      = malloc(DMAO_PAGES * sizeof(dmaOPage_t *));
+
+   if ((waveSimPages == NULL) || (dmaOVirt == NULL) || (dmaOBus == NULL))
    {
-      if (gpioInfo[gpio].is != GPIO_WRITE)
-      {
-         /* stop a glitch between setting mode then level */
-         if (level == PI_OFF) *(gpioReg + GPCLR0 + BANK) = BIT;
-         else                 *(gpioReg + GPSET0 + BANK) = BIT;
+      free(waveSimPages);
+      free(dmaOVirt);
+      free(dmaOBus);
 
-         switchFunctionOff(gpio);
+      waveSimPages = NULL;
+      dmaOVirt     = MAP_FAILED;
+      dmaOBus      = MAP_FAILED;
 
-         gpioInfo[gpio].is = GPIO_WRITE;
-      }
+      SOFT_ERROR(PI_NO_MEMORY, "can't allocate simulated DMA pages");
    }
 
-   myGpioSetMode(gpio, PI_OUTPUT);
+   /* made up bus addresses, only the simulator follows them */
 
-   if (level == PI_OFF) *(gpioReg + GPCLR0 + BANK) = BIT;
-   else                 *(gpioReg + GPSET0 + BANK) = BIT;
+   for (i=0; i<DMAO_PAGES; i++)
+   {
+      dmaOVirt[i] = &waveSimPages[i];
+      dmaOBus[i]  =
+         (dmaOPage_t *)(uintptr_t)(WAVE_SIM_BUS + (i * sizeof(dmaOPage_t)));
+   }
 
-   return 0;
-}
+   waveSimOpen = 1;
 
+   return gpioWaveClear();
+}
 
 /* ----------------------------------------------------------------------- */
 
-int gpioPWM(unsigned gpio, unsigned val)
+int gpioWaveSimClose(void)
 {
-   DBG(DBG_USER, "gpio=%d dutycycle=%d", gpio, val);
+   int i;
 
-   CHECK_INITED;
+   DBG(DBG_USER, "");
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+   if (!waveSimOpen) return 0;
 
-   if (val > gpioInfo[gpio].range)
-      SOFT_ERROR(PI_BAD_DUTYCYCLE, "gpio %d, bad dutycycle (%d)", gpio, val);
+   waveCacheReset();
 
-   if (gpioInfo[gpio].is != GPIO_PWM)
-   {
-      switchFunctionOff(gpio);
+   for (i=0; i<PI_MAX_WAVE_SLOTS; i++) waveSlotFree(i);
 
-      gpioInfo[gpio].is = GPIO_PWM;
+   waveStreamFree();
 
-      if (!val) myGpioWrite(gpio, 0);
-   }
+   waveTableFree();
 
-   myGpioSetMode(gpio, PI_OUTPUT);
+   free(waveSimPages);
+   free(dmaOVirt);
+   free(dmaOBus);
 
-   myGpioSetPwm(gpio, gpioInfo[gpio].width, val);
+   waveSimPages = NULL;
+   dmaOVirt     = MAP_FAILED;
+   dmaOBus      = MAP_FAILED;
 
-   gpioInfo[gpio].width=val;
+   waveSimOpen   = 0;
+   waveSimStart  = 0;
+   waveSimLevels = 0;
+   waveEndPtr   = NULL;
 
    return 0;
 }
 
 /* ----------------------------------------------------------------------- */
 
-int gpioGetPWMdutycycle(unsigned gpio)
+typedef struct
 {
-   unsigned pwm;
+   uint32_t     micros;    /* simulated time */
+   uint32_t     levels;    /* simulated GPIO levels */
+   uint32_t     last;      /* time of the last pulse */
+   unsigned     pulses;    /* pulses seen, may exceed maxPulses */
+   unsigned     maxPulses;
+   gpioPulse_t *pulse;
+   int          vcdFd;
+   uint32_t     vcdTime;
+} waveSim_t;
 
-   DBG(DBG_USER, "gpio=%d", gpio);
+static int waveSimSymbol(int bit)
+{
+   /* as pig2vcd */
 
-   CHECK_INITED;
+   if (bit < 26) return ('A' + bit);
+   else          return ('a' + bit - 26);
+}
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+static uint32_t *waveSimMem(uint32_t bus)
+{
+   uint32_t offset;
 
-   switch (gpioInfo[gpio].is)
+   offset = bus - WAVE_SIM_BUS;
+
+   if ((bus < WAVE_SIM_BUS) || (offset & 3) ||
+       (offset >= (DMAO_PAGES * sizeof(dmaOPage_t)))) return NULL;
+
+   return (uint32_t *)waveSimPages + (offset / 4);
+}
+
+static void waveSimGpio(waveSim_t *sim, uint32_t on, uint32_t off)
+{
+   uint32_t changed;
+   int b;
+
+   if (sim->micros != sim->last)
    {
-      case GPIO_PWM:
-         return gpioInfo[gpio].width;
+      /* close the previous pulse and start a new one */
 
-      case GPIO_HW_PWM:
-         pwm = (PWMDef[gpio] >> 4) & 3;
-         return hw_pwm_duty[pwm];
+      if (sim->pulses <= sim->maxPulses)
+         sim->pulse[sim->pulses-1].usDelay = sim->micros - sim->last;
 
-      case GPIO_HW_CLK:
-         return PI_HW_PWM_RANGE/2;
+      if (sim->pulses < sim->maxPulses)
+      {
+         sim->pulse[sim->pulses].gpioOn  = 0;
+         sim->pulse[sim->pulses].gpioOff = 0;
+         sim->pulse[sim->pulses].usDelay = 0;
+      }
 
-      default:
-         SOFT_ERROR(PI_NOT_PWM_GPIO, "not a PWM gpio (%d)", gpio);
+      sim->pulses++;
+      sim->last = sim->micros;
+   }
+
+   if (sim->pulses <= sim->maxPulses)
+   {
+      sim->pulse[sim->pulses-1].gpioOn  |= on;
+      sim->pulse[sim->pulses-1].gpioOff |= off;
+   }
+
+   changed = sim->levels;
+
+   sim->levels = (sim->levels | on) & ~off;
+
+   changed ^= sim->levels;
+
+   if ((sim->vcdFd >= 0) && changed)
+   {
+      if (sim->micros != sim->vcdTime)
+      {
+         dprintf(sim->vcdFd, "#%u\n", sim->micros);
+         sim->vcdTime = sim->micros;
+      }
+
+      for (b=0; b<32; b++)
+      {
+         if (changed & (1<<b))
+            dprintf(sim->vcdFd, "%c%c\n",
+               (sim->levels & (1<<b)) ? '1' : '0', waveSimSymbol(b));
+      }
    }
 }
 
+static int waveSimWord(waveSim_t *sim, uint32_t src, uint32_t dst)
+{
+   /* one 32 bit DMA transfer */
 
-/* ----------------------------------------------------------------------- */
+   uint32_t val, *p;
 
-int gpioSetPWMrange(unsigned gpio, unsigned range)
+   if      ((p = waveSimMem(src)) != NULL) val = *p;
+   else if (src == (((GPIO_BASE + (GPLEV0*4)) & 0x00ffffff) | PI_PERI_BUS))
+      val = sim->levels;
+   else if (src == (((SYST_BASE + (SYST_CLO*4)) & 0x00ffffff) | PI_PERI_BUS))
+      val = sim->micros;
+   else if ((src & 0xFF000000) == PI_PERI_BUS) val = 0;
+   else return PI_WAVE_SIM_FAULT;
+
+   if      ((p = waveSimMem(dst)) != NULL) *p = val;
+   else if (dst == (((GPIO_BASE + (GPSET0*4)) & 0x00ffffff) | PI_PERI_BUS))
+      waveSimGpio(sim, val, 0);
+   else if (dst == (((GPIO_BASE + (GPCLR0*4)) & 0x00ffffff) | PI_PERI_BUS))
+      waveSimGpio(sim, 0, val);
+   else if ((dst & 0xFF000000) != PI_PERI_BUS) return PI_WAVE_SIM_FAULT;
+
+   return 0;
+}
+
+static int waveSimCB(waveSim_t *sim, rawCbs_t *cb, uint32_t maxMicros)
 {
-   int oldWidth, newWidth;
+   /* one control block, returns 1 if time passed */
 
-   DBG(DBG_USER, "gpio=%d range=%d", gpio, range);
+   uint32_t src, dst, x, y, rows, micros;
+   int status;
 
-   CHECK_INITED;
+   if ((cb->dst == PCM_TIMER) || (cb->dst == PWM_TIMER))
+   {
+      /* paced by the secondary clock, BPD bytes a tick */
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+      if (!(cb->info & DMA_DEST_DREQ)) return 0;
 
-   if ((range < PI_MIN_DUTYCYCLE_RANGE)  || (range > PI_MAX_DUTYCYCLE_RANGE))
-      SOFT_ERROR(PI_BAD_DUTYRANGE, "gpio %d, bad range (%d)", gpio, range);
+      micros = (cb->length / BPD) * PI_WF_MICROS;
 
-   oldWidth = gpioInfo[gpio].width;
+      if ((maxMicros - sim->micros) < micros) micros = maxMicros - sim->micros;
 
-   if (oldWidth)
+      sim->micros += micros;
+
+      return (micros != 0);
+   }
+
+   src = cb->src;
+   dst = cb->dst;
+
+   if (cb->info & DMA_TDMODE)
    {
-      if (gpioInfo[gpio].is == GPIO_PWM)
+      rows = cb->length >> 16;
+      x    = cb->length & 0xFFFF;
+   }
+   else
+   {
+      rows = 1;
+      x    = cb->length;
+   }
+
+   for (y=0; y<rows; y++)
+   {
+      uint32_t s=src, d=dst, n;
+
+      for (n=0; n<x; n+=4)
       {
-         newWidth = (range * oldWidth) / gpioInfo[gpio].range;
+         if (!(cb->info & DMA_DEST_IGNORE))
+         {
+            status = waveSimWord(sim, s, d);
+            if (status < 0) return status;
+         }
 
-         myGpioSetPwm(gpio, oldWidth, 0);
-         gpioInfo[gpio].range = range;
-         gpioInfo[gpio].width = newWidth;
-         myGpioSetPwm(gpio, 0, newWidth);
+         if (cb->info & DMA_SRC_INC)  s += 4;
+         if (cb->info & DMA_DEST_INC) d += 4;
       }
+
+      src += (int16_t)(cb->stride & 0xFFFF);
+      dst += (int16_t)(cb->stride >> 16);
    }
 
-   gpioInfo[gpio].range = range;
+   return 0;
+}
 
-   /* return the actual range for the current gpio frequency */
+int gpioWaveSimRun(
+   uint32_t maxMicros, gpioPulse_t *pulses, unsigned maxPulses, int vcdFd)
+{
+   waveSim_t sim;
+   rawCbs_t cb, *p;
+   uint32_t cbAddr;
+   unsigned idle;
+   int b, status;
 
-   return pwmRealRange[gpioInfo[gpio].freqIdx];
-}
+   DBG(DBG_USER, "maxMicros=%u pulses=%08"PRIXPTR" maxPulses=%u vcdFd=%d",
+      maxMicros, (uintptr_t)pulses, maxPulses, vcdFd);
 
+   if (!waveSimOpen)
+      SOFT_ERROR(PI_NOT_INITIALISED, "call gpioWaveSimOpen() first");
 
-/* ----------------------------------------------------------------------- */
+   if (maxPulses && !pulses)
+      SOFT_ERROR(PI_BAD_POINTER, "bad (NULL) pulses pointer");
 
-int gpioGetPWMrange(unsigned gpio)
-{
-   DBG(DBG_USER, "gpio=%d", gpio);
+   sim.micros    = 0;
+   sim.levels    = waveSimLevels;
+   sim.last      = 0;
+   sim.pulses    = 1;
+   sim.maxPulses = maxPulses;
+   sim.pulse     = pulses;
+   sim.vcdFd     = vcdFd;
+   sim.vcdTime   = 0;
 
-   CHECK_INITED;
+   /* the list always starts with a pulse at time 0 */
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+   if (maxPulses)
+   {
+      pulses[0].gpioOn  = 0;
+      pulses[0].gpioOff = 0;
+      pulses[0].usDelay = 0;
+   }
 
-   switch (gpioInfo[gpio].is)
+   if (vcdFd >= 0)
    {
-      case GPIO_HW_PWM:
-      case GPIO_HW_CLK:
-         return PI_HW_PWM_RANGE;
+      dprintf(vcdFd, "$version pigpio wave simulator $end\n");
+      dprintf(vcdFd, "$timescale 1 us $end\n");
+      dprintf(vcdFd, "$scope module top $end\n");
 
-      default:
-         return gpioInfo[gpio].range;
+      for (b=0; b<32; b++)
+         dprintf(vcdFd, "$var wire 1 %c %d $end\n", waveSimSymbol(b), b);
+
+      dprintf(vcdFd, "$upscope $end\n");
+      dprintf(vcdFd, "$enddefinitions $end\n");
+      dprintf(vcdFd, "#0\n");
    }
-}
 
+   cbAddr = waveSimStart;
+   idle   = 0;
 
-/* ----------------------------------------------------------------------- */
+   while (cbAddr && (sim.micros < maxMicros))
+   {
+      p = (rawCbs_t *)waveSimMem(cbAddr);
 
-int gpioGetPWMrealRange(unsigned gpio)
-{
-   unsigned pwm;
+      if ((p == NULL) || (cbAddr & 31))
+         SOFT_ERROR(PI_WAVE_SIM_FAULT, "bad CB address (%08X)", cbAddr);
 
-   DBG(DBG_USER, "gpio=%d", gpio);
+      /* like the DMA engine work from a copy of the CB */
 
-   CHECK_INITED;
+      cb = *p;
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+      status = waveSimCB(&sim, &cb, maxMicros);
 
-   switch (gpioInfo[gpio].is)
-   {
-      case GPIO_HW_PWM:
-         pwm = (PWMDef[gpio] >> 4) & 3;
-         return hw_pwm_real_range[pwm];
+      if (status < 0)
+         SOFT_ERROR(PI_WAVE_SIM_FAULT, "bad transfer (%08X->%08X)",
+            cb.src, cb.dst);
 
-      case GPIO_HW_CLK:
-         return PI_HW_PWM_RANGE;
+      if (status) idle = 0;
+      else if (++idle > WAVE_SIM_STEPS)
+         SOFT_ERROR(PI_WAVE_SIM_FAULT, "CBs loop without delay");
 
-      default:
-         return pwmRealRange[gpioInfo[gpio].freqIdx];
+      cbAddr = cb.next;
    }
-}
 
+   /* the next run carries on from here */
+
+   waveSimStart  = cbAddr;
+   waveSimLevels = sim.levels;
+
+   if ((sim.pulses <= maxPulses) && (sim.micros > sim.last))
+      pulses[sim.pulses-1].usDelay = sim.micros - sim.last;
+
+   if (vcdFd >= 0) dprintf(vcdFd, "#%u\n", sim.micros);
+
+   return sim.pulses;
+}
 
 /* ----------------------------------------------------------------------- */
 
-int gpioSetPWMfrequency(unsigned gpio, unsigned frequency)
+static int waveSlotSending(int wid)
 {
-   int i, width;
-   unsigned diff, best, idx;
+   int now;
 
-   DBG(DBG_USER, "gpio=%d frequency=%d", gpio, frequency);
+   now = waveDMAnow();
 
-   CHECK_INITED;
+   return ((now >= waveInfo[wid].botCB) && (now <= waveInfo[wid].topCB));
+}
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+static void waveDelayCB(rawCbs_t *p)
+{
+   /* use the secondary clock */
 
-   if      (frequency > pwmFreq[0])           idx = 0;
-   else if (frequency < pwmFreq[PWM_FREQS-1]) idx = PWM_FREQS-1;
+   if (gpioCfg.clockPeriph != PI_CLOCK_PCM)
+   {
+      p->info = NORMAL_DMA | TIMED_DMA(2);
+      p->dst  = PCM_TIMER;
+   }
    else
    {
-      best = 100000; /* impossibly high frequency difference */
-      idx = 0;
+      p->info = NORMAL_DMA | TIMED_DMA(5);
+      p->dst  = PWM_TIMER;
+   }
 
-      for (i=0; i<PWM_FREQS; i++)
-      {
-         if (frequency > pwmFreq[i]) diff = frequency - pwmFreq[i];
-         else                        diff = pwmFreq[i] - frequency;
+   //cast twice to suppress compiler warning, I belive this cast is ok
+   //because dmaOBus contains bus addresses, not virtual addresses.
+   p->src = (uint32_t)(uintptr_t) (&dmaOBus[0]->periphData);
+}
 
-         if (diff < best)
-         {
-            best = diff;
-            idx = i;
-         }
-      }
+static void wavePulseInit(int CB, int OOL, int delays)
+{
+   /*
+      A pulse which may be rewritten in place.  Always a 2-beat burst
+      so the levels may change freely, then the delay CBs reserved.
+   */
+
+   int d, s_stride;
+   rawCbs_t *p;
+
+   p = rawWaveCBAdr(CB);
+
+   p->info   = TWO_BEAT_DMA;
+   p->src    = waveOOLPOadr(OOL);
+   s_stride  = waveOOLPOadr(OOL + 1) - p->src;
+   p->dst    = ((GPIO_BASE + (GPSET0*4)) & 0x00ffffff) | PI_PERI_BUS;
+   p->length = (2<<16) + 4;         // 2 transfers of 4 bytes each
+   p->stride = (12<<16) + s_stride; // d_stride = (GPCLR0-GPSET0)*4 = 12
+
+   for (d=0; d<delays; d++)
+   {
+      p = rawWaveCBAdr(CB + 1 + d);
+      waveDelayCB(p);
+      p->length = BPD;
    }
+}
 
-   width = gpioInfo[gpio].width;
+static void wavePulseSet(int CB, int OOL, uint32_t after, gpioPulse_t *pp)
+{
+   /*
+      Patch a pulse made by wavePulseInit.  The OOLs get the new
+      levels.  The reserved delay CBs get the new delay and any not
+      needed are skipped.
+   */
 
-   if (width)
+   int d, used;
+   uint32_t delayLeft;
+   rawCbs_t *p;
+
+   waveSetOOL(OOL,   pp->gpioOn);
+   waveSetOOL(OOL+1, pp->gpioOff);
+
+   used = waveDelayCBs(pp->usDelay);
+
+   delayLeft = pp->usDelay;
+
+   for (d=0; d<used; d++)
    {
-      if (gpioInfo[gpio].is == GPIO_PWM)
+      p = rawWaveCBAdr(CB + 1 + d);
+
+      p->length = BPD * delayLeft / PI_WF_MICROS;
+
+      if ((gpioCfg.DMAsecondaryChannel >= DMA_LITE_FIRST) &&
+          (p->length > DMA_LITE_MAX))
       {
-         myGpioSetPwm(gpio, width, 0);
-         gpioInfo[gpio].freqIdx = idx;
-         myGpioSetPwm(gpio, 0, width);
+         p->length = DMA_LITE_MAX;
       }
+
+      delayLeft -= (p->length / BPD);
+
+      if ((d + 1) < used) p->next = waveCbPOadr(CB + 2 + d);
+      else                p->next = after;
    }
 
-   gpioInfo[gpio].freqIdx = idx;
+   /* the GPIO CB is patched last, linking in the new delay */
 
-   return pwmFreq[idx];
+   p = rawWaveCBAdr(CB);
+
+   if (used) p->next = waveCbPOadr(CB + 1);
+   else      p->next = after;
 }
 
+static void waveSlotSet(waveSlot_t *slot, int copy, int pulse, gpioPulse_t *pp)
+{
+   int wid;
+   uint32_t after;
 
-/* ----------------------------------------------------------------------- */
+   wid = slot->wid[copy];
 
-int gpioGetPWMfrequency(unsigned gpio)
+   if ((pulse + 1) < slot->pulses)
+        after = waveCbPOadr(waveInfo[wid].botCB + slot->cbOff[pulse+1]);
+   else after = waveCbPOadr(waveInfo[wid].topCB);
+
+   wavePulseSet(waveInfo[wid].botCB + slot->cbOff[pulse],
+      waveInfo[wid].botOOL + (2 * pulse), after, pp);
+
+   slot->pulse[copy][pulse] = *pp;
+}
+
+static void waveSlotBuild(waveSlot_t *slot, int copy)
 {
-   unsigned pwm, clock;
+   int wid, CB, i;
+   rawCbs_t *p;
 
-   DBG(DBG_USER, "gpio=%d", gpio);
+   wid = slot->wid[copy];
+   CB  = waveInfo[wid].botCB;
 
-   CHECK_INITED;
+   /* add delay cb at start of DMA */
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+   p = rawWaveCBAdr(CB);
+   waveDelayCB(p);
+   p->length = BPD * 20 / PI_WF_MICROS; /* 20 micros delay */
+   p->next   = waveCbPOadr(CB + 1);
 
-   switch (gpioInfo[gpio].is)
+   for (i=0; i<slot->pulses; i++)
    {
-      case GPIO_HW_PWM:
-         pwm = (PWMDef[gpio] >> 4) & 3;
-         return hw_pwm_freq[pwm];
-
-      case GPIO_HW_CLK:
-         clock = (clkDef[gpio] >> 4) & 3;
-         return hw_clk_freq[clock];
+      wavePulseInit(waveInfo[wid].botCB + slot->cbOff[i],
+         waveInfo[wid].botOOL + (2 * i), slot->delays[i]);
 
-      default:
-         return pwmFreq[gpioInfo[gpio].freqIdx];
+      waveSlotSet(slot, copy, i, &slot->pulse[copy][i]);
    }
-}
 
+   /* the end CB, its next loops the copy or leads to the other */
+
+   p = rawWaveCBAdr(waveInfo[wid].topCB);
+
+   p->info   = NORMAL_DMA;
+   //cast twice to suppress warning, I belive this is ok as dmaOBus
+   //contains bus addresses not virtual addresses. --plugwash
+   p->src    = (uint32_t)(uintptr_t) (&dmaOBus[0]->periphData);
+   p->dst    = (uint32_t)(uintptr_t) (&dmaOBus[0]->periphData);
+   p->length = 4;
+   p->next   = waveCbPOadr(waveInfo[wid].botCB + 1);
+}
 
 /* ----------------------------------------------------------------------- */
 
-int gpioServo(unsigned gpio, unsigned val)
+int gpioWaveSlotCreate(unsigned maxDelay)
 {
-   DBG(DBG_USER, "gpio=%d pulsewidth=%d", gpio, val);
+   int s, i, c, n;
+   uint32_t reserve;
+   uint64_t numCB, maxCB;
+   waveSlot_t *slot;
+   rawWave_t *waves;
 
-   CHECK_INITED;
+   DBG(DBG_USER, "maxDelay=%u", maxDelay);
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+   CHECK_WAVE_INITED;
 
-   if ((val!=PI_SERVO_OFF) && (val<PI_MIN_SERVO_PULSEWIDTH))
-      SOFT_ERROR(PI_BAD_PULSEWIDTH,
-         "gpio %d, bad pulsewidth (%d)", gpio, val);
+   if (wfc[wfcur] == 0) return PI_EMPTY_WAVEFORM;
 
-   if (val>PI_MAX_SERVO_PULSEWIDTH)
-      SOFT_ERROR(PI_BAD_PULSEWIDTH,
-         "gpio %d, bad pulsewidth (%d)", gpio, val);
+   for (s=0; s<PI_MAX_WAVE_SLOTS; s++) if (!waveSlot[s].used) break;
 
-   if (gpioInfo[gpio].is != GPIO_SERVO)
-   {
-      switchFunctionOff(gpio);
+   if (s >= PI_MAX_WAVE_SLOTS)
+      SOFT_ERROR(PI_NO_HANDLE, "no wave slot available");
 
-      gpioInfo[gpio].is = GPIO_SERVO;
+   n     = wfc[wfcur];
+   waves = wf[wfcur];
 
-      if (!val) myGpioWrite(gpio, 0);
+   for (i=0; i<n; i++)
+   {
+      if (waves[i].flags)
+         SOFT_ERROR(PI_BAD_PARAM, "wave slots can't read or tick");
    }
 
-   myGpioSetMode(gpio, PI_OUTPUT);
+   /* both copies must fit in the CBs the pool has */
 
-   myGpioSetServo(gpio, gpioInfo[gpio].width, val);
+   maxCB = (NUM_WAVE_CBS - WAVE_BASE_CB) / 2;
 
-   gpioInfo[gpio].width=val;
+   reserve = waveDelayCBs(maxDelay);
 
-   return 0;
-}
+   if ((2 + ((uint64_t)n * (1 + reserve))) > maxCB)
+      SOFT_ERROR(PI_BAD_PARAM, "bad maximum delay (%u)", maxDelay);
 
+   numCB = 2;
 
-/* ----------------------------------------------------------------------- */
+   for (i=0; i<n; i++)
+   {
+      if (waveDelayCBs(waves[i].usDelay) > reserve)
+         numCB += 1 + waveDelayCBs(waves[i].usDelay);
+      else
+         numCB += 1 + reserve;
+   }
 
-int gpioGetServoPulsewidth(unsigned gpio)
-{
-   DBG(DBG_USER, "gpio=%d", gpio);
+   if (numCB > maxCB)
+      SOFT_ERROR(PI_TOO_MANY_CBS, "wave slot needs too many CBs");
 
-   CHECK_INITED;
+   slot = &waveSlot[s];
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+   slot->cbOff    = malloc(n * sizeof(uint32_t));
+   slot->delays   = malloc(n * sizeof(uint32_t));
+   slot->pulse[0] = malloc(n * sizeof(gpioPulse_t));
+   slot->pulse[1] = malloc(n * sizeof(gpioPulse_t));
 
-   if (gpioInfo[gpio].is != GPIO_SERVO)
-      SOFT_ERROR(PI_NOT_SERVO_GPIO, "not a servo gpio (%d)", gpio);
+   if (!slot->cbOff || !slot->delays || !slot->pulse[0] || !slot->pulse[1])
+   {
+      waveSlotFree(s);
+      SOFT_ERROR(PI_NO_MEMORY, "can't allocate wave slot");
+   }
 
-   return gpioInfo[gpio].width;
-}
+   /* start delay, per pulse a GPIO CB and its delay CBs, end CB */
 
+   numCB = 1;
 
-/* ----------------------------------------------------------------------- */
+   for (i=0; i<n; i++)
+   {
+      slot->cbOff[i] = numCB;
 
-int gpioWaveClear(void)
-{
-   DBG(DBG_USER, "");
+      slot->delays[i] = waveDelayCBs(waves[i].usDelay);
 
-   CHECK_INITED;
+      if (slot->delays[i] < reserve) slot->delays[i] = reserve;
 
-   wfc[0] = 0;
-   wfc[1] = 0;
-   wfc[2] = 0;
+      numCB += 1 + slot->delays[i];
 
-   wfcur = 0;
+      slot->pulse[0][i].gpioOn  = waves[i].gpioOn;
+      slot->pulse[0][i].gpioOff = waves[i].gpioOff;
+      slot->pulse[0][i].usDelay = waves[i].usDelay;
+      slot->pulse[1][i] = slot->pulse[0][i];
+   }
 
-   wfStats.micros = 0;
-   wfStats.pulses = 0;
-   wfStats.cbs    = 0;
+   numCB++;
 
-   waveOutBotCB  = PI_WAVE_COUNT_PAGES*CBS_PER_OPAGE;
-   waveOutBotOOL = PI_WAVE_COUNT_PAGES*OOL_PER_OPAGE;
-   waveOutTopOOL = NUM_WAVE_OOL;
+   slot->pulses = n;
 
-   waveOutCount = 0;
+   for (c=0; c<2; c++)
+   {
+      slot->wid[c] = waveAllocate(numCB, 2*n, 0);
 
-   waveEndPtr = NULL;
+      if (slot->wid[c] < 0)
+      {
+         i = slot->wid[c];
 
-   return 0;
-}
+         if (c) gpioWaveDelete(slot->wid[0]);
 
-/* ----------------------------------------------------------------------- */
+         waveSlotFree(s);
 
-int gpioWaveAddNew(void)
-{
-   DBG(DBG_USER, "");
+         return i;
+      }
 
-   CHECK_INITED;
+      waveInfo[slot->wid[c]].deleted = 0;
+   }
+
+   slot->used   = 1;
+   slot->active = 0;
+   slot->stale  = 0;
+
+   waveSlotBuild(slot, 0);
+   waveSlotBuild(slot, 1);
+
+   DBG(DBG_USER, "Wave slot: %d waves %d,%d CBs %d pulses %d", s,
+      slot->wid[0], slot->wid[1], (int)numCB, n);
+
+   /* Consume waves. */
 
    wfc[0] = 0;
    wfc[1] = 0;
@@ -9312,559 +15312,590 @@ int gpioWaveAddNew(void)
 
    wfcur = 0;
 
-   wfStats.micros = 0;
-   wfStats.pulses = 0;
-   wfStats.cbs    = 0;
-
-   return 0;
+   return s;
 }
 
 /* ----------------------------------------------------------------------- */
 
-int gpioWaveAddGeneric(unsigned numPulses, gpioPulse_t *pulses)
+int gpioWaveSlotTx(unsigned slot_id)
 {
-   int p;
+   DBG(DBG_USER, "slot_id=%d", slot_id);
 
-   DBG(DBG_USER, "numPulses=%u pulses=%08"PRIXPTR, numPulses, (uintptr_t)pulses);
-
-   CHECK_INITED;
-
-   if (numPulses > PI_WAVE_MAX_PULSES)
-      SOFT_ERROR(PI_TOO_MANY_PULSES, "bad number of pulses (%d)", numPulses);
-
-   if (!pulses) SOFT_ERROR(PI_BAD_POINTER, "bad (NULL) pulses pointer");
+   CHECK_WAVE_INITED;
 
-   for (p=0; p<numPulses; p++)
-   {
-      wf[2][p].gpioOff = pulses[p].gpioOff;
-      wf[2][p].gpioOn  = pulses[p].gpioOn;
-      wf[2][p].usDelay = pulses[p].usDelay;
-      wf[2][p].flags   = 0;
-   }
+   if ((slot_id >= PI_MAX_WAVE_SLOTS) || !waveSlot[slot_id].used)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad wave slot (%d)", slot_id);
 
-   return rawWaveAddGeneric(numPulses, wf[2]);
+   return gpioWaveTxSend(
+      waveSlot[slot_id].wid[waveSlot[slot_id].active], PI_WAVE_MODE_REPEAT);
 }
 
 /* ----------------------------------------------------------------------- */
 
-int gpioWaveAddSerial
-   (unsigned gpio,
-    unsigned baud,
-    unsigned data_bits,
-    unsigned stop_bits,
-    unsigned offset,
-    unsigned numBytes,
-    char     *bstr)
+int gpioWaveSlotUpdate(
+   unsigned slot_id, unsigned first, unsigned count, gpioPulse_t *pulses)
 {
-   int i, b, p, lev, c, v;
+   waveSlot_t *slot;
+   int i, inactive;
 
-   uint16_t *wstr = (uint16_t *)bstr;
-   uint32_t *lstr = (uint32_t *)bstr;
+   DBG(DBG_USER, "slot_id=%d first=%d count=%d pulses=%08"PRIXPTR,
+      slot_id, first, count, (uintptr_t)pulses);
 
-   unsigned bitDelay[32];
+   CHECK_WAVE_INITED;
 
-   DBG(DBG_USER,
-      "gpio=%d baud=%d bits=%d stops=%d offset=%d numBytes=%d str=[%s]",
-      gpio, baud, data_bits, stop_bits, offset,
-      numBytes, myBuf2Str(numBytes, (char *)bstr));
+   if ((slot_id >= PI_MAX_WAVE_SLOTS) || !waveSlot[slot_id].used)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad wave slot (%d)", slot_id);
 
-   CHECK_INITED;
+   slot = &waveSlot[slot_id];
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+   if ((first >= slot->pulses) || (count > (slot->pulses - first)))
+      SOFT_ERROR(PI_BAD_PARAM, "bad pulse range (%d+%d)", first, count);
 
-   if ((baud < PI_WAVE_MIN_BAUD) || (baud > PI_WAVE_MAX_BAUD))
-      SOFT_ERROR(PI_BAD_WAVE_BAUD, "bad baud rate (%d)", baud);
+   if (count && !pulses)
+      SOFT_ERROR(PI_BAD_POINTER, "bad (NULL) pulses pointer");
 
-   if ((data_bits < PI_MIN_WAVE_DATABITS) ||
-       (data_bits > PI_MAX_WAVE_DATABITS))
-      SOFT_ERROR(PI_BAD_DATABITS, "bad number of databits (%d)", data_bits);
+   for (i=0; i<count; i++)
+   {
+      if (waveDelayCBs(pulses[i].usDelay) > slot->delays[first+i])
+         SOFT_ERROR(PI_BAD_SLOT_DELAY, "pulse %d delay %d too long",
+            first+i, pulses[i].usDelay);
+   }
 
-   if ((stop_bits < PI_MIN_WAVE_HALFSTOPBITS) ||
-       (stop_bits > PI_MAX_WAVE_HALFSTOPBITS))
-      SOFT_ERROR(PI_BAD_STOPBITS,
-         "bad number of (half) stop bits (%d)", stop_bits);
+   inactive = 1 - slot->active;
+
+   /* the last swap hasn't happened yet */
+
+   if (waveSlotSending(slot->wid[inactive])) return PI_SLOT_BUSY;
+
+   if (slot->stale)
+   {
+      for (i=0; i<slot->pulses; i++)
+         waveSlotSet(slot, inactive, i, &slot->pulse[slot->active][i]);
 
-   if (gpio > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+      slot->stale = 0;
+   }
 
-   if (numBytes > PI_WAVE_MAX_CHARS)
-      SOFT_ERROR(PI_TOO_MANY_CHARS, "too many chars (%d)", numBytes);
+   for (i=0; i<count; i++) waveSlotSet(slot, inactive, first+i, &pulses[i]);
 
-   if (offset > PI_WAVE_MAX_MICROS)
-      SOFT_ERROR(PI_BAD_SER_OFFSET, "offset too large (%d)", offset);
+   return 0;
+}
 
-   if (data_bits > 8) numBytes /= 2;
-   if (data_bits > 16) numBytes /= 2;
+/* ----------------------------------------------------------------------- */
 
-   if (!numBytes) return 0;
+int gpioWaveSlotSwap(unsigned slot_id)
+{
+   waveSlot_t *slot;
+   int i, from, to;
 
-   waveBitDelay(baud, data_bits, stop_bits, bitDelay);
+   DBG(DBG_USER, "slot_id=%d", slot_id);
 
-   p = 0;
+   CHECK_WAVE_INITED;
 
-   wf[2][p].gpioOn  = (1<<gpio);
-   wf[2][p].gpioOff = 0;
-   wf[2][p].flags   = 0;
+   if ((slot_id >= PI_MAX_WAVE_SLOTS) || !waveSlot[slot_id].used)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad wave slot (%d)", slot_id);
+
+   slot = &waveSlot[slot_id];
 
-   if (offset > bitDelay[0]) wf[2][p].usDelay = offset;
-   else                      wf[2][p].usDelay = bitDelay[0];
+   from = slot->wid[slot->active];
+   to   = slot->wid[1 - slot->active];
 
-   for (i=0; i<numBytes; i++)
+   if (waveSlotSending(to)) return PI_SLOT_BUSY;
+
+   if (slot->stale)
    {
-      p++;
+      /* nothing updated since the last swap, send the same pulses */
 
-      /* start bit */
+      for (i=0; i<slot->pulses; i++)
+         waveSlotSet(slot, 1 - slot->active, i, &slot->pulse[slot->active][i]);
+   }
 
-      wf[2][p].gpioOn = 0;
-      wf[2][p].gpioOff = (1<<gpio);
-      wf[2][p].usDelay = bitDelay[0];
-      wf[2][p].flags   = 0;
+   /* the new copy repeats, the old one ends by jumping into it */
 
-      lev = 0;
+   rawWaveCBAdr(waveInfo[to].topCB)->next = waveCbPOadr(waveInfo[to].botCB+1);
 
-      if      (data_bits <  9) c = bstr[i];
-      else if (data_bits < 17) c = wstr[i];
-      else                  c = lstr[i];
+   rawWaveCBAdr(waveInfo[from].topCB)->next =
+      waveCbPOadr(waveInfo[to].botCB+1);
 
-      for (b=0; b<data_bits; b++)
-      {
-         if (c & (1<<b)) v=1; else v=0;
+   slot->active = 1 - slot->active;
+   slot->stale  = 1;
 
-         if (v == lev) wf[2][p].usDelay += bitDelay[b+1];
-         else
-         {
-            p++;
+   return 0;
+}
 
-            lev = v;
+/* ----------------------------------------------------------------------- */
 
-            if (lev)
-            {
-               wf[2][p].gpioOn  = (1<<gpio);
-               wf[2][p].gpioOff = 0;
-               wf[2][p].flags   = 0;
-            }
-            else
-            {
-               wf[2][p].gpioOn  = 0;
-               wf[2][p].gpioOff = (1<<gpio);
-               wf[2][p].flags   = 0;
-            }
+int gpioWaveSlotDelete(unsigned slot_id)
+{
+   int wid[2];
 
-            wf[2][p].usDelay = bitDelay[b+1];
-         }
-      }
+   DBG(DBG_USER, "slot_id=%d", slot_id);
 
-      /* stop bit */
+   CHECK_WAVE_INITED;
 
-      if (lev) wf[2][p].usDelay += bitDelay[data_bits+1];
-      else
-      {
-         p++;
+   if ((slot_id >= PI_MAX_WAVE_SLOTS) || !waveSlot[slot_id].used)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad wave slot (%d)", slot_id);
 
-         wf[2][p].gpioOn  = (1<<gpio);
-         wf[2][p].gpioOff = 0;
-         wf[2][p].usDelay = bitDelay[data_bits+1];
-         wf[2][p].flags   = 0;
-      }
-   }
+   wid[0] = waveSlot[slot_id].wid[0];
+   wid[1] = waveSlot[slot_id].wid[1];
 
-   p++;
+   waveSlotFree(slot_id);
 
-   wf[2][p].gpioOn  = (1<<gpio);
-   wf[2][p].gpioOff = 0;
-   wf[2][p].usDelay = bitDelay[0];
-   wf[2][p].flags   = 0;
+   gpioWaveDelete(wid[0]);
+   gpioWaveDelete(wid[1]);
 
-   return rawWaveAddGeneric(p, wf[2]);
+   return 0;
 }
 
 /* ----------------------------------------------------------------------- */
 
-int rawWaveAddSPI(
-   rawSPI_t *spi,
-   unsigned offset,
-   unsigned spiSS,
-   char *buf,
-   unsigned spiTxBits,
-   unsigned spiBitFirst,
-   unsigned spiBitLast,
-   unsigned spiBits)
+static int waveStreamCB(unsigned seg)
 {
-   int p, bit, dbv, halfbit;
-   int rising_edge[2], read_cycle[2];
-   uint32_t on_bits, off_bits;
-   int tx_bit_pos;
+   /* the first CB of a segment, after the start delay CB */
 
-   DBG(DBG_USER,
-      "spi=%08"PRIXPTR" off=%d spiSS=%d tx=%08"PRIXPTR", num=%d fb=%d lb=%d spiBits=%d",
-      (uintptr_t)spi, offset, spiSS, (uintptr_t)buf, spiTxBits,
-      spiBitFirst, spiBitLast, spiBits);
+   return waveInfo[waveStream.wid].botCB + 1 + (seg * waveStream.segCBs);
+}
 
-   CHECK_INITED;
+static int waveStreamOOL(unsigned seg)
+{
+   /* per pulse two OOLs, then a constant 1 and the underrun flag */
 
-   if (spiSS > PI_MAX_USER_GPIO)
-      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", spiSS);
+   return waveInfo[waveStream.wid].botOOL +
+      (seg * ((2 * waveStream.segPulses) + 2));
+}
 
+static void waveStreamBuild(unsigned seg)
+{
    /*
-   CPOL CPHA
-    0    0   read rising/write falling
-    0    1   read falling/write rising
-    1    0   read falling/write rising
-    1    1   read rising/write falling
+      The parts of a segment which never change.  After the pulses
+      come an end CB, which leads to the next segment once that is
+      committed, a flag CB, which records an underrun, and a stall CB
+      which loops until the next segment is linked in.
    */
 
-   if (spi->clk_pol) {rising_edge[0] = 0; rising_edge[1] = 1;}
-   else              {rising_edge[0] = 1; rising_edge[1] = 0;}
+   int CB, OOL, end, i, step;
+   rawCbs_t *p;
 
-   if (spi->clk_pha) {read_cycle[0] = 0; read_cycle[1] = 1;}
-   else              {read_cycle[0] = 1; read_cycle[1] = 0;}
+   step = 1 + waveStream.delays;
 
-   p = 0;
+   CB  = waveStreamCB(seg);
+   OOL = waveStreamOOL(seg);
+   end = CB + (waveStream.segPulses * step);
 
-   if (offset)
-   {
-      wf[2][p].gpioOn  = 0;
-      wf[2][p].gpioOff = 0;
-      wf[2][p].flags   = 0;
-      wf[2][p].usDelay = offset;
-      p++;
-   }
+   for (i=0; i<waveStream.segPulses; i++)
+      wavePulseInit(CB + (i * step), OOL + (2 * i), waveStream.delays);
 
-   on_bits = 0;
-   off_bits = 0;
+   OOL += 2 * waveStream.segPulses;
 
-   tx_bit_pos = 0;
+   waveSetOOL(OOL,   1);
+   waveSetOOL(OOL+1, 0);
 
-   /* preset initial mosi bit */
+   p = rawWaveCBAdr(end);
 
-   if (getBitInBytes(tx_bit_pos, buf, spiTxBits))
-   {
-      on_bits  |= (1<<(spi->mosi));
-      dbv = 1;
-   }
-   else
+   p->info   = NORMAL_DMA;
+   //cast twice to suppress warning, I belive this is ok as dmaOBus
+   //contains bus addresses not virtual addresses. --plugwash
+   p->src    = (uint32_t)(uintptr_t) (&dmaOBus[0]->periphData);
+   p->dst    = (uint32_t)(uintptr_t) (&dmaOBus[0]->periphData);
+   p->length = 4;
+   p->next   = waveCbPOadr(end + 1);
+
+   p = rawWaveCBAdr(end + 1);
+
+   p->info   = NORMAL_DMA;
+   p->src    = waveOOLPOadr(OOL);
+   p->dst    = waveOOLPOadr(OOL + 1);
+   p->length = 4;
+   p->next   = waveCbPOadr(end + 2);
+
+   p = rawWaveCBAdr(end + 2);
+
+   waveDelayCB(p);
+   p->length = BPD * WAVE_STREAM_STALL / PI_WF_MICROS;
+   p->next   = waveCbPOadr(end + 2);
+}
+
+static int waveStreamCommit(void)
+{
+   /* send the staged pulses as the next segment, 1 if done */
+
+   unsigned seg, prev, i, n;
+   int CB, OOL, end, now, step;
+   uint32_t after;
+
+   if (!waveStream.filled || (waveStream.queued >= waveStream.segments))
+      return 0;
+
+   seg = (waveStream.head + waveStream.queued) % waveStream.segments;
+
+   CB = waveStreamCB(seg);
+
+   /* a dry stream may not yet have left the segment's stall CB */
+
+   now = waveDMAnow();
+
+   if ((now >= CB) && (now < (CB + waveStream.segCBs))) return 0;
+
+   step = 1 + waveStream.delays;
+   OOL  = waveStreamOOL(seg);
+   end  = CB + (waveStream.segPulses * step);
+   n    = waveStream.filled;
+
+   for (i=0; i<n; i++)
    {
-      off_bits |= (1<<(spi->mosi));
-      dbv = 0;
+      if ((i + 1) < n) after = waveCbPOadr(CB + ((i + 1) * step));
+      else             after = waveCbPOadr(end);
+
+      wavePulseSet(CB + (i * step), OOL + (2 * i), after,
+         &waveStream.stage[i]);
    }
 
-   if (!spi->clk_pha) tx_bit_pos ++;
+   rawWaveCBAdr(end)->next     = waveCbPOadr(end + 1);
+   rawWaveCBAdr(end + 2)->next = waveCbPOadr(end + 2);
 
-   if (spi->ss_pol) off_bits |= (1<<spiSS);
-   else             on_bits  |= (1<<spiSS);
+   /*
+      Link the segment before to this one.  If the DMA ran dry it is
+      looping in that segment's stall CB so link that too.
+   */
 
-   if (spi->clk_pol) on_bits  |= (1<<(spi->clk));
-   else              off_bits |= (1<<(spi->clk));
+   prev = (seg + waveStream.segments - 1) % waveStream.segments;
+   end  = waveStreamCB(prev) + (waveStream.segPulses * step);
 
-   wf[2][p].gpioOn  = on_bits;
-   wf[2][p].gpioOff = off_bits;
-   wf[2][p].flags   = 0;
+   rawWaveCBAdr(end)->next     = waveCbPOadr(CB);
+   rawWaveCBAdr(end + 2)->next = waveCbPOadr(CB);
 
-   if (spi->clk_us > spi->ss_us) wf[2][p].usDelay = spi->clk_us;
-   else                          wf[2][p].usDelay = spi->ss_us;
+   waveStream.count[seg] = n;
+   waveStream.queued++;
+   waveStream.filled = 0;
 
-   p++;
+   return 1;
+}
 
-   for (bit=1; bit<=spiBits; bit++)
+static int waveStreamPoll(void)
+{
+   /*
+      Count any underruns and retire the segments sent.  Returns the
+      CB the DMA is at or -1 if the stream isn't being sent.
+   */
+
+   unsigned seg, ahead, i;
+   int now, bot, off, flag, step;
+
+   for (i=0; i<waveStream.segments; i++)
    {
-      for (halfbit=0; halfbit<2; halfbit++)
+      flag = waveStreamOOL(i) + (2 * waveStream.segPulses) + 1;
+
+      if (waveGetOOL(flag))
       {
-         wf[2][p].usDelay = spi->clk_us;
-         wf[2][p].flags = 0;
+         waveStream.underruns++;
+         waveSetOOL(flag, 0);
+      }
+   }
 
-         on_bits = 0;
-         off_bits = 0;
+   if (!waveStream.started) return -1;
 
-         if (read_cycle[halfbit])
-         {
-            if ((bit>=spiBitFirst) && (bit<=spiBitLast))
-               wf[2][p].flags = WAVE_FLAG_READ;
-         }
-         else
-         {
-            if (getBitInBytes(tx_bit_pos, buf, spiTxBits))
-            {
-               if (!dbv) on_bits  |= (1<<(spi->mosi));
-               dbv = 1;
-            }
-            else
-            {
-               if (dbv) off_bits |= (1<<(spi->mosi));
-               dbv = 0;
-            }
+   now = waveDMAnow();
+   bot = waveStreamCB(0);
 
-            ++tx_bit_pos;
-         }
+   if ((now < (bot - 1)) ||
+       (now >= (bot + (waveStream.segments * waveStream.segCBs))))
+   {
+      /* stopped, or another wave sent */
 
-         if (rising_edge[halfbit]) on_bits  |= (1<<(spi->clk));
-         else                      off_bits |= (1<<(spi->clk));
+      waveStream.started = 0;
+      return -1;
+   }
 
-         wf[2][p].gpioOn = on_bits;
-         wf[2][p].gpioOff = off_bits;
+   if (now < bot) return now; /* in the start delay */
 
-         p++;
-      }
-   }
+   step = 1 + waveStream.delays;
+   seg  = (now - bot) / waveStream.segCBs;
+   off  = (now - bot) % waveStream.segCBs;
 
-   on_bits = 0;
-   off_bits = 0;
+   /* the segments before the one being sent have gone */
 
-   if (spi->ss_pol) on_bits  |= (1<<spiSS);
-   else             off_bits |= (1<<spiSS);
+   ahead = (seg + waveStream.segments - waveStream.head) % waveStream.segments;
 
-   wf[2][p].gpioOn  = on_bits;
-   wf[2][p].gpioOff = off_bits;
-   wf[2][p].flags   = 0;
-   wf[2][p].usDelay = 0;
+   if (ahead < waveStream.queued)
+   {
+      waveStream.head    = seg;
+      waveStream.queued -= ahead;
 
-   p++;
+      /* as has this one once its pulses are done and any flag is set */
 
-   return rawWaveAddGeneric(p, wf[2]);
+      if ((off >= (waveStream.segPulses * step)) &&
+          (off != ((waveStream.segPulses * step) + 1)))
+      {
+         waveStream.head = (seg + 1) % waveStream.segments;
+         waveStream.queued--;
+      }
+   }
+
+   return now;
 }
 
 /* ----------------------------------------------------------------------- */
 
-int gpioWaveCreate(void)
+int gpioWaveStreamOpen(
+   unsigned numSegments, unsigned segPulses, unsigned maxDelay)
 {
-   int i, wid;
-   int numCB, numBOOL, numTOOL;
-   int CB, BOOL, TOOL;
+   unsigned seg;
+   int delays, segCBs, wid;
+   rawCbs_t *p;
 
-   DBG(DBG_USER, "");
+   DBG(DBG_USER, "numSegments=%u segPulses=%u maxDelay=%u",
+      numSegments, segPulses, maxDelay);
 
-   CHECK_INITED;
+   CHECK_WAVE_INITED;
 
-   if (wfc[wfcur] == 0) return PI_EMPTY_WAVEFORM;
+   if (waveStream.open)
+      SOFT_ERROR(PI_NO_HANDLE, "wave stream already open");
 
-   /* What resources are needed? */
+   if ((numSegments < 2) || (numSegments > NUM_WAVE_CBS))
+      SOFT_ERROR(PI_BAD_PARAM, "bad number of segments (%u)", numSegments);
 
-      waveCBsOOLs(&numCB, &numBOOL, &numTOOL);
+   if ((segPulses < 1) || (segPulses > PI_WAVE_MAX_PULSES))
+      SOFT_ERROR(PI_BAD_PARAM, "bad pulses per segment (%u)", segPulses);
 
-   wid = -1;
+   if (maxDelay < 1)
+      SOFT_ERROR(PI_BAD_PARAM, "bad maximum delay (%u)", maxDelay);
 
-   /* Is there an exact fit with a deleted wave. */
+   delays = waveDelayCBs(maxDelay);
+   segCBs = (segPulses * (1 + delays)) + 3;
 
-   for (i=0; i<waveOutCount; i++)
+   if (((uint64_t)numSegments * segCBs) >= NUM_WAVE_CBS)
+      SOFT_ERROR(PI_TOO_MANY_CBS, "stream needs too many CBs");
+
+   waveStream.count = calloc(numSegments, sizeof(uint16_t));
+   waveStream.stage = malloc(segPulses * sizeof(gpioPulse_t));
+
+   if (!waveStream.count || !waveStream.stage)
    {
-      if (waveInfo[i].deleted             &&
-         (waveInfo[i].numCB   == numCB)   &&
-         (waveInfo[i].numBOOL == numBOOL) &&
-         (waveInfo[i].numTOOL == numTOOL))
-      {
-         /* Reuse the deleted waves resources. */
-         wid = i;
-         break;
-      }
+      waveStreamFree();
+      SOFT_ERROR(PI_NO_MEMORY, "can't allocate wave stream");
    }
 
-   if (wid == -1)
+   wid = waveAllocate(1 + (numSegments * segCBs),
+      numSegments * ((2 * segPulses) + 2), 0);
+
+   if (wid < 0)
    {
-      /* Are there enough spare resources? */
+      waveStreamFree();
+      return wid;
+   }
 
-      if ((numCB+waveOutBotCB) > NUM_WAVE_CBS)
-         return PI_TOO_MANY_CBS;
+   waveInfo[wid].deleted = 0;
 
-      if ((numBOOL+waveOutBotOOL) > (waveOutTopOOL-numTOOL))
-         return PI_TOO_MANY_OOL;
+   waveStream.open      = 1;
+   waveStream.wid       = wid;
+   waveStream.segments  = numSegments;
+   waveStream.segPulses = segPulses;
+   waveStream.delays    = delays;
+   waveStream.maxDelay  = maxDelay;
+   waveStream.segCBs    = segCBs;
 
-      if (wid >= PI_MAX_WAVES)
-         return PI_NO_WAVEFORM_ID;
+   /* add delay cb at start of DMA */
 
-      wid = waveOutCount++;
+   p = rawWaveCBAdr(waveInfo[wid].botCB);
+   waveDelayCB(p);
+   p->length = BPD * 20 / PI_WF_MICROS; /* 20 micros delay */
+   p->next   = waveCbPOadr(waveStreamCB(0));
 
-      waveInfo[wid].botCB  = waveOutBotCB;
-      waveInfo[wid].topCB  = waveOutBotCB + numCB -1;
-      waveInfo[wid].botOOL = waveOutBotOOL;
-      waveInfo[wid].topOOL = waveOutTopOOL;
-      waveInfo[wid].numCB = numCB;
-      waveInfo[wid].numBOOL = numBOOL;
-      waveInfo[wid].numTOOL = numTOOL;
+   for (seg=0; seg<numSegments; seg++) waveStreamBuild(seg);
 
-      waveOutBotCB += numCB;
-      waveOutBotOOL += numBOOL;
-      waveOutTopOOL -= numTOOL;
-   }
+   DBG(DBG_USER, "Wave stream: wave %d %d CBs", wid, waveInfo[wid].numCB);
 
-   /* Must be room if got this far. */
+   return 0;
+}
 
-   CB   = waveInfo[wid].botCB;
-   BOOL = waveInfo[wid].botOOL;
-   TOOL = waveInfo[wid].topOOL;
+/* ----------------------------------------------------------------------- */
 
-   wave2Cbs(PI_WAVE_MODE_ONE_SHOT, &CB, &BOOL, &TOOL, 0, 0, 0);
+int gpioWaveStreamWrite(unsigned numPulses, gpioPulse_t *pulses)
+{
+   gpioPulse_t *pp;
+   unsigned taken;
 
-   /* Sanity check. */
+   DBG(DBG_USER, "numPulses=%u pulses=%08"PRIXPTR,
+      numPulses, (uintptr_t)pulses);
 
-   if ( (numCB   != (CB-waveInfo[wid].botCB))    ||
-        (numBOOL != (BOOL-waveInfo[wid].botOOL)) ||
-        (numTOOL != (waveInfo[wid].topOOL-TOOL)) )
+   CHECK_WAVE_INITED;
+
+   if (!waveStream.open)
+      SOFT_ERROR(PI_NO_WAVE_STREAM, "wave stream not open");
+
+   if (numPulses && !pulses)
+      SOFT_ERROR(PI_BAD_POINTER, "bad (NULL) pulses pointer");
+
+   waveStreamPoll();
+
+   taken = 0;
+
+   while (1)
    {
-      DBG(DBG_ALWAYS, "ERROR wid=%d CBs %d=%d BOOL %d=%d TOOL %d=%d", wid,
-         numCB,   CB-waveInfo[wid].botCB,
-         numBOOL, BOOL-waveInfo[wid].botOOL,
-         numTOOL, waveInfo[wid].topOOL-TOOL);
+      if (waveStream.filled == waveStream.segPulses)
+      {
+         if (!waveStreamCommit()) break; /* ring full */
+      }
+
+      if (waveStream.queued >= waveStream.segments) break;
+
+      pp = &waveStream.stage[waveStream.filled];
+
+      /* delays longer than the maximum continue in level-less pulses */
+
+      if (waveStream.carry)
+      {
+         pp->gpioOn  = 0;
+         pp->gpioOff = 0;
+         pp->usDelay = waveStream.carry;
+      }
+      else if (taken < numPulses) *pp = pulses[taken++];
+      else break;
+
+      if (pp->usDelay > waveStream.maxDelay)
+      {
+         waveStream.carry = pp->usDelay - waveStream.maxDelay;
+         pp->usDelay = waveStream.maxDelay;
+      }
+      else waveStream.carry = 0;
+
+      waveStream.filled++;
    }
 
-   DBG(DBG_USER, "Wave Stats: wid=%d CBs %d BOOL %d TOOL %d", wid,
-      numCB, numBOOL, numTOOL);
+   return taken;
+}
+
+/* ----------------------------------------------------------------------- */
 
-   waveInfo[wid].deleted = 0;
+int gpioWaveStreamFlush(void)
+{
+   DBG(DBG_USER, "");
 
-   /* Consume waves. */
+   CHECK_WAVE_INITED;
 
-   wfc[0] = 0;
-   wfc[1] = 0;
-   wfc[2] = 0;
+   if (!waveStream.open)
+      SOFT_ERROR(PI_NO_WAVE_STREAM, "wave stream not open");
 
-   wfcur = 0;
+   /* any delay carried over is written first */
 
-   return wid;
+   gpioWaveStreamWrite(0, NULL);
+
+   waveStreamCommit();
+
+   /* what the ring had no room for */
+
+   return waveStream.filled + (waveStream.carry != 0);
 }
 
-int gpioWaveCreatePad(int pctCB, int pctBOOL, int pctTOOL)
+/* ----------------------------------------------------------------------- */
+
+int gpioWaveStreamTx(void)
 {
-   int i, wid;
-   int numCB, numBOOL, numTOOL;
-   int CB, BOOL, TOOL;
+   int bot;
 
-   DBG(DBG_USER, "%d, %d, %d", pctCB, pctBOOL, pctTOOL);
+   DBG(DBG_USER, "");
 
-   CHECK_INITED;
+   CHECK_WAVE_INITED;
 
-   if (pctCB < 0 || pctCB > 100)
-      SOFT_ERROR(PI_BAD_PARAM, "bad wave param, pctCB=(%d)", pctCB);
-   if (pctBOOL < 0 || pctBOOL > 100)
-      SOFT_ERROR(PI_BAD_PARAM, "bad wave param, pctBOOL=(%d)", pctBOOL);
-   if (pctTOOL < 0 || pctTOOL > 100)
-      SOFT_ERROR(PI_BAD_PARAM, "bad wave param, pctTOOL=(%d)", pctTOOL);
+   if (!waveStream.open)
+      SOFT_ERROR(PI_NO_WAVE_STREAM, "wave stream not open");
 
-   if (wfc[wfcur] == 0) return PI_EMPTY_WAVEFORM;
+   if (waveStreamPoll() >= 0) return 0; /* already being sent */
 
-   /* What resources are needed? */
-   waveCBsOOLs(&numCB, &numBOOL, &numTOOL);
+   if (!waveStream.queued)
+      SOFT_ERROR(PI_EMPTY_WAVEFORM, "nothing written to the stream");
 
-   /* Amount of pad required */
-   CB = (NUM_WAVE_CBS - PI_WAVE_COUNT_PAGES*CBS_PER_OPAGE) * pctCB / 100;
-   BOOL = (NUM_WAVE_OOL - PI_WAVE_COUNT_PAGES*OOL_PER_OPAGE) * pctBOOL /100;
-   TOOL = (NUM_WAVE_OOL - PI_WAVE_COUNT_PAGES*OOL_PER_OPAGE) * pctTOOL /100;
+   bot = waveInfo[waveStream.wid].botCB;
 
-   /* Reject if wave is too big */
-   if (numCB > CB) return PI_TOO_MANY_CBS;
-   if (numBOOL > BOOL) return PI_TOO_MANY_OOL;
-   if (numTOOL > TOOL) return PI_TOO_MANY_OOL;
+   waveClockStart();
 
-   /* Set the padding */
-   numCB = CB;
-   numBOOL = BOOL;
-   numTOOL = TOOL;
+   waveDMAkill();
 
+   rawWaveCBAdr(bot)->next = waveCbPOadr(waveStreamCB(waveStream.head));
 
-   wid = -1;
+   waveDMAgo(waveCbPOadr(bot));
 
-   /* Is there an exact fit with a deleted wave. */
+   waveStream.started = 1;
 
-   for (i=0; i<waveOutCount; i++)
-   {
-      if (waveInfo[i].deleted             &&
-         (waveInfo[i].numCB   == numCB)   &&
-         (waveInfo[i].numBOOL == numBOOL) &&
-         (waveInfo[i].numTOOL == numTOOL))
-      {
-         /* Reuse the deleted waves resources. */
-         wid = i;
-         break;
-      }
-   }
+   waveEndPtr = NULL;
 
-   if (wid == -1)
-   {
-      /* Are there enough spare resources? */
+   return 0;
+}
 
-      if ((numCB+waveOutBotCB) > NUM_WAVE_CBS)
-         return PI_TOO_MANY_CBS;
+/* ----------------------------------------------------------------------- */
 
-      if ((numBOOL+waveOutBotOOL) > (waveOutTopOOL-numTOOL))
-         return PI_TOO_MANY_OOL;
+int gpioWaveStreamStatus(unsigned *queued, unsigned *underruns)
+{
+   unsigned seg, i, sent, room;
+   int now, off;
 
-      if (wid >= PI_MAX_WAVES)
-         return PI_NO_WAVEFORM_ID;
+   DBG(DBG_USER, "queued=%08"PRIXPTR" underruns=%08"PRIXPTR,
+      (uintptr_t)queued, (uintptr_t)underruns);
 
-      wid = waveOutCount++;
+   CHECK_WAVE_INITED;
 
-      waveInfo[wid].botCB  = waveOutBotCB;
-      waveInfo[wid].topCB  = waveOutBotCB + numCB -1;
-      waveInfo[wid].botOOL = waveOutBotOOL;
-      waveInfo[wid].topOOL = waveOutTopOOL;
-      waveInfo[wid].numCB = numCB;
-      waveInfo[wid].numBOOL = numBOOL;
-      waveInfo[wid].numTOOL = numTOOL;
+   if (!waveStream.open)
+      SOFT_ERROR(PI_NO_WAVE_STREAM, "wave stream not open");
 
-      waveOutBotCB += numCB;
-      waveOutBotOOL += numBOOL;
-      waveOutTopOOL -= numTOOL;
-   }
+   now = waveStreamPoll();
 
-   /* Must be room if got this far. */
+   if (queued)
+   {
+      *queued = waveStream.filled;
 
-   CB   = waveInfo[wid].botCB;
-   BOOL = waveInfo[wid].botOOL;
-   TOOL = waveInfo[wid].topOOL;
+      for (i=0; i<waveStream.queued; i++)
+      {
+         seg = (waveStream.head + i) % waveStream.segments;
+         *queued += waveStream.count[seg];
+      }
 
-   wave2Cbs(PI_WAVE_MODE_ONE_SHOT, &CB, &BOOL, &TOOL, numCB, numBOOL, numTOOL);
+      /* less those of the segment being sent already done */
 
-   /* Sanity check. */
+      off = now - waveStreamCB(waveStream.head);
 
-   if ( (numCB   != (CB-waveInfo[wid].botCB))    ||
-        (numBOOL != (BOOL-waveInfo[wid].botOOL)) ||
-        (numTOOL != (waveInfo[wid].topOOL-TOOL)) )
-   {
-      DBG(DBG_ALWAYS, "ERROR wid=%d CBs %d=%d BOOL %d=%d TOOL %d=%d", wid,
-         numCB,   CB-waveInfo[wid].botCB,
-         numBOOL, BOOL-waveInfo[wid].botOOL,
-         numTOOL, waveInfo[wid].topOOL-TOOL);
-   }
+      if (waveStream.queued && (off >= 0) && (off < waveStream.segCBs))
+      {
+         sent = off / (1 + waveStream.delays);
 
-   DBG(DBG_USER, "Wave padding: wid=%d CBs %d BOOL %d TOOL %d", wid,
-      numCB, numBOOL, numTOOL);
+         if (sent > waveStream.count[waveStream.head])
+            sent = waveStream.count[waveStream.head];
 
-   waveInfo[wid].deleted = 0;
+         *queued -= sent;
+      }
+   }
 
-   /* Consume waves. */
+   if (underruns) *underruns = waveStream.underruns;
 
-   wfc[0] = 0;
-   wfc[1] = 0;
-   wfc[2] = 0;
+   if (waveStream.queued >= waveStream.segments) return 0;
 
-   wfcur = 0;
+   room = (waveStream.segments - waveStream.queued) * waveStream.segPulses;
 
-   return wid;
+   return room - waveStream.filled;
 }
+
 /* ----------------------------------------------------------------------- */
 
-int gpioWaveDelete(unsigned wave_id)
+int gpioWaveStreamClose(void)
 {
-   DBG(DBG_USER, "wave id=%d", wave_id);
+   int wid;
 
-   CHECK_INITED;
+   DBG(DBG_USER, "");
 
-   if ((wave_id >= waveOutCount) || waveInfo[wave_id].deleted)
-      SOFT_ERROR(PI_BAD_WAVE_ID, "bad wave id (%d)", wave_id);
+   CHECK_WAVE_INITED;
 
-   waveInfo[wave_id].deleted = 1;
+   if (!waveStream.open)
+      SOFT_ERROR(PI_NO_WAVE_STREAM, "wave stream not open");
 
-   if (wave_id == (waveOutCount-1))
+   if (waveStreamPoll() >= 0)
    {
-      /* top wave deleted, garbage collect any other deleted waves */
+      waveDMAkill();
+      waveEndPtr = NULL;
+   }
 
-      while ((wave_id > 0) && (waveInfo[wave_id-1].deleted)) --wave_id;
+   wid = waveStream.wid;
 
-      waveOutBotCB  = waveInfo[wave_id].botCB;
-      waveOutBotOOL = waveInfo[wave_id].botOOL;
-      waveOutTopOOL = waveInfo[wave_id].topOOL;
+   waveStreamFree();
 
-      waveOutCount = wave_id;
-   }
+   gpioWaveDelete(wid);
 
    return 0;
 }
@@ -9888,23 +15919,18 @@ int gpioWaveTxSend(unsigned wave_id, unsigned wave_mode)
 
    DBG(DBG_USER, "wave_id=%d wave_mode=%d", wave_id, wave_mode);
 
-   CHECK_INITED;
+   CHECK_WAVE_INITED;
 
-   if ((wave_id >= waveOutCount) || waveInfo[wave_id].deleted)
+   if ((wave_id >= waveOutCount) || waveInfo[wave_id].deleted ||
+       (waveStream.open && (waveStream.wid == wave_id)))
       SOFT_ERROR(PI_BAD_WAVE_ID, "bad wave id (%d)", wave_id);
 
    if (wave_mode > PI_WAVE_MODE_REPEAT_SYNC)
       SOFT_ERROR(PI_BAD_WAVE_MODE, "bad wave mode (%d)", wave_mode);
 
-   if (!waveClockInited)
-   {
-      stopHardwarePWM();
-      initClock(0); /* initialise secondary clock */
-      waveClockInited = 1;
-      PWMClockInited = 0;
-   }
+   waveClockStart();
 
-   if (wave_mode < PI_WAVE_MODE_ONE_SHOT_SYNC) initKillDMA(dmaOut);
+   if (wave_mode < PI_WAVE_MODE_ONE_SHOT_SYNC) waveDMAkill();
 
    p = rawWaveCBAdr(waveInfo[wave_id].topCB);
 
@@ -9917,14 +15943,14 @@ int gpioWaveTxSend(unsigned wave_id, unsigned wave_mode)
    {
       *waveEndPtr = waveCbPOadr(waveInfo[wave_id].botCB+1);
 
-      if (!dmaOut[DMA_CONBLK_AD])
+      if (!waveDMAbusy())
       {
-         initDMAgo((uint32_t *)dmaOut, waveCbPOadr(waveInfo[wave_id].botCB));
+         waveDMAgo(waveCbPOadr(waveInfo[wave_id].botCB));
       }
    }
    else
    {
-      initDMAgo((uint32_t *)dmaOut, waveCbPOadr(waveInfo[wave_id].botCB));
+      waveDMAgo(waveCbPOadr(waveInfo[wave_id].botCB));
    }
 
    waveEndPtr = &p->next;
@@ -10137,17 +16163,11 @@ int gpioWaveChain(char *buf, unsigned bufSize)
 
    DBG(DBG_USER, "bufSize=%d [%s]", bufSize, myBuf2Str(bufSize, buf));
 
-   CHECK_INITED;
+   CHECK_WAVE_INITED;
 
-   if (!waveClockInited)
-   {
-      stopHardwarePWM();
-      initClock(0); /* initialise secondary clock */
-      waveClockInited = 1;
-      PWMClockInited = 0;
-   }
+   waveClockStart();
 
-   initKillDMA(dmaOut);
+   waveDMAkill();
 
    waveEndPtr = NULL;
    endPtr = NULL;
@@ -10182,7 +16202,7 @@ int gpioWaveChain(char *buf, unsigned bufSize)
 
    while (i<bufSize)
    {
-      wid = (unsigned)buf[i];
+      wid = (uint8_t)buf[i];
 
       if (wid == 255) /* wave command */
       {
@@ -10190,7 +16210,7 @@ int gpioWaveChain(char *buf, unsigned bufSize)
             SOFT_ERROR(PI_BAD_CHAIN_CMD,
                "incomplete chain command (at %d)", i);
 
-         cmd = buf[i+1];
+         cmd = (uint8_t)buf[i+1];
 
          if (cmd == 0) /* loop begin */
          {
@@ -10219,7 +16239,7 @@ int gpioWaveChain(char *buf, unsigned bufSize)
                SOFT_ERROR(PI_BAD_CHAIN_LOOP,
                   "empty chain loop (at %d)", i);
 
-            cycles = ((unsigned)buf[i+3] <<  8) + (unsigned)buf[i+2];
+            cycles = ((uint8_t)buf[i+3] <<  8) + (uint8_t)buf[i+2];
 
             i += 4;
 
@@ -10280,7 +16300,7 @@ int gpioWaveChain(char *buf, unsigned bufSize)
                SOFT_ERROR(PI_BAD_CHAIN_CMD,
                   "incomplete chain command (at %d)", i);
 
-            cycles = ((unsigned)buf[i+3] <<  8) + (unsigned)buf[i+2];
+            cycles = ((uint8_t)buf[i+3] <<  8) + (uint8_t)buf[i+2];
 
             i += 4;
 
@@ -10416,7 +16436,7 @@ int gpioWaveChain(char *buf, unsigned bufSize)
 
    if (!endPtr) endPtr = &p->next;
 
-   initDMAgo((uint32_t *)dmaOut, waveCbPOadr(chainGetCB(0)));
+   waveDMAgo(waveCbPOadr(chainGetCB(0)));
 
    waveEndPtr = endPtr;
 
@@ -10451,7 +16471,7 @@ int gpioWaveTxAt(void)
 
    if (cb < 0) return -cb;
 
-   for (i=0; i<PI_MAX_WAVES; i++)
+   for (i=0; i<waveMax; i++)
    {
       if ( !waveInfo[i].deleted &&
           (cb >= waveInfo[i].botCB) &&
@@ -10482,7 +16502,7 @@ int gpioWaveGetMicros(void)
 {
    DBG(DBG_USER, "");
 
-   CHECK_INITED;
+   CHECK_WAVE_INITED;
 
    return wfStats.micros;
 }
@@ -10493,7 +16513,7 @@ int gpioWaveGetHighMicros(void)
 {
    DBG(DBG_USER, "");
 
-   CHECK_INITED;
+   CHECK_WAVE_INITED;
 
    return wfStats.highMicros;
 }
@@ -10504,7 +16524,7 @@ int gpioWaveGetMaxMicros(void)
 {
    DBG(DBG_USER, "");
 
-   CHECK_INITED;
+   CHECK_WAVE_INITED;
 
    return wfStats.maxMicros;
 }
@@ -10515,7 +16535,7 @@ int gpioWaveGetPulses(void)
 {
    DBG(DBG_USER, "");
 
-   CHECK_INITED;
+   CHECK_WAVE_INITED;
 
    return wfStats.pulses;
 }
@@ -10526,7 +16546,7 @@ int gpioWaveGetHighPulses(void)
 {
    DBG(DBG_USER, "");
 
-   CHECK_INITED;
+   CHECK_WAVE_INITED;
 
    return wfStats.highPulses;
 }
@@ -10537,7 +16557,7 @@ int gpioWaveGetMaxPulses(void)
 {
    DBG(DBG_USER, "");
 
-   CHECK_INITED;
+   CHECK_WAVE_INITED;
 
    return wfStats.maxPulses;
 }
@@ -10548,7 +16568,7 @@ int gpioWaveGetCbs(void)
 {
    DBG(DBG_USER, "");
 
-   CHECK_INITED;
+   CHECK_WAVE_INITED;
 
    return wfStats.cbs;
 }
@@ -10559,7 +16579,7 @@ int gpioWaveGetHighCbs(void)
 {
    DBG(DBG_USER, "");
 
-   CHECK_INITED;
+   CHECK_WAVE_INITED;
 
    return wfStats.highCbs;
 }
@@ -10570,101 +16590,126 @@ int gpioWaveGetMaxCbs(void)
 {
    DBG(DBG_USER, "");
 
-   CHECK_INITED;
+   CHECK_WAVE_INITED;
 
    return wfStats.maxCbs;
 }
 
 /* ----------------------------------------------------------------------- */
 
-static int read_SDA(wfRx_t *w)
-{
-   myGpioSetMode(w->I.SDA, PI_INPUT);
-   return myGpioRead(w->I.SDA);
-}
+/*
+   SDA and SCL are open drain.  Their output latches are held low so
+   a line is pulled low by making its GPIO an output and released to
+   its pull-up by making it an input.
 
-static void set_SDA(wfRx_t *w)
-{
-   myGpioSetMode(w->I.SDA, PI_INPUT);
-}
+   Each SCL edge is timed by myNanosWait against a deadline, the
+   earliest time it may happen.
+*/
 
-static void clear_SDA(wfRx_t *w)
+static uint64_t I2CWait(wfRx_t *w)
 {
-   myGpioSetMode(w->I.SDA, PI_OUTPUT);
-   myGpioWrite(w->I.SDA, 0);
+   return myNanosWait(w->I.next);
 }
 
-static void clear_SCL(wfRx_t *w)
+static void I2CClockHigh(wfRx_t *w)
 {
-   myGpioSetMode(w->I.SCL, PI_OUTPUT);
-   myGpioWrite(w->I.SCL, 0);
-}
+   uint64_t start, now;
 
-static void I2C_delay(wfRx_t *w)
-{
-   myGpioDelay(w->I.delay);
+   start = I2CWait(w);
+
+   myGpioSetMode(w->I.SCL, PI_INPUT);
+
+   /* a slave may hold SCL low (clock stretching) */
+
+   now = start;
+
+   while (!(*(gpioReg + GPLEV0) & w->I.SCLBit))
+   {
+      now = myNanos();
+      if ((now - start) > I2C_MAX_STRETCH) break;
+   }
+
+   if ((now - start) > w->I.highNs) w->I.stretches++;
+
+   w->I.next = now + w->I.highNs;
 }
 
-static void I2C_clock_stretch(wfRx_t *w)
+static void I2CClockLow(wfRx_t *w)
 {
-   uint32_t now, max_stretch=100000;
+   uint64_t now;
 
-   myGpioSetMode(w->I.SCL, PI_INPUT);
-   now = gpioTick();
-   while ((myGpioRead(w->I.SCL) == 0) && ((gpioTick()-now) < max_stretch));
+   now = I2CWait(w);
+
+   myGpioSetMode(w->I.SCL, PI_OUTPUT);
+
+   w->I.next = now + w->I.lowNs;
 }
 
 static void I2CStart(wfRx_t *w)
 {
+   uint64_t now;
+
    if (w->I.started)
    {
-      set_SDA(w);
-      I2C_delay(w);
-      I2C_clock_stretch(w);
-      I2C_delay(w);
+      /* repeated start, SCL is low */
+      myGpioSetMode(w->I.SDA, PI_INPUT);
+      I2CClockHigh(w);
    }
 
-   clear_SDA(w);
-   I2C_delay(w);
-   clear_SCL(w);
-   I2C_delay(w);
+   now = I2CWait(w);
+
+   myGpioSetMode(w->I.SDA, PI_OUTPUT);
+
+   w->I.next = now + w->I.highNs;
+
+   I2CClockLow(w);
 
    w->I.started = 1;
 }
 
 static void I2CStop(wfRx_t *w)
 {
-   clear_SDA(w);
-   I2C_delay(w);
-   I2C_clock_stretch(w);
-   I2C_delay(w);
-   set_SDA(w);
-   I2C_delay(w);
+   uint64_t now;
+
+   myGpioSetMode(w->I.SDA, PI_OUTPUT);
+
+   I2CClockHigh(w);
+
+   now = I2CWait(w);
+
+   myGpioSetMode(w->I.SDA, PI_INPUT);
+
+   w->I.next = now + w->I.lowNs; /* bus free time */
 
    w->I.started = 0;
 }
 
 static void I2CPutBit(wfRx_t *w, int bit)
 {
-   if (bit) set_SDA(w);
-   else     clear_SDA(w);
+   /* SCL is low */
 
-   I2C_delay(w);
-   I2C_clock_stretch(w);
-   I2C_delay(w);
-   clear_SCL(w);
+   if (bit) myGpioSetMode(w->I.SDA, PI_INPUT);
+   else     myGpioSetMode(w->I.SDA, PI_OUTPUT);
+
+   I2CClockHigh(w);
+   I2CClockLow(w);
 }
 
 static int I2CGetBit(wfRx_t *w)
 {
    int bit;
 
-   set_SDA(w); /* let SDA float */
-   I2C_delay(w);
-   I2C_clock_stretch(w);
-   bit = read_SDA(w);
-   I2C_delay(w);
-   clear_SCL(w);
+   myGpioSetMode(w->I.SDA, PI_INPUT); /* let SDA float */
+
+   I2CClockHigh(w);
+
+   /* sample at the end of the high phase */
+
+   I2CWait(w);
+
+   bit = (*(gpioReg + GPLEV0) & w->I.SDABit) ? 1 : 0;
+
+   I2CClockLow(w);
 
    return bit;
 }
@@ -10672,6 +16717,9 @@ static int I2CGetBit(wfRx_t *w)
 static int I2CPutByte(wfRx_t *w, int byte)
 {
    int bit, nack;
+   uint64_t fall;
+
+   fall = w->I.next - w->I.lowNs;
 
    for(bit=0; bit<8; bit++)
    {
@@ -10681,12 +16729,18 @@ static int I2CPutByte(wfRx_t *w, int byte)
 
    nack = I2CGetBit(w);
 
+   w->I.clocks += 9;
+   w->I.clockNs += (w->I.next - w->I.lowNs) - fall;
+
    return nack;
 }
 
 static uint8_t I2CGetByte(wfRx_t *w, int nack)
 {
    int bit, byte=0;
+   uint64_t fall;
+
+   fall = w->I.next - w->I.lowNs;
 
    for (bit=0; bit<8; bit++)
    {
@@ -10695,6 +16749,9 @@ static uint8_t I2CGetByte(wfRx_t *w, int nack)
 
    I2CPutBit(w, nack);
 
+   w->I.clocks += 9;
+   w->I.clockNs += (w->I.next - w->I.lowNs) - fall;
+
    return byte;
 }
 
@@ -10729,7 +16786,14 @@ int bbI2COpen(unsigned SDA, unsigned SCL, unsigned baud)
    wfRx[SDA].I.started = 0;
    wfRx[SDA].I.SDA = SDA;
    wfRx[SDA].I.SCL = SCL;
-   wfRx[SDA].I.delay = 500000 / baud;
+   wfRx[SDA].I.SDABit = 1<<SDA;
+   wfRx[SDA].I.SCLBit = 1<<SCL;
+   wfRx[SDA].I.lowNs = I2C_LOW_NS(baud);
+   wfRx[SDA].I.highNs = (THOUSAND * MILLION / baud) - I2C_LOW_NS(baud);
+   wfRx[SDA].I.next = 0;
+   wfRx[SDA].I.clocks = 0;
+   wfRx[SDA].I.clockNs = 0;
+   wfRx[SDA].I.stretches = 0;
    wfRx[SDA].I.SDAMode = gpioGetMode(SDA);
    wfRx[SDA].I.SCLMode = gpioGetMode(SCL);
 
@@ -10787,6 +16851,7 @@ int bbI2CZip(
 {
    int i, ack, inPos, outPos, status, bytes;
    int addr, flags, esc, setesc;
+   uint64_t now;
    wfRx_t *w;
 
    DBG(DBG_USER, "gpio=%d inBuf=%s outBuf=%08"PRIXPTR" len=%d",
@@ -10819,6 +16884,18 @@ int bbI2CZip(
 
    wfRx_lock(SDA);
 
+   /* the latches stay low, the GPIO modes drive the lines */
+
+   *(gpioReg + GPCLR0) = w->I.SDABit | w->I.SCLBit;
+
+   now = myNanos();
+
+   if (w->I.next < now) w->I.next = now;
+
+   w->I.clocks = 0;
+   w->I.clockNs = 0;
+   w->I.stretches = 0;
+
    while (!status && (inPos < inLen))
    {
       DBG(DBG_INTERNAL, "status=%d inpos=%d inlen=%d cmd=%d addr=%d flags=%x",
@@ -10922,6 +16999,42 @@ int bbI2CZip(
 
 /* ----------------------------------------------------------------------- */
 
+int bbI2CStats(unsigned SDA, uint32_t *freq, uint32_t *stretches)
+{
+   wfRx_t *w;
+
+   DBG(DBG_USER, "SDA=%d freq=%08"PRIXPTR" stretches=%08"PRIXPTR,
+      SDA, (uintptr_t)freq, (uintptr_t)stretches);
+
+   CHECK_INITED;
+
+   if (SDA > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", SDA);
+
+   if (wfRx[SDA].mode != PI_WFRX_I2C_SDA)
+      SOFT_ERROR(PI_NOT_I2C_GPIO, "no I2C on gpio (%d)", SDA);
+
+   w = &wfRx[SDA];
+
+   wfRx_lock(SDA);
+
+   if (freq)
+   {
+      if (w->I.clockNs)
+         *freq = ((uint64_t)w->I.clocks * THOUSAND * MILLION) / w->I.clockNs;
+      else
+         *freq = 0;
+   }
+
+   if (stretches) *stretches = w->I.stretches;
+
+   wfRx_unlock(SDA);
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
 void bscInit(int mode)
 {
    int sda, scl, mosi, miso, ce;
@@ -11199,26 +17312,159 @@ static uint8_t bbSPIXferByte(wfRx_t *w, char txByte)
             txByte <<= 1;
          }
 
-         SPI_delay(w);
+         SPI_delay(w);
+
+         set_SCLK(w);
+
+         if (PI_SPI_FLAGS_GET_RX_LSB(w->S.spiFlags))
+         {
+            rxByte = (rxByte >> 1) | myGpioRead(w->S.MISO) << 7;
+         }
+         else
+         {
+            rxByte = (rxByte << 1) | myGpioRead(w->S.MISO);
+         }
+
+         SPI_delay(w);
+
+         clear_SCLK(w);
+      }
+   }
+
+   return rxByte;
+}
+
+/*-------------------------------------------------------------------------*/
+
+static void bbSPIXferLanes(
+   wfRx_t *w, char *inBuf, char *outBuf, unsigned count)
+{
+   /*
+   Each lane is a device with its own MOSI and/or MISO sharing CS and
+   SCLK.  Byte n of lane l is at buf[n*lanes + l].  All the lanes are
+   clocked together, each clock edge being one write to GPSET0 and
+   one to GPCLR0 which also carries any MOSI changes, and MISO being
+   sampled for every lane with one read of GPLEV0.
+   */
+
+   uint32_t MOSIBit[32], MISOBit[32];
+   uint8_t rxByte[32];
+   uint32_t SCLKBit, lead, trail, set, clr, level;
+   uint64_t next;
+   int lanes, numMOSI, numMISO, cpha, txLSB, rxLSB;
+   int i, bit, txShift, rxShift;
+   unsigned pos;
+   char *tx, *rx;
+
+   lanes = w->S.lanes;
+
+   numMOSI = 0;
+   for (i=0; i<32; i++) if (w->S.MOSIBits & (1<<i)) MOSIBit[numMOSI++] = 1<<i;
+
+   numMISO = 0;
+   for (i=0; i<32; i++) if (w->S.MISOBits & (1<<i)) MISOBit[numMISO++] = 1<<i;
+
+   cpha  = PI_SPI_FLAGS_GET_CPHA(w->S.spiFlags);
+   txLSB = PI_SPI_FLAGS_GET_TX_LSB(w->S.spiFlags);
+   rxLSB = PI_SPI_FLAGS_GET_RX_LSB(w->S.spiFlags);
+
+   SCLKBit = 1<<w->S.SCLK;
+
+   /* the leading edge sets SCLK unless the clock idles high */
+
+   if (PI_SPI_FLAGS_GET_CPOL(w->S.spiFlags)) {lead = 0; trail = SCLKBit;}
+   else                                      {lead = SCLKBit; trail = 0;}
+
+   /* clock idle, then assert CS */
+
+   if (trail) *(gpioReg + GPSET0) = SCLKBit;
+   else       *(gpioReg + GPCLR0) = SCLKBit;
+
+   next = myNanosWait(myNanos() + w->S.halfNs);
+
+   set_CS(w);
+
+   next += w->S.halfNs;
+
+   for (pos=0; pos<count; pos+=lanes)
+   {
+      tx = inBuf + pos;
+      rx = outBuf + pos;
+
+      memset(rxByte, 0, lanes);
+
+      for (bit=0; bit<8; bit++)
+      {
+         if (txLSB) txShift = bit; else txShift = 7 - bit;
+         if (rxLSB) rxShift = bit; else rxShift = 7 - bit;
+
+         set = 0;
+         clr = 0;
+
+         for (i=0; i<numMOSI; i++)
+         {
+            if ((tx[i] >> txShift) & 1) set |= MOSIBit[i];
+            else                        clr |= MOSIBit[i];
+         }
+
+         /*
+         CPHA 0, MOSI changes with the trailing edge of the previous
+         bit and MISO is read after the leading edge.
 
-         set_SCLK(w);
+         CPHA 1, MOSI changes with the leading edge and MISO is read
+         after the trailing edge.
+         */
 
-         if (PI_SPI_FLAGS_GET_RX_LSB(w->S.spiFlags))
+         if (cpha) {set |= lead;  clr |= SCLKBit & ~lead;}
+         else      {set |= trail; clr |= SCLKBit & ~trail;}
+
+         next = myNanosWait(next);
+
+         *(gpioReg + GPSET0) = set;
+         *(gpioReg + GPCLR0) = clr;
+
+         next += w->S.halfNs;
+
+         next = myNanosWait(next);
+
+         if (cpha)
          {
-            rxByte = (rxByte >> 1) | myGpioRead(w->S.MISO) << 7;
+            if (trail) *(gpioReg + GPSET0) = SCLKBit;
+            else       *(gpioReg + GPCLR0) = SCLKBit;
          }
          else
          {
-            rxByte = (rxByte << 1) | myGpioRead(w->S.MISO);
+            if (lead) *(gpioReg + GPSET0) = SCLKBit;
+            else      *(gpioReg + GPCLR0) = SCLKBit;
          }
 
-         SPI_delay(w);
+         level = *(gpioReg + GPLEV0);
 
-         clear_SCLK(w);
+         for (i=0; i<numMISO; i++)
+         {
+            if (level & MISOBit[i]) rxByte[i] |= (1<<rxShift);
+         }
+
+         next += w->S.halfNs;
       }
+
+      /* inBuf and outBuf may be the same */
+
+      memcpy(rx, rxByte, lanes);
    }
 
-   return rxByte;
+   /* return the clock to idle, then release CS */
+
+   next = myNanosWait(next);
+
+   if (trail) *(gpioReg + GPSET0) = SCLKBit;
+   else       *(gpioReg + GPCLR0) = SCLKBit;
+
+   next = myNanosWait(next + w->S.halfNs);
+
+   clear_CS(w);
+
+   myNanosWait(next + w->S.halfNs);
 }
 
 /*-------------------------------------------------------------------------*/
@@ -11272,7 +17518,8 @@ int bbSPIOpen(
       {
          if ((wfRx[MISO].mode == PI_WFRX_SPI_MISO) &&
              (wfRx[MOSI].mode == PI_WFRX_SPI_MOSI) &&
-             (wfRx[SCLK].mode == PI_WFRX_SPI_SCLK))
+             (wfRx[SCLK].mode == PI_WFRX_SPI_SCLK) &&
+             (!wfRx[SCLK].S.lanes))
          {
             valid = 2; /* new CS for existing SPI GPIO */
          }
@@ -11298,6 +17545,7 @@ int bbSPIOpen(
    wfRx[CS].S.CSMode = gpioGetMode(CS);
    wfRx[CS].S.delay = (500000 / baud) - 1;
    wfRx[CS].S.spiFlags = spiFlags;
+   wfRx[CS].S.lanes = 0;
 
    /* preset CS to off */
 
@@ -11311,6 +17559,7 @@ int bbSPIOpen(
    if (valid == 1) /* first time GPIO for SPI */
    {
       wfRx[SCLK].S.usage = 1;
+      wfRx[SCLK].S.lanes = 0;
 
       wfRx[SCLK].S.SCLKMode = gpioGetMode(SCLK);
       wfRx[SCLK].S.MISOMode = gpioGetMode(MISO);
@@ -11338,9 +17587,108 @@ int bbSPIOpen(
 
 /*-------------------------------------------------------------------------*/
 
+int bbSPIOpenLanes(
+   unsigned CS, uint32_t MISOBits, uint32_t MOSIBits, unsigned SCLK,
+   unsigned baud, unsigned spiFlags)
+{
+   int gpio, lanes, numMISO, numMOSI;
+   uint32_t bits;
+
+   DBG(DBG_USER, "CS=%d MISOBits=%08X MOSIBits=%08X SCLK=%d baud=%d flags=%d",
+      CS, MISOBits, MOSIBits, SCLK, baud, spiFlags);
+
+   CHECK_INITED;
+
+   if (CS > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad CS (%d)", CS);
+
+   if (SCLK > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad SCLK (%d)", SCLK);
+
+   if ((baud < PI_BB_SPI_MIN_BAUD) || (baud > PI_BB_SPI_MAX_BAUD))
+      SOFT_ERROR(PI_BAD_SPI_BAUD, "CS %d, bad baud (%d)", CS, baud);
+
+   numMISO = __builtin_popcount(MISOBits);
+   numMOSI = __builtin_popcount(MOSIBits);
+
+   /* a lane may have MISO, MOSI, or both, but all lanes alike */
+
+   if ((!numMISO && !numMOSI) ||
+       (numMISO && numMOSI && (numMISO != numMOSI)))
+      SOFT_ERROR(PI_BAD_PARAM, "bad lanes (MISO %08X, MOSI %08X)",
+         MISOBits, MOSIBits);
+
+   if (numMISO > numMOSI) lanes = numMISO; else lanes = numMOSI;
+
+   /* check all GPIO unique and unused */
+
+   bits = (1<<CS) | (1<<SCLK) | MISOBits | MOSIBits;
+
+   if (__builtin_popcount(bits) != (2 + numMISO + numMOSI))
+      SOFT_ERROR(PI_GPIO_IN_USE, "GPIO used more than once");
+
+   for (gpio=0; gpio<=PI_MAX_USER_GPIO; gpio++)
+   {
+      if ((bits & (1<<gpio)) && (wfRx[gpio].mode != PI_WFRX_NONE))
+         SOFT_ERROR(PI_GPIO_IN_USE,
+            "gpio %d is already being used, mode %d", gpio, wfRx[gpio].mode);
+   }
+
+   for (gpio=0; gpio<=PI_MAX_USER_GPIO; gpio++)
+   {
+      if (bits & (1<<gpio))
+      {
+         wfRx[gpio].gpio = gpio;
+         wfRx[gpio].S.laneMode = gpioGetMode(gpio);
+
+         if (MISOBits & (1<<gpio))
+         {
+            wfRx[gpio].mode = PI_WFRX_SPI_MISO;
+            myGpioSetMode(gpio, PI_INPUT);
+         }
+         else if (MOSIBits & (1<<gpio))
+         {
+            wfRx[gpio].mode = PI_WFRX_SPI_MOSI;
+            myGpioWrite(gpio, 0);
+            myGpioSetMode(gpio, PI_OUTPUT);
+         }
+      }
+   }
+
+   wfRx[CS].mode = PI_WFRX_SPI_CS;
+   wfRx[CS].baud = baud;
+
+   wfRx[CS].S.CS = CS;
+   wfRx[CS].S.SCLK = SCLK;
+   wfRx[CS].S.lanes = lanes;
+   wfRx[CS].S.MISOBits = MISOBits;
+   wfRx[CS].S.MOSIBits = MOSIBits;
+   wfRx[CS].S.halfNs = (500 * MILLION) / baud;
+   wfRx[CS].S.spiFlags = spiFlags;
+
+   /* preset CS to off */
+
+   myGpioWrite(CS, !PI_SPI_FLAGS_GET_CSPOL(spiFlags));
+   myGpioSetMode(CS, PI_OUTPUT);
+
+   /* the SCLK entry marks the GPIO as a lane bus for bbSPIOpen */
+
+   wfRx[SCLK].mode = PI_WFRX_SPI_SCLK;
+   wfRx[SCLK].S.usage = 1;
+   wfRx[SCLK].S.lanes = lanes;
+
+   myGpioWrite(SCLK, PI_SPI_FLAGS_GET_CPOL(spiFlags));
+   myGpioSetMode(SCLK, PI_OUTPUT);
+
+   return 0;
+}
+
+/*-------------------------------------------------------------------------*/
+
 int bbSPIClose(unsigned CS)
 {
-   int SCLK;
+   int SCLK, gpio;
+   uint32_t bits;
 
    DBG(DBG_USER, "CS=%d", CS);
 
@@ -11353,6 +17701,23 @@ int bbSPIClose(unsigned CS)
    {
       case PI_WFRX_SPI_CS:
 
+         if (wfRx[CS].S.lanes)
+         {
+            bits = wfRx[CS].S.MISOBits | wfRx[CS].S.MOSIBits |
+               (1<<CS) | (1<<wfRx[CS].S.SCLK);
+
+            for (gpio=0; gpio<=PI_MAX_USER_GPIO; gpio++)
+            {
+               if (bits & (1<<gpio))
+               {
+                  myGpioSetMode(gpio, wfRx[gpio].S.laneMode);
+                  wfRx[gpio].mode = PI_WFRX_NONE;
+               }
+            }
+
+            break;
+         }
+
          myGpioSetMode(wfRx[CS].S.CS, wfRx[CS].S.CSMode);
          wfRx[CS].mode = PI_WFRX_NONE;
 
@@ -11411,6 +17776,21 @@ int bbSPIXfer(
    if (!outBuf && count)
       SOFT_ERROR(PI_BAD_POINTER, "output buffer can't be NULL");
 
+   if (wfRx[CS].S.lanes)
+   {
+      if (count % wfRx[CS].S.lanes)
+         SOFT_ERROR(PI_BAD_SPI_COUNT, "count %d not a multiple of %d lanes",
+            count, wfRx[CS].S.lanes);
+
+      wfRx_lock(CS);
+
+      bbSPIXferLanes(&wfRx[CS], inBuf, outBuf, count);
+
+      wfRx_unlock(CS);
+
+      return count;
+   }
+
    SCLK = wfRx[CS].S.SCLK;
 
    wfRx[SCLK].S.CS = CS;
@@ -11440,7 +17820,7 @@ int bbSPIXfer(
 
 int gpioSerialReadOpen(unsigned gpio, unsigned baud, unsigned data_bits)
 {
-   int bitTime, timeout;
+   int bitTime;
 
    DBG(DBG_USER, "gpio=%d baud=%d data_bits=%d", gpio, baud, data_bits);
 
@@ -11453,49 +17833,228 @@ int gpioSerialReadOpen(unsigned gpio, unsigned baud, unsigned data_bits)
       SOFT_ERROR(PI_BAD_WAVE_BAUD,
          "gpio %d, bad baud rate (%d)", gpio, baud);
 
-   if ((data_bits < PI_MIN_WAVE_DATABITS) ||
-       (data_bits > PI_MAX_WAVE_DATABITS))
-      SOFT_ERROR(PI_BAD_DATABITS,
-         "gpio %d, bad data bits (%d)", gpio, data_bits);
+   if ((data_bits < PI_MIN_WAVE_DATABITS) ||
+       (data_bits > PI_MAX_WAVE_DATABITS))
+      SOFT_ERROR(PI_BAD_DATABITS,
+         "gpio %d, bad data bits (%d)", gpio, data_bits);
+
+   if (wfRx[gpio].mode != PI_WFRX_NONE)
+      SOFT_ERROR(PI_GPIO_IN_USE, "gpio %d is already being used", gpio);
+
+   bitTime = (1000 * MILLION) / baud; /* nanos */
+
+   wfRx[gpio].gpio = gpio;
+   wfRx[gpio].mode = PI_WFRX_SERIAL;
+   wfRx[gpio].baud = baud;
+
+   wfRx[gpio].s.buf      = malloc(SRX_BUF_SIZE);
+   wfRx[gpio].s.bufSize  = SRX_BUF_SIZE;
+   wfRx[gpio].s.fullBit  = bitTime;         /* nanos */
+   wfRx[gpio].s.halfBit  = (bitTime/2)+500; /* nanos (500 for rounding) */
+   wfRx[gpio].s.readPos  = 0;
+   wfRx[gpio].s.writePos = 0;
+   wfRx[gpio].s.bit      = -1;
+   wfRx[gpio].s.dataBits = data_bits;
+   wfRx[gpio].s.invert   = PI_BB_SER_NORMAL;
+   wfRx[gpio].s.parity   = PI_BB_SER_PARITY_NONE;
+   wfRx[gpio].s.framingErrs = 0;
+   wfRx[gpio].s.parityErrs  = 0;
+   wfRx[gpio].s.waiters     = 0;
+
+   if      (data_bits <  9) wfRx[gpio].s.bytes = 1;
+   else if (data_bits < 17) wfRx[gpio].s.bytes = 2;
+   else                  wfRx[gpio].s.bytes = 4;
+
+   waveRxSerialFrame(&wfRx[gpio]);
+
+   /* decoded by the alert thread, see waveRxSerialSamples */
+
+   serialRxBits |= (1<<gpio);
+
+   monitorBits = alertBits | serialRxBits | notifyBits | scriptBits |
+      gpioGetSamples.bits;
+
+   return 0;
+}
+
+/*-------------------------------------------------------------------------*/
+
+int gpioSerialReadInvert(unsigned gpio, unsigned invert)
+{
+   DBG(DBG_USER, "gpio=%d invert=%d", gpio, invert);
+
+   CHECK_INITED;
+
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+
+   if (wfRx[gpio].mode != PI_WFRX_SERIAL)
+      SOFT_ERROR(PI_NOT_SERIAL_GPIO, "no serial read on gpio (%d)", gpio);
+
+   if ((invert < PI_BB_SER_NORMAL) ||
+       (invert > PI_BB_SER_INVERT))
+      SOFT_ERROR(PI_BAD_SER_INVERT,
+         "bad invert level for gpio %d (%d)", gpio, invert);
+
+   wfRx[gpio].s.invert = invert;
+
+   return 0;
+}
+
+/*-------------------------------------------------------------------------*/
+
+int gpioSerialReadParity(unsigned gpio, unsigned parity)
+{
+   DBG(DBG_USER, "gpio=%d parity=%d", gpio, parity);
+
+   CHECK_INITED;
+
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+
+   if (wfRx[gpio].mode != PI_WFRX_SERIAL)
+      SOFT_ERROR(PI_NOT_SERIAL_GPIO, "no serial read on gpio (%d)", gpio);
+
+   if (parity > PI_BB_SER_PARITY_EVEN)
+      SOFT_ERROR(PI_BAD_SER_PARITY,
+         "bad parity for gpio %d (%d)", gpio, parity);
+
+   wfRx[gpio].s.parity = parity;
+
+   waveRxSerialFrame(&wfRx[gpio]);
+
+   return 0;
+}
+
+/*-------------------------------------------------------------------------*/
+
+int gpioSerialReadErrors(
+   unsigned gpio, unsigned *framingErrs, unsigned *parityErrs)
+{
+   DBG(DBG_USER, "gpio=%d framingErrs=%08"PRIXPTR" parityErrs=%08"PRIXPTR,
+      gpio, (uintptr_t)framingErrs, (uintptr_t)parityErrs);
+
+   CHECK_INITED;
+
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+
+   if (wfRx[gpio].mode != PI_WFRX_SERIAL)
+      SOFT_ERROR(PI_NOT_SERIAL_GPIO, "no serial read on gpio (%d)", gpio);
+
+   if (framingErrs) *framingErrs = wfRx[gpio].s.framingErrs;
+   if (parityErrs)  *parityErrs  = wfRx[gpio].s.parityErrs;
+
+   return 0;
+}
+
+/*-------------------------------------------------------------------------*/
+
+int gpioSerialRead(unsigned gpio, void *buf, size_t bufSize)
+{
+   unsigned bytes=0, wpos;
+   volatile wfRx_t *w;
+
+   DBG(DBG_USER, "gpio=%d buf=%08"PRIXPTR" bufSize=%zd", gpio, (uintptr_t)buf, bufSize);
+
+   CHECK_INITED;
+
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+
+   if (bufSize == 0)
+      SOFT_ERROR(PI_BAD_SERIAL_COUNT, "buffer size can't be zero");
+
+   if (wfRx[gpio].mode != PI_WFRX_SERIAL)
+      SOFT_ERROR(PI_NOT_SERIAL_GPIO, "no serial read on gpio (%d)", gpio);
+
+   w = &wfRx[gpio];
+
+   wfRx_lock(gpio);
+
+   if (w->mode != PI_WFRX_SERIAL)
+   {
+      wfRx_unlock(gpio);
+      SOFT_ERROR(PI_NOT_SERIAL_GPIO, "no serial read on gpio (%d)", gpio);
+   }
+
+   if (w->s.readPos != w->s.writePos)
+   {
+      wpos = w->s.writePos;
+
+      if (wpos > w->s.readPos) bytes = wpos - w->s.readPos;
+      else                     bytes = w->s.bufSize - w->s.readPos;
+
+      if (bytes > bufSize) bytes = bufSize;
+
+      /* copy in multiples of the data size in bytes */
+
+      bytes = (bytes / w->s.bytes) * w->s.bytes;
+
+      if (buf) memcpy(buf, w->s.buf+w->s.readPos, bytes);
+
+      w->s.readPos += bytes;
+
+      if (w->s.readPos >= w->s.bufSize) w->s.readPos = 0;
+   }
+
+   wfRx_unlock(gpio);
+
+   return bytes;
+}
+
+
+/*-------------------------------------------------------------------------*/
+
+int gpioSerialReadPeek(unsigned gpio, char **buf)
+{
+   int bytes, wpos;
+   wfRx_t *w;
+
+   DBG(DBG_USER, "gpio=%d buf=%08"PRIXPTR, gpio, (uintptr_t)buf);
+
+   CHECK_INITED;
+
+   if (gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+
+   if (!buf) SOFT_ERROR(PI_BAD_POINTER, "bad (NULL) buf pointer");
+
+   if (wfRx[gpio].mode != PI_WFRX_SERIAL)
+      SOFT_ERROR(PI_NOT_SERIAL_GPIO, "no serial read on gpio (%d)", gpio);
 
-   if (wfRx[gpio].mode != PI_WFRX_NONE)
-      SOFT_ERROR(PI_GPIO_IN_USE, "gpio %d is already being used", gpio);
+   w = &wfRx[gpio];
 
-   bitTime = (1000 * MILLION) / baud; /* nanos */
+   wfRx_lock(gpio);
 
-   timeout  = ((data_bits+2) * bitTime)/MILLION; /* millis */
+   if (w->mode != PI_WFRX_SERIAL)
+   {
+      wfRx_unlock(gpio);
+      SOFT_ERROR(PI_NOT_SERIAL_GPIO, "no serial read on gpio (%d)", gpio);
+   }
 
-   if (timeout < 1) timeout = 1;
+   wpos = w->s.writePos;
 
-   wfRx[gpio].gpio = gpio;
-   wfRx[gpio].mode = PI_WFRX_SERIAL;
-   wfRx[gpio].baud = baud;
+   /* the buffer size is a multiple of all the character sizes */
 
-   wfRx[gpio].s.buf      = malloc(SRX_BUF_SIZE);
-   wfRx[gpio].s.bufSize  = SRX_BUF_SIZE;
-   wfRx[gpio].s.timeout  = timeout;
-   wfRx[gpio].s.fullBit  = bitTime;         /* nanos */
-   wfRx[gpio].s.halfBit  = (bitTime/2)+500; /* nanos (500 for rounding) */
-   wfRx[gpio].s.readPos  = 0;
-   wfRx[gpio].s.writePos = 0;
-   wfRx[gpio].s.bit      = -1;
-   wfRx[gpio].s.dataBits = data_bits;
-   wfRx[gpio].s.invert   = PI_BB_SER_NORMAL;
+   if (wpos >= w->s.readPos) bytes = wpos - w->s.readPos;
+   else                      bytes = w->s.bufSize - w->s.readPos;
 
-   if      (data_bits <  9) wfRx[gpio].s.bytes = 1;
-   else if (data_bits < 17) wfRx[gpio].s.bytes = 2;
-   else                  wfRx[gpio].s.bytes = 4;
+   *buf = w->s.buf + w->s.readPos;
 
-   gpioSetAlertFunc(gpio, waveRxBit);
+   wfRx_unlock(gpio);
 
-   return 0;
+   return bytes;
 }
 
 /*-------------------------------------------------------------------------*/
 
-int gpioSerialReadInvert(unsigned gpio, unsigned invert)
+int gpioSerialReadCommit(unsigned gpio, unsigned count)
 {
-   DBG(DBG_USER, "gpio=%d invert=%d", gpio, invert);
+   unsigned bytes, wpos;
+   wfRx_t *w;
+
+   DBG(DBG_USER, "gpio=%d count=%d", gpio, count);
 
    CHECK_INITED;
 
@@ -11505,60 +18064,97 @@ int gpioSerialReadInvert(unsigned gpio, unsigned invert)
    if (wfRx[gpio].mode != PI_WFRX_SERIAL)
       SOFT_ERROR(PI_NOT_SERIAL_GPIO, "no serial read on gpio (%d)", gpio);
 
-   if ((invert < PI_BB_SER_NORMAL) ||
-       (invert > PI_BB_SER_INVERT))
-      SOFT_ERROR(PI_BAD_SER_INVERT,
-         "bad invert level for gpio %d (%d)", gpio, invert);
+   w = &wfRx[gpio];
 
-   wfRx[gpio].s.invert = invert;
+   wfRx_lock(gpio);
+
+   if (w->mode != PI_WFRX_SERIAL)
+   {
+      wfRx_unlock(gpio);
+      SOFT_ERROR(PI_NOT_SERIAL_GPIO, "no serial read on gpio (%d)", gpio);
+   }
+
+   wpos = w->s.writePos;
+
+   if (wpos >= w->s.readPos) bytes = wpos - w->s.readPos;
+   else                      bytes = w->s.bufSize - w->s.readPos;
+
+   if ((count > bytes) || (count % w->s.bytes))
+   {
+      wfRx_unlock(gpio);
+      SOFT_ERROR(PI_BAD_SERIAL_COUNT,
+         "bad count for gpio %d (%d of %d)", gpio, count, bytes);
+   }
+
+   w->s.readPos = (w->s.readPos + count) % w->s.bufSize;
+
+   wfRx_unlock(gpio);
 
    return 0;
 }
 
 /*-------------------------------------------------------------------------*/
 
-int gpioSerialRead(unsigned gpio, void *buf, size_t bufSize)
+int gpioSerialReadWait(unsigned gpio, unsigned terminator, unsigned timeout)
 {
-   unsigned bytes=0, wpos;
-   volatile wfRx_t *w;
+   struct timespec deadline;
+   int status, timedOut;
+   wfRx_t *w;
 
-   DBG(DBG_USER, "gpio=%d buf=%08"PRIXPTR" bufSize=%zd", gpio, (uintptr_t)buf, bufSize);
+   DBG(DBG_USER, "gpio=%d terminator=%d timeout=%d",
+      gpio, terminator, timeout);
 
    CHECK_INITED;
 
    if (gpio > PI_MAX_USER_GPIO)
       SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-   if (bufSize == 0)
-      SOFT_ERROR(PI_BAD_SERIAL_COUNT, "buffer size can't be zero");
+   if (terminator > PI_BB_SER_ANY)
+      SOFT_ERROR(PI_BAD_PARAM, "bad terminator (%d)", terminator);
 
    if (wfRx[gpio].mode != PI_WFRX_SERIAL)
       SOFT_ERROR(PI_NOT_SERIAL_GPIO, "no serial read on gpio (%d)", gpio);
 
-   w = &wfRx[gpio];
+   clock_gettime(CLOCK_MONOTONIC, &deadline);
 
-   if (w->s.readPos != w->s.writePos)
+   deadline.tv_sec  += timeout / THOUSAND;
+   deadline.tv_nsec += (timeout % THOUSAND) * MILLION;
+
+   if (deadline.tv_nsec >= BILLION)
    {
-      wpos = w->s.writePos;
+      deadline.tv_sec++;
+      deadline.tv_nsec -= BILLION;
+   }
 
-      if (wpos > w->s.readPos) bytes = wpos - w->s.readPos;
-      else                     bytes = w->s.bufSize - w->s.readPos;
+   w = &wfRx[gpio];
 
-      if (bytes > bufSize) bytes = bufSize;
+   status = 0;
+   timedOut = 0;
 
-      /* copy in multiples of the data size in bytes */
+   wfRx_lock(gpio);
 
-      bytes = (bytes / w->s.bytes) * w->s.bytes;
+   w->s.waiters++;
 
-      if (buf) memcpy(buf, w->s.buf+w->s.readPos, bytes);
+   while (w->mode == PI_WFRX_SERIAL)
+   {
+      status = waveRxSerialReady(w, terminator);
 
-      w->s.readPos += bytes;
+      if (status || timedOut) break;
 
-      if (w->s.readPos >= w->s.bufSize) w->s.readPos = 0;
+      if (pthread_cond_timedwait(&w->cond, &w->mutex, &deadline) == ETIMEDOUT)
+         timedOut = 1;
    }
-   return bytes;
-}
 
+   /* a close and reopen while waiting has already cleared it */
+
+   if (w->s.waiters) w->s.waiters--;
+
+   if (w->mode != PI_WFRX_SERIAL) status = PI_NOT_SERIAL_GPIO;
+
+   wfRx_unlock(gpio);
+
+   return status;
+}
 
 /*-------------------------------------------------------------------------*/
 
@@ -11581,14 +18177,23 @@ int gpioSerialReadClose(unsigned gpio)
 
       case PI_WFRX_SERIAL:
 
-         free(wfRx[gpio].s.buf);
+         serialRxBits &= ~(1<<gpio);
+
+         monitorBits = alertBits | serialRxBits | notifyBits | scriptBits |
+            gpioGetSamples.bits;
 
-         gpioSetWatchdog(gpio, 0); /* switch off timeouts */
+         /* waiters wake and see the GPIO has closed */
 
-         gpioSetAlertFunc(gpio, NULL); /* cancel alert */
+         wfRx_lock(gpio);
+
+         free(wfRx[gpio].s.buf);
 
          wfRx[gpio].mode = PI_WFRX_NONE;
 
+         pthread_cond_broadcast(&wfRx[gpio].cond);
+
+         wfRx_unlock(gpio);
+
          break;
    }
 
@@ -11671,6 +18276,26 @@ int eventMonitor(unsigned handle, uint32_t bits)
 }
 
 
+/* ----------------------------------------------------------------------- */
+
+int serialMonitor(unsigned handle, uint32_t bits)
+{
+   DBG(DBG_USER, "handle=%d bits=%08X", handle, bits);
+
+   CHECK_INITED;
+
+   if (handle >= PI_NOTIFY_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   if (gpioNotify[handle].state <= PI_NOTIFY_CLOSING)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+   gpioNotify[handle].serialBits = bits;
+
+   return 0;
+}
+
+
 /* ----------------------------------------------------------------------- */
 
 int eventTrigger(unsigned event)
@@ -11713,7 +18338,8 @@ static int intGpioSetAlertFunc(
       alertBits &= ~BIT;
    }
 
-   monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits;
+   monitorBits = alertBits | serialRxBits | notifyBits | scriptBits |
+      gpioGetSamples.bits;
 
    return 0;
 }
@@ -11752,71 +18378,332 @@ int gpioSetAlertFuncEx(unsigned gpio, gpioAlertFuncEx_t f, void *userdata)
    return 0;
 }
 
-static void *pthISRThread(void *x)
+static void isrCallback(
+   unsigned gpio, int count, int *level, uint32_t *tick)
 {
-   gpioISR_t *isr = x;
-   int fd;
-   int retval;
-   uint32_t tick;
-   int level;
-   uint32_t levels;
-   struct pollfd pfd;
+   /* called, and returns, with isrMutex held */
+
+   gpioISR_t *isr;
+   callbk_t func;
+   unsigned ex;
+   void *userdata;
+   int i;
+
+   isr = &gpioISR[gpio];
+
+   func     = isr->func;
+   ex       = isr->ex;
+   userdata = isr->userdata;
+
+   isrActive = gpio;
+
+   pthread_mutex_unlock(&isrMutex);
+
+   for (i=0; i<count; i++)
+   {
+      if (ex) (func)(gpio, level[i], tick[i], userdata);
+      else    (func)(gpio, level[i], tick[i]);
+   }
+
+   pthread_mutex_lock(&isrMutex);
+
+   isrActive = -1;
+
+   pthread_cond_broadcast(&isrIdle);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int isrRead(
+   gpioISR_t *isr, uint32_t *levels, uint32_t nowTick, uint64_t nowNanos,
+   int *level, uint32_t *tick)
+{
+   /* consumes the interrupts pending on a GPIO, returns their number */
+
    char buf[64];
+   int i, count;
+
+#ifdef GPIO_V2_GET_LINE_IOCTL
+   struct gpio_v2_line_event event[ISR_EVENTS];
+
+   if (isr->inited == ISR_CHARDEV)
+   {
+      /* a batch of edges, each with its kernel timestamp */
+
+      count = read(isr->fd, event, sizeof(event));
+
+      if (count < 0) return 0;
+
+      count /= sizeof(event[0]);
+
+      for (i=0; i<count; i++)
+      {
+         if (event[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE) level[i] = PI_ON;
+         else                                               level[i] = PI_OFF;
+
+         tick[i] = nowTick - (nowNanos - event[i].timestamp_ns) / THOUSAND;
+      }
+
+      return count;
+   }
+#endif
+
+   lseek(isr->fd, 0, SEEK_SET);    /* consume interrupt */
+   if (read(isr->fd, buf, sizeof buf) == -1) { /* ignore errors */ }
+
+   if (levels[isr->gpio >> 5] & (1<<(isr->gpio & 0x1F))) level[0] = PI_ON;
+   else                                                  level[0] = PI_OFF;
+
+   tick[0] = nowTick;
 
-   DBG(DBG_USER, "gpio=%d edge=%d timeout=%d f=%"PRIxPTR" u=%d data=%"PRIxPTR,
-      isr->gpio, isr->edge, isr->timeout, (uintptr_t)isr->func,
-      isr->ex, (uintptr_t)isr->userdata);
+   return 1;
+}
+
+/* ----------------------------------------------------------------------- */
 
-   sprintf(buf, "/sys/class/gpio/gpio%d/value", isr->gpio);
+static void *pthISRThread(void *x)
+{
+   struct epoll_event ev[ISR_EVENTS];
+   struct timespec ts;
+   eventfd_t wakes;
+   uint64_t bits, now, nowNanos, wait;
+   uint32_t levels[2], tick[ISR_EVENTS], nowTick;
+   int level[ISR_EVENTS];
+   int i, n, gpio, count, timeout;
 
-   isr->fd = -1; /* no fd assigned */
+   pthread_mutex_lock(&isrMutex);
 
-   if ((fd = open(buf, O_RDONLY)) < 0)
+   while (!isrStop)
    {
-      DBG(DBG_ALWAYS, "gpio %d not exported", isr->gpio);
-      return NULL;
+      /* wait no longer than the nearest interrupt timeout */
+
+      now = timerMicros();
+
+      timeout = -1;
+
+      for (bits=isrBits; bits; bits&=(bits-1))
+      {
+         gpio = __builtin_ctzll(bits);
+
+         if (gpioISR[gpio].timeout > 0)
+         {
+            if (gpioISR[gpio].deadline > now)
+               wait = (gpioISR[gpio].deadline - now + 999) / THOUSAND;
+            else
+               wait = 0;
+
+            if ((timeout < 0) || (wait < timeout)) timeout = wait;
+         }
+      }
+
+      pthread_mutex_unlock(&isrMutex);
+
+      n = epoll_wait(fdISR, ev, ISR_EVENTS, timeout);
+
+      nowTick = systReg[SYST_CLO];
+
+      levels[0] = *(gpioReg + GPLEV0);
+      levels[1] = *(gpioReg + GPLEV1);
+
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+
+      nowNanos = ((uint64_t)ts.tv_sec * THOUSAND * MILLION) + ts.tv_nsec;
+      now = nowNanos / THOUSAND;
+
+      pthread_mutex_lock(&isrMutex);
+
+      for (i=0; i<n; i++)
+      {
+         gpio = ev[i].data.u32;
+
+         if (gpio == ISR_WAKE)
+         {
+            eventfd_read(fdISRWake, &wakes);
+            continue;
+         }
+
+         /* skip a GPIO whose ISR was cancelled since the wait */
+
+         if (!(isrBits & (1ULL<<gpio)) || (gpioISR[gpio].fd < 0)) continue;
+
+         count = isrRead(&gpioISR[gpio], levels, nowTick, nowNanos,
+            level, tick);
+
+         gpioISR[gpio].deadline =
+            now + (uint64_t)gpioISR[gpio].timeout * THOUSAND;
+
+         if (count) isrCallback(gpio, count, level, tick);
+      }
+
+      for (bits=isrBits; bits; bits&=(bits-1))
+      {
+         gpio = __builtin_ctzll(bits);
+
+         /* an earlier callback may have cancelled the ISR */
+
+         if (!(isrBits & (1ULL<<gpio))) continue;
+
+         if ((gpioISR[gpio].timeout > 0) && (gpioISR[gpio].deadline <= now))
+         {
+            gpioISR[gpio].deadline =
+            now + (uint64_t)gpioISR[gpio].timeout * THOUSAND;
+
+            level[0] = PI_TIMEOUT;
+            tick[0] = nowTick;
+
+            isrCallback(gpio, 1, level, tick);
+         }
+      }
    }
 
-   isr->fd = fd; /* store fd so it can be closed */
+   pthread_mutex_unlock(&isrMutex);
 
-   pfd.fd = fd;
+   return NULL;
+}
+
+/* ----------------------------------------------------------------------- */
 
-   pfd.events = POLLPRI;
+static int isrServiceStart(void)
+{
+   /* one thread waits on the interrupts of every ISR GPIO */
+
+   pthread_attr_t pthAttr;
+   struct epoll_event ev;
 
-   lseek(fd, 0, SEEK_SET);    /* consume any prior interrupt */
-   if (read(fd, buf, sizeof buf) == -1) { /* ignore errors */ }
+   if (pthISRRunning != PI_THREAD_NONE) return 0;
 
-   while (1)
+   if (fdISR < 0) fdISR = epoll_create1(EPOLL_CLOEXEC);
+
+   if (fdISR < 0) return -1;
+
+   if (fdISRWake >= 0) close(fdISRWake);
+
+   fdISRWake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+   if (fdISRWake < 0) return -1;
+
+   ev.events = EPOLLIN;
+   ev.data.u64 = 0;
+   ev.data.u32 = ISR_WAKE;
+
+   if (epoll_ctl(fdISR, EPOLL_CTL_ADD, fdISRWake, &ev)) return -1;
+
+   if (pthread_attr_init(&pthAttr)) return -1;
+
+   if (pthread_attr_setstacksize(&pthAttr, STACK_SIZE)) return -1;
+
+   if (pthread_create(&pthISR, &pthAttr, pthISRThread, NULL)) return -1;
+
+   pthISRRunning = PI_THREAD_RUNNING;
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int isrServiceAdd(unsigned gpio, int fd, uint32_t events)
+{
+   struct epoll_event ev;
+
+   ev.events = events;
+   ev.data.u64 = 0;
+   ev.data.u32 = gpio;
+
+   return epoll_ctl(fdISR, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void isrServiceRemove(unsigned gpio)
+{
+   if (gpioISR[gpio].fd >= 0)
    {
-      retval = poll(&pfd, 1, isr->timeout); /* wait for interrupt */
+      epoll_ctl(fdISR, EPOLL_CTL_DEL, gpioISR[gpio].fd, NULL);
+      close(gpioISR[gpio].fd);
+      gpioISR[gpio].fd = -1;
+   }
+}
+
+/* ----------------------------------------------------------------------- */
+
+#ifdef GPIO_V2_GET_LINE_IOCTL
+
+static int isrChipOpen(void)
+{
+   /* the BCM GPIO chip, or the one named by PIGPIO_GPIOCHIP */
+
+   struct gpiochip_info info;
+   glob_t chips;
+   char *name;
+   int i, fd;
 
-      tick = systReg[SYST_CLO];
+   if (fdGpioChip >= 0) return 0;
 
-      levels = *(gpioReg + GPLEV0);
+   name = getenv(PI_ENVCHIP);
 
-      if (retval >= 0)
+   if (name)
+   {
+      fdGpioChip = open(name, O_RDWR | O_CLOEXEC);
+   }
+   else if (glob("/dev/gpiochip*", 0, NULL, &chips) == 0)
+   {
+      for (i=0; i<chips.gl_pathc; i++)
       {
-         lseek(fd, 0, SEEK_SET);    /* consume interrupt */
-         if (read(fd, buf, sizeof buf) == -1) { /* ignore errors */ }
+         fd = open(chips.gl_pathv[i], O_RDWR | O_CLOEXEC);
+
+         if (fd < 0) continue;
 
-         if (retval)
+         if ((ioctl(fd, GPIO_GET_CHIPINFO_IOCTL, &info) == 0) &&
+            (strncmp(info.label, "pinctrl-bcm", 11) == 0))
          {
-            if (levels & (1<<isr->gpio)) level = PI_ON; else level = PI_OFF;
+            fdGpioChip = fd;
+            break;
          }
-         else level = PI_TIMEOUT;
 
-         if (isr->ex) (isr->func)(isr->gpio, level, tick, isr->userdata);
-         else         (isr->func)(isr->gpio, level, tick);
-      }
-   }
+         close(fd);
+      }
+
+      globfree(&chips);
+   }
+
+   if (fdGpioChip < 0) return -1;
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int isrLineRequest(unsigned gpio, unsigned edge)
+{
+   struct gpio_v2_line_request req;
+
+   memset(&req, 0, sizeof(req));
+
+   req.offsets[0] = gpio;
+   req.num_lines = 1;
+
+   strcpy(req.consumer, "pigpio");
+
+   req.config.flags = GPIO_V2_LINE_FLAG_INPUT;
+
+   if (edge != FALLING_EDGE)
+      req.config.flags |= GPIO_V2_LINE_FLAG_EDGE_RISING;
+
+   if (edge != RISING_EDGE)
+      req.config.flags |= GPIO_V2_LINE_FLAG_EDGE_FALLING;
+
+   if (ioctl(fdGpioChip, GPIO_V2_GET_LINE_IOCTL, &req) < 0) return -1;
 
-   return NULL;
+   fcntl(req.fd, F_SETFL, O_NONBLOCK);
+
+   return req.fd;
 }
 
+#endif
 
 /* ----------------------------------------------------------------------- */
 
-static int intGpioSetISRFunc(
+static int intISRSet(
    unsigned gpio,
    unsigned edge,
    int timeout,
@@ -11824,92 +18711,135 @@ static int intGpioSetISRFunc(
    int user,
    void *userdata)
 {
+   /* called with isrMutex held */
+
    char buf[64];
 
    char *edge_str[]={"rising\n", "falling\n", "both\n"};
    int fd;
    int err;
 
-   DBG(DBG_INTERNAL,
-      "gpio=%d edge=%d timeout=%d function=%08"PRIXPTR" user=%d userdata=%08"PRIXPTR,
-      gpio, edge, timeout, (uintptr_t)f, user, (uintptr_t)userdata);
-
    if (f)
    {
-      if (!gpioISR[gpio].inited) /* export gpio if unexported */
+      if (!gpioISR[gpio].inited)
       {
-         fd = open("/sys/class/gpio/export", O_WRONLY);
-         if (fd < 0) return PI_BAD_ISR_INIT;
+         if (isrServiceStart()) return PI_BAD_ISR_INIT;
 
-         /* ignore write fail if already exported */
-         sprintf(buf, "%d\n", gpio);
-         err = write(fd, buf, strlen(buf));
-         close(fd);
+         if (gpioCfg.internals & PI_CFG_ISR_CHARDEV)
+         {
+#ifdef GPIO_V2_GET_LINE_IOCTL
+            if (isrChipOpen()) return PI_BAD_ISR_INIT;
 
-         sprintf(buf, "/sys/class/gpio/gpio%d/direction", gpio);
-         fd = open(buf, O_WRONLY);
-         if (fd < 0) return PI_BAD_ISR_INIT;
+            gpioISR[gpio].inited = ISR_CHARDEV;
+#else
+            return PI_BAD_ISR_INIT;
+#endif
+         }
+         else /* export gpio if unexported */
+         {
+            fd = open("/sys/class/gpio/export", O_WRONLY);
+            if (fd < 0) return PI_BAD_ISR_INIT;
 
-         err = write(fd, "in\n", 3);
-         close(fd);
-         if (err != 3) return PI_BAD_ISR_INIT;
+            /* ignore write fail if already exported */
+            sprintf(buf, "%d\n", gpio);
+            err = write(fd, buf, strlen(buf));
+            close(fd);
+
+            sprintf(buf, "/sys/class/gpio/gpio%d/direction", gpio);
+            fd = open(buf, O_WRONLY);
+            if (fd < 0) return PI_BAD_ISR_INIT;
+
+            err = write(fd, "in\n", 3);
+            close(fd);
+            if (err != 3) return PI_BAD_ISR_INIT;
+
+            gpioISR[gpio].inited = ISR_SYSFS;
+         }
 
          gpioISR[gpio].gpio = gpio;
          gpioISR[gpio].edge = -1;
          gpioISR[gpio].timeout = -1;
-
-         gpioISR[gpio].inited = 1;
+         gpioISR[gpio].fd = -1;
       }
 
       if (gpioISR[gpio].edge != edge)
       {
-         sprintf(buf, "/sys/class/gpio/gpio%d/edge", gpio);
-         fd = open(buf, O_WRONLY);
-         if (fd < 0) return PI_BAD_ISR_INIT;
+#ifdef GPIO_V2_GET_LINE_IOCTL
+         if (gpioISR[gpio].inited == ISR_CHARDEV)
+         {
+            /* the edges are fixed when the line is requested */
 
-         err = write(fd, edge_str[edge], strlen(edge_str[edge]));
-         close(fd);
-         if (err != strlen(edge_str[edge])) return PI_BAD_ISR_INIT;
+            isrServiceRemove(gpio);
 
-         gpioISR[gpio].edge = edge;
+            fd = isrLineRequest(gpio, edge);
+            if (fd < 0) return PI_BAD_ISR_INIT;
+
+            gpioISR[gpio].fd = fd;
+
+            if (isrServiceAdd(gpio, fd, EPOLLIN)) return PI_BAD_ISR_INIT;
+         }
+         else
+#endif
+         {
+            sprintf(buf, "/sys/class/gpio/gpio%d/edge", gpio);
+            fd = open(buf, O_WRONLY);
+            if (fd < 0) return PI_BAD_ISR_INIT;
+
+            err = write(fd, edge_str[edge], strlen(edge_str[edge]));
+            close(fd);
+            if (err != strlen(edge_str[edge])) return PI_BAD_ISR_INIT;
+
+            if (gpioISR[gpio].fd < 0)
+            {
+               sprintf(buf, "/sys/class/gpio/gpio%d/value", gpio);
+               fd = open(buf, O_RDONLY | O_CLOEXEC);
+               if (fd < 0) return PI_BAD_ISR_INIT;
+
+               gpioISR[gpio].fd = fd;
+
+               lseek(fd, 0, SEEK_SET);    /* consume any prior interrupt */
+               if (read(fd, buf, sizeof buf) == -1) { /* ignore errors */ }
+
+               if (isrServiceAdd(gpio, fd, EPOLLPRI | EPOLLERR))
+                  return PI_BAD_ISR_INIT;
+            }
+         }
 
-         if (gpioISR[gpio].pth != NULL)
-            pthread_kill(*gpioISR[gpio].pth, SIGCHLD);
+         gpioISR[gpio].edge = edge;
       }
 
       if (timeout <= 0) timeout = -1;
-      if (gpioISR[gpio].timeout != timeout)
-      {
-         gpioISR[gpio].timeout = timeout;
+      else gpioISR[gpio].deadline = timerMicros() + (uint64_t)timeout * THOUSAND;
 
-         if (gpioISR[gpio].pth != NULL)
-            pthread_kill(*gpioISR[gpio].pth, SIGCHLD);
-      }
+      gpioISR[gpio].timeout = timeout;
 
       gpioISR[gpio].func = f;
       gpioISR[gpio].ex = user;
       gpioISR[gpio].userdata = userdata;
 
-      if (gpioISR[gpio].pth == NULL)
-         gpioISR[gpio].pth = gpioStartThread(pthISRThread, &gpioISR[gpio]);
+      isrBits |= (1ULL<<gpio);
+
+      /* the wait may need a nearer timeout */
+
+      eventfd_write(fdISRWake, 1);
    }
-   else /* null function, delete ISR, unexport gpio */
+   else /* null function, delete ISR, release gpio */
    {
-      if (gpioISR[gpio].pth) /* delete any existing ISR */
-      {
-         gpioStopThread(gpioISR[gpio].pth);
+      isrBits &= ~(1ULL<<gpio);
 
-         if (gpioISR[gpio].fd >= 0)
-         {
-            close(gpioISR[gpio].fd);
-            gpioISR[gpio].fd = -1;
-         }
+      gpioISR[gpio].func = NULL;
 
-         gpioISR[gpio].func = NULL;
-         gpioISR[gpio].pth = NULL;
+      isrServiceRemove(gpio);
+
+      /* a callback may not run after its ISR is cancelled */
+
+      if (!pthread_equal(pthread_self(), pthISR))
+      {
+         while (isrActive == gpio)
+            pthread_cond_wait(&isrIdle, &isrMutex);
       }
 
-      if (gpioISR[gpio].inited) /* unexport the gpio */
+      if (gpioISR[gpio].inited == ISR_SYSFS) /* unexport the gpio */
       {
          fd = open("/sys/class/gpio/unexport", O_WRONLY);
          if (fd < 0) return PI_BAD_ISR_INIT;
@@ -11917,8 +18847,9 @@ static int intGpioSetISRFunc(
          err = write(fd, buf, strlen(buf));
          close(fd);
          if (err != strlen(buf)) return PI_BAD_ISR_INIT;
-         gpioISR[gpio].inited = 0;
       }
+
+      gpioISR[gpio].inited = 0;
    }
 
    return 0;
@@ -11926,6 +18857,31 @@ static int intGpioSetISRFunc(
 
 /* ----------------------------------------------------------------------- */
 
+static int intGpioSetISRFunc(
+   unsigned gpio,
+   unsigned edge,
+   int timeout,
+   void *f,
+   int user,
+   void *userdata)
+{
+   int status;
+
+   DBG(DBG_INTERNAL,
+      "gpio=%d edge=%d timeout=%d function=%08"PRIXPTR" user=%d userdata=%08"PRIXPTR,
+      gpio, edge, timeout, (uintptr_t)f, user, (uintptr_t)userdata);
+
+   pthread_mutex_lock(&isrMutex);
+
+   status = intISRSet(gpio, edge, timeout, f, user, userdata);
+
+   pthread_mutex_unlock(&isrMutex);
+
+   return status;
+}
+
+/* ----------------------------------------------------------------------- */
+
 int gpioSetISRFunc(
    unsigned gpio,
    unsigned edge,
@@ -12052,6 +19008,8 @@ int gpioNotifyOpenWithSize(int bufSize)
 
    gpioNotify[slot].seqno = 0;
    gpioNotify[slot].bits  = 0;
+   gpioNotify[slot].serialBits = 0;
+   gpioNotify[slot].acqBits = 0;
    gpioNotify[slot].fd    = fd;
    gpioNotify[slot].pipe  = 1;
    gpioNotify[slot].max_emits  = MAX_EMITS;
@@ -12098,6 +19056,8 @@ static int gpioNotifyOpenInBand(int fd)
 
    gpioNotify[slot].seqno = 0;
    gpioNotify[slot].bits  = 0;
+   gpioNotify[slot].serialBits = 0;
+   gpioNotify[slot].acqBits = 0;
    gpioNotify[slot].fd    = fd;
    gpioNotify[slot].pipe  = 0;
    gpioNotify[slot].max_emits  = MAX_EMITS;
@@ -12129,7 +19089,8 @@ static void intScriptBits(void)
 
    scriptBits = bits;
 
-   monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits;
+   monitorBits = alertBits | serialRxBits | notifyBits | scriptBits |
+      gpioGetSamples.bits;
 }
 
 
@@ -12169,7 +19130,8 @@ static void intNotifyBits(void)
 
    notifyBits = bits;
 
-   monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits;
+   monitorBits = alertBits | serialRxBits | notifyBits | scriptBits |
+      gpioGetSamples.bits;
 }
 
 
@@ -12392,7 +19354,8 @@ int gpioSetGetSamplesFunc(gpioGetSamplesFunc_t f, uint32_t bits)
    if (f) gpioGetSamples.bits = bits;
    else   gpioGetSamples.bits = 0;
 
-   monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits;
+   monitorBits = alertBits | serialRxBits | notifyBits | scriptBits |
+      gpioGetSamples.bits;
 
    return 0;
 }
@@ -12415,7 +19378,8 @@ int gpioSetGetSamplesFuncEx(gpioGetSamplesFuncEx_t f,
    if (f) gpioGetSamples.bits = bits;
    else   gpioGetSamples.bits = 0;
 
-   monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits;
+   monitorBits = alertBits | serialRxBits | notifyBits | scriptBits |
+      gpioGetSamples.bits;
 
    return 0;
 }
@@ -12423,69 +19387,123 @@ int gpioSetGetSamplesFuncEx(gpioGetSamplesFuncEx_t f,
 
 /* ----------------------------------------------------------------------- */
 
-static int intGpioSetTimerFunc(unsigned id,
-                               unsigned millis,
-                               void *f,
-                               int user,
-                               void *userdata)
+static int intTimerStart(
+   uint32_t delay, uint32_t period, void *f, int user, void *userdata)
 {
    pthread_attr_t pthAttr;
+   gpioTimer_t *t;
+   uint64_t now, next;
+   int handle;
 
-   DBG(DBG_INTERNAL, "id=%d millis=%d function=%08"PRIXPTR" user=%d userdata=%08"PRIXPTR,
-      id, millis, (uintptr_t)f, user, (uintptr_t)userdata);
+   pthread_mutex_lock(&timerMutex);
 
-   gpioTimer[id].id   = id;
+   for (handle=0; handle<PI_TIMER_SLOTS; handle++)
+   {
+      if (!gpioTimer[handle].used) break;
+   }
 
-   if (f)
+   if (handle >= PI_TIMER_SLOTS)
    {
-      gpioTimer[id].func     = f;
-      gpioTimer[id].ex       = user;
-      gpioTimer[id].userdata = userdata;
-      gpioTimer[id].millis   = millis;
+      pthread_mutex_unlock(&timerMutex);
+      SOFT_ERROR(PI_NO_HANDLE, "no timer handles");
+   }
 
-      if (!gpioTimer[id].running)
+   if (pthTimerRunning == PI_THREAD_NONE)
+   {
+      if (pthread_attr_init(&pthAttr) ||
+          pthread_attr_setstacksize(&pthAttr, STACK_SIZE) ||
+          pthread_create(&pthTimer, &pthAttr, pthTimerTick, NULL))
       {
-         if (pthread_attr_init(&pthAttr))
-            SOFT_ERROR(PI_TIMER_FAILED,
-               "pthread_attr_init failed (%m)");
+         pthread_mutex_unlock(&timerMutex);
+         SOFT_ERROR(PI_TIMER_FAILED, "timer thread create failed (%m)");
+      }
+
+      pthTimerRunning = PI_THREAD_RUNNING;
+   }
 
-         if (pthread_attr_setstacksize(&pthAttr, STACK_SIZE))
-            SOFT_ERROR(PI_TIMER_FAILED,
-               "pthread_attr_setstacksize failed (%m)");
+   now = timerMicros();
 
-         if (pthread_create(
-            &gpioTimer[id].pthId, &pthAttr, pthTimerTick, &gpioTimer[id]))
-               SOFT_ERROR(PI_TIMER_FAILED,
-                  "timer %d, create failed (%m)", id);
+   /* an empty wheel may jump to the present */
 
-         gpioTimer[id].running = 1;
-      }
+   if (!timerNext(&next) && (timerNow < now)) timerNow = now;
+
+   t = &gpioTimer[handle];
+
+   t->func     = f;
+   t->ex       = user;
+   t->userdata = userdata;
+   t->expiry   = now + delay;
+   t->period   = period;
+   t->used     = 1;
+
+   timerInsert(t);
+
+   if (t->expiry < timerSleep) pthread_cond_signal(&timerCond);
+
+   pthread_mutex_unlock(&timerMutex);
+
+   return handle;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int intTimerCancel(unsigned handle)
+{
+   pthread_mutex_lock(&timerMutex);
+
+   if (!gpioTimer[handle].used)
+   {
+      pthread_mutex_unlock(&timerMutex);
+      SOFT_ERROR(PI_BAD_HANDLE, "bad timer handle (%d)", handle);
    }
-   else
+
+   timerUnlink(&gpioTimer[handle]);
+
+   /*
+   A callback may not run after its timer is cancelled.  A running
+   callback's slot is freed by the timer thread once it returns,
+   so it can't be reused meanwhile.
+   */
+
+   if (timerActive != handle) gpioTimer[handle].used = 0;
+   else if (!pthread_equal(pthread_self(), pthTimer))
    {
-      if (gpioTimer[id].running)
-      {
+      while (timerActive == handle)
+         pthread_cond_wait(&timerIdle, &timerMutex);
+   }
 
-         /* destroy thread */
+   pthread_mutex_unlock(&timerMutex);
 
-         if (pthread_self() == gpioTimer[id].pthId)
-         {
-            gpioTimer[id].running = 0;
-            gpioTimer[id].func    = 0;
-            pthread_exit(NULL);
-         }
-         else
-         {
-            if (pthread_cancel(gpioTimer[id].pthId))
-               SOFT_ERROR(PI_TIMER_FAILED, "timer %d, cancel failed (%m)", id);
+   return 0;
+}
 
-            if (pthread_join(gpioTimer[id].pthId, NULL))
-               SOFT_ERROR(PI_TIMER_FAILED, "timer %d, join failed (%m)", id);
+/* ----------------------------------------------------------------------- */
 
-            gpioTimer[id].running = 0;
-            gpioTimer[id].func    = 0;
-         }
-      }
+static int intGpioSetTimerFunc(unsigned id,
+                               unsigned millis,
+                               void *f,
+                               int user,
+                               void *userdata)
+{
+   int handle;
+
+   DBG(DBG_INTERNAL, "id=%d millis=%d function=%08"PRIXPTR" user=%d userdata=%08"PRIXPTR,
+      id, millis, (uintptr_t)f, user, (uintptr_t)userdata);
+
+   if (gpioTimerId[id] >= 0)
+   {
+      intTimerCancel(gpioTimerId[id]);
+      gpioTimerId[id] = -1;
+   }
+
+   if (f)
+   {
+      handle = intTimerStart(millis * THOUSAND, millis * THOUSAND,
+         f, user, userdata);
+
+      if (handle < 0) return handle;
+
+      gpioTimerId[id] = handle;
    }
 
    return 0;
@@ -12509,9 +19527,7 @@ int gpioSetTimerFunc(unsigned id, unsigned millis, gpioTimerFunc_t f)
          SOFT_ERROR(PI_BAD_MS, "timer %d, bad millis (%d)", id, millis);
    }
 
-   intGpioSetTimerFunc(id, millis, f, 0, NULL);
-
-   return 0;
+   return intGpioSetTimerFunc(id, millis, f, 0, NULL);
 }
 
 
@@ -12531,9 +19547,43 @@ int gpioSetTimerFuncEx(unsigned id, unsigned millis, gpioTimerFuncEx_t f,
    if ((millis < PI_MIN_MS) || (millis > PI_MAX_MS))
       SOFT_ERROR(PI_BAD_MS, "timer %d, bad millis (%d)", id, millis);
 
-   intGpioSetTimerFunc(id, millis, f, 1, userdata);
+   return intGpioSetTimerFunc(id, millis, f, 1, userdata);
+}
+
+/* ----------------------------------------------------------------------- */
 
-   return 0;
+int gpioTimerStart(
+   unsigned delay, unsigned period, gpioTimerFuncEx_t f, void *userdata)
+{
+   DBG(DBG_USER, "delay=%d period=%d function=%08"PRIXPTR", userdata=%08"PRIXPTR,
+      delay, period, (uintptr_t)f, (uintptr_t)userdata);
+
+   CHECK_INITED;
+
+   if (delay > PI_MAX_TIMER_MICROS)
+      SOFT_ERROR(PI_BAD_TIMER_MICROS, "bad delay (%d)", delay);
+
+   if (period &&
+      ((period < PI_MIN_TIMER_PERIOD) || (period > PI_MAX_TIMER_MICROS)))
+         SOFT_ERROR(PI_BAD_TIMER_MICROS, "bad period (%d)", period);
+
+   if (!f) SOFT_ERROR(PI_BAD_PARAM, "no function");
+
+   return intTimerStart(delay, period, f, 1, userdata);
+}
+
+/* ----------------------------------------------------------------------- */
+
+int gpioTimerCancel(unsigned handle)
+{
+   DBG(DBG_USER, "handle=%d", handle);
+
+   CHECK_INITED;
+
+   if (handle >= PI_TIMER_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad timer handle (%d)", handle);
+
+   return intTimerCancel(handle);
 }
 
 /* ----------------------------------------------------------------------- */
@@ -12632,6 +19682,12 @@ int gpioStoreScript(char *script)
 
    if (status == 0)
    {
+      if (!(gpioCfg.internals & PI_CFG_NOSCRIPTOPT))
+         cmdOptimiseScript(&s->script);
+
+      s->profile = 0;
+      s->prof = NULL;
+
       s->request   = PI_SCRIPT_HALT;
       s->run_state = PI_SCRIPT_INITING;
 
@@ -12763,6 +19819,92 @@ int gpioScriptStatus(unsigned script_id, uint32_t *param)
 }
 
 
+/* ----------------------------------------------------------------------- */
+
+int gpioScriptProfile(unsigned script_id, unsigned enable)
+{
+   gpioScript_t *s;
+   cmdInstr_t *instr;
+   int i;
+
+   DBG(DBG_USER, "script_id=%d enable=%d", script_id, enable);
+
+   CHECK_INITED;
+
+   if (script_id >= PI_MAX_SCRIPTS)
+      SOFT_ERROR(PI_BAD_SCRIPT_ID, "bad script id(%d)", script_id);
+
+   s = &gpioScript[script_id];
+
+   if (s->state != PI_SCRIPT_IN_USE) return PI_BAD_SCRIPT_ID;
+
+   if (enable)
+   {
+      if (s->prof == NULL)
+      {
+         s->prof = calloc(s->script.instrs + 1, sizeof(gpioScriptProf_t));
+
+         if (s->prof == NULL)
+            SOFT_ERROR(PI_NO_MEMORY, "can't allocate script profile");
+
+         for (i=0; i<s->script.instrs; i++)
+         {
+            instr = &s->script.instr[i];
+
+            s->prof[i].cmd  = instr->p[0];
+            s->prof[i].p1   = instr->p[1];
+            s->prof[i].p2   = instr->p[2];
+            s->prof[i].opt1 = (instr->opt[1] > 0) ? instr->opt[1] : 0;
+            s->prof[i].opt2 = (instr->opt[2] > 0) ? instr->opt[2] : 0;
+         }
+      }
+      else
+      {
+         for (i=0; i<s->script.instrs; i++)
+         {
+            s->prof[i].count = 0;
+            s->prof[i].micros = 0;
+         }
+      }
+   }
+
+   s->profile = enable ? 1 : 0;
+
+   return 0;
+}
+
+
+/* ----------------------------------------------------------------------- */
+
+int gpioScriptProfileRead(
+   unsigned script_id, unsigned start, unsigned count, gpioScriptProf_t *prof)
+{
+   gpioScript_t *s;
+
+   DBG(DBG_USER, "script_id=%d start=%d count=%d prof=%08"PRIXPTR,
+      script_id, start, count, (uintptr_t)prof);
+
+   CHECK_INITED;
+
+   if (script_id >= PI_MAX_SCRIPTS)
+      SOFT_ERROR(PI_BAD_SCRIPT_ID, "bad script id(%d)", script_id);
+
+   s = &gpioScript[script_id];
+
+   if (s->state != PI_SCRIPT_IN_USE) return PI_BAD_SCRIPT_ID;
+
+   if (s->prof == NULL) return PI_NO_SCRIPT_PROF;
+
+   if (start >= s->script.instrs) return 0;
+
+   if (count > (s->script.instrs - start)) count = s->script.instrs - start;
+
+   memcpy(prof, s->prof + start, count * sizeof(gpioScriptProf_t));
+
+   return count;
+}
+
+
 /* ----------------------------------------------------------------------- */
 
 int gpioStopScript(unsigned script_id)
@@ -12830,6 +19972,10 @@ int gpioDeleteScript(unsigned script_id)
 
       gpioScript[script_id].script.par = NULL;
 
+      if (gpioScript[script_id].prof) free(gpioScript[script_id].prof);
+
+      gpioScript[script_id].prof = NULL;
+
       gpioScript[script_id].state = PI_SCRIPT_FREE;
 
       return 0;
@@ -13923,6 +21069,37 @@ int gpioCfgDMAchannels(unsigned primaryChannel, unsigned secondaryChannel)
 }
 
 
+/* ----------------------------------------------------------------------- */
+
+int gpioCfgSPIDMA(unsigned txChannel, unsigned rxChannel, unsigned minBytes)
+{
+   DBG(DBG_USER, "txChannel=%d rxChannel=%d minBytes=%d",
+      txChannel, rxChannel, minBytes);
+
+   CHECK_NOT_INITED;
+
+   if (minBytes)
+   {
+      /* channel 15 is not in the DMA register block */
+
+      if ((txChannel >= PI_MAX_DMA_CHANNEL) ||
+          (rxChannel >= PI_MAX_DMA_CHANNEL) ||
+          (txChannel == rxChannel))
+         SOFT_ERROR(PI_BAD_SPI_DMA, "bad channels (%d/%d)",
+            txChannel, rxChannel);
+
+      if (minBytes > PI_MAX_SPI_DEVICE_COUNT)
+         SOFT_ERROR(PI_BAD_SPI_DMA, "bad minBytes (%d)", minBytes);
+   }
+
+   gpioCfg.spiDMATx    = txChannel;
+   gpioCfg.spiDMARx    = rxChannel;
+   gpioCfg.spiDMABytes = minBytes;
+
+   return 0;
+}
+
+
 /*-------------------------------------------------------------------------*/
 
 int gpioCfgPermissions(uint64_t updateMask)
@@ -13947,7 +21124,7 @@ int gpioCfgInterfaces(unsigned ifFlags)
 
    CHECK_NOT_INITED;
 
-   if (ifFlags > 15)
+   if (ifFlags > 31)
       SOFT_ERROR(PI_BAD_IF_FLAGS, "bad ifFlags (%X)", ifFlags);
 
    gpioCfg.ifFlags = ifFlags;
@@ -13991,6 +21168,29 @@ int gpioCfgMemAlloc(unsigned memAllocMode)
 
 /* ----------------------------------------------------------------------- */
 
+int gpioCfgWaveMemory(unsigned waveBlocks, unsigned maxWaves)
+{
+   DBG(DBG_USER, "waveBlocks=%d maxWaves=%d", waveBlocks, maxWaves);
+
+   CHECK_NOT_INITED;
+
+   if (waveSimOpen)
+      SOFT_ERROR(PI_BAD_WAVE_MEMORY, "wave simulator open");
+
+   if (waveBlocks > PI_MAX_WAVE_BLOCKS)
+      SOFT_ERROR(PI_BAD_WAVE_MEMORY, "bad wave blocks (%d)", waveBlocks);
+
+   if ((maxWaves < 1) || (maxWaves > PI_MAX_WAVE_IDS))
+      SOFT_ERROR(PI_BAD_WAVE_MEMORY, "bad max waves (%d)", maxWaves);
+
+   gpioCfg.waveBlocks = waveBlocks;
+   gpioCfg.maxWaves   = maxWaves;
+
+   return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
 int gpioCfgNetAddr(int numSockAddr, uint32_t *sockAddr)
 {
    int i;
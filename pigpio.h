@@ -175,6 +175,9 @@ gpioSetAlertFuncEx         Request a GPIO change callback, extended
 gpioSetTimerFunc           Request a regular timed callback
 gpioSetTimerFuncEx         Request a regular timed callback, extended
 
+gpioTimerStart             Start a one-shot or periodic timer
+gpioTimerCancel            Cancel a timer
+
 gpioStartThread            Start a new thread
 gpioStopThread             Stop a previously started thread
 
@@ -215,6 +218,7 @@ gpioCustom2                User custom function 2
 Events
 
 eventMonitor               Sets the events to monitor
+serialMonitor              Sets the bit bang serial data to stream
 eventSetFunc               Request an event callback
 eventSetFuncEx             Request an event callback, extended
 
@@ -228,6 +232,8 @@ gpioUpdateScript           Set a scripts parameters
 gpioScriptStatus           Get script status and parameters
 gpioStopScript             Stop a running script
 gpioDeleteScript           Delete a stored script
+gpioScriptProfile          Turn script profiling on or off
+gpioScriptProfileRead      Get a script's execution profile
 
 I2C
 
@@ -263,6 +269,10 @@ i2cSegments                Performs multiple I2C transactions
 
 i2cZip                     Performs multiple I2C transactions
 
+i2cBatch                   Performs a batch of I2C operations
+i2cBatchStart              Queues a batch of I2C operations
+i2cBatchWait               Waits for a queued batch to complete
+
 I2C_BIT_BANG
 
 bbI2COpen                  Opens GPIO for bit banging I2C
@@ -270,6 +280,8 @@ bbI2CClose                 Closes GPIO for bit banging I2C
 
 bbI2CZip                   Performs bit banged I2C transactions
 
+bbI2CStats                 Gets the achieved bit banged I2C bus frequency
+
 I2C/SPI_SLAVE
 
 bscXfer                    I2C/SPI as slave transfer
@@ -287,14 +299,22 @@ serWrite                   Writes bytes to a serial device
 
 serDataAvailable           Returns number of bytes ready to be read
 
+serReadBuffer              Buffers serial reads in a background thread
+serSetReadyFunc            Sets a function called when buffered data is ready
+
 SERIAL_BIT_BANG_(read_only)
 
 gpioSerialReadOpen         Opens a GPIO for bit bang serial reads
 gpioSerialReadClose        Closes a GPIO for bit bang serial reads
 
 gpioSerialReadInvert       Configures normal/inverted for serial reads
+gpioSerialReadParity       Configures the parity for serial reads
+gpioSerialReadErrors       Gets the framing and parity error counts
 
 gpioSerialRead             Reads bit bang serial data from a GPIO
+gpioSerialReadPeek         Gets the bit bang serial data in place
+gpioSerialReadCommit       Frees bit bang serial data got in place
+gpioSerialReadWait         Waits for bit bang serial data or a terminator
 
 SPI
 
@@ -304,14 +324,28 @@ spiClose                   Closes a SPI device
 spiRead                    Reads bytes from a SPI device
 spiWrite                   Writes bytes to a SPI device
 spiXfer                    Transfers bytes with a SPI device
+spiSegments                Transfers several segments in one message
+
+gpioSPISimOpen             Runs the main SPI in ordinary memory
+gpioSPISimStats            Gets the simulated DMA and CPU byte counts
+gpioSPISimClose            Ends SPI simulation
 
 SPI_BIT_BANG
 
 bbSPIOpen                  Opens GPIO for bit banging SPI
+bbSPIOpenLanes             Opens GPIO for parallel bit banging SPI
 bbSPIClose                 Closes GPIO for bit banging SPI
 
 bbSPIXfer                  Performs bit banged SPI transactions
 
+SENSOR_ACQUISITION
+
+acqStart                   Starts periodic reads of a sensor register
+acqStop                    Stops periodic reads of a sensor register
+
+acqRead                    Reads timestamped sensor samples
+acqMonitor                 Sets the sensor samples to stream
+
 FILES
 
 fileOpen                   Opens a file
@@ -331,10 +365,13 @@ gpioWaveClear              Deletes all waveforms
 gpioWaveAddNew             Starts a new waveform
 gpioWaveAddGeneric         Adds a series of pulses to the waveform
 gpioWaveAddSerial          Adds serial data to the waveform
+gpioWaveAddTrains          Adds many pulse trains to the waveform
+gpioWaveAddSerials         Adds many serial data lanes to the waveform
 
 gpioWaveCreate             Creates a waveform from added data
 gpioWaveCreatePad          Creates a waveform of fixed size from added data
 gpioWaveDelete             Deletes a waveform
+gpioWaveCompact            Defragments the waveform memory
 
 gpioWaveTxSend             Transmits a waveform
 
@@ -358,6 +395,23 @@ gpioWaveGetPulses          Length in pulses of the current waveform
 gpioWaveGetHighPulses      Length of longest waveform so far
 gpioWaveGetMaxPulses       Absolute maximum allowed pulses
 
+gpioWaveSlotCreate         Creates a double buffered waveform
+gpioWaveSlotTx             Transmits a double buffered waveform
+gpioWaveSlotUpdate         Changes pulses of the waveform's spare copy
+gpioWaveSlotSwap           Sends the spare copy from the next cycle
+gpioWaveSlotDelete         Deletes a double buffered waveform
+
+gpioWaveStreamOpen         Creates a ring for streaming pulses
+gpioWaveStreamWrite        Adds pulses to the stream
+gpioWaveStreamFlush        Commits a partly filled stream segment
+gpioWaveStreamTx           Starts transmitting the stream
+gpioWaveStreamStatus       Gets the stream's free space and underruns
+gpioWaveStreamClose        Stops the stream and frees its ring
+
+gpioWaveSimOpen            Builds waveforms in ordinary memory
+gpioWaveSimRun             Simulates the last waveform or chain sent
+gpioWaveSimClose           Ends waveform simulation
+
 UTILITIES
 
 gpioDelay                  Delay for a number of microseconds
@@ -382,10 +436,12 @@ gpioCfgBufferSize          Configure the GPIO sample buffer size
 gpioCfgClock               Configure the GPIO sample rate
 gpioCfgDMAchannel          Configure the DMA channel (DEPRECATED)
 gpioCfgDMAchannels         Configure the DMA channels
+gpioCfgSPIDMA              Configure DMA for large main SPI transfers
 gpioCfgPermissions         Configure the GPIO access permissions
 gpioCfgInterfaces          Configure user interfaces
 gpioCfgSocketPort          Configure socket port
 gpioCfgMemAlloc            Configure DMA memory allocation mode
+gpioCfgWaveMemory          Configure the wave memory and wave table size
 gpioCfgNetAddr             Configure allowed network addresses
 
 gpioCfgGetInternals        Get internal configuration settings
@@ -411,10 +467,13 @@ OVERVIEW*/
 
 #define PI_INPFIFO "/dev/pigpio"
 #define PI_OUTFIFO "/dev/pigout"
+#define PI_INPFIFO_BIN "/dev/pigbin"
+#define PI_OUTFIFO_BIN "/dev/pigbout"
 #define PI_ERRFIFO "/dev/pigerr"
 
 #define PI_ENVPORT "PIGPIO_PORT"
 #define PI_ENVADDR "PIGPIO_ADDR"
+#define PI_ENVCHIP "PIGPIO_GPIOCHIP"
 
 #define PI_LOCKFILE "/var/run/pigpio.pid"
 
@@ -458,6 +517,36 @@ typedef struct
    uint32_t usDelay;
 } gpioPulse_t;
 
+typedef struct
+{
+   uint32_t offset;      /* start of the train in micros from wave start */
+   uint32_t numPulses;
+   gpioPulse_t *pulses;
+} gpioPulseTrain_t;
+
+typedef struct
+{
+   uint32_t gpio;
+   uint32_t baud;
+   uint32_t data_bits;
+   uint32_t stop_bits;
+   uint32_t offset;      /* start of the data in micros from wave start */
+   uint32_t numBytes;
+   char    *str;
+} gpioSerialLane_t;
+
+typedef struct
+{
+   uint32_t cmd;    /* script step command */
+   uint32_t p1;     /* first parameter */
+   uint32_t p2;     /* second parameter */
+   uint8_t  opt1;   /* p1 is 0 none, 1 a number, 2 a var, 3 a par */
+   uint8_t  opt2;   /* p2 is 0 none, 1 a number, 2 a var, 3 a par */
+   uint16_t pad;
+   uint32_t count;  /* times the step was executed */
+   uint32_t micros; /* time spent blocked in the step */
+} gpioScriptProf_t;
+
 #define WAVE_FLAG_READ  1
 #define WAVE_FLAG_TICK  2
 
@@ -526,6 +615,30 @@ typedef struct
    uint8_t  *buf;  /* pointer to msg data */
 } pi_i2c_msg_t;
 
+typedef struct
+{
+   uint16_t handle; /* from i2cOpen              */
+   uint8_t  flags;  /* PI_I2C_OP_READ, _REG      */
+   uint8_t  reg;    /* register if PI_I2C_OP_REG */
+   uint16_t len;    /* bytes to read or write    */
+   char     *buf;   /* data read or to write     */
+   int      status; /* bytes transferred or error */
+} pi_i2c_op_t;
+
+typedef void (*i2cBatchFunc_t) (int id, int status, void *userdata);
+
+typedef void (*serReadyFunc_t) (int handle, int count, void *userdata);
+
+typedef struct
+{
+   char    *txBuf;    /* bytes to send, NULL sends zeros         */
+   char    *rxBuf;    /* bytes received, may be NULL             */
+   uint32_t len;      /* bytes to transfer                       */
+   uint16_t usDelay;  /* micros to wait after the segment        */
+   uint8_t  csChange; /* 1 deselects the device after the segment */
+   uint8_t  pad;
+} pi_spi_seg_t;
+
 /* BSC FIFO size */
 
 #define BSC_FIFO_SIZE 512
@@ -656,10 +769,14 @@ typedef void *(gpioThreadFunc_t) (void *);
 
 #define PI_NOTIFY_SLOTS  32
 
+#define PI_NTFY_FLAGS_END      (1<<12)
+#define PI_NTFY_FLAGS_ACQ      (1<<11)
+#define PI_NTFY_FLAGS_SER      (1 <<8)
 #define PI_NTFY_FLAGS_EVENT    (1 <<7)
 #define PI_NTFY_FLAGS_ALIVE    (1 <<6)
 #define PI_NTFY_FLAGS_WDOG     (1 <<5)
 #define PI_NTFY_FLAGS_BIT(x) (((x)<<0)&31)
+#define PI_NTFY_FLAGS_LEN(x) ((((x)-1)&3)<<9)
 
 #define PI_WAVE_BLOCKS     4
 #define PI_WAVE_MAX_PULSES (PI_WAVE_BLOCKS * 3000)
@@ -677,6 +794,12 @@ typedef void *(gpioThreadFunc_t) (void *);
 #define PI_BB_SER_NORMAL 0
 #define PI_BB_SER_INVERT 1
 
+#define PI_BB_SER_PARITY_NONE 0
+#define PI_BB_SER_PARITY_ODD  1
+#define PI_BB_SER_PARITY_EVEN 2
+
+#define PI_BB_SER_ANY 256
+
 #define PI_WAVE_MIN_BAUD      50
 #define PI_WAVE_MAX_BAUD 1000000
 
@@ -693,6 +816,11 @@ typedef void *(gpioThreadFunc_t) (void *);
 
 #define PI_MAX_WAVES 250
 
+#define PI_MAX_WAVE_BLOCKS 40
+#define PI_MAX_WAVE_IDS  2500
+
+#define PI_MAX_WAVE_SLOTS 8
+
 #define PI_MAX_WAVE_CYCLES 65535
 #define PI_MAX_WAVE_DELAY  65535
 
@@ -717,6 +845,10 @@ typedef void *(gpioThreadFunc_t) (void *);
 #define PI_SPI_SLOTS  32
 #define PI_SER_SLOTS  16
 
+#define PI_SER_MAX_BUFFER    65536
+#define PI_SER_NO_TERMINATOR 256
+#define PI_SER_NO_EVENT      32
+
 #define PI_MAX_I2C_ADDR 0x7F
 
 #define PI_NUM_AUX_SPI_CHANNEL 3
@@ -725,6 +857,15 @@ typedef void *(gpioThreadFunc_t) (void *);
 #define PI_MAX_I2C_DEVICE_COUNT (1<<16)
 #define PI_MAX_SPI_DEVICE_COUNT (1<<16)
 
+/* acqStart */
+
+#define PI_ACQ_SLOTS   32
+#define PI_ACQ_SAMPLES 1024
+#define PI_MAX_ACQ_LEN 32
+
+#define PI_ACQ_I2C 0
+#define PI_ACQ_SPI 1
+
 /* max pi_i2c_msg_t per transaction */
 
 #define  PI_I2C_RDRW_IOCTL_MAX_MSGS 42
@@ -740,6 +881,16 @@ typedef void *(gpioThreadFunc_t) (void *);
 #define PI_I2C_M_REV_DIR_ADDR 0x2000 /* if I2C_FUNC_PROTOCOL_MANGLING */
 #define PI_I2C_M_NOSTART      0x4000 /* if I2C_FUNC_PROTOCOL_MANGLING */
 
+/* pi_i2c_op_t flags for i2cBatch */
+
+#define PI_I2C_OP_WRITE 0
+#define PI_I2C_OP_READ  1
+#define PI_I2C_OP_REG   2
+
+/* i2cBatchStart priority */
+
+#define PI_MAX_I2C_PRIORITY 255
+
 /* bbI2CZip and i2cZip commands */
 
 #define PI_I2C_END          0
@@ -755,6 +906,7 @@ typedef void *(gpioThreadFunc_t) (void *);
 
 /* SPI */
 
+#define PI_SPI_FLAGS_SPIDEV(x)  ((x&1)<<22)
 #define PI_SPI_FLAGS_BITLEN(x) ((x&63)<<16)
 #define PI_SPI_FLAGS_RX_LSB(x)  ((x&1)<<15)
 #define PI_SPI_FLAGS_TX_LSB(x)  ((x&1)<<14)
@@ -765,6 +917,10 @@ typedef void *(gpioThreadFunc_t) (void *);
 #define PI_SPI_FLAGS_CSPOLS(x)  ((x&7)<<2)
 #define PI_SPI_FLAGS_MODE(x)    ((x&3))
 
+/* max pi_spi_seg_t per spiSegments */
+
+#define PI_SPI_MAX_SEGS 64
+
 /* BSC registers */
 
 #define BSC_DR         0
@@ -834,6 +990,13 @@ typedef void *(gpioThreadFunc_t) (void *);
 #define PI_MIN_MS 10
 #define PI_MAX_MS 60000
 
+/* delay: 0-3600000000, period: 0, 100-3600000000 */
+
+#define PI_TIMER_SLOTS 4096
+
+#define PI_MIN_TIMER_PERIOD 100
+#define PI_MAX_TIMER_MICROS 3600000000U
+
 #define PI_MAX_SCRIPTS       32
 
 #define PI_MAX_SCRIPT_TAGS   50
@@ -890,6 +1053,7 @@ typedef void *(gpioThreadFunc_t) (void *);
 #define PI_DISABLE_SOCK_IF   2
 #define PI_LOCALHOST_SOCK_IF 4
 #define PI_DISABLE_ALERT     8
+#define PI_ENABLE_BIN_FIFO_IF 16
 
 /* memAllocMode */
 
@@ -909,8 +1073,11 @@ typedef void *(gpioThreadFunc_t) (void *);
 #define PI_CFG_RT_PRIORITY       (1<<8)
 #define PI_CFG_STATS             (1<<9)
 #define PI_CFG_NOSIGHANDLER      (1<<10)
+#define PI_CFG_NOSCRIPTOPT       (1<<11)
+#define PI_CFG_WAVE_CACHE        (1<<12)
+#define PI_CFG_ISR_CHARDEV       (1<<13)
 
-#define PI_CFG_ILLEGAL_VAL       (1<<11)
+#define PI_CFG_ILLEGAL_VAL       (1<<14)
 
 
 /* gpioISR */
@@ -1560,7 +1727,9 @@ tick        32 bit   The number of microseconds since boot
 . .
 
 The underlying Linux sysfs GPIO interface is used to provide
-the interrupt services.
+the interrupt services.  A single thread waits (with epoll) on the
+interrupts of all the GPIO with an ISR and makes the callbacks one
+at a time.
 
 The first time the function is called, with a non-NULL f, the
 GPIO is exported, set to be an input, and set to interrupt
@@ -1570,7 +1739,8 @@ Subsequent calls, with a non-NULL f, can vary one or more of the
 edge, timeout, or function.
 
 The ISR may be cancelled by passing a NULL f, in which case the
-GPIO is unexported.
+GPIO is unexported.  When the cancel returns the function is not
+running and will not be called again.
 
 The tick is that read at the time the process was informed of
 the interrupt.  This will be a variable number of microseconds
@@ -1584,6 +1754,17 @@ expired.  It may not be the same as the expected edge as
 interrupts happening in rapid succession may be missed by the
 kernel (i.e. this mechanism can not be used to capture several
 interrupts only a few microseconds apart).
+
+If PI_CFG_ISR_CHARDEV is set in the internal configuration (see
+[*gpioCfgSetInternals*]) the GPIO character device line event
+interface is used instead of sysfs.  The GPIO is requested as an
+input line rather than exported.  Every edge is queued by the
+kernel with its own timestamp, the queued edges are read in
+batches, and the function is called once per edge with the level
+after that edge and the tick at which it occurred.
+
+The BCM GPIO chip is used unless the PIGPIO_GPIOCHIP environment
+variable names another, e.g. a gpio-sim chip for testing.
 D*/
 
 
@@ -1723,8 +1904,9 @@ typedef struct
 seqno: starts at 0 each time the handle is opened and then increments
 by one for each report.
 
-flags: three flags are defined, PI_NTFY_FLAGS_WDOG,
-PI_NTFY_FLAGS_ALIVE, and PI_NTFY_FLAGS_EVENT.
+flags: five flags are defined, PI_NTFY_FLAGS_WDOG,
+PI_NTFY_FLAGS_ALIVE, PI_NTFY_FLAGS_EVENT, PI_NTFY_FLAGS_SER, and
+PI_NTFY_FLAGS_ACQ.
 
 If bit 5 is set (PI_NTFY_FLAGS_WDOG) then bits 0-4 of the flags
 indicate a GPIO which has had a watchdog timeout.
@@ -1736,6 +1918,18 @@ of other notification activity.
 If bit 7 is set (PI_NTFY_FLAGS_EVENT) then bits 0-4 of the flags
 indicate an event which has been triggered.
 
+If bit 8 is set (PI_NTFY_FLAGS_SER) then bits 0-4 of the flags
+indicate a GPIO opened for bit bang serial reads, bits 9-10 hold
+the number of data bytes less one, and the bytes are in level,
+first byte lowest.  See [*serialMonitor*].
+
+If bit 11 is set (PI_NTFY_FLAGS_ACQ) then bits 0-4 of the flags
+indicate an acquisition, bits 9-10 hold the number of data bytes
+less one, and the bytes are in level, first byte lowest.  tick is
+when the sample was taken.  A sample longer than 4 bytes is sent in
+several reports, bit 12 (PI_NTFY_FLAGS_END) is set in the last.
+See [*acqMonitor*].
+
 tick: the number of microseconds since system boot.  It wraps around
 after 1h12m.
 
@@ -1945,6 +2139,106 @@ gpioWaveAddSerial(4, 9600, 8, 2, 1000000, MSG_LEN, data);
 D*/
 
 
+/*F*/
+int gpioWaveAddTrains(unsigned numTrains, gpioPulseTrain_t *trains);
+/*D
+This function adds a number of pulse trains to the current waveform
+in one pass.
+
+. .
+numTrains: the number of pulse trains
+  *trains: an array of pulse trains
+. .
+
+Returns the new total number of pulses in the current waveform if OK,
+otherwise PI_BAD_POINTER, PI_TOO_MANY_PULSES, or PI_NO_MEMORY.
+
+Each train is as would be passed to [*gpioWaveAddGeneric*] but starts
+offset microseconds after the start of the waveform, so no leading
+delay pulse is needed.  Typically there is one train per GPIO.
+
+The trains and the existing waveform (if any) are merged together in
+time order.  Pulses from different trains which are due at the same
+time are combined into one.
+
+The result is the same as adding each train in turn with
+[*gpioWaveAddGeneric*] but the cost is proportional to the total
+number of pulses rather than to the number of trains times the total.
+
+...
+gpioPulse_t tx1[64], tx2[64];
+gpioPulseTrain_t train[2];
+
+// fill in tx1 and tx2
+
+train[0].offset = 0;
+train[0].numPulses = 64;
+train[0].pulses = tx1;
+
+train[1].offset = 500; // starts half a millisecond later
+train[1].numPulses = 64;
+train[1].pulses = tx2;
+
+gpioWaveAddNew();
+
+gpioWaveAddTrains(2, train);
+
+wave_id = gpioWaveCreate();
+...
+D*/
+
+
+/*F*/
+int gpioWaveAddSerials(unsigned numLanes, gpioSerialLane_t *lanes);
+/*D
+This function adds serial data on a number of GPIO to the current
+waveform in one pass.
+
+. .
+numLanes: the number of serial lanes
+  *lanes: an array of serial lanes
+. .
+
+Returns the new total number of pulses in the current waveform if OK,
+otherwise PI_BAD_POINTER, PI_BAD_USER_GPIO, PI_BAD_WAVE_BAUD,
+PI_BAD_DATABITS, PI_BAD_STOPBITS, PI_TOO_MANY_CHARS, PI_BAD_SER_OFFSET,
+PI_TOO_MANY_PULSES, or PI_NO_MEMORY.
+
+Each lane holds the parameters which would be passed to
+[*gpioWaveAddSerial*].  Typically there is one lane per GPIO.
+
+The result is the same as adding each lane in turn with
+[*gpioWaveAddSerial*] but the lanes are merged with the existing
+waveform (if any) in one pass, as by [*gpioWaveAddTrains*].
+
+Both functions build characters of 1-8 data bits from a table of
+the pulses for every character, kept per GPIO and rebuilt when the
+baud rate, data bits, or stop bits change.
+
+...
+gpioSerialLane_t lane[8];
+int i;
+
+for (i=0; i<8; i++)
+{
+   lane[i].gpio = 4 + i;
+   lane[i].baud = 19200;
+   lane[i].data_bits = 8;
+   lane[i].stop_bits = 2;
+   lane[i].offset = 0;
+   lane[i].numBytes = strlen(msg[i]);
+   lane[i].str = msg[i];
+}
+
+gpioWaveAddNew();
+
+gpioWaveAddSerials(8, lane);
+
+wave_id = gpioWaveCreate();
+...
+D*/
+
+
 /*F*/
 int gpioWaveCreate(void);
 /*D
@@ -1995,6 +2289,14 @@ set all the fields to zero (the pulse will be ignored).
 When a waveform is started each pulse is executed in order with the
 specified delay between the pulse and the next.
 
+If PI_CFG_WAVE_CACHE is set in the internal configuration (see
+[*gpioCfgSetInternals*]) and the added data is identical to that of
+an existing wave the id of that wave is returned and nothing is
+built.  The wave is then only deleted when [*gpioWaveDelete*] has
+been called once for each time its id was returned.  Waves which
+read the GPIO or tick (WAVE_FLAG_READ, WAVE_FLAG_TICK) are never
+shared.
+
 Returns the new waveform id if OK, otherwise PI_EMPTY_WAVEFORM,
 PI_NO_WAVEFORM_ID, PI_TOO_MANY_CBS, or PI_TOO_MANY_OOL.
 D*/
@@ -2005,7 +2307,8 @@ int gpioWaveCreatePad(int pctCB, int pctBOOL, int pctTOOL);
 /*D
 Similar to [*gpioWaveCreate*], this function creates a waveform but pads the consumed
 resources. Padded waves of equal dimension can be re-cycled efficiently allowing
-newly created waves to re-use the resources of deleted waves of the same dimension.
+newly created waves to re-use the resources of deleted waves of the same dimension
+without fragmenting the free space.
 
 . .
 pctCB: 0-100, the percent of all DMA control blocks to consume.
@@ -2048,25 +2351,42 @@ int gpioWaveDelete(unsigned wave_id);
 /*D
 This function deletes the waveform with id wave_id.
 
-The wave is flagged for deletion.  The resources used by the wave
-will only be reused when either of the following apply.
-
-- all waves with higher numbered wave ids have been deleted or have
-been flagged for deletion.
-
-- a new wave is created which uses exactly the same resources as
-the current wave (see the C source for gpioWaveCreate for details).
+The resources used by the wave are freed at once and merged with
+any neighbouring free space.  New waves are placed in the smallest
+free space which will hold them.
 
 . .
 wave_id: >=0, as returned by [*gpioWaveCreate*]
 . .
 
-Wave ids are allocated in order, 0, 1, 2, etc.
+Wave ids are allocated in order, 0, 1, 2, etc.  The lowest deleted
+wave id is reused first.
 
 Returns 0 if OK, otherwise PI_BAD_WAVE_ID.
 D*/
 
 
+/*F*/
+int gpioWaveCompact(void);
+/*D
+This function moves the waves down so that the free DMA control
+blocks and OOL space each become one contiguous block.
+
+Wave ids are unchanged.  The wave being transmitted and any wave
+queued to follow it with a sync send are not moved.
+
+Returns the number of waves moved if OK, otherwise PI_CHAIN_IN_USE.
+
+Use after many waves of differing sizes have been created and
+deleted if [*gpioWaveCreate*] fails with PI_TOO_MANY_CBS or
+PI_TOO_MANY_OOL even though enough waves have been deleted to
+make room.
+
+This function may not be called while a wave chain is being
+transmitted.
+D*/
+
+
 /*F*/
 int gpioWaveTxSend(unsigned wave_id, unsigned wave_mode);
 /*D
@@ -2294,213 +2614,702 @@ D*/
 
 
 /*F*/
-int gpioSerialReadOpen(unsigned user_gpio, unsigned baud, unsigned data_bits);
+int gpioWaveSlotCreate(unsigned maxDelay);
 /*D
-This function opens a GPIO for bit bang reading of serial data.
+This function creates a double buffered waveform (a wave slot) from
+the data provided by the prior calls to the [*gpioWaveAdd**]
+functions.
 
 . .
-user_gpio: 0-31
-     baud: 50-250000
-data_bits: 1-32
+maxDelay: the longest delay any pulse may later be given
 . .
 
-Returns 0 if OK, otherwise PI_BAD_USER_GPIO, PI_BAD_WAVE_BAUD,
-PI_BAD_DATABITS, or PI_GPIO_IN_USE.
+Returns a slot id (0 to PI_MAX_WAVE_SLOTS-1) if OK, otherwise
+PI_EMPTY_WAVEFORM, PI_NO_HANDLE, PI_BAD_PARAM, PI_NO_MEMORY,
+PI_TOO_MANY_CBS, PI_TOO_MANY_OOL, or PI_NO_WAVEFORM_ID.
 
-The serial data is returned in a cyclic buffer and is read using
-[*gpioSerialRead*].
+The data provided by the [*gpioWaveAdd**] functions is consumed by this
+function.
 
-It is the caller's responsibility to read data from the cyclic buffer
-in a timely fashion.
+Two copies of the waveform are built.  One is transmitted while the
+other is changed with [*gpioWaveSlotUpdate*] and then swapped in with
+[*gpioWaveSlotSwap*].  Nothing is allocated or rebuilt after creation
+so the levels and delays may be changed many times a second.
+
+Each pulse always sets and clears its GPIO with one control block,
+so any pulse may later switch any GPIO.  On DMA lite channels a long
+delay needs more than one control block.  Enough are reserved for
+the larger of the pulse's delay and maxDelay.  PI_BAD_PARAM is
+returned if maxDelay needs more control blocks than both copies
+could ever be given.
+
+The slot uses two wave ids which may not be deleted with
+[*gpioWaveDelete*].  Waves which read the GPIO or tick may not be
+used in a slot.
 D*/
 
+
 /*F*/
-int gpioSerialReadInvert(unsigned user_gpio, unsigned invert);
+int gpioWaveSlotTx(unsigned slot_id);
 /*D
-This function configures the level logic for bit bang serial reads.
+This function starts repeated transmission of the current copy of a
+wave slot.
 
-Use PI_BB_SER_INVERT to invert the serial logic and PI_BB_SER_NORMAL for
-normal logic.  Default is PI_BB_SER_NORMAL.
+. .
+slot_id: >=0, as returned by [*gpioWaveSlotCreate*]
+. .
+
+Returns the number of DMA control blocks in the copy if OK,
+otherwise PI_BAD_HANDLE.
+D*/
+
+
+/*F*/
+int gpioWaveSlotUpdate(
+   unsigned slot_id, unsigned first, unsigned count, gpioPulse_t *pulses);
+/*D
+This function changes pulses in the spare copy of a wave slot.
 
 . .
-user_gpio: 0-31
-   invert: 0-1
+slot_id: >=0, as returned by [*gpioWaveSlotCreate*]
+  first: the first pulse to change
+  count: the number of pulses to change
+ pulses: the new pulses
 . .
 
-Returns 0 if OK, otherwise PI_BAD_USER_GPIO, PI_GPIO_IN_USE,
-PI_NOT_SERIAL_GPIO, or PI_BAD_SER_INVERT.
+Returns 0 if OK, otherwise PI_BAD_HANDLE, PI_BAD_PARAM,
+PI_BAD_POINTER, PI_BAD_SLOT_DELAY, or PI_SLOT_BUSY.
 
-The GPIO must be opened for bit bang reading of serial data using
-[*gpioSerialReadOpen*] prior to calling this function.
+The pulses are numbered as added with [*gpioWaveAdd**].  The spare
+copy starts as the copy being sent, so only the pulses which change
+need be given.  The changes are not sent until [*gpioWaveSlotSwap*]
+is called.
+
+PI_SLOT_BUSY means the last swap has not yet happened (the spare copy
+is still being sent).  Try again after the end of the current cycle.
+
+PI_BAD_SLOT_DELAY means a delay needs more control blocks than were
+reserved, see [*gpioWaveSlotCreate*].
 D*/
 
 
 /*F*/
-int gpioSerialRead(unsigned user_gpio, void *buf, size_t bufSize);
+int gpioWaveSlotSwap(unsigned slot_id);
 /*D
-This function copies up to bufSize bytes of data read from the
-bit bang serial cyclic buffer to the buffer starting at buf.
+This function makes the spare copy of a wave slot the one sent.
 
 . .
-user_gpio: 0-31, previously opened with [*gpioSerialReadOpen*]
-      buf: an array to receive the read bytes
-  bufSize: >=0
+slot_id: >=0, as returned by [*gpioWaveSlotCreate*]
 . .
 
-Returns the number of bytes copied if OK, otherwise PI_BAD_USER_GPIO
-or PI_NOT_SERIAL_GPIO.
+Returns 0 if OK, otherwise PI_BAD_HANDLE or PI_SLOT_BUSY.
 
-The bytes returned for each character depend upon the number of
-data bits [*data_bits*] specified in the [*gpioSerialReadOpen*] command.
+If the slot is being sent the switch happens at the end of the
+current cycle.  It is made by a single write to the last control
+block of the copy being sent so there is no gap or glitch.
 
-For [*data_bits*] 1-8 there will be one byte per character. 
-For [*data_bits*] 9-16 there will be two bytes per character. 
-For [*data_bits*] 17-32 there will be four bytes per character.
+PI_SLOT_BUSY means the last swap has not yet happened.
 D*/
 
 
 /*F*/
-int gpioSerialReadClose(unsigned user_gpio);
+int gpioWaveSlotDelete(unsigned slot_id);
 /*D
-This function closes a GPIO for bit bang reading of serial data.
+This function deletes a wave slot and both its waves.
 
 . .
-user_gpio: 0-31, previously opened with [*gpioSerialReadOpen*]
+slot_id: >=0, as returned by [*gpioWaveSlotCreate*]
 . .
 
-Returns 0 if OK, otherwise PI_BAD_USER_GPIO, or PI_NOT_SERIAL_GPIO.
+Returns 0 if OK, otherwise PI_BAD_HANDLE.
+
+Stop the transmission first if the slot is being sent.
 D*/
 
+
 /*F*/
-int i2cOpen(unsigned i2cBus, unsigned i2cAddr, unsigned i2cFlags);
+int gpioWaveStreamOpen(
+   unsigned numSegments, unsigned segPulses, unsigned maxDelay);
 /*D
-This returns a handle for the device at the address on the I2C bus.
+This function creates the wave stream, a ring of DMA control block
+segments which are refilled while the stream is transmitted.  It
+allows pulse sequences of any length to be sent without building
+them all first.
 
 . .
-  i2cBus: >=0
- i2cAddr: 0-0x7F
-i2cFlags: 0
+numSegments: >1, the number of segments in the ring
+  segPulses: >0, the number of pulses each segment holds
+   maxDelay: >0, the longest delay one pulse may use
 . .
 
-No flags are currently defined.  This parameter should be set to zero.
-
-Physically buses 0 and 1 are available on the Pi.  Higher numbered buses
-will be available if a kernel supported bus multiplexor is being used.
+Returns 0 if OK, otherwise PI_NO_HANDLE, PI_BAD_PARAM, PI_NO_MEMORY,
+PI_TOO_MANY_CBS, PI_TOO_MANY_OOL, or PI_NO_WAVEFORM_ID.
 
-The GPIO used are given in the following table.
+Only one stream may be open.  Its ring uses a wave id which may not
+be sent with [*gpioWaveTxSend*] or deleted with [*gpioWaveDelete*].
 
-      @ SDA @ SCL
-I2C 0 @  0  @  1
-I2C 1 @  2  @  3
+Pulses are written with [*gpioWaveStreamWrite*].  A segment is
+committed to the ring when it is full or [*gpioWaveStreamFlush*] is
+called.  Segments are reused once they have been sent.
 
-Returns a handle (>=0) if OK, otherwise PI_BAD_I2C_BUS, PI_BAD_I2C_ADDR,
-PI_BAD_FLAGS, PI_NO_HANDLE, or PI_I2C_OPEN_FAILED.
+A pulse with a delay longer than maxDelay is written as the pulse
+followed by as many pulses which change no GPIO as are needed to make
+up the delay.  On DMA lite channels a smaller maxDelay uses fewer
+control blocks per pulse.
 
-For the SMBus commands the low level transactions are shown at the end
-of the function description.  The following abbreviations are used.
+The ring needs numSegments * (segPulses * (1 + d) + 3) + 1 control
+blocks, where d is the number of delay control blocks maxDelay needs
+(1 unless a DMA lite channel is used).
 
-. .
-S      (1 bit) : Start bit
-P      (1 bit) : Stop bit
-Rd/Wr  (1 bit) : Read/Write bit. Rd equals 1, Wr equals 0.
-A, NA  (1 bit) : Accept and not accept bit. 
-Addr   (7 bits): I2C 7 bit address.
-i2cReg (8 bits): Command byte, a byte which often selects a register.
-Data   (8 bits): A data byte.
-Count  (8 bits): A byte defining the length of a block operation.
+...
+gpioWaveStreamOpen(8, 500, 1000); // 8 segments of 500 pulses
 
-[..]: Data sent by the device.
-. .
+while (more)
+{
+   n = gpioWaveStreamWrite(count, pulses);
+   pulses += n;
+   count -= n;
+   if (n && !started) started = !gpioWaveStreamTx();
+   if (count) time_sleep(0.001);
+}
+gpioWaveStreamFlush();
+...
 D*/
 
 
 /*F*/
-int i2cClose(unsigned handle);
+int gpioWaveStreamWrite(unsigned numPulses, gpioPulse_t *pulses);
 /*D
-This closes the I2C device associated with the handle.
+This function adds pulses to the wave stream.
 
 . .
-handle: >=0, as returned by a call to [*i2cOpen*]
+numPulses: the number of pulses
+   pulses: the pulses, in the form used by [*gpioWaveAddGeneric*]
 . .
 
-Returns 0 if OK, otherwise PI_BAD_HANDLE.
+Returns the number of pulses taken if OK, otherwise
+PI_NO_WAVE_STREAM or PI_BAD_POINTER.
+
+The call never waits.  Fewer pulses than given are taken when the
+ring is full.  Give the rest in a later call.
 D*/
 
 
 /*F*/
-int i2cWriteQuick(unsigned handle, unsigned bit);
+int gpioWaveStreamFlush(void);
 /*D
-This sends a single bit (in the Rd/Wr bit) to the device associated
-with handle.
-
-. .
-handle: >=0, as returned by a call to [*i2cOpen*]
-   bit: 0-1, the value to write
-. .
+This function commits the pulses written to the wave stream which do
+not fill a segment.
 
-Returns 0 if OK, otherwise PI_BAD_HANDLE, PI_BAD_PARAM, or
-PI_I2C_WRITE_FAILED.
+Returns the number of pulses still waiting for room in the ring if
+OK (0 once all are committed), otherwise PI_NO_WAVE_STREAM.
 
-Quick command. SMBus 2.0 5.5.1
-. .
-S Addr bit [A] P
-. .
+Call this after the last pulses have been written, and whenever
+pulses must not wait for their segment to fill.
 D*/
 
 
 /*F*/
-int i2cWriteByte(unsigned handle, unsigned bVal);
+int gpioWaveStreamTx(void);
 /*D
-This sends a single byte to the device associated with handle.
+This function starts transmitting the wave stream.
 
-. .
-handle: >=0, as returned by a call to [*i2cOpen*]
-  bVal: 0-0xFF, the value to write
-. .
+Returns 0 if OK, otherwise PI_NO_WAVE_STREAM or PI_EMPTY_WAVEFORM.
 
-Returns 0 if OK, otherwise PI_BAD_HANDLE, PI_BAD_PARAM, or
-PI_I2C_WRITE_FAILED.
+Transmission starts with the oldest segment not yet sent.  Write and
+commit a few segments first so the ring doesn't run dry at once.
 
-Send byte. SMBus 2.0 5.5.2
-. .
-S Addr Wr [A] bVal [A] P
-. .
+The stream keeps running while there are committed segments.  When
+it runs out (an underrun) it holds the GPIO levels and waits for the
+next segment, which is sent as soon as it is committed.
+
+Sending another wave or chain, or [*gpioWaveTxStop*], stops the
+stream.  A later call restarts it from the start of the segment it
+was sending.
 D*/
 
 
 /*F*/
-int i2cReadByte(unsigned handle);
+int gpioWaveStreamStatus(unsigned *queued, unsigned *underruns);
 /*D
-This reads a single byte from the device associated with handle.
+This function reports the state of the wave stream.
 
 . .
-handle: >=0, as returned by a call to [*i2cOpen*]
+   queued: if not NULL, set to the pulses written but not yet sent
+underruns: if not NULL, set to the underruns since the stream opened
 . .
 
-Returns the byte read (>=0) if OK, otherwise PI_BAD_HANDLE,
-or PI_I2C_READ_FAILED.
+Returns the number of pulses which may be written without waiting
+if OK, otherwise PI_NO_WAVE_STREAM.
 
-Receive byte. SMBus 2.0 5.5.3
-. .
-S Addr Rd [A] [Data] NA P
-. .
+An underrun is counted each time the stream runs out of committed
+segments, including after the last one.  The stream is checked when
+this function, [*gpioWaveStreamWrite*], or [*gpioWaveStreamFlush*]
+is called.
 D*/
 
 
 /*F*/
-int i2cWriteByteData(unsigned handle, unsigned i2cReg, unsigned bVal);
+int gpioWaveStreamClose(void);
 /*D
-This writes a single byte to the specified register of the device
-associated with handle.
+This function stops the wave stream if it is being sent and frees
+its ring.
 
-. .
-handle: >=0, as returned by a call to [*i2cOpen*]
-i2cReg: 0-255, the register to write
-  bVal: 0-0xFF, the value to write
-. .
+Returns 0 if OK, otherwise PI_NO_WAVE_STREAM.
+D*/
 
-Returns 0 if OK, otherwise PI_BAD_HANDLE, PI_BAD_PARAM, or
-PI_I2C_WRITE_FAILED.
+
+/*F*/
+int gpioWaveSimOpen(void);
+/*D
+This function lets waveforms be built and checked without a Pi.
+
+It must be called before [*gpioInitialise*].  The DMA pages used for
+waveforms are allocated in ordinary memory.  Nothing is mapped and no
+hardware is touched.
+
+Returns 0 if OK, otherwise PI_INITIALISED or PI_NO_MEMORY.
+
+While open the [*gpioWaveAdd**], [*gpioWaveCreate*],
+[*gpioWaveCreatePad*], [*gpioWaveDelete*], [*gpioWaveCompact*],
+[*gpioWaveClear*], and gpioWaveGet* functions work as normal.
+[*gpioWaveTxSend*] and [*gpioWaveChain*] build their control blocks
+as normal but note where DMA would start rather than starting it.
+[*gpioWaveSimRun*] then executes those control blocks.
+
+Call [*gpioWaveSimClose*] to free the memory.  [*gpioInitialise*]
+closes the simulation.
+
+...
+gpioPulse_t out[1000];
+int wid, n;
+
+gpioWaveSimOpen();
+
+gpioWaveAddSerial(4, 9600, 8, 2, 0, 5, "hello");
+wid = gpioWaveCreate();
+
+gpioWaveTxSend(wid, PI_WAVE_MODE_ONE_SHOT);
+
+n = gpioWaveSimRun(1000000, out, 1000, STDOUT_FILENO); // VCD to stdout
+
+gpioWaveSimClose();
+...
+D*/
+
+
+/*F*/
+int gpioWaveSimRun(
+   uint32_t maxMicros, gpioPulse_t *pulses, unsigned maxPulses, int vcdFd);
+/*D
+This function executes the DMA control blocks of the last
+[*gpioWaveTxSend*] or [*gpioWaveChain*] made since [*gpioWaveSimOpen*].
+It returns the resulting GPIO timeline.
+
+. .
+maxMicros: the most microseconds to simulate
+  *pulses: where to store the timeline, may be NULL if maxPulses is 0
+maxPulses: the size of pulses
+    vcdFd: a file descriptor for a VCD copy of the timeline, or -1
+. .
+
+Returns the number of pulses in the timeline if OK, otherwise
+PI_NOT_INITIALISED, PI_BAD_POINTER, or PI_WAVE_SIM_FAULT.
+
+Only the first maxPulses pulses are stored, but the count returned
+includes them all.
+
+The timeline is a pulse list in the form accepted by
+[*gpioWaveAddGeneric*].  The first pulse is at time 0.  Each pulse
+holds the GPIO set and cleared at one instant.  Its delay is the time
+to the next pulse.  For the last pulse it is the time to the end of
+the simulation.  The DMA start delay and the delays used by chain
+loops and [*gpioWaveChain*] delays are included.
+
+The simulation ends when the control blocks end or maxMicros have
+been simulated, so repeating waves and chains need a limit.  A run
+which reaches maxMicros stops after the control block being run,
+cutting any delay short, and the next run carries on from the
+following one as the DMA would have.  This lets
+code which changes waves while they are sent, such as
+[*gpioWaveSlotSwap*] and the wave stream functions, be checked.
+
+Simulated time only passes in the delay control blocks.  All other
+control blocks, including the self modifying ones used by chain loop
+counters, take no time.  GPIO reads and ticks (WAVE_FLAG_READ,
+WAVE_FLAG_TICK) are stored as normal.
+
+The VCD uses the same symbols as pig2vcd with a timescale of 1 us.
+
+Sending a wave or chain starts the next run afresh.
+
+PI_WAVE_SIM_FAULT means a control block used an address outside the
+simulated memory or the GPIO, timer, and system timer registers.  It
+also means a million control blocks ran without any delay.
+D*/
+
+
+/*F*/
+int gpioWaveSimClose(void);
+/*D
+This function frees the memory allocated by [*gpioWaveSimOpen*].
+
+Returns 0.
+D*/
+
+
+/*F*/
+int gpioSerialReadOpen(unsigned user_gpio, unsigned baud, unsigned data_bits);
+/*D
+This function opens a GPIO for bit bang reading of serial data.
+
+. .
+user_gpio: 0-31
+     baud: 50-250000
+data_bits: 1-32
+. .
+
+Returns 0 if OK, otherwise PI_BAD_USER_GPIO, PI_BAD_WAVE_BAUD,
+PI_BAD_DATABITS, or PI_GPIO_IN_USE.
+
+The serial data is returned in a cyclic buffer and is read using
+[*gpioSerialRead*].
+
+It is the caller's responsibility to read data from the cyclic buffer
+in a timely fashion.
+
+All the GPIO opened for serial reads are decoded together by the
+alert thread in one pass over each batch of samples.  A character
+whose last bits have no edges is completed once its stop bit time
+has passed, so no GPIO watchdog is used and the GPIO's alert function
+(see [*gpioSetAlertFunc*]) remains free for other use.
+D*/
+
+/*F*/
+int gpioSerialReadInvert(unsigned user_gpio, unsigned invert);
+/*D
+This function configures the level logic for bit bang serial reads.
+
+Use PI_BB_SER_INVERT to invert the serial logic and PI_BB_SER_NORMAL for
+normal logic.  Default is PI_BB_SER_NORMAL.
+
+. .
+user_gpio: 0-31
+   invert: 0-1
+. .
+
+Returns 0 if OK, otherwise PI_BAD_USER_GPIO, PI_GPIO_IN_USE,
+PI_NOT_SERIAL_GPIO, or PI_BAD_SER_INVERT.
+
+The GPIO must be opened for bit bang reading of serial data using
+[*gpioSerialReadOpen*] prior to calling this function.
+D*/
+
+
+/*F*/
+int gpioSerialReadParity(unsigned user_gpio, unsigned parity);
+/*D
+This function configures the parity bit for bit bang serial reads.
+
+. .
+user_gpio: 0-31
+   parity: 0-2
+. .
+
+Returns 0 if OK, otherwise PI_BAD_USER_GPIO, PI_NOT_SERIAL_GPIO,
+or PI_BAD_SER_PARITY.
+
+Use PI_BB_SER_PARITY_ODD or PI_BB_SER_PARITY_EVEN if a parity bit
+follows the data bits, PI_BB_SER_PARITY_NONE if not.  Default is
+PI_BB_SER_PARITY_NONE.
+
+The parity bit is checked but not returned with the data.  Characters
+failing the check are still returned and are counted, see
+[*gpioSerialReadErrors*].
+
+The GPIO must be opened for bit bang reading of serial data using
+[*gpioSerialReadOpen*] prior to calling this function.
+D*/
+
+
+/*F*/
+int gpioSerialReadErrors
+   (unsigned user_gpio, unsigned *framingErrs, unsigned *parityErrs);
+/*D
+This function returns the number of framing and parity errors seen
+since the GPIO was opened for bit bang serial reads.
+
+. .
+  user_gpio: 0-31, previously opened with [*gpioSerialReadOpen*]
+*framingErrs: set to the number of characters with a low stop bit
+ *parityErrs: set to the number of characters failing the parity check
+. .
+
+Returns 0 if OK, otherwise PI_BAD_USER_GPIO or PI_NOT_SERIAL_GPIO.
+
+Either pointer may be NULL if that count is not wanted.
+D*/
+
+
+/*F*/
+int gpioSerialRead(unsigned user_gpio, void *buf, size_t bufSize);
+/*D
+This function copies up to bufSize bytes of data read from the
+bit bang serial cyclic buffer to the buffer starting at buf.
+
+. .
+user_gpio: 0-31, previously opened with [*gpioSerialReadOpen*]
+      buf: an array to receive the read bytes
+  bufSize: >=0
+. .
+
+Returns the number of bytes copied if OK, otherwise PI_BAD_USER_GPIO
+or PI_NOT_SERIAL_GPIO.
+
+The bytes returned for each character depend upon the number of
+data bits [*data_bits*] specified in the [*gpioSerialReadOpen*] command.
+
+For [*data_bits*] 1-8 there will be one byte per character. 
+For [*data_bits*] 9-16 there will be two bytes per character. 
+For [*data_bits*] 17-32 there will be four bytes per character.
+D*/
+
+
+/*F*/
+int gpioSerialReadPeek(unsigned user_gpio, char **buf);
+/*D
+This function returns the bit bang serial data which may be read in
+place from the cyclic buffer.
+
+. .
+user_gpio: 0-31, previously opened with [*gpioSerialReadOpen*]
+     *buf: set to the start of the data
+. .
+
+Returns the number of bytes available at *buf if OK, otherwise
+PI_BAD_USER_GPIO, PI_BAD_POINTER, or PI_NOT_SERIAL_GPIO.
+
+The bytes are contiguous.  When the data wraps round the end of the
+cyclic buffer the rest is returned by the next call.
+
+The bytes stay in the buffer until freed with [*gpioSerialReadCommit*].
+
+...
+char *data;
+int n;
+
+n = gpioSerialReadPeek(17, &data);
+
+if (n > 0)
+{
+   fwrite(data, 1, n, stdout);
+   gpioSerialReadCommit(17, n);
+}
+...
+D*/
+
+
+/*F*/
+int gpioSerialReadCommit(unsigned user_gpio, unsigned count);
+/*D
+This function frees bytes returned by [*gpioSerialReadPeek*] once
+they have been used.
+
+. .
+user_gpio: 0-31, previously opened with [*gpioSerialReadOpen*]
+    count: the number of bytes to free
+. .
+
+Returns 0 if OK, otherwise PI_BAD_USER_GPIO, PI_NOT_SERIAL_GPIO,
+or PI_BAD_SERIAL_COUNT.
+
+count may not exceed the bytes returned by [*gpioSerialReadPeek*]
+and must be a whole number of characters.
+D*/
+
+
+/*F*/
+int gpioSerialReadWait
+   (unsigned user_gpio, unsigned terminator, unsigned timeout);
+/*D
+This function waits for bit bang serial data to arrive.
+
+. .
+ user_gpio: 0-31, previously opened with [*gpioSerialReadOpen*]
+terminator: 0-255, or PI_BB_SER_ANY
+   timeout: the longest wait in milliseconds
+. .
+
+Returns the number of unread bytes if OK, 0 if the wait timed out,
+otherwise PI_BAD_USER_GPIO, PI_BAD_PARAM, or PI_NOT_SERIAL_GPIO.
+
+With PI_BB_SER_ANY the function returns as soon as there is unread
+data.  Otherwise it returns once an unread character equals
+terminator, e.g. '\n' to wait for a whole line.
+
+The function returns at once if the data is already there.  It
+does not read the data, use [*gpioSerialRead*] or
+[*gpioSerialReadPeek*].
+
+The waiting thread is woken by the alert thread at most once an
+alert pass (about a millisecond), however much data arrives.  One
+thread at a time should wait on each GPIO.
+
+...
+char line[256];
+int n;
+
+while (gpioSerialReadWait(17, '\n', 1000) >= 0)
+{
+   n = gpioSerialRead(17, line, sizeof(line));
+   // process n bytes
+}
+...
+D*/
+
+
+/*F*/
+int gpioSerialReadClose(unsigned user_gpio);
+/*D
+This function closes a GPIO for bit bang reading of serial data.
+
+. .
+user_gpio: 0-31, previously opened with [*gpioSerialReadOpen*]
+. .
+
+Returns 0 if OK, otherwise PI_BAD_USER_GPIO, or PI_NOT_SERIAL_GPIO.
+D*/
+
+/*F*/
+int i2cOpen(unsigned i2cBus, unsigned i2cAddr, unsigned i2cFlags);
+/*D
+This returns a handle for the device at the address on the I2C bus.
+
+. .
+  i2cBus: >=0
+ i2cAddr: 0-0x7F
+i2cFlags: 0
+. .
+
+No flags are currently defined.  This parameter should be set to zero.
+
+Physically buses 0 and 1 are available on the Pi.  Higher numbered buses
+will be available if a kernel supported bus multiplexor is being used.
+
+The GPIO used are given in the following table.
+
+      @ SDA @ SCL
+I2C 0 @  0  @  1
+I2C 1 @  2  @  3
+
+Returns a handle (>=0) if OK, otherwise PI_BAD_I2C_BUS, PI_BAD_I2C_ADDR,
+PI_BAD_FLAGS, PI_NO_HANDLE, or PI_I2C_OPEN_FAILED.
+
+For the SMBus commands the low level transactions are shown at the end
+of the function description.  The following abbreviations are used.
+
+. .
+S      (1 bit) : Start bit
+P      (1 bit) : Stop bit
+Rd/Wr  (1 bit) : Read/Write bit. Rd equals 1, Wr equals 0.
+A, NA  (1 bit) : Accept and not accept bit. 
+Addr   (7 bits): I2C 7 bit address.
+i2cReg (8 bits): Command byte, a byte which often selects a register.
+Data   (8 bits): A data byte.
+Count  (8 bits): A byte defining the length of a block operation.
+
+[..]: Data sent by the device.
+. .
+D*/
+
+
+/*F*/
+int i2cClose(unsigned handle);
+/*D
+This closes the I2C device associated with the handle.
+
+. .
+handle: >=0, as returned by a call to [*i2cOpen*]
+. .
+
+Returns 0 if OK, otherwise PI_BAD_HANDLE.
+D*/
+
+
+/*F*/
+int i2cWriteQuick(unsigned handle, unsigned bit);
+/*D
+This sends a single bit (in the Rd/Wr bit) to the device associated
+with handle.
+
+. .
+handle: >=0, as returned by a call to [*i2cOpen*]
+   bit: 0-1, the value to write
+. .
+
+Returns 0 if OK, otherwise PI_BAD_HANDLE, PI_BAD_PARAM, or
+PI_I2C_WRITE_FAILED.
+
+Quick command. SMBus 2.0 5.5.1
+. .
+S Addr bit [A] P
+. .
+D*/
+
+
+/*F*/
+int i2cWriteByte(unsigned handle, unsigned bVal);
+/*D
+This sends a single byte to the device associated with handle.
+
+. .
+handle: >=0, as returned by a call to [*i2cOpen*]
+  bVal: 0-0xFF, the value to write
+. .
+
+Returns 0 if OK, otherwise PI_BAD_HANDLE, PI_BAD_PARAM, or
+PI_I2C_WRITE_FAILED.
+
+Send byte. SMBus 2.0 5.5.2
+. .
+S Addr Wr [A] bVal [A] P
+. .
+D*/
+
+
+/*F*/
+int i2cReadByte(unsigned handle);
+/*D
+This reads a single byte from the device associated with handle.
+
+. .
+handle: >=0, as returned by a call to [*i2cOpen*]
+. .
+
+Returns the byte read (>=0) if OK, otherwise PI_BAD_HANDLE,
+or PI_I2C_READ_FAILED.
+
+Receive byte. SMBus 2.0 5.5.3
+. .
+S Addr Rd [A] [Data] NA P
+. .
+D*/
+
+
+/*F*/
+int i2cWriteByteData(unsigned handle, unsigned i2cReg, unsigned bVal);
+/*D
+This writes a single byte to the specified register of the device
+associated with handle.
+
+. .
+handle: >=0, as returned by a call to [*i2cOpen*]
+i2cReg: 0-255, the register to write
+  bVal: 0-0xFF, the value to write
+. .
+
+Returns 0 if OK, otherwise PI_BAD_HANDLE, PI_BAD_PARAM, or
+PI_I2C_WRITE_FAILED.
 
 Write byte. SMBus 2.0 5.5.4
 . .
@@ -2851,6 +3660,131 @@ End
 ...
 D*/
 
+/*F*/
+int i2cBatch(unsigned numOps, pi_i2c_op_t *ops);
+/*D
+This function performs a batch of I2C reads and writes, which may
+be for several devices on one or more buses, with as few system
+calls as possible.
+
+. .
+numOps: the number of operations
+   ops: an array of I2C operations
+. .
+
+Returns the number of operations which succeeded, otherwise
+PI_BAD_POINTER.
+
+Each operation names a handle returned by [*i2cOpen*] and is one of
+
+. .
+PI_I2C_OP_READ                 read len bytes
+PI_I2C_OP_READ|PI_I2C_OP_REG   write reg, repeated start, read len bytes
+PI_I2C_OP_WRITE                write len bytes
+PI_I2C_OP_WRITE|PI_I2C_OP_REG  write reg then len (0-4095) bytes
+. .
+
+The status of each operation is set to the number of bytes read
+or written, or to PI_BAD_HANDLE, PI_BAD_POINTER, PI_BAD_I2C_RLEN,
+PI_BAD_I2C_WLEN, PI_I2C_READ_FAILED, or PI_I2C_WRITE_FAILED.
+
+The operations for each bus are performed in order, packed into as
+few I2C_RDWR ioctls as will hold their segments (42 per ioctl).  If
+an ioctl fails all of its operations are marked as failed.  The
+kernel does not say which segment failed and those before it have
+been performed, so they are not retried.  Batch operations which
+must succeed or fail individually separately.
+
+Adapters which do not support I2C_RDWR (such as i2c-stub) are driven
+one operation at a time with the equivalent SMBus commands.  A
+register read is then limited to 32 bytes.
+
+The array may be reused, e.g. to poll the same registers at regular
+intervals.
+
+...
+char accel[6], gyro[6], temp[2];
+pi_i2c_op_t ops[3]=
+{
+   {adxl, PI_I2C_OP_READ|PI_I2C_OP_REG, 0x32, 6, accel},
+   {itg,  PI_I2C_OP_READ|PI_I2C_OP_REG, 0x1D, 6, gyro},
+   {itg,  PI_I2C_OP_READ|PI_I2C_OP_REG, 0x1B, 2, temp},
+};
+
+if (i2cBatch(3, ops) == 3)
+{
+   // all three reads made in one I2C_RDWR ioctl
+}
+...
+D*/
+
+/*F*/
+int i2cBatchStart(
+   unsigned numOps, pi_i2c_op_t *ops, unsigned priority,
+   i2cBatchFunc_t f, void *userdata);
+/*D
+This function queues a batch of I2C operations to be performed, as
+by [*i2cBatch*], by the worker thread of their bus.  It returns
+without waiting for them.
+
+. .
+  numOps: >0, the number of operations
+     ops: an array of I2C operations, all on one bus
+priority: 0-255, higher priorities are performed first
+       f: the function to call on completion, or NULL
+userdata: a pointer to arbitrary user data
+. .
+
+Returns a request id (>=0) if OK, otherwise PI_BAD_POINTER,
+PI_BAD_PARAM, PI_BAD_HANDLE, or PI_NO_HANDLE.
+
+Each bus has its own worker thread, started by its first request,
+so a slow transfer on one bus does not hold up the others.  Queued
+batches for a bus are performed in priority order, and in the order
+they were queued within a priority.  A batch which has started is
+not interrupted.
+
+Up to 8 buses and 64 queued or uncollected batches are supported.
+
+The ops array and its buffers must remain valid until the batch
+has completed.
+
+If f is given it is called from the worker thread when the batch
+has completed, with the request id, the return value of
+[*i2cBatch*], and userdata.  The request id is then released.
+
+If f is NULL the result must be collected with [*i2cBatchWait*].
+
+...
+void eepromDone(int id, int status, void *userdata)
+{
+   printf("EEPROM page written\n");
+}
+
+// the page write waits behind the sensor poll
+i2cBatchStart(1, &pageWrite, 0, eepromDone, NULL);
+id = i2cBatchStart(30, sweep, 200, NULL, NULL);
+ok = i2cBatchWait(id, 100);
+...
+D*/
+
+/*F*/
+int i2cBatchWait(unsigned id, unsigned timeout);
+/*D
+This function waits for a batch queued by [*i2cBatchStart*] without
+a completion function and returns its result.
+
+. .
+     id: >=0, as returned by a call to [*i2cBatchStart*]
+timeout: the milliseconds to wait, 0 to return at once
+. .
+
+Returns the return value of [*i2cBatch*] if the batch has completed,
+otherwise PI_I2C_PENDING or PI_BAD_HANDLE.
+
+Once the result has been returned the request id is released.
+D*/
+
 /*F*/
 int bbI2COpen(unsigned SDA, unsigned SCL, unsigned baud);
 /*D
@@ -2874,6 +3808,11 @@ baud: 50-500000
 Returns 0 if OK, otherwise PI_BAD_USER_GPIO, PI_BAD_I2C_BAUD, or
 PI_GPIO_IN_USE.
 
+SCL is low for 9/16 of each period, which meets the fast mode
+minimum low and high times at 400000.  The clock edges are timed
+with busy waits, so the achieved rate depends on the thread not
+being preempted.  See [*bbI2CStats*].
+
 NOTE:
 
 The GPIO used for SDA and SCL must have pull-ups to 3V3 connected.  As
@@ -2964,6 +3903,40 @@ End
 ...
 D*/
 
+/*F*/
+int bbI2CStats(unsigned SDA, uint32_t *freq, uint32_t *stretches);
+/*D
+This function returns the SCL frequency achieved by the last
+[*bbI2CZip*] on a bit banged I2C bus and the number of times a
+slave stretched the clock during it.
+
+. .
+      SDA: 0-31 (as used in a prior call to [*bbI2COpen*])
+     freq: where to store the frequency in Hz, may be NULL
+stretches: where to store the clock stretch count, may be NULL
+. .
+
+Returns 0 if OK, otherwise PI_BAD_USER_GPIO, or PI_NOT_I2C_GPIO.
+
+The frequency is measured over the clock pulses which carried
+bytes (and their acknowledgements), so the start and stop
+conditions are not counted.  It is 0 if no bytes were sent.
+
+Each SCL edge waits for a deadline set from the time of the
+previous edge, so the achieved frequency is the requested baud
+rate unless the CPU can not keep up, or a slave stretched the
+clock.  A stretch is counted when a slave holds SCL low for longer
+than the SCL high time.
+
+...
+uint32_t hz;
+
+bbI2CZip(4, cmd, len, buf, sizeof(buf));
+
+bbI2CStats(4, &hz, NULL);
+...
+D*/
+
 /*F*/
 int bscXfer(bsc_xfer_t *bsc_xfer);
 /*D
@@ -3167,11 +4140,55 @@ bbSPIOpen(11, MISO, MOSI, SCLK, 20000, 3); // device 2
 ...
 D*/
 
+/*F*/
+int bbSPIOpenLanes(
+   unsigned CS, uint32_t MISOBits, uint32_t MOSIBits, unsigned SCLK,
+   unsigned baud, unsigned spiFlags);
+/*D
+This function selects a set of GPIO for bit banging SPI to several
+identical devices at once.  The devices (lanes) share CS and SCLK
+and each has its own MISO and/or MOSI.
+
+. .
+      CS: 0-31
+MISOBits: a bit mask of the lane MISO GPIO (0-31), may be 0
+MOSIBits: a bit mask of the lane MOSI GPIO (0-31), may be 0
+    SCLK: 0-31
+    baud: 50-250000
+spiFlags: see [*bbSPIOpen*]
+. .
+
+Returns 0 if OK, otherwise PI_BAD_USER_GPIO, PI_BAD_SPI_BAUD,
+PI_BAD_PARAM, or PI_GPIO_IN_USE.
+
+Lane n uses the nth lowest GPIO set in MISOBits and in MOSIBits.
+If both masks are given they must select the same number of GPIO.
+Either may be 0 for devices which only receive (e.g. 74HC595 shift
+registers) or only send (e.g. 74HC165 shift registers).  No GPIO may
+be used twice or already be in use.
+
+Each clock edge drives SCLK and the MOSI of every lane with one write
+to the GPIO set register and one to the clear register, and each
+MISO sample reads every lane with one read of the GPIO level
+register.  So n lanes transfer n bytes in the time one lane takes
+to transfer one.
+
+Transfers are made with [*bbSPIXfer*], with the lanes' bytes
+interleaved (see there), and the GPIO are released with
+[*bbSPIClose*].
+
+...
+// four ADC boards on MISO 5, 6, 13, 19 and MOSI 20, 21, 22, 23
+
+bbSPIOpenLanes(8, 1<<5|1<<6|1<<13|1<<19, 0xF<<20, 11, 100000, 0);
+...
+D*/
+
 /*F*/
 int bbSPIClose(unsigned CS);
 /*D
 This function stops bit banging SPI on a set of GPIO
-opened with [*bbSPIOpen*].
+opened with [*bbSPIOpen*] or [*bbSPIOpenLanes*].
 
 . .
 CS: 0-31, the CS GPIO used in a prior call to [*bbSPIOpen*]
@@ -3197,7 +4214,13 @@ outBuf: pointer to buffer to hold returned data
 . .
 
 Returns >= 0 if OK (the number of bytes read), otherwise
-PI_BAD_USER_GPIO, PI_NOT_SPI_GPIO or PI_BAD_POINTER.
+PI_BAD_USER_GPIO, PI_NOT_SPI_GPIO, PI_BAD_POINTER, or
+PI_BAD_SPI_COUNT.
+
+If CS was opened with [*bbSPIOpenLanes*] the buffers hold the bytes
+of all lanes interleaved, byte b of lane l at index b*lanes+l, and
+count must be a multiple of the number of lanes.  inBuf and outBuf
+may be the same buffer.
 
 ...
 // gcc -Wall -pthread -o bbSPIx_test bbSPIx_test.c -lpigpio
@@ -3296,13 +4319,23 @@ spiFlags: see below
 Returns a handle (>=0) if OK, otherwise PI_BAD_SPI_CHANNEL,
 PI_BAD_SPI_SPEED, PI_BAD_FLAGS, PI_NO_AUX_SPI, or PI_SPI_OPEN_FAILED.
 
-spiFlags consists of the least significant 22 bits.
+spiFlags consists of the least significant 23 bits.
 
 . .
-21 20 19 18 17 16 15 14 13 12 11 10  9  8  7  6  5  4  3  2  1  0
- b  b  b  b  b  b  R  T  n  n  n  n  W  A u2 u1 u0 p2 p1 p0  m  m
+22 21 20 19 18 17 16 15 14 13 12 11 10  9  8  7  6  5  4  3  2  1  0
+ K  b  b  b  b  b  b  R  T  n  n  n  n  W  A u2 u1 u0 p2 p1 p0  m  m
 . .
 
+K is 0 to drive the SPI registers directly (default) and 1 to use the
+kernel driver through /dev/spidevA.C (A as below, C the channel).
+The kernel driver must be loaded (dtparam=spi=on, dtoverlay=spi1-3cs
+for the auxiliary SPI).  Handles opened with K set don't need
+[*gpioInitialise*], don't touch the GPIO modes, and may be used
+alongside other users of the device.  The mode, p, W, T, and b settings
+are passed to the driver, u and R are ignored.  When W is set
+[*spiXfer*] writes nnnn bytes then reads the rest, the first nnnn
+bytes received are zero.
+
 mm defines the SPI mode.
 
 Warning: modes 1 and 3 do not appear to work on the auxiliary SPI.
@@ -3374,52 +4407,280 @@ D*/
 /*F*/
 int spiRead(unsigned handle, char *buf, unsigned count);
 /*D
-This function reads count bytes of data from the SPI
-device associated with the handle.
+This function reads count bytes of data from the SPI
+device associated with the handle.
+
+. .
+handle: >=0, as returned by a call to [*spiOpen*]
+   buf: an array to receive the read data bytes
+ count: the number of bytes to read
+. .
+
+Returns the number of bytes transferred if OK, otherwise
+PI_BAD_HANDLE, PI_BAD_SPI_COUNT, or PI_SPI_XFER_FAILED.
+D*/
+
+
+/*F*/
+int spiWrite(unsigned handle, char *buf, unsigned count);
+/*D
+This function writes count bytes of data from buf to the SPI
+device associated with the handle.
+
+. .
+handle: >=0, as returned by a call to [*spiOpen*]
+   buf: the data bytes to write
+ count: the number of bytes to write
+. .
+
+Returns the number of bytes transferred if OK, otherwise
+PI_BAD_HANDLE, PI_BAD_SPI_COUNT, or PI_SPI_XFER_FAILED.
+D*/
+
+/*F*/
+int spiXfer(unsigned handle, char *txBuf, char *rxBuf, unsigned count);
+/*D
+This function transfers count bytes of data from txBuf to the SPI
+device associated with the handle.  Simultaneously count bytes of
+data are read from the device and placed in rxBuf.
+
+. .
+handle: >=0, as returned by a call to [*spiOpen*]
+ txBuf: the data bytes to write
+ rxBuf: the received data bytes
+ count: the number of bytes to transfer
+. .
+
+Returns the number of bytes transferred if OK, otherwise
+PI_BAD_HANDLE, PI_BAD_SPI_COUNT, or PI_SPI_XFER_FAILED.
+
+The main SPI moves the bytes by CPU polling.  Large transfers may be
+handed to DMA instead, see [*gpioCfgSPIDMA*].
+D*/
+
+
+/*F*/
+int spiSegments(unsigned handle, pi_spi_seg_t *segs, unsigned numSegs);
+/*D
+This function transfers several segments with a SPI device as one
+message.
+
+. .
+ handle: >=0, as returned by a call to [*spiOpen*]
+   segs: an array of SPI segments
+numSegs: 1-64 (PI_SPI_MAX_SEGS), the number of segments
+. .
+
+Returns the total number of bytes transferred if OK, otherwise
+PI_BAD_HANDLE, PI_BAD_POINTER, PI_TOO_MANY_SEGS, PI_BAD_SPI_COUNT,
+or PI_SPI_XFER_FAILED.
+
+Each segment sends len bytes from txBuf (zeros if NULL) while
+storing the len bytes received in rxBuf (if not NULL).  usDelay
+micros are waited after the segment.  The device stays selected
+between segments unless csChange is 1.
+
+On a /dev/spidev handle (see [*spiOpen*]) the segments are made in
+one SPI_IOC_MESSAGE ioctl, so reading a chain of devices costs one
+system call.  The kernel limits the total bytes per message, 4096
+by default (the spidev bufsiz module parameter).
+
+On other handles each segment is a separate [*spiXfer*], the device
+is deselected between every segment.
+
+...
+char cmd[8][2], val[8][2];
+pi_spi_seg_t seg[8];
+int i;
+
+for (i=0; i<8; i++)
+{
+   cmd[i][0] = 0x80 | i; // read channel i
+   seg[i].txBuf = cmd[i];
+   seg[i].rxBuf = val[i];
+   seg[i].len = 2;
+   seg[i].usDelay = 0;
+   seg[i].csChange = 1;
+}
+
+spiSegments(h, seg, 8);
+...
+D*/
+
+
+/*F*/
+int gpioSPISimOpen(void);
+/*D
+This function lets the main SPI DMA path be checked without a Pi.
+
+It must be called before [*gpioInitialise*].  The GPIO and SPI
+registers and the SPI DMA memory are allocated in ordinary memory.
+Nothing is mapped and no hardware is touched.
+
+Returns 0 if OK, otherwise PI_INITIALISED or PI_NO_MEMORY.
+
+While open [*spiOpen*], [*spiClose*], [*spiRead*], [*spiWrite*], and
+[*spiXfer*] work on the main SPI as normal.  The device is a
+loopback, each byte received is the byte sent.
+
+Transfers which [*gpioCfgSPIDMA*] sends by DMA build their control
+blocks and set the SPI registers as normal.  A simulated DMA engine
+then checks them against what the hardware needs (the DREQs, the
+FIFO address, the lengths, and the buffers) and only moves the data
+if they are right.  Other transfers are simply copied.
+
+...
+char tx[12288], rx[12288];
+uint32_t dmaBytes;
+int h;
+
+gpioCfgSPIDMA(5, 4, 4096);
+
+gpioSPISimOpen();
+
+h = spiOpen(0, 8000000, 0);
+
+spiXfer(h, tx, rx, sizeof(tx)); // rx now matches tx
+
+if (gpioSPISimStats(&dmaBytes, NULL) == 0) printf("%u", dmaBytes);
+
+gpioSPISimClose();
+...
+D*/
+
+
+/*F*/
+int gpioSPISimStats(uint32_t *dmaBytes, uint32_t *cpuBytes);
+/*D
+This function gets the number of bytes moved since
+[*gpioSPISimOpen*].
+
+. .
+dmaBytes: where to store the bytes moved by simulated DMA, may be NULL
+cpuBytes: where to store the bytes copied, may be NULL
+. .
+
+Returns the number of DMA transfers rejected by the simulator if OK,
+otherwise PI_NOT_INITIALISED.
+
+A rejected transfer leaves the receive buffer unchanged.
+D*/
+
+
+/*F*/
+int gpioSPISimClose(void);
+/*D
+This function frees the memory allocated by [*gpioSPISimOpen*] and
+closes any SPI handles.
+
+Returns 0.
+D*/
+
+/*F*/
+int acqStart(
+   unsigned type, unsigned handle, unsigned reg, unsigned len,
+   unsigned micros);
+/*D
+This function starts reading a sensor register at a fixed rate.
+The samples are timestamped and kept in a ring for [*acqRead*] or
+streamed by [*acqMonitor*].
+
+. .
+  type: PI_ACQ_I2C or PI_ACQ_SPI
+handle: >=0, as returned by a call to [*i2cOpen*] or [*spiOpen*]
+   reg: 0-255, the register (I2C) or first byte to send (SPI)
+   len: 1-32, the number of bytes in a sample
+micros: 100-3600000000, the sample period
+. .
+
+Returns an acquisition id (>=0) if OK, otherwise PI_BAD_PARAM,
+PI_BAD_HANDLE, PI_BAD_TIMER_MICROS, PI_NO_HANDLE, or PI_NO_MEMORY.
+
+The reads are scheduled on the timer wheel (see [*gpioTimerStart*]).
+
+An I2C sample reads len bytes from register reg, as the
+PI_I2C_OP_READ|PI_I2C_OP_REG operation of [*i2cBatch*] (or
+[*i2cReadI2CBlockData*] on an SMBus only adapter).  The read is
+queued at the highest priority on the worker thread of the bus (see
+[*i2cBatchStart*]) so other timers are not held up.
+
+A SPI sample transfers reg followed by len zero bytes with
+[*spiXfer*] and keeps the len bytes received after reg.  The
+transfer is made from the timer thread and should be short.
+
+If a read has not completed when the next is due the next is
+skipped.  The ring holds the latest 1024 (PI_ACQ_SAMPLES) samples,
+older samples are discarded.
+
+Closing the handle with [*i2cClose*] or [*spiClose*] stops the
+acquisition.  Its unread samples may still be read, after which
+[*acqRead*] returns PI_BAD_HANDLE.  [*acqStop*] must still be called
+to free it.
+
+Up to 32 (PI_ACQ_SLOTS) acquisitions may run at once.
+
+...
+// read 6 bytes of accelerometer data from register 0x32 at 400 Hz
+h = i2cOpen(1, 0x53, 0);
+id = acqStart(PI_ACQ_I2C, h, 0x32, 6, 2500);
+...
+D*/
+
+/*F*/
+int acqStop(unsigned acq_id);
+/*D
+This function stops an acquisition started by [*acqStart*] and
+discards its unread samples.
 
 . .
-handle: >=0, as returned by a call to [*spiOpen*]
-   buf: an array to receive the read data bytes
- count: the number of bytes to read
+acq_id: >=0, as returned by a call to [*acqStart*]
 . .
 
-Returns the number of bytes transferred if OK, otherwise
-PI_BAD_HANDLE, PI_BAD_SPI_COUNT, or PI_SPI_XFER_FAILED.
+Returns 0 if OK, otherwise PI_BAD_HANDLE.
 D*/
 
-
 /*F*/
-int spiWrite(unsigned handle, char *buf, unsigned count);
+int acqRead(unsigned acq_id, char *buf, unsigned bufSize);
 /*D
-This function writes count bytes of data from buf to the SPI
-device associated with the handle.
+This function copies as many whole unread samples of an acquisition
+as fit into buf.
 
 . .
-handle: >=0, as returned by a call to [*spiOpen*]
-   buf: the data bytes to write
- count: the number of bytes to write
+ acq_id: >=0, as returned by a call to [*acqStart*]
+    buf: an array to receive the samples
+bufSize: >=0, the size of buf
 . .
 
-Returns the number of bytes transferred if OK, otherwise
-PI_BAD_HANDLE, PI_BAD_SPI_COUNT, or PI_SPI_XFER_FAILED.
+Returns the number of bytes copied if OK, otherwise PI_BAD_HANDLE.
+
+PI_BAD_HANDLE is also returned once every sample has been read from
+an acquisition whose I2C or SPI handle has been closed.
+
+Each sample is the tick (4 bytes, least significant byte first)
+when it was taken followed by the len bytes read.
 D*/
 
 /*F*/
-int spiXfer(unsigned handle, char *txBuf, char *rxBuf, unsigned count);
+int acqMonitor(unsigned handle, uint32_t bits);
 /*D
-This function transfers count bytes of data from txBuf to the SPI
-device associated with the handle.  Simultaneously count bytes of
-data are read from the device and placed in rxBuf.
+This function selects the acquisitions whose samples are streamed
+on a notification handle.
 
 . .
-handle: >=0, as returned by a call to [*spiOpen*]
- txBuf: the data bytes to write
- rxBuf: the received data bytes
- count: the number of bytes to transfer
+handle: >=0, as returned by [*gpioNotifyOpen*]
+  bits: a bit mask indicating the acquisitions of interest
 . .
 
-Returns the number of bytes transferred if OK, otherwise
-PI_BAD_HANDLE, PI_BAD_SPI_COUNT, or PI_SPI_XFER_FAILED.
+Returns 0 if OK, otherwise PI_BAD_HANDLE.
+
+If bit x of bits is set then the samples of acquisition x are sent
+as PI_NTFY_FLAGS_ACQ reports (see [*gpioNotifyOpen*]) instead of
+being kept for [*acqRead*].
+
+...
+// stream acquisitions 0 and 3
+acqMonitor(h, 1<<0 | 1<<3);
+...
 D*/
 
 
@@ -3428,7 +4689,7 @@ int serOpen(char *sertty, unsigned baud, unsigned serFlags);
 /*D
 This function opens a serial device at a specified baud rate
 and with specified flags.  The device name must start with
-/dev/tty or /dev/serial.
+/dev/tty, /dev/serial, or /dev/pts.
 
 . .
   sertty: the serial device to open
@@ -3520,6 +4781,10 @@ Returns the number of bytes read (>0=) if OK, otherwise PI_BAD_HANDLE,
 PI_BAD_PARAM, or PI_SER_READ_NO_DATA.
 
 If no data is ready zero is returned.
+
+If the handle is buffered (see [*serReadBuffer*]) the bytes are
+taken from the buffer, so a count of at least the buffer size
+drains everything received so far in one call.
 D*/
 
 
@@ -3538,6 +4803,88 @@ otherwise PI_BAD_HANDLE.
 D*/
 
 
+/*F*/
+int serReadBuffer(
+   unsigned handle, unsigned bufSize, unsigned minBytes,
+   unsigned terminator, unsigned event);
+/*D
+This function starts (or stops) buffering the data received on the
+serial port associated with handle.
+
+. .
+    handle: >=0, as returned by a call to [*serOpen*]
+   bufSize: 0 (stop buffering), or 1-65536 (PI_SER_MAX_BUFFER)
+  minBytes: 1-bufSize, the bytes which make the data ready
+terminator: 0-255, a byte which makes the data ready, or
+            PI_SER_NO_TERMINATOR
+     event: 0-31, the event triggered when data is ready, or
+            PI_SER_NO_EVENT
+. .
+
+Returns 0 if OK, otherwise PI_BAD_HANDLE, PI_BAD_PARAM, or
+PI_SER_BUF_FAILED.
+
+A buffered port is read by a background thread which waits for
+data with epoll, so neither it nor the caller needs to poll.  The
+thread is shared by all buffered ports and is started by the first.
+
+The received data is kept in a cyclic buffer of bufSize bytes.  If
+the buffer fills the oldest data is discarded.  [*serRead*],
+[*serReadByte*], and [*serDataAvailable*] use the buffer rather
+than the device while the port is buffered.
+
+The data is ready when at least minBytes are buffered, or when
+a received byte matches terminator.  Each time data is received
+while it is ready the event is triggered (see [*eventSetFunc*] and
+[*eventMonitor*]) and the function set by [*serSetReadyFunc*] is
+called.
+
+Calling this function again changes the settings and keeps the
+buffered data which still fits.  A bufSize of 0 stops buffering and
+discards any buffered data.
+
+...
+// GPS sentences, event 4 when a line is complete
+serReadBuffer(h, 4096, 4096, '\n', 4);
+...
+D*/
+
+
+/*F*/
+int serSetReadyFunc(unsigned handle, serReadyFunc_t f, void *userdata);
+/*D
+Registers a function to be called (a callback) when data is ready
+on a buffered serial port.
+
+. .
+  handle: >=0, as returned by a call to [*serOpen*]
+       f: the callback function, or NULL to cancel
+userdata: a pointer to arbitrary user data
+. .
+
+Returns 0 if OK, otherwise PI_BAD_HANDLE.
+
+The function is called from the serial read thread with the handle,
+the number of bytes buffered, and userdata, whenever data is
+received while it is ready (see [*serReadBuffer*]).  It may call
+[*serRead*] to take the data.  It should not block for long as the
+other buffered ports are not read while it runs.
+
+...
+void gpsLine(int handle, int count, void *userdata)
+{
+   char buf[4096];
+
+   count = serRead(handle, buf, sizeof(buf));
+   ...
+}
+
+serSetReadyFunc(h, gpsLine, NULL);
+serReadBuffer(h, 4096, 4096, '\n', PI_SER_NO_EVENT);
+...
+D*/
+
+
 /*F*/
 int gpioTrigger(unsigned user_gpio, unsigned pulseLen, unsigned level);
 /*D
@@ -3728,7 +5075,9 @@ millis: 10-60000
 
 Returns 0 if OK, otherwise PI_BAD_TIMER, PI_BAD_MS, or PI_TIMER_FAILED.
 
-10 timers are supported numbered 0 to 9.
+10 timers are supported numbered 0 to 9.  They are served by the
+same timer thread as [*gpioTimerStart*], which supports many more
+timers and sub-millisecond periods.
 
 One function may be registered per timer.
 
@@ -3770,6 +5119,73 @@ See [*gpioSetTimerFunc*] for further details.
 D*/
 
 
+/*F*/
+int gpioTimerStart(
+   unsigned delay, unsigned period, gpioTimerFuncEx_t f, void *userdata);
+/*D
+Starts a timer which calls a function (a callback) after delay
+microseconds and then, if period is non-zero, every period
+microseconds.
+
+. .
+   delay: 0-3600000000
+  period: 0 (one-shot), 100-3600000000
+       f: the function to call
+userdata: a pointer to arbitrary user data
+. .
+
+Returns a timer handle (>=0) if OK, otherwise PI_BAD_TIMER_MICROS,
+PI_BAD_PARAM, PI_NO_HANDLE, or PI_TIMER_FAILED.
+
+The function is passed the userdata pointer.
+
+Up to 4096 timers may be running at once.  They are all served by
+one thread from a hierarchical timer wheel with microsecond slots,
+sleeping until the next absolute deadline on the monotonic clock.
+
+The deadlines of a periodic timer are fixed multiples of the period
+from the first, so the time spent in the callback does not
+accumulate as drift.  If a callback overruns one or more deadlines
+they are skipped rather than called late in a burst.
+
+Callbacks are called one at a time and should return quickly, a
+slow callback delays every other timer.
+
+A one-shot timer is released before its function is called, its
+handle may then be reused.
+
+...
+void blink(void *userdata)
+{
+   static int level;
+
+   gpioWrite(*(unsigned*)userdata, level ^= 1);
+}
+
+unsigned led = 4;
+
+// toggle GPIO 4 every 250 microseconds
+h = gpioTimerStart(250, 250, blink, &led);
+...
+D*/
+
+
+/*F*/
+int gpioTimerCancel(unsigned handle);
+/*D
+Cancels a timer started by [*gpioTimerStart*].
+
+. .
+handle: >=0, as returned by a call to [*gpioTimerStart*]
+. .
+
+Returns 0 if OK, otherwise PI_BAD_HANDLE.
+
+When this function returns the timer's function is not running and
+will not be called again, unless it is called from that function.
+D*/
+
+
 /*F*/
 pthread_t *gpioStartThread(gpioThreadFunc_t f, void *userdata);
 /*D
@@ -3924,6 +5340,50 @@ The current value of script parameters 0 to 9 are returned in param.
 D*/
 
 
+/*F*/
+int gpioScriptProfile(unsigned script_id, unsigned enable);
+/*D
+This function turns profiling of a stored script on or off.
+
+. .
+script_id: >=0, as returned by [*gpioStoreScript*]
+   enable: 1 to clear the profile and turn profiling on, 0 to turn
+           it off
+. .
+
+The function returns 0 if OK, otherwise PI_BAD_SCRIPT_ID or
+PI_NO_MEMORY.
+
+The setting takes effect the next time the script is run.  While
+profiling is on each step counts the number of times it has been
+executed.  MICS, MILS, WAIT, and EVTWT steps also accumulate the
+microseconds they spend blocked.  The counts are kept when profiling
+is turned off and may be read with [*gpioScriptProfileRead*].
+D*/
+
+
+/*F*/
+int gpioScriptProfileRead(
+   unsigned script_id, unsigned start, unsigned count, gpioScriptProf_t *prof);
+/*D
+This function returns the execution profile of a stored script.
+
+. .
+script_id: >=0, as returned by [*gpioStoreScript*]
+    start: the first script step to return
+    count: the maximum number of steps to return
+     prof: an array to hold the returned steps
+. .
+
+The function returns the number of steps returned if OK, otherwise
+PI_BAD_SCRIPT_ID or PI_NO_SCRIPT_PROF.
+
+Each [*gpioScriptProf_t*] step holds the command and parameters it
+was parsed from (tags replaced by step numbers) together with its
+execution count and blocked time in microseconds.
+D*/
+
+
 /*F*/
 int gpioStopScript(unsigned script_id);
 /*D
@@ -4379,6 +5839,34 @@ eventMonitor(h, 0xC8);
 
 D*/
 
+/*F*/
+int serialMonitor(unsigned handle, uint32_t bits);
+/*D
+This function selects the bit bang serial read GPIO whose data is to
+be streamed on a previously opened handle.
+
+. .
+handle: >=0, as returned by [*gpioNotifyOpen*]
+  bits: a bit mask indicating the GPIO of interest
+. .
+
+Returns 0 if OK, otherwise PI_BAD_HANDLE.
+
+The data received on each GPIO opened with [*gpioSerialReadOpen*]
+whose bit in bits is set is sent as it arrives, up to 4 bytes a
+report.  See [*gpioNotifyBegin*] for the notification format.
+
+The streamed data is taken from the GPIO's cyclic buffer so is not
+also returned by [*gpioSerialRead*].  Only one handle should stream
+each GPIO.
+
+...
+// Stream the serial data received on GPIO 17.
+
+serialMonitor(h, 1<<17);
+...
+D*/
+
 /*F*/
 int eventSetFunc(unsigned event, eventFunc_t f);
 /*D
@@ -4877,6 +6365,38 @@ and 611 control blocks on a lite channel.
 D*/
 
 
+/*F*/
+int gpioCfgSPIDMA(unsigned txChannel, unsigned rxChannel, unsigned minBytes);
+/*D
+Configures the main SPI to use DMA for large transfers.
+
+This function is only effective if called before [*gpioInitialise*]
+or [*gpioSPISimOpen*].
+
+. .
+txChannel: 0-14
+rxChannel: 0-14
+ minBytes: 0-65536, 0 (the default) never uses DMA
+. .
+
+Returns 0 if OK, otherwise PI_BAD_SPI_DMA.
+
+[*spiRead*], [*spiWrite*], and [*spiXfer*] transfers of minBytes or
+more on the main SPI are moved between memory and the SPI FIFO by
+the two DMA channels.  The CPU sleeps for most of the transfer
+rather than polling the FIFO.  Smaller transfers, auxiliary SPI
+transfers, and 3-wire transfers are polled as before.
+
+The channels must differ from each other and from those used by
+pigpio (see [*gpioCfgDMAchannels*]), otherwise [*gpioInitialise*]
+fails.  They must also be free of other users, e.g. channels 0, 2,
+and 4 are normally used by Linux.  Lite channels (7-14) will do.
+
+About 132 KB of mailbox memory is allocated by [*gpioInitialise*].
+Transfers are sent in pieces of at most 65532 bytes.
+D*/
+
+
 /*F*/
 int gpioCfgPermissions(uint64_t updateMask);
 /*D
@@ -4927,7 +6447,7 @@ Configures pigpio support of the fifo and socket interfaces.
 This function is only effective if called before [*gpioInitialise*].
 
 . .
-ifFlags: 0-7
+ifFlags: 0-31
 . .
 
 The default setting (0) is that both interfaces are enabled.
@@ -4939,6 +6459,15 @@ Or in PI_DISABLE_SOCK_IF to disable the socket interface.
 Or in PI_LOCALHOST_SOCK_IF to disable remote socket
 access (this means that the socket interface is only
 usable from the local Pi).
+
+Or in PI_ENABLE_BIN_FIFO_IF to enable the binary pipe interface.
+Commands written to /dev/pigbin use the socket command format
+(cmd, p1, p2, p3 as native 32-bit words followed by p3 bytes of
+extension).  Each result is returned on /dev/pigbout in the socket
+response format (cmd, p1, p2, res followed by any extension).
+Any number of commands may be written at once, the results are
+returned in order.  The reader must consume the results as the
+daemon waits for space in /dev/pigbout.
 D*/
 
 
@@ -4962,6 +6491,36 @@ size is requested with [*gpioCfgBufferSize*].
 D*/
 
 
+/*F*/
+int gpioCfgWaveMemory(unsigned waveBlocks, unsigned maxWaves);
+/*D
+Sets the amount of DMA memory used for waveforms and the number of
+waveforms which may exist at once.
+
+This function is only effective if called before [*gpioInitialise*]
+or [*gpioWaveSimOpen*].
+
+. .
+waveBlocks: 0-40 (PI_MAX_WAVE_BLOCKS), default 4 (PI_WAVE_BLOCKS)
+  maxWaves: 1-2500 (PI_MAX_WAVE_IDS), default 250 (PI_MAX_WAVES)
+. .
+
+Returns 0 if OK, otherwise PI_BAD_WAVE_MEMORY.
+
+Each block is 53 pages of 4096 bytes and holds about 6250 DMA
+control blocks (see [*gpioWaveGetMaxCbs*]).  The memory is only
+allocated when a wave function is first called, so programs which
+never use waves don't pay for it.  With 0 blocks the wave functions
+return PI_NO_WAVE_MEMORY.  That is also returned if the memory
+can't be allocated, in which case the next wave function tries
+again.
+
+The limit on the pulses in a single waveform (PI_WAVE_MAX_PULSES) is
+not changed.  Only wave ids below 255 may be used in
+[*gpioWaveChain*].
+D*/
+
+
 /*F*/
 int gpioCfgNetAddr(int numSockAddr, uint32_t *sockAddr);
 /*D
@@ -5295,6 +6854,9 @@ The number of microseconds level changes are reported for once
 a noise filter has been triggered (by [*steady*] microseconds of
 a stable level).
 
+acq_id::
+An acquisition id as returned by [*acqStart*].
+
 arg1::
 
 An unsigned argument passed to a user customised function.  Its
@@ -5351,6 +6913,10 @@ typedef struct
 
 A buffer to hold data being sent or being received.
 
+**buf::
+
+Set to point to data held by the library.
+
 bufSize::
 
 The size in bytes of a buffer.
@@ -5410,7 +6976,10 @@ PI_HW_CLK_MAX_FREQ_2711 375000000
 
 count::
 The number of bytes to be transferred in an I2C, SPI, or Serial
-command.
+command, or the number of wave slot pulses to change.
+
+*cpuBytes::
+Where to store the number of bytes copied by the SPI simulator.
 
 CS::
 The GPIO used for the slave select signal when bit banging SPI.
@@ -5425,12 +6994,19 @@ PI_MIN_WAVE_DATABITS 1
 PI_MAX_WAVE_DATABITS 32
 . .
 
+*dmaBytes::
+Where to store the number of bytes moved by simulated SPI DMA.
+
 DMAchannel::0-15
 . .
 PI_MIN_DMA_CHANNEL 0
 PI_MAX_DMA_CHANNEL 15
 . .
 
+delay::0-3600000000
+
+The number of microseconds before a timer first expires.
+
 double::
 
 A floating point number.
@@ -5452,6 +7028,9 @@ FALLING_EDGE 1
 EITHER_EDGE 2
 . .
 
+enable::0-1
+A value used to turn a feature on (1) or off (0).
+
 event::0-31
 An event is a signal used to inform one or more consumers
 to start an action.
@@ -5471,14 +7050,23 @@ f::
 
 A function.
 
+*freq::
+A pointer to a uint32_t to store a frequency in Hz.
+
 *file::
 A full file path.  To be accessible the path must match an entry in
 /opt/pigpio/access.
 
+first::
+The first pulse of a wave slot to change.
+
 *fpat::
 A file path which may contain wildcards.  To be accessible the path
 must match an entry in /opt/pigpio/access.
 
+*framingErrs::
+The number of framing errors seen by bit bang serial reads.
+
 frequency::>=0
 
 The number of times a GPIO is swiched on and off per second.  This
@@ -5574,6 +7162,16 @@ typedef struct
 } gpioPulse_t;
 . .
 
+gpioPulseTrain_t::
+. .
+typedef struct
+{
+   uint32_t offset;
+   uint32_t numPulses;
+   gpioPulse_t *pulses;
+} gpioPulseTrain_t;
+. .
+
 gpioSample_t::
 . .
 typedef struct
@@ -5583,6 +7181,35 @@ typedef struct
 } gpioSample_t;
 . .
 
+gpioScriptProf_t::
+. .
+typedef struct
+{
+   uint32_t cmd;    // script step command
+   uint32_t p1;     // first parameter
+   uint32_t p2;     // second parameter
+   uint8_t  opt1;   // p1 is 0 none, 1 a number, 2 a var, 3 a par
+   uint8_t  opt2;   // p2 is 0 none, 1 a number, 2 a var, 3 a par
+   uint16_t pad;
+   uint32_t count;  // times the step was executed
+   uint32_t micros; // time spent blocked in the step
+} gpioScriptProf_t;
+. .
+
+gpioSerialLane_t::
+. .
+typedef struct
+{
+   uint32_t gpio;
+   uint32_t baud;
+   uint32_t data_bits;
+   uint32_t stop_bits;
+   uint32_t offset;
+   uint32_t numBytes;
+   char    *str;
+} gpioSerialLane_t;
+. .
+
 gpioSignalFunc_t::
 . .
 typedef void (*gpioSignalFunc_t) (int signum);
@@ -5615,6 +7242,7 @@ One of
 [*gpioWaveAddNew*] 
 [*gpioWaveAddGeneric*] 
 [*gpioWaveAddSerial*]
+[*gpioWaveAddTrains*]
 
 handle::>=0
 
@@ -5622,6 +7250,7 @@ A number referencing an object opened by one of
 
 [*fileOpen*] 
 [*gpioNotifyOpen*] 
+[*gpioTimerStart*] 
 [*i2cOpen*] 
 [*serOpen*] 
 [*spiOpen*]
@@ -5641,10 +7270,13 @@ i2cReg:: 0-255
 
 A register of an I2C device.
 
-ifFlags::0-3
+ifFlags::0-31
 . .
-PI_DISABLE_FIFO_IF 1
-PI_DISABLE_SOCK_IF 2
+PI_DISABLE_FIFO_IF    1
+PI_DISABLE_SOCK_IF    2
+PI_LOCALHOST_SOCK_IF  4
+PI_DISABLE_ALERT      8
+PI_ENABLE_BIN_FIFO_IF 16
 . .
 
 *inBuf::
@@ -5662,6 +7294,9 @@ A 32-bit signed value.
 invert::
 A flag used to set normal or inverted bit bang serial data level logic.
 
+len:: 1-32
+The number of bytes in a sensor sample.
+
 level::
 The level of a GPIO.  Low or High.
 
@@ -5684,6 +7319,9 @@ PI_TIMEOUT 2
 . .
 
 
+*lanes::
+An array of serial lanes to be added to a waveform.
+
 lVal::0-4294967295 (Hex 0x0-0xFFFFFFFF, Octal 0-37777777777)
 
 A 32-bit word value.
@@ -5702,6 +7340,12 @@ PI_MEM_ALLOC_MAILBOX 2
 
 A value representing microseconds.
 
+minBytes:: 0-65536
+The smallest main SPI transfer sent by DMA, 0 for none.
+
+The number of buffered serial bytes which make the data ready
+(see [*serReadBuffer*]).
+
 micros::
 
 A value representing microseconds.
@@ -5713,6 +7357,10 @@ A value representing milliseconds.
 MISO::
 The GPIO used for the MISO signal when bit banging SPI.
 
+MISOBits::
+A bit mask of the GPIO used for the MISO signals of the lanes when
+bit banging parallel SPI.
+
 mode::
 
 1. The operational mode of a GPIO, normally INPUT or OUTPUT.
@@ -5747,6 +7395,10 @@ PI_FILE_TRUNC  16
 MOSI::
 The GPIO used for the MOSI signal when bit banging SPI.
 
+MOSIBits::
+A bit mask of the GPIO used for the MOSI signals of the lanes when
+bit banging parallel SPI.
+
 numBits::
 
 The number of bits stored in a buffer.
@@ -5756,14 +7408,26 @@ The number of bytes used to store characters in a string.  Depending
 on the number of bits per character there may be 1, 2, or 4 bytes
 per character.
 
+numLanes::
+The number of serial lanes to be added to a waveform.
+
+numOps::
+The number of I2C operations in a batch.
+
 numPar:: 0-10
 The number of parameters passed to a script.
 
 numPulses::
-The number of pulses to be added to a waveform.
+The number of pulses to be added to a waveform or the wave stream.
+
+numSegments::
+The number of segments in the wave stream's ring.
 
 numSegs::
-The number of segments in a combined I2C transaction.
+The number of segments in a combined I2C transaction or SPI message.
+
+numTrains::
+The number of pulse trains to be added to a waveform.
 
 numSockAddr::
 The number of network addresses allowed to use the socket interface.
@@ -5774,6 +7438,9 @@ offset::
 The associated data starts this number of microseconds from the start of
 the waveform.
 
+*ops::
+An array of I2C operations, see [*pi_i2c_op_t*].
+
 *outBuf::
 A buffer used to return data from a function.
 
@@ -5795,6 +7462,13 @@ high and low levels.
 *param::
 An array of script parameters.
 
+parity:: 0-2
+The parity of bit bang serial reads, PI_BB_SER_PARITY_NONE,
+PI_BB_SER_PARITY_ODD, or PI_BB_SER_PARITY_EVEN.
+
+*parityErrs::
+The number of parity errors seen by bit bang serial reads.
+
 pctBOOL:: 0-100
 percent On-Off-Level (OOL) buffer to consume for wave output.
 
@@ -5815,6 +7489,40 @@ typedef struct
 } pi_i2c_msg_t;
 . .
 
+pi_i2c_op_t::
+. .
+typedef struct
+{
+   uint16_t handle; // from i2cOpen
+   uint8_t  flags;  // PI_I2C_OP_READ, _REG
+   uint8_t  reg;    // register if PI_I2C_OP_REG
+   uint16_t len;    // bytes to read or write
+   char     *buf;   // data read or to write
+   int      status; // bytes transferred or error
+} pi_i2c_op_t;
+. .
+
+pi_spi_seg_t::
+. .
+typedef struct
+{
+   char    *txBuf;    // bytes to send, NULL sends zeros
+   char    *rxBuf;    // bytes received, may be NULL
+   uint32_t len;      // bytes to transfer
+   uint16_t usDelay;  // micros to wait after the segment
+   uint8_t  csChange; // 1 deselects the device after the segment
+   uint8_t  pad;
+} pi_spi_seg_t;
+. .
+
+period::0, 100-3600000000
+
+The number of microseconds between the expiries of a periodic timer,
+0 for a one-shot timer.
+
+PI_MIN_TIMER_PERIOD 100
+PI_MAX_TIMER_MICROS 3600000000
+
 port:: 1024-32000
 The port used to bind to the pigpio socket.  Defaults to 8888.
 
@@ -5825,6 +7533,9 @@ primaryChannel:: 0-15
 The DMA channel used to time the sampling of GPIO and to time servo and
 PWM pulses.
 
+*prof::
+An array of [*gpioScriptProf_t*] to receive a script's execution profile.
+
 *pth::
 
 A thread identifier, returned by [*gpioStartThread*].
@@ -5848,10 +7559,26 @@ pulseLen::
 
 1-100, the length of a trigger pulse in microseconds.
 
+maxDelay::
+The longest delay in microseconds a wave slot or wave stream pulse
+may be given.
+
+maxMicros::
+The most microseconds to simulate.
+
+maxPulses::
+The size of an array of pulses.
+
+maxWaves::1-2500
+The number of waveforms which may exist at once.
+
 *pulses::
 
 An array of pulses to be added to a waveform.
 
+*queued::
+The number of pulses written to the wave stream but not yet sent.
+
 pulsewidth::0, 500-2500
 . .
 PI_SERVO_OFF 0
@@ -5936,6 +7663,9 @@ typedef struct
 } rawWaveInfo_t;
 . .
 
+reg:: 0-255
+The register to read, or for SPI the first byte to send.
+
 *retBuf::
 
 A buffer to hold a number of bytes returned to a used customised function,
@@ -5944,6 +7674,9 @@ retMax::
 
 The maximum number of bytes a user customised function should return.
 
+rxChannel:: 0-14
+The DMA channel which moves received bytes from the SPI FIFO.
+
 *rxBuf::
 
 A pointer to a buffer to receive data.
@@ -5957,6 +7690,9 @@ The GPIO used for the SCLK signal when bit banging SPI.
 *script::
 A pointer to the text of a script.
 
+slot_id::
+A wave slot id as returned by [*gpioWaveSlotCreate*].
+
 script_id::
 An id of a stored script as returned by [*gpioStoreScript*].
 
@@ -5970,6 +7706,9 @@ The string to be passed to a [*shell*] script to be executed.
 SDA::
 The user GPIO to use for data when bit banging I2C.
 
+segPulses::
+The number of pulses a wave stream segment holds.
+
 secondaryChannel:: 0-6
 
 The DMA channel used to time output waveforms.
@@ -5995,11 +7734,17 @@ The number of bytes to move forward (positive) or backwards (negative)
 from the seek position (start, current, or end of file).
 
 *segs::
-An array of segments which make up a combined I2C transaction.
+An array of segments which make up a combined I2C transaction or SPI
+message.
 
 serFlags::
 Flags which modify a serial open command.  None are currently defined.
 
+serReadyFunc_t::
+. .
+typedef void (*serReadyFunc_t) (int handle, int count, void *userdata);
+. .
+
 *sertty::
 The name of a serial tty device, e.g. /dev/ttyAMA0, /dev/ttyUSB0, /dev/tty1.
 
@@ -6012,6 +7757,9 @@ PI_MIN_SIGNUM 0
 PI_MAX_SIGNUM 63
 . .
 
+start::
+The first item to be returned.
+
 size_t::
 
 A standard type used to indicate the size of an object in bytes.
@@ -6065,9 +7813,24 @@ PI_MAX_WAVE_HALFSTOPBITS 8
 *str::
 An array of characters.
 
+*stretches::
+A pointer to a uint32_t to store a count of clock stretches.
+
+terminator:: 0-255, PI_BB_SER_ANY
+The character which ends a wait for bit bang serial data, or
+PI_BB_SER_ANY to end the wait as soon as there is any data.
+
+For [*serReadBuffer*] the character which makes buffered serial
+data ready, or PI_SER_NO_TERMINATOR for none.
+
 timeout::
 A GPIO level change timeout in milliseconds.
 
+[*gpioSerialReadWait*]
+. .
+the longest wait for data in milliseconds
+. .
+
 [*gpioSetWatchdog*]
 . .
 PI_MIN_WDOG_TIMEOUT 0
@@ -6086,16 +7849,30 @@ PI_MIN_TIMER 0
 PI_MAX_TIMER 9
 . .
 
+*trains::
+
+An array of pulse trains to be added to a waveform.
+
+vcdFd::
+A file descriptor to which a VCD format timeline is written, or -1
+for none.
+
 timetype::
 . .
 PI_TIME_RELATIVE 0
 PI_TIME_ABSOLUTE 1
 . .
 
+txChannel:: 0-14
+The DMA channel which moves bytes to be sent into the SPI FIFO.
+
 *txBuf::
 
 An array of bytes to transmit.
 
+type:: 0-1
+The kind of sensor interface, PI_ACQ_I2C or PI_ACQ_SPI.
+
 uint32_t::0-0-4,294,967,295 (Hex 0x0-0xFFFFFFFF)
 
 A 32-bit unsigned value.
@@ -6104,6 +7881,9 @@ uint64_t::0-(2^64)-1
 
 A 64-bit unsigned value.
 
+*underruns::
+The number of times the wave stream ran out of pulses.
+
 unsigned::
 
 A whole number >= 0.
@@ -6154,6 +7934,9 @@ wave_id::
 
 A number identifying a waveform created by [*gpioWaveCreate*].
 
+waveBlocks::0-40
+The number of blocks of DMA memory used for waveforms.
+
 wave_mode::
 
 The mode determines if the waveform is sent once or cycles
@@ -6317,6 +8100,21 @@ PARAMS*/
 #define PI_CMD_PROCU 117
 #define PI_CMD_WVCAP 118
 
+#define PI_CMD_PROFS 119
+#define PI_CMD_PROFR 120
+#define PI_CMD_WVCMP 121
+#define PI_CMD_SLRM  122
+
+#define PI_CMD_I2CBQ 123
+#define PI_CMD_I2CBR 124
+
+#define PI_CMD_ACQS  125
+#define PI_CMD_ACQP  126
+#define PI_CMD_ACQR  127
+#define PI_CMD_ACQM  128
+#define PI_CMD_SERB  129
+#define PI_CMD_BSPIL 130
+
 /*DEF_E*/
 
 /*
@@ -6528,6 +8326,19 @@ after this command is issued.
 #define PI_CMD_INTERRUPTED -144 // Used by Python
 #define PI_NOT_ON_BCM2711  -145 // not available on BCM2711
 #define PI_ONLY_ON_BCM2711 -146 // only available on BCM2711
+#define PI_NO_SCRIPT_PROF  -147 // script profiling never turned on
+#define PI_CHAIN_IN_USE    -148 // can't compact while a chain is transmitted
+#define PI_WAVE_SIM_FAULT  -149 // bad address or endless loop in simulated DMA
+#define PI_SLOT_BUSY       -150 // wave slot copy still being transmitted
+#define PI_BAD_SLOT_DELAY  -151 // delay needs more CBs than the slot reserved
+#define PI_NO_WAVE_STREAM  -152 // wave stream not open
+#define PI_BAD_WAVE_MEMORY -153 // bad wave blocks or number of waves
+#define PI_NO_WAVE_MEMORY  -154 // wave memory not configured or unavailable
+#define PI_BAD_SER_PARITY  -155 // bit bang serial parity not 0, 1, or 2
+#define PI_BAD_TIMER_MICROS -156 // timer delay or period out of range
+#define PI_I2C_PENDING     -157 // queued I2C batch has not completed
+#define PI_BAD_SPI_DMA     -158 // bad SPI DMA channels or threshold
+#define PI_SER_BUF_FAILED  -159 // can't start buffered serial reads
 
 #define PI_PIGIF_ERR_0    -2000
 #define PI_PIGIF_ERR_99   -2099
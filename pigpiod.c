@@ -60,6 +60,11 @@ static unsigned DMAprimaryChannel      = PI_DEFAULT_DMA_NOT_SET;
 static unsigned DMAsecondaryChannel    = PI_DEFAULT_DMA_NOT_SET;
 static unsigned socketPort             = PI_DEFAULT_SOCKET_PORT;
 static unsigned memAllocMode           = PI_DEFAULT_MEM_ALLOC_MODE;
+static unsigned waveBlocks             = PI_WAVE_BLOCKS;
+static unsigned maxWaves               = PI_MAX_WAVES;
+static unsigned spiDMATx               = 0;
+static unsigned spiDMARx               = 0;
+static unsigned spiDMABytes            = 0;
 static uint64_t updateMask             = -1;
 
 static uint32_t cfgInternals           = PI_DEFAULT_CFG_INTERNALS;
@@ -97,6 +102,7 @@ void usage()
       "   -b value,   sample buffer size in ms,          default 120\n" \
       "   -c value,   library internal settings,         default 0\n" \
       "   -d value,   primary DMA channel, 0-14,         default 14\n" \
+      "   -D tx,rx,n, SPI DMA channels and min bytes,    default off\n" \
       "   -e value,   secondary DMA channel, 0-14,       default 6\n" \
       "   -f,         disable fifo interface,            default enabled\n" \
       "   -g,         run in foreground (do not fork),   default disabled\n" \
@@ -108,7 +114,10 @@ void usage()
       "   -s value,   sample rate, 1, 2, 4, 5, 8, or 10, default 5\n" \
       "   -t value,   clock peripheral, 0=PWM 1=PCM,     default PCM\n" \
       "   -v, -V,     display pigpio version and exit\n" \
+      "   -w value,   wave memory blocks, 0-40,          default 4\n" \
+      "   -W value,   most waves at once, 1-2500,        default 250\n" \
       "   -x mask,    GPIO which may be updated,         default board GPIO\n" \
+      "   -y,         enable binary fifo interface,      default disabled\n" \
       "EXAMPLE\n" \
       "sudo pigpiod -s 2 -b 200 -f\n" \
       "  Set a sample rate of 2 microseconds with a 200 millisecond\n" \
@@ -163,7 +172,7 @@ static void initOpts(int argc, char *argv[])
    uint32_t addr;
    int64_t mask;
 
-   while ((opt = getopt(argc, argv, "a:b:c:d:e:fgkln:mp:s:t:x:vV")) != -1)
+   while ((opt = getopt(argc, argv, "a:b:c:d:D:e:fgkln:mp:s:t:w:W:x:vVy")) != -1)
    {
       switch (opt)
       {
@@ -195,6 +204,16 @@ static void initOpts(int argc, char *argv[])
             else fatal("invalid -d option (%d)", i);
             break;
 
+         case 'D':
+            if ((sscanf(optarg, "%u,%u,%u",
+                    &spiDMATx, &spiDMARx, &spiDMABytes) != 3) ||
+                (spiDMATx >= PI_MAX_DMA_CHANNEL) ||
+                (spiDMARx >= PI_MAX_DMA_CHANNEL) ||
+                (spiDMATx == spiDMARx) ||
+                (spiDMABytes > PI_MAX_SPI_DEVICE_COUNT))
+               fatal("invalid -D option (%s)", optarg);
+            break;
+
          case 'e':
             i = getNum(optarg, &err);
             if ((i >= PI_MIN_DMA_CHANNEL) && (i <= PI_MAX_DMA_CHANNEL))
@@ -222,6 +241,10 @@ static void initOpts(int argc, char *argv[])
             ifFlags |= PI_DISABLE_ALERT;
             break; 
 
+         case 'y':
+            ifFlags |= PI_ENABLE_BIN_FIFO_IF;
+            break; 
+
          case 'n':
             addr = checkAddr(optarg);
             if (addr && (numSockNetAddr<MAX_CONNECT_ADDRESSES))
@@ -269,6 +292,20 @@ static void initOpts(int argc, char *argv[])
             exit(EXIT_SUCCESS);
             break;
 
+         case 'w':
+            i = getNum(optarg, &err);
+            if ((i >= 0) && (i <= PI_MAX_WAVE_BLOCKS))
+               waveBlocks = i;
+            else fatal("invalid -w option (%d)", i);
+            break;
+
+         case 'W':
+            i = getNum(optarg, &err);
+            if ((i >= 1) && (i <= PI_MAX_WAVE_IDS))
+               maxWaves = i;
+            else fatal("invalid -W option (%d)", i);
+            break;
+
          case 'x':
             mask = getNum(optarg, &err);
             if (!err)
@@ -360,6 +397,10 @@ int main(int argc, char **argv)
 
    gpioCfgMemAlloc(memAllocMode);
 
+   gpioCfgWaveMemory(waveBlocks, maxWaves);
+
+   gpioCfgSPIDMA(spiDMATx, spiDMARx, spiDMABytes);
+
    if (updateMaskSet) gpioCfgPermissions(updateMask);
 
    gpioCfgNetAddr(numSockNetAddr, sockNetAddr);
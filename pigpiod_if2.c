@@ -96,6 +96,8 @@ static int             gPigHandle   [MAX_PI];
 static int             gPigNotify   [MAX_PI];
 
 static uint32_t        gEventBits   [MAX_PI];
+static uint32_t        gSerialBits  [MAX_PI];
+static uint32_t        gAcqBits     [MAX_PI];
 static uint32_t        gNotifyBits  [MAX_PI];
 static uint32_t        gLastLevel   [MAX_PI];
 
@@ -110,6 +112,14 @@ static callback_t *gCallBackLast  = 0;
 static evtCallback_t *geCallBackFirst = 0;
 static evtCallback_t *geCallBackLast  = 0;
 
+static serCBFunc_t gSerFunc[MAX_PI][PI_MAX_USER_GPIO+1];
+static void       *gSerUser[MAX_PI][PI_MAX_USER_GPIO+1];
+
+static acqCBFunc_t gAcqFunc[MAX_PI][PI_ACQ_SLOTS];
+static void       *gAcqUser[MAX_PI][PI_ACQ_SLOTS];
+static char        gAcqData[MAX_PI][PI_ACQ_SLOTS][PI_MAX_ACQ_LEN+4];
+static unsigned    gAcqLen [MAX_PI][PI_ACQ_SLOTS];
+
 /* PRIVATE ---------------------------------------------------------------- */
 
 static void _pml(int pi)
@@ -274,7 +284,8 @@ static void dispatch_notification(int pi, gpioReport_t *r)
    callback_t *p;
    evtCallback_t *ep;
    uint32_t changed;
-   int l, g;
+   int l, g, n;
+   char buf[4];
 
 /*
    printf("s=%4x f=%4x t=%10u l=%8x\n",
@@ -337,6 +348,39 @@ static void dispatch_notification(int pi, gpioReport_t *r)
             ep = ep->next;
          }
       }
+      else if ((r->flags) & PI_NTFY_FLAGS_SER)
+      {
+         g = (r->flags) & 31;
+         n = (((r->flags) >> 9) & 3) + 1;
+
+         if (gSerFunc[pi][g])
+         {
+            memcpy(buf, &r->level, n);
+            (gSerFunc[pi][g])(pi, g, buf, n, r->tick, gSerUser[pi][g]);
+         }
+      }
+      else if ((r->flags) & PI_NTFY_FLAGS_ACQ)
+      {
+         /* a sample may span several reports, the last is flagged */
+
+         g = (r->flags) & 31;
+         n = (((r->flags) >> 9) & 3) + 1;
+
+         if (gAcqLen[pi][g] <= PI_MAX_ACQ_LEN)
+         {
+            memcpy(gAcqData[pi][g] + gAcqLen[pi][g], &r->level, n);
+            gAcqLen[pi][g] += n;
+         }
+
+         if ((r->flags) & PI_NTFY_FLAGS_END)
+         {
+            if (gAcqFunc[pi][g])
+               (gAcqFunc[pi][g])(pi, g, gAcqData[pi][g], gAcqLen[pi][g],
+                  r->tick, gAcqUser[pi][g]);
+
+            gAcqLen[pi][g] = 0;
+         }
+      }
    }
 }
 
@@ -959,6 +1003,9 @@ int wave_create_and_pad(int pi, int percent)
 int wave_delete(int pi, unsigned wave_id)
    {return pigpio_command(pi, PI_CMD_WVDEL, wave_id, 0, 1);}
 
+int wave_compact(int pi)
+   {return pigpio_command(pi, PI_CMD_WVCMP, 0, 0, 1);}
+
 int wave_tx_start(int pi) /* DEPRECATED */
    {return pigpio_command(pi, PI_CMD_WVGO, 0, 0, 1);}
 
@@ -1197,6 +1244,38 @@ int bb_serial_read_close(int pi, unsigned user_gpio)
 int bb_serial_invert(int pi, unsigned user_gpio, unsigned invert)
    {return pigpio_command(pi, PI_CMD_SLRI, user_gpio, invert, 1);}
 
+int bb_serial_read_callback(
+   int pi, unsigned user_gpio, serCBFunc_t f, void *userdata)
+{
+   if ((pi < 0) || (pi >= MAX_PI) || !gPiInUse[pi])
+      return pigif_unconnected_pi;
+
+   if (user_gpio > PI_MAX_USER_GPIO) return PI_BAD_USER_GPIO;
+
+   if (!f) return pigif_bad_callback;
+
+   gSerUser[pi][user_gpio] = userdata;
+   gSerFunc[pi][user_gpio] = f;
+
+   gSerialBits[pi] |= (1<<user_gpio);
+
+   return pigpio_command(pi, PI_CMD_SLRM, gPigHandle[pi], gSerialBits[pi], 1);
+}
+
+int bb_serial_read_callback_cancel(int pi, unsigned user_gpio)
+{
+   if ((pi < 0) || (pi >= MAX_PI) || !gPiInUse[pi])
+      return pigif_unconnected_pi;
+
+   if (user_gpio > PI_MAX_USER_GPIO) return PI_BAD_USER_GPIO;
+
+   gSerialBits[pi] &= ~(1<<user_gpio);
+
+   gSerFunc[pi][user_gpio] = NULL;
+
+   return pigpio_command(pi, PI_CMD_SLRM, gPigHandle[pi], gSerialBits[pi], 1);
+}
+
 int i2c_open(int pi, unsigned i2c_bus, unsigned i2c_addr, uint32_t i2c_flags)
 {
    gpioExtent_t ext[1];
@@ -1478,6 +1557,117 @@ int i2c_zip(
    return bytes;
 }
 
+int i2c_batch_start(
+   int pi, unsigned numOps, pi_i2c_op_t *ops,
+   unsigned priority, unsigned event)
+{
+   int i, len, pos, bytes;
+   char *buf;
+   gpioExtent_t ext[1];
+
+   /*
+   p1=priority
+   p2=event
+   p3=len
+   ## extension ##
+   per operation handle(2) flags reg len(2) [write data]
+   */
+
+   if (!ops || !numOps) return PI_BAD_POINTER;
+
+   len = 0;
+
+   for (i=0; i<numOps; i++)
+   {
+      len += 6;
+      if (!(ops[i].flags & PI_I2C_OP_READ)) len += ops[i].len;
+   }
+
+   buf = malloc(len);
+
+   if (!buf) return PI_NO_MEMORY;
+
+   for (i=0, pos=0; i<numOps; i++)
+   {
+      buf[pos++] = ops[i].handle & 0xFF;
+      buf[pos++] = ops[i].handle >> 8;
+      buf[pos++] = ops[i].flags;
+      buf[pos++] = ops[i].reg;
+      buf[pos++] = ops[i].len & 0xFF;
+      buf[pos++] = ops[i].len >> 8;
+
+      if (!(ops[i].flags & PI_I2C_OP_READ))
+      {
+         memcpy(buf+pos, ops[i].buf, ops[i].len);
+         pos += ops[i].len;
+      }
+   }
+
+   ext[0].size = len;
+   ext[0].ptr = buf;
+
+   bytes = pigpio_command_ext
+      (pi, PI_CMD_I2CBQ, priority, event, len, 1, ext, 1);
+
+   free(buf);
+
+   return bytes;
+}
+
+int i2c_batch_result(
+   int pi, unsigned id, unsigned timeout,
+   unsigned numOps, pi_i2c_op_t *ops)
+{
+   int i, bytes, pos, status, good;
+   char *buf;
+
+   if (!ops || !numOps) return PI_BAD_POINTER;
+
+   bytes = pigpio_command(pi, PI_CMD_I2CBR, id, timeout, 0);
+
+   if (bytes <= 0)
+   {
+      _pmu(pi);
+      return bytes;
+   }
+
+   buf = malloc(bytes);
+
+   if (!buf)
+   {
+      recvMax(pi, NULL, 0, bytes);
+      _pmu(pi);
+      return PI_NO_MEMORY;
+   }
+
+   bytes = recvMax(pi, buf, bytes, bytes);
+
+   _pmu(pi);
+
+   good = 0;
+
+   for (i=0, pos=0; (i<numOps) && ((pos+4)<=bytes); i++)
+   {
+      memcpy(&status, buf+pos, 4);
+      pos += 4;
+
+      ops[i].status = status;
+
+      if ((ops[i].flags & PI_I2C_OP_READ) && (status > 0))
+      {
+         if ((pos + status) > bytes) break;
+         memcpy(ops[i].buf, buf+pos, status);
+         pos += status;
+      }
+
+      if (status >= 0) good++;
+   }
+
+   free(buf);
+
+   return good;
+}
+
 int bb_i2c_open(int pi, unsigned SDA, unsigned SCL, unsigned baud)
 {
    gpioExtent_t ext[1];
@@ -1568,6 +1758,39 @@ int bb_spi_open(
       (pi, PI_CMD_BSPIO, CS, 0, 20, 1, ext, 1);
 }
 
+int bb_spi_open_lanes(
+   int pi,
+   unsigned CS, uint32_t MISOBits, uint32_t MOSIBits, unsigned SCLK,
+   unsigned baud, unsigned spiFlags)
+{
+   uint8_t buf[20];
+   gpioExtent_t ext[1];
+
+   /*
+   p1=CS
+   p2=0
+   p3=20
+   ## extension ##
+   uint32_t MISOBits
+   uint32_t MOSIBits
+   uint32_t SCLK
+   uint32_t baud
+   uint32_t spiFlags
+   */
+
+   ext[0].size = 20;
+   ext[0].ptr = &buf;
+
+   memcpy(buf +  0, &MISOBits, 4);
+   memcpy(buf +  4, &MOSIBits, 4);
+   memcpy(buf +  8, &SCLK, 4);
+   memcpy(buf + 12, &baud, 4);
+   memcpy(buf + 16, &spiFlags, 4);
+
+   return pigpio_command_ext
+      (pi, PI_CMD_BSPIL, CS, 0, 20, 1, ext, 1);
+}
+
 int bb_spi_close(int pi, unsigned CS)
    {return pigpio_command(pi, PI_CMD_BSPIC, CS, 0, 1);}
 
@@ -1692,6 +1915,85 @@ int spi_xfer(int pi, unsigned handle, char *txBuf, char *rxBuf, unsigned count)
    return bytes;
 }
 
+int acq_start(
+   int pi, unsigned type, unsigned handle, unsigned reg, unsigned len,
+   unsigned micros)
+{
+   uint32_t u[3];
+   gpioExtent_t ext[1];
+
+   /*
+   p1=type
+   p2=handle
+   p3=12
+   ## extension ##
+   uint32_t reg
+   uint32_t len
+   uint32_t micros
+   */
+
+   u[0] = reg;
+   u[1] = len;
+   u[2] = micros;
+
+   ext[0].size = sizeof(u);
+   ext[0].ptr = u;
+
+   return pigpio_command_ext
+      (pi, PI_CMD_ACQS, type, handle, sizeof(u), 1, ext, 1);
+}
+
+int acq_stop(int pi, unsigned acq_id)
+   {return pigpio_command(pi, PI_CMD_ACQP, acq_id, 0, 1);}
+
+int acq_read(int pi, unsigned acq_id, char *buf, unsigned bufSize)
+{
+   int bytes;
+
+   bytes = pigpio_command(pi, PI_CMD_ACQR, acq_id, bufSize, 0);
+
+   if (bytes > 0)
+   {
+      bytes = recvMax(pi, buf, bufSize, bytes);
+   }
+
+   _pmu(pi);
+
+   return bytes;
+}
+
+int acq_callback(int pi, unsigned acq_id, acqCBFunc_t f, void *userdata)
+{
+   if ((pi < 0) || (pi >= MAX_PI) || !gPiInUse[pi])
+      return pigif_unconnected_pi;
+
+   if (acq_id >= PI_ACQ_SLOTS) return PI_BAD_HANDLE;
+
+   if (!f) return pigif_bad_callback;
+
+   gAcqUser[pi][acq_id] = userdata;
+   gAcqFunc[pi][acq_id] = f;
+   gAcqLen [pi][acq_id] = 0;
+
+   gAcqBits[pi] |= (1<<acq_id);
+
+   return pigpio_command(pi, PI_CMD_ACQM, gPigHandle[pi], gAcqBits[pi], 1);
+}
+
+int acq_callback_cancel(int pi, unsigned acq_id)
+{
+   if ((pi < 0) || (pi >= MAX_PI) || !gPiInUse[pi])
+      return pigif_unconnected_pi;
+
+   if (acq_id >= PI_ACQ_SLOTS) return PI_BAD_HANDLE;
+
+   gAcqBits[pi] &= ~(1<<acq_id);
+
+   gAcqFunc[pi][acq_id] = NULL;
+
+   return pigpio_command(pi, PI_CMD_ACQM, gPigHandle[pi], gAcqBits[pi], 1);
+}
+
 int serial_open(int pi, char *dev, unsigned baud, unsigned flags)
 {
    int len;
@@ -1762,6 +2064,34 @@ int serial_read(int pi, unsigned handle, char *buf, unsigned count)
 int serial_data_available(int pi, unsigned handle)
    {return pigpio_command(pi, PI_CMD_SERDA, handle, 0, 1);}
 
+int serial_read_buffer(
+   int pi, unsigned handle, unsigned bufSize, unsigned minBytes,
+   unsigned terminator, unsigned event)
+{
+   gpioExtent_t ext[1];
+   uint32_t u[3];
+
+   /*
+   p1=handle
+   p2=bufSize
+   p3=12
+   ## extension ##
+   uint32_t minBytes
+   uint32_t terminator
+   uint32_t event
+   */
+
+   u[0] = minBytes;
+   u[1] = terminator;
+   u[2] = event;
+
+   ext[0].size = sizeof(u);
+   ext[0].ptr = u;
+
+   return pigpio_command_ext
+      (pi, PI_CMD_SERB, handle, bufSize, sizeof(u), 1, ext, 1);
+}
+
 int custom_1(int pi, unsigned arg1, unsigned arg2, char *argx, unsigned count)
 {
    gpioExtent_t ext[1];
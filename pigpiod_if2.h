@@ -231,6 +231,9 @@ i2c_block_process_call     smbus block process call
 
 i2c_zip                    Performs multiple I2C transactions
 
+i2c_batch_start            Queues a batch of I2C operations
+i2c_batch_result           Gets the result of a queued I2C batch
+
 I2C_BIT_BANG
 
 bb_i2c_open                Opens GPIO for bit banging I2C
@@ -256,6 +259,8 @@ serial_write               Writes bytes to a serial device
 
 serial_data_available      Returns number of bytes ready to be read
 
+serial_read_buffer         Buffers serial reads in the daemon
+
 SERIAL_BIT_BANG_(read_only)
 
 bb_serial_read_open        Opens a GPIO for bit bang serial reads
@@ -265,6 +270,9 @@ bb_serial_invert           Invert serial logic (1 invert, 0 normal)
 
 bb_serial_read             Reads bit bang serial data from a GPIO
 
+bb_serial_read_callback    Streams bit bang serial data to a callback
+bb_serial_read_callback_cancel Stops streaming bit bang serial data
+
 SPI
 
 spi_open                   Opens a SPI device
@@ -277,10 +285,21 @@ spi_xfer                   Transfers bytes with a SPI device
 SPI_BIT_BANG
 
 bb_spi_open                Opens GPIO for bit banging SPI
+bb_spi_open_lanes          Opens GPIO for parallel bit banging SPI
 bb_spi_close               Closes GPIO for bit banging SPI
 
 bb_spi_xfer                Transfers bytes with bit banging SPI
 
+SENSOR_ACQUISITION
+
+acq_start                  Starts periodic reads of a sensor register
+acq_stop                   Stops periodic reads of a sensor register
+
+acq_read                   Reads timestamped sensor samples
+
+acq_callback               Streams sensor samples to a callback
+acq_callback_cancel        Stops streaming sensor samples
+
 FILES
 
 file_open                  Opens a file
@@ -304,6 +323,7 @@ wave_add_serial            Adds serial data to the waveform
 wave_create                Creates a waveform from added data
 wave_create_and_pad        Creates a waveform of fixed size from added data
 wave_delete                Deletes one or more waveforms
+wave_compact               Defragments the waveform memory
 
 wave_send_once             Transmits a waveform once
 wave_send_repeat           Transmits a waveform repeatedly
@@ -364,6 +384,14 @@ typedef void (*evtCBFuncEx_t)
 
 typedef struct evtCallback_s evtCallback_t;
 
+typedef void (*serCBFunc_t)
+   (int pi, unsigned user_gpio, char *buf, unsigned count, uint32_t tick,
+    void *userdata);
+
+typedef void (*acqCBFunc_t)
+   (int pi, unsigned acq_id, char *buf, unsigned count, uint32_t tick,
+    void *userdata);
+
 /*F*/
 double time_time(void);
 /*D
@@ -1429,16 +1457,28 @@ wave_id: >=0, as returned by [*wave_create*].
 
 Wave ids are allocated in order, 0, 1, 2, etc.
 
-The wave is flagged for deletion.  The resources used by the wave
-will only be reused when either of the following apply.
+The resources used by the wave are freed at once and merged with
+any neighbouring free space.  New waves are placed in the smallest
+free space which will hold them.
+
+Returns 0 if OK, otherwise PI_BAD_WAVE_ID.
+D*/
+
 
-- all waves with higher numbered wave ids have been deleted or have
-been flagged for deletion.
+/*F*/
+int wave_compact(int pi);
+/*D
+This function moves the waves down so that the free DMA control
+blocks and OOL space each become one contiguous block.
 
-- a new wave is created which uses exactly the same resources as
-the current wave (see the C source for gpioWaveCreate for details).
+. .
+pi: >=0 (as returned by [*pigpio_start*]).
+. .
 
-Returns 0 if OK, otherwise PI_BAD_WAVE_ID.
+Wave ids are unchanged.  The wave being transmitted and any wave
+queued to follow it with a sync send are not moved.
+
+Returns the number of waves moved if OK, otherwise PI_CHAIN_IN_USE.
 D*/
 
 
@@ -1946,6 +1986,49 @@ user_gpio: 0-31, previously opened with [*bb_serial_read_open*].
 Returns 0 if OK, otherwise PI_NOT_SERIAL_GPIO or PI_BAD_SER_INVERT.
 D*/
 
+/*F*/
+int bb_serial_read_callback
+   (int pi, unsigned user_gpio, serCBFunc_t f, void *userdata);
+/*D
+This function streams the bit bang serial data received on a GPIO
+to a callback, rather than it being polled with [*bb_serial_read*].
+
+. .
+      pi: >=0 (as returned by [*pigpio_start*]).
+user_gpio: 0-31, previously opened with [*bb_serial_read_open*].
+       f: the callback function.
+userdata: a pointer to arbitrary user data.
+. .
+
+Returns 0 if OK, otherwise pigif_unconnected_pi, PI_BAD_USER_GPIO,
+pigif_bad_callback, or PI_BAD_HANDLE.
+
+The data is sent on the notification socket as it arrives.  The
+callback is called from the notification thread with the GPIO, up to
+4 bytes of data, the tick when the data was sent, and the userdata
+pointer.
+
+Data streamed to the callback is not returned by [*bb_serial_read*].
+A later call for the same GPIO replaces the callback.
+D*/
+
+/*F*/
+int bb_serial_read_callback_cancel(int pi, unsigned user_gpio);
+/*D
+This function stops streaming the bit bang serial data received on
+a GPIO.
+
+. .
+       pi: >=0 (as returned by [*pigpio_start*]).
+user_gpio: 0-31, previously opened with [*bb_serial_read_open*].
+. .
+
+Returns 0 if OK, otherwise pigif_unconnected_pi, PI_BAD_USER_GPIO,
+or PI_BAD_HANDLE.
+
+Later data is held for [*bb_serial_read*] again.
+D*/
+
 /*F*/
 int i2c_open(int pi, unsigned i2c_bus, unsigned i2c_addr, unsigned i2c_flags);
 /*D
@@ -2406,6 +2489,55 @@ End
 
 D*/
 
+/*F*/
+int i2c_batch_start(
+   int pi, unsigned numOps, pi_i2c_op_t *ops,
+   unsigned priority, unsigned event);
+/*D
+This function queues a batch of I2C operations (see [*i2cBatch*])
+on the daemon's worker thread for the bus and returns at once.
+
+. .
+      pi: >=0 (as returned by [*pigpio_start*]).
+  numOps: the number of operations
+     ops: an array of operations, all on the same I2C bus
+priority: 0-255, higher priority batches are performed first
+   event: 0-31, the event triggered on completion, >31 for none
+. .
+
+Returns a request id (>=0) if OK, otherwise PI_BAD_POINTER,
+PI_BAD_PARAM, PI_BAD_HANDLE, PI_BAD_I2C_RLEN, PI_NO_HANDLE, or
+PI_NO_MEMORY.
+
+Only the handle, flags, reg, and len of each operation and the
+data of each write are sent.  The result must be collected with
+[*i2c_batch_result*], typically from an [*event_callback*] for
+[*event*].  Only the connection which queued a batch may collect it.
+Batches not collected when the connection closes are freed.
+D*/
+
+/*F*/
+int i2c_batch_result(
+   int pi, unsigned id, unsigned timeout,
+   unsigned numOps, pi_i2c_op_t *ops);
+/*D
+This function waits for a batch queued by [*i2c_batch_start*] and
+copies the status of each operation and any data read into ops.
+
+. .
+     pi: >=0 (as returned by [*pigpio_start*]).
+     id: >=0, as returned by a call to [*i2c_batch_start*]
+timeout: the milliseconds to wait, 0 to return at once
+ numOps: the number of operations
+    ops: the array of operations passed to [*i2c_batch_start*]
+. .
+
+Returns the number of operations which succeeded, otherwise
+PI_I2C_PENDING, PI_BAD_HANDLE, PI_BAD_POINTER, or PI_BAD_I2C_RLEN.
+
+Once the result has been returned the request id is released.
+D*/
+
 /*F*/
 int bb_i2c_open(int pi, unsigned SDA, unsigned SCL, unsigned baud);
 /*D
@@ -2581,11 +2713,52 @@ bb_spi_open(pi,11, MISO, MOSI, SCLK, 20000, 3); // device 2
 ...
 D*/
 
+/*F*/
+int bb_spi_open_lanes(
+   int pi,
+   unsigned CS, uint32_t MISOBits, uint32_t MOSIBits, unsigned SCLK,
+   unsigned baud, unsigned spiFlags);
+/*D
+This function selects a set of GPIO for bit banging SPI to several
+identical devices at once.  The devices (lanes) share CS and SCLK
+and each has its own MISO and/or MOSI.
+
+. .
+      pi: >=0 (as returned by [*pigpio_start*]).
+      CS: 0-31
+MISOBits: a bit mask of the lane MISO GPIO (0-30), may be 0
+MOSIBits: a bit mask of the lane MOSI GPIO (0-30), may be 0
+    SCLK: 0-31
+    baud: 50-250000
+spiFlags: see [*bb_spi_open*]
+. .
+
+Returns 0 if OK, otherwise PI_BAD_USER_GPIO, PI_BAD_SPI_BAUD,
+PI_BAD_PARAM, or PI_GPIO_IN_USE.
+
+Lane n uses the nth lowest GPIO set in MISOBits and in MOSIBits.
+If both masks are given they must select the same number of GPIO.
+
+All the lanes are clocked together, one write of the GPIO set and
+clear registers driving SCLK and every MOSI, and one read of the
+GPIO level register sampling every MISO.
+
+Transfers are made with [*bb_spi_xfer*], with the lanes' bytes
+interleaved (byte b of lane l at index b*lanes+l), and the GPIO are
+released with [*bb_spi_close*].
+
+...
+// four ADC boards on MISO 5, 6, 13, 19 and MOSI 20, 21, 22, 23
+
+bb_spi_open_lanes(pi, 8, 1<<5|1<<6|1<<13|1<<19, 0xF<<20, 11, 100000, 0);
+...
+D*/
+
 /*F*/
 int bb_spi_close(int pi, unsigned CS);
 /*D
 This function stops bit banging SPI on a set of GPIO
-opened with [*bbSPIOpen*].
+opened with [*bb_spi_open*] or [*bb_spi_open_lanes*].
 
 . .
 pi: >=0 (as returned by [*pigpio_start*]).
@@ -2614,7 +2787,11 @@ count: size of data transfer
 . .
 
 Returns >= 0 if OK (the number of bytes read), otherwise
-PI_BAD_USER_GPIO, PI_NOT_SPI_GPIO or PI_BAD_POINTER.
+PI_BAD_USER_GPIO, PI_NOT_SPI_GPIO, PI_BAD_POINTER, or
+PI_BAD_SPI_COUNT.
+
+For a CS opened with [*bb_spi_open_lanes*] count must be a multiple
+of the number of lanes.
 
 ...
 // gcc -Wall -pthread -o bb_spi_x_test bb_spi_x_test.c -lpigpiod_if2
@@ -2711,13 +2888,18 @@ spi_channel: 0-1 (0-2 for the auxiliary SPI).
 Returns a handle (>=0) if OK, otherwise PI_BAD_SPI_CHANNEL,
 PI_BAD_SPI_SPEED, PI_BAD_FLAGS, PI_NO_AUX_SPI, or PI_SPI_OPEN_FAILED.
 
-spi_flags consists of the least significant 22 bits.
+spi_flags consists of the least significant 23 bits.
 
 . .
-21 20 19 18 17 16 15 14 13 12 11 10  9  8  7  6  5  4  3  2  1  0
- b  b  b  b  b  b  R  T  n  n  n  n  W  A u2 u1 u0 p2 p1 p0  m  m
+22 21 20 19 18 17 16 15 14 13 12 11 10  9  8  7  6  5  4  3  2  1  0
+ K  b  b  b  b  b  b  R  T  n  n  n  n  W  A u2 u1 u0 p2 p1 p0  m  m
 . .
 
+K is 0 to drive the SPI registers directly (default) and 1 to use the
+kernel driver through /dev/spidevA.C (A as below, C the channel).
+The kernel driver must be loaded.  The mode, p, W, T, and b settings
+are passed to the driver, u and R are ignored.
+
 mm defines the SPI mode.
 
 Warning: modes 1 and 3 do not appear to work on the auxiliary SPI.
@@ -2840,6 +3022,101 @@ Returns the number of bytes transferred if OK, otherwise
 PI_BAD_HANDLE, PI_BAD_SPI_COUNT, or PI_SPI_XFER_FAILED.
 D*/
 
+/*F*/
+int acq_start(
+   int pi, unsigned type, unsigned handle, unsigned reg, unsigned len,
+   unsigned micros);
+/*D
+This function starts reading a sensor register at a fixed rate on
+the daemon.  See [*acqStart*].
+
+. .
+    pi: >=0 (as returned by [*pigpio_start*]).
+  type: PI_ACQ_I2C or PI_ACQ_SPI
+handle: >=0, as returned by a call to [*i2c_open*] or [*spi_open*]
+   reg: 0-255, the register (I2C) or first byte to send (SPI)
+   len: 1-32, the number of bytes in a sample
+micros: 100-3600000000, the sample period
+. .
+
+Returns an acquisition id (>=0) if OK, otherwise PI_BAD_PARAM,
+PI_BAD_HANDLE, PI_BAD_TIMER_MICROS, PI_NO_HANDLE, or PI_NO_MEMORY.
+
+The samples are kept by the daemon until fetched in bulk with
+[*acq_read*] or streamed with [*acq_callback*].
+D*/
+
+/*F*/
+int acq_stop(int pi, unsigned acq_id);
+/*D
+This function stops an acquisition started by [*acq_start*].
+
+. .
+    pi: >=0 (as returned by [*pigpio_start*]).
+acq_id: >=0, as returned by a call to [*acq_start*]
+. .
+
+Returns 0 if OK, otherwise PI_BAD_HANDLE.
+D*/
+
+/*F*/
+int acq_read(int pi, unsigned acq_id, char *buf, unsigned bufSize);
+/*D
+This function copies as many whole unread samples of an acquisition
+as fit into buf.
+
+. .
+     pi: >=0 (as returned by [*pigpio_start*]).
+ acq_id: >=0, as returned by a call to [*acq_start*]
+    buf: an array to receive the samples
+bufSize: >=0, the size of buf
+. .
+
+Returns the number of bytes copied if OK, otherwise PI_BAD_HANDLE.
+
+Each sample is the tick (4 bytes, least significant byte first)
+when it was taken followed by the len bytes read.
+D*/
+
+/*F*/
+int acq_callback(int pi, unsigned acq_id, acqCBFunc_t f, void *userdata);
+/*D
+This function streams the samples of an acquisition to a callback,
+rather than them being fetched with [*acq_read*].
+
+. .
+      pi: >=0 (as returned by [*pigpio_start*]).
+  acq_id: >=0, as returned by a call to [*acq_start*]
+       f: the callback function.
+userdata: a pointer to arbitrary user data.
+. .
+
+Returns 0 if OK, otherwise pigif_unconnected_pi, PI_BAD_HANDLE, or
+pigif_bad_callback.
+
+The samples are sent on the notification socket as they are taken.
+The callback is called from the notification thread with the
+acquisition id, the sample, the tick when it was taken, and the
+userdata pointer.
+
+A later call for the same acquisition replaces the callback.
+D*/
+
+/*F*/
+int acq_callback_cancel(int pi, unsigned acq_id);
+/*D
+This function stops streaming the samples of an acquisition.
+
+. .
+    pi: >=0 (as returned by [*pigpio_start*]).
+acq_id: >=0, as returned by a call to [*acq_start*]
+. .
+
+Returns 0 if OK, otherwise pigif_unconnected_pi or PI_BAD_HANDLE.
+
+Later samples are held for [*acq_read*] again.
+D*/
+
 /*F*/
 int serial_open(int pi, char *ser_tty, unsigned baud, unsigned ser_flags);
 /*D
@@ -2959,6 +3236,56 @@ Returns the number of bytes of data available (>=0) if OK,
 otherwise PI_BAD_HANDLE.
 D*/
 
+/*F*/
+int serial_read_buffer(
+   int pi, unsigned handle, unsigned bufSize, unsigned minBytes,
+   unsigned terminator, unsigned event);
+/*D
+This function starts (or stops) buffering the data received on the
+serial port associated with handle.
+
+. .
+        pi: >=0 (as returned by [*pigpio_start*]).
+    handle: >=0, as returned by a call to [*serial_open*].
+   bufSize: 0 (stop buffering), or 1-65536 (PI_SER_MAX_BUFFER).
+  minBytes: 1-bufSize, the bytes which make the data ready.
+terminator: 0-255, a byte which makes the data ready, or
+            PI_SER_NO_TERMINATOR.
+     event: 0-31, the event triggered when data is ready, or
+            PI_SER_NO_EVENT.
+. .
+
+Returns 0 if OK, otherwise PI_BAD_HANDLE, PI_BAD_PARAM, or
+PI_SER_BUF_FAILED.
+
+The daemon reads a buffered port in a background thread which
+waits for data, so the client need not poll with
+[*serial_data_available*] or [*serial_read*].
+
+The data is ready when at least minBytes are buffered, or when
+a received byte matches terminator.  Each time data is received
+while it is ready the event is triggered.  Use [*event_callback*]
+or [*wait_for_event*] to be told, then take everything buffered
+with one [*serial_read*] of at least bufSize bytes.
+
+If the buffer fills the oldest data is discarded.  A bufSize of 0
+stops buffering and discards any buffered data.
+
+...
+void gpsLine(int pi, unsigned event, uint32_t tick)
+{
+   char buf[4096];
+   int count;
+
+   count = serial_read(pi, gps, buf, sizeof(buf));
+   ...
+}
+
+serial_read_buffer(pi, gps, 4096, 4096, '\n', 4);
+event_callback(pi, 4, gpsLine);
+...
+D*/
+
 /*F*/
 int custom_1(int pi, unsigned arg1, unsigned arg2, char *argx, unsigned argc);
 /*D
@@ -3804,6 +4131,16 @@ arg2::
 An unsigned argument passed to a user customised function.  Its
 meaning is defined by the customiser.
 
+acq_id::
+An acquisition id as returned by [*acq_start*].
+
+acqCBFunc_t::
+. .
+typedef void (*acqCBFunc_t)
+   (int pi, unsigned acq_id, char *buf, unsigned count, uint32_t tick,
+    void *userdata);
+. .
+
 argc::
 The count of bytes passed to a user customised function.
 
@@ -4055,9 +4392,17 @@ reported as PI_TIMEOUT.  See [*set_watchdog*].
 PI_TIMEOUT 2
 . .
 
+minBytes::
+The number of buffered serial bytes which make the data ready
+(see [*serial_read_buffer*]).
+
 MISO::
 The GPIO used for the MISO signal when bit banging SPI.
 
+MISOBits::
+A bit mask of the GPIO used for the MISO signals of the lanes when
+bit banging parallel SPI.
+
 mode::
 1. The operational mode of a GPIO, normally INPUT or OUTPUT.
 
@@ -4100,6 +4445,10 @@ PI_FILE_TRUNC  16
 MOSI::
 The GPIO used for the MOSI signal when bit banging SPI.
 
+MOSIBits::
+A bit mask of the GPIO used for the MOSI signals of the lanes when
+bit banging parallel SPI.
+
 numBytes::
 The number of bytes used to store characters in a string.  Depending
 on the number of bits per character there may be 1, 2, or 4 bytes
@@ -4264,6 +4613,13 @@ A SPI channel, 0-2.
 spi_flags::
 See [*spi_open*] and [*bb_spi_open*].
 
+serCBFunc_t::
+. .
+typedef void (*serCBFunc_t)
+   (int pi, unsigned user_gpio, char *buf, unsigned count, uint32_t tick,
+    void *userdata);
+. .
+
 steady:: 0-300000
 
 The number of microseconds level changes must be stable for
@@ -4282,6 +4638,10 @@ to a waveform.
 *str::
  An array of characters.
 
+terminator::
+A byte which makes buffered serial data ready, or
+PI_SER_NO_TERMINATOR for none (see [*serial_read_buffer*]).
+
 thread_func::
 A function of type gpioThreadFunc_t used as the main function of a
 thread.
@@ -147,6 +147,40 @@ static int openSocket(void)
    return sock;
 }
 
+static void print_operand(int opt, uint32_t val)
+{
+   switch (opt)
+   {
+      case CMD_NUMERIC: printf(" %d", val); break;
+      case CMD_VAR:     printf(" v%d", val); break;
+      case CMD_PAR:     printf(" p%d", val); break;
+   }
+}
+
+static void print_profile(cmdCmd_t cmd)
+{
+   /* one line per script step, jump tags shown as step numbers */
+
+   int i, steps;
+   gpioScriptProf_t *prof;
+
+   steps = cmd.res / sizeof(gpioScriptProf_t);
+   prof = (gpioScriptProf_t *)response_buf;
+
+   printf("%5s %10s %10s  %s\n", "step", "count", "micros", "command");
+
+   for (i=0; i<steps; i++)
+   {
+      printf("%5d %10u %10u  %s",
+         cmd.p2 + i, prof[i].count, prof[i].micros, cmdName(prof[i].cmd));
+
+      print_operand(prof[i].opt1, prof[i].p1);
+      print_operand(prof[i].opt2, prof[i].p2);
+
+      printf("\n");
+   }
+}
+
 void print_result(int sock, int rv, cmdCmd_t cmd)
 {
    int i, r, ch;
@@ -183,8 +217,8 @@ void print_result(int sock, int rv, cmdCmd_t cmd)
          break;
 
       case 6: /*
-                 BI2CZ  CF2  FL  FR  I2CPK  I2CRD  I2CRI  I2CRK
-                 I2CZ  SERR  SLR  SPIX  SPIR
+                 ACQR  BI2CZ  CF2  FL  FR  I2CBR  I2CPK  I2CRD  I2CRI
+                 I2CRK  I2CZ  SERR  SLR  SPIX  SPIR
               */
          printf("%d", r);
          if (r < 0) report(PIGS_SCRIPT_ERR, "ERROR: %s", cmdErrStr(r));
@@ -263,6 +297,15 @@ void print_result(int sock, int rv, cmdCmd_t cmd)
          printf("\n");
          break;
 
+      case 9: /* PROFR */
+         if (r < 0)
+         {
+            printf("%d\n", r);
+            report(PIGS_SCRIPT_ERR, "ERROR: %s", cmdErrStr(r));
+         }
+         else print_profile(cmd);
+         break;
+
    }
 }
 
@@ -282,6 +325,7 @@ void get_extensions(int sock, int command, int res)
       case PI_CMD_I2CRK:
       case PI_CMD_I2CZ:
       case PI_CMD_PROCP:
+      case PI_CMD_PROFR:
       case PI_CMD_SERR:
       case PI_CMD_SLR:
       case PI_CMD_SPIX: